@@ -45,6 +45,8 @@
 #include "NVEncFilterAfs.h"
 #include "NVEncCmd.h"
 #include "NVEncCore.h"
+#include "rgy_chunk.h"
+#include "NVEncLadder.h"
 
 static void show_version() {
     _ftprintf(stdout, _T("%s"), GetNVEncVersion().c_str());
@@ -292,6 +294,25 @@ int _tmain(int argc, TCHAR **argv) {
 
     encPrm.encConfig.encodeCodecConfig = codecPrm[encPrm.codec];
 
+    if (encPrm.ctrl.chunkParallel > 1) {
+        //チャンク分割による並列エンコード (子プロセスで区間ごとにエンコードする)
+        //同時に実行するチャンクは、使用できるGPUのNVENCのセッション数までとする
+        int deviceCount = 1;
+        if (encPrm.deviceID < 0) {
+            if (CUDA_SUCCESS != cuInit(0) || CUDA_SUCCESS != cuDeviceGetCount(&deviceCount) || deviceCount <= 0) {
+                deviceCount = 1;
+            }
+        }
+        const auto codec = (encPrm.codec == NV_ENC_HEVC) ? RGY_CODEC_HEVC : RGY_CODEC_H264;
+        return rgy_chunk_run(argc, (const TCHAR **)argv, &encPrm.common, &encPrm.ctrl, codec, NVENC_MAX_SESSIONS_GEFORCE * deviceCount);
+    }
+
+    if (encPrm.ladder.size() > 0) {
+        //入力を1回だけデコードし、複数の解像度・ビットレートでエンコードする
+        set_signal_handler();
+        return nvenc_ladder_run(&encPrm, &g_signal_abort);
+    }
+
     int ret = 1;
 
     NVEncCore nvEnc;
@@ -191,6 +191,15 @@ tstring encoder_help() {
         _T("      max-bitrate=<int>\n")
         _T("      vbr-quality=<float>\n")
         _T("\n")
+        _T("   --ladder res=<int>x<int>,bitrate=<int>[,max-bitrate=<int>],output=<string>\n")
+        _T("     encode an additional rendition from the same decoded input\n")
+        _T("     could be set multiple times to build an ABR ladder\n")
+        _T("    params\n")
+        _T("      res=<int>x<int>            output resolution\n")
+        _T("      bitrate=<int>              target bitrate (kbps)\n")
+        _T("      max-bitrate=<int>          max bitrate (kbps)\n")
+        _T("      output=<string>            output file\n")
+        _T("\n")
         _T("   --qp-init <int> or           set initial QP\n")
         _T("             <int>:<int>:<int>    default: auto\n")
         _T("   --qp-max <int> or            set max QP\n")
@@ -531,6 +540,23 @@ tstring encoder_help() {
         _T("                                 default %d MB (0-%d)\n"),
         DEFAULT_OUTPUT_BUF, RGY_OUTPUT_BUF_MB_MAX
     );
+    str += strsprintf(_T("")
+        _T("   --output-sink <string>       method to write output file\n")
+        _T("                                 stdio  : buffered write by FILE* (default)\n")
+        _T("                                 async  : write on background threads\n")
+        _T("                                 direct : async + O_DIRECT (Linux only)\n"));
+    str += strsprintf(_T("")
+        _T("   --cmaf [<param1>=<value>][,<param2>=<value>][...]\n")
+        _T("     output fragmented mp4 (CMAF) segments cut at each IDR,\n")
+        _T("     <output>_init.mp4, <output>_%%05d.m4s and playlists.\n")
+        _T("    params\n")
+        _T("      chunk=<int>                write moof+mdat every <int> frames\n")
+        _T("                                  in a segment (default: 0 = off)\n")
+        _T("      window=<int>               segments kept in playlist (default: 0 = all)\n")
+        _T("      playlist=<string>          none, hls, dash, all (default: hls)\n")
+        _T("      url=<string>               send by http chunked transfer to\n")
+        _T("                                  http://host[:port][/path] instead of files\n")
+        _T("      method=<string>            post, put (default: post)\n"));
     str += gen_cmd_help_ctrl();
     return str;
 }
@@ -858,6 +884,74 @@ int parse_one_option(const TCHAR *option_name, const TCHAR* strInput[], int& i,
         pParams->dynamicRC.push_back(rcPrm);
         return 0;
     }
+    if (IS_OPTION("ladder")) {
+        if (i+1 >= nArgNum || strInput[i+1][0] == _T('-')) {
+            print_cmd_error_invalid_value(option_name, _T(""));
+            return 1;
+        }
+        i++;
+        const auto paramList = std::vector<std::string>{ "res", "bitrate", "max-bitrate", "output" };
+        LadderRendition rendition;
+        for (const auto &param : split(strInput[i], _T(","))) {
+            auto pos = param.find_first_of(_T("="));
+            if (pos == std::string::npos) {
+                print_cmd_error_unknown_opt_param(option_name, param, paramList);
+                return 1;
+            }
+            auto param_arg = param.substr(0, pos);
+            auto param_val = param.substr(pos+1);
+            param_arg = tolowercase(param_arg);
+            if (param_arg == _T("res")) {
+                int a[2] = { 0 };
+                if (   2 != _stscanf_s(param_val.c_str(), _T("%dx%d"), &a[0], &a[1])
+                    && 2 != _stscanf_s(param_val.c_str(), _T("%d:%d"), &a[0], &a[1])) {
+                    print_cmd_error_invalid_value(tstring(option_name) + _T(" ") + param_arg + _T("="), param_val);
+                    return 1;
+                }
+                rendition.width = a[0];
+                rendition.height = a[1];
+                continue;
+            }
+            if (param_arg == _T("bitrate")) {
+                try {
+                    rendition.avg_bitrate = std::stoi(param_val) * 1000;
+                } catch (...) {
+                    print_cmd_error_invalid_value(tstring(option_name) + _T(" ") + param_arg + _T("="), param_val);
+                    return 1;
+                }
+                continue;
+            }
+            if (param_arg == _T("max-bitrate")) {
+                try {
+                    rendition.max_bitrate = std::stoi(param_val) * 1000;
+                } catch (...) {
+                    print_cmd_error_invalid_value(tstring(option_name) + _T(" ") + param_arg + _T("="), param_val);
+                    return 1;
+                }
+                continue;
+            }
+            if (param_arg == _T("output")) {
+                rendition.output = param_val;
+                continue;
+            }
+            print_cmd_error_unknown_opt_param(option_name, param_arg, paramList);
+            return 1;
+        }
+        if (rendition.width <= 0 || rendition.height <= 0) {
+            print_cmd_error_invalid_value(option_name, strInput[i], _T("resolution unspecified!"));
+            return 1;
+        }
+        if (rendition.avg_bitrate <= 0) {
+            print_cmd_error_invalid_value(option_name, strInput[i], _T("bitrate unspecified!"));
+            return 1;
+        }
+        if (rendition.output.length() == 0) {
+            print_cmd_error_invalid_value(option_name, strInput[i], _T("output file unspecified!"));
+            return 1;
+        }
+        pParams->ladder.push_back(rendition);
+        return 0;
+    }
     if (IS_OPTION("qp-init") || IS_OPTION("qp-max") || IS_OPTION("qp-min")) {
         i++;
         int a[4] = { 0 };
@@ -84,6 +84,9 @@
 #include "helper_nvenc.h"
 #include "h264_level.h"
 #include "hevc_level.h"
+#include "rgy_mem_pool.h"
+#include "rgy_trace.h"
+#include "rgy_metrics.h"
 
 #pragma warning(push)
 #pragma warning(disable: 4244)
@@ -259,11 +262,14 @@ NVEncCore::NVEncCore() :
     m_inputHostBuffer(),
     m_trimParam(),
     m_pFileReader(),
+    m_inputFanoutPrm(),
     m_AudioReaders(),
     m_pFileWriter(),
     m_pFileWriterListAudio(),
     m_pStatus(),
     m_pPerfMonitor(),
+    m_traceOpened(false),
+    m_metricsSource(),
     m_stPicStruct(),
     m_stEncConfig(),
 #if ENABLE_AVSW_READER
@@ -313,6 +319,15 @@ void NVEncCore::SetAbortFlagPointer(bool *abortFlag) {
     m_pAbortByUser = abortFlag;
 }
 
+void NVEncCore::SetInputFanout(std::shared_ptr<RGYFrameFanout> fanout, int branch, std::shared_ptr<RGYInput> source,
+    std::shared_ptr<RGYAudioEncodeCache> audioEncodeCache) {
+    m_inputFanoutPrm = std::make_unique<RGYInputFanoutPrm>(RGYInputPrm());
+    m_inputFanoutPrm->fanout = fanout;
+    m_inputFanoutPrm->branch = branch;
+    m_inputFanoutPrm->source = source;
+    m_inputFanoutPrm->audioEncodeCache = audioEncodeCache;
+}
+
 //エンコーダが出力使用する色空間を入力パラメータをもとに取得
 RGY_CSP NVEncCore::GetEncoderCSP(const InEncodeVideoParam *inputParam) {
     const bool bOutputHighBitDepth = inputParam->codec == NV_ENC_HEVC && inputParam->encConfig.encodeCodecConfig.hevcConfig.pixelBitDepthMinus8 > 0;
@@ -356,6 +371,16 @@ NVENCSTATUS NVEncCore::InitLog(const InEncodeVideoParam *inputParam) {
     if ((inputParam->ctrl.logfile.length() > 0 || inputParam->common.outputFilename.length() > 0) && inputParam->input.type != RGY_INPUT_FMT_SM) {
         m_pNVLog->writeFileHeader(inputParam->common.outputFilename.c_str());
     }
+    //入力スレッドなどが起動する前に開始しておく (スレッド名は各スレッドの開始時に登録されるため)
+    if (inputParam->ctrl.traceFile.length() > 0 && !m_traceOpened) {
+        auto err = RGYTrace::get()->open(inputParam->ctrl.traceFile);
+        if (err != RGY_ERR_NONE) {
+            PrintMes(RGY_LOG_WARN, _T("Failed to start trace output to \"%s\": %s.\n"), inputParam->ctrl.traceFile.c_str(), get_err_mes(err));
+        } else {
+            m_traceOpened = true;
+            PrintMes(RGY_LOG_DEBUG, _T("Started trace output to \"%s\".\n"), inputParam->ctrl.traceFile.c_str());
+        }
+    }
     return NV_ENC_SUCCESS;
 }
 
@@ -453,7 +478,15 @@ NVENCSTATUS NVEncCore::InitInput(InEncodeVideoParam *inputParam, const std::vect
         m_qpTable = std::make_unique<RGYListRef<RGYFrameDataQP>>();
     }
 
-    if (initReaders(m_pFileReader, m_AudioReaders, &inputParam->input,
+    if (m_inputFanoutPrm) {
+        //入力の読み込みは共有するリーダーで行われ、ここではそのフレームを受け取るのみ
+        m_pFileReader = std::make_shared<RGYInputFanout>();
+        auto ret = m_pFileReader->Init(inputParam->common.inputFilename.c_str(), &inputParam->input, m_inputFanoutPrm.get(), m_pNVLog, m_pStatus);
+        if (ret != RGY_ERR_NONE) {
+            PrintMes(RGY_LOG_ERROR, _T("failed to initialize fanout reader: %s.\n"), get_err_mes(ret));
+            return NV_ENC_ERR_GENERIC;
+        }
+    } else if (initReaders(m_pFileReader, m_AudioReaders, &inputParam->input,
         m_pStatus, &inputParam->common, &inputParam->ctrl, HWDecCodecCsp, subburnTrackId,
         inputParam->vpp.rff, inputParam->vpp.afs.enable, m_qpTable.get(), m_pPerfMonitor.get(), m_pNVLog) != RGY_ERR_NONE) {
         PrintMes(RGY_LOG_ERROR, _T("failed to initialize file reader(s).\n"));
@@ -471,8 +504,9 @@ NVENCSTATUS NVEncCore::InitInput(InEncodeVideoParam *inputParam, const std::vect
 #if ENABLE_AVSW_READER
         std::dynamic_pointer_cast<RGYInputAvcodec>(m_pFileReader) == nullptr &&
 #endif
-        inputParam->common.pTrimList && inputParam->common.nTrimCount > 0) {
+        !m_inputFanoutPrm && inputParam->common.pTrimList && inputParam->common.nTrimCount > 0) {
         //avhw/avswリーダー以外は、trimは自分ではセットされないので、ここでセットする
+        //共有するリーダーから受け取る場合は、そのリーダーの設定を引き継いでいる
         sTrimParam trimParam;
         trimParam.list = make_vector(inputParam->common.pTrimList, inputParam->common.nTrimCount);
         trimParam.offset = 0;
@@ -560,12 +594,24 @@ NVENCSTATUS NVEncCore::InitPerfMonitor(const InEncodeVideoParam *inputParam) {
 #if ENABLE_NVML
     perfMonitorPrm.pciBusId = m_dev->pciBusId();
 #endif
-    if (m_pPerfMonitor->init(perfMonLog.c_str(), _T(""), (bLogOutput) ? inputParam->ctrl.perfMonitorInterval : 1000,
+    if (inputParam->ctrl.metricsPort > 0) {
+        //ABRラダーの各エンコードは同じポートを共有し、出力ファイル名のラベルで区別する
+        auto err = RGYMetricsServer::get()->open(tchar_to_string(inputParam->ctrl.metricsHost), inputParam->ctrl.metricsPort, m_pNVLog);
+        if (err != RGY_ERR_NONE) {
+            PrintMes(RGY_LOG_WARN, _T("Failed to start metrics endpoint on %s:%d: %s.\n"),
+                inputParam->ctrl.metricsHost.c_str(), inputParam->ctrl.metricsPort, get_err_mes(err));
+        } else {
+            m_metricsSource = RGYMetricsServer::get()->addSource(inputParam->common.outputFilename);
+            perfMonitorPrm.metrics = m_metricsSource;
+            PrintMes(RGY_LOG_DEBUG, _T("Serving metrics at http://%s:%d/metrics.\n"), inputParam->ctrl.metricsHost.c_str(), inputParam->ctrl.metricsPort);
+        }
+    }
+    if (m_pPerfMonitor->init(perfMonLog.c_str(), _T(""), (bLogOutput || m_metricsSource) ? inputParam->ctrl.perfMonitorInterval : 1000,
         (int)inputParam->ctrl.perfMonitorSelect, (int)inputParam->ctrl.perfMonitorSelectMatplot,
 #if defined(_WIN32) || defined(_WIN64)
         std::unique_ptr<void, handle_deleter>(OpenThread(SYNCHRONIZE | THREAD_QUERY_INFORMATION, false, GetCurrentThreadId()), handle_deleter()),
 #else
-        nullptr,
+        std::unique_ptr<void, handle_deleter>((HANDLE)GetCurrentThread(), handle_deleter()),
 #endif
         m_pNVLog, &perfMonitorPrm)) {
         PrintMes(RGY_LOG_WARN, _T("Failed to initialize performance monitor, disabled.\n"));
@@ -870,6 +916,7 @@ NVENCSTATUS NVEncCore::ProcessOutput(const EncodeBuffer *pEncodeBuffer) {
             return NV_ENC_ERR_INVALID_PARAM;
         }
         NVTXRANGE(ProcessOutputWait);
+        RGY_TRACE_SCOPE("encode_wait", m_pStatus->m_sData.frameOut);
         WaitForSingleObject(pEncodeBuffer->stOutputBfr.hOutputEvent, INFINITE);
     }
 
@@ -882,7 +929,11 @@ NVENCSTATUS NVEncCore::ProcessOutput(const EncodeBuffer *pEncodeBuffer) {
     lockBitstreamData.outputBitstream = pEncodeBuffer->stOutputBfr.hBitstreamBuffer;
     lockBitstreamData.doNotWait = false;
 
-    NVENCSTATUS nvStatus = m_dev->encoder()->NvEncLockBitstream(&lockBitstreamData);
+    NVENCSTATUS nvStatus = NV_ENC_SUCCESS;
+    {
+        RGY_TRACE_SCOPE("encode_lock", m_pStatus->m_sData.frameOut);
+        nvStatus = m_dev->encoder()->NvEncLockBitstream(&lockBitstreamData);
+    }
     if (nvStatus == NV_ENC_SUCCESS) {
         RGYBitstream bitstream = RGYBitstreamInit(lockBitstreamData);
         if (m_ssim) {
@@ -892,7 +943,11 @@ NVENCSTATUS NVEncCore::ProcessOutput(const EncodeBuffer *pEncodeBuffer) {
             m_ssim->addBitstream(&bitstream);
         }
         PrintMes(RGY_LOG_TRACE, _T("Output frame %d: size %zu, pts %lld, dts %lld\n"), m_pStatus->m_sData.frameOut, bitstream.size(), bitstream.pts(), bitstream.dts());
-        auto outErr = m_pFileWriter->WriteNextFrame(&bitstream);
+        RGY_ERR outErr = RGY_ERR_NONE;
+        {
+            RGY_TRACE_SCOPE("mux", m_pStatus->m_sData.frameOut);
+            outErr = m_pFileWriter->WriteNextFrame(&bitstream);
+        }
         nvStatus = m_dev->encoder()->NvEncUnlockBitstream(pEncodeBuffer->stOutputBfr.hBitstreamBuffer);
         if (nvStatus == NV_ENC_SUCCESS && outErr != RGY_ERR_NONE) {
             nvStatus = NV_ENC_ERR_GENERIC;
@@ -944,6 +999,11 @@ NVENCSTATUS NVEncCore::Deinitialize() {
             m_qpTable.reset();
         }
         ReleaseIOBuffers();
+        if (m_inputHostBuffer.size()) {
+            NVEncCtxAutoLock(ctxlock(m_dev->vidCtxLock()));
+            m_inputHostBuffer.clear();
+        }
+        PrintMes(RGY_LOG_DEBUG, _T("%s.\n"), RGYMemPool::shared()->statsStr().c_str());
     }
     m_inputHostBuffer.clear();
     m_cuvidDec.reset();
@@ -966,6 +1026,21 @@ NVENCSTATUS NVEncCore::Deinitialize() {
     PrintMes(RGY_LOG_DEBUG, _T("Closing perf monitor...\n"));
     m_pPerfMonitor.reset();
 
+    if (m_metricsSource) {
+        RGYMetricsServer::get()->removeSource(m_metricsSource);
+        m_metricsSource.reset();
+        RGYMetricsServer::get()->close();
+    }
+
+    if (m_traceOpened) {
+        //各スレッドは上で終了しているので、ここで残りの区間を書き出す
+        RGYTrace::get()->close();
+        const auto traceStats = RGYTrace::get()->stats();
+        m_traceOpened = false;
+        PrintMes((traceStats.dropped > 0) ? RGY_LOG_WARN : RGY_LOG_DEBUG, _T("trace: %lld events from %d threads, %lld dropped.\n"),
+            (long long)traceStats.events, traceStats.threads, (long long)traceStats.dropped);
+    }
+
     PrintMes(RGY_LOG_DEBUG, _T("Closing logger...\n"));
     m_pNVLog.reset();
     m_pAbortByUser = nullptr;
@@ -1144,11 +1219,22 @@ NVENCSTATUS NVEncCore::AllocateIOBuffers(uint32_t uInputWidth, uint32_t uInputHe
 #if ENABLE_AVSW_READER
             CCtxAutoLock ctxLock(m_dev->vidCtxLock());
 #endif //#if ENABLE_AVSW_READER
-            auto cudaret = cudaMallocHost(&m_inputHostBuffer[i].frameInfo.ptr, bufSize);
+            //huge pageで確保したメモリプールのバッファをpage-lockedにして使用する
+            auto buf = RGYMemPool::shared()->alloc(bufSize);
+            if (!buf) {
+                PrintMes(RGY_LOG_ERROR, _T("Failed to allocate input host buffer.\n"));
+                return NV_ENC_ERR_OUT_OF_MEMORY;
+            }
+            auto cudaret = cudaHostRegister(buf.get(), bufSize, cudaHostRegisterPortable);
             if (cudaret != cudaSuccess) {
-                PrintMes(RGY_LOG_ERROR, _T("Error cudaEventRecord: %d (%s).\n"), cudaret, char_to_tstring(_cudaGetErrorEnum(cudaret)).c_str());
+                PrintMes(RGY_LOG_ERROR, _T("Error cudaHostRegister: %d (%s).\n"), cudaret, char_to_tstring(_cudaGetErrorEnum(cudaret)).c_str());
                 return NV_ENC_ERR_GENERIC;
             }
+            //解放時はpage-lockedを解除してからプールに戻す
+            m_inputHostBuffer[i].hostBuf = std::shared_ptr<uint8_t>(buf.get(), [buf](uint8_t *ptr) {
+                cudaHostUnregister(ptr);
+            });
+            m_inputHostBuffer[i].frameInfo.ptr = m_inputHostBuffer[i].hostBuf.get();
         }
     }
 
@@ -3045,6 +3131,7 @@ NVENCSTATUS NVEncCore::ShowNVEncFeatures(const InEncodeVideoParam *inputParam) {
 
 NVENCSTATUS NVEncCore::NvEncEncodeFrame(EncodeBuffer *pEncodeBuffer, int id, uint64_t timestamp, uint64_t duration, int inputFrameId, const std::vector<std::shared_ptr<RGYFrameData>>& frameDataList) {
     PrintMes(RGY_LOG_TRACE, _T("Sending frame %d to encoder: timestamp %lld, duration %lld\n"), inputFrameId, timestamp, duration);
+    RGY_TRACE_SCOPE("encode_submit", inputFrameId);
     NV_ENC_PIC_PARAMS encPicParams;
     INIT_CONFIG(encPicParams, NV_ENC_PIC_PARAMS);
 
@@ -3204,6 +3291,7 @@ NVENCSTATUS NVEncCore::NvEncEncodeFrame(EncodeBuffer *pEncodeBuffer, int id, uin
 NVENCSTATUS NVEncCore::Encode() {
     NVENCSTATUS nvStatus = NV_ENC_SUCCESS;
     m_pStatus->SetStart();
+    RGY_TRACE_THREAD_NAME("main");
 
     const int nEventCount = m_pipelineDepth + CHECK_PTS_MAX_INSERT_FRAMES + 1 + MAX_FILTER_OUTPUT;
 
@@ -3350,12 +3438,16 @@ NVENCSTATUS NVEncCore::Encode() {
     std::thread th_input;
     if (m_cuvidDec) {
         th_input = std::thread([this, streamIn, &queueHDR10plusMetadata, &nvStatus]() {
+            RGY_TRACE_THREAD_NAME("input");
             CUresult curesult = CUDA_SUCCESS;
             RGYBitstream bitstream = RGYBitstreamInit();
             RGY_ERR sts = RGY_ERR_NONE;
             for (int i = 0; sts == RGY_ERR_NONE && nvStatus == NV_ENC_SUCCESS && !m_cuvidDec->GetError(); i++) {
-                sts = m_pFileReader->LoadNextFrame(nullptr);
-                m_pFileReader->GetNextBitstream(&bitstream);
+                {
+                    RGY_TRACE_SCOPE("demux", i);
+                    sts = m_pFileReader->LoadNextFrame(nullptr);
+                    m_pFileReader->GetNextBitstream(&bitstream);
+                }
                 for (auto& frameData : bitstream.getFrameDataList()) {
                     if (frameData->dataType() == RGY_FRAME_DATA_HDR10PLUS) {
                         auto ptr = dynamic_cast<RGYFrameDataHDR10plus*>(frameData);
@@ -3366,6 +3458,7 @@ NVENCSTATUS NVEncCore::Encode() {
                 }
                 PrintMes(RGY_LOG_TRACE, _T("Set packet #%d, size %zu, pts %lld (%s)\n"), i, bitstream.size(),
                     (long long int)bitstream.pts(), getTimestampString(bitstream.pts(), streamIn->time_base).c_str());
+                RGY_TRACE_SCOPE("decode_submit", i);
                 if (CUDA_SUCCESS != (curesult = m_cuvidDec->DecodePacket(bitstream.bufptr() + bitstream.offset(), bitstream.size(), bitstream.pts(), streamIn->time_base))) {
                     PrintMes(RGY_LOG_ERROR, _T("Error in DecodePacket: %d (%s).\n"), curesult, char_to_tstring(_cudaGetErrorEnum(curesult)).c_str());
                     return curesult;
@@ -3874,6 +3967,7 @@ NVENCSTATUS NVEncCore::Encode() {
             }
             NVTXRANGE(LoadNextFrame);
             RGYFrame frame = RGYFrame(inputFrameBuf.frameInfo);
+            RGY_TRACE_SCOPE("input", nInputFrame);
             auto rgy_err = m_pFileReader->LoadNextFrame(&frame);
             if (rgy_err != RGY_ERR_NONE) {
                 if (rgy_err != RGY_ERR_MORE_DATA) { //RGY_ERR_MORE_DATAは読み込みの正常終了を示す
@@ -3986,6 +4080,12 @@ NVENCSTATUS NVEncCore::Encode() {
         th_input.join();
         PrintMes(RGY_LOG_DEBUG, _T("Flushed Decoder\n"));
     }
+    if (auto fanoutReader = std::dynamic_pointer_cast<RGYInputFanout>(m_pFileReader)) {
+        //共有している音声エンコードのflushでは、エンコードを担当する出力の終了を待つ
+        //途中で終了した場合でもその出力を止めないよう、先にフレームの受け取りを終了する
+        fanoutReader->closeBranch();
+        PrintMes(RGY_LOG_DEBUG, _T("Closed fanout branch.\n"));
+    }
     for (const auto& writer : m_pFileWriterListAudio) {
         auto pAVCodecWriter = std::dynamic_pointer_cast<RGYOutputAvcodec>(writer);
         if (pAVCodecWriter != nullptr) {
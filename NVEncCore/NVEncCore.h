@@ -45,6 +45,7 @@
 #include "NVEncFilterSsim.h"
 #include "NVEncFrameInfo.h"
 #include "rgy_input.h"
+#include "rgy_input_fanout.h"
 #include "rgy_output.h"
 #include "rgy_osdep.h"
 #include "rgy_tchar.h"
@@ -55,8 +56,11 @@
 
 using std::vector;
 
+class RGYMetricsSource;
+
 struct InputFrameBufInfo {
     FrameInfo frameInfo; //入力フレームへのポインタと情報
+    std::shared_ptr<uint8_t> hostBuf; //frameInfo.ptrの実体 (page-lockedなメモリプールのバッファ)
     std::unique_ptr<void, handle_deleter> heTransferFin; //入力フレームに関連付けられたイベント、このフレームが不要になったらSetする
 };
 
@@ -89,6 +93,12 @@ public:
     //ユーザーからの中断を知らせるフラグへのポインタをセット
     void SetAbortFlagPointer(bool *abortFlag);
 
+    //入力をほかのエンコードと共有する場合 (ABRラダー) に、Initialize()より前にセットする
+    //入力ファイルは開かず、sourceが読み込みfanoutが分配するbranch番目のフレームをエンコードする
+    //audioEncodeCacheを指定すると、同じ設定の音声エンコードはほかのエンコードと共有する
+    void SetInputFanout(std::shared_ptr<RGYFrameFanout> fanout, int branch, std::shared_ptr<RGYInput> source,
+        std::shared_ptr<RGYAudioEncodeCache> audioEncodeCache);
+
     NVENCSTATUS ShowDeviceList(const InEncodeVideoParam *inputParam);
     NVENCSTATUS ShowCodecSupport(const InEncodeVideoParam *inputParam);
     NVENCSTATUS ShowNVEncFeatures(const InEncodeVideoParam *inputParam);
@@ -188,11 +198,14 @@ protected:
 
     sTrimParam                    m_trimParam;
     shared_ptr<RGYInput>          m_pFileReader;           //動画読み込み
+    unique_ptr<RGYInputFanoutPrm> m_inputFanoutPrm;        //入力を共有する場合の設定
     vector<shared_ptr<RGYInput>>  m_AudioReaders;
     shared_ptr<RGYOutput>         m_pFileWriter;           //動画書き出し
     vector<shared_ptr<RGYOutput>> m_pFileWriterListAudio;
     shared_ptr<EncodeStatus>      m_pStatus;               //エンコードステータス管理
     shared_ptr<CPerfMonitor>      m_pPerfMonitor;
+    bool                          m_traceOpened;         //RGYTraceを開始したか (Deinitializeで閉じる)
+    shared_ptr<RGYMetricsSource>  m_metricsSource;       //--metrics-portで公開する値
     NV_ENC_PIC_STRUCT             m_stPicStruct;           //エンコードフレーム情報(プログレッシブ/インタレ)
     NV_ENC_CONFIG                 m_stEncConfig;           //エンコード設定
 #if ENABLE_AVSW_READER
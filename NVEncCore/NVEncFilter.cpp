@@ -27,13 +27,14 @@
 // ------------------------------------------------------------------------------------------
 
 #include "NVEncFilter.h"
+#include "rgy_trace.h"
 
 NVEncFilter::NVEncFilter() :
     m_sFilterName(), m_sFilterInfo(), m_pPrintMes(), m_pFrameBuf(), m_nFrameIdx(0),
     m_pFieldPairIn(), m_pFieldPairOut(),
     m_pParam(),
     m_nPathThrough(FILTER_PATHTHROUGH_ALL), m_bCheckPerformance(false),
-    m_peFilterStart(), m_peFilterFin(), m_dFilterTimeMs(0.0), m_nFilterRunCount(0) {
+    m_peFilterStart(), m_peFilterFin(), m_dFilterTimeMs(0.0), m_nFilterRunCount(0), m_traceName(nullptr) {
 
 }
 
@@ -86,6 +87,12 @@ RGY_ERR NVEncFilter::filter(FrameInfo *pInputFrame, FrameInfo **ppOutputFrames,
         }
     }
 
+    if (m_traceName == nullptr && RGYTrace::enabled()) {
+        m_traceName = RGYTrace::intern(m_sFilterName);
+    }
+    //GPU上の処理は非同期なので、ここで記録されるのはCPU側でカーネルを投入するまでの時間
+    RGY_TRACE_SCOPE(m_traceName, (pInputFrame) ? pInputFrame->inputFrameId : -1);
+
     if (pInputFrame == nullptr) {
         *pOutputFrameNum = 0;
         ppOutputFrames[0] = nullptr;
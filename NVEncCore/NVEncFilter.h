@@ -187,6 +187,7 @@ private:
     unique_ptr<cudaEvent_t, cudaevent_deleter> m_peFilterFin;
     double m_dFilterTimeMs;
     int m_nFilterRunCount;
+    const char *m_traceName; //RGYTraceでの区間名
 };
 
 class NVEncFilterParamCrop : public NVEncFilterParam {
@@ -0,0 +1,212 @@
+﻿// -----------------------------------------------------------------------------------------
+// QSVEnc/NVEnc/VCEEnc by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2020 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+#include <thread>
+#include "NVEncLadder.h"
+#include "NVEncCore.h"
+#include "rgy_input.h"
+#include "rgy_frame_fanout.h"
+#include "rgy_input_fanout.h"
+#include "rgy_audio_encode_share.h"
+
+#if ENABLE_RAW_READER
+
+//出力先ごとのキューの長さ
+static const int LADDER_FANOUT_QUEUE = 4;
+
+//レンディションのエンコード設定を作成する
+static InEncodeVideoParam ladder_rendition_param(const InEncodeVideoParam *encPrm, const VideoInfo& inputInfo, const LadderRendition& rendition) {
+    InEncodeVideoParam prm = *encPrm;
+    prm.ladder.clear();
+    prm.dynamicRC.clear();
+    prm.input = inputInfo;
+    prm.input.dstWidth = rendition.width;
+    prm.input.dstHeight = rendition.height;
+    prm.common.outputFilename = rendition.output;
+    prm.encConfig.rcParams.averageBitRate = rendition.avg_bitrate;
+    prm.encConfig.rcParams.maxBitRate = rendition.max_bitrate;
+    //進捗表示は最初のエンコードのみとし、以降は警告以上のみ表示する
+    prm.ctrl.loglevel = (std::max)(prm.ctrl.loglevel, (int)RGY_LOG_WARN);
+    return prm;
+}
+
+int nvenc_ladder_run(InEncodeVideoParam *encPrm, bool *abortFlag) {
+    auto log = std::make_shared<RGYLog>(encPrm->ctrl.logfile.c_str(), encPrm->ctrl.loglevel);
+
+    if (encPrm->encConfig.rcParams.rateControlMode == NV_ENC_PARAMS_RC_CONSTQP) {
+        log->write(RGY_LOG_ERROR, _T("--ladder requires bitrate based rate control (--vbr or --cbr).\n"));
+        return 1;
+    }
+    if (encPrm->ctrl.chunkParallel > 1) {
+        log->write(RGY_LOG_ERROR, _T("--ladder cannot be used with --chunk-parallel.\n"));
+        return 1;
+    }
+    if (encPrm->common.audioSource.size() > 0 || encPrm->common.subSource.size() > 0) {
+        log->write(RGY_LOG_ERROR, _T("--ladder cannot be used with --audio-source or --sub-source.\n"));
+        return 1;
+    }
+    if (encPrm->common.caption2ass != FORMAT_INVALID) {
+        log->write(RGY_LOG_ERROR, _T("--ladder cannot be used with --caption2ass.\n"));
+        return 1;
+    }
+    for (const auto& rendition : encPrm->ladder) {
+        if (rendition.output == encPrm->common.outputFilename || rendition.output == _T("-")) {
+            log->write(RGY_LOG_ERROR, _T("--ladder: output of each rendition must be a different file: %s.\n"), rendition.output.c_str());
+            return 1;
+        }
+    }
+
+    //入力を読み込むリーダーを作成する
+    //デコード後のフレームをホストメモリで分配するので、HWデコードは使用できない
+    //明示的に--avhwが指定されている場合に、黙ってavswでデコードすると速度が大きく変わるので、エラーとする
+    //(自動選択の場合は、HWデコードの情報を渡さないので、avswでデコードされる)
+    VideoInfo inputInfo = encPrm->input;
+    if (inputInfo.type == RGY_INPUT_FMT_AVHW) {
+        log->write(RGY_LOG_ERROR, _T("--ladder cannot be used with --avhw, decoded frames are shared on host memory. Please use --avsw instead.\n"));
+        return 1;
+    }
+    DeviceCodecCsp HWDecCodecCsp;
+    int subburnTrackId = 0;
+    for (const auto &subburn : encPrm->vpp.subburn) {
+        if (subburn.trackId > 0) {
+            subburnTrackId = subburn.trackId;
+            break;
+        }
+    }
+    std::shared_ptr<RGYInput> source;
+    std::vector<std::shared_ptr<RGYInput>> sourceOthers; //--audio-source, --sub-sourceは使用しないので空となる
+    auto sourceStatus = std::make_shared<EncodeStatus>();
+    auto err = initReaders(source, sourceOthers, &inputInfo, sourceStatus, &encPrm->common, &encPrm->ctrl, HWDecCodecCsp, subburnTrackId,
+        encPrm->vpp.rff, encPrm->vpp.afs.enable, nullptr, nullptr, log);
+    if (err != RGY_ERR_NONE) {
+        log->write(RGY_LOG_ERROR, _T("ladder: failed to initialize file reader(s): %s.\n"), get_err_mes(err));
+        return 1;
+    }
+    if (encPrm->common.pTrimList && encPrm->common.nTrimCount > 0 && source->GetTrimParam().list.size() == 0) {
+        //avswリーダー以外は、trimは自分ではセットされないので、ここでセットする
+        sTrimParam trimParam;
+        trimParam.list = make_vector(encPrm->common.pTrimList, encPrm->common.nTrimCount);
+        trimParam.offset = 0;
+        source->SetTrimParam(trimParam);
+    }
+    log->write(RGY_LOG_DEBUG, _T("ladder: %s\n"), source->GetInputMessage());
+
+    //読み込むフレームの形式 (NVEncCoreの入力バッファと同じ配置とする)
+    FrameInfo frameInfo;
+    frameInfo.csp = inputInfo.csp;
+    frameInfo.width = inputInfo.srcWidth - inputInfo.crop.e.left - inputInfo.crop.e.right;
+    frameInfo.height = inputInfo.srcHeight - inputInfo.crop.e.bottom - inputInfo.crop.e.up;
+    frameInfo.picstruct = inputInfo.picstruct;
+    const auto frameInfoEx = getFrameInfoExtra(&frameInfo);
+    //このアライメントは読み込み時の色変換の並列化のために必要
+    frameInfo.pitch = ALIGN(frameInfoEx.width_byte, 64 * (RGY_CSP_BIT_DEPTH[frameInfo.csp] > 8 ? 2 : 1));
+    const size_t frameSize = (size_t)frameInfo.pitch * frameInfoEx.height_total;
+
+    std::vector<InEncodeVideoParam> prms;
+    prms.push_back(*encPrm);
+    prms.back().ladder.clear();
+    prms.back().input = inputInfo;
+    prms.back().input.dstWidth = encPrm->input.dstWidth;
+    prms.back().input.dstHeight = encPrm->input.dstHeight;
+    for (const auto& rendition : encPrm->ladder) {
+        prms.push_back(ladder_rendition_param(encPrm, inputInfo, rendition));
+    }
+
+    auto fanout = std::make_shared<RGYFrameFanout>();
+    if ((err = fanout->init((int)prms.size(), frameInfo, frameSize, LADDER_FANOUT_QUEUE, 0,
+        RGYInputFanout::createLoader(source), log)) != RGY_ERR_NONE) {
+        log->write(RGY_LOG_ERROR, _T("ladder: failed to initialize fanout: %s.\n"), get_err_mes(err));
+        return 1;
+    }
+
+#if ENABLE_AVSW_READER
+    //同じ設定の音声エンコードは最初に初期化した出力でのみ行い、その結果をほかの出力で共有する
+    auto audioEncodeCache = std::make_shared<RGYAudioEncodeCache>();
+#else
+    std::shared_ptr<RGYAudioEncodeCache> audioEncodeCache;
+#endif //#if ENABLE_AVSW_READER
+
+    std::vector<std::unique_ptr<NVEncCore>> encoders;
+    for (int i = 0; i < (int)prms.size(); i++) {
+        auto encoder = std::make_unique<NVEncCore>();
+        encoder->SetInputFanout(fanout, i, source, audioEncodeCache);
+        if (NV_ENC_SUCCESS != encoder->Initialize(&prms[i])
+            || NV_ENC_SUCCESS != encoder->InitEncode(&prms[i])) {
+            log->write(RGY_LOG_ERROR, _T("ladder: failed to initialize encoder for %s.\n"), prms[i].common.outputFilename.c_str());
+            encoders.clear();
+            fanout->close();
+            return 1;
+        }
+        encoder->SetAbortFlagPointer(abortFlag);
+        encoder->PrintEncodingParamsInfo(RGY_LOG_INFO);
+        encoders.push_back(std::move(encoder));
+    }
+
+    fanout->start();
+    std::vector<NVENCSTATUS> results(encoders.size(), NV_ENC_SUCCESS);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < (int)encoders.size(); i++) {
+        threads.push_back(std::thread([&encoders, &results, i]() {
+            results[i] = encoders[i]->Encode();
+            //エンコードが終了したら、以降のフレームは不要
+            encoders[i]->Deinitialize();
+        }));
+    }
+    for (auto& th : threads) {
+        th.join();
+    }
+    encoders.clear();
+    const auto stats = fanout->stats();
+    fanout->close();
+    log->write(RGY_LOG_DEBUG, _T("ladder: %lld frames, max buffers %d, wait queue %.1f ms, wait buffer %.1f ms.\n"),
+        (long long)stats.frames, stats.maxBuffersInUse, stats.waitQueueMs, stats.waitBufferMs);
+#if ENABLE_AVSW_READER
+    log->write(RGY_LOG_DEBUG, _T("ladder: %d audio encode(s) in shared cache.\n"), audioEncodeCache->shares());
+#endif //#if ENABLE_AVSW_READER
+    if (fanout->error() != RGY_ERR_NONE) {
+        log->write(RGY_LOG_ERROR, _T("ladder: error in input: %s.\n"), get_err_mes(fanout->error()));
+        return 1;
+    }
+    int ret = 0;
+    for (int i = 0; i < (int)results.size(); i++) {
+        if (results[i] != NV_ENC_SUCCESS) {
+            log->write(RGY_LOG_ERROR, _T("ladder: failed to encode %s.\n"), prms[i].common.outputFilename.c_str());
+            ret = 1;
+        }
+    }
+    return ret;
+}
+
+#else
+
+int nvenc_ladder_run(InEncodeVideoParam *encPrm, bool *abortFlag) {
+    UNREFERENCED_PARAMETER(encPrm);
+    UNREFERENCED_PARAMETER(abortFlag);
+    return 1;
+}
+
+#endif //#if ENABLE_RAW_READER
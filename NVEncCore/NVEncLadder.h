@@ -0,0 +1,40 @@
+﻿// -----------------------------------------------------------------------------------------
+// QSVEnc/NVEnc/VCEEnc by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2020 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+#pragma once
+#ifndef __NVENC_LADDER_H__
+#define __NVENC_LADDER_H__
+
+#include "NVEncParam.h"
+
+//ABRラダーのエンコードを行う (--ladder)
+//入力は1回だけ読み込み・デコードし、RGYFrameFanoutで通常の出力と各レンディションのエンコードに分配する
+//各エンコードは別々のNVEncCoreで、リサイズ・レート制御・出力をそれぞれ行う
+//戻り値はプロセスの終了コード
+int nvenc_ladder_run(InEncodeVideoParam *encPrm, bool *abortFlag);
+
+#endif //__NVENC_LADDER_H__
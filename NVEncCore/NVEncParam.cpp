@@ -94,6 +94,30 @@ bool DynamicRCParam::operator!=(const DynamicRCParam &x) const {
     return !(*this == x);
 }
 
+LadderRendition::LadderRendition() : width(0), height(0), avg_bitrate(0), max_bitrate(0), output() {
+
+}
+tstring LadderRendition::print() const {
+    TStringStream t;
+    t << "res=" << width << "x" << height;
+    t << ",bitrate=" << avg_bitrate / 1000;
+    if (max_bitrate != 0) {
+        t << ",max-bitrate=" << max_bitrate / 1000;
+    }
+    t << ",output=" << output;
+    return t.str();
+}
+bool LadderRendition::operator==(const LadderRendition &x) const {
+    return width == x.width
+        && height == x.height
+        && avg_bitrate == x.avg_bitrate
+        && max_bitrate == x.max_bitrate
+        && output == x.output;
+}
+bool LadderRendition::operator!=(const LadderRendition &x) const {
+    return !(*this == x);
+}
+
 GPUAutoSelectMul::GPUAutoSelectMul() : cores(0.001f), gen(1.0f), gpu(1.0f), ve(1.0f) {}
 
 bool GPUAutoSelectMul::operator==(const GPUAutoSelectMul &x) const {
@@ -1155,6 +1179,7 @@ InEncodeVideoParam::InEncodeVideoParam() :
     par(),
     encConfig(),
     dynamicRC(),
+    ladder(),
     codec(NV_ENC_H264),
     bluray(0),                   //bluray出力
     yuv444(0),                   //YUV444出力
@@ -46,6 +46,9 @@
 
 using std::vector;
 
+//GeForceで同時に使用できるNVENCのセッション数 (Quadro/Teslaには制限がないが、安全側に合わせる)
+static const int NVENC_MAX_SESSIONS_GEFORCE = 3;
+
 static const int   FILTER_DEFAULT_DELOGO_DEPTH = 128;
 static const int   FILTER_DEFAULT_UNSHARP_RADIUS = 3;
 static const float FILTER_DEFAULT_UNSHARP_WEIGHT = 0.5f;
@@ -420,6 +423,20 @@ struct DynamicRCParam {
 };
 tstring printParams(const std::vector<DynamicRCParam> &dynamicRC);
 
+//ABRラダーの各レンディション (--ladder)
+struct LadderRendition {
+    int width;
+    int height;
+    int avg_bitrate;
+    int max_bitrate;
+    tstring output;
+
+    LadderRendition();
+    tstring print() const;
+    bool operator==(const LadderRendition &x) const;
+    bool operator!=(const LadderRendition &x) const;
+};
+
 enum {
     NPPI_INTER_MAX = NPPI_INTER_LANCZOS3_ADVANCED,
     RESIZE_CUDA_TEXTURE_BILINEAR,
@@ -1288,6 +1305,7 @@ struct InEncodeVideoParam {
     int par[2];                   //使用されていません
     NV_ENC_CONFIG encConfig;      //エンコード設定
     std::vector<DynamicRCParam> dynamicRC;
+    std::vector<LadderRendition> ladder; //入力を共有してエンコードするレンディション
     int codec;                    //出力コーデック
     int bluray;                   //bluray出力
     int yuv444;                   //YUV444出力
@@ -34,6 +34,8 @@
 #include "rgy_version.h"
 #include "convert_csp.h"
 #include "rgy_osdep.h"
+#include "cpu_info.h"
+#include "rgy_thread_pool.h"
 
 void copy_nv12_to_nv12_sse2(void **dst, const void **src, int width, int src_y_pitch_byte, int src_uv_pitch_byte, int dst_y_pitch_byte, int height, int dst_height, int thread_id, int thread_n, int *crop);
 void copy_p010_to_p010_sse2(void **dst, const void **src, int width, int src_y_pitch_byte, int src_uv_pitch_byte, int dst_y_pitch_byte, int height, int dst_height, int thread_id, int thread_n, int *crop);
@@ -126,6 +128,36 @@ void convert_yv12_09_to_p010_sse2(void **dst, const void **src, int width, int s
 #define FUNC_AVX2(from, to, uv_only, funcp, funci, simd)
 #endif
 
+void copy_nv12_to_nv12_avx512(void **dst, const void **src, int width, int src_y_pitch_byte, int src_uv_pitch_byte, int dst_y_pitch_byte, int height, int dst_height, int thread_id, int thread_n, int *crop);
+void copy_p010_to_p010_avx512(void **dst, const void **src, int width, int src_y_pitch_byte, int src_uv_pitch_byte, int dst_y_pitch_byte, int height, int dst_height, int thread_id, int thread_n, int *crop);
+void convert_yv12_to_nv12_avx512(void **dst, const void **src, int width, int src_y_pitch_byte, int src_uv_pitch_byte, int dst_y_pitch_byte, int height, int dst_height, int thread_id, int thread_n, int *crop);
+void convert_uv_yv12_to_nv12_avx512(void **dst, const void **src, int width, int src_y_pitch_byte, int src_uv_pitch_byte, int dst_y_pitch_byte, int height, int dst_height, int thread_id, int thread_n, int *crop);
+void convert_yv12_to_nv12_avx512vbmi(void **dst, const void **src, int width, int src_y_pitch_byte, int src_uv_pitch_byte, int dst_y_pitch_byte, int height, int dst_height, int thread_id, int thread_n, int *crop);
+void convert_uv_yv12_to_nv12_avx512vbmi(void **dst, const void **src, int width, int src_y_pitch_byte, int src_uv_pitch_byte, int dst_y_pitch_byte, int height, int dst_height, int thread_id, int thread_n, int *crop);
+void convert_yv12_to_p010_avx512(void **dst, const void **src, int width, int src_y_pitch_byte, int src_uv_pitch_byte, int dst_y_pitch_byte, int height, int dst_height, int thread_id, int thread_n, int *crop);
+void convert_yv12_16_to_p010_avx512(void **dst, const void **src, int width, int src_y_pitch_byte, int src_uv_pitch_byte, int dst_y_pitch_byte, int height, int dst_height, int thread_id, int thread_n, int *crop);
+void convert_yv12_14_to_p010_avx512(void **dst, const void **src, int width, int src_y_pitch_byte, int src_uv_pitch_byte, int dst_y_pitch_byte, int height, int dst_height, int thread_id, int thread_n, int *crop);
+void convert_yv12_12_to_p010_avx512(void **dst, const void **src, int width, int src_y_pitch_byte, int src_uv_pitch_byte, int dst_y_pitch_byte, int height, int dst_height, int thread_id, int thread_n, int *crop);
+void convert_yv12_10_to_p010_avx512(void **dst, const void **src, int width, int src_y_pitch_byte, int src_uv_pitch_byte, int dst_y_pitch_byte, int height, int dst_height, int thread_id, int thread_n, int *crop);
+void convert_yv12_09_to_p010_avx512(void **dst, const void **src, int width, int src_y_pitch_byte, int src_uv_pitch_byte, int dst_y_pitch_byte, int height, int dst_height, int thread_id, int thread_n, int *crop);
+void copy_yuv444_to_yuv444_avx512(void **dst, const void **src, int width, int src_y_pitch_byte, int src_uv_pitch_byte, int dst_y_pitch_byte, int height, int dst_height, int thread_id, int thread_n, int *crop);
+void convert_yuv444_16_to_yuv444_16_avx512(void **dst, const void **src, int width, int src_y_pitch_byte, int src_uv_pitch_byte, int dst_y_pitch_byte, int height, int dst_height, int thread_id, int thread_n, int *crop);
+void convert_yuv444_14_to_yuv444_16_avx512(void **dst, const void **src, int width, int src_y_pitch_byte, int src_uv_pitch_byte, int dst_y_pitch_byte, int height, int dst_height, int thread_id, int thread_n, int *crop);
+void convert_yuv444_12_to_yuv444_16_avx512(void **dst, const void **src, int width, int src_y_pitch_byte, int src_uv_pitch_byte, int dst_y_pitch_byte, int height, int dst_height, int thread_id, int thread_n, int *crop);
+void convert_yuv444_10_to_yuv444_16_avx512(void **dst, const void **src, int width, int src_y_pitch_byte, int src_uv_pitch_byte, int dst_y_pitch_byte, int height, int dst_height, int thread_id, int thread_n, int *crop);
+void convert_yuv444_09_to_yuv444_16_avx512(void **dst, const void **src, int width, int src_y_pitch_byte, int src_uv_pitch_byte, int dst_y_pitch_byte, int height, int dst_height, int thread_id, int thread_n, int *crop);
+
+#if defined(_MSC_VER) || defined(__AVX512BW__)
+#define FUNC_AVX512(from, to, uv_only, funcp, funci, simd) { from, to, uv_only, { funcp, funci }, simd },
+#else
+#define FUNC_AVX512(from, to, uv_only, funcp, funci, simd)
+#endif
+#if defined(_MSC_VER) || defined(__AVX512VBMI__)
+#define FUNC_AVX512VBMI(from, to, uv_only, funcp, funci, simd) { from, to, uv_only, { funcp, funci }, simd },
+#else
+#define FUNC_AVX512VBMI(from, to, uv_only, funcp, funci, simd)
+#endif
+
 void convert_yuv422_to_nv16_sse2(void **dst, const void **src, int width, int src_y_pitch_byte, int src_uv_pitch_byte, int dst_y_pitch_byte, int height, int dst_height, int thread_id, int thread_n, int *crop);
 void convert_yuv422_to_p210_sse2(void **dst, const void **src, int width, int src_y_pitch_byte, int src_uv_pitch_byte, int dst_y_pitch_byte, int height, int dst_height, int thread_id, int thread_n, int *crop);
 void convert_yuv422_09_to_p210_sse2(void **dst, const void **src, int width, int src_y_pitch_byte, int src_uv_pitch_byte, int dst_y_pitch_byte, int height, int dst_height, int thread_id, int thread_n, int *crop);
@@ -247,8 +279,8 @@ void convert_yuy2_to_nv12_i(void **dst_array, const void **src_array, int width,
             dstY[3*dst_y_pitch_byte   + 1] = srcP[3*src_y_pitch_byte + 2];
             dstC[0*dst_y_pitch_byte/2 + 0] =(srcP[0*src_y_pitch_byte + 1] * 3 + srcP[2*src_y_pitch_byte + 1] * 1 + 2)>>2;
             dstC[0*dst_y_pitch_byte/2 + 1] =(srcP[0*src_y_pitch_byte + 3] * 3 + srcP[2*src_y_pitch_byte + 3] * 1 + 2)>>2;
-            dstC[1*dst_y_pitch_byte/2 + 0] =(srcP[1*src_y_pitch_byte + 1] * 1 + srcP[3*src_y_pitch_byte + 1] * 3 + 2)>>2;
-            dstC[1*dst_y_pitch_byte/2 + 1] =(srcP[1*src_y_pitch_byte + 3] * 1 + srcP[3*src_y_pitch_byte + 3] * 3 + 2)>>2;
+            dstC[1*dst_y_pitch_byte   + 0] =(srcP[1*src_y_pitch_byte + 1] * 1 + srcP[3*src_y_pitch_byte + 1] * 3 + 2)>>2;
+            dstC[1*dst_y_pitch_byte   + 1] =(srcP[1*src_y_pitch_byte + 3] * 1 + srcP[3*src_y_pitch_byte + 3] * 3 + 2)>>2;
         }
     }
 }
@@ -512,7 +544,7 @@ static void convert_yuv422_to_yuv444(void **dst, const void **src, int width, in
         uint8_t *srcYLine = (uint8_t *)src[0] + src_y_pitch_byte * y_range.start_src + crop_left;
         uint8_t *dstLine = (uint8_t *)dst[0] + dst_y_pitch_byte * y_range.start_dst;
         const int y_width = width - crop_right - crop_left;
-        for (int y = crop_up; y < y_range.len; y++, srcYLine += src_y_pitch_byte, dstLine += dst_y_pitch_byte) {
+        for (int y = 0; y < y_range.len; y++, srcYLine += src_y_pitch_byte, dstLine += dst_y_pitch_byte) {
             memcpy(dstLine, srcYLine, y_width);
         }
     }
@@ -611,7 +643,7 @@ static void RGY_FORCEINLINE convert_yv12_p_to_yuv444_c(void **dst, const void **
             Tout *dstC = dstLine;
             Tin *srcP = srcCLine;
             const int x_fin = width - crop_right - crop_left;
-            if (y == 0) {
+            if (y_range.start_dst + y == 0) {
                 for (int x = 0; x < x_fin; x += 2, dstC += 2, srcP++) {
                     int cxplus = (x + 2 < x_fin);
                     int cy0x0 = srcP[ 0*src_uv_pitch + 0];
@@ -722,11 +754,13 @@ static void RGY_FORCEINLINE convert_yv12_i_to_yuv444_c(void **dst, const void **
             Tin *srcP = srcCLine;
             const int x_fin = width - crop_right - crop_left;
 
-            int y_m2 = (y >= 4) ? -2 : 0;
-            int y_m1 = (y >= 2) ? -1 : 1;
-            int y_p1 = (y < uv_fin - 2) ? 1 : -1;
-            int y_p2 = (y < uv_fin - 4) ? 2 :  0;
-            int y_p3 = (y < uv_fin - 6) ? 3 : ((y < uv_fin - 2) ? 1 : -1);
+            //上下端の判定は、スレッドに割り当てられた範囲ではなくフレーム全体での位置で行う
+            const int y_dst = y_range.start_dst + y;
+            int y_m2 = (y_dst >= 4) ? -2 : 0;
+            int y_m1 = (y_dst >= 2) ? -1 : 1;
+            int y_p1 = (y_dst < uv_fin - 2) ? 1 : -1;
+            int y_p2 = (y_dst < uv_fin - 4) ? 2 :  0;
+            int y_p3 = (y_dst < uv_fin - 6) ? 3 : ((y_dst < uv_fin - 2) ? 1 : -1);
 
             int sy0x0 = srcP[y_m2*src_uv_pitch + 0];
             int sy1x0 = srcP[y_m1*src_uv_pitch + 0];
@@ -923,8 +957,10 @@ static void convert_yv12_to_p010(void **dst, const void **src, int width, int sr
 
 static const ConvertCSP funcList[] = {
 #if !FOR_AUO
+    FUNC_AVX512(RGY_CSP_NV12,     RGY_CSP_NV12,      false,  copy_nv12_to_nv12_avx512,            copy_nv12_to_nv12_avx512,            AVX512BW|AVX512F|AVX2|AVX)
     FUNC_AVX2( RGY_CSP_NV12,      RGY_CSP_NV12,      false,  copy_nv12_to_nv12_avx2,              copy_nv12_to_nv12_avx2,              AVX2|AVX)
     FUNC_SSE(  RGY_CSP_NV12,      RGY_CSP_NV12,      false,  copy_nv12_to_nv12_sse2,              copy_nv12_to_nv12_sse2,              SSE2 )
+    FUNC_AVX512(RGY_CSP_P010,     RGY_CSP_P010,      false,  copy_p010_to_p010_avx512,            copy_p010_to_p010_avx512,            AVX512BW|AVX512F|AVX2|AVX)
     FUNC_AVX2( RGY_CSP_P010,      RGY_CSP_P010,      false,  copy_p010_to_p010_avx2,              copy_p010_to_p010_avx2,              AVX2|AVX)
     FUNC_SSE(  RGY_CSP_P010,      RGY_CSP_P010,      false,  copy_p010_to_p010_sse2,              copy_p010_to_p010_sse2,              SSE2 )
 #endif
@@ -932,7 +968,7 @@ static const ConvertCSP funcList[] = {
     FUNC_AVX(  RGY_CSP_YUY2,      RGY_CSP_NV12,      false,  convert_yuy2_to_nv12_avx,            convert_yuy2_to_nv12_i_avx,          AVX )
     FUNC_SSE(  RGY_CSP_YUY2,      RGY_CSP_NV12,      false,  convert_yuy2_to_nv12_sse2,           convert_yuy2_to_nv12_i_ssse3,        SSSE3|SSE2 )
     FUNC_SSE(  RGY_CSP_YUY2,      RGY_CSP_NV12,      false,  convert_yuy2_to_nv12_sse2,           convert_yuy2_to_nv12_i_sse2,         SSE2 )
-    FUNC_SSE(  RGY_CSP_YUY2,      RGY_CSP_NV12,      false,  convert_yuy2_to_nv12,                convert_yuy2_to_nv12,                NONE )
+    FUNC_SSE(  RGY_CSP_YUY2,      RGY_CSP_NV12,      false,  convert_yuy2_to_nv12,                convert_yuy2_to_nv12_i,              NONE )
     FUNC_SSE(  RGY_CSP_YUY2,      RGY_CSP_YUV444,    false,  convert_yuy2_to_yuv444,              convert_yuy2_to_yuv444,              NONE )
 #if FOR_AUO
     FUNC_SSE(  RGY_CSP_YC48,      RGY_CSP_YUV444,    false,  convert_yc48_to_yuv444_avx,          convert_yc48_to_yuv444_avx,          AVX )
@@ -956,10 +992,14 @@ static const ConvertCSP funcList[] = {
     FUNC_SSE( RGY_CSP_YUV444_16,  RGY_CSP_YC48,      false,  convert_yuv444_16bit_to_yc48_sse2,   convert_yuv444_16bit_to_yc48_sse2,   SSE2 )
 #endif
 #if ENABLE_AVSW_READER || ENABLE_AVI_READER || ENABLE_AVISYNTH_READER || ENABLE_VAPOURSYNTH_READER || ENABLE_AVI_READER || ENABLE_RAW_READER
+    FUNC_AVX512VBMI(RGY_CSP_YV12, RGY_CSP_NV12, false, convert_yv12_to_nv12_avx512vbmi, convert_yv12_to_nv12_avx512vbmi, AVX512VBMI|AVX512BW|AVX512F|AVX2|AVX)
+    FUNC_AVX512(RGY_CSP_YV12, RGY_CSP_NV12, false, convert_yv12_to_nv12_avx512,   convert_yv12_to_nv12_avx512,   AVX512BW|AVX512F|AVX2|AVX)
     FUNC_AVX2( RGY_CSP_YV12, RGY_CSP_NV12, false, convert_yv12_to_nv12_avx2,     convert_yv12_to_nv12_avx2,     AVX2|AVX)
     FUNC_AVX(  RGY_CSP_YV12, RGY_CSP_NV12, false, convert_yv12_to_nv12_avx,      convert_yv12_to_nv12_avx,      AVX )
     FUNC_SSE(  RGY_CSP_YV12, RGY_CSP_NV12, false, convert_yv12_to_nv12_sse2,     convert_yv12_to_nv12_sse2,     SSE2 )
     FUNC_SSE(  RGY_CSP_YV12, RGY_CSP_YUV444, false, convert_yv12_p_to_yuv444,    convert_yv12_i_to_yuv444,      NONE )
+    FUNC_AVX512VBMI(RGY_CSP_YV12, RGY_CSP_NV12, true,  convert_uv_yv12_to_nv12_avx512vbmi, convert_uv_yv12_to_nv12_avx512vbmi, AVX512VBMI|AVX512BW|AVX512F|AVX2|AVX)
+    FUNC_AVX512(RGY_CSP_YV12, RGY_CSP_NV12, true,  convert_uv_yv12_to_nv12_avx512, convert_uv_yv12_to_nv12_avx512, AVX512BW|AVX512F|AVX2|AVX)
     FUNC_AVX2( RGY_CSP_YV12, RGY_CSP_NV12, true,  convert_uv_yv12_to_nv12_avx2,  convert_uv_yv12_to_nv12_avx2,  AVX2|AVX )
     FUNC_AVX(  RGY_CSP_YV12, RGY_CSP_NV12, true,  convert_uv_yv12_to_nv12_avx,   convert_uv_yv12_to_nv12_avx,   AVX )
     FUNC_SSE(  RGY_CSP_YV12, RGY_CSP_NV12, true,  convert_uv_yv12_to_nv12_sse2,  convert_uv_yv12_to_nv12_sse2,  SSE2 )
@@ -999,6 +1039,7 @@ static const ConvertCSP funcList[] = {
     FUNC_SSE(  RGY_CSP_RGB24,  RGY_CSP_RGB24, false, convert_rgb24_to_rgb24_sse2,      convert_rgb24_to_rgb24_sse2,      SSE2 )
     FUNC_SSE(  RGY_CSP_RGB24R, RGY_CSP_RGB24, false, convert_rgb24r_to_rgb24_sse2,     convert_rgb24r_to_rgb24_sse2,     SSE2 )
 
+    FUNC_AVX512(RGY_CSP_YV12,     RGY_CSP_P010,      false, convert_yv12_to_p010_avx512,         convert_yv12_to_p010_avx512,  AVX512BW|AVX512F|AVX2|AVX)
     FUNC_AVX2( RGY_CSP_YV12,      RGY_CSP_P010,      false, convert_yv12_to_p010_avx2,           convert_yv12_to_p010_avx2,    AVX2|AVX )
     FUNC_AVX(  RGY_CSP_YV12,      RGY_CSP_P010,      false, convert_yv12_to_p010_avx,            convert_yv12_to_p010_avx,     AVX )
     FUNC_SSE(  RGY_CSP_YV12,      RGY_CSP_P010,      false, convert_yv12_to_p010_sse2,           convert_yv12_to_p010_sse2,    SSE2 )
@@ -1014,14 +1055,19 @@ static const ConvertCSP funcList[] = {
     FUNC_SSE(  RGY_CSP_YV12_10,   RGY_CSP_NV12,      false, convert_yv12_10_to_nv12_sse2,        convert_yv12_10_to_nv12_sse2, SSE2 )
     FUNC_AVX2( RGY_CSP_YV12_09,   RGY_CSP_NV12,      false, convert_yv12_09_to_nv12_avx2,        convert_yv12_09_to_nv12_avx2, AVX2|AVX )
     FUNC_SSE(  RGY_CSP_YV12_09,   RGY_CSP_NV12,      false, convert_yv12_09_to_nv12_sse2,        convert_yv12_09_to_nv12_sse2, SSE2 )
+    FUNC_AVX512(RGY_CSP_YV12_16,  RGY_CSP_P010,      false, convert_yv12_16_to_p010_avx512,      convert_yv12_16_to_p010_avx512, AVX512BW|AVX512F|AVX2|AVX)
     FUNC_AVX2( RGY_CSP_YV12_16,   RGY_CSP_P010,      false, convert_yv12_16_to_p010_avx2,        convert_yv12_16_to_p010_avx2, AVX2|AVX )
     FUNC_SSE(  RGY_CSP_YV12_16,   RGY_CSP_P010,      false, convert_yv12_16_to_p010_sse2,        convert_yv12_16_to_p010_sse2, SSE2 )
+    FUNC_AVX512(RGY_CSP_YV12_14,  RGY_CSP_P010,      false, convert_yv12_14_to_p010_avx512,      convert_yv12_14_to_p010_avx512, AVX512BW|AVX512F|AVX2|AVX)
     FUNC_AVX2( RGY_CSP_YV12_14,   RGY_CSP_P010,      false, convert_yv12_14_to_p010_avx2,        convert_yv12_14_to_p010_avx2, AVX2|AVX )
     FUNC_SSE(  RGY_CSP_YV12_14,   RGY_CSP_P010,      false, convert_yv12_14_to_p010_sse2,        convert_yv12_14_to_p010_sse2, SSE2 )
+    FUNC_AVX512(RGY_CSP_YV12_12,  RGY_CSP_P010,      false, convert_yv12_12_to_p010_avx512,      convert_yv12_12_to_p010_avx512, AVX512BW|AVX512F|AVX2|AVX)
     FUNC_AVX2( RGY_CSP_YV12_12,   RGY_CSP_P010,      false, convert_yv12_12_to_p010_avx2,        convert_yv12_12_to_p010_avx2, AVX2|AVX )
     FUNC_SSE(  RGY_CSP_YV12_12,   RGY_CSP_P010,      false, convert_yv12_12_to_p010_sse2,        convert_yv12_12_to_p010_sse2, SSE2 )
+    FUNC_AVX512(RGY_CSP_YV12_10,  RGY_CSP_P010,      false, convert_yv12_10_to_p010_avx512,      convert_yv12_10_to_p010_avx512, AVX512BW|AVX512F|AVX2|AVX)
     FUNC_AVX2( RGY_CSP_YV12_10,   RGY_CSP_P010,      false, convert_yv12_10_to_p010_avx2,        convert_yv12_10_to_p010_avx2, AVX2|AVX )
     FUNC_SSE(  RGY_CSP_YV12_10,   RGY_CSP_P010,      false, convert_yv12_10_to_p010_sse2,        convert_yv12_10_to_p010_sse2, SSE2 )
+    FUNC_AVX512(RGY_CSP_YV12_09,  RGY_CSP_P010,      false, convert_yv12_09_to_p010_avx512,      convert_yv12_09_to_p010_avx512, AVX512BW|AVX512F|AVX2|AVX)
     FUNC_AVX2( RGY_CSP_YV12_09,   RGY_CSP_P010,      false, convert_yv12_09_to_p010_avx2,        convert_yv12_09_to_p010_avx2, AVX2|AVX )
     FUNC_SSE(  RGY_CSP_YV12_09,   RGY_CSP_P010,      false, convert_yv12_09_to_p010_sse2,        convert_yv12_09_to_p010_sse2, SSE2 )
     FUNC_AVX2( RGY_CSP_YV12_16,   RGY_CSP_YUV444,    false, convert_yv12_16_p_to_yuv444,         convert_yv12_16_i_to_yuv444,  NONE )
@@ -1044,6 +1090,7 @@ static const ConvertCSP funcList[] = {
     FUNC_SSE(  RGY_CSP_YUV422_09, RGY_CSP_P210,      false, convert_yuv422_09_to_p210_sse2,      convert_yuv422_09_to_p210_sse2, SSE2)
     FUNC_SSE(  RGY_CSP_YUV444,    RGY_CSP_NV12,      false, convert_yuv444_to_nv12_p,            convert_yuv444_to_nv12_i, NONE )
     FUNC_SSE(  RGY_CSP_YUV444,    RGY_CSP_P010,      false, convert_yuv444_to_p010_p,            convert_yuv444_to_p010_i, NONE )
+    FUNC_AVX512(RGY_CSP_YUV444,   RGY_CSP_YUV444,    false, copy_yuv444_to_yuv444_avx512,        copy_yuv444_to_yuv444_avx512, AVX512BW|AVX512F|AVX2|AVX)
     FUNC_AVX2( RGY_CSP_YUV444,    RGY_CSP_YUV444,    false, copy_yuv444_to_yuv444_avx2,          copy_yuv444_to_yuv444_avx2, AVX2|AVX )
     FUNC_SSE(  RGY_CSP_YUV444,    RGY_CSP_YUV444,    false, copy_yuv444_to_yuv444_sse2,          copy_yuv444_to_yuv444_sse2, SSE2 )
     FUNC_SSE(  RGY_CSP_YUV444_16, RGY_CSP_NV12,      false, convert_yuv444_16_to_nv12_p,         convert_yuv444_16_to_nv12_i, NONE )
@@ -1056,14 +1103,19 @@ static const ConvertCSP funcList[] = {
     FUNC_SSE(  RGY_CSP_YUV444_12, RGY_CSP_P010,      false, convert_yuv444_12_to_p010_p,         convert_yuv444_12_to_p010_i, NONE )
     FUNC_SSE(  RGY_CSP_YUV444_10, RGY_CSP_P010,      false, convert_yuv444_10_to_p010_p,         convert_yuv444_10_to_p010_i, NONE )
     FUNC_SSE(  RGY_CSP_YUV444_09, RGY_CSP_P010,      false, convert_yuv444_09_to_p010_p,         convert_yuv444_09_to_p010_i, NONE )
+    FUNC_AVX512(RGY_CSP_YUV444_16, RGY_CSP_YUV444_16, false, convert_yuv444_16_to_yuv444_16_avx512, convert_yuv444_16_to_yuv444_16_avx512, AVX512BW|AVX512F|AVX2|AVX)
     FUNC_AVX2( RGY_CSP_YUV444_16, RGY_CSP_YUV444_16, false, convert_yuv444_16_to_yuv444_16_avx2, convert_yuv444_16_to_yuv444_16_avx2, AVX2|AVX )
     FUNC_SSE(  RGY_CSP_YUV444_16, RGY_CSP_YUV444_16, false, convert_yuv444_16_to_yuv444_16_sse2, convert_yuv444_16_to_yuv444_16_sse2, SSE2 )
+    FUNC_AVX512(RGY_CSP_YUV444_14, RGY_CSP_YUV444_16, false, convert_yuv444_14_to_yuv444_16_avx512, convert_yuv444_14_to_yuv444_16_avx512, AVX512BW|AVX512F|AVX2|AVX)
     FUNC_AVX2( RGY_CSP_YUV444_14, RGY_CSP_YUV444_16, false, convert_yuv444_14_to_yuv444_16_avx2, convert_yuv444_14_to_yuv444_16_avx2, AVX2|AVX )
     FUNC_SSE(  RGY_CSP_YUV444_14, RGY_CSP_YUV444_16, false, convert_yuv444_14_to_yuv444_16_sse2, convert_yuv444_14_to_yuv444_16_sse2, SSE2 )
+    FUNC_AVX512(RGY_CSP_YUV444_12, RGY_CSP_YUV444_16, false, convert_yuv444_12_to_yuv444_16_avx512, convert_yuv444_12_to_yuv444_16_avx512, AVX512BW|AVX512F|AVX2|AVX)
     FUNC_AVX2( RGY_CSP_YUV444_12, RGY_CSP_YUV444_16, false, convert_yuv444_12_to_yuv444_16_avx2, convert_yuv444_12_to_yuv444_16_avx2, AVX2|AVX )
     FUNC_SSE(  RGY_CSP_YUV444_12, RGY_CSP_YUV444_16, false, convert_yuv444_12_to_yuv444_16_sse2, convert_yuv444_12_to_yuv444_16_sse2, SSE2 )
+    FUNC_AVX512(RGY_CSP_YUV444_10, RGY_CSP_YUV444_16, false, convert_yuv444_10_to_yuv444_16_avx512, convert_yuv444_10_to_yuv444_16_avx512, AVX512BW|AVX512F|AVX2|AVX)
     FUNC_AVX2( RGY_CSP_YUV444_10, RGY_CSP_YUV444_16, false, convert_yuv444_10_to_yuv444_16_avx2, convert_yuv444_10_to_yuv444_16_avx2, AVX2|AVX )
     FUNC_SSE(  RGY_CSP_YUV444_10, RGY_CSP_YUV444_16, false, convert_yuv444_10_to_yuv444_16_sse2, convert_yuv444_10_to_yuv444_16_sse2, SSE2 )
+    FUNC_AVX512(RGY_CSP_YUV444_09, RGY_CSP_YUV444_16, false, convert_yuv444_09_to_yuv444_16_avx512, convert_yuv444_09_to_yuv444_16_avx512, AVX512BW|AVX512F|AVX2|AVX)
     FUNC_AVX2( RGY_CSP_YUV444_09, RGY_CSP_YUV444_16, false, convert_yuv444_09_to_yuv444_16_avx2, convert_yuv444_09_to_yuv444_16_avx2, AVX2|AVX )
     FUNC_SSE(  RGY_CSP_YUV444_09, RGY_CSP_YUV444_16, false, convert_yuv444_09_to_yuv444_16_sse2, convert_yuv444_09_to_yuv444_16_sse2, SSE2 )
     FUNC_AVX2( RGY_CSP_YUV444,    RGY_CSP_YUV444_16, false, convert_yuv444_to_yuv444_16_avx2,    convert_yuv444_to_yuv444_16_avx2, AVX2|AVX )
@@ -1117,8 +1169,93 @@ const ConvertCSP *get_convert_csp_func(RGY_CSP csp_from, RGY_CSP csp_to, bool uv
     return convert;
 }
 
+RGYConvertCSP::RGYConvertCSP() : RGYConvertCSP(0) {
+}
+
+RGYConvertCSP::RGYConvertCSP(int threads) :
+    m_csp(nullptr),
+    m_csp_from(RGY_CSP_NA),
+    m_csp_to(RGY_CSP_NA),
+    m_uv_only(false),
+    m_threads(threads) {
+};
+
+RGYConvertCSP::~RGYConvertCSP() {
+};
+const ConvertCSP *RGYConvertCSP::getFunc(RGY_CSP csp_from, RGY_CSP csp_to, bool uv_only, uint32_t simd) {
+    if (m_csp == nullptr
+        || (m_csp_from != csp_from || m_csp_to != csp_to || m_uv_only != uv_only)) {
+        m_csp_from = csp_from;
+        m_csp_to = csp_to;
+        m_uv_only = uv_only;
+        m_csp = get_convert_csp_func(csp_from, csp_to, uv_only, simd);
+    }
+    return m_csp;
+}
+
+RGY_ERR RGYConvertCSP::checkSize(int width, int height, const int *crop) const {
+    if (m_csp == nullptr) {
+        return RGY_ERR_INVALID_CALL;
+    }
+    //各変換関数は色差の幅を(幅 - Crop)/2として処理するので、奇数の幅・Cropには対応しない
+    bool subsample_x = false, subsample_y = false;
+    for (const auto csp : { m_csp->csp_from, m_csp->csp_to }) {
+        const auto chromafmt = RGY_CSP_CHROMA_FORMAT[csp];
+        subsample_x |= (chromafmt == RGY_CHROMAFMT_YUV420 || chromafmt == RGY_CHROMAFMT_YUV422);
+        subsample_y |= (chromafmt == RGY_CHROMAFMT_YUV420);
+    }
+    if (subsample_x && ((width | crop[0] | crop[2]) & 1)) {
+        return RGY_ERR_INVALID_RESOLUTION;
+    }
+    if (subsample_y && ((height | crop[1] | crop[3]) & 1)) {
+        return RGY_ERR_INVALID_RESOLUTION;
+    }
+    return RGY_ERR_NONE;
+}
+
+RGY_ERR RGYConvertCSP::run(int interlaced, void **dst, const void **src, int width, int src_y_pitch_byte, int src_uv_pitch_byte, int dst_y_pitch_byte, int height, int dst_height, int *crop) {
+    auto err = checkSize(width, height, crop);
+    if (err != RGY_ERR_NONE) {
+        return err;
+    }
+    if (m_threads == 0) {
+        const int div = (m_csp->simd == 0) ? 2 : 4;
+        const int max = (m_csp->simd == 0) ? 8 : 4;
+        m_threads = (dst_y_pitch_byte % 128 != 0) ? 1 : std::min(max, ((int)get_cpu_info().physical_cores + div) / div);
+    }
+    if (m_threads <= 1) {
+        m_csp->func[interlaced](dst, src,
+            width, src_y_pitch_byte, src_uv_pitch_byte, dst_y_pitch_byte,
+            height, dst_height, 0, 1, crop);
+        return RGY_ERR_NONE;
+    }
+    //フレームをスレッド数ではなくCONVERT_TILE_ROWS行程度のタイルに分割し、
+    //空いたスレッドから順にタイルを処理させることで、遅れたスレッドがあっても負荷が偏らないようにする
+    auto pool = RGYThreadPool::shared();
+    pool->reserve(m_threads);
+    const int tiles = (std::max)(m_threads, (height + CONVERT_TILE_ROWS - 1) / CONVERT_TILE_ROWS);
+    const auto func = m_csp->func[interlaced];
+    pool->run(tiles, m_threads, [=](int tile_id, int tile_n) {
+        func(dst, src,
+            width, src_y_pitch_byte, src_uv_pitch_byte, dst_y_pitch_byte,
+            height, dst_height, tile_id, tile_n, crop);
+    });
+    return RGY_ERR_NONE;
+}
+
+std::vector<const ConvertCSP *> get_convert_csp_func_list() {
+    std::vector<const ConvertCSP *> list;
+    for (int i = 0; i < _countof(funcList); i++) {
+        list.push_back(&funcList[i]);
+    }
+    return list;
+}
+
 const TCHAR *get_simd_str(unsigned int simd) {
     static std::vector<std::pair<uint32_t, const TCHAR*>> simd_str_list = {
+        { AVX512VBMI, _T("AVX512VBMI") },
+        { AVX512BW,   _T("AVX512BW")   },
+        { AVX512F,    _T("AVX512")     },
         { AVX2,  _T("AVX2")   },
         { AVX,   _T("AVX")    },
         { SSE42, _T("SSE4.2") },
@@ -32,6 +32,7 @@
 #include <vector>
 #include <memory>
 #include "rgy_tchar.h"
+#include "rgy_err.h"
 
 #if defined(_MSC_VER)
 #ifndef RGY_FORCEINLINE
@@ -367,8 +368,31 @@ typedef struct ConvertCSP {
 } ConvertCSP;
 
 const ConvertCSP *get_convert_csp_func(RGY_CSP csp_from, RGY_CSP csp_to, bool uv_only, uint32_t simd);
+std::vector<const ConvertCSP *> get_convert_csp_func_list();
 const TCHAR *get_simd_str(unsigned int simd);
 
+class RGYConvertCSP {
+private:
+    const ConvertCSP *m_csp;
+    RGY_CSP m_csp_from;
+    RGY_CSP m_csp_to;
+    bool m_uv_only;
+    int m_threads; //変換に使用するスレッド数 (呼び出し元のスレッドを含む)
+public:
+    static const int CONVERT_TILE_ROWS = 32; //スレッドに割り当てる1タイルあたりの行数の目安
+
+    RGYConvertCSP();
+    RGYConvertCSP(int threads);
+    ~RGYConvertCSP();
+    const ConvertCSP *getFunc(RGY_CSP csp_from, RGY_CSP csp_to, bool uv_only, uint32_t simd);
+    const ConvertCSP *getFunc() const { return m_csp; };
+
+    //色差が横方向に間引かれている場合(4:2:0, 4:2:2)は幅とCrop(左右)、4:2:0では縦方向も2の倍数である必要がある
+    //対応しないサイズの場合はRGY_ERR_INVALID_RESOLUTIONを返す
+    RGY_ERR checkSize(int width, int height, const int *crop) const;
+    RGY_ERR run(int interlaced, void **dst, const void **src, int width, int src_y_pitch_byte, int src_uv_pitch_byte, int dst_y_pitch_byte, int height, int dst_height, int *crop);
+};
+
 enum RGY_FRAME_FLAGS : uint64_t {
     RGY_FRAME_FLAG_NONE     = 0x00u,
     RGY_FRAME_FLAG_RFF      = 0x01u,
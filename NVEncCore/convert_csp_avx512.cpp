@@ -0,0 +1,441 @@
+﻿// -----------------------------------------------------------------------------------------
+// QSVEnc/NVEnc by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2020 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// ------------------------------------------------------------------------------------------
+
+
+#define USE_SSE2  1
+#define USE_SSSE3 1
+#define USE_SSE41 1
+#define USE_AVX   1
+#define USE_AVX2  1
+
+#include <immintrin.h>
+#include "rgy_simd.h"
+#include <stdint.h>
+#include <string.h>
+#include "convert_csp.h"
+
+#if _MSC_VER >= 1911 && !defined(__AVX512BW__) && !defined(_DEBUG)
+static_assert(false, "do not forget to set /arch:AVX512 for this file.");
+#endif
+
+#if defined(_MSC_VER) || defined(__AVX512BW__)
+
+//下位nバイト(n<=64)を有効にするマスク
+static RGY_FORCEINLINE __mmask64 avx512_mask64(int n) {
+    return (n >= 64) ? ~0ull : ((1ull << n) - 1);
+}
+
+//下位n要素(n<=32)を有効にするマスク
+static RGY_FORCEINLINE __mmask32 avx512_mask32(int n) {
+    return (n >= 32) ? ~0u : ((1u << n) - 1);
+}
+
+//下位256bitを取り出す
+//_mm512_castsi512_si256はgccでは未初期化値を経由する実装のため、-Wmaybe-uninitializedの警告が出る
+static RGY_FORCEINLINE __m256i avx512_lower256(__m512i z) {
+    return _mm512_maskz_extracti64x4_epi64((__mmask8)0x0f, z, 0);
+}
+
+//端数はマスク付きload/storeで処理するので、行末を超えて書き込まない
+static void RGY_FORCEINLINE avx512_memcpy(uint8_t *dst, const uint8_t *src, int size) {
+    uint8_t *dst_fin = dst + size;
+    for (; dst + 256 <= dst_fin; dst += 256, src += 256) {
+        __m512i z0 = _mm512_loadu_si512((const __m512i *)(src +   0));
+        __m512i z1 = _mm512_loadu_si512((const __m512i *)(src +  64));
+        __m512i z2 = _mm512_loadu_si512((const __m512i *)(src + 128));
+        __m512i z3 = _mm512_loadu_si512((const __m512i *)(src + 192));
+        _mm512_storeu_si512((__m512i *)(dst +   0), z0);
+        _mm512_storeu_si512((__m512i *)(dst +  64), z1);
+        _mm512_storeu_si512((__m512i *)(dst + 128), z2);
+        _mm512_storeu_si512((__m512i *)(dst + 192), z3);
+    }
+    for (; dst < dst_fin; dst += 64, src += 64) {
+        const __mmask64 mask = avx512_mask64((int)(dst_fin - dst));
+        _mm512_mask_storeu_epi8(dst, mask, _mm512_maskz_loadu_epi8(mask, src));
+    }
+}
+
+#pragma warning (push)
+#pragma warning (disable: 4100)
+template<bool highbit_depth>
+void copy_nv12_to_nv12_avx512_internal(void **dst, const void **src, int width, int src_y_pitch_byte, int src_uv_pitch_byte, int dst_y_pitch_byte, int height, int dst_height, int thread_id, int thread_n, int *crop) {
+    const int crop_left   = crop[0];
+    const int crop_up     = crop[1];
+    const int crop_right  = crop[2];
+    const int crop_bottom = crop[3];
+    const int pixel_size = highbit_depth ? 2 : 1;
+    for (int i = 0; i < 2; i++) {
+        const auto y_range = thread_y_range(crop_up >> i, (height - crop_bottom) >> i, thread_id, thread_n);
+        const uint8_t *srcYLine = (const uint8_t *)src[i] + src_y_pitch_byte * y_range.start_src + crop_left * pixel_size;
+        uint8_t *dstLine = (uint8_t *)dst[i] + dst_y_pitch_byte * y_range.start_dst;
+        const int y_width = width - crop_right - crop_left;
+        for (int y = 0; y < y_range.len; y++, srcYLine += src_y_pitch_byte, dstLine += dst_y_pitch_byte) {
+            avx512_memcpy(dstLine, srcYLine, y_width * pixel_size);
+        }
+    }
+    _mm256_zeroupper();
+}
+#pragma warning (pop)
+
+void copy_nv12_to_nv12_avx512(void **dst, const void **src, int width, int src_y_pitch_byte, int src_uv_pitch_byte, int dst_y_pitch_byte, int height, int dst_height, int thread_id, int thread_n, int *crop) {
+    return copy_nv12_to_nv12_avx512_internal<false>(dst, src, width, src_y_pitch_byte, src_uv_pitch_byte, dst_y_pitch_byte, height, dst_height, thread_id, thread_n, crop);
+}
+
+void copy_p010_to_p010_avx512(void **dst, const void **src, int width, int src_y_pitch_byte, int src_uv_pitch_byte, int dst_y_pitch_byte, int height, int dst_height, int thread_id, int thread_n, int *crop) {
+    return copy_nv12_to_nv12_avx512_internal<true>(dst, src, width, src_y_pitch_byte, src_uv_pitch_byte, dst_y_pitch_byte, height, dst_height, thread_id, thread_n, crop);
+}
+
+//u, vの64byteずつをインタレースして128byteにする
+template<bool use_vbmi>
+static RGY_FORCEINLINE void interleave_uv_8bit_avx512(__m512i& z0_u_return_lower, __m512i& z1_v_return_upper) {
+#if defined(_MSC_VER) || defined(__AVX512VBMI__)
+    if (use_vbmi) {
+        //vpermt2bで1命令でインタレース
+        alignas(64) static const uint8_t SHUFFLE_MASK_LO[64] = {
+             0, 64,  1, 65,  2, 66,  3, 67,  4, 68,  5, 69,  6, 70,  7, 71,
+             8, 72,  9, 73, 10, 74, 11, 75, 12, 76, 13, 77, 14, 78, 15, 79,
+            16, 80, 17, 81, 18, 82, 19, 83, 20, 84, 21, 85, 22, 86, 23, 87,
+            24, 88, 25, 89, 26, 90, 27, 91, 28, 92, 29, 93, 30, 94, 31, 95
+        };
+        const __m512i zMaskLo = _mm512_load_si512((const __m512i *)SHUFFLE_MASK_LO);
+        const __m512i zMaskHi = _mm512_add_epi8(zMaskLo, _mm512_set1_epi8(32));
+        __m512i z0 = _mm512_permutex2var_epi8(z0_u_return_lower, zMaskLo, z1_v_return_upper);
+        __m512i z1 = _mm512_permutex2var_epi8(z0_u_return_lower, zMaskHi, z1_v_return_upper);
+        z0_u_return_lower = z0;
+        z1_v_return_upper = z1;
+        return;
+    }
+#endif
+    //128bitレーンごとに [qword k, qword k+4] となるよう並べ替えてからunpack
+    const __m512i zPermQword = _mm512_set_epi64(7, 3, 6, 2, 5, 1, 4, 0);
+    //maskなしの_mm512_permutexvar_epi64はgccで未初期化値の警告が出るので、maskz版を使う
+    __m512i z0 = _mm512_maskz_permutexvar_epi64((__mmask8)0xff, zPermQword, z0_u_return_lower);
+    __m512i z1 = _mm512_maskz_permutexvar_epi64((__mmask8)0xff, zPermQword, z1_v_return_upper);
+    z0_u_return_lower = _mm512_unpacklo_epi8(z0, z1);
+    z1_v_return_upper = _mm512_unpackhi_epi8(z0, z1);
+}
+
+//u, vの32要素ずつ(16bit)をインタレースして64要素にする
+static RGY_FORCEINLINE void interleave_uv_16bit_avx512(__m512i& z0_u_return_lower, __m512i& z1_v_return_upper) {
+    alignas(64) static const uint16_t SHUFFLE_MASK_LO[32] = {
+         0, 32,  1, 33,  2, 34,  3, 35,  4, 36,  5, 37,  6, 38,  7, 39,
+         8, 40,  9, 41, 10, 42, 11, 43, 12, 44, 13, 45, 14, 46, 15, 47
+    };
+    const __m512i zMaskLo = _mm512_load_si512((const __m512i *)SHUFFLE_MASK_LO);
+    const __m512i zMaskHi = _mm512_add_epi16(zMaskLo, _mm512_set1_epi16(16));
+    __m512i z0 = _mm512_permutex2var_epi16(z0_u_return_lower, zMaskLo, z1_v_return_upper);
+    __m512i z1 = _mm512_permutex2var_epi16(z0_u_return_lower, zMaskHi, z1_v_return_upper);
+    z0_u_return_lower = z0;
+    z1_v_return_upper = z1;
+}
+
+#pragma warning (push)
+#pragma warning (disable: 4100)
+#pragma warning (disable: 4127)
+template<bool uv_only, bool use_vbmi>
+static void RGY_FORCEINLINE convert_yv12_to_nv12_avx512_base(void **dst, const void **src, int width, int src_y_pitch_byte, int src_uv_pitch_byte, int dst_y_pitch_byte, int height, int dst_height, int thread_id, int thread_n, int *crop) {
+    const int crop_left   = crop[0];
+    const int crop_up     = crop[1];
+    const int crop_right  = crop[2];
+    const int crop_bottom = crop[3];
+    //Y成分のコピー
+    if (!uv_only) {
+        const auto y_range = thread_y_range(crop_up, height - crop_bottom, thread_id, thread_n);
+        uint8_t *srcYLine = (uint8_t *)src[0] + src_y_pitch_byte * y_range.start_src + crop_left;
+        uint8_t *dstLine = (uint8_t *)dst[0] + dst_y_pitch_byte * y_range.start_dst;
+        const int y_width = width - crop_right - crop_left;
+        for (int y = 0; y < y_range.len; y++, srcYLine += src_y_pitch_byte, dstLine += dst_y_pitch_byte) {
+            avx512_memcpy(dstLine, srcYLine, y_width);
+        }
+    }
+    //UV成分のコピー
+    const auto uv_range = thread_y_range(crop_up >> 1, (height - crop_bottom) >> 1, thread_id, thread_n);
+    uint8_t *srcULine = (uint8_t *)src[1] + ((src_uv_pitch_byte * uv_range.start_src) + (crop_left >> 1));
+    uint8_t *srcVLine = (uint8_t *)src[2] + ((src_uv_pitch_byte * uv_range.start_src) + (crop_left >> 1));
+    uint8_t *dstLine = (uint8_t *)dst[1] + dst_y_pitch_byte * uv_range.start_dst;
+    const int x_fin = width - crop_right;
+    for (int y = 0; y < uv_range.len; y++, srcULine += src_uv_pitch_byte, srcVLine += src_uv_pitch_byte, dstLine += dst_y_pitch_byte) {
+        uint8_t *src_u_ptr = srcULine;
+        uint8_t *src_v_ptr = srcVLine;
+        uint8_t *dst_ptr = dstLine;
+        __m512i z0, z1;
+        int x = crop_left;
+        for (; x + 128 <= x_fin; x += 128, src_u_ptr += 64, src_v_ptr += 64, dst_ptr += 128) {
+            z0 = _mm512_loadu_si512((const __m512i *)src_u_ptr);
+            z1 = _mm512_loadu_si512((const __m512i *)src_v_ptr);
+            interleave_uv_8bit_avx512<use_vbmi>(z0, z1);
+            _mm512_storeu_si512((__m512i *)(dst_ptr +  0), z0);
+            _mm512_storeu_si512((__m512i *)(dst_ptr + 64), z1);
+        }
+        if (x < x_fin) {
+            const int remain = x_fin - x;
+            const __mmask64 mask_src = avx512_mask64((remain + 1) >> 1);
+            z0 = _mm512_maskz_loadu_epi8(mask_src, src_u_ptr);
+            z1 = _mm512_maskz_loadu_epi8(mask_src, src_v_ptr);
+            interleave_uv_8bit_avx512<use_vbmi>(z0, z1);
+            _mm512_mask_storeu_epi8(dst_ptr +  0, avx512_mask64(remain), z0);
+            if (remain > 64) {
+                _mm512_mask_storeu_epi8(dst_ptr + 64, avx512_mask64(remain - 64), z1);
+            }
+        }
+    }
+    _mm256_zeroupper();
+}
+
+template<bool uv_only>
+static void RGY_FORCEINLINE convert_yv12_to_p010_avx512_base(void **dst, const void **src, int width, int src_y_pitch_byte, int src_uv_pitch_byte, int dst_y_pitch_byte, int height, int dst_height, int thread_id, int thread_n, int *crop) {
+    const int crop_left   = crop[0];
+    const int crop_up     = crop[1];
+    const int crop_right  = crop[2];
+    const int crop_bottom = crop[3];
+    const __m512i zOffset = _mm512_set1_epi16(2 << 6);
+    //Y成分のコピー
+    if (!uv_only) {
+        const auto y_range = thread_y_range(crop_up, height - crop_bottom, thread_id, thread_n);
+        uint8_t *srcYLine = (uint8_t *)src[0] + src_y_pitch_byte * y_range.start_src + crop_left;
+        uint8_t *dstLine  = (uint8_t *)dst[0] + dst_y_pitch_byte * y_range.start_dst;
+        const int y_width = width - crop_right - crop_left;
+        for (int y = 0; y < y_range.len; y++, srcYLine += src_y_pitch_byte, dstLine += dst_y_pitch_byte) {
+            uint16_t *dst_ptr = (uint16_t *)dstLine;
+            uint8_t *src_ptr = srcYLine;
+            for (int x = 0; x < y_width; x += 32, dst_ptr += 32, src_ptr += 32) {
+                const __mmask32 mask = avx512_mask32(y_width - x);
+                __m512i z0 = _mm512_cvtepu8_epi16(avx512_lower256(_mm512_maskz_loadu_epi8(mask, src_ptr)));
+                z0 = _mm512_add_epi16(_mm512_slli_epi16(z0, 8), zOffset);
+                _mm512_mask_storeu_epi16(dst_ptr, mask, z0);
+            }
+        }
+    }
+    //UV成分のコピー
+    const auto uv_range = thread_y_range(crop_up >> 1, (height - crop_bottom) >> 1, thread_id, thread_n);
+    uint8_t *srcULine = (uint8_t *)src[1] + ((src_uv_pitch_byte * uv_range.start_src) + (crop_left >> 1));
+    uint8_t *srcVLine = (uint8_t *)src[2] + ((src_uv_pitch_byte * uv_range.start_src) + (crop_left >> 1));
+    uint8_t *dstLine  = (uint8_t *)dst[1] + dst_y_pitch_byte * uv_range.start_dst;
+    const int x_fin = width - crop_right;
+    for (int y = 0; y < uv_range.len; y++, srcULine += src_uv_pitch_byte, srcVLine += src_uv_pitch_byte, dstLine += dst_y_pitch_byte) {
+        uint8_t *src_u_ptr = srcULine;
+        uint8_t *src_v_ptr = srcVLine;
+        uint16_t *dst_ptr = (uint16_t *)dstLine;
+        for (int x = crop_left; x < x_fin; x += 64, src_u_ptr += 32, src_v_ptr += 32, dst_ptr += 64) {
+            const int remain = x_fin - x;
+            const __mmask32 mask_src = avx512_mask32((remain + 1) >> 1);
+            __m512i z0 = _mm512_cvtepu8_epi16(avx512_lower256(_mm512_maskz_loadu_epi8(mask_src, src_u_ptr)));
+            __m512i z1 = _mm512_cvtepu8_epi16(avx512_lower256(_mm512_maskz_loadu_epi8(mask_src, src_v_ptr)));
+            z0 = _mm512_add_epi16(_mm512_slli_epi16(z0, 8), zOffset);
+            z1 = _mm512_add_epi16(_mm512_slli_epi16(z1, 8), zOffset);
+            interleave_uv_16bit_avx512(z0, z1);
+            _mm512_mask_storeu_epi16(dst_ptr +  0, avx512_mask32(remain), z0);
+            if (remain > 32) {
+                _mm512_mask_storeu_epi16(dst_ptr + 32, avx512_mask32(remain - 32), z1);
+            }
+        }
+    }
+    _mm256_zeroupper();
+}
+
+template<int in_bit_depth, bool uv_only>
+static void RGY_FORCEINLINE convert_yv12_high_to_p010_avx512_base(void **dst, const void **src, int width, int src_y_pitch_byte, int src_uv_pitch_byte, int dst_y_pitch_byte, int height, int dst_height, int thread_id, int thread_n, int *crop) {
+    static_assert(8 < in_bit_depth && in_bit_depth <= 16, "in_bit_depth must be 9-16.");
+    const int crop_left   = crop[0];
+    const int crop_up     = crop[1];
+    const int crop_right  = crop[2];
+    const int crop_bottom = crop[3];
+    const int src_y_pitch = src_y_pitch_byte >> 1;
+    const int dst_y_pitch = dst_y_pitch_byte >> 1;
+    //Y成分のコピー
+    if (!uv_only) {
+        const auto y_range = thread_y_range(crop_up, height - crop_bottom, thread_id, thread_n);
+        uint16_t *srcYLine = (uint16_t *)src[0] + src_y_pitch * y_range.start_src + crop_left;
+        uint16_t *dstLine = (uint16_t *)dst[0] + dst_y_pitch * y_range.start_dst;
+        const int y_width = width - crop_right - crop_left;
+        for (int y = 0; y < y_range.len; y++, srcYLine += src_y_pitch, dstLine += dst_y_pitch) {
+            if (in_bit_depth == 16) {
+                avx512_memcpy((uint8_t *)dstLine, (uint8_t *)srcYLine, y_width * (int)sizeof(uint16_t));
+            } else {
+                uint16_t *src_ptr = srcYLine;
+                uint16_t *dst_ptr = dstLine;
+                int x = 0;
+                for (; x + 64 <= y_width; x += 64, dst_ptr += 64, src_ptr += 64) {
+                    __m512i z0 = _mm512_loadu_si512((const __m512i *)(src_ptr +  0));
+                    __m512i z1 = _mm512_loadu_si512((const __m512i *)(src_ptr + 32));
+                    z0 = _mm512_slli_epi16(z0, 16 - in_bit_depth);
+                    z1 = _mm512_slli_epi16(z1, 16 - in_bit_depth);
+                    _mm512_storeu_si512((__m512i *)(dst_ptr +  0), z0);
+                    _mm512_storeu_si512((__m512i *)(dst_ptr + 32), z1);
+                }
+                for (; x < y_width; x += 32, dst_ptr += 32, src_ptr += 32) {
+                    const __mmask32 mask = avx512_mask32(y_width - x);
+                    __m512i z0 = _mm512_maskz_loadu_epi16(mask, src_ptr);
+                    z0 = _mm512_slli_epi16(z0, 16 - in_bit_depth);
+                    _mm512_mask_storeu_epi16(dst_ptr, mask, z0);
+                }
+            }
+        }
+    }
+    //UV成分のコピー
+    const auto uv_range = thread_y_range(crop_up >> 1, (height - crop_bottom) >> 1, thread_id, thread_n);
+    const int src_uv_pitch = src_uv_pitch_byte >> 1;
+    uint16_t *srcULine = (uint16_t *)src[1] + ((src_uv_pitch * uv_range.start_src) + (crop_left >> 1));
+    uint16_t *srcVLine = (uint16_t *)src[2] + ((src_uv_pitch * uv_range.start_src) + (crop_left >> 1));
+    uint16_t *dstLine = (uint16_t *)dst[1] + dst_y_pitch * uv_range.start_dst;
+    const int x_fin = width - crop_right;
+    for (int y = 0; y < uv_range.len; y++, srcULine += src_uv_pitch, srcVLine += src_uv_pitch, dstLine += dst_y_pitch) {
+        uint16_t *src_u_ptr = srcULine;
+        uint16_t *src_v_ptr = srcVLine;
+        uint16_t *dst_ptr = dstLine;
+        for (int x = crop_left; x < x_fin; x += 64, src_u_ptr += 32, src_v_ptr += 32, dst_ptr += 64) {
+            const int remain = x_fin - x;
+            const __mmask32 mask_src = avx512_mask32((remain + 1) >> 1);
+            __m512i z0 = _mm512_maskz_loadu_epi16(mask_src, src_u_ptr);
+            __m512i z1 = _mm512_maskz_loadu_epi16(mask_src, src_v_ptr);
+            if (in_bit_depth < 16) {
+                z0 = _mm512_slli_epi16(z0, 16 - in_bit_depth);
+                z1 = _mm512_slli_epi16(z1, 16 - in_bit_depth);
+            }
+            interleave_uv_16bit_avx512(z0, z1);
+            _mm512_mask_storeu_epi16(dst_ptr +  0, avx512_mask32(remain), z0);
+            if (remain > 32) {
+                _mm512_mask_storeu_epi16(dst_ptr + 32, avx512_mask32(remain - 32), z1);
+            }
+        }
+    }
+    _mm256_zeroupper();
+}
+
+template<int in_bit_depth>
+static void RGY_FORCEINLINE convert_yuv444_high_to_yuv444_16_avx512_base(void **dst, const void **src, int width, int src_y_pitch_byte, int src_uv_pitch_byte, int dst_y_pitch_byte, int height, int dst_height, int thread_id, int thread_n, int *crop) {
+    static_assert(8 < in_bit_depth && in_bit_depth <= 16, "in_bit_depth must be 9-16.");
+    const int crop_left   = crop[0];
+    const int crop_up     = crop[1];
+    const int crop_right  = crop[2];
+    const int crop_bottom = crop[3];
+    const int src_y_pitch = src_y_pitch_byte >> 1;
+    const int dst_y_pitch = dst_y_pitch_byte >> 1;
+    const auto y_range = thread_y_range(crop_up, height - crop_bottom, thread_id, thread_n);
+    for (int i = 0; i < 3; i++) {
+        const uint16_t *srcYLine = (const uint16_t *)src[i] + src_y_pitch * y_range.start_src + crop_left;
+        uint16_t *dstLine = (uint16_t *)dst[i] + dst_y_pitch * y_range.start_dst;
+        const int y_width = width - crop_right - crop_left;
+        for (int y = 0; y < y_range.len; y++, srcYLine += src_y_pitch, dstLine += dst_y_pitch) {
+            if (in_bit_depth == 16) {
+                avx512_memcpy((uint8_t *)dstLine, (const uint8_t *)srcYLine, y_width * (int)sizeof(uint16_t));
+            } else {
+                const uint16_t *src_ptr = srcYLine;
+                uint16_t *dst_ptr = dstLine;
+                for (int x = 0; x < y_width; x += 32, dst_ptr += 32, src_ptr += 32) {
+                    const __mmask32 mask = avx512_mask32(y_width - x);
+                    __m512i z0 = _mm512_maskz_loadu_epi16(mask, src_ptr);
+                    z0 = _mm512_slli_epi16(z0, 16 - in_bit_depth);
+                    _mm512_mask_storeu_epi16(dst_ptr, mask, z0);
+                }
+            }
+        }
+    }
+    _mm256_zeroupper();
+}
+
+void copy_yuv444_to_yuv444_avx512(void **dst, const void **src, int width, int src_y_pitch_byte, int src_uv_pitch_byte, int dst_y_pitch_byte, int height, int dst_height, int thread_id, int thread_n, int *crop) {
+    const int crop_left   = crop[0];
+    const int crop_up     = crop[1];
+    const int crop_right  = crop[2];
+    const int crop_bottom = crop[3];
+    const auto y_range = thread_y_range(crop_up, height - crop_bottom, thread_id, thread_n);
+    for (int i = 0; i < 3; i++) {
+        const uint8_t *srcYLine = (const uint8_t *)src[i] + src_y_pitch_byte * y_range.start_src + crop_left;
+        uint8_t *dstLine = (uint8_t *)dst[i] + dst_y_pitch_byte * y_range.start_dst;
+        const int y_width = width - crop_right - crop_left;
+        for (int y = 0; y < y_range.len; y++, srcYLine += src_y_pitch_byte, dstLine += dst_y_pitch_byte) {
+            avx512_memcpy(dstLine, srcYLine, y_width);
+        }
+    }
+    _mm256_zeroupper();
+}
+#pragma warning (pop)
+
+void convert_yv12_to_nv12_avx512(void **dst, const void **src, int width, int src_y_pitch_byte, int src_uv_pitch_byte, int dst_y_pitch_byte, int height, int dst_height, int thread_id, int thread_n, int *crop) {
+    convert_yv12_to_nv12_avx512_base<false, false>(dst, src, width, src_y_pitch_byte, src_uv_pitch_byte, dst_y_pitch_byte, height, dst_height, thread_id, thread_n, crop);
+}
+
+void convert_uv_yv12_to_nv12_avx512(void **dst, const void **src, int width, int src_y_pitch_byte, int src_uv_pitch_byte, int dst_y_pitch_byte, int height, int dst_height, int thread_id, int thread_n, int *crop) {
+    convert_yv12_to_nv12_avx512_base<true, false>(dst, src, width, src_y_pitch_byte, src_uv_pitch_byte, dst_y_pitch_byte, height, dst_height, thread_id, thread_n, crop);
+}
+
+#if defined(_MSC_VER) || defined(__AVX512VBMI__)
+void convert_yv12_to_nv12_avx512vbmi(void **dst, const void **src, int width, int src_y_pitch_byte, int src_uv_pitch_byte, int dst_y_pitch_byte, int height, int dst_height, int thread_id, int thread_n, int *crop) {
+    convert_yv12_to_nv12_avx512_base<false, true>(dst, src, width, src_y_pitch_byte, src_uv_pitch_byte, dst_y_pitch_byte, height, dst_height, thread_id, thread_n, crop);
+}
+
+void convert_uv_yv12_to_nv12_avx512vbmi(void **dst, const void **src, int width, int src_y_pitch_byte, int src_uv_pitch_byte, int dst_y_pitch_byte, int height, int dst_height, int thread_id, int thread_n, int *crop) {
+    convert_yv12_to_nv12_avx512_base<true, true>(dst, src, width, src_y_pitch_byte, src_uv_pitch_byte, dst_y_pitch_byte, height, dst_height, thread_id, thread_n, crop);
+}
+#endif //#if defined(_MSC_VER) || defined(__AVX512VBMI__)
+
+void convert_yv12_to_p010_avx512(void **dst, const void **src, int width, int src_y_pitch_byte, int src_uv_pitch_byte, int dst_y_pitch_byte, int height, int dst_height, int thread_id, int thread_n, int *crop) {
+    convert_yv12_to_p010_avx512_base<false>(dst, src, width, src_y_pitch_byte, src_uv_pitch_byte, dst_y_pitch_byte, height, dst_height, thread_id, thread_n, crop);
+}
+
+void convert_yv12_16_to_p010_avx512(void **dst, const void **src, int width, int src_y_pitch_byte, int src_uv_pitch_byte, int dst_y_pitch_byte, int height, int dst_height, int thread_id, int thread_n, int *crop) {
+    convert_yv12_high_to_p010_avx512_base<16, false>(dst, src, width, src_y_pitch_byte, src_uv_pitch_byte, dst_y_pitch_byte, height, dst_height, thread_id, thread_n, crop);
+}
+
+void convert_yv12_14_to_p010_avx512(void **dst, const void **src, int width, int src_y_pitch_byte, int src_uv_pitch_byte, int dst_y_pitch_byte, int height, int dst_height, int thread_id, int thread_n, int *crop) {
+    convert_yv12_high_to_p010_avx512_base<14, false>(dst, src, width, src_y_pitch_byte, src_uv_pitch_byte, dst_y_pitch_byte, height, dst_height, thread_id, thread_n, crop);
+}
+
+void convert_yv12_12_to_p010_avx512(void **dst, const void **src, int width, int src_y_pitch_byte, int src_uv_pitch_byte, int dst_y_pitch_byte, int height, int dst_height, int thread_id, int thread_n, int *crop) {
+    convert_yv12_high_to_p010_avx512_base<12, false>(dst, src, width, src_y_pitch_byte, src_uv_pitch_byte, dst_y_pitch_byte, height, dst_height, thread_id, thread_n, crop);
+}
+
+void convert_yv12_10_to_p010_avx512(void **dst, const void **src, int width, int src_y_pitch_byte, int src_uv_pitch_byte, int dst_y_pitch_byte, int height, int dst_height, int thread_id, int thread_n, int *crop) {
+    convert_yv12_high_to_p010_avx512_base<10, false>(dst, src, width, src_y_pitch_byte, src_uv_pitch_byte, dst_y_pitch_byte, height, dst_height, thread_id, thread_n, crop);
+}
+
+void convert_yv12_09_to_p010_avx512(void **dst, const void **src, int width, int src_y_pitch_byte, int src_uv_pitch_byte, int dst_y_pitch_byte, int height, int dst_height, int thread_id, int thread_n, int *crop) {
+    convert_yv12_high_to_p010_avx512_base<9, false>(dst, src, width, src_y_pitch_byte, src_uv_pitch_byte, dst_y_pitch_byte, height, dst_height, thread_id, thread_n, crop);
+}
+
+void convert_yuv444_16_to_yuv444_16_avx512(void **dst, const void **src, int width, int src_y_pitch_byte, int src_uv_pitch_byte, int dst_y_pitch_byte, int height, int dst_height, int thread_id, int thread_n, int *crop) {
+    convert_yuv444_high_to_yuv444_16_avx512_base<16>(dst, src, width, src_y_pitch_byte, src_uv_pitch_byte, dst_y_pitch_byte, height, dst_height, thread_id, thread_n, crop);
+}
+
+void convert_yuv444_14_to_yuv444_16_avx512(void **dst, const void **src, int width, int src_y_pitch_byte, int src_uv_pitch_byte, int dst_y_pitch_byte, int height, int dst_height, int thread_id, int thread_n, int *crop) {
+    convert_yuv444_high_to_yuv444_16_avx512_base<14>(dst, src, width, src_y_pitch_byte, src_uv_pitch_byte, dst_y_pitch_byte, height, dst_height, thread_id, thread_n, crop);
+}
+
+void convert_yuv444_12_to_yuv444_16_avx512(void **dst, const void **src, int width, int src_y_pitch_byte, int src_uv_pitch_byte, int dst_y_pitch_byte, int height, int dst_height, int thread_id, int thread_n, int *crop) {
+    convert_yuv444_high_to_yuv444_16_avx512_base<12>(dst, src, width, src_y_pitch_byte, src_uv_pitch_byte, dst_y_pitch_byte, height, dst_height, thread_id, thread_n, crop);
+}
+
+void convert_yuv444_10_to_yuv444_16_avx512(void **dst, const void **src, int width, int src_y_pitch_byte, int src_uv_pitch_byte, int dst_y_pitch_byte, int height, int dst_height, int thread_id, int thread_n, int *crop) {
+    convert_yuv444_high_to_yuv444_16_avx512_base<10>(dst, src, width, src_y_pitch_byte, src_uv_pitch_byte, dst_y_pitch_byte, height, dst_height, thread_id, thread_n, crop);
+}
+
+void convert_yuv444_09_to_yuv444_16_avx512(void **dst, const void **src, int width, int src_y_pitch_byte, int src_uv_pitch_byte, int dst_y_pitch_byte, int height, int dst_height, int thread_id, int thread_n, int *crop) {
+    convert_yuv444_high_to_yuv444_16_avx512_base<9>(dst, src, width, src_y_pitch_byte, src_uv_pitch_byte, dst_y_pitch_byte, height, dst_height, thread_id, thread_n, crop);
+}
+
+#endif //#if defined(_MSC_VER) || defined(__AVX512BW__)
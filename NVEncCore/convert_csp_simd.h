@@ -125,7 +125,7 @@ static void RGY_FORCEINLINE copy_nv12_to_nv12(void **dst, const void **src, int
     const int pixel_size = highbit_depth ? 2 : 1;
     for (int i = 0; i < 2; i++) {
         const auto y_range = thread_y_range(crop_up >> i, (height - crop_bottom) >> i, thread_id, thread_n);
-        uint8_t *srcYLine = (uint8_t *)src[i] + src_y_pitch_byte * y_range.start_src + crop_left;
+        uint8_t *srcYLine = (uint8_t *)src[i] + src_y_pitch_byte * y_range.start_src + crop_left * pixel_size;
         uint8_t *dstLine = (uint8_t *)dst[i] + dst_y_pitch_byte * y_range.start_dst;
         const int y_width = width - crop_right - crop_left;
         for (int y = 0; y < y_range.len; y++, srcYLine += src_y_pitch_byte, dstLine += dst_y_pitch_byte) {
@@ -433,7 +433,7 @@ static void RGY_FORCEINLINE convert_rgb24r_to_rgb32_simd(void **dst, const void
     const int crop_bottom = crop[3];
     const auto y_range = thread_y_range(crop_up, height - crop_bottom, thread_id, thread_n);
     uint8_t *srcLine = (uint8_t *)src[0] + (src_y_pitch_byte * ((y_range.start_src + y_range.len) - 1)) + crop_left * 3;;
-    uint8_t *dstLine = (uint8_t *)dst[0] + (dst_y_pitch_byte * y_range.start_dst);
+    uint8_t *dstLine = (uint8_t *)dst[0] + (dst_y_pitch_byte * ((height - crop_up - crop_bottom) - (y_range.start_dst + y_range.len)));
     alignas(16) const char MASK_RGB3_TO_RGB4[] = { 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1 };
     __m128i xMask = _mm_load_si128((__m128i*)MASK_RGB3_TO_RGB4);
     for (int y = 0; y  < y_range.len; y++, srcLine -= src_y_pitch_byte, dstLine += dst_y_pitch_byte) {
@@ -474,7 +474,7 @@ static void RGY_FORCEINLINE convert_rgb24_to_rgb_simd(void **dst, const void **s
     uint8_t *dst0Line = (uint8_t *)dst[(plane_from >>  0) & 0xff] + dst_y_pitch_byte * y_range.start_dst;
     uint8_t *dst1Line = (uint8_t *)dst[(plane_from >>  8) & 0xff] + dst_y_pitch_byte * y_range.start_dst;
     uint8_t *dst2Line = (uint8_t *)dst[(plane_from >> 16) & 0xff] + dst_y_pitch_byte * y_range.start_dst;
-    uint8_t *srcLine  = (uint8_t *)src[0] + src_y_pitch_byte * ((source_reverse) ? (height - crop_bottom - y_range.start_src - 1) : y_range.start_src) + crop_left * 3;
+    uint8_t *srcLine  = (uint8_t *)src[0] + src_y_pitch_byte * ((source_reverse) ? (height - crop_bottom - 1 - y_range.start_dst) : y_range.start_src) + crop_left * 3;
     alignas(16) const char MASK_RGB_TO_RGB24[] = {
         0,  3,  6,  9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
         1,  4,  7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
@@ -510,8 +510,9 @@ static void RGY_FORCEINLINE convert_rgb24_to_rgb_simd(void **dst, const void **s
             _mm_storeu_si128((__m128i *)ptr_dst1, x1);
             _mm_storeu_si128((__m128i *)ptr_dst2, x2);
         }
-        if (width & 15) {
-            int x_offset = (16 - (width & 15));
+        const int x_width = width - crop_left - crop_right;
+        if (x_width & 15) {
+            int x_offset = (16 - (x_width & 15));
             ptr_src -= x_offset * 3;
             ptr_dst0 -= x_offset;
             ptr_dst1 -= x_offset;
@@ -577,8 +578,9 @@ static void RGY_FORCEINLINE convert_rgb_to_rgb24_simd(void **dst, const void **s
             _mm_storeu_si128((__m128i *)(ptr_dst + 16), x1);
             _mm_storeu_si128((__m128i *)(ptr_dst + 32), x2);
         }
-        if (width & 15) {
-            int x_offset = (16 - (width & 15));
+        const int x_width = width - crop_left - crop_right;
+        if (x_width & 15) {
+            int x_offset = (16 - (x_width & 15));
             ptr_dst -= x_offset * 3;
             ptr_srcR -= x_offset;
             ptr_srcG -= x_offset;
@@ -613,7 +615,7 @@ static void RGY_FORCEINLINE convert_rgb32_to_rgb_simd(void **dst, const void **s
     uint8_t *dst0Line = (uint8_t *)dst[(plane_from >>  0) & 0xff] + dst_y_pitch_byte * y_range.start_dst;
     uint8_t *dst1Line = (uint8_t *)dst[(plane_from >>  8) & 0xff] + dst_y_pitch_byte * y_range.start_dst;
     uint8_t *dst2Line = (uint8_t *)dst[(plane_from >> 16) & 0xff] + dst_y_pitch_byte * y_range.start_dst;
-    uint8_t *srcLine  = (uint8_t *)src[0] + src_y_pitch_byte * ((source_reverse) ? (height - crop_bottom - y_range.start_src - 1) : y_range.start_src) + crop_left * 4;
+    uint8_t *srcLine  = (uint8_t *)src[0] + src_y_pitch_byte * ((source_reverse) ? (height - crop_bottom - 1 - y_range.start_dst) : y_range.start_src) + crop_left * 4;
     __m128i xMask = _mm_set1_epi16(0xff);
     if (source_reverse) {
         src_y_pitch_byte = -1 * src_y_pitch_byte;
@@ -644,9 +646,10 @@ static void RGY_FORCEINLINE convert_rgb32_to_rgb_simd(void **dst, const void **s
             _mm_storeu_si128((__m128i *)ptr_dst1, x1);
             _mm_storeu_si128((__m128i *)ptr_dst2, x2);
         }
-        if (width & 15) {
-            int x_offset = (16 - (width & 15));
-            ptr_src -= x_offset * 3;
+        const int x_width = width - crop_left - crop_right;
+        if (x_width & 15) {
+            int x_offset = (16 - (x_width & 15));
+            ptr_src -= x_offset * 4;
             ptr_dst0 -= x_offset;
             ptr_dst1 -= x_offset;
             ptr_dst2 -= x_offset;
@@ -709,9 +712,10 @@ static void RGY_FORCEINLINE convert_rgb_to_rgb32_simd(void **dst, const void **s
             _mm_storeu_si128((__m128i *)(ptr_dst + 32), x2);
             _mm_storeu_si128((__m128i *)(ptr_dst + 48), x3);
         }
-        if (width & 15) {
-            int x_offset = (16 - (width & 15));
-            ptr_dst -= x_offset * 3;
+        const int x_width = width - crop_left - crop_right;
+        if (x_width & 15) {
+            int x_offset = (16 - (x_width & 15));
+            ptr_dst -= x_offset * 4;
             ptr_srcR -= x_offset;
             ptr_srcG -= x_offset;
             ptr_srcB -= x_offset;
@@ -818,7 +822,7 @@ static void RGY_FORCEINLINE convert_rgb24r_to_rgb24_simd(void **dst, const void
     const int crop_bottom = crop[3];
     const auto y_range = thread_y_range(crop_up, height - crop_bottom, thread_id, thread_n);
     uint8_t *srcLine = (uint8_t *)src[0] + src_y_pitch_byte * (y_range.start_src + y_range.len - 1) + crop_left * 3;
-    uint8_t *dstLine = (uint8_t *)dst[0] + dst_y_pitch_byte * (height - (y_range.start_dst + y_range.len));
+    uint8_t *dstLine = (uint8_t *)dst[0] + dst_y_pitch_byte * ((height - crop_up - crop_bottom) - (y_range.start_dst + y_range.len));
     const int y_width = width - crop_right - crop_left;
     for (int y = 0; y < y_range.len; y++, dstLine += dst_y_pitch_byte, srcLine -= src_y_pitch_byte) {
         memcpy_sse(dstLine, srcLine, y_width * 3);
@@ -835,7 +839,7 @@ void convert_rgb32_to_rgb32_simd(void **dst, const void **src, int width, int sr
     uint8_t *srcLine = (uint8_t *)src[0] + src_y_pitch_byte * y_range.start_src + crop_left * 4;
     uint8_t *dstLine = (uint8_t *)dst[0] + dst_y_pitch_byte * y_range.start_dst;
     const int x_width = width - crop_right - crop_left;
-    if (csp_from == RGY_CSP_RGB24) {
+    if (csp_from == RGY_CSP_RGB32) {
     for (int y = 0; y < y_range.len; y++, dstLine += dst_y_pitch_byte, srcLine += src_y_pitch_byte) {
         memcpy_sse(dstLine, srcLine, x_width * 4);
     }
@@ -880,7 +884,7 @@ static void RGY_FORCEINLINE convert_rgb32r_to_rgb32_simd(void **dst, const void
     const int crop_bottom = crop[3];
     const auto y_range = thread_y_range(crop_up, height - crop_bottom, thread_id, thread_n);
     uint8_t *srcLine = (uint8_t *)src[0] + src_y_pitch_byte * (y_range.start_src + y_range.len - 1) + crop_left * 4;
-    uint8_t *dstLine = (uint8_t *)dst[0] + dst_y_pitch_byte * (height - (y_range.start_dst + y_range.len));
+    uint8_t *dstLine = (uint8_t *)dst[0] + dst_y_pitch_byte * ((height - crop_up - crop_bottom) - (y_range.start_dst + y_range.len));
     const int y_width = width - crop_right - crop_left;
     for (int y = 0; y < y_range.len; y++, dstLine += dst_y_pitch_byte, srcLine -= src_y_pitch_byte) {
         memcpy_sse(dstLine, srcLine, y_width * 4);
@@ -1126,7 +1130,7 @@ static void RGY_FORCEINLINE convert_yuv422_to_p210_simd(void **dst, const void *
         uint8_t *src_v_ptr = srcVLine;
         uint16_t *dst_ptr = dstLine;
         __m128i x0, x1, x2, x3, x4;
-        for (int x = crop_left; x < x_fin; x += 16, src_u_ptr += 16, src_v_ptr += 16, dst_ptr += 32) {
+        for (int x = crop_left; x < x_fin; x += 32, src_u_ptr += 16, src_v_ptr += 16, dst_ptr += 32) {
             x0 = _mm_loadu_si128((const __m128i *)src_u_ptr);
             x1 = _mm_loadu_si128((const __m128i *)src_v_ptr);
             x2 = _mm_unpackhi_epi8(_mm_setzero_si128(), x0);
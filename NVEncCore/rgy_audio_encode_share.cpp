@@ -0,0 +1,165 @@
+﻿// -----------------------------------------------------------------------------------------
+// QSVEnc/NVEnc/VCEEnc by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2020 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+#include "rgy_audio_encode_share.h"
+
+#if ENABLE_AVSW_READER
+
+RGYAudioEncodeShare::RGYAudioEncodeShare() :
+    m_mtx(),
+    m_cvFinish(),
+    m_queues(),
+    m_finished(false),
+    m_complete(false),
+    m_published(0) {
+}
+
+RGYAudioEncodeShare::~RGYAudioEncodeShare() {
+    for (auto& queue : m_queues) {
+        if (queue) {
+            for (auto& pkt : *queue) {
+                av_packet_free(&pkt);
+            }
+        }
+    }
+    m_queues.clear();
+}
+
+int RGYAudioEncodeShare::subscribe() {
+    std::lock_guard<std::mutex> lock(m_mtx);
+    m_queues.push_back(std::make_unique<std::deque<AVPacket *>>());
+    return (int)m_queues.size() - 1;
+}
+
+void RGYAudioEncodeShare::unsubscribe(int id) {
+    std::unique_ptr<std::deque<AVPacket *>> queue;
+    {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        if (id < 0 || id >= (int)m_queues.size()) {
+            return;
+        }
+        queue = std::move(m_queues[id]);
+    }
+    //popで待機している場合は、待機を終了させる
+    m_cvFinish.notify_all();
+    if (queue) {
+        for (auto& pkt : *queue) {
+            av_packet_free(&pkt);
+        }
+    }
+}
+
+RGY_ERR RGYAudioEncodeShare::publish(const AVPacket *pkt) {
+    std::lock_guard<std::mutex> lock(m_mtx);
+    if (m_finished) {
+        return RGY_ERR_UNDEFINED_BEHAVIOR;
+    }
+    for (auto& queue : m_queues) {
+        if (!queue) continue;
+        //データはコピーせず、参照を追加する
+        AVPacket *pktRef = av_packet_clone(pkt);
+        if (pktRef == nullptr) {
+            return RGY_ERR_NULL_PTR;
+        }
+        queue->push_back(pktRef);
+    }
+    m_published++;
+    return RGY_ERR_NONE;
+}
+
+void RGYAudioEncodeShare::finish(bool complete) {
+    {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        if (m_finished) {
+            return;
+        }
+        m_finished = true;
+        m_complete = complete;
+    }
+    m_cvFinish.notify_all();
+}
+
+std::vector<AVPacket *> RGYAudioEncodeShare::pop(int id, bool wait) {
+    std::vector<AVPacket *> pkts;
+    std::unique_lock<std::mutex> lock(m_mtx);
+    if (wait) {
+        m_cvFinish.wait(lock, [this, id]() {
+            return m_finished || id < 0 || id >= (int)m_queues.size() || !m_queues[id];
+        });
+    }
+    if (id < 0 || id >= (int)m_queues.size() || !m_queues[id]) {
+        return pkts;
+    }
+    auto& queue = *m_queues[id];
+    pkts.assign(queue.begin(), queue.end());
+    queue.clear();
+    return pkts;
+}
+
+bool RGYAudioEncodeShare::finished() {
+    std::lock_guard<std::mutex> lock(m_mtx);
+    return m_finished;
+}
+
+bool RGYAudioEncodeShare::complete() {
+    std::lock_guard<std::mutex> lock(m_mtx);
+    return m_complete;
+}
+
+int64_t RGYAudioEncodeShare::published() {
+    std::lock_guard<std::mutex> lock(m_mtx);
+    return m_published;
+}
+
+RGYAudioEncodeCache::RGYAudioEncodeCache() :
+    m_mtx(),
+    m_shares() {
+}
+
+RGYAudioEncodeCache::~RGYAudioEncodeCache() {
+    m_shares.clear();
+}
+
+std::shared_ptr<RGYAudioEncodeShare> RGYAudioEncodeCache::join(const std::string& signature, int *subscriberId) {
+    std::lock_guard<std::mutex> lock(m_mtx);
+    auto it = m_shares.find(signature);
+    if (it == m_shares.end()) {
+        auto share = std::make_shared<RGYAudioEncodeShare>();
+        m_shares[signature] = share;
+        *subscriberId = -1;
+        return share;
+    }
+    *subscriberId = it->second->subscribe();
+    return it->second;
+}
+
+int RGYAudioEncodeCache::shares() {
+    std::lock_guard<std::mutex> lock(m_mtx);
+    return (int)m_shares.size();
+}
+
+#endif //#if ENABLE_AVSW_READER
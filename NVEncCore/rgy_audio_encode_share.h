@@ -0,0 +1,108 @@
+﻿// -----------------------------------------------------------------------------------------
+// QSVEnc/NVEnc/VCEEnc by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2020 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+#pragma once
+#ifndef __RGY_AUDIO_ENCODE_SHARE_H__
+#define __RGY_AUDIO_ENCODE_SHARE_H__
+
+#include "rgy_version.h"
+
+#if ENABLE_AVSW_READER
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include "rgy_avutil.h"
+#include "rgy_err.h"
+#include "rgy_util.h"
+
+//1つの音声エンコードの結果を、同じエンコードを行う他の出力に参照で渡す
+//エンコードを担当する側 (publisher) がpublishしたパケットは、
+//受け取り側 (subscriber) ごとのキューにav_packet_refで追加され、データのコピーは発生しない
+//
+//subscribeはpublishの開始前に行うこと (それ以前にpublishされたパケットは受け取れない)
+class RGYAudioEncodeShare {
+public:
+    RGYAudioEncodeShare();
+    ~RGYAudioEncodeShare();
+
+    //受け取り側を追加し、そのidを返す
+    int subscribe();
+    //受け取り側を削除し、受け取っていないパケットを破棄する
+    //popで待機中の場合は、待機を終了させる
+    void unsubscribe(int id);
+
+    //エンコード結果を各受け取り側のキューに追加する (pktの参照は呼び出し側に残る)
+    RGY_ERR publish(const AVPacket *pkt);
+    //これ以上パケットが追加されないことを通知する
+    //complete = falseの場合は、エンコードが途中で終了したことを示す
+    void finish(bool complete);
+
+    //受け取り側のキューからパケットを取り出す (取り出したパケットはav_packet_freeで解放すること)
+    //wait = trueの場合はfinishされるまで待機し、残りのパケットをすべて取り出す
+    //待機中にunsubscribeされた場合は、何も返さずに終了する
+    std::vector<AVPacket *> pop(int id, bool wait);
+
+    bool finished();
+    //finishがcomplete = trueで呼ばれたか
+    bool complete();
+    //publishされたパケットの数
+    int64_t published();
+protected:
+    std::mutex m_mtx;
+    std::condition_variable m_cvFinish;
+    std::vector<std::unique_ptr<std::deque<AVPacket *>>> m_queues; //受け取り側ごとのキュー (unsubscribe済みならnullptr)
+    bool m_finished;
+    bool m_complete;
+    int64_t m_published;
+};
+
+//入力トラック・フィルタ・コーデック・パラメータが一致する音声エンコードを共有するためのキャッシュ
+//ABRラダーのように同じ入力から複数の出力を行う場合に、各出力の音声処理で共有する
+class RGYAudioEncodeCache {
+public:
+    RGYAudioEncodeCache();
+    ~RGYAudioEncodeCache();
+
+    //signatureに対応するRGYAudioEncodeShareを返す
+    //最初に参加した場合は*subscriberId = -1 となり、エンコードを担当してその結果をpublishすること
+    //既にエンコードを担当する側がいれば、*subscriberIdに受け取り側のidを返す
+    std::shared_ptr<RGYAudioEncodeShare> join(const std::string& signature, int *subscriberId);
+    //共有されているエンコードの数
+    int shares();
+protected:
+    std::mutex m_mtx;
+    std::map<std::string, std::shared_ptr<RGYAudioEncodeShare>> m_shares;
+};
+
+#endif //#if ENABLE_AVSW_READER
+
+#endif //__RGY_AUDIO_ENCODE_SHARE_H__
@@ -26,7 +26,10 @@
 // --------------------------------------------------------------------------------------------
 
 #include <regex>
+#include <algorithm>
+#include <emmintrin.h>
 #include "rgy_util.h"
+#include "rgy_simd.h"
 #include "rgy_bitstream.h"
 #include "rgy_util.h"
 
@@ -45,6 +48,129 @@ std::vector<uint8_t> unnal(const uint8_t *ptr, size_t len) {
     return data;
 }
 
+size_t find_nal_start_code_c(const uint8_t *data, size_t pos, size_t size) {
+    if (size <= 3) {
+        return size;
+    }
+    const size_t i_fin = size - 3;
+    for (size_t i = pos; i < i_fin;) {
+        //data[i+2]が0でも1でもなければ、i, i+1, i+2のいずれも開始コードの先頭になりえない
+        const uint8_t c = data[i+2];
+        if (c > 1) {
+            i += 3;
+        } else if (c == 1) {
+            if (data[i+0] == 0 && data[i+1] == 0) {
+                return i;
+            }
+            i += 3;
+        } else {
+            i++;
+        }
+    }
+    return size;
+}
+
+size_t find_nal_start_code_sse2(const uint8_t *data, size_t pos, size_t size) {
+    const __m128i xZero = _mm_setzero_si128();
+    const __m128i xOne  = _mm_set1_epi8(1);
+    size_t i = pos;
+    //i～i+15のすべてについて、data[i+3]までがsize内に収まる範囲をSIMDで処理する
+    for (; i + 19 <= size; i += 16) {
+        //まず出現頻度の低い0x01を探し、見つかった場合のみその前の2byteを確認する
+        uint32_t mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(data + i + 2)), xOne));
+        if (mask) {
+            const __m128i x0 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(data + i + 0)), xZero);
+            const __m128i x1 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(data + i + 1)), xZero);
+            mask &= _mm_movemask_epi8(_mm_and_si128(x0, x1));
+            if (mask) {
+                return i + rgy_ctz32(mask);
+            }
+        }
+    }
+    return find_nal_start_code_c(data, i, size);
+}
+
+funcFindNalStartCode get_find_nal_start_code_func(uint32_t simd) {
+#if defined(_MSC_VER) || defined(__AVX2__)
+    //rgy_bitstream_avx2.cppはAVX2が有効な場合のみビルドされる (convert_cspと同様)
+    if (simd & AVX2) {
+        return find_nal_start_code_avx2;
+    }
+#endif //#if defined(_MSC_VER) || defined(__AVX2__)
+    if (simd & SSE2) {
+        return find_nal_start_code_sse2;
+    }
+    return find_nal_start_code_c;
+}
+
+void parse_nal_unit(std::vector<nal_info>& nal_list, funcFindNalStartCode find_start_code, const uint8_t *data, size_t size, bool hevc) {
+    nal_list.clear();
+    if (size <= 3) {
+        return;
+    }
+    const size_t i_fin = size - 3;
+    //開始コードの直後から次を探すため、見つかった位置の4byte先から再開する
+    for (size_t i = find_start_code(data, 0, size); i < i_fin; i = find_start_code(data, i + 4, size)) {
+        nal_info nal_start;
+        nal_start.ptr = data + i - (i > 0 && data[i-1] == 0);
+        nal_start.type = (hevc) ? (data[i+3] & 0x7f) >> 1 : data[i+3] & 0x1f;
+        nal_start.size = data + size - nal_start.ptr;
+        if (nal_list.size()) {
+            auto& prev = nal_list.back();
+            prev.size = nal_start.ptr - prev.ptr;
+        }
+        nal_list.push_back(nal_start);
+    }
+}
+
+void parse_nal_unit_h264(std::vector<nal_info>& nal_list, const uint8_t *data, size_t size) {
+    static const auto find_start_code = get_find_nal_start_code_func(get_availableSIMD());
+    parse_nal_unit(nal_list, find_start_code, data, size, false);
+}
+
+void parse_nal_unit_hevc(std::vector<nal_info>& nal_list, const uint8_t *data, size_t size) {
+    static const auto find_start_code = get_find_nal_start_code_func(get_availableSIMD());
+    parse_nal_unit(nal_list, find_start_code, data, size, true);
+}
+
+size_t bitstream_segments_size(const std::vector<RGYBitstreamSegment>& segments) {
+    size_t size = 0;
+    for (const auto& segment : segments) {
+        size += segment.size;
+    }
+    return size;
+}
+
+uint8_t *bitstream_segments_gather(uint8_t *dst, const std::vector<RGYBitstreamSegment>& segments) {
+    for (const auto& segment : segments) {
+        if (segment.size > 0) {
+            memcpy(dst, segment.ptr, segment.size);
+            dst += segment.size;
+        }
+    }
+    return dst;
+}
+
+bool hevc_insert_sei_segments(std::vector<RGYBitstreamSegment>& segments, const std::vector<nal_info>& nal_list, const uint8_t *sei, size_t sei_size) {
+    const auto hevc_vps_nal = std::find_if(nal_list.begin(), nal_list.end(), [](nal_info info) { return info.type == NALU_HEVC_VPS; });
+    const auto hevc_sps_nal = std::find_if(nal_list.begin(), nal_list.end(), [](nal_info info) { return info.type == NALU_HEVC_SPS; });
+    const auto hevc_pps_nal = std::find_if(nal_list.begin(), nal_list.end(), [](nal_info info) { return info.type == NALU_HEVC_PPS; });
+    const bool header_check = (nal_list.end() != hevc_vps_nal) && (nal_list.end() != hevc_sps_nal) && (nal_list.end() != hevc_pps_nal);
+    if (!header_check) {
+        return false;
+    }
+    segments.push_back({ hevc_vps_nal->ptr, hevc_vps_nal->size });
+    segments.push_back({ hevc_sps_nal->ptr, hevc_sps_nal->size });
+    segments.push_back({ hevc_pps_nal->ptr, hevc_pps_nal->size });
+    segments.push_back({ sei, sei_size });
+    for (const auto& nal : nal_list) {
+        if (nal.type != NALU_HEVC_VPS && nal.type != NALU_HEVC_SPS && nal.type != NALU_HEVC_PPS) {
+            segments.push_back({ nal.ptr, nal.size });
+        }
+    }
+    return true;
+}
+
 HEVCHDRSeiPrm::HEVCHDRSeiPrm() : maxcll(-1), maxfall(-1), contentlight_set(false), masterdisplay(), masterdisplay_set(false) {
     memset(&masterdisplay, 0, sizeof(masterdisplay));
 }
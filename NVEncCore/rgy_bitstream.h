@@ -32,6 +32,7 @@
 #include <vector>
 #include <cstdint>
 #include <string>
+#include "rgy_def.h"
 
 struct nal_info {
     const uint8_t *ptr;
@@ -119,61 +120,49 @@ enum PayloadType {
 
 std::vector<uint8_t> unnal(const uint8_t *ptr, size_t len);
 
+//data[pos]以降で最初に現れる開始コード(00 00 01)の位置を返す
+//開始コードの直後のNALヘッダ(1byte)までsize内に収まるものだけを対象とし、見つからなければsizeを返す
+typedef size_t (*funcFindNalStartCode)(const uint8_t *data, size_t pos, size_t size);
+size_t find_nal_start_code_c(const uint8_t *data, size_t pos, size_t size);
+size_t find_nal_start_code_sse2(const uint8_t *data, size_t pos, size_t size);
+#if defined(_MSC_VER) || defined(__AVX2__)
+size_t find_nal_start_code_avx2(const uint8_t *data, size_t pos, size_t size);
+#endif //#if defined(_MSC_VER) || defined(__AVX2__)
+funcFindNalStartCode get_find_nal_start_code_func(uint32_t simd);
+
+//nal_listをクリアしてから、dataに含まれるNALユニットの位置・サイズ・タイプを格納する
+//毎フレーム呼ぶ場合は、nal_listを呼び出し側で保持して使いまわすことで再確保を避けられる
+void parse_nal_unit_h264(std::vector<nal_info>& nal_list, const uint8_t *data, size_t size);
+void parse_nal_unit_hevc(std::vector<nal_info>& nal_list, const uint8_t *data, size_t size);
+//開始コードの検出にfind_start_codeを使用する (parse_nal_unit_h264/hevcは実行環境に合わせて自動で選択する)
+void parse_nal_unit(std::vector<nal_info>& nal_list, funcFindNalStartCode find_start_code, const uint8_t *data, size_t size, bool hevc);
+
 static std::vector<nal_info> parse_nal_unit_h264(const uint8_t *data, size_t size) {
     std::vector<nal_info> nal_list;
-    if (size > 3) {
-        nal_info nal_start = { nullptr, 0, 0 };
-        const auto i_fin = size - 3;
-        for (size_t i = 0; i < i_fin; i++) {
-            if (data[i+0] == 0 && data[i+1] == 0 && data[i+2] == 1) {
-                if (nal_start.ptr) {
-                    nal_list.push_back(nal_start);
-                }
-                nal_start.ptr = data + i - (i > 0 && data[i-1] == 0);
-                nal_start.type = data[i+3] & 0x1f;
-                nal_start.size = data + size - nal_start.ptr;
-                if (nal_list.size()) {
-                    auto prev = nal_list.end()-1;
-                    prev->size = nal_start.ptr - prev->ptr;
-                }
-                i += 3;
-            }
-        }
-        if (nal_start.ptr) {
-            nal_list.push_back(nal_start);
-        }
-    }
+    parse_nal_unit_h264(nal_list, data, size);
     return nal_list;
 }
 
 static std::vector<nal_info> parse_nal_unit_hevc(const uint8_t *data, size_t size) {
     std::vector<nal_info> nal_list;
-    if (size > 3) {
-        nal_info nal_start = { nullptr, 0, 0 };
-        const auto i_fin = size - 3;
-
-        for (size_t i = 0; i < i_fin; i++) {
-            if (data[i+0] == 0 && data[i+1] == 0 && data[i+2] == 1) {
-                if (nal_start.ptr) {
-                    nal_list.push_back(nal_start);
-                }
-                nal_start.ptr = data + i - (i > 0 && data[i-1] == 0);
-                nal_start.type = (data[i+3] & 0x7f) >> 1;
-                nal_start.size = data + size - nal_start.ptr;
-                if (nal_list.size()) {
-                    auto prev = nal_list.end()-1;
-                    prev->size = nal_start.ptr - prev->ptr;
-                }
-                i += 3;
-            }
-        }
-        if (nal_start.ptr) {
-            nal_list.push_back(nal_start);
-        }
-    }
+    parse_nal_unit_hevc(nal_list, data, size);
     return nal_list;
 }
 
+//ビットストリームの一部分 (出力データを組み立て直さずに並べるのに使用する)
+struct RGYBitstreamSegment {
+    const uint8_t *ptr;
+    size_t size;
+};
+
+//segmentsの合計サイズを返す
+size_t bitstream_segments_size(const std::vector<RGYBitstreamSegment>& segments);
+//segmentsを順にdstに連結し、書き込んだ末尾の次の位置を返す (dstにはbitstream_segments_size()以上の領域が必要)
+uint8_t *bitstream_segments_gather(uint8_t *dst, const std::vector<RGYBitstreamSegment>& segments);
+//HEVCのVPS/SPS/PPSの直後にseiを挿入した並びをsegmentsの末尾に追加する
+//VPS/SPS/PPSのいずれかが見つからなければfalseを返す
+bool hevc_insert_sei_segments(std::vector<RGYBitstreamSegment>& segments, const std::vector<nal_info>& nal_list, const uint8_t *sei, size_t sei_size);
+
 struct HEVCHDRSeiPrm {
     int maxcll;
     int maxfall;
@@ -0,0 +1,58 @@
+﻿// -----------------------------------------------------------------------------------------
+// QSVEnc/NVEnc/VCEEnc by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2020 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+#include <immintrin.h>
+#include "rgy_simd.h"
+#include "rgy_bitstream.h"
+
+#if _MSC_VER >= 1800 && !defined(__AVX__) && !defined(_DEBUG)
+static_assert(false, "do not forget to set /arch:AVX or /arch:AVX2 for this file.");
+#endif
+
+#if defined(_MSC_VER) || defined(__AVX2__)
+
+size_t find_nal_start_code_avx2(const uint8_t *data, size_t pos, size_t size) {
+    const __m256i yZero = _mm256_setzero_si256();
+    const __m256i yOne  = _mm256_set1_epi8(1);
+    size_t i = pos;
+    //i～i+31のすべてについて、data[i+3]までがsize内に収まる範囲をSIMDで処理する
+    for (; i + 35 <= size; i += 32) {
+        //まず出現頻度の低い0x01を探し、見つかった場合のみその前の2byteを確認する
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(data + i + 2)), yOne));
+        if (mask) {
+            const __m256i y0 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(data + i + 0)), yZero);
+            const __m256i y1 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(data + i + 1)), yZero);
+            mask &= (uint32_t)_mm256_movemask_epi8(_mm256_and_si256(y0, y1));
+            if (mask) {
+                return i + rgy_ctz32(mask);
+            }
+        }
+    }
+    return find_nal_start_code_c(data, i, size);
+}
+
+#endif //#if defined(_MSC_VER) || defined(__AVX2__)
@@ -0,0 +1,483 @@
+﻿// -----------------------------------------------------------------------------------------
+// QSVEnc/NVEnc/VCEEnc by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2020 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+#include <vector>
+#include <algorithm>
+#include <numeric>
+#include "rgy_osdep.h"
+#include "rgy_chunk.h"
+#include "rgy_pipe.h"
+#include "rgy_util.h"
+#include "rgy_bitstream.h"
+#include "rgy_simd.h"
+#include "rgy_avutil.h"
+
+RGY_ERR rgy_chunk_plan(std::vector<RGYChunk>& chunks, int *frameCount, const std::vector<RGYChunkPacket>& packets, double timebase, int chunkCount, std::shared_ptr<RGYLog> log) {
+    chunks.clear();
+    *frameCount = 0;
+    const int packetCount = (int)packets.size();
+    if (packetCount == 0) {
+        log->write(RGY_LOG_ERROR, _T("chunk: no video packet found.\n"));
+        return RGY_ERR_INVALID_FORMAT;
+    }
+    bool ptsValid = true, dtsValid = true;
+    for (const auto& packet : packets) {
+        ptsValid &= packet.pts != AV_NOPTS_VALUE;
+        dtsValid &= packet.dts != AV_NOPTS_VALUE;
+    }
+    //表示順に並べる (pts/dtsがない場合はパケット順とする)
+    auto timestamp = [&](int i) {
+        return (ptsValid) ? packets[i].pts : ((dtsValid) ? packets[i].dts : (int64_t)i);
+    };
+    std::vector<int> order(packetCount);
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](int a, int b) { return timestamp(a) < timestamp(b); });
+
+    //最初のキーフレームより前に表示されるフレームは、リーダー側で取り除かれるので数えない
+    int64_t firstKeyTimestamp = AV_NOPTS_VALUE;
+    for (int i = 0; i < packetCount; i++) {
+        if (packets[i].key) {
+            firstKeyTimestamp = timestamp(i);
+            break;
+        }
+    }
+    //リーダーの--seekは、最初のパケットのptsからの時間で指定する
+    //キーフレームのptsちょうどを指定すれば、シーク先がその前後のどちらのキーフレームに丸められる場合でも、そのキーフレームから読み込まれる
+    std::vector<int> keyFrames; //表示順でのキーフレームのフレーム番号
+    std::vector<double> keySeekSec; //キーフレームにシークするための--seekの値
+    int frames = 0;
+    for (int i = 0; i < packetCount; i++) {
+        const int idx = order[i];
+        if (firstKeyTimestamp != AV_NOPTS_VALUE && timestamp(idx) < firstKeyTimestamp) {
+            continue;
+        }
+        if (packets[idx].key) {
+            keyFrames.push_back(frames);
+            keySeekSec.push_back((ptsValid) ? (std::max)((packets[idx].pts - packets[0].pts) * timebase, 0.0) : 0.0);
+        }
+        frames++;
+    }
+    if (!ptsValid) {
+        log->write(RGY_LOG_WARN, _T("chunk: no pts in input, each chunk will be decoded from the beginning.\n"));
+    }
+    log->write(RGY_LOG_DEBUG, _T("chunk: %d frames, %d keyframes.\n"), frames, (int)keyFrames.size());
+
+    //等分した位置に最も近いキーフレームで区切る
+    int chunkStart = 0;
+    double chunkSeekSec = 0.0;
+    for (int ichunk = 1; ichunk < chunkCount; ichunk++) {
+        const int target = (int)((int64_t)frames * ichunk / chunkCount);
+        int split = -1;
+        for (size_t ikey = 0; ikey < keyFrames.size(); ikey++) {
+            const int key = keyFrames[ikey];
+            if (key <= chunkStart) continue;
+            if (split < 0 || std::abs(key - target) < std::abs(keyFrames[split] - target)) {
+                split = (int)ikey;
+            }
+        }
+        if (split < 0) {
+            break;
+        }
+        chunks.push_back(RGYChunk{ sTrim{ chunkStart, keyFrames[split] - 1 }, chunkSeekSec });
+        chunkStart = keyFrames[split];
+        chunkSeekSec = keySeekSec[split];
+    }
+    chunks.push_back(RGYChunk{ sTrim{ chunkStart, frames - 1 }, chunkSeekSec });
+    if ((int)chunks.size() < chunkCount) {
+        log->write(RGY_LOG_WARN, _T("chunk: only %d keyframes available for split, using %d chunks.\n"), (int)keyFrames.size(), (int)chunks.size());
+    }
+    *frameCount = frames;
+    return RGY_ERR_NONE;
+}
+
+RGY_ERR rgy_chunk_split(std::vector<RGYChunk>& chunks, int *frameCount, const tstring& filename, int chunkCount, std::shared_ptr<RGYLog> log) {
+    chunks.clear();
+    *frameCount = 0;
+#if ENABLE_AVSW_READER
+    if (!check_avcodec_dll()) {
+        log->write(RGY_LOG_ERROR, error_mes_avcodec_dll_not_found().c_str());
+        return RGY_ERR_NULL_PTR;
+    }
+    std::string filename_char;
+    if (0 == tchar_to_string(filename.c_str(), filename_char, CP_UTF8)) {
+        log->write(RGY_LOG_ERROR, _T("failed to convert filename to utf-8 characters.\n"));
+        return RGY_ERR_UNSUPPORTED;
+    }
+    AVFormatContext *formatCtxPtr = nullptr;
+    int ret = 0;
+    if ((ret = avformat_open_input(&formatCtxPtr, filename_char.c_str(), nullptr, nullptr)) != 0) {
+        log->write(RGY_LOG_ERROR, _T("chunk: error opening file \"%s\": %s\n"), filename.c_str(), qsv_av_err2str(ret).c_str());
+        return RGY_ERR_FILE_OPEN;
+    }
+    std::unique_ptr<AVFormatContext, RGYAVDeleter<AVFormatContext>> formatCtx(formatCtxPtr, RGYAVDeleter<AVFormatContext>(avformat_close_input));
+    if (avformat_find_stream_info(formatCtx.get(), nullptr) < 0) {
+        log->write(RGY_LOG_ERROR, _T("chunk: error finding stream information.\n"));
+        return RGY_ERR_UNKNOWN;
+    }
+    const int videoIndex = av_find_best_stream(formatCtx.get(), AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0);
+    if (videoIndex < 0) {
+        log->write(RGY_LOG_ERROR, _T("chunk: no video stream found in \"%s\".\n"), filename.c_str());
+        return RGY_ERR_INVALID_FORMAT;
+    }
+    //映像以外は読み飛ばす
+    for (uint32_t i = 0; i < formatCtx->nb_streams; i++) {
+        formatCtx->streams[i]->discard = ((int)i == videoIndex) ? AVDISCARD_DEFAULT : AVDISCARD_ALL;
+    }
+
+    //デコードせずにパケットのタイムスタンプとキーフレームフラグだけを集める
+    std::vector<RGYChunkPacket> packets;
+    AVPacket pkt;
+    av_init_packet(&pkt);
+    while (av_read_frame(formatCtx.get(), &pkt) >= 0) {
+        if (pkt.stream_index == videoIndex) {
+            packets.push_back(RGYChunkPacket{ pkt.pts, pkt.dts, (pkt.flags & AV_PKT_FLAG_KEY) != 0 });
+        }
+        av_packet_unref(&pkt);
+    }
+    return rgy_chunk_plan(chunks, frameCount, packets, av_q2d(formatCtx->streams[videoIndex]->time_base), chunkCount, log);
+#else
+    log->write(RGY_LOG_ERROR, _T("chunk: avcodec is required to split input.\n"));
+    return RGY_ERR_UNSUPPORTED;
+#endif //#if ENABLE_AVSW_READER
+}
+
+//エレメンタリストリームのフレーム数を数える
+//ピクチャの最初のスライス (H.264: first_mb_in_slice = 0, HEVC: first_slice_segment_in_pic_flag = 1) を数える
+//データは分割して渡してよく、開始コードやヘッダが分割位置をまたいでもよい
+class RGYChunkFrameCounter {
+public:
+    RGYChunkFrameCounter(bool hevc) : m_hevc(hevc), m_findStartCode(get_find_nal_start_code_func(get_availableSIMD())), m_buf(), m_frames(0) {};
+    void add(const uint8_t *data, size_t size) {
+        m_buf.insert(m_buf.end(), data, data + size);
+        //開始コードの後ろに必要なサイズ (NALヘッダとスライスヘッダの先頭1byte)
+        const size_t headerSize = (m_hevc) ? 3 : 2;
+        //開始コードがまたがっている可能性のある末尾の3byteは、次のデータと合わせて探す
+        size_t keep = (m_buf.size() > 3) ? m_buf.size() - 3 : 0;
+        for (size_t i = m_findStartCode(m_buf.data(), 0, m_buf.size()); i < m_buf.size(); i = m_findStartCode(m_buf.data(), i + 3, m_buf.size())) {
+            if (i + 3 + headerSize > m_buf.size()) {
+                keep = i;
+                break;
+            }
+            const uint8_t *header = m_buf.data() + i + 3;
+            if (m_hevc) {
+                const int type = (header[0] & 0x7e) >> 1;
+                m_frames += (type < 32 && (header[2] & 0x80)) ? 1 : 0;
+            } else {
+                const int type = header[0] & 0x1f;
+                m_frames += ((type == NALU_H264_NONIDR || type == NALU_H264_IDR) && (header[1] & 0x80)) ? 1 : 0;
+            }
+        }
+        m_buf.erase(m_buf.begin(), m_buf.begin() + keep);
+    }
+    int frames() const { return m_frames; }
+protected:
+    bool m_hevc;
+    funcFindNalStartCode m_findStartCode;
+    std::vector<uint8_t> m_buf;
+    int m_frames;
+};
+
+static tstring getExePath() {
+#if defined(_WIN32) || defined(_WIN64)
+    TCHAR exePath[1024];
+    memset(exePath, 0, sizeof(exePath));
+    GetModuleFileName(NULL, exePath, _countof(exePath));
+    return exePath;
+#else
+    char prg_path[4096];
+    auto ret = readlink("/proc/self/exe", prg_path, sizeof(prg_path) - 1);
+    prg_path[(ret > 0) ? ret : 0] = '\0';
+    return char_to_tstring(prg_path);
+#endif //#if defined(_WIN32) || defined(_WIN64)
+}
+
+static tstring quoteArg(const tstring& arg) {
+#if defined(_WIN32) || defined(_WIN64)
+    //CreateProcessにはコマンドラインとして渡されるので、空白や"を含む場合は"で囲む
+    //CommandLineToArgvWの規則に従い、"とその直前の\はエスケープする
+    if (arg.length() > 0 && arg.find_first_of(_T(" \t\"")) == tstring::npos) {
+        return arg;
+    }
+    tstring quoted = _T("\"");
+    size_t backslashes = 0;
+    for (const auto c : arg) {
+        if (c == _T('\\')) {
+            backslashes++;
+            continue;
+        }
+        quoted.append((c == _T('"')) ? backslashes * 2 + 1 : backslashes, _T('\\'));
+        quoted += c;
+        backslashes = 0;
+    }
+    //末尾の\が閉じる"をエスケープしないようにする
+    quoted.append(backslashes * 2, _T('\\'));
+    quoted += _T('"');
+    return quoted;
+#else
+    return arg;
+#endif //#if defined(_WIN32) || defined(_WIN64)
+}
+
+//子プロセスでエンコーダを実行するバックエンド
+class RGYChunkBackendProcess : public RGYChunkBackend {
+public:
+    RGYChunkBackendProcess(int chunkCount) : m_exePath(getExePath()), m_processes(chunkCount), m_pipes(chunkCount) {};
+    virtual ~RGYChunkBackendProcess() {
+        for (int ichunk = 0; ichunk < (int)m_processes.size(); ichunk++) {
+            if (m_processes[ichunk]) {
+                wait(ichunk);
+            }
+        }
+    };
+    virtual RGY_ERR start(int ichunk, const std::vector<tstring>& args) override {
+        std::vector<tstring> argsQuoted;
+        argsQuoted.push_back(quoteArg(m_exePath));
+        for (const auto& arg : args) {
+            argsQuoted.push_back(quoteArg(arg));
+        }
+        std::vector<const TCHAR *> argsPtr;
+        for (const auto& arg : argsQuoted) {
+            argsPtr.push_back(arg.c_str());
+        }
+        argsPtr.push_back(nullptr);
+        memset(&m_pipes[ichunk], 0, sizeof(m_pipes[ichunk]));
+        auto process = createRGYPipeProcess();
+        process->init();
+        if (process->run(argsPtr, nullptr, &m_pipes[ichunk], 0, true, false)) {
+            return RGY_ERR_RUN_PROCESS;
+        }
+        m_processes[ichunk] = std::move(process);
+        return RGY_ERR_NONE;
+    }
+    virtual int wait(int ichunk) override {
+        if (!m_processes[ichunk]) {
+            return -1;
+        }
+        const int exitCode = m_processes[ichunk]->waitAndGetExitCode();
+        m_processes[ichunk]->close();
+        m_processes[ichunk].reset();
+        return exitCode;
+    }
+protected:
+    tstring m_exePath;
+    std::vector<std::unique_ptr<RGYPipeProcess>> m_processes;
+    std::vector<ProcessPipe> m_pipes;
+};
+
+//元のコマンドラインから--chunk-parallel, --log, --trace, 出力ファイル名を差し替え、--seek, --trimを追加する
+static std::vector<tstring> rgy_chunk_args(const RGYChunk& chunk, int ichunk, int argc, const TCHAR **argv, const tstring& chunkFile, const tstring& chunkLog, const RGYChunkEncodePrm& prm) {
+    std::vector<tstring> args;
+    for (int iarg = 1; iarg < argc; iarg++) {
+        const tstring arg = argv[iarg];
+        //--metrics-portは各チャンクで同じポートを使えないので渡さない
+        if (arg == _T("--chunk-parallel") || arg == _T("--log") || arg == _T("--trace") || arg == _T("--metrics-port")) {
+            iarg++;
+            continue;
+        }
+        args.push_back(arg);
+        if ((arg == _T("-o") || arg == _T("--output")) && iarg + 1 < argc) {
+            iarg++;
+            args.push_back(chunkFile);
+        }
+    }
+    //区間の先頭のキーフレームにシークし、そこからのフレーム番号でtrimする
+    //(trimだけでは区間の前のフレームもすべてデコードしてから捨てることになる)
+    const int trimOffset = (chunk.seekSec > 0.0) ? chunk.trim.start : 0;
+    if (chunk.seekSec > 0.0) {
+        args.push_back(_T("--seek"));
+        args.push_back(strsprintf(_T("%.9f"), chunk.seekSec));
+    }
+    //終了位置はフレーム数で指定する ("0:0"は最後までの意味になるため)
+    args.push_back(_T("--trim"));
+    args.push_back(strsprintf(_T("%d:-%d"), chunk.trim.start - trimOffset, chunk.trim.fin - chunk.trim.start + 1));
+    args.push_back(_T("--log"));
+    args.push_back(chunkLog);
+    if (prm.traceFile.length() > 0) {
+        //各チャンクは別プロセスなので、トレースもチャンクごとに別ファイルに出力する
+        const TCHAR *traceExtPtr = PathFindExtension(prm.traceFile.c_str());
+        args.push_back(_T("--trace"));
+        args.push_back(PathRemoveExtensionS(prm.traceFile) + strsprintf(_T(".chunk%02d"), ichunk) + ((traceExtPtr) ? traceExtPtr : _T("")));
+    }
+    if (prm.quiet) {
+        args.push_back(_T("--log-level"));
+        args.push_back(_T("warn"));
+    }
+    return args;
+}
+
+//各チャンクのフレーム数を確認しながら連結する
+static RGY_ERR rgy_chunk_concat(const std::vector<RGYChunk>& chunks, const std::vector<tstring>& chunkFiles, const RGYChunkEncodePrm& prm, std::shared_ptr<RGYLog> log) {
+    std::unique_ptr<FILE, fp_deleter> fpOut(_tfopen(prm.output.c_str(), _T("wb")));
+    if (!fpOut) {
+        log->write(RGY_LOG_ERROR, _T("chunk: failed to open output file \"%s\".\n"), prm.output.c_str());
+        return RGY_ERR_FILE_OPEN;
+    }
+    std::vector<uint8_t> buffer(4 * 1024 * 1024);
+    int totalFrames = 0, expectedTotalFrames = 0;
+    for (int ichunk = 0; ichunk < (int)chunkFiles.size(); ichunk++) {
+        std::unique_ptr<FILE, fp_deleter> fpIn(_tfopen(chunkFiles[ichunk].c_str(), _T("rb")));
+        if (!fpIn) {
+            log->write(RGY_LOG_ERROR, _T("chunk: failed to open chunk file \"%s\".\n"), chunkFiles[ichunk].c_str());
+            return RGY_ERR_FILE_OPEN;
+        }
+        RGYChunkFrameCounter counter(prm.codec == RGY_CODEC_HEVC);
+        size_t readSize = 0;
+        while ((readSize = fread(buffer.data(), 1, buffer.size(), fpIn.get())) > 0) {
+            counter.add(buffer.data(), readSize);
+            if (fwrite(buffer.data(), 1, readSize, fpOut.get()) != readSize) {
+                log->write(RGY_LOG_ERROR, _T("chunk: failed to write to output file \"%s\".\n"), prm.output.c_str());
+                return RGY_ERR_UNDEFINED_BEHAVIOR;
+            }
+        }
+        //区間の前後のフレームが欠けたり重複したりしていないか、フレーム数を確認する
+        const int expectedFrames = chunks[ichunk].trim.fin - chunks[ichunk].trim.start + 1;
+        if (counter.frames() != expectedFrames) {
+            log->write(RGY_LOG_ERROR, _T("chunk %d: encoded %d frames, expected %d frames (frame %d - %d).\n"),
+                ichunk, counter.frames(), expectedFrames, chunks[ichunk].trim.start, chunks[ichunk].trim.fin);
+            return RGY_ERR_INVALID_DATA_TYPE;
+        }
+        totalFrames += counter.frames();
+        expectedTotalFrames += expectedFrames;
+    }
+    if (totalFrames != expectedTotalFrames) {
+        log->write(RGY_LOG_ERROR, _T("chunk: encoded %d frames in total, expected %d frames.\n"), totalFrames, expectedTotalFrames);
+        return RGY_ERR_INVALID_DATA_TYPE;
+    }
+    log->write(RGY_LOG_DEBUG, _T("chunk: joined %d frames.\n"), totalFrames);
+    return RGY_ERR_NONE;
+}
+
+RGY_ERR rgy_chunk_encode(const std::vector<RGYChunk>& chunks, int argc, const TCHAR **argv, const RGYChunkEncodePrm& prm, RGYChunkBackend *backend, std::shared_ptr<RGYLog> log) {
+    const int chunkCount = (int)chunks.size();
+    const TCHAR *outputExtPtr = PathFindExtension(prm.output.c_str());
+    const tstring outputExt = (outputExtPtr) ? outputExtPtr : _T("");
+    const tstring outputBase = PathRemoveExtensionS(prm.output);
+    std::vector<tstring> chunkFiles, chunkLogs;
+    for (int ichunk = 0; ichunk < chunkCount; ichunk++) {
+        chunkFiles.push_back(outputBase + strsprintf(_T(".chunk%02d"), ichunk) + outputExt);
+        chunkLogs.push_back(outputBase + strsprintf(_T(".chunk%02d.log"), ichunk));
+    }
+    RGY_ERR err = RGY_ERR_NONE;
+    auto waitChunk = [&](int ichunk) {
+        const int exitCode = backend->wait(ichunk);
+        if (exitCode != 0) {
+            log->write(RGY_LOG_ERROR, _T("chunk %d: encoder process failed (%d), see \"%s\".\n"), ichunk, exitCode, chunkLogs[ichunk].c_str());
+            err = RGY_ERR_RUN_PROCESS;
+        } else {
+            log->write(RGY_LOG_INFO, _T("chunk %d: finished.\n"), ichunk);
+        }
+    };
+    //チャンクは順に開始し、workersMax個が実行中の場合は、最も先に開始したチャンクの終了を待ってから次を開始する
+    //(各チャンクのフレーム数はほぼ等しいので、おおむね開始した順に終了する)
+    const int workersMax = clamp(prm.workersMax, 1, (std::max)(chunkCount, 1));
+    int started = 0, finished = 0;
+    for (int ichunk = 0; ichunk < chunkCount && err == RGY_ERR_NONE; ichunk++) {
+        if (started - finished >= workersMax) {
+            waitChunk(finished++);
+            if (err != RGY_ERR_NONE) {
+                break;
+            }
+        }
+        const auto args = rgy_chunk_args(chunks[ichunk], ichunk, argc, argv, chunkFiles[ichunk], chunkLogs[ichunk], prm);
+        log->write(RGY_LOG_INFO, _T("chunk %d: frame %d - %d\n"), ichunk, chunks[ichunk].trim.start, chunks[ichunk].trim.fin);
+        if (backend->start(ichunk, args) != RGY_ERR_NONE) {
+            log->write(RGY_LOG_ERROR, _T("chunk %d: failed to run encoder process.\n"), ichunk);
+            err = RGY_ERR_RUN_PROCESS;
+            break;
+        }
+        started++;
+    }
+    //実行中のチャンクの終了を待つ
+    while (finished < started) {
+        waitChunk(finished++);
+    }
+    if (err == RGY_ERR_NONE) {
+        //各チャンクはIDRとヘッダから始まるので、そのまま連結すればよい
+        err = rgy_chunk_concat(chunks, chunkFiles, prm, log);
+        if (err != RGY_ERR_NONE) {
+            _tremove(prm.output.c_str());
+        }
+    }
+    for (int ichunk = 0; ichunk < chunkCount; ichunk++) {
+        _tremove(chunkFiles[ichunk].c_str());
+        if (err == RGY_ERR_NONE) {
+            _tremove(chunkLogs[ichunk].c_str());
+        }
+    }
+    if (err == RGY_ERR_NONE) {
+        log->write(RGY_LOG_INFO, _T("encoded %d chunks to \"%s\".\n"), chunkCount, prm.output.c_str());
+    }
+    return err;
+}
+
+int rgy_chunk_run(int argc, const TCHAR **argv, const RGYParamCommon *common, const RGYParamControl *ctrl, RGY_CODEC codec, int workersMax) {
+    auto log = std::make_shared<RGYLog>(ctrl->logfile.c_str(), ctrl->loglevel);
+
+    //各チャンクの出力は単純に連結するので、エレメンタリストリームの出力のみ対応する
+    const bool esOutput =
+        (common->muxOutputFormat.length() > 0 && 0 == _tcscmp(common->muxOutputFormat.c_str(), _T("raw")))
+        || (PathFindExtension(common->outputFilename.c_str()) == nullptr || PathFindExtension(common->outputFilename.c_str())[0] != '.')
+        || check_ext(common->outputFilename.c_str(), { ".264", ".h264", ".avc", ".avc1", ".x264", ".265", ".h265", ".hevc" });
+    if (!esOutput || (common->AVMuxTarget & RGY_MUX_VIDEO)) {
+        log->write(RGY_LOG_ERROR, _T("--chunk-parallel supports only elementary stream output.\n"));
+        return 1;
+    }
+    if (common->nAudioSelectCount > 0 || common->nSubtitleSelectCount > 0 || common->nDataSelectCount > 0 || common->nAttachmentSelectCount > 0
+        || common->audioSource.size() > 0 || common->subSource.size() > 0) {
+        log->write(RGY_LOG_ERROR, _T("--chunk-parallel cannot be used with audio/subtitle/data tracks.\n"));
+        return 1;
+    }
+    if (common->nTrimCount > 0 || common->seekSec > 0.0) {
+        log->write(RGY_LOG_ERROR, _T("--chunk-parallel cannot be used with --trim or --seek.\n"));
+        return 1;
+    }
+    if (common->inputFilename == _T("-") || common->outputFilename == _T("-")) {
+        log->write(RGY_LOG_ERROR, _T("--chunk-parallel cannot be used with pipe input/output.\n"));
+        return 1;
+    }
+
+    std::vector<RGYChunk> chunks;
+    int frameCount = 0;
+    auto err = rgy_chunk_split(chunks, &frameCount, common->inputFilename, ctrl->chunkParallel, log);
+    if (err != RGY_ERR_NONE) {
+        log->write(RGY_LOG_ERROR, _T("chunk: failed to split input: %s.\n"), get_err_mes(err));
+        return 1;
+    }
+    if (workersMax < (int)chunks.size()) {
+        log->write(RGY_LOG_INFO, _T("chunk: encoding up to %d chunks at the same time.\n"), workersMax);
+    }
+
+    RGYChunkEncodePrm prm;
+    prm.output = common->outputFilename;
+    prm.codec = codec;
+    prm.traceFile = ctrl->traceFile;
+    prm.quiet = ctrl->loglevel == RGY_LOG_INFO;
+    prm.workersMax = workersMax;
+    RGYChunkBackendProcess backend((int)chunks.size());
+    err = rgy_chunk_encode(chunks, argc, argv, prm, &backend, log);
+    return (err != RGY_ERR_NONE) ? 1 : 0;
+}
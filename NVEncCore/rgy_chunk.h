@@ -0,0 +1,90 @@
+﻿// -----------------------------------------------------------------------------------------
+// QSVEnc/NVEnc/VCEEnc by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2020 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+#pragma once
+#ifndef __RGY_CHUNK_H__
+#define __RGY_CHUNK_H__
+
+#include <vector>
+#include <memory>
+#include "rgy_def.h"
+#include "rgy_err.h"
+#include "rgy_log.h"
+#include "rgy_prm.h"
+
+//チャンク分割の計画に使用する動画のパケットの情報
+struct RGYChunkPacket {
+    int64_t pts;
+    int64_t dts;
+    bool key;
+};
+
+//チャンク分割の区間
+struct RGYChunk {
+    sTrim trim;     //入力全体での表示順のフレーム番号の区間 (start, finとも区間に含む)
+    double seekSec; //区間の先頭のキーフレームのptsちょうどにシークするための--seekの値 (0ならシークしない)
+};
+
+//デコード順のパケットの情報から、フレーム数がほぼ等しくなるよう最大chunkCount個の区間に分割する
+//区間の境界は表示順でのキーフレームの位置とし、最初のキーフレームより前に表示されるフレームは数えない (リーダー側で取り除かれる)
+//timebaseはptsの単位(秒)、frameCountには区間のフレーム数の合計を返す
+RGY_ERR rgy_chunk_plan(std::vector<RGYChunk>& chunks, int *frameCount, const std::vector<RGYChunkPacket>& packets, double timebase, int chunkCount, std::shared_ptr<RGYLog> log);
+
+//入力ファイルの動画のパケットをデコードせずに読み、rgy_chunk_planで区間に分割する
+RGY_ERR rgy_chunk_split(std::vector<RGYChunk>& chunks, int *frameCount, const tstring& filename, int chunkCount, std::shared_ptr<RGYLog> log);
+
+//チャンクのエンコードを実行するバックエンド
+//通常は子プロセスでエンコーダを実行するが、CPUのみのスタブに置き換えて分割・連結の処理を確認できるようにする
+class RGYChunkBackend {
+public:
+    virtual ~RGYChunkBackend() {};
+    //ichunk番目のチャンクのエンコードを、コマンドラインargs (実行ファイル名を除く) で開始する
+    virtual RGY_ERR start(int ichunk, const std::vector<tstring>& args) = 0;
+    //ichunk番目のチャンクのエンコードの終了を待ち、終了コードを返す
+    virtual int wait(int ichunk) = 0;
+};
+
+struct RGYChunkEncodePrm {
+    tstring output;    //出力ファイル名 (各チャンクは"<出力>.chunkNN.<拡張子>"に出力する)
+    RGY_CODEC codec;   //出力のコーデック (フレーム数の確認に使用する)
+    tstring traceFile; //--traceの出力先 (チャンクごとに別ファイルとする)
+    bool quiet;        //子プロセスの進捗表示が混ざらないよう、ログを警告以上とする
+    int workersMax;    //同時にエンコードするチャンクの数の上限
+
+    RGYChunkEncodePrm() : output(), codec(RGY_CODEC_H264), traceFile(), quiet(false), workersMax(1) {};
+};
+
+//各チャンクを、元のコマンドライン(argv[1]以降)に--seekと--trimを加えてバックエンドでエンコードし、
+//それぞれのフレーム数が区間のフレーム数と一致することを確認しながら、出力されたエレメンタリストリームを連結する
+RGY_ERR rgy_chunk_encode(const std::vector<RGYChunk>& chunks, int argc, const TCHAR **argv, const RGYChunkEncodePrm& prm, RGYChunkBackend *backend, std::shared_ptr<RGYLog> log);
+
+//チャンク分割による並列エンコードを行う
+//区間ごとに子プロセスでエンコードし、同時に実行するのはworkersMax個までとする
+//戻り値はプロセスの終了コード
+int rgy_chunk_run(int argc, const TCHAR **argv, const RGYParamCommon *common, const RGYParamControl *ctrl, RGY_CODEC codec, int workersMax);
+
+#endif //__RGY_CHUNK_H__
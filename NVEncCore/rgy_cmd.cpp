@@ -507,6 +507,34 @@ int parse_one_common_option(const TCHAR *option_name, const TCHAR *strInput[], i
         }
         return 0;
     }
+    if (IS_OPTION("input-prefetch")) {
+        i++;
+        int value = 0;
+        if (1 != _stscanf_s(strInput[i], _T("%d"), &value)) {
+            print_cmd_error_invalid_value(option_name, strInput[i]);
+            return 1;
+        } else if (value < 0) {
+            print_cmd_error_invalid_value(option_name, strInput[i], _T("input-prefetch requires non-negative value."));
+            return 1;
+        } else {
+            common->demuxPrefetchMB = (std::min)(value, 4096);
+        }
+        return 0;
+    }
+    if (IS_OPTION("avs-prefetch")) {
+        i++;
+        int value = 0;
+        if (1 != _stscanf_s(strInput[i], _T("%d"), &value)) {
+            print_cmd_error_invalid_value(option_name, strInput[i]);
+            return 1;
+        } else if (value < 0) {
+            print_cmd_error_invalid_value(option_name, strInput[i], _T("avs-prefetch requires non-negative value."));
+            return 1;
+        } else {
+            common->avsPrefetch = (std::min)(value, 64);
+        }
+        return 0;
+    }
     if (IS_OPTION("video-track")) {
         i++;
         int v = 0;
@@ -571,10 +599,10 @@ int parse_one_common_option(const TCHAR *option_name, const TCHAR *strInput[], i
         i++;
         int ret = 0;
         int hh = 0, mm = 0;
-        float sec = 0.0f;
-        if (   3 != (ret = _stscanf_s(strInput[i], _T("%d:%d:%f"),    &hh, &mm, &sec))
-            && 2 != (ret = _stscanf_s(strInput[i],    _T("%d:%f"),         &mm, &sec))
-            && 1 != (ret = _stscanf_s(strInput[i],       _T("%f"),              &sec))) {
+        double sec = 0.0;
+        if (   3 != (ret = _stscanf_s(strInput[i], _T("%d:%d:%lf"),    &hh, &mm, &sec))
+            && 2 != (ret = _stscanf_s(strInput[i],    _T("%d:%lf"),         &mm, &sec))
+            && 1 != (ret = _stscanf_s(strInput[i],       _T("%lf"),              &sec))) {
             print_cmd_error_invalid_value(option_name, strInput[i]);
             return 1;
         }
@@ -593,7 +621,7 @@ int parse_one_common_option(const TCHAR *option_name, const TCHAR *strInput[], i
             return 1;
         }
         mm += hh * 60;
-        if (mm > 0 && sec >= 60.0f) {
+        if (mm > 0 && sec >= 60.0) {
             print_cmd_error_invalid_value(option_name, strInput[i]);
             return 1;
         }
@@ -1385,6 +1413,79 @@ int parse_one_common_option(const TCHAR *option_name, const TCHAR *strInput[], i
         common->outputBufSizeMB = (std::min)(value, RGY_OUTPUT_BUF_MB_MAX);
         return 0;
     }
+    if (IS_OPTION("output-sink")) {
+        int value = 0;
+        i++;
+        if (PARSE_ERROR_FLAG != (value = get_value_from_chr(list_output_sink, strInput[i]))) {
+            common->outputSink = (RGYOutputSink)value;
+        } else {
+            print_cmd_error_invalid_value(option_name, strInput[i], list_output_sink);
+            return 1;
+        }
+        return 0;
+    }
+    if (IS_OPTION("cmaf")) {
+        common->cmaf.enable = true;
+        if (i+1 >= nArgNum || strInput[i+1][0] == _T('-')) {
+            return 0;
+        }
+        i++;
+        const auto paramList = std::vector<std::string>{ "chunk", "window", "playlist", "url", "method" };
+        for (const auto& param : split(strInput[i], _T(","))) {
+            auto pos = param.find_first_of(_T("="));
+            if (pos != std::string::npos) {
+                auto param_arg = tolowercase(param.substr(0, pos));
+                auto param_val = param.substr(pos+1);
+                if (param_arg == _T("chunk") || param_arg == _T("window")) {
+                    int value = 0;
+                    try {
+                        value = std::stoi(param_val);
+                    } catch (...) {
+                        print_cmd_error_invalid_value(tstring(option_name) + _T(" ") + param_arg + _T("="), param_val);
+                        return 1;
+                    }
+                    if (value < 0) {
+                        print_cmd_error_invalid_value(tstring(option_name) + _T(" ") + param_arg + _T("="), param_val, _T("should be set in positive value."));
+                        return 1;
+                    }
+                    ((param_arg == _T("chunk")) ? common->cmaf.chunkFrames : common->cmaf.window) = value;
+                    continue;
+                }
+                if (param_arg == _T("playlist")) {
+                    int value = 0;
+                    if (PARSE_ERROR_FLAG == (value = get_value_from_chr(list_cmaf_playlist, param_val.c_str()))) {
+                        print_cmd_error_invalid_value(tstring(option_name) + _T(" ") + param_arg + _T("="), param_val, list_cmaf_playlist);
+                        return 1;
+                    }
+                    common->cmaf.playlist = value;
+                    continue;
+                }
+                if (param_arg == _T("url")) {
+                    if (param_val.substr(0, 7) != _T("http://")) {
+                        print_cmd_error_invalid_value(tstring(option_name) + _T(" ") + param_arg + _T("="), param_val, _T("only http:// is supported."));
+                        return 1;
+                    }
+                    common->cmaf.url = param_val;
+                    continue;
+                }
+                if (param_arg == _T("method")) {
+                    param_val = touppercase(param_val);
+                    if (param_val != _T("POST") && param_val != _T("PUT")) {
+                        print_cmd_error_invalid_value(tstring(option_name) + _T(" ") + param_arg + _T("="), param_val, _T("should be post or put."));
+                        return 1;
+                    }
+                    common->cmaf.method = param_val;
+                    continue;
+                }
+                print_cmd_error_unknown_opt_param(option_name, param_arg, paramList);
+                return 1;
+            } else {
+                print_cmd_error_unknown_opt_param(option_name, param, paramList);
+                return 1;
+            }
+        }
+        return 0;
+    }
     if (IS_OPTION("avsync")) {
         int value = 0;
         i++;
@@ -1572,6 +1673,20 @@ int parse_one_ctrl_option(const TCHAR *option_name, const TCHAR *strInput[], int
         ctrl->lowLatency = true;
         return 0;
     }
+    if (IS_OPTION("chunk-parallel")) {
+        i++;
+        int value = 0;
+        if (1 != _stscanf_s(strInput[i], _T("%d"), &value)) {
+            print_cmd_error_invalid_value(option_name, strInput[i]);
+            return 1;
+        }
+        if (value < 0 || value > 64) {
+            print_cmd_error_invalid_value(option_name, strInput[i], _T("should be 0 - 64"));
+            return 1;
+        }
+        ctrl->chunkParallel = value;
+        return 0;
+    }
     if (IS_OPTION("input-thread") || IS_OPTION("thread-input")) {
         i++;
         int value = 0;
@@ -1611,8 +1726,8 @@ int parse_one_ctrl_option(const TCHAR *option_name, const TCHAR *strInput[], int
             print_cmd_error_invalid_value(option_name, strInput[i]);
             return 1;
         }
-        if (value < -1 || value >= 3) {
-            print_cmd_error_invalid_value(option_name, strInput[i], _T("shoule be in range: 0 - 2"));
+        if (value < -1 || value > 64) {
+            print_cmd_error_invalid_value(option_name, strInput[i], _T("should be -1 (auto) or in range: 0 - 64"));
             return 1;
         }
         ctrl->threadAudio = value;
@@ -1670,6 +1785,33 @@ int parse_one_ctrl_option(const TCHAR *option_name, const TCHAR *strInput[], int
         ctrl->perfMonitorInterval = std::max(50, v);
         return 0;
     }
+    if (IS_OPTION("trace")) {
+        i++;
+        ctrl->traceFile = strInput[i];
+        return 0;
+    }
+    if (IS_OPTION("metrics-port")) {
+        i++;
+        //[<host>:]<port>, IPv6アドレスは[]で囲む
+        tstring host = ctrl->metricsHost;
+        tstring port = strInput[i];
+        const auto pos = port.rfind(_T(':'));
+        if (pos != tstring::npos) {
+            host = port.substr(0, pos);
+            port = port.substr(pos + 1);
+            if (host.length() >= 2 && host.front() == _T('[') && host.back() == _T(']')) {
+                host = host.substr(1, host.length() - 2);
+            }
+        }
+        int value = 0;
+        if (host.length() == 0 || 1 != _stscanf_s(port.c_str(), _T("%d"), &value) || value <= 0 || value >= 65536) {
+            print_cmd_error_invalid_value(option_name, strInput[i]);
+            return 1;
+        }
+        ctrl->metricsHost = host;
+        ctrl->metricsPort = value;
+        return 0;
+    }
     if (IS_OPTION("parent-pid")) {
         i++;
         try {
@@ -1739,6 +1881,8 @@ tstring gen_cmd(const RGYParamCommon *param, const RGYParamCommon *defaultPrm, b
     std::basic_stringstream<TCHAR> tmp;
 
     OPT_NUM(_T("--input-analyze"), demuxAnalyzeSec);
+    OPT_NUM(_T("--input-prefetch"), demuxPrefetchMB);
+    OPT_NUM(_T("--avs-prefetch"), avsPrefetch);
     if (param->nTrimCount > 0) {
         cmd << _T(" --trim ");
         for (int i = 0; i < param->nTrimCount; i++) {
@@ -1994,6 +2138,19 @@ tstring gen_cmd(const RGYParamCommon *param, const RGYParamCommon *defaultPrm, b
     }
 
     OPT_NUM(_T("--output-buf"), outputBufSizeMB);
+    OPT_LST(_T("--output-sink"), outputSink, list_output_sink);
+    if (param->cmaf != defaultPrm->cmaf && param->cmaf.enable) {
+        std::basic_stringstream<TCHAR> tmp;
+        if (param->cmaf.chunkFrames != defaultPrm->cmaf.chunkFrames) tmp << _T(",chunk=") << param->cmaf.chunkFrames;
+        if (param->cmaf.window != defaultPrm->cmaf.window) tmp << _T(",window=") << param->cmaf.window;
+        if (param->cmaf.playlist != defaultPrm->cmaf.playlist) tmp << _T(",playlist=") << get_chr_from_value(list_cmaf_playlist, param->cmaf.playlist);
+        if (param->cmaf.url.length() > 0) tmp << _T(",url=") << param->cmaf.url;
+        if (param->cmaf.method != defaultPrm->cmaf.method) tmp << _T(",method=") << param->cmaf.method;
+        cmd << _T(" --cmaf");
+        if (!tmp.str().empty()) {
+            cmd << _T(" ") << tmp.str().substr(1);
+        }
+    }
     return cmd.str();
 }
 
@@ -2006,6 +2163,7 @@ tstring gen_cmd(const RGYParamControl *param, const RGYParamControl *defaultPrm,
     OPT_LST(_T("--simd-csp"), simdCsp, list_simd);
     OPT_NUM(_T("--max-procfps"), procSpeedLimit);
     OPT_BOOL(_T("--lowlatency"), _T(""), lowLatency);
+    OPT_NUM(_T("--chunk-parallel"), chunkParallel);
     OPT_STR_PATH(_T("--log"), logfile);
     OPT_LST(_T("--log-level"), loglevel, list_log_level);
     OPT_STR_PATH(_T("--log-framelist"), logFramePosList);
@@ -2028,6 +2186,11 @@ tstring gen_cmd(const RGYParamControl *param, const RGYParamControl *defaultPrm,
         }
     }
     OPT_NUM(_T("--perf-monitor-interval"), perfMonitorInterval);
+    OPT_STR_PATH(_T("--trace"), traceFile);
+    if (param->metricsPort > 0) {
+        const auto host = (param->metricsHost.find(_T(':')) != tstring::npos) ? _T("[") + param->metricsHost + _T("]") : param->metricsHost;
+        cmd << _T(" --metrics-port ") << host << _T(":") << param->metricsPort;
+    }
     OPT_NUM(_T("--parent-pid"), parentProcessID);
     return cmd.str();
 }
@@ -2112,6 +2275,11 @@ tstring gen_cmd_help_common() {
         _T("                                 default: 5 (seconds).\n")
         _T("                                 could be only used with avhw/avsw reader.\n")
         _T("                                 use if reader fails to detect audio stream.\n")
+        _T("   --input-prefetch <int>       read ahead input file in background (MB).\n")
+        _T("                                 default: 0 (disabled).\n")
+        _T("                                 could be only used with avhw/avsw reader.\n")
+        _T("   --avs-prefetch <int>         read ahead frames of avs reader in background.\n")
+        _T("                                 default: 0 (disabled).\n")
         _T("   --video-track <int>          set video track to encode in track id\n")
         _T("                                 1 (default)  highest resolution video track\n")
         _T("                                 2            next high resolution video track\n")
@@ -2245,7 +2413,11 @@ tstring gen_cmd_help_ctrl() {
     str += strsprintf(_T("")
         _T("   --max-procfps <int>         limit encoding speed for lower utilization.\n")
         _T("                                 default:0 (no limit)\n")
-        _T("   --lowlatency                minimize latency (might have lower throughput).\n"));
+        _T("   --lowlatency                minimize latency (might have lower throughput).\n")
+        _T("   --chunk-parallel <int>      split input at keyframes into <int> chunks and\n")
+        _T("                                 encode them in parallel processes.\n")
+        _T("                                 only for elementary stream output.\n")
+        _T("                                 up to 3 chunks per GPU run at the same time.\n"));
 #if ENABLE_AVCODEC_OUT_THREAD
     str += strsprintf(_T("")
         _T("   --output-thread <int>        set output thread num\n")
@@ -2258,6 +2430,10 @@ tstring gen_cmd_help_ctrl() {
         _T("                                  0: disable (slow, but less memory usage)\n")
         _T("                                  1: use one thread\n")
         _T("                                  2: use two thread\n")
+        _T("                                 3-: use one thread for decode, and\n")
+        _T("                                     the others for encode of each track\n")
+        _T("                                 auto uses one encode thread per track\n")
+        _T("                                 (up to 4) when 2 or more tracks are encoded.\n")
 #endif //#if ENABLE_AVCODEC_AUDPROCESS_THREAD
     );
 #endif //#if ENABLE_AVCODEC_OUT_THREAD
@@ -2270,14 +2446,15 @@ tstring gen_cmd_help_ctrl() {
         _T("                                 all          ... monitor all info\n")
         _T("                                 cpu_total    ... cpu total usage (%%)\n")
         _T("                                 cpu_kernel   ... cpu kernel usage (%%)\n")
-#if defined(_WIN32) || defined(_WIN64)
         _T("                                 cpu_main     ... cpu main thread usage (%%)\n")
         _T("                                 cpu_enc      ... cpu encode thread usage (%%)\n")
         _T("                                 cpu_in       ... cpu input thread usage (%%)\n")
         _T("                                 cpu_out      ... cpu output thread usage (%%)\n")
         _T("                                 cpu_aud_proc ... cpu aud proc thread usage (%%)\n")
         _T("                                 cpu_aud_enc  ... cpu aud enc thread usage (%%)\n")
-#endif //#if defined(_WIN32) || defined(_WIN64)
+#if !(defined(_WIN32) || defined(_WIN64))
+        _T("                                 cpu_counter  ... cpu cycles and llc misses (perf_event)\n")
+#endif //#if !(defined(_WIN32) || defined(_WIN64))
         _T("                                 cpu          ... monitor all cpu info\n")
         _T("                                 gpu_load    ... gpu usage (%%)\n")
         _T("                                 gpu_clock   ... gpu avg clock\n")
@@ -2288,6 +2465,7 @@ tstring gen_cmd_help_ctrl() {
 #endif
         _T("                                 gpu         ... monitor all gpu info\n")
         _T("                                 queue       ... queue usage\n")
+        _T("                                 out_sink    ... output sink in-flight and write latency\n")
         _T("                                 mem_private ... private memory (MB)\n")
         _T("                                 mem_virtual ... virtual memory (MB)\n")
         _T("                                 mem         ... monitor all memory info\n")
@@ -2301,6 +2479,12 @@ tstring gen_cmd_help_ctrl() {
         _T("                                 frame_out   ... written_frames\n")
         _T("                                 \n")
         _T("   --perf-monitor-interval <int> set perf monitor check interval (millisec)\n")
-        _T("                                 default 500, must be 50 or more\n"));
+        _T("                                 default 500, must be 50 or more\n")
+        _T("   --trace <string>              output per-frame trace of each pipeline stage\n")
+        _T("                                 as Chrome trace json (chrome://tracing, Perfetto)\n")
+        _T("   --metrics-port [<string>:]<int>\n")
+        _T("                                 serve encode and perf monitor stats as\n")
+        _T("                                 OpenMetrics (Prometheus) at http://<host>:<int>/metrics\n")
+        _T("                                 host defaults to 127.0.0.1\n"));
     return str;
 }
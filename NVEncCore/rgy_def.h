@@ -44,6 +44,7 @@ static const int MAX_FILENAME_LEN = 1024;
 
 static const int RGY_OUTPUT_THREAD_AUTO = -1;
 static const int RGY_AUDIO_THREAD_AUTO = -1;
+static const int AUDIO_ENCODE_THREAD_AUTO_MAX = 4; //--thread-audio 自動時の音声エンコードスレッド数の上限
 static const int RGY_INPUT_THREAD_AUTO = -1;
 
 static const int CHECK_PTS_MAX_INSERT_FRAMES = 8;
@@ -693,6 +694,64 @@ const CX_DESC list_resampler[] = {
     { NULL, 0 }
 };
 
+enum RGYOutputSink {
+    RGY_OUTPUT_SINK_STDIO  = 0, //FILE*によるバッファ付きの書き込み
+    RGY_OUTPUT_SINK_ASYNC  = 1, //書き込みスレッドによる非同期書き込み
+    RGY_OUTPUT_SINK_DIRECT = 2, //書き込みスレッドによる非同期書き込み + O_DIRECT (Linuxのみ)
+};
+
+const CX_DESC list_output_sink[] = {
+    { _T("stdio"),  RGY_OUTPUT_SINK_STDIO  },
+    { _T("async"),  RGY_OUTPUT_SINK_ASYNC  },
+    { _T("direct"), RGY_OUTPUT_SINK_DIRECT },
+    { NULL, 0 }
+};
+
+enum RGYCMAFPlaylist {
+    RGY_CMAF_PLAYLIST_NONE = 0x00,
+    RGY_CMAF_PLAYLIST_HLS  = 0x01,
+    RGY_CMAF_PLAYLIST_DASH = 0x02,
+    RGY_CMAF_PLAYLIST_ALL  = RGY_CMAF_PLAYLIST_HLS | RGY_CMAF_PLAYLIST_DASH,
+};
+
+const CX_DESC list_cmaf_playlist[] = {
+    { _T("none"), RGY_CMAF_PLAYLIST_NONE },
+    { _T("hls"),  RGY_CMAF_PLAYLIST_HLS  },
+    { _T("dash"), RGY_CMAF_PLAYLIST_DASH },
+    { _T("all"),  RGY_CMAF_PLAYLIST_ALL  },
+    { NULL, 0 }
+};
+
+//CMAF (fragmented mp4) のセグメント出力の設定
+struct RGYCMAFParam {
+    bool enable;
+    int chunkFrames;   //セグメント内をchunk (moof+mdat) に区切るフレーム数 (0でセグメント単位)
+    int window;        //プレイリストに残すセグメント数 (0ですべて残す)
+    int playlist;      //RGY_CMAF_PLAYLIST_xxx
+    tstring url;       //http出力先 (空ならファイルに出力する)
+    tstring method;    //http出力時のメソッド
+
+    RGYCMAFParam() :
+        enable(false),
+        chunkFrames(0),
+        window(0),
+        playlist(RGY_CMAF_PLAYLIST_HLS),
+        url(),
+        method(_T("POST")) {
+    }
+    bool operator==(const RGYCMAFParam &x) const {
+        return enable == x.enable
+            && chunkFrames == x.chunkFrames
+            && window == x.window
+            && playlist == x.playlist
+            && url == x.url
+            && method == x.method;
+    }
+    bool operator!=(const RGYCMAFParam &x) const {
+        return !(*this == x);
+    }
+};
+
 const CX_DESC list_interlaced[] = {
     { _T("progressive"), RGY_PICSTRUCT_FRAME     },
     { _T("tff"),         RGY_PICSTRUCT_FRAME_TFF },
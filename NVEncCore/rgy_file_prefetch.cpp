@@ -0,0 +1,172 @@
+﻿// -----------------------------------------------------------------------------------------
+// QSVEnc/NVEnc/VCEEnc by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2020 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+#include <vector>
+#include <cstdarg>
+#include "rgy_file_prefetch.h"
+
+RGYFilePrefetch::RGYFilePrefetch(std::shared_ptr<RGYLog> log) :
+    m_log(log),
+    m_fp(),
+    m_prefetchSize(0),
+    m_mtx(),
+    m_cv(),
+    m_abort(false),
+    m_readPos(0),
+    m_prefetchPos(0),
+    m_totalRead(0),
+    m_state(RGY_PREFETCH_RUNNING),
+    m_thread() {
+}
+
+RGYFilePrefetch::~RGYFilePrefetch() {
+    close();
+}
+
+RGY_ERR RGYFilePrefetch::start(const tstring& filename, int64_t prefetchSize) {
+    close();
+    m_fp.reset(_tfsopen(filename.c_str(), _T("rb"), _SH_DENYNO));
+    if (!m_fp) {
+        AddMessage(RGY_LOG_WARN, _T("failed to open input file for prefetch, prefetch disabled.\n"));
+        return RGY_ERR_FILE_OPEN;
+    }
+    m_prefetchSize = prefetchSize;
+    m_abort = false;
+    m_readPos = 0;
+    m_prefetchPos = 0;
+    m_totalRead = 0;
+    m_state = RGY_PREFETCH_RUNNING;
+    m_thread = std::thread(&RGYFilePrefetch::threadFunc, this);
+    AddMessage(RGY_LOG_DEBUG, _T("started prefetch thread: %lld MB.\n"), (long long int)(prefetchSize >> 20));
+    return RGY_ERR_NONE;
+}
+
+void RGYFilePrefetch::close() {
+    {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        m_abort = true;
+    }
+    m_cv.notify_all();
+    if (m_thread.joinable()) {
+        m_thread.join();
+        AddMessage(RGY_LOG_DEBUG, _T("closed prefetch thread: read %.1f MB in total.\n"), m_totalRead / (1024.0 * 1024.0));
+    }
+    m_fp.reset();
+    m_abort = false;
+}
+
+void RGYFilePrefetch::setReadPos(int64_t pos) {
+    {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        if (m_readPos == pos) {
+            return;
+        }
+        m_readPos = pos;
+    }
+    m_cv.notify_one();
+}
+
+int64_t RGYFilePrefetch::readPos() {
+    std::lock_guard<std::mutex> lock(m_mtx);
+    return m_readPos;
+}
+
+RGYPrefetchState RGYFilePrefetch::state() {
+    std::lock_guard<std::mutex> lock(m_mtx);
+    return m_state;
+}
+
+int64_t RGYFilePrefetch::prefetchPos() {
+    std::lock_guard<std::mutex> lock(m_mtx);
+    return m_prefetchPos;
+}
+
+int64_t RGYFilePrefetch::totalRead() {
+    std::lock_guard<std::mutex> lock(m_mtx);
+    return m_totalRead;
+}
+
+void RGYFilePrefetch::threadFunc() {
+    std::vector<uint8_t> buffer(CHUNK_SIZE);
+    std::unique_lock<std::mutex> lock(m_mtx);
+    while (!m_abort) {
+        const int64_t readPos = m_readPos;
+        if (m_prefetchPos < readPos || m_prefetchPos > readPos + m_prefetchSize + (int64_t)CHUNK_SIZE) {
+            //demuxerに追いつかれたか、demuxerがシークした場合は、読み込み位置から再開する
+            m_prefetchPos = readPos;
+            m_state = RGY_PREFETCH_RUNNING;
+            if (_fseeki64(m_fp.get(), m_prefetchPos, SEEK_SET) != 0) {
+                m_state = RGY_PREFETCH_ERROR;
+                break;
+            }
+        }
+        if (m_state == RGY_PREFETCH_EOF || m_prefetchPos >= readPos + m_prefetchSize) {
+            //十分先まで読んだか、ファイル終端に到達した場合は、demuxerが読み進めるまで待機する
+            m_cv.wait(lock, [this, readPos]() { return m_abort || m_readPos != readPos; });
+            //ファイルが伸びていく場合もあるので、ファイル終端からも読み込みを再開する
+            if (m_state == RGY_PREFETCH_EOF) {
+                m_state = RGY_PREFETCH_RUNNING;
+            }
+            continue;
+        }
+        lock.unlock();
+        const auto ret = _fread_nolock(buffer.data(), 1, buffer.size(), m_fp.get());
+        const bool readError = ret == 0 && ferror(m_fp.get());
+        lock.lock();
+        if (ret == 0) {
+            if (readError) {
+                m_state = RGY_PREFETCH_ERROR;
+                break;
+            }
+            clearerr(m_fp.get());
+            m_state = RGY_PREFETCH_EOF;
+            continue;
+        }
+        m_prefetchPos += ret;
+        m_totalRead += ret;
+    }
+    const auto state = m_state;
+    const auto prefetchPos = m_prefetchPos;
+    lock.unlock();
+    if (state == RGY_PREFETCH_ERROR) {
+        AddMessage(RGY_LOG_WARN, _T("failed to read input file for prefetch at %lld, prefetch stopped.\n"), (long long int)prefetchPos);
+    }
+}
+
+void RGYFilePrefetch::AddMessage(int log_level, const TCHAR *format, ...) {
+    if (m_log == nullptr || log_level < m_log->getLogLevel()) {
+        return;
+    }
+    va_list args;
+    va_start(args, format);
+    int len = _vsctprintf(format, args) + 1; // _vscprintf doesn't count terminating '\0'
+    tstring buffer;
+    buffer.resize(len, _T('\0'));
+    _vstprintf_s(&buffer[0], len, format, args);
+    va_end(args);
+    m_log->write(log_level, (tstring(_T("prefetch: ")) + buffer.c_str()).c_str());
+}
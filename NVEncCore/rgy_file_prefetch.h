@@ -0,0 +1,90 @@
+﻿// -----------------------------------------------------------------------------------------
+// QSVEnc/NVEnc/VCEEnc by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2020 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+#pragma once
+#ifndef __RGY_FILE_PREFETCH_H__
+#define __RGY_FILE_PREFETCH_H__
+
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "rgy_tchar.h"
+#include "rgy_err.h"
+#include "rgy_log.h"
+#include "rgy_util.h"
+
+//ファイル先読みスレッドの状態
+enum RGYPrefetchState {
+    RGY_PREFETCH_RUNNING, //先読み中、または読み込み位置の更新待ち
+    RGY_PREFETCH_EOF,     //ファイル終端に到達し、demuxerが読み進めるのを待っている
+    RGY_PREFETCH_ERROR,   //ファイルの読み込みに失敗し、先読みを終了した
+};
+
+//demuxerとは別にファイルを開き、demuxerの読み込み位置より先をバックグラウンドで読んでおく
+//読んだデータは捨てるが、OSのファイルキャッシュに載るので、demuxerの読み込みは待たされなくなる
+//ファイル終端に到達したあとも、読み込み位置が更新されればファイル終端から読み込みを再開する (伸びていくファイル用)
+class RGYFilePrefetch {
+public:
+    static const size_t CHUNK_SIZE = 1024 * 1024; //1回の読み込みサイズ
+
+    RGYFilePrefetch(std::shared_ptr<RGYLog> log);
+    ~RGYFilePrefetch();
+
+    //ファイルを開き、読み込み位置(0)からprefetchSizeだけ先まで読むスレッドを開始する
+    RGY_ERR start(const tstring& filename, int64_t prefetchSize);
+    //先読みスレッドを停止する
+    void close();
+    //demuxerの読み込み位置を通知する (シークした場合も含む)
+    void setReadPos(int64_t pos);
+    int64_t readPos();
+    bool running() const { return m_thread.joinable(); }
+    RGYPrefetchState state();
+    //先読みの済んだ位置
+    int64_t prefetchPos();
+    //これまでに先読みしたサイズの合計
+    int64_t totalRead();
+protected:
+    void threadFunc();
+    void AddMessage(int log_level, const TCHAR *format, ...);
+
+    std::shared_ptr<RGYLog> m_log;
+    std::unique_ptr<FILE, fp_deleter> m_fp;
+    int64_t m_prefetchSize;       //読み込み位置から先読みするサイズ
+    std::mutex m_mtx;             //以下のスレッドとの共有データを保護する
+    std::condition_variable m_cv; //読み込み位置の更新・停止をスレッドに通知する
+    bool m_abort;                 //スレッドに停止を通知する
+    int64_t m_readPos;            //demuxerがファイルを読み込んでいる位置
+    int64_t m_prefetchPos;        //先読みの済んだ位置
+    int64_t m_totalRead;          //先読みしたサイズの合計
+    RGYPrefetchState m_state;
+    std::thread m_thread;
+};
+
+#endif //__RGY_FILE_PREFETCH_H__
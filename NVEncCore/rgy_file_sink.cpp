@@ -0,0 +1,386 @@
+﻿// -----------------------------------------------------------------------------------------
+// QSVEnc/NVEnc/VCEEnc by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2020 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <chrono>
+#include <algorithm>
+#include <cstdarg>
+#include <cstring>
+#if defined(_WIN32) || defined(_WIN64)
+#include <io.h>
+#include <share.h>
+#else
+#include <unistd.h>
+#endif
+#include "rgy_file_sink.h"
+#include "rgy_util.h"
+
+#if defined(_WIN32) || defined(_WIN64)
+static int sink_open(const TCHAR *filename, bool direct) {
+    int fd = -1;
+    if (direct) {
+        //WindowsではO_DIRECT相当の書き込みには対応しない
+        return -1;
+    }
+    //"movflags:faststart"にするには、共有モードで開けるようにする必要がある
+    if (_tsopen_s(&fd, filename, _O_RDWR | _O_CREAT | _O_TRUNC | _O_BINARY, _SH_DENYWR, _S_IREAD | _S_IWRITE) != 0) {
+        return -1;
+    }
+    return fd;
+}
+static int64_t sink_pwrite(int fd, const void *buf, size_t size, int64_t offset, std::mutex& mtx) {
+    //Windowsにはpwriteがないので、ファイル位置の移動と書き込みをまとめてロックする
+    std::lock_guard<std::mutex> lock(mtx);
+    if (_lseeki64(fd, offset, SEEK_SET) < 0) {
+        return -1;
+    }
+    return _write(fd, buf, (unsigned int)size);
+}
+static int64_t sink_pread(int fd, void *buf, size_t size, int64_t offset) {
+    if (_lseeki64(fd, offset, SEEK_SET) < 0) {
+        return -1;
+    }
+    return _read(fd, buf, (unsigned int)size);
+}
+static void sink_close(int fd) {
+    _close(fd);
+}
+#else
+static int sink_open(const TCHAR *filename, bool direct) {
+    if (direct) {
+#if defined(O_DIRECT)
+        return ::open(filename, O_WRONLY | O_DIRECT | O_CLOEXEC);
+#else
+        return -1;
+#endif
+    }
+    return ::open(filename, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+}
+static int64_t sink_pwrite(int fd, const void *buf, size_t size, int64_t offset, std::mutex& mtx) {
+    UNREFERENCED_PARAMETER(mtx);
+    size_t written = 0;
+    while (written < size) {
+        const auto ret = ::pwrite(fd, (const uint8_t *)buf + written, size - written, offset + written);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (ret == 0) {
+            break;
+        }
+        written += ret;
+    }
+    return written;
+}
+static int64_t sink_pread(int fd, void *buf, size_t size, int64_t offset) {
+    ssize_t ret = 0;
+    do {
+        ret = ::pread(fd, buf, size, offset);
+    } while (ret < 0 && errno == EINTR);
+    return ret;
+}
+static void sink_close(int fd) {
+    ::close(fd);
+}
+#endif
+
+RGYFileSinkAsync::RGYFileSinkAsync(std::shared_ptr<RGYLog> log, size_t bufferSize, bool directIO, PerfQueueInfo *queueInfo) :
+    m_log(log),
+    m_queueInfo(queueInfo),
+    m_blockSize(0),
+    m_directIO(directIO),
+    m_fd(-1),
+    m_fdDirect(-1),
+    m_threads(),
+    m_mtx(),
+    m_mtxFile(),
+    m_cvSubmit(),
+    m_cvComplete(),
+    m_buffers(),
+    m_free(),
+    m_pending(),
+    m_writing(0),
+    m_cur(),
+    m_pos(0),
+    m_fileSize(0),
+    m_abort(false),
+    m_error(false),
+    m_inflight(0),
+    m_latency() {
+    //バッファを書き込みスレッド数+1個のブロックに分け、1つをバッファリングに、残りを書き込みに使う
+    m_blockSize = (std::max<size_t>)(bufferSize / (WRITE_THREADS + 1), 1024 * 1024);
+    m_blockSize = (m_blockSize + BLOCK_ALIGN - 1) & ~(BLOCK_ALIGN - 1);
+    m_cur.ptr = nullptr;
+    m_cur.size = 0;
+    m_cur.offset = 0;
+    for (auto& lat : m_latency) {
+        lat = 0;
+    }
+}
+
+RGYFileSinkAsync::~RGYFileSinkAsync() {
+    close();
+}
+
+void RGYFileSinkAsync::AddMessage(int log_level, const tstring& str) {
+    if (m_log == nullptr || log_level < m_log->getLogLevel()) {
+        return;
+    }
+    auto lines = split(str, _T("\n"));
+    for (const auto& line : lines) {
+        if (line[0] != _T('\0')) {
+            m_log->write(log_level, (tstring(_T("file sink: ")) + line + _T("\n")).c_str());
+        }
+    }
+}
+
+void RGYFileSinkAsync::AddMessage(int log_level, const TCHAR *format, ...) {
+    if (m_log == nullptr || log_level < m_log->getLogLevel()) {
+        return;
+    }
+    va_list args;
+    va_start(args, format);
+    int len = _vsctprintf(format, args) + 1; // _vscprintf doesn't count terminating '\0'
+    tstring buffer;
+    buffer.resize(len, _T('\0'));
+    _vstprintf_s(&buffer[0], len, format, args);
+    va_end(args);
+    AddMessage(log_level, buffer);
+}
+
+RGY_ERR RGYFileSinkAsync::open(const TCHAR *filename) {
+    if ((m_fd = sink_open(filename, false)) < 0) {
+        AddMessage(RGY_LOG_ERROR, _T("failed to open output file \"%s\": %s.\n"), filename, _tcserror(errno));
+        return RGY_ERR_FILE_OPEN;
+    }
+    if (m_directIO) {
+        //O_DIRECTに対応していないファイルシステム (tmpfsなど) では通常の書き込みのみとする
+        if ((m_fdDirect = sink_open(filename, true)) < 0) {
+            AddMessage(RGY_LOG_WARN, _T("O_DIRECT is not supported for \"%s\", using buffered write.\n"), filename);
+        }
+    }
+    for (int i = 0; i < WRITE_THREADS + 1; i++) {
+        std::unique_ptr<uint8_t, aligned_malloc_deleter> buf((uint8_t *)_aligned_malloc(m_blockSize, BLOCK_ALIGN));
+        if (!buf) {
+            AddMessage(RGY_LOG_ERROR, _T("failed to allocate output buffer.\n"));
+            return RGY_ERR_MEMORY_ALLOC;
+        }
+        Block block;
+        block.ptr = buf.get();
+        block.size = 0;
+        block.offset = 0;
+        m_free.push_back(block);
+        m_buffers.push_back(std::move(buf));
+    }
+    for (int i = 0; i < WRITE_THREADS; i++) {
+        m_threads.push_back(std::thread(&RGYFileSinkAsync::threadFunc, this));
+    }
+    AddMessage(RGY_LOG_DEBUG, _T("opened \"%s\" (%s), block %d KB x %d.\n"), filename, name(), (int)(m_blockSize >> 10), WRITE_THREADS + 1);
+    return RGY_ERR_NONE;
+}
+
+void RGYFileSinkAsync::addLatency(int64_t us) {
+    //1ms, 4ms, 16ms, 64ms, 256ms, それ以上
+    int bin = 0;
+    for (int64_t limit = 1000; bin < PERF_OUTPUT_WRITE_LATENCY_BINS - 1 && us >= limit; limit *= 4) {
+        bin++;
+    }
+    m_latency[bin]++;
+    if (m_queueInfo) {
+        m_queueInfo->output_write_latency[bin] = m_latency[bin];
+    }
+}
+
+int64_t RGYFileSinkAsync::writeBlock(const Block *block) {
+    //O_DIRECTはオフセット・サイズともにアラインされている場合のみ使用する
+    const bool aligned = ((block->offset | block->size) & (BLOCK_ALIGN - 1)) == 0;
+    const int fd = (m_fdDirect >= 0 && aligned) ? m_fdDirect : m_fd;
+    const auto start = std::chrono::steady_clock::now();
+    const auto ret = sink_pwrite(fd, block->ptr, block->size, block->offset, m_mtxFile);
+    addLatency(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count());
+    return ret;
+}
+
+void RGYFileSinkAsync::threadFunc() {
+    std::unique_lock<std::mutex> lock(m_mtx);
+    for (;;) {
+        m_cvSubmit.wait(lock, [this]() { return m_abort || m_pending.size() > 0; });
+        if (m_pending.size() == 0) {
+            break;
+        }
+        Block block = m_pending.front();
+        m_pending.pop_front();
+        m_writing++;
+        lock.unlock();
+        const auto ret = writeBlock(&block);
+        if (ret != (int64_t)block.size) {
+            m_error = true;
+        }
+        m_inflight -= block.size;
+        if (m_queueInfo) {
+            m_queueInfo->output_inflight = (size_t)m_inflight;
+        }
+        lock.lock();
+        block.size = 0;
+        m_free.push_back(block);
+        m_writing--;
+        m_cvComplete.notify_all();
+    }
+}
+
+void RGYFileSinkAsync::submitBlock() {
+    if (m_cur.ptr == nullptr) {
+        return;
+    }
+    if (m_cur.size == 0) {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        m_free.push_back(m_cur);
+    } else {
+        m_inflight += m_cur.size;
+        if (m_queueInfo) {
+            m_queueInfo->output_inflight = (size_t)m_inflight;
+        }
+        std::lock_guard<std::mutex> lock(m_mtx);
+        m_pending.push_back(m_cur);
+        m_cvSubmit.notify_one();
+    }
+    m_cur.ptr = nullptr;
+    m_cur.size = 0;
+}
+
+void RGYFileSinkAsync::waitIdle() {
+    submitBlock();
+    std::unique_lock<std::mutex> lock(m_mtx);
+    m_cvComplete.wait(lock, [this]() { return m_pending.size() == 0 && m_writing == 0; });
+}
+
+int64_t RGYFileSinkAsync::write(const void *buf, size_t size) {
+    if (m_error) {
+        return -1;
+    }
+    const uint8_t *ptr = (const uint8_t *)buf;
+    size_t remain = size;
+    while (remain > 0) {
+        if (m_cur.ptr == nullptr) {
+            //空きブロックができるまで待機する
+            std::unique_lock<std::mutex> lock(m_mtx);
+            m_cvComplete.wait(lock, [this]() { return m_free.size() > 0; });
+            m_cur = m_free.front();
+            m_free.pop_front();
+            m_cur.size = 0;
+            m_cur.offset = m_pos;
+        }
+        const size_t copySize = (std::min)(remain, m_blockSize - m_cur.size);
+        memcpy(m_cur.ptr + m_cur.size, ptr, copySize);
+        m_cur.size += copySize;
+        m_pos += copySize;
+        m_fileSize = (std::max)(m_fileSize, m_pos);
+        ptr += copySize;
+        remain -= copySize;
+        if (m_cur.size == m_blockSize) {
+            submitBlock();
+        }
+    }
+    return (int64_t)size;
+}
+
+int64_t RGYFileSinkAsync::read(void *buf, size_t size) {
+    //書き込み中のデータを読む可能性があるので、すべて書き込んでから読む
+    waitIdle();
+    const auto ret = sink_pread(m_fd, buf, size, m_pos);
+    if (ret > 0) {
+        m_pos += ret;
+    }
+    return ret;
+}
+
+int64_t RGYFileSinkAsync::seek(int64_t offset, int whence) {
+    int64_t pos = 0;
+    switch (whence) {
+    case SEEK_SET: pos = offset; break;
+    case SEEK_CUR: pos = m_pos + offset; break;
+    case SEEK_END: pos = m_fileSize + offset; break;
+    default: return -1;
+    }
+    if (pos < 0) {
+        return -1;
+    }
+    if (pos != m_pos) {
+        //書き込み中のブロックと範囲が重なる書き込みが追い越さないよう、すべて書き込まれるのを待つ
+        waitIdle();
+        m_pos = pos;
+    }
+    return m_pos;
+}
+
+RGY_ERR RGYFileSinkAsync::close() {
+    if (m_fd < 0) {
+        return RGY_ERR_NONE;
+    }
+    waitIdle();
+    {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        m_abort = true;
+        m_cvSubmit.notify_all();
+    }
+    for (auto& th : m_threads) {
+        if (th.joinable()) {
+            th.join();
+        }
+    }
+    m_threads.clear();
+    if (m_fdDirect >= 0) {
+        sink_close(m_fdDirect);
+        m_fdDirect = -1;
+    }
+    sink_close(m_fd);
+    m_fd = -1;
+    m_free.clear();
+    m_buffers.clear();
+    AddMessage(RGY_LOG_DEBUG, _T("closed, write latency <1ms:%u, <4ms:%u, <16ms:%u, <64ms:%u, <256ms:%u, >=256ms:%u.\n"),
+        (uint32_t)m_latency[0], (uint32_t)m_latency[1], (uint32_t)m_latency[2], (uint32_t)m_latency[3], (uint32_t)m_latency[4], (uint32_t)m_latency[5]);
+    if (m_error) {
+        AddMessage(RGY_LOG_ERROR, _T("Error writing file.\nNot enough disk space!\n"));
+        return RGY_ERR_UNKNOWN;
+    }
+    return RGY_ERR_NONE;
+}
+
+std::unique_ptr<RGYFileSink> createFileSink(RGYOutputSink type, std::shared_ptr<RGYLog> log, size_t bufferSize, PerfQueueInfo *queueInfo) {
+    switch (type) {
+    case RGY_OUTPUT_SINK_ASYNC:
+        return std::unique_ptr<RGYFileSink>(new RGYFileSinkAsync(log, bufferSize, false, queueInfo));
+    case RGY_OUTPUT_SINK_DIRECT:
+        return std::unique_ptr<RGYFileSink>(new RGYFileSinkAsync(log, bufferSize, true, queueInfo));
+    case RGY_OUTPUT_SINK_STDIO:
+    default:
+        return std::unique_ptr<RGYFileSink>();
+    }
+}
@@ -0,0 +1,130 @@
+﻿// -----------------------------------------------------------------------------------------
+// QSVEnc/NVEnc/VCEEnc by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2020 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+#pragma once
+#ifndef __RGY_FILE_SINK_H__
+#define __RGY_FILE_SINK_H__
+
+#include <cstdint>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <memory>
+#include "rgy_osdep.h"
+#include "rgy_def.h"
+#include "rgy_err.h"
+#include "rgy_log.h"
+#include "rgy_util.h"
+#include "rgy_perf_monitor.h"
+
+//出力ファイルへの書き込みを行うクラスの基底
+//write/seek/readはいずれも単一のスレッドから呼ぶこと
+class RGYFileSink {
+public:
+    RGYFileSink() {};
+    virtual ~RGYFileSink() {};
+
+    virtual RGY_ERR open(const TCHAR *filename) = 0;
+    //書き込んだバイト数を返す (エラー時は負の値)
+    virtual int64_t write(const void *buf, size_t size) = 0;
+    //読み込んだバイト数を返す (エラー時は負の値)
+    virtual int64_t read(void *buf, size_t size) = 0;
+    //移動後の位置を返す (エラー時は負の値)
+    virtual int64_t seek(int64_t offset, int whence) = 0;
+    virtual RGY_ERR close() = 0;
+    virtual const TCHAR *name() const = 0;
+};
+
+//書き込みスレッドで非同期に書き込むFileSink
+//ブロック単位でバッファリングし、埋まったブロックを書き込みスレッドがpwriteする
+//directIOが有効な場合 (Linuxのみ)、アラインされたブロックはO_DIRECTで書き込み、ページキャッシュを経由しない
+class RGYFileSinkAsync : public RGYFileSink {
+public:
+    RGYFileSinkAsync(std::shared_ptr<RGYLog> log, size_t bufferSize, bool directIO, PerfQueueInfo *queueInfo);
+    virtual ~RGYFileSinkAsync();
+
+    virtual RGY_ERR open(const TCHAR *filename) override;
+    virtual int64_t write(const void *buf, size_t size) override;
+    virtual int64_t read(void *buf, size_t size) override;
+    virtual int64_t seek(int64_t offset, int whence) override;
+    virtual RGY_ERR close() override;
+    virtual const TCHAR *name() const override {
+        return (m_fdDirect >= 0) ? _T("async+direct") : _T("async");
+    }
+
+    //O_DIRECTで要求されるアラインメント
+    static const size_t BLOCK_ALIGN = 4096;
+    //同時に書き込み中にできるブロック数 (+1がバッファリング中のブロック)
+    static const int WRITE_THREADS = 2;
+protected:
+    struct Block {
+        uint8_t *ptr;
+        size_t   size;
+        int64_t  offset;
+    };
+    void threadFunc();
+    //バッファリング中のブロックを書き込みスレッドに渡す
+    void submitBlock();
+    //書き込み中のブロックがすべて書き込まれるのを待つ
+    void waitIdle();
+    int64_t writeBlock(const Block *block);
+    void addLatency(int64_t us);
+    void AddMessage(int log_level, const tstring& str);
+    void AddMessage(int log_level, const TCHAR *format, ...);
+
+    std::shared_ptr<RGYLog> m_log;
+    PerfQueueInfo *m_queueInfo;
+    size_t m_blockSize;
+    bool m_directIO;
+    int m_fd;                       //通常の書き込み/読み込み用
+    int m_fdDirect;                 //O_DIRECTでの書き込み用 (使用しない場合は-1)
+    std::vector<std::thread> m_threads;
+    std::mutex m_mtx;
+    std::mutex m_mtxFile;            //ファイル位置の移動と書き込みを排他する (pwriteのない環境用)
+    std::condition_variable m_cvSubmit;   //m_pendingにブロックが追加された
+    std::condition_variable m_cvComplete; //ブロックの書き込みが終了した
+    std::vector<std::unique_ptr<uint8_t, aligned_malloc_deleter>> m_buffers;
+    std::deque<Block> m_free;       //空きブロック
+    std::deque<Block> m_pending;    //書き込み待ちのブロック
+    int m_writing;                  //書き込み中のブロック数
+    Block m_cur;                    //バッファリング中のブロック (ptr == nullptrならなし)
+    int64_t m_pos;                  //論理的なファイル位置
+    int64_t m_fileSize;             //書き込んだ範囲の終端
+    bool m_abort;
+    std::atomic<bool> m_error;
+    std::atomic<int64_t> m_inflight; //書き込み待ち/書き込み中のバイト数
+    std::atomic<uint32_t> m_latency[PERF_OUTPUT_WRITE_LATENCY_BINS]; //書き込み時間のヒストグラム
+};
+
+//typeに応じたFileSinkを作成する
+//RGY_OUTPUT_SINK_STDIOの場合はnullptrを返すので、従来どおりFILE*で書き込むこと
+std::unique_ptr<RGYFileSink> createFileSink(RGYOutputSink type, std::shared_ptr<RGYLog> log, size_t bufferSize, PerfQueueInfo *queueInfo);
+
+#endif //__RGY_FILE_SINK_H__
@@ -0,0 +1,253 @@
+﻿// -----------------------------------------------------------------------------------------
+// QSVEnc/NVEnc/VCEEnc by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2020 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+#include <chrono>
+#include <cstdarg>
+#include <cstring>
+#include <algorithm>
+#include "rgy_frame_fanout.h"
+#include "rgy_mem_pool.h"
+#include "rgy_util.h"
+
+RGYFrameFanout::RGYFrameFanout() :
+    m_sync(std::make_shared<Sync>()),
+    m_branches(),
+    m_frameInfo(),
+    m_frameSize(0),
+    m_queueSize(0),
+    m_bufferCount(0),
+    m_load(),
+    m_thLoad(),
+    m_abort(false),
+    m_err(RGY_ERR_NONE),
+    m_stats(),
+    m_log() {
+    memset(&m_stats, 0, sizeof(m_stats));
+}
+
+RGYFrameFanout::~RGYFrameFanout() {
+    close();
+}
+
+void RGYFrameFanout::AddMessage(int log_level, const TCHAR *format, ...) {
+    if (m_log == nullptr || log_level < m_log->getLogLevel()) {
+        return;
+    }
+    va_list args;
+    va_start(args, format);
+    int len = _vsctprintf(format, args) + 1; // _vscprintf doesn't count terminating '\0'
+    tstring buffer;
+    buffer.resize(len, _T('\0'));
+    _vstprintf_s(&buffer[0], len, format, args);
+    va_end(args);
+    m_log->write(log_level, (tstring(_T("fanout: ")) + buffer.c_str()).c_str());
+}
+
+RGY_ERR RGYFrameFanout::init(int branches, const FrameInfo& frameInfo, size_t frameSize, int queueSize, int bufferCount, funcLoad load, std::shared_ptr<RGYLog> log) {
+    m_log = log;
+    if (branches <= 0 || queueSize <= 0 || frameSize == 0 || !load) {
+        AddMessage(RGY_LOG_ERROR, _T("invalid parameter.\n"));
+        return RGY_ERR_INVALID_PARAM;
+    }
+    m_branches.resize(branches);
+    m_frameInfo = frameInfo;
+    m_frameInfo.ptr = nullptr;
+    m_frameSize = frameSize;
+    m_queueSize = queueSize;
+    //各出力先がキューを満たし、さらに1枚ずつ処理中でも読み込みを続けられる数
+    m_bufferCount = (bufferCount > 0) ? bufferCount : branches + queueSize + 1;
+    m_load = load;
+    AddMessage(RGY_LOG_DEBUG, _T("init %d branches, %dx%d %s, queue %d, buffers %d.\n"),
+        branches, frameInfo.width, frameInfo.height, RGY_CSP_NAMES[frameInfo.csp], m_queueSize, m_bufferCount);
+    return RGY_ERR_NONE;
+}
+
+RGY_ERR RGYFrameFanout::start() {
+    if (m_branches.size() == 0) {
+        return RGY_ERR_NOT_INITIALIZED;
+    }
+    m_thLoad = std::thread(&RGYFrameFanout::loadThread, this);
+    return RGY_ERR_NONE;
+}
+
+bool RGYFrameFanout::canLoad() const {
+    if (m_sync->buffersInUse >= m_bufferCount) {
+        return false;
+    }
+    for (const auto& branch : m_branches) {
+        if (!branch.closed && (int)branch.queue.size() >= m_queueSize) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void RGYFrameFanout::pushAll(const std::shared_ptr<RGYFanoutFrame>& frame) {
+    {
+        std::lock_guard<std::mutex> lock(m_sync->mtx);
+        if (frame->info.ptr) {
+            m_stats.frames++;
+        }
+        for (auto& branch : m_branches) {
+            if (!branch.closed) {
+                branch.queue.push_back(frame);
+            }
+        }
+    }
+    m_sync->cvPop.notify_all();
+}
+
+void RGYFrameFanout::loadThread() {
+    auto pool = RGYMemPool::shared();
+    for (int iframe = 0; ; iframe++) {
+        {
+            std::unique_lock<std::mutex> lock(m_sync->mtx);
+            if (!canLoad()) {
+                const bool waitBuffer = m_sync->buffersInUse >= m_bufferCount;
+                const auto start = std::chrono::high_resolution_clock::now();
+                m_sync->cvLoad.wait(lock, [this]() { return m_abort || canLoad(); });
+                const auto elapsed = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+                ((waitBuffer) ? m_stats.waitBufferMs : m_stats.waitQueueMs) += elapsed;
+            }
+            if (m_abort) {
+                break;
+            }
+            if (std::all_of(m_branches.begin(), m_branches.end(), [](const Branch& branch) { return branch.closed; })) {
+                AddMessage(RGY_LOG_DEBUG, _T("all branches closed, stop loading at frame %d.\n"), iframe);
+                break;
+            }
+            m_sync->buffersInUse++;
+            m_stats.maxBuffersInUse = (std::max)(m_stats.maxBuffersInUse, m_sync->buffersInUse);
+        }
+        auto buffer = pool->alloc(m_frameSize);
+        FrameInfo info = m_frameInfo;
+        info.ptr = buffer.get();
+        info.inputFrameId = iframe;
+        std::shared_ptr<void> extra;
+        auto err = (buffer) ? m_load(&info, &extra) : RGY_ERR_NULL_PTR;
+        if (err != RGY_ERR_NONE) {
+            buffer.reset();
+            {
+                std::lock_guard<std::mutex> lock(m_sync->mtx);
+                m_sync->buffersInUse--;
+            }
+            if (err != RGY_ERR_MORE_DATA) {
+                AddMessage(RGY_LOG_ERROR, _T("failed to load frame %d: %s.\n"), iframe, get_err_mes(err));
+                m_err = err;
+            }
+            //終端 (またはエラー) を示すフレームを分配する
+            auto eos = std::make_shared<RGYFanoutFrame>();
+            eos->info = m_frameInfo;
+            eos->info.inputFrameId = iframe;
+            eos->extra = extra;
+            pushAll(eos);
+            AddMessage(RGY_LOG_DEBUG, _T("finished loading %d frames.\n"), iframe);
+            break;
+        }
+        //すべての出力先が参照を解放したら、バッファを返却して読み込みスレッドを起こす
+        auto sync = m_sync;
+        auto frame = std::shared_ptr<RGYFanoutFrame>(new RGYFanoutFrame(), [sync, buffer](RGYFanoutFrame *ptr) mutable {
+            delete ptr;
+            buffer.reset();
+            {
+                std::lock_guard<std::mutex> lock(sync->mtx);
+                sync->buffersInUse--;
+            }
+            sync->cvLoad.notify_one();
+        });
+        frame->info = info;
+        frame->extra = extra;
+        pushAll(frame);
+    }
+}
+
+RGY_ERR RGYFrameFanout::pop(int branch, std::shared_ptr<RGYFanoutFrame>& frame) {
+    frame.reset();
+    if (branch < 0 || branch >= (int)m_branches.size()) {
+        return RGY_ERR_INVALID_PARAM;
+    }
+    {
+        std::unique_lock<std::mutex> lock(m_sync->mtx);
+        auto& target = m_branches[branch];
+        m_sync->cvPop.wait(lock, [this, &target]() { return m_abort || target.closed || target.queue.size() > 0; });
+        if (target.queue.size() == 0) {
+            return (m_err != RGY_ERR_NONE) ? m_err.load() : RGY_ERR_ABORTED;
+        }
+        frame = target.queue.front();
+        if (frame->info.ptr == nullptr) {
+            //終端のフレームはキューに残し、以降も終端を返す
+            return (m_err != RGY_ERR_NONE) ? m_err.load() : RGY_ERR_MORE_DATA;
+        }
+        target.queue.pop_front();
+    }
+    m_sync->cvLoad.notify_one();
+    return RGY_ERR_NONE;
+}
+
+void RGYFrameFanout::closeBranch(int branch) {
+    if (branch < 0 || branch >= (int)m_branches.size()) {
+        return;
+    }
+    std::deque<std::shared_ptr<RGYFanoutFrame>> queue;
+    {
+        std::lock_guard<std::mutex> lock(m_sync->mtx);
+        m_branches[branch].closed = true;
+        //フレームの解放はロックの外で行う
+        queue.swap(m_branches[branch].queue);
+    }
+    queue.clear();
+    m_sync->cvLoad.notify_one();
+    m_sync->cvPop.notify_all();
+}
+
+void RGYFrameFanout::close() {
+    {
+        std::lock_guard<std::mutex> lock(m_sync->mtx);
+        m_abort = true;
+    }
+    m_sync->cvLoad.notify_all();
+    m_sync->cvPop.notify_all();
+    if (m_thLoad.joinable()) {
+        m_thLoad.join();
+    }
+    std::vector<Branch> branches;
+    {
+        std::lock_guard<std::mutex> lock(m_sync->mtx);
+        branches.swap(m_branches);
+    }
+    branches.clear();
+}
+
+int RGYFrameFanout::buffersInUse() const {
+    std::lock_guard<std::mutex> lock(m_sync->mtx);
+    return m_sync->buffersInUse;
+}
+
+RGYFrameFanout::Stats RGYFrameFanout::stats() const {
+    std::lock_guard<std::mutex> lock(m_sync->mtx);
+    return m_stats;
+}
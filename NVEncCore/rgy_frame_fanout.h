@@ -0,0 +1,128 @@
+﻿// -----------------------------------------------------------------------------------------
+// QSVEnc/NVEnc/VCEEnc by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2020 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+#pragma once
+#ifndef __RGY_FRAME_FANOUT_H__
+#define __RGY_FRAME_FANOUT_H__
+
+#include <cstdint>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include "rgy_err.h"
+#include "rgy_log.h"
+#include "rgy_util.h"
+#include "convert_csp.h"
+
+//1つの入力から読み込んだフレームを、複数の出力先 (ABRラダーの各エンコード) に分配する
+//
+//フレームは読み込みスレッドでバッファに読み込み、同じshared_ptrを各出力先のキューに積む
+//すべての出力先が参照を解放した時点でバッファは返却され、次の読み込みに使われる
+//出力先のキューが満杯の場合は読み込みを待機する (最も遅い出力先に律速される)
+struct RGYFanoutFrame {
+    FrameInfo info;              //フレームの情報 (ptrはホストメモリ上のバッファ、入力の終端ではnullptr)
+    std::shared_ptr<void> extra; //フレームに付随するデータ (音声パケットなど)
+};
+
+class RGYFrameFanout {
+public:
+    //フレームを1枚読み込む関数 frame->ptrには確保済みのバッファが渡される
+    //入力の終端ではRGY_ERR_MORE_DATAを返す (extraを設定した場合は終端のデータとして分配する)
+    typedef std::function<RGY_ERR(FrameInfo *frame, std::shared_ptr<void> *extra)> funcLoad;
+
+    struct Stats {
+        int64_t frames;          //読み込んだフレーム数
+        int     maxBuffersInUse; //同時に使用したバッファ数の最大値
+        double  waitQueueMs;     //出力先のキューの空きを待った時間
+        double  waitBufferMs;    //バッファの返却を待った時間
+    };
+
+    RGYFrameFanout();
+    ~RGYFrameFanout();
+
+    //branches    : 出力先の数
+    //frameInfo   : 読み込むフレームの形式 (ptrは無視される)
+    //frameSize   : 1フレームのバッファサイズ (byte)
+    //queueSize   : 出力先ごとのキューの長さ
+    //bufferCount : 同時に使用するバッファの数 (0なら branches + queueSize + 1)
+    RGY_ERR init(int branches, const FrameInfo& frameInfo, size_t frameSize, int queueSize, int bufferCount, funcLoad load, std::shared_ptr<RGYLog> log);
+    //読み込みスレッドを開始する
+    RGY_ERR start();
+    //branch番目の出力先の次のフレームを取得する
+    //入力の終端ではframe->info.ptr == nullptrのフレームを返し、RGY_ERR_MORE_DATAとなる
+    RGY_ERR pop(int branch, std::shared_ptr<RGYFanoutFrame>& frame);
+    //branch番目の出力先を終了し、以降フレームを分配しない
+    void closeBranch(int branch);
+    //読み込みを中断し、スレッドを終了する
+    void close();
+
+    RGY_ERR error() const { return m_err; }
+    int branches() const { return (int)m_branches.size(); }
+    const FrameInfo& frameInfo() const { return m_frameInfo; }
+    Stats stats() const;
+    //使用中のバッファの数
+    int buffersInUse() const;
+protected:
+    //バッファの返却を通知するため、フレームの解放側と共有する
+    struct Sync {
+        std::mutex mtx;
+        std::condition_variable cvLoad;  //読み込みスレッドの待機用
+        std::condition_variable cvPop;   //出力先の待機用
+        int buffersInUse;
+        Sync() : mtx(), cvLoad(), cvPop(), buffersInUse(0) {};
+    };
+    struct Branch {
+        std::deque<std::shared_ptr<RGYFanoutFrame>> queue;
+        bool closed;
+        Branch() : queue(), closed(false) {};
+    };
+    void AddMessage(int log_level, const TCHAR *format, ...);
+    void loadThread();
+    //m_sync->mtxを取得した状態で呼ぶこと
+    bool canLoad() const;
+    void pushAll(const std::shared_ptr<RGYFanoutFrame>& frame);
+
+    std::shared_ptr<Sync> m_sync;
+    std::vector<Branch> m_branches;
+    FrameInfo m_frameInfo;
+    size_t m_frameSize;
+    int m_queueSize;
+    int m_bufferCount;
+    funcLoad m_load;
+    std::thread m_thLoad;
+    bool m_abort;
+    std::atomic<RGY_ERR> m_err;
+    Stats m_stats;
+    std::shared_ptr<RGYLog> m_log;
+};
+
+#endif //__RGY_FRAME_FANOUT_H__
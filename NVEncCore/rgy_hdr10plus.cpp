@@ -25,85 +25,620 @@
 //
 // --------------------------------------------------------------------------------------------
 
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <cstring>
+#include <cstdarg>
+#include <algorithm>
 #include "rgy_osdep.h"
 #include "rgy_hdr10plus.h"
 
+const TCHAR *RGYHDR10Plus::INDEX_FILE_EXT = _T(".rgyhdr10plus");
+
+static const char HDR10PLUS_INDEX_MAGIC[8] = { 'R', 'G', 'Y', 'H', 'D', 'R', '1', '0' };
+static const uint32_t HDR10PLUS_INDEX_VERSION = 1;
+
+//キャッシュする索引のヘッダ
+//この後に、uint64_tのオフセット(frameCount+1個)、ペイロード(payloadSize byte)が続く
+struct RGYHDR10PlusIndexHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t frameCount;
+    uint64_t jsonSize;    //索引を作成したときのjsonのサイズ
+    int64_t jsonTime;     //索引を作成したときのjsonの更新時刻
+    uint64_t payloadSize;
+};
+
+static const uint8_t  HDR10PLUS_COUNTRY_CODE           = 0xB5;
+static const uint16_t HDR10PLUS_PROVIDER_CODE          = 0x003C;
+static const uint16_t HDR10PLUS_PROVIDER_ORIENTED_CODE = 0x0001;
+static const uint8_t  HDR10PLUS_APPLICATION_IDENTIFIER = 4;
+static const uint8_t  HDR10PLUS_APPLICATION_VERSION    = 1;
+static const int      HDR10PLUS_JSON_MAX_DEPTH         = 64;
+
+static bool get_file_stat(const tstring& filename, uint64_t *size, int64_t *mtime) {
 #if defined(_WIN32) || defined(_WIN64)
-#include <fcntl.h>
-const TCHAR *RGYHDR10Plus::HDR10PLUS_GEN_EXE_NAME =  _T("hdr10plus_gen.exe");
+    struct _stati64 st;
+    if (_tstati64(filename.c_str(), &st) != 0) {
+        return false;
+    }
 #else
-const TCHAR *RGYHDR10Plus::HDR10PLUS_GEN_EXE_NAME =  _T("hdr10plus_gen");
+    struct stat st;
+    if (stat(filename.c_str(), &st) != 0) {
+        return false;
+    }
 #endif
+    *size = (uint64_t)st.st_size;
+    *mtime = (int64_t)st.st_mtime;
+    return true;
+}
+
+//HDR10+のjsonの解析に必要な最小限のjsonの値
+struct RGYJsonValue {
+    enum Type {
+        JSON_NULL,
+        JSON_BOOL,
+        JSON_NUMBER,
+        JSON_STRING,
+        JSON_ARRAY,
+        JSON_OBJECT,
+    };
+    Type type;
+    double number;
+    std::string str;
+    std::vector<RGYJsonValue> array;
+    std::vector<std::pair<std::string, RGYJsonValue>> object;
+
+    RGYJsonValue() : type(JSON_NULL), number(0.0), str(), array(), object() {};
+    const RGYJsonValue *get(const char *key) const {
+        for (const auto& member : object) {
+            if (member.first == key) {
+                return &member.second;
+            }
+        }
+        return nullptr;
+    }
+};
+
+//メモリ上のjsonを先頭から順に読み進める
+//SceneInfoの配列は要素ごとに取り出せるよう、値の単位で読み込む
+class RGYJsonReader {
+public:
+    RGYJsonReader(const char *ptr, size_t size) : m_begin(ptr), m_ptr(ptr), m_fin(ptr + size), m_error() {
+        //UTF-8のBOM
+        if (size >= 3 && memcmp(ptr, "\xEF\xBB\xBF", 3) == 0) {
+            m_ptr += 3;
+        }
+    };
+    //次の文字がcなら読み進めてtrueを返す
+    bool consume(char c) {
+        skipSpace();
+        if (m_ptr < m_fin && *m_ptr == c) {
+            m_ptr++;
+            return true;
+        }
+        return false;
+    }
+    bool expect(char c) {
+        if (!consume(c)) {
+            return setError(strsprintf("'%c' expected", c));
+        }
+        return true;
+    }
+    bool parseString(std::string& str) {
+        if (!expect('"')) {
+            return false;
+        }
+        str.clear();
+        while (m_ptr < m_fin && *m_ptr != '"') {
+            char c = *m_ptr++;
+            if (c == '\\') {
+                if (m_ptr >= m_fin) {
+                    break;
+                }
+                c = *m_ptr++;
+                switch (c) {
+                case 'b': str.push_back('\b'); break;
+                case 'f': str.push_back('\f'); break;
+                case 'n': str.push_back('\n'); break;
+                case 'r': str.push_back('\r'); break;
+                case 't': str.push_back('\t'); break;
+                case 'u': {
+                    if (m_fin - m_ptr < 4) {
+                        return setError("invalid escape sequence");
+                    }
+                    uint32_t code = 0;
+                    for (int i = 0; i < 4; i++) {
+                        const char h = *m_ptr++;
+                        code <<= 4;
+                        if ('0' <= h && h <= '9')      code |= h - '0';
+                        else if ('a' <= h && h <= 'f') code |= h - 'a' + 10;
+                        else if ('A' <= h && h <= 'F') code |= h - 'A' + 10;
+                        else return setError("invalid escape sequence");
+                    }
+                    //キーや値の比較にしか使わないので、サロゲートペアは個別に変換する
+                    if (code < 0x80) {
+                        str.push_back((char)code);
+                    } else if (code < 0x800) {
+                        str.push_back((char)(0xC0 | (code >> 6)));
+                        str.push_back((char)(0x80 | (code & 0x3F)));
+                    } else {
+                        str.push_back((char)(0xE0 | (code >> 12)));
+                        str.push_back((char)(0x80 | ((code >> 6) & 0x3F)));
+                        str.push_back((char)(0x80 | (code & 0x3F)));
+                    }
+                    break;
+                }
+                default: str.push_back(c); break;
+                }
+            } else {
+                str.push_back(c);
+            }
+        }
+        if (m_ptr >= m_fin) {
+            return setError("unterminated string");
+        }
+        m_ptr++;
+        return true;
+    }
+    bool parse(RGYJsonValue& value, int depth = 0) {
+        if (depth > HDR10PLUS_JSON_MAX_DEPTH) {
+            return setError("nested too deeply");
+        }
+        skipSpace();
+        if (m_ptr >= m_fin) {
+            return setError("unexpected end of file");
+        }
+        value = RGYJsonValue();
+        const char c = *m_ptr;
+        if (c == '{') {
+            m_ptr++;
+            value.type = RGYJsonValue::JSON_OBJECT;
+            if (consume('}')) {
+                return true;
+            }
+            do {
+                std::pair<std::string, RGYJsonValue> member;
+                if (!parseString(member.first) || !expect(':') || !parse(member.second, depth + 1)) {
+                    return false;
+                }
+                value.object.push_back(std::move(member));
+            } while (consume(','));
+            return expect('}');
+        } else if (c == '[') {
+            m_ptr++;
+            value.type = RGYJsonValue::JSON_ARRAY;
+            if (consume(']')) {
+                return true;
+            }
+            do {
+                value.array.push_back(RGYJsonValue());
+                if (!parse(value.array.back(), depth + 1)) {
+                    return false;
+                }
+            } while (consume(','));
+            return expect(']');
+        } else if (c == '"') {
+            value.type = RGYJsonValue::JSON_STRING;
+            return parseString(value.str);
+        } else if (matchLiteral("true")) {
+            value.type = RGYJsonValue::JSON_BOOL;
+            value.number = 1.0;
+            return true;
+        } else if (matchLiteral("false")) {
+            value.type = RGYJsonValue::JSON_BOOL;
+            return true;
+        } else if (matchLiteral("null")) {
+            return true;
+        }
+        //数値 (strtodに渡すため、NUL終端した領域にコピーする)
+        char buf[64];
+        size_t len = 0;
+        while (m_ptr + len < m_fin && len < sizeof(buf) - 1 && strchr("+-0123456789.eE", m_ptr[len])) {
+            len++;
+        }
+        memcpy(buf, m_ptr, len);
+        buf[len] = '\0';
+        char *endptr = nullptr;
+        value.number = strtod(buf, &endptr);
+        if (len == 0 || endptr != buf + len) {
+            return setError("invalid value");
+        }
+        value.type = RGYJsonValue::JSON_NUMBER;
+        m_ptr += len;
+        return true;
+    }
+    bool isEnd() {
+        skipSpace();
+        return m_ptr >= m_fin;
+    }
+    //最上位の値の後ろには、空白以外何もないこと
+    bool expectEnd() {
+        if (!isEnd()) {
+            return setError("unexpected data after the end of json");
+        }
+        return true;
+    }
+    bool hasError() const {
+        return m_error.length() > 0;
+    }
+    //エラーの内容と、その位置の行番号
+    tstring error() const {
+        int line = 1;
+        for (auto ptr = m_begin; ptr < m_ptr && ptr < m_fin; ptr++) {
+            line += (*ptr == '\n');
+        }
+        return strsprintf(_T("line %d: %s"), line, char_to_tstring(m_error).c_str());
+    }
+protected:
+    void skipSpace() {
+        while (m_ptr < m_fin && (*m_ptr == ' ' || *m_ptr == '\t' || *m_ptr == '\r' || *m_ptr == '\n')) {
+            m_ptr++;
+        }
+    }
+    bool matchLiteral(const char *literal) {
+        const size_t len = strlen(literal);
+        if ((size_t)(m_fin - m_ptr) >= len && memcmp(m_ptr, literal, len) == 0) {
+            m_ptr += len;
+            return true;
+        }
+        return false;
+    }
+    bool setError(const std::string& error) {
+        if (m_error.length() == 0) {
+            m_error = error;
+        }
+        return false;
+    }
+
+    const char *m_begin;
+    const char *m_ptr;
+    const char *m_fin;
+    std::string m_error;
+};
+
+//上位ビットから順に書き込む
+class RGYBitWriter {
+public:
+    RGYBitWriter(std::vector<uint8_t>& buf) : m_buf(buf), m_bitPos(0) {};
+    void put(uint32_t value, int bits) {
+        for (int i = bits - 1; i >= 0; i--) {
+            if ((m_bitPos & 7) == 0) {
+                m_buf.push_back(0);
+            }
+            if ((value >> i) & 1) {
+                m_buf.back() |= (uint8_t)(0x80 >> (m_bitPos & 7));
+            }
+            m_bitPos++;
+        }
+    }
+    //値をbitsで表せる範囲に収めてから書き込む
+    void putClamp(double value, int bits) {
+        const double maxValue = (double)((1u << bits) - 1);
+        put((uint32_t)std::max(0.0, std::min(value, maxValue)), bits);
+    }
+protected:
+    std::vector<uint8_t>& m_buf;
+    size_t m_bitPos;
+};
+
+static bool is_number_array(const RGYJsonValue *value, size_t minCount, size_t maxCount) {
+    if (value == nullptr || value->type != RGYJsonValue::JSON_ARRAY
+        || value->array.size() < minCount || value->array.size() > maxCount) {
+        return false;
+    }
+    for (const auto& item : value->array) {
+        if (item.type != RGYJsonValue::JSON_NUMBER) {
+            return false;
+        }
+    }
+    return true;
+}
+
+//SceneInfoの要素1つ分から、ST 2094-40のメタデータ(ITU-T T.35のペイロード)を生成してpayloadの末尾に追加する
+static bool append_hdr10plus_payload(std::vector<uint8_t>& payload, const RGYJsonValue& scene, tstring& error) {
+    const auto targetPeak = scene.get("TargetedSystemDisplayMaximumLuminance");
+    const auto luminance = scene.get("LuminanceParameters");
+    if (targetPeak == nullptr || targetPeak->type != RGYJsonValue::JSON_NUMBER) {
+        error = _T("TargetedSystemDisplayMaximumLuminance not found");
+        return false;
+    }
+    if (luminance == nullptr || luminance->type != RGYJsonValue::JSON_OBJECT) {
+        error = _T("LuminanceParameters not found");
+        return false;
+    }
+    const auto maxScl = luminance->get("MaxScl");
+    const auto averageRGB = luminance->get("AverageRGB");
+    const auto distributions = luminance->get("LuminanceDistributions");
+    const auto distributionIndex = (distributions) ? distributions->get("DistributionIndex") : nullptr;
+    const auto distributionValues = (distributions) ? distributions->get("DistributionValues") : nullptr;
+    if (!is_number_array(maxScl, 3, 3)) {
+        error = _T("invalid MaxScl");
+        return false;
+    }
+    if (averageRGB == nullptr || averageRGB->type != RGYJsonValue::JSON_NUMBER) {
+        error = _T("AverageRGB not found");
+        return false;
+    }
+    if (!is_number_array(distributionIndex, 0, 15) || !is_number_array(distributionValues, 0, 15)
+        || distributionIndex->array.size() != distributionValues->array.size()) {
+        error = _T("invalid LuminanceDistributions");
+        return false;
+    }
+    //BezierCurveDataが空でなければtone mappingのデータを付加する
+    const auto bezier = scene.get("BezierCurveData");
+    const bool toneMapping = bezier && bezier->type == RGYJsonValue::JSON_OBJECT && bezier->object.size() > 0;
+    const auto anchors = (toneMapping) ? bezier->get("Anchors") : nullptr;
+    const auto kneePointX = (toneMapping) ? bezier->get("KneePointX") : nullptr;
+    const auto kneePointY = (toneMapping) ? bezier->get("KneePointY") : nullptr;
+    if (toneMapping
+        && (!is_number_array(anchors, 0, 15)
+            || kneePointX == nullptr || kneePointX->type != RGYJsonValue::JSON_NUMBER
+            || kneePointY == nullptr || kneePointY->type != RGYJsonValue::JSON_NUMBER)) {
+        error = _T("invalid BezierCurveData");
+        return false;
+    }
+
+    RGYBitWriter writer(payload);
+    writer.put(HDR10PLUS_COUNTRY_CODE, 8);
+    writer.put(HDR10PLUS_PROVIDER_CODE, 16);
+    writer.put(HDR10PLUS_PROVIDER_ORIENTED_CODE, 16);
+    writer.put(HDR10PLUS_APPLICATION_IDENTIFIER, 8);
+    writer.put(HDR10PLUS_APPLICATION_VERSION, 8);
+    writer.put(1, 2); //num_windows (LLC形式は画面全体の1つのみ)
+    writer.putClamp(targetPeak->number, 27); //targeted_system_display_maximum_luminance
+    writer.put(0, 1); //targeted_system_display_actual_peak_luminance_flag
+    for (const auto& scl : maxScl->array) {
+        writer.putClamp(scl.number, 17); //maxscl
+    }
+    writer.putClamp(averageRGB->number, 17); //average_maxrgb
+    writer.put((uint32_t)distributionIndex->array.size(), 4); //num_distribution_maxrgb_percentiles
+    for (size_t i = 0; i < distributionIndex->array.size(); i++) {
+        writer.putClamp(distributionIndex->array[i].number, 7);   //distribution_maxrgb_percentages
+        writer.putClamp(distributionValues->array[i].number, 17); //distribution_maxrgb_percentiles
+    }
+    writer.put(0, 10); //fraction_bright_pixels
+    writer.put(0, 1);  //mastering_display_actual_peak_luminance_flag
+    writer.put(toneMapping ? 1 : 0, 1); //tone_mapping_flag
+    if (toneMapping) {
+        writer.putClamp(kneePointX->number, 12);
+        writer.putClamp(kneePointY->number, 12);
+        writer.put((uint32_t)anchors->array.size(), 4); //num_bezier_curve_anchors
+        for (const auto& anchor : anchors->array) {
+            writer.putClamp(anchor.number, 10);
+        }
+    }
+    writer.put(0, 1); //color_saturation_mapping_flag
+    return true;
+}
 
 RGYHDR10Plus::RGYHDR10Plus() :
-    m_proc(), m_pipes(),
-    m_fpStdOut(std::unique_ptr<FILE, decltype(&fclose)>(nullptr, fclose)),
-    m_buffer(std::make_pair(-1, vector<uint8_t>())){
+    m_inputJson(),
+    m_log(),
+    m_jsonSize(0),
+    m_jsonTime(0),
+    m_offsetBuf(),
+    m_payloadBuf(),
+    m_fpIndex(std::unique_ptr<FILE, decltype(&fclose)>(nullptr, fclose)),
+    m_indexMap(),
+    m_offsets(nullptr),
+    m_payload(nullptr),
+    m_payloadSize(0),
+    m_frameCount(0),
+    m_buffer(std::make_pair(-1, vector<uint8_t>())) {
 }
 
 RGYHDR10Plus::~RGYHDR10Plus() {
-    m_fpStdOut.reset();
-    m_proc.reset();
+    m_indexMap.close();
+    m_fpIndex.reset();
 }
 
-RGY_ERR RGYHDR10Plus::init(const tstring &inputJson) {
-    if (!(PathFileExists(inputJson.c_str()))) {
-        return RGY_ERR_NOT_FOUND;
+void RGYHDR10Plus::AddMessage(int log_level, const TCHAR *format, ...) {
+    if (m_log == nullptr || log_level < m_log->getLogLevel()) {
+        return;
     }
+    va_list args;
+    va_start(args, format);
+    int len = _vsctprintf(format, args) + 1; // _vscprintf doesn't count terminating '\0'
+    tstring buffer;
+    buffer.resize(len, _T('\0'));
+    _vstprintf_s(&buffer[0], len, format, args);
+    va_end(args);
+    m_log->write(log_level, (tstring(_T("hdr10plus: ")) + buffer).c_str());
+}
+
+RGY_ERR RGYHDR10Plus::init(const tstring &inputJson, std::shared_ptr<RGYLog> log) {
+    m_log = log;
     m_inputJson = inputJson;
-#if defined(_WIN32) || defined(_WIN64)
-    tstring HDR10PlusGenExePath = getExeDir() + _T("\\") + HDR10PLUS_GEN_EXE_NAME;
-#else
-    tstring HDR10PlusGenExePath = getExeDir() + _T("/") + HDR10PLUS_GEN_EXE_NAME;
-#endif
-    if (!PathFileExists(HDR10PLUS_GEN_EXE_NAME)) {
-        HDR10PlusGenExePath = HDR10PLUS_GEN_EXE_NAME;
-    }
-    const tstring HDR10PlusGenExePathWithQuotes = tstring(_T("\"")) + HDR10PlusGenExePath + _T("\"");
-    const tstring inputJsonWithQuotes = tstring(_T("\"")) + inputJson + _T("\"");
-    std::vector<const TCHAR *> args;
-    args.push_back(HDR10PlusGenExePathWithQuotes.c_str());
-    args.push_back(_T("-i"));
-    args.push_back(inputJsonWithQuotes.c_str());
-    args.push_back(_T("-o"));
-    args.push_back(_T("-"));
-
-    m_pipes.stdOut.mode = PIPE_MODE_ENABLE;
-    m_pipes.stdOut.bufferSize = 1024;
-
-    m_proc = createRGYPipeProcess();
-    m_proc->init();
-    if (m_proc->run(args, nullptr, &m_pipes, 0, true, true)) {
-        return RGY_ERR_RUN_PROCESS;
+    if (!get_file_stat(inputJson, &m_jsonSize, &m_jsonTime)) {
+        AddMessage(RGY_LOG_ERROR, _T("Cannot find the file specified : %s.\n"), inputJson.c_str());
+        return RGY_ERR_NOT_FOUND;
+    }
+    const tstring indexFile = inputJson + INDEX_FILE_EXT;
+    if (loadIndex(indexFile) == RGY_ERR_NONE) {
+        AddMessage(RGY_LOG_DEBUG, _T("Loaded index %s: %u frames.\n"), indexFile.c_str(), m_frameCount);
+        return RGY_ERR_NONE;
+    }
+    auto err = parseJson();
+    if (err != RGY_ERR_NONE) {
+        return err;
+    }
+    m_offsets = m_offsetBuf.data();
+    m_payload = m_payloadBuf.data();
+    m_payloadSize = m_payloadBuf.size();
+    m_frameCount = (uint32_t)(m_offsetBuf.size() - 1);
+    AddMessage(RGY_LOG_DEBUG, _T("Parsed %s: %u frames.\n"), inputJson.c_str(), m_frameCount);
+    //キャッシュが作れなくても(書き込み不可の場所など)、解析結果はそのまま使用できる
+    if (writeIndex(indexFile) == RGY_ERR_NONE) {
+        AddMessage(RGY_LOG_DEBUG, _T("Wrote index %s.\n"), indexFile.c_str());
+    } else {
+        AddMessage(RGY_LOG_DEBUG, _T("Could not write index %s.\n"), indexFile.c_str());
+    }
+    return RGY_ERR_NONE;
+}
+
+RGY_ERR RGYHDR10Plus::parseJson() {
+    std::unique_ptr<FILE, decltype(&fclose)> fp(_tfopen(m_inputJson.c_str(), _T("rb")), fclose);
+    if (!fp) {
+        AddMessage(RGY_LOG_ERROR, _T("Failed to open %s.\n"), m_inputJson.c_str());
+        return RGY_ERR_FILE_OPEN;
+    }
+    //可能ならメモリマップし、できなければ全体を読み込む
+    RGYFileMap jsonMap;
+    std::vector<char> jsonBuf;
+    const char *jsonPtr = nullptr;
+    size_t jsonSize = 0;
+    if (jsonMap.open(fp.get()) == RGY_ERR_NONE) {
+        jsonPtr = (const char *)jsonMap.ptr();
+        jsonSize = (size_t)jsonMap.size();
+    } else {
+        jsonBuf.resize((size_t)m_jsonSize);
+        if (jsonBuf.size() > 0 && fread(jsonBuf.data(), 1, jsonBuf.size(), fp.get()) != jsonBuf.size()) {
+            AddMessage(RGY_LOG_ERROR, _T("Failed to read %s.\n"), m_inputJson.c_str());
+            return RGY_ERR_FILE_OPEN;
+        }
+        jsonPtr = jsonBuf.data();
+        jsonSize = jsonBuf.size();
+    }
+
+    m_offsetBuf.clear();
+    m_payloadBuf.clear();
+    m_offsetBuf.push_back(0);
+    bool sceneInfoFound = false;
+    RGYJsonReader reader(jsonPtr, jsonSize);
+    auto parseSceneInfo = [&]() {
+        if (!reader.expect('[')) {
+            return false;
+        }
+        if (reader.consume(']')) {
+            return true;
+        }
+        RGYJsonValue scene;
+        do {
+            if (!reader.parse(scene)) {
+                return false;
+            }
+            tstring error;
+            if (!append_hdr10plus_payload(m_payloadBuf, scene, error)) {
+                AddMessage(RGY_LOG_ERROR, _T("SceneInfo[%d]: %s.\n"), (int)(m_offsetBuf.size() - 1), error.c_str());
+                return false;
+            }
+            m_offsetBuf.push_back(m_payloadBuf.size());
+        } while (reader.consume(','));
+        return reader.expect(']');
+    };
+    //SceneInfo以外の値は読み飛ばす
+    bool ret = reader.expect('{');
+    if (ret && !reader.consume('}')) {
+        do {
+            std::string key;
+            if (!(ret = reader.parseString(key) && reader.expect(':'))) {
+                break;
+            }
+            if (key == "SceneInfo") {
+                sceneInfoFound = true;
+                ret = parseSceneInfo();
+            } else {
+                RGYJsonValue value;
+                ret = reader.parse(value);
+            }
+        } while (ret && reader.consume(','));
+        ret = ret && reader.expect('}');
+    }
+    ret = ret && reader.expectEnd();
+    if (!ret) {
+        //SceneInfoの内容の誤りは、append_hdr10plus_payloadのエラーとして出力済み
+        if (reader.hasError()) {
+            AddMessage(RGY_LOG_ERROR, _T("Failed to parse %s: %s.\n"), m_inputJson.c_str(), reader.error().c_str());
+        }
+        return RGY_ERR_INVALID_FORMAT;
+    }
+    if (!sceneInfoFound) {
+        AddMessage(RGY_LOG_ERROR, _T("SceneInfo not found in %s, only HDR10+ LLC json is supported.\n"), m_inputJson.c_str());
+        return RGY_ERR_INVALID_FORMAT;
+    }
+    return RGY_ERR_NONE;
+}
+
+RGY_ERR RGYHDR10Plus::loadIndex(const tstring& indexFile) {
+    std::unique_ptr<FILE, decltype(&fclose)> fp(_tfopen(indexFile.c_str(), _T("rb")), fclose);
+    if (!fp) {
+        return RGY_ERR_FILE_OPEN;
+    }
+    if (m_indexMap.open(fp.get()) != RGY_ERR_NONE) {
+        return RGY_ERR_MAP_FAILED;
+    }
+    //jsonが更新されていたり、内容が壊れていれば使用しない
+    const auto header = (const RGYHDR10PlusIndexHeader *)m_indexMap.ptr();
+    const uint64_t fileSize = m_indexMap.size();
+    const uint64_t offsetSize = (fileSize >= sizeof(RGYHDR10PlusIndexHeader)) ? ((uint64_t)header->frameCount + 1) * sizeof(uint64_t) : 0;
+    if (fileSize < sizeof(RGYHDR10PlusIndexHeader)
+        || memcmp(header->magic, HDR10PLUS_INDEX_MAGIC, sizeof(HDR10PLUS_INDEX_MAGIC)) != 0
+        || header->version != HDR10PLUS_INDEX_VERSION
+        || header->jsonSize != m_jsonSize
+        || header->jsonTime != m_jsonTime
+        || sizeof(RGYHDR10PlusIndexHeader) + offsetSize + header->payloadSize != fileSize) {
+        m_indexMap.close();
+        return RGY_ERR_INVALID_FORMAT;
+    }
+    const auto offsets = (const uint64_t *)(m_indexMap.ptr() + sizeof(RGYHDR10PlusIndexHeader));
+    if (offsets[0] != 0 || offsets[header->frameCount] != header->payloadSize) {
+        m_indexMap.close();
+        return RGY_ERR_INVALID_FORMAT;
+    }
+    m_offsets = offsets;
+    m_payload = m_indexMap.ptr() + sizeof(RGYHDR10PlusIndexHeader) + offsetSize;
+    m_payloadSize = header->payloadSize;
+    m_frameCount = header->frameCount;
+    m_fpIndex = std::move(fp);
+    return RGY_ERR_NONE;
+}
+
+RGY_ERR RGYHDR10Plus::writeIndex(const tstring& indexFile) {
+    //並列に実行された他のプロセスが読み込み途中のファイルを使わないよう、一時ファイルに書いてから置き換える
+    const tstring tmpFile = indexFile + strsprintf(_T(".%u.tmp"), (uint32_t)GetCurrentProcessId());
+    std::unique_ptr<FILE, decltype(&fclose)> fp(_tfopen(tmpFile.c_str(), _T("wb")), fclose);
+    if (!fp) {
+        return RGY_ERR_FILE_OPEN;
+    }
+    RGYHDR10PlusIndexHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, HDR10PLUS_INDEX_MAGIC, sizeof(HDR10PLUS_INDEX_MAGIC));
+    header.version = HDR10PLUS_INDEX_VERSION;
+    header.frameCount = m_frameCount;
+    header.jsonSize = m_jsonSize;
+    header.jsonTime = m_jsonTime;
+    header.payloadSize = m_payloadSize;
+    bool ret = fwrite(&header, sizeof(header), 1, fp.get()) == 1
+        && fwrite(m_offsetBuf.data(), sizeof(m_offsetBuf[0]), m_offsetBuf.size(), fp.get()) == m_offsetBuf.size()
+        && (m_payloadBuf.size() == 0 || fwrite(m_payloadBuf.data(), 1, m_payloadBuf.size(), fp.get()) == m_payloadBuf.size());
+    ret = (fclose(fp.release()) == 0) && ret;
+    if (!ret) {
+        _tremove(tmpFile.c_str());
+        return RGY_ERR_FILE_OPEN;
     }
 #if defined(_WIN32) || defined(_WIN64)
-    m_fpStdOut = std::unique_ptr<FILE, decltype(&fclose)>(_fdopen(_open_osfhandle((intptr_t)m_pipes.stdOut.h_read, _O_BINARY), "rb"), fclose);
-#else
-    m_fpStdOut = std::unique_ptr<FILE, decltype(&fclose)>(m_pipes.f_stdout, fclose);
+    _tremove(indexFile.c_str()); //Windowsでは、置き換え先が存在するとrenameに失敗する
 #endif
-    if (!m_fpStdOut) {
-        return RGY_ERR_INVALID_HANDLE;
+    if (_trename(tmpFile.c_str(), indexFile.c_str()) != 0) {
+        _tremove(tmpFile.c_str());
+        return RGY_ERR_FILE_OPEN;
     }
     return RGY_ERR_NONE;
 }
 
 const vector<uint8_t> *RGYHDR10Plus::getData(int iframe) {
-    if (!m_fpStdOut) {
+    if (m_offsets == nullptr || iframe < 0 || (uint32_t)iframe >= m_frameCount) {
         return nullptr;
     }
-    while (m_buffer.first != iframe) {
-        m_buffer.second.clear();
-        int header[2];
-        if (fread(header, sizeof(header[0]), _countof(header), m_fpStdOut.get()) != _countof(header)) {
-            return nullptr;
-        }
-        const int frameNum = header[0];
-        const int dataSize = header[1];
-        m_buffer.second.resize(dataSize, 0);
-        if (fread(m_buffer.second.data(), 1, m_buffer.second.size(), m_fpStdOut.get()) != m_buffer.second.size()) {
+    if (m_buffer.first != iframe) {
+        const uint64_t start = m_offsets[iframe];
+        const uint64_t fin = m_offsets[iframe + 1];
+        if (start > fin || fin > m_payloadSize) {
             return nullptr;
         }
-        m_buffer.first = frameNum;
+        m_buffer.second.assign(m_payload + start, m_payload + fin);
+        m_buffer.first = iframe;
     }
     return &m_buffer.second;
 }
@@ -32,23 +32,47 @@
 #include <string>
 #include <memory>
 #include "rgy_err.h"
-#include "rgy_pipe.h"
+#include "rgy_log.h"
 #include "rgy_util.h"
 
+//HDR10+ (LLC形式)のjsonを読み込み、各フレームのST 2094-40のメタデータ(ITU-T T.35のペイロード)を生成する
+//生成結果はフレーム→ペイロードの索引としてjsonと同じ場所にキャッシュし、
+//次回以降はjsonを解析せずにキャッシュをメモリマップして使用する
 class RGYHDR10Plus {
 public:
-    static const TCHAR *HDR10PLUS_GEN_EXE_NAME;
+    static const TCHAR *INDEX_FILE_EXT;
     RGYHDR10Plus();
     virtual ~RGYHDR10Plus();
 
-    RGY_ERR init(const tstring& inputJson);
+    RGY_ERR init(const tstring& inputJson, std::shared_ptr<RGYLog> log);
+    //iframe番目のフレームのペイロードを返す (存在しなければnullptr)
     const vector<uint8_t> *getData(int iframe);
     const tstring &inputJson() const { return m_inputJson; };
+    int frameCount() const { return (int)m_frameCount; }
 protected:
+    RGY_ERR parseJson();
+    RGY_ERR loadIndex(const tstring& indexFile);
+    RGY_ERR writeIndex(const tstring& indexFile);
+
+    void AddMessage(int log_level, const TCHAR *format, ...);
+
     tstring m_inputJson;
-    std::unique_ptr<RGYPipeProcess> m_proc;
-    ProcessPipe m_pipes;
-    std::unique_ptr<FILE, decltype(&fclose)> m_fpStdOut;
+    std::shared_ptr<RGYLog> m_log;
+    uint64_t m_jsonSize;
+    int64_t m_jsonTime;
+
+    //jsonを解析した場合の索引とペイロード
+    std::vector<uint64_t> m_offsetBuf;
+    std::vector<uint8_t> m_payloadBuf;
+    //キャッシュを使用する場合のマップ
+    std::unique_ptr<FILE, decltype(&fclose)> m_fpIndex;
+    RGYFileMap m_indexMap;
+
+    //m_offsetBuf/m_payloadBufまたはm_indexMap内を指す
+    const uint64_t *m_offsets; //m_frameCount+1個、iframeのペイロードは[m_offsets[iframe], m_offsets[iframe+1])
+    const uint8_t *m_payload;
+    uint64_t m_payloadSize;
+    uint32_t m_frameCount;
     std::pair<int, std::vector<uint8_t>> m_buffer;
 };
 
@@ -86,44 +86,6 @@ static int trackID(int trackID) {
 }
 #endif //#if ENABLE_AVSW_READER
 
-struct RGYConvertCSPPrm {
-    bool abort;
-    void **dst;
-    const void **src;
-    int interlaced;
-    int width;
-    int src_y_pitch_byte;
-    int src_uv_pitch_byte;
-    int dst_y_pitch_byte;
-    int height;
-    int dst_height;
-    int *crop;
-
-    RGYConvertCSPPrm();
-};
-
-class RGYConvertCSP {
-private:
-    const ConvertCSP *m_csp;
-    RGY_CSP m_csp_from;
-    RGY_CSP m_csp_to;
-    bool m_uv_only;
-    int m_threads;
-    std::vector<std::thread> m_th;
-    std::vector<std::unique_ptr<void, handle_deleter>> m_heStart;
-    std::vector<std::unique_ptr<void, handle_deleter>> m_heFin;
-    std::vector<HANDLE> m_heFinCopy;
-    RGYConvertCSPPrm m_prm;
-public:
-    RGYConvertCSP();
-    RGYConvertCSP(int threads);
-    ~RGYConvertCSP();
-    const ConvertCSP *getFunc(RGY_CSP csp_from, RGY_CSP csp_to, bool uv_only, uint32_t simd);
-    const ConvertCSP *getFunc() const { return m_csp; };
-
-    int run(int interlaced, void **dst, const void **src, int width, int src_y_pitch_byte, int src_uv_pitch_byte, int dst_y_pitch_byte, int height, int dst_height, int *crop);
-};
-
 class RGYInputPrm {
 public:
     int threadCsp;
@@ -142,7 +104,18 @@ public:
         Close();
         m_printMes = log;
         m_encSatusInfo = encSatusInfo;
-        return Init(strFileName, inputInfo, prm);
+        auto ret = Init(strFileName, inputInfo, prm);
+        if (ret == RGY_ERR_NONE && m_convert && m_convert->getFunc()) {
+            //色空間変換が対応しない幅・Cropは、読み込みを始める前にエラーとする
+            ret = m_convert->checkSize(m_inputVideoInfo.srcWidth, m_inputVideoInfo.srcHeight, m_inputVideoInfo.crop.c);
+            if (ret != RGY_ERR_NONE) {
+                AddMessage(RGY_LOG_ERROR, _T("%dx%d, crop [%d,%d,%d,%d]: resolution and crop of mod2 required for %s -> %s.\n"),
+                    m_inputVideoInfo.srcWidth, m_inputVideoInfo.srcHeight,
+                    m_inputVideoInfo.crop.c[0], m_inputVideoInfo.crop.c[1], m_inputVideoInfo.crop.c[2], m_inputVideoInfo.crop.c[3],
+                    RGY_CSP_NAMES[m_convert->getFunc()->csp_from], RGY_CSP_NAMES[m_convert->getFunc()->csp_to]);
+            }
+        }
+        return ret;
     };
 
     virtual RGY_ERR LoadNextFrame(RGYFrame *surface) = 0;
@@ -40,6 +40,7 @@
 #include "rgy_input_avcodec.h"
 #include "rgy_bitstream.h"
 #include "rgy_avlog.h"
+#include "rgy_trace.h"
 
 //#ifdef LIBVA_SUPPORT
 //#include "qsv_hw_va.h"
@@ -85,6 +86,7 @@ RGYInputAvcodecPrm::RGYInputAvcodecPrm(RGYInputPrm base) :
     readChapter(false),
     videoAvgFramerate(),
     analyzeSec(0),
+    prefetchMB(0),
     nTrimCount(0),
     pTrimList(nullptr),
     trackStartAudio(0),
@@ -139,6 +141,11 @@ void RGYInputAvcodec::CloseThread() {
         AddMessage(RGY_LOG_DEBUG, _T("Closed Input thread.\n"));
     }
     m_Demux.thread.bAbortInput = false;
+    if (m_Demux.thread.prefetch) {
+        AddMessage(RGY_LOG_DEBUG, _T("Closing Prefetch thread.\n"));
+        m_Demux.thread.prefetch.reset();
+        AddMessage(RGY_LOG_DEBUG, _T("Closed Prefetch thread.\n"));
+    }
 }
 
 void RGYInputAvcodec::CloseFormat(AVDemuxFormat *format) {
@@ -1121,6 +1128,19 @@ RGY_ERR RGYInputAvcodec::Init(const TCHAR *strFileName, VideoInfo *inputInfo, co
         m_cap2ass.disable();
     }
 #endif
+    //ストリーム情報の解析やフレームレートの推定のための先読みの段階から
+    //ファイルの読み込み待ちが発生しないよう、ファイルを開く前に先読みスレッドを開始する
+    if (input_prm->prefetchMB > 0) {
+        if (m_Demux.format.isPipe || usingAVProtocols(filename_char, 0) || input_prm->inputOpt.size() > 0
+            || (inFormat != nullptr && (inFormat->flags & (AVFMT_NEEDNUMBER | AVFMT_NOFILE)))) {
+            AddMessage(RGY_LOG_WARN, _T("--input-prefetch is only supported for file input, disabled.\n"));
+        } else {
+            m_Demux.thread.prefetch = std::make_unique<RGYFilePrefetch>(m_printMes);
+            if (m_Demux.thread.prefetch->start(strFileName, (int64_t)input_prm->prefetchMB * 1024 * 1024) != RGY_ERR_NONE) {
+                m_Demux.thread.prefetch.reset();
+            }
+        }
+    }
     //ファイルのオープン
     if ((ret = avformat_open_input(&(m_Demux.format.formatCtx), filename_char.c_str(), inFormat, &m_Demux.format.formatOptions)) != 0) {
         AddMessage(RGY_LOG_ERROR, _T("error opening file \"%s\": %s\n"), char_to_tstring(filename_char, CP_UTF8).c_str(), qsv_av_err2str(ret).c_str());
@@ -1509,10 +1529,11 @@ RGY_ERR RGYInputAvcodec::Init(const TCHAR *strFileName, VideoInfo *inputInfo, co
             m_inputVideoInfo.codecExtra = m_Demux.video.extradata;
             m_inputVideoInfo.codecExtraSize = m_Demux.video.extradataSize;
         }
-        if (input_prm->seekSec > 0.0f) {
+        if (input_prm->seekSec > 0.0) {
             AVPacket firstpkt;
             getSample(&firstpkt); //現在のtimestampを取得する
-            const auto seek_time = av_rescale_q(1, av_d2q((double)input_prm->seekSec, 1<<24), m_Demux.video.stream->time_base);
+            //--chunk-parallelではキーフレームのptsちょうどを指定するので、timebase単位に丸めて誤差が出ないようにする
+            const auto seek_time = (int64_t)std::round(input_prm->seekSec / av_q2d(m_Demux.video.stream->time_base));
             int seek_ret = av_seek_frame(m_Demux.format.formatCtx, m_Demux.video.index, firstpkt.pts + seek_time, 0);
             if (0 > seek_ret) {
                 seek_ret = av_seek_frame(m_Demux.format.formatCtx, m_Demux.video.index, firstpkt.pts + seek_time, AVSEEK_FLAG_ANY);
@@ -1785,7 +1806,7 @@ RGY_ERR RGYInputAvcodec::Init(const TCHAR *strFileName, VideoInfo *inputInfo, co
             tstring mes = strsprintf(_T("av" DECODER_NAME ": %s, %dx%d, %d/%d fps"),
                 CodecToStr(m_inputVideoInfo.codec).c_str(),
                 m_inputVideoInfo.srcWidth, m_inputVideoInfo.srcHeight, m_inputVideoInfo.fpsN, m_inputVideoInfo.fpsD);
-            if (input_prm->seekSec > 0.0f) {
+            if (input_prm->seekSec > 0.0) {
                 mes += strsprintf(_T("\n         seek: %s"), print_time(input_prm->seekSec).c_str());
             }
             AddMessage(RGY_LOG_DEBUG, mes);
@@ -1793,7 +1814,7 @@ RGY_ERR RGYInputAvcodec::Init(const TCHAR *strFileName, VideoInfo *inputInfo, co
         } else {
             CreateInputInfo((tstring(_T("avsw: ")) + char_to_tstring(avcodec_get_name(m_Demux.video.stream->codecpar->codec_id))).c_str(),
                 RGY_CSP_NAMES[m_convert->getFunc()->csp_from], RGY_CSP_NAMES[m_convert->getFunc()->csp_to], get_simd_str(m_convert->getFunc()->simd), &m_inputVideoInfo);
-            if (input_prm->seekSec > 0.0f) {
+            if (input_prm->seekSec > 0.0) {
                 m_inputInfo += strsprintf(_T("\n         seek: %s"), print_time(input_prm->seekSec).c_str());
             }
             AddMessage(RGY_LOG_DEBUG, m_inputInfo);
@@ -1881,6 +1902,18 @@ FramePosList *RGYInputAvcodec::GetFramePosList() {
 int RGYInputAvcodec::getVideoFrameIdx(int64_t pts, AVRational timebase, int iStart) {
     const int framePosCount = m_Demux.frames.frameNum();
     const AVRational vid_pkt_timebase = (m_Demux.video.stream) ? m_Demux.video.stream->time_base : av_inv_q(m_Demux.video.nAvgFramerate);
+    //ptsの確定した範囲はソート済みなので、前回の位置から探索範囲を絞り込む
+    //iStartより前に戻ることはないので、以降の線形探索は1回で済む
+    const int sortedCount = (std::min)((int)m_Demux.frames.sortedNum(), framePosCount);
+    if (iStart < sortedCount - 1) {
+        const uint32_t first = (uint32_t)(std::max)(0, iStart);
+        const int found = (av_cmp_q(timebase, vid_pkt_timebase) == 0)
+            ? (int)m_Demux.frames.searchSorted(first, (uint32_t)sortedCount, [pts](const FramePos& pos) { return pts <= pos.pts; })
+            : (int)m_Demux.frames.searchSorted(first, (uint32_t)sortedCount, [pts, timebase, vid_pkt_timebase](const FramePos& pos) {
+                return av_compare_ts(pts, timebase, pos.pts, vid_pkt_timebase) < 0; });
+        //見つかった位置から線形探索を再開する (0フレーム目の判定は下の線形探索で行う)
+        iStart = (std::max)(iStart, found);
+    }
     if (av_cmp_q(timebase, vid_pkt_timebase) == 0) {
         for (int i = (std::max)(0, iStart); i < framePosCount; i++) {
             if (pts == m_Demux.frames.list(i).pts) {
@@ -2040,6 +2073,7 @@ int RGYInputAvcodec::getSample(AVPacket *pkt, bool bTreatFirstPacketAsKeyframe)
     while ((ret_read_frame = av_read_frame(m_Demux.format.formatCtx, pkt)) >= 0
         //trimからわかるフレーム数の上限値よりfixedNumがある程度の量の処理を進めたら読み込みを打ち切る
         && m_Demux.frames.fixedNum() - TRIM_OVERREAD_FRAMES < getVideoTrimMaxFramIdx()) {
+        prefetchReadPosAVIO();
         if (pkt->stream_index == m_Demux.video.index) {
             if (pkt->flags & AV_PKT_FLAG_CORRUPT) {
                 const auto timestamp = (pkt->pts == AV_NOPTS_VALUE) ? pkt->dts : pkt->pts;
@@ -2297,6 +2331,7 @@ void RGYInputAvcodec::GetAudioDataPacketsWhenNoVideoRead(int inputFrame) {
     //動画に映像がない場合、
     //およそ1フレーム分のパケットを取得する
     while (av_read_frame(m_Demux.format.formatCtx, &pkt) >= 0) {
+        prefetchReadPosAVIO();
         const auto codec_type = m_Demux.format.formatCtx->streams[pkt.stream_index]->codecpar->codec_type;
         if (codec_type != AVMEDIA_TYPE_AUDIO && codec_type != AVMEDIA_TYPE_SUBTITLE) {
             av_packet_unref(&pkt);
@@ -2565,10 +2600,13 @@ RGY_ERR RGYInputAvcodec::LoadNextFrame(RGYFrame *pSurface) {
         //フレームデータをコピー
         void *dst_array[3];
         pSurface->ptrArray(dst_array, m_convert->getFunc()->csp_to == RGY_CSP_RGB24 || m_convert->getFunc()->csp_to == RGY_CSP_RGB32);
-        m_convert->run(m_Demux.video.frame->interlaced_frame != 0,
-            dst_array, (const void **)m_Demux.video.frame->data,
-            m_inputVideoInfo.srcWidth, m_Demux.video.frame->linesize[0], m_Demux.video.frame->linesize[1], pSurface->pitch(),
-            m_inputVideoInfo.srcHeight, m_inputVideoInfo.srcHeight, m_inputVideoInfo.crop.c);
+        {
+            RGY_TRACE_SCOPE("convert_csp", m_encSatusInfo->m_sData.frameIn);
+            m_convert->run(m_Demux.video.frame->interlaced_frame != 0,
+                dst_array, (const void **)m_Demux.video.frame->data,
+                m_inputVideoInfo.srcWidth, m_Demux.video.frame->linesize[0], m_Demux.video.frame->linesize[1], pSurface->pitch(),
+                m_inputVideoInfo.srcHeight, m_inputVideoInfo.srcHeight, m_inputVideoInfo.crop.c);
+        }
         if (got_frame) {
             av_frame_unref(m_Demux.video.frame);
         }
@@ -2593,11 +2631,7 @@ int RGYInputAvcodec::GetHWDecDeviceID() {
 }
 
 HANDLE RGYInputAvcodec::getThreadHandleInput() {
-#if defined(WIN32) || defined(WIN64)
-    return m_Demux.thread.thInput.native_handle();
-#else
-    return NULL;
-#endif //#if defined(WIN32) || defined(WIN64)
+    return (HANDLE)m_Demux.thread.thInput.native_handle();
 }
 
 //出力する動画の情報をセット
@@ -2615,16 +2649,33 @@ void RGYInputAvcodec::setOutputVideoInfo(int w, int h, int sar_x, int sar_y, boo
 }
 
 RGY_ERR RGYInputAvcodec::ThreadFuncRead() {
+    RGY_TRACE_THREAD_NAME("demux");
     while (!m_Demux.thread.bAbortInput) {
         AVPacket pkt;
-        if (getSample(&pkt)) {
-            break;
+        {
+            RGY_TRACE_SCOPE("demux_read", -1);
+            if (getSample(&pkt)) {
+                break;
+            }
         }
         m_Demux.qVideoPkt.push(pkt);
     }
     return RGY_ERR_NONE;
 }
 
+void RGYInputAvcodec::prefetchReadPos(int64_t pos) {
+    if (m_Demux.thread.prefetch) {
+        m_Demux.thread.prefetch->setReadPos(pos);
+    }
+}
+
+void RGYInputAvcodec::prefetchReadPosAVIO() {
+    //独自のAVIOで読み込んでいる場合は、readPacket/seekで通知している
+    if (m_Demux.format.fpInput == nullptr && m_Demux.format.formatCtx->pb != nullptr) {
+        prefetchReadPos(avio_tell(m_Demux.format.formatCtx->pb));
+    }
+}
+
 const AVMasteringDisplayMetadata *RGYInputAvcodec::getMasteringDisplay() const {
     return m_Demux.video.masteringDisplay;
 };
@@ -2635,6 +2686,9 @@ const AVContentLightMetadata *RGYInputAvcodec::getContentLight() const {
 #if USE_CUSTOM_INPUT
 int RGYInputAvcodec::readPacket(uint8_t *buf, int buf_size) {
     auto ret = (int)_fread_nolock(buf, 1, buf_size, m_Demux.format.fpInput);
+    if (m_Demux.thread.prefetch) {
+        prefetchReadPos(m_Demux.thread.prefetch->readPos() + ret);
+    }
     if (m_cap2ass.enabled()) {
         if (m_cap2ass.proc(buf, ret, m_Demux.qStreamPktL1) != RGY_ERR_NONE) {
             AddMessage(RGY_LOG_ERROR, _T("failed to process ts caption.\n"));
@@ -2657,7 +2711,9 @@ int64_t RGYInputAvcodec::seek(int64_t offset, int whence) {
     if (m_cap2ass.enabled() && whence == SEEK_SET && offset == 0) {
         m_cap2ass.reset();
     }
-    return _fseeki64(m_Demux.format.fpInput, offset, whence);
+    const auto ret = _fseeki64(m_Demux.format.fpInput, offset, whence);
+    prefetchReadPos(_ftelli64(m_Demux.format.fpInput));
+    return ret;
 }
 #endif //USE_CUSTOM_INPUT
 
@@ -37,6 +37,7 @@
 #include "rgy_queue.h"
 #include "rgy_perf_monitor.h"
 #include "convert_csp.h"
+#include "rgy_file_prefetch.h"
 #include <deque>
 #include <atomic>
 #include <thread>
@@ -153,7 +154,9 @@ public:
     FramePosList() :
         m_frameDuration(0.0),
         m_list(),
+        m_ptsKey(),
         m_nextFixNumIndex(0),
+        m_sortedNum(0),
         m_inputFin(false),
         m_duration(0),
         m_durationNum(0),
@@ -164,6 +167,7 @@ public:
         m_ptsWrapArroundThreshold(0xFFFFFFFF),
         m_fpDebugCopyFrameData() {
         m_list.init();
+        m_ptsKey.init();
         static_assert(sizeof(m_list.get()[0]) == sizeof(m_list.get()->data), "FramePos must not have padding.");
     };
     virtual ~FramePosList() {
@@ -217,8 +221,10 @@ public:
     //初期化
     void clear() {
         m_list.close();
+        m_ptsKey.close();
         m_frameDuration = 0.0;
         m_nextFixNumIndex = 0;
+        m_sortedNum = 0;
         m_inputFin = false;
         m_duration = 0;
         m_durationNum = 0;
@@ -229,6 +235,7 @@ public:
         m_ptsWrapArroundThreshold = 0xFFFFFFFF;
         m_fpDebugCopyFrameData.reset();
         m_list.init();
+        m_ptsKey.init();
     }
     //ここまで計算したdurationを返す
     int64_t duration() const {
@@ -257,6 +264,8 @@ public:
         }
         m_lastPoc = 0;
         m_nextFixNumIndex = 0;
+        m_sortedNum = 0;
+        m_ptsKey.clear();
         m_streamPtsStatus = RGY_PTS_UNKNOWN;
         m_PAFFRewind = 0;
         m_ptsWrapArroundThreshold = 0xFFFFFFFF;
@@ -264,9 +273,106 @@ public:
     RGYPtsStatus getStreamPtsStatus() const {
         return m_streamPtsStatus;
     }
+    //ソート済み(ptsの確定した)フレーム数を返す
+    //fixedNum()と異なり、push側以外のスレッドからも参照できる
+    uint32_t sortedNum() const {
+        return (uint32_t)m_sortedNum.load();
+    }
+    //[first, last)の範囲で、isAfter(pos)がtrueとなる最初のインデックスを返す (見つからなければlast)
+    //ptsの確定した範囲はソート済みなので、firstから指数探索で範囲を絞ったのち二分探索する
+    //前回の位置の近傍にあることが多いので、通常は数回の比較で済む
+    template<typename Func>
+    uint32_t searchSorted(uint32_t first, uint32_t last, Func isAfter) {
+        FramePos pos = framePosInit();
+        uint32_t lo = first;
+        uint32_t hi = last;
+        for (uint32_t step = 1; lo < last; step <<= 1) {
+            const uint32_t index = (uint32_t)(std::min<uint64_t>)((uint64_t)lo + step - 1, last - 1);
+            if (!m_list.copy(&pos, index)) {
+                hi = index;
+                break;
+            }
+            if (isAfter(pos)) {
+                hi = index;
+                break;
+            }
+            lo = index + 1;
+        }
+        while (lo < hi) {
+            const uint32_t mid = lo + (hi - lo) / 2;
+            if (!m_list.copy(&pos, mid) || isAfter(pos)) {
+                hi = mid;
+            } else {
+                lo = mid + 1;
+            }
+        }
+        return lo;
+    }
+    //ptsとbaseの差を*diffに返し、差がlimit未満ならtrueを返す
+    //ptsは32bit以上の2のべき乗でwrap arroundするので、差が2^31を超える場合はwrap arroundとみなして補正する
+    bool ptsDiff(int64_t pts, int64_t base, int64_t limit, int64_t *diff) const {
+        int64_t d = pts - base;
+        const int64_t absDiff = std::abs(d);
+        if (absDiff > (1LL << 31)) {
+            int64_t wrap = 1LL << 32;
+            while (wrap < absDiff && wrap < (1LL << 62)) {
+                wrap <<= 1;
+            }
+            d += (d < 0) ? wrap : -wrap;
+        }
+        *diff = d;
+        return std::abs(d) < limit;
+    }
+    //[first, last)の範囲で、ptsのキーがkey以上となる最初のインデックスを返す (見つからなければlast)
+    //キーは単調増加なので、firstから指数探索で範囲を絞ったのち二分探索する
+    //前回の位置の近傍にあることが多いので、通常は数回の比較で済む
+    uint32_t searchKey(uint32_t first, uint32_t last, int64_t key) {
+        int64_t value = 0;
+        uint32_t lo = first;
+        uint32_t hi = last;
+        for (uint32_t step = 1; lo < last; step <<= 1) {
+            const uint32_t index = (uint32_t)(std::min<uint64_t>)((uint64_t)lo + step - 1, last - 1);
+            if (!m_ptsKey.copy(&value, index) || key <= value) {
+                hi = index;
+                break;
+            }
+            lo = index + 1;
+        }
+        while (lo < hi) {
+            const uint32_t mid = lo + (hi - lo) / 2;
+            if (!m_ptsKey.copy(&value, mid) || key <= value) {
+                hi = mid;
+            } else {
+                lo = mid + 1;
+            }
+        }
+        return lo;
+    }
+    //ptsの一致するフレームの情報のコピーを返す
+    //一致するフレームがなければ、ptsより前の直近のフレームを返す
     FramePos findpts(int64_t pts, uint32_t *lastIndex) {
-        FramePos pos_last = framePosInit();
-        for (uint32_t index = *lastIndex + 1; ; index++) {
+        const uint32_t nSorted = sortedNum();
+        uint32_t lowerBound = UINT32_MAX; //ソート済みの範囲で、ptsより後となる最初のフレーム (UINT32_MAXなら不明)
+        if (nSorted > 0) {
+            //前回の位置のフレームを基準にptsをキーに変換し、ソート済みの範囲をキーで二分探索する
+            const uint32_t anchor = (*lastIndex == UINT32_MAX) ? 0 : (std::min)(*lastIndex, nSorted - 1);
+            FramePos pos = framePosInit();
+            int64_t anchorKey = 0;
+            if (m_list.copy(&pos, anchor) && m_ptsKey.copy(&anchorKey, anchor)) {
+                int64_t diff = 0;
+                if (ptsDiff(pts, pos.pts, 1LL << 31, &diff)) {
+                    const int64_t key = anchorKey + diff;
+                    const uint32_t found = (diff > 0) ? searchKey(anchor + 1, nSorted, key) : searchKey(0, anchor + 1, key);
+                    if (found < nSorted && m_list.copy(&pos, found) && pts == pos.pts) {
+                        *lastIndex = found;
+                        return pos;
+                    }
+                    lowerBound = found;
+                }
+            }
+        }
+        //ptsの確定していない範囲は順不同なので線形探索
+        for (uint32_t index = nSorted; ; index++) {
             FramePos pos = framePosInit();
             if (!m_list.copy(&pos, index)) {
                 break;
@@ -275,10 +381,22 @@ public:
                 *lastIndex = index;
                 return pos;
             }
-            pos_last = pos;
         }
-        //最初から探索
-        for (uint32_t index = 0; ; index++) {
+        FramePos pos_last = framePosInit();
+        if (lowerBound < nSorted) {
+            //pts < demux.videoFramePts[lowerBound]であるなら、その前のフレームを返す
+            *lastIndex = lowerBound - 1;
+            if (lowerBound > 0) {
+                m_list.copy(&pos_last, lowerBound - 1);
+            }
+            return pos_last;
+        }
+        //ソート済みの範囲より後、またはwrap arroundをまたいでキーに変換できない場合は線形探索
+        uint32_t index = (lowerBound == nSorted) ? nSorted - 1 : 0;
+        if (index > 0) {
+            m_list.copy(&pos_last, index - 1);
+        }
+        for (; ; index++) {
             FramePos pos = framePosInit();
             if (!m_list.copy(&pos, index)) {
                 break;
@@ -376,6 +494,7 @@ public:
         add(pos);
         m_nextFixNumIndex += m_PAFFRewind;
         m_PAFFRewind = 0;
+        updateSortedNum();
         m_duration = total_duration;
         m_durationNum = m_nextFixNumIndex;
     }
@@ -632,6 +751,9 @@ protected:
                 && m_nextFixNumIndex <= 16) { //wrap arroundの場合は除く
                 //これはフレームリストから取り除く
                 m_list.pop();
+                if (m_ptsKey.size() > 0) {
+                    m_ptsKey.pop();
+                }
                 m_nextFixNumIndex--;
                 nSortFixedSize--;
             } else {
@@ -649,11 +771,32 @@ protected:
             m_nextFixNumIndex--;
             m_PAFFRewind = 1;
         }
+        updateSortedNum();
+    }
+    //ptsの確定したフレームについて、wrap arroundを展開した単調増加の64bitのキーを計算し、探索できる範囲を更新する
+    //キーは直前のフレームとのptsの差を積算したもので、ptsが不連続な箇所では直前のフレームのdurationを加える
+    void updateSortedNum() {
+        for (int i = (int)m_ptsKey.size(); i < m_nextFixNumIndex; i++) {
+            int64_t key = m_list[i].data.pts;
+            if (i > 0) {
+                int64_t prevKey = 0;
+                m_ptsKey.copy(&prevKey, i - 1);
+                int64_t diff = 0;
+                if (!ptsDiff(m_list[i].data.pts, m_list[i-1].data.pts, m_ptsWrapArroundThreshold, &diff)) {
+                    diff = (std::max<int64_t>)(1, m_list[i-1].data.duration);
+                }
+                key = prevKey + diff;
+            }
+            m_ptsKey.push(key);
+        }
+        m_sortedNum = m_nextFixNumIndex;
     }
 protected:
     double m_frameDuration; //CFRを仮定する際のフレーム長 (RGY_PTS_ALL_INVALID, RGY_PTS_NONKEY_INVALID, RGY_PTS_NONKEY_INVALID時有効)
     RGYQueueSPSP<FramePos, 1> m_list; //内部データサイズとFramePosのデータサイズを一致させるため、alignを1に設定
+    RGYQueueSPSP<int64_t, 1> m_ptsKey; //ptsの確定したフレームの、wrap arroundを展開したpts (単調増加、m_listと同じインデックス)
     int m_nextFixNumIndex; //次にptsを確定させるフレームのインデックス
+    std::atomic<int> m_sortedNum; //ソートによりptsが確定したフレーム数 (push側以外のスレッドからの探索用)
     bool m_inputFin; //入力が終了したことを示すフラグ
     int64_t m_duration; //m_durationNumのフレーム数分のdurationの総和
     int m_durationNum; //durationを計算したフレーム数
@@ -732,6 +875,7 @@ typedef struct AVDemuxThread {
     int                          threadInput;        //入力スレッドを使用する
     std::atomic<bool>            bAbortInput;        //読み込みスレッドに停止を通知する
     std::thread                  thInput;            //読み込みスレッド
+    std::unique_ptr<RGYFilePrefetch> prefetch;       //ファイル先読みスレッド
     PerfQueueInfo               *queueInfo;          //キューの情報を格納する構造体
 } AVDemuxThread;
 
@@ -929,6 +1073,7 @@ public:
     bool           readChapter;             //チャプターの読み込みを行うかどうか
     pair<int,int>  videoAvgFramerate;       //動画のフレームレート
     int            analyzeSec;              //入力ファイルを分析する秒数
+    int            prefetchMB;              //入力ファイルをバックグラウンドで先読みするサイズ (MB, 0で無効)
     int            nTrimCount;              //Trimする動画フレームの領域の数
     sTrim         *pTrimList;               //Trimする動画フレームの領域のリスト
     int            trackStartAudio;         //音声のトラック番号の開始点
@@ -944,7 +1089,7 @@ public:
     DataSelect   **ppAttachmentSelect;      //muxするAttachmentのトラック番号のリスト 1,2,...(1から連番で指定)
     RGYAVSync      AVSyncMode;              //音声・映像同期モード
     int            procSpeedLimit;          //プリデコードする場合の処理速度制限 (0で制限なし)
-    float          seekSec;                 //指定された秒数分先頭を飛ばす
+    double         seekSec;                 //指定された秒数分先頭を飛ばす
     const TCHAR   *logFramePosList;         //FramePosListの内容を入力終了時に出力する (デバッグ用)
     const TCHAR   *logCopyFrameData;        //frame情報copy関数のログ出力先 (デバッグ用)
     int            threadInput;             //入力スレッドを有効にする
@@ -1083,6 +1228,12 @@ protected:
     //読み込みスレッド関数
     RGY_ERR ThreadFuncRead();
 
+    //demuxerの読み込み位置を先読みスレッドに通知する
+    void prefetchReadPos(int64_t pos);
+
+    //libavformatのAVIOで読み込んでいる場合に、その読み込み位置を先読みスレッドに通知する
+    void prefetchReadPosAVIO();
+
     //指定したptsとtimebaseから、該当する動画フレームを取得する
     int getVideoFrameIdx(int64_t pts, AVRational timebase, int iStart);
 
@@ -26,6 +26,8 @@
 // ------------------------------------------------------------------------------------------
 
 #include "rgy_input_avi.h"
+#include "rgy_mem_pool.h"
+#include "rgy_trace.h"
 #if ENABLE_AVI_READER
 #pragma warning(disable:4312)
 #pragma warning(disable:4838)
@@ -192,6 +194,7 @@ void RGYInputAvi::Close() {
     m_nBufSize = 0;
     m_pBuffer.reset();
 
+    AddMessage(RGY_LOG_DEBUG, _T("%s.\n"), RGYMemPool::shared()->statsStr().c_str());
     AddMessage(RGY_LOG_DEBUG, _T("Closed.\n"));
     m_encSatusInfo.reset();
 }
@@ -214,7 +217,7 @@ RGY_ERR RGYInputAvi::LoadNextFrame(RGYFrame *pSurface) {
         uint32_t required_bufsize = m_inputVideoInfo.srcWidth * m_inputVideoInfo.srcHeight * 3;
         if (m_nBufSize < required_bufsize) {
             m_pBuffer.reset();
-            m_pBuffer = std::shared_ptr<uint8_t>((uint8_t *)_aligned_malloc(required_bufsize, 16), aligned_malloc_deleter());
+            m_pBuffer = RGYMemPool::shared()->alloc(required_bufsize);
             if (!m_pBuffer.get()) {
                 return RGY_ERR_MEMORY_ALLOC;
             }
@@ -230,10 +233,13 @@ RGY_ERR RGYInputAvi::LoadNextFrame(RGYFrame *pSurface) {
     pSurface->ptrArray(dst_array, m_convert->getFunc()->csp_to == RGY_CSP_RGB24 || m_convert->getFunc()->csp_to == RGY_CSP_RGB32);
     const void *src_array[3] = { ptr_src, ptr_src + m_inputVideoInfo.srcWidth * m_inputVideoInfo.srcHeight * 5 / 4, ptr_src + m_inputVideoInfo.srcWidth * m_inputVideoInfo.srcHeight };
 
-    m_convert->run((m_inputVideoInfo.picstruct & RGY_PICSTRUCT_INTERLACED) ? 1 : 0,
-        dst_array, src_array,
-        m_inputVideoInfo.srcWidth, m_inputVideoInfo.srcWidth * m_nYPitchMultiplizer, m_inputVideoInfo.srcWidth/2, pSurface->pitch(),
-        m_inputVideoInfo.srcHeight, m_inputVideoInfo.srcHeight, m_inputVideoInfo.crop.c);
+    {
+        RGY_TRACE_SCOPE("convert_csp", m_encSatusInfo->m_sData.frameIn);
+        m_convert->run((m_inputVideoInfo.picstruct & RGY_PICSTRUCT_INTERLACED) ? 1 : 0,
+            dst_array, src_array,
+            m_inputVideoInfo.srcWidth, m_inputVideoInfo.srcWidth * m_nYPitchMultiplizer, m_inputVideoInfo.srcWidth/2, pSurface->pitch(),
+            m_inputVideoInfo.srcHeight, m_inputVideoInfo.srcHeight, m_inputVideoInfo.crop.c);
+    }
 
     m_encSatusInfo->m_sData.frameIn++;
     // display update
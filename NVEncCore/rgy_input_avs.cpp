@@ -27,14 +27,21 @@
 
 #include "rgy_input_avs.h"
 #if ENABLE_AVISYNTH_READER
+#include "rgy_mem_pool.h"
+#include "rgy_trace.h"
 
+std::vector<const TCHAR *> RGYInputAvs::dllNames() {
 #if defined(_WIN32) || defined(_WIN64)
-static const TCHAR *avisynth_dll_name = _T("avisynth.dll");
+    return { _T("avisynth.dll") };
 #else
-static const TCHAR *avisynth_dll_name = _T("libavxsynth.so");
+    //AviSynth+ (Linux版) を優先し、なければAvxSynthを使用する
+    return { _T("libavisynth.so"), _T("libavxsynth.so") };
 #endif
+}
 
 static const int RGY_AVISYNTH_INTERFACE_25 = 2;
+//先読みで保持する変換後のフレームの総量の上限 (byte)
+static const size_t AVS_PREFETCH_MAX_BYTES = (size_t)1024 * 1024 * 1024;
 
 int AVSC_CC rgy_avs_get_pitch_p(const AVS_VideoFrame * p, int plane) {
     switch (plane) {
@@ -55,11 +62,24 @@ const uint8_t* AVSC_CC rgy_avs_get_read_ptr_p(const AVS_VideoFrame * p, int plan
 
 RGYInputAvsPrm::RGYInputAvsPrm(RGYInputPrm base) :
     RGYInputPrm(base),
-    readAudio(false) {
+    readAudio(false),
+    prefetch(0) {
 
 }
 
 RGYInputAvs::RGYInputAvs() :
+    m_prefetchThread(),
+    m_prefetchMtx(),
+    m_prefetchCondReady(),
+    m_prefetchCondFree(),
+    m_prefetchQueue(),
+    m_prefetchFreeBuf(),
+    m_prefetchAbort(false),
+    m_prefetchEnd(false),
+    m_prefetchDepth(0),
+    m_prefetchBufInfo(),
+    m_prefetchBufSize(0),
+    m_prefetchStalls(0),
     m_sAVSenv(nullptr),
     m_sAVSclip(nullptr),
     m_sAVSinfo(nullptr),
@@ -67,7 +87,8 @@ RGYInputAvs::RGYInputAvs() :
 #if ENABLE_AVSW_READER
     m_audio(),
     m_format(unique_ptr<AVFormatContext, decltype(&avformat_free_context)>(nullptr, &avformat_free_context)),
-    m_audioCurrentSample(0)
+    m_audioCurrentSample(0),
+    m_audioPackets()
 #endif //#if ENABLE_AVSW_READER
 {
     memset(&m_sAvisynth, 0, sizeof(m_sAvisynth));
@@ -92,12 +113,20 @@ void RGYInputAvs::release_avisynth() {
 RGY_ERR RGYInputAvs::load_avisynth() {
     release_avisynth();
 
+    for (const auto dllName : dllNames()) {
 #if defined(_WIN32) || defined(_WIN64)
-    if (nullptr == (m_sAvisynth.h_avisynth = (HMODULE)LoadLibrary(avisynth_dll_name)))
+        m_sAvisynth.h_avisynth = (HMODULE)LoadLibrary(dllName);
 #else
-    if (nullptr == (m_sAvisynth.h_avisynth = dlopen(avisynth_dll_name, RTLD_LAZY)))
+        m_sAvisynth.h_avisynth = dlopen(dllName, RTLD_LAZY);
 #endif
+        if (m_sAvisynth.h_avisynth) {
+            AddMessage(RGY_LOG_DEBUG, _T("loaded %s.\n"), dllName);
+            break;
+        }
+    }
+    if (m_sAvisynth.h_avisynth == nullptr) {
         return RGY_ERR_INVALID_HANDLE;
+    }
 
 #define LOAD_FUNC(x, required, altern_func) {\
     if (nullptr == (m_sAvisynth.f_ ## x = (func_avs_ ## x)RGY_GET_PROC_ADDRESS(m_sAvisynth.h_avisynth, "avs_" #x))) { \
@@ -191,19 +220,16 @@ RGY_ERR RGYInputAvs::InitAudio() {
     return RGY_ERR_NONE;
 }
 
-vector<AVPacket> RGYInputAvs::GetStreamDataPackets(int inputFrame) {
-    UNREFERENCED_PARAMETER(inputFrame);
-
-    vector<AVPacket> pkts;
+void RGYInputAvs::readAudio(int n, vector<AVPacket>& pkts, tstring& errMes) {
     if (m_audio.size() == 0) {
-        return pkts;
+        return;
     }
 
     const auto samplerate = av_make_q(m_sAVSinfo->audio_samples_per_second, 1);
     const auto fps = av_make_q(m_inputVideoInfo.fpsN, m_inputVideoInfo.fpsD);
-    auto samples = (int)(av_rescale_q(m_encSatusInfo->m_sData.frameIn, samplerate, fps) - m_audioCurrentSample);
+    auto samples = (int)(av_rescale_q(n + 1, samplerate, fps) - m_audioCurrentSample);
     if (samples <= 0) {
-        return pkts;
+        return;
     }
     if (m_audioCurrentSample + samples > m_sAVSinfo->num_audio_samples) {
         samples = (int)(m_sAVSinfo->num_audio_samples - m_audioCurrentSample);
@@ -212,7 +238,8 @@ vector<AVPacket> RGYInputAvs::GetStreamDataPackets(int inputFrame) {
     const int size = avs_bytes_per_channel_sample(m_sAVSinfo) * samples * m_sAVSinfo->nchannels;
     AVPacket pkt;
     if (av_new_packet(&pkt, size) < 0) {
-        return pkts;
+        errMes = _T("Failed to allocate audio packet.\n");
+        return;
     }
     pkt.pts = m_audioCurrentSample;
     pkt.dts = m_audioCurrentSample;
@@ -223,11 +250,20 @@ vector<AVPacket> RGYInputAvs::GetStreamDataPackets(int inputFrame) {
     m_sAvisynth.f_get_audio(m_sAVSclip, pkt.data, m_audioCurrentSample, samples);
     const auto avs_err = m_sAvisynth.f_clip_get_error(m_sAVSclip);
     if (avs_err) {
-        AddMessage(RGY_LOG_ERROR, _T("Unknown error when reading audio frame from avisynth: %d.\n"), avs_err);
-        return pkts;
+        errMes = strsprintf(_T("Error when reading audio frame from avisynth: %s\n"), char_to_tstring(avs_err).c_str());
+        av_packet_unref(&pkt);
+        return;
     }
     pkts.push_back(pkt);
     m_audioCurrentSample += samples;
+}
+
+vector<AVPacket> RGYInputAvs::GetStreamDataPackets(int inputFrame) {
+    UNREFERENCED_PARAMETER(inputFrame);
+
+    //音声はLoadNextFrameで読み込んだフレームの分まで、フレームとともに読み込んである
+    vector<AVPacket> pkts;
+    pkts.swap(m_audioPackets);
     return pkts;
 }
 #endif //#if ENABLE_AVSW_READER
@@ -238,7 +274,11 @@ RGY_ERR RGYInputAvs::Init(const TCHAR *strFileName, VideoInfo *pInputInfo, const
     m_inputVideoInfo = *pInputInfo;
 
     if (load_avisynth() != RGY_ERR_NONE) {
-        AddMessage(RGY_LOG_ERROR, _T("failed to load %s.\n"), avisynth_dll_name);
+        tstring dllNameList;
+        for (const auto dllName : dllNames()) {
+            dllNameList += ((dllNameList.length() > 0) ? _T(", ") : _T("")) + tstring(dllName);
+        }
+        AddMessage(RGY_LOG_ERROR, _T("failed to load %s.\n"), dllNameList.c_str());
         return RGY_ERR_INVALID_HANDLE;
     }
 
@@ -391,6 +431,9 @@ RGY_ERR RGYInputAvs::Init(const TCHAR *strFileName, VideoInfo *pInputInfo, const
 
     CreateInputInfo(avisynth_version.c_str(), RGY_CSP_NAMES[m_convert->getFunc()->csp_from], RGY_CSP_NAMES[m_convert->getFunc()->csp_to], get_simd_str(m_convert->getFunc()->simd), &m_inputVideoInfo);
     AddMessage(RGY_LOG_DEBUG, m_inputInfo);
+
+    initPrefetch((avsPrm != nullptr) ? avsPrm->prefetch : 0);
+    AddMessage(RGY_LOG_DEBUG, _T("prefetch %d frames.\n"), m_prefetchDepth);
     *pInputInfo = m_inputVideoInfo;
     return RGY_ERR_NONE;
 }
@@ -398,7 +441,16 @@ RGY_ERR RGYInputAvs::Init(const TCHAR *strFileName, VideoInfo *pInputInfo, const
 
 void RGYInputAvs::Close() {
     AddMessage(RGY_LOG_DEBUG, _T("Closing...\n"));
+    if (m_prefetchThread.joinable()) {
+        AddMessage(RGY_LOG_DEBUG, _T("prefetch %d frames, waited for %d frames.\n"), m_prefetchDepth, m_prefetchStalls);
+    }
+    //AviSynthを解放する前に、先読みスレッドを停止する
+    stopPrefetch();
 #if ENABLE_AVSW_READER
+    for (auto& pkt : m_audioPackets) {
+        av_packet_unref(&pkt);
+    }
+    m_audioPackets.clear();
     m_format.reset();
 #endif //#if ENABLE_AVSW_READER
     if (m_sAVSclip)
@@ -415,34 +467,216 @@ void RGYInputAvs::Close() {
     AddMessage(RGY_LOG_DEBUG, _T("Closed.\n"));
 }
 
-RGY_ERR RGYInputAvs::LoadNextFrame(RGYFrame *pSurface) {
-    if ((int)m_encSatusInfo->m_sData.frameIn >= m_inputVideoInfo.frames
-        //m_encSatusInfo->m_nInputFramesがtrimの結果必要なフレーム数を大きく超えたら、エンコードを打ち切る
-        //ちょうどのところで打ち切ると他のストリームに影響があるかもしれないので、余分に取得しておく
-        || getVideoTrimMaxFramIdx() < (int)m_encSatusInfo->m_sData.frameIn - TRIM_OVERREAD_FRAMES) {
-        return RGY_ERR_MORE_DATA;
-    }
-
-    AVS_VideoFrame *frame = m_sAvisynth.f_get_frame(m_sAVSclip, m_encSatusInfo->m_sData.frameIn);
-    if (frame == nullptr) {
-        return RGY_ERR_MORE_DATA;
-    }
+RGY_ERR RGYInputAvs::readFrame(int n, void **dst, int dstPitch, tstring& errMes) {
+    AVS_VideoFrame *frame = m_sAvisynth.f_get_frame(m_sAVSclip, n);
     auto avs_err = m_sAvisynth.f_clip_get_error(m_sAVSclip);
     if (avs_err) {
-        AddMessage(RGY_LOG_ERROR, _T("Unknown error when reading video frame from avisynth: %d.\n"), avs_err);
+        errMes = strsprintf(_T("Error when reading video frame %d from avisynth: %s\n"), n, char_to_tstring(avs_err).c_str());
+        if (frame) {
+            m_sAvisynth.f_release_video_frame(frame);
+        }
         return RGY_ERR_UNKNOWN;
     }
+    if (frame == nullptr) {
+        return RGY_ERR_MORE_DATA;
+    }
 
-    void *dst_array[3];
-    pSurface->ptrArray(dst_array, m_convert->getFunc()->csp_to == RGY_CSP_RGB24 || m_convert->getFunc()->csp_to == RGY_CSP_RGB32);
     const void *src_array[3] = { m_sAvisynth.f_get_read_ptr_p(frame, AVS_PLANAR_Y), m_sAvisynth.f_get_read_ptr_p(frame, AVS_PLANAR_U), m_sAvisynth.f_get_read_ptr_p(frame, AVS_PLANAR_V) };
 
-    m_convert->run((m_inputVideoInfo.picstruct & RGY_PICSTRUCT_INTERLACED) ? 1 : 0,
-        dst_array, src_array,
-        m_inputVideoInfo.srcWidth, m_sAvisynth.f_get_pitch_p(frame, AVS_PLANAR_Y), m_sAvisynth.f_get_pitch_p(frame, AVS_PLANAR_U),
-        pSurface->pitch(), m_inputVideoInfo.srcHeight, m_inputVideoInfo.srcHeight, m_inputVideoInfo.crop.c);
+    {
+        RGY_TRACE_SCOPE("convert_csp", n);
+        m_convert->run((m_inputVideoInfo.picstruct & RGY_PICSTRUCT_INTERLACED) ? 1 : 0,
+            dst, src_array,
+            m_inputVideoInfo.srcWidth, m_sAvisynth.f_get_pitch_p(frame, AVS_PLANAR_Y), m_sAvisynth.f_get_pitch_p(frame, AVS_PLANAR_U),
+            dstPitch, m_inputVideoInfo.srcHeight, m_inputVideoInfo.srcHeight, m_inputVideoInfo.crop.c);
+    }
 
     m_sAvisynth.f_release_video_frame(frame);
+    return RGY_ERR_NONE;
+}
+
+void RGYInputAvs::initPrefetch(int depth) {
+    //変換後のフレームの配置 (NVEncCoreの入力バッファと同じ配置とする)
+    m_prefetchBufInfo = FrameInfo();
+    m_prefetchBufInfo.csp = m_convert->getFunc()->csp_to;
+    m_prefetchBufInfo.width = m_inputVideoInfo.srcWidth - m_inputVideoInfo.crop.e.left - m_inputVideoInfo.crop.e.right;
+    m_prefetchBufInfo.height = m_inputVideoInfo.srcHeight - m_inputVideoInfo.crop.e.bottom - m_inputVideoInfo.crop.e.up;
+    m_prefetchBufInfo.picstruct = m_inputVideoInfo.picstruct;
+    const auto exinfo = getFrameInfoExtra(&m_prefetchBufInfo);
+    m_prefetchBufInfo.pitch = ALIGN(exinfo.width_byte, 64 * (RGY_CSP_BIT_DEPTH[m_prefetchBufInfo.csp] > 8 ? 2 : 1));
+    m_prefetchBufSize = (size_t)m_prefetchBufInfo.pitch * exinfo.height_total;
+    //配置の分からない色空間では、先読みせず従来どおり読み込む
+    m_prefetchDepth = 0;
+    if (m_prefetchBufSize > 0 && depth > 0) {
+        m_prefetchDepth = (std::min)(depth, (int)(std::max<size_t>)(AVS_PREFETCH_MAX_BYTES / m_prefetchBufSize, 1));
+    }
+    m_prefetchStalls = 0;
+}
+
+void RGYInputAvs::startPrefetch() {
+    //trimで不要となる範囲のフレームは読み込まない (LoadNextFrameはTRIM_OVERREAD_FRAMES分余分に読む)
+    int maxFrames = m_inputVideoInfo.frames;
+    const int trimMax = getVideoTrimMaxFramIdx();
+    if (trimMax < INT_MAX - TRIM_OVERREAD_FRAMES - 1) {
+        maxFrames = (std::min)(maxFrames, trimMax + TRIM_OVERREAD_FRAMES + 1);
+    }
+    m_prefetchAbort = false;
+    m_prefetchEnd = false;
+    m_prefetchThread = std::thread(&RGYInputAvs::prefetchThreadFunc, this, (int)m_encSatusInfo->m_sData.frameIn, maxFrames);
+}
+
+void RGYInputAvs::stopPrefetch() {
+    if (m_prefetchThread.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(m_prefetchMtx);
+            m_prefetchAbort = true;
+        }
+        m_prefetchCondFree.notify_all();
+        m_prefetchThread.join();
+    }
+#if ENABLE_AVSW_READER
+    for (auto& frame : m_prefetchQueue) {
+        for (auto& pkt : frame.audio) {
+            av_packet_unref(&pkt);
+        }
+    }
+#endif //#if ENABLE_AVSW_READER
+    m_prefetchQueue.clear();
+    m_prefetchFreeBuf.clear();
+    m_prefetchAbort = false;
+    m_prefetchEnd = false;
+}
+
+void RGYInputAvs::prefetchThreadFunc(int startFrame, int maxFrames) {
+    //先読み中のAviSynthの呼び出しはすべてこのスレッドで行う
+    for (int n = startFrame; n < maxFrames; n++) {
+        PrefetchFrame frame;
+        {
+            std::unique_lock<std::mutex> lock(m_prefetchMtx);
+            m_prefetchCondFree.wait(lock, [this]() { return m_prefetchAbort || (int)m_prefetchQueue.size() < m_prefetchDepth; });
+            if (m_prefetchAbort) {
+                break;
+            }
+            if (m_prefetchFreeBuf.size() > 0) {
+                frame.buf = std::move(m_prefetchFreeBuf.back());
+                m_prefetchFreeBuf.pop_back();
+            }
+        }
+        if (!frame.buf) {
+            frame.buf = RGYMemPool::shared()->alloc(m_prefetchBufSize);
+        }
+        if (!frame.buf) {
+            frame.err = RGY_ERR_NULL_PTR;
+            frame.errMes = _T("Failed to allocate buffer for prefetch.\n");
+        } else {
+            RGY_TRACE_SCOPE("avs_prefetch", n);
+            FrameInfo bufInfo = m_prefetchBufInfo;
+            bufInfo.ptr = frame.buf.get();
+            void *dst_array[3];
+            RGYFrame(bufInfo).ptrArray(dst_array, bufInfo.csp == RGY_CSP_RGB24 || bufInfo.csp == RGY_CSP_RGB32);
+            frame.err = readFrame(n, dst_array, bufInfo.pitch, frame.errMes);
+        }
+#if ENABLE_AVSW_READER
+        if (frame.err == RGY_ERR_NONE) {
+            readAudio(n, frame.audio, frame.audioErrMes);
+        }
+#endif //#if ENABLE_AVSW_READER
+        const bool end = frame.err != RGY_ERR_NONE;
+        {
+            std::lock_guard<std::mutex> lock(m_prefetchMtx);
+            m_prefetchQueue.push_back(std::move(frame));
+        }
+        m_prefetchCondReady.notify_one();
+        if (end) {
+            break;
+        }
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_prefetchMtx);
+        m_prefetchEnd = true;
+    }
+    m_prefetchCondReady.notify_one();
+}
+
+RGY_ERR RGYInputAvs::LoadNextFrame(RGYFrame *pSurface) {
+    if ((int)m_encSatusInfo->m_sData.frameIn >= m_inputVideoInfo.frames
+        //m_encSatusInfo->m_nInputFramesがtrimの結果必要なフレーム数を大きく超えたら、エンコードを打ち切る
+        //ちょうどのところで打ち切ると他のストリームに影響があるかもしれないので、余分に取得しておく
+        || getVideoTrimMaxFramIdx() < (int)m_encSatusInfo->m_sData.frameIn - TRIM_OVERREAD_FRAMES) {
+        return RGY_ERR_MORE_DATA;
+    }
+
+    const int n = (int)m_encSatusInfo->m_sData.frameIn;
+    if (m_prefetchDepth <= 0) {
+        void *dst_array[3];
+        pSurface->ptrArray(dst_array, m_convert->getFunc()->csp_to == RGY_CSP_RGB24 || m_convert->getFunc()->csp_to == RGY_CSP_RGB32);
+        tstring errMes;
+        auto err = readFrame(n, dst_array, pSurface->pitch(), errMes);
+        if (err != RGY_ERR_NONE) {
+            if (errMes.length() > 0) {
+                AddMessage(RGY_LOG_ERROR, errMes);
+            }
+            return err;
+        }
+#if ENABLE_AVSW_READER
+        readAudio(n, m_audioPackets, errMes);
+        if (errMes.length() > 0) {
+            AddMessage(RGY_LOG_ERROR, errMes);
+        }
+#endif //#if ENABLE_AVSW_READER
+    } else {
+        if (!m_prefetchThread.joinable()) {
+            startPrefetch();
+        }
+        PrefetchFrame frame;
+        {
+            std::unique_lock<std::mutex> lock(m_prefetchMtx);
+            if (m_prefetchQueue.size() == 0 && !m_prefetchEnd) {
+                RGY_TRACE_SCOPE("avs_wait", n);
+                m_prefetchStalls++;
+                m_prefetchCondReady.wait(lock, [this]() { return m_prefetchQueue.size() > 0 || m_prefetchEnd; });
+            }
+            if (m_prefetchQueue.size() == 0) {
+                //trimで必要な範囲をすべて読み込んだ
+                return RGY_ERR_MORE_DATA;
+            }
+            frame = std::move(m_prefetchQueue.front());
+            m_prefetchQueue.pop_front();
+        }
+        m_prefetchCondFree.notify_one();
+#if ENABLE_AVSW_READER
+        vector_cat(m_audioPackets, frame.audio);
+        if (frame.audioErrMes.length() > 0) {
+            AddMessage(RGY_LOG_ERROR, frame.audioErrMes);
+        }
+#endif //#if ENABLE_AVSW_READER
+        if (frame.err != RGY_ERR_NONE) {
+            if (frame.errMes.length() > 0) {
+                AddMessage(RGY_LOG_ERROR, frame.errMes);
+            }
+            return frame.err;
+        }
+
+        //先読みスレッドで変換済みのフレームをコピーする
+        if ((int)pSurface->width() != m_prefetchBufInfo.width || (int)pSurface->height() != m_prefetchBufInfo.height) {
+            AddMessage(RGY_LOG_ERROR, _T("Frame size mismatch: %dx%d, expected %dx%d.\n"),
+                pSurface->width(), pSurface->height(), m_prefetchBufInfo.width, m_prefetchBufInfo.height);
+            return RGY_ERR_INCOMPATIBLE_VIDEO_PARAM;
+        }
+        const auto exinfo = getFrameInfoExtra(&m_prefetchBufInfo);
+        const uint8_t *src = frame.buf.get();
+        uint8_t *dst = pSurface->ptrY();
+        const int dstPitch = (int)pSurface->pitch();
+        if (dstPitch == m_prefetchBufInfo.pitch) {
+            memcpy(dst, src, m_prefetchBufSize);
+        } else {
+            for (int y = 0; y < exinfo.height_total; y++) {
+                memcpy(dst + (size_t)y * dstPitch, src + (size_t)y * m_prefetchBufInfo.pitch, exinfo.width_byte);
+            }
+        }
+        std::lock_guard<std::mutex> lock(m_prefetchMtx);
+        m_prefetchFreeBuf.push_back(std::move(frame.buf));
+    }
 
     m_encSatusInfo->m_sData.frameIn++;
     return m_encSatusInfo->UpdateDisplay();
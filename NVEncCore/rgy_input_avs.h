@@ -31,6 +31,10 @@
 
 #include "rgy_version.h"
 #if ENABLE_AVISYNTH_READER
+#include <thread>
+#include <mutex>
+#include <deque>
+#include <condition_variable>
 #pragma warning(push)
 #pragma warning(disable:4244)
 #pragma warning(disable:4456)
@@ -100,6 +104,7 @@ struct avs_dll_t {
 class RGYInputAvsPrm : public RGYInputPrm {
 public:
     bool readAudio;
+    int prefetch; //先読みするフレーム数 (0で先読みしない)
     RGYInputAvsPrm(RGYInputPrm base);
 
     virtual ~RGYInputAvsPrm() {};
@@ -110,6 +115,9 @@ public:
     RGYInputAvs();
     virtual ~RGYInputAvs();
 
+    //読み込みを試すAviSynthのライブラリ (先に読み込めたものを使用する)
+    static std::vector<const TCHAR *> dllNames();
+
     virtual RGY_ERR LoadNextFrame(RGYFrame *pSurface) override;
     virtual void Close() override;
 
@@ -124,10 +132,51 @@ public:
 #endif // #if ENABLE_AVSW_READER
 
 protected:
+    //先読みスレッドで読み込んだフレーム
+    struct PrefetchFrame {
+        RGY_ERR err;                   //RGY_ERR_NONE以外の場合、ここで読み込みを終了する
+        tstring errMes;
+        std::shared_ptr<uint8_t> buf;  //変換後のフレーム (m_prefetchBufInfoの配置)
+#if ENABLE_AVSW_READER
+        std::vector<AVPacket> audio;   //このフレームまでの音声
+        tstring audioErrMes;
+#endif //#if ENABLE_AVSW_READER
+
+        PrefetchFrame() : err(RGY_ERR_NONE), errMes(), buf()
+#if ENABLE_AVSW_READER
+            , audio(), audioErrMes()
+#endif //#if ENABLE_AVSW_READER
+        {};
+    };
+
     virtual RGY_ERR Init(const TCHAR *strFileName, VideoInfo *pInputInfo, const RGYInputPrm *prm) override;
     RGY_ERR load_avisynth();
     void release_avisynth();
 
+    //フレームnを取得してdstに変換する
+    RGY_ERR readFrame(int n, void **dst, int dstPitch, tstring& errMes);
+    //先読みの設定 (変換後のフレームの配置) を決める
+    void initPrefetch(int depth);
+    //先読みスレッドを開始する (trimの設定後に呼ぶ)
+    void startPrefetch();
+    //先読みスレッドを停止し、先読みしたフレームをすべて破棄する
+    void stopPrefetch();
+    //先読みスレッドの本体 (startFrameからmaxFrames-1までを読み込む)
+    void prefetchThreadFunc(int startFrame, int maxFrames);
+
+    std::thread m_prefetchThread;
+    std::mutex m_prefetchMtx;
+    std::condition_variable m_prefetchCondReady; //先読みしたフレームが追加された
+    std::condition_variable m_prefetchCondFree;  //先読みしたフレームが取り出された
+    std::deque<PrefetchFrame> m_prefetchQueue;   //先読みしたフレーム (m_prefetchMtxで保護)
+    std::vector<std::shared_ptr<uint8_t>> m_prefetchFreeBuf; //再利用する変換後のフレームのバッファ (m_prefetchMtxで保護)
+    bool m_prefetchAbort;                        //先読みスレッドを終了させる (m_prefetchMtxで保護)
+    bool m_prefetchEnd;                          //先読みスレッドが終了した (m_prefetchMtxで保護)
+    int m_prefetchDepth;                         //先読みするフレーム数 (0で先読みしない)
+    FrameInfo m_prefetchBufInfo;                 //変換後のフレームの配置 (ptrは使用しない)
+    size_t m_prefetchBufSize;
+    int m_prefetchStalls;                        //先読みが間に合わず待った回数
+
     AVS_ScriptEnvironment *m_sAVSenv;
     AVS_Clip *m_sAVSclip;
     const AVS_VideoInfo *m_sAVSinfo;
@@ -136,10 +185,13 @@ protected:
 
 #if ENABLE_AVSW_READER
     RGY_ERR InitAudio();
+    //フレームnまでの音声をpktsに追加する
+    void readAudio(int n, vector<AVPacket>& pkts, tstring& errMes);
 
     vector<AVDemuxStream> m_audio;
     unique_ptr<AVFormatContext, decltype(&avformat_free_context)> m_format;
-    int64_t m_audioCurrentSample;
+    int64_t m_audioCurrentSample;                //読み込んだ音声のサンプル数 (先読み中は先読みスレッドのみが触る)
+    vector<AVPacket> m_audioPackets;             //読み込んだフレームまでの音声で、まだ返していないもの
 #endif //#if ENABLE_AVSW_READER
 };
 
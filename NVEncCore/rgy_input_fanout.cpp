@@ -0,0 +1,228 @@
+﻿// -----------------------------------------------------------------------------------------
+// QSVEnc/NVEnc/VCEEnc by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2020 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+#include <cstring>
+#include "rgy_input_fanout.h"
+#include "rgy_avutil.h"
+#include "rgy_audio_encode_share.h"
+
+RGYInputFanoutPrm::RGYInputFanoutPrm(RGYInputPrm base) :
+    RGYInputPrm(base),
+    fanout(),
+    branch(0),
+    source(),
+    audioEncodeCache() {
+
+}
+
+RGYInputFanout::RGYInputFanout() :
+    m_fanout(),
+    m_branch(0),
+    m_source(),
+    m_audioEncodeCache(),
+    m_next(),
+    m_nextErr(RGY_ERR_NONE),
+    m_eosPacketsSent(false) {
+    m_readerName = _T("fanout");
+}
+
+RGYInputFanout::~RGYInputFanout() {
+    Close();
+}
+
+void RGYInputFanout::Close() {
+    AddMessage(RGY_LOG_DEBUG, _T("Closing...\n"));
+    m_next.reset();
+    m_nextErr = RGY_ERR_NONE;
+    m_eosPacketsSent = false;
+    if (m_fanout) {
+        //このエンコードが途中で終了しても、ほかのエンコードを止めないようにする
+        m_fanout->closeBranch(m_branch);
+    }
+    m_fanout.reset();
+    m_source.reset();
+    m_audioEncodeCache.reset();
+    RGYInput::Close();
+}
+
+void RGYInputFanout::closeBranch() {
+    m_next.reset();
+    if (m_fanout) {
+        m_fanout->closeBranch(m_branch);
+    }
+}
+
+RGY_ERR RGYInputFanout::Init(const TCHAR *strFileName, VideoInfo *pInputInfo, const RGYInputPrm *prm) {
+    UNREFERENCED_PARAMETER(strFileName);
+    const auto prmFanout = dynamic_cast<const RGYInputFanoutPrm *>(prm);
+    if (prmFanout == nullptr || !prmFanout->fanout || !prmFanout->source) {
+        AddMessage(RGY_LOG_ERROR, _T("source reader not set.\n"));
+        return RGY_ERR_NOT_INITIALIZED;
+    }
+    if (prmFanout->branch < 0 || prmFanout->branch >= prmFanout->fanout->branches()) {
+        AddMessage(RGY_LOG_ERROR, _T("invalid branch %d.\n"), prmFanout->branch);
+        return RGY_ERR_INVALID_PARAM;
+    }
+    m_fanout = prmFanout->fanout;
+    m_branch = prmFanout->branch;
+    m_source = prmFanout->source;
+    m_audioEncodeCache = prmFanout->audioEncodeCache;
+    //デコードは元のリーダーで済んでいるので、HWデコードは行わない
+    pInputInfo->codec = RGY_CODEC_UNKNOWN;
+    m_inputVideoInfo = *pInputInfo;
+    m_inputCsp = m_inputVideoInfo.csp;
+    //trimは元のリーダーと同じ設定とする
+    m_trimParam = m_source->GetTrimParam();
+
+    const auto sourceInfo = m_source->GetInputFrameInfo();
+    const tstring inputName = strsprintf(_T("fanout #%d"), m_branch);
+    CreateInputInfo(inputName.c_str(), RGY_CSP_NAMES[sourceInfo.csp], RGY_CSP_NAMES[m_inputVideoInfo.csp], nullptr, &m_inputVideoInfo);
+    AddMessage(RGY_LOG_DEBUG, m_inputInfo);
+    return RGY_ERR_NONE;
+}
+
+rgy_rational<int> RGYInputFanout::getInputTimebase() {
+    return (m_source) ? m_source->getInputTimebase() : rgy_rational<int>();
+}
+
+RGY_ERR RGYInputFanout::popNext() {
+    if (!m_next) {
+        m_nextErr = m_fanout->pop(m_branch, m_next);
+    }
+    return m_nextErr;
+}
+
+RGY_ERR RGYInputFanout::LoadNextFrame(RGYFrame *pSurface) {
+    if (!m_fanout) {
+        return RGY_ERR_NOT_INITIALIZED;
+    }
+    popNext();
+    auto frame = std::move(m_next);
+    const auto err = m_nextErr;
+    if (err != RGY_ERR_NONE) {
+        if (err != RGY_ERR_MORE_DATA) {
+            AddMessage(RGY_LOG_ERROR, _T("error in source reader: %s.\n"), get_err_mes(err));
+        }
+        return err;
+    }
+    auto dst = pSurface->getInfo();
+    const auto& src = frame->info;
+    if (dst.csp != src.csp || dst.width != src.width || dst.height != src.height) {
+        AddMessage(RGY_LOG_ERROR, _T("frame format mismatch: %s %dx%d -> %s %dx%d.\n"),
+            RGY_CSP_NAMES[src.csp], src.width, src.height, RGY_CSP_NAMES[dst.csp], dst.width, dst.height);
+        return RGY_ERR_INVALID_FORMAT;
+    }
+    const auto srcInfoEx = getFrameInfoExtra(&src);
+    if (dst.pitch == src.pitch) {
+        memcpy(dst.ptr, src.ptr, (size_t)src.pitch * srcInfoEx.height_total);
+    } else {
+        for (int y = 0; y < srcInfoEx.height_total; y++) {
+            memcpy(dst.ptr + (size_t)y * dst.pitch, src.ptr + (size_t)y * src.pitch, srcInfoEx.width_byte);
+        }
+    }
+    pSurface->setTimestamp(src.timestamp);
+    pSurface->setDuration(src.duration);
+    pSurface->setPicstruct(src.picstruct);
+    pSurface->dataList() = src.dataList;
+    //frameの参照をここで解放し、バッファを元のリーダーに戻す
+    frame.reset();
+
+    if (m_encSatusInfo) {
+        m_encSatusInfo->m_sData.frameIn++;
+        return m_encSatusInfo->UpdateDisplay();
+    }
+    return RGY_ERR_NONE;
+}
+
+#if ENABLE_AVSW_READER
+//フレームに付随するパケットの配列 (解放時にunrefする)
+typedef std::vector<AVPacket> RGYFanoutPackets;
+
+vector<AVPacket> RGYInputFanout::GetStreamDataPackets(int inputFrame) {
+    UNREFERENCED_PARAMETER(inputFrame);
+    vector<AVPacket> packets;
+    if (!m_fanout) {
+        return packets;
+    }
+    //パケットは次のフレームに付随しているので、先にフレームを取得しておく
+    popNext();
+    if (!m_next || (m_next->info.ptr == nullptr && m_eosPacketsSent)) {
+        return packets;
+    }
+    //終端のフレームは各出力先で共有され、以降も返されるので、パケットは一度だけ渡す
+    m_eosPacketsSent = m_next->info.ptr == nullptr;
+    auto srcPackets = std::static_pointer_cast<RGYFanoutPackets>(m_next->extra);
+    if (srcPackets) {
+        //ほかのエンコードと共有しているので、参照を作って渡す
+        for (const auto& srcPkt : *srcPackets) {
+            AVPacket pkt;
+            av_init_packet(&pkt);
+            if (av_packet_ref(&pkt, &srcPkt) < 0) {
+                AddMessage(RGY_LOG_ERROR, _T("failed to ref packet.\n"));
+                break;
+            }
+            packets.push_back(pkt);
+        }
+    }
+    return packets;
+}
+
+vector<AVDemuxStream> RGYInputFanout::GetInputStreamInfo() {
+    return (m_source) ? m_source->GetInputStreamInfo() : vector<AVDemuxStream>();
+}
+#endif //#if ENABLE_AVSW_READER
+
+RGYFrameFanout::funcLoad RGYInputFanout::createLoader(std::shared_ptr<RGYInput> source) {
+    return [source](FrameInfo *frame, std::shared_ptr<void> *extra) {
+#if ENABLE_AVSW_READER
+        auto packets = std::shared_ptr<RGYFanoutPackets>(new RGYFanoutPackets(), [](RGYFanoutPackets *ptr) {
+            for (auto& pkt : *ptr) {
+                av_packet_unref(&pkt);
+            }
+            delete ptr;
+        });
+        //エンコードのループと同じく、フレームの読み込み前に音声・字幕パケットを取得する
+        vector_cat(*packets, source->GetStreamDataPackets(frame->inputFrameId));
+#else
+        UNREFERENCED_PARAMETER(extra);
+#endif //#if ENABLE_AVSW_READER
+        RGYFrame surface(*frame);
+        auto err = source->LoadNextFrame(&surface);
+        *frame = surface.getInfo();
+#if ENABLE_AVSW_READER
+        if (err == RGY_ERR_MORE_DATA) {
+            //映像の終端より後ろの音声・字幕パケットは終端を読み込んだ時点で取り出せるようになるので、
+            //ここで残りをすべて取得し、終端のフレームに付随させる
+            vector_cat(*packets, source->GetStreamDataPackets(frame->inputFrameId));
+        }
+        if (packets->size() > 0) {
+            *extra = packets;
+        }
+#endif //#if ENABLE_AVSW_READER
+        return err;
+    };
+}
@@ -0,0 +1,94 @@
+﻿// -----------------------------------------------------------------------------------------
+// QSVEnc/NVEnc/VCEEnc by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2020 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+#pragma once
+#ifndef __RGY_INPUT_FANOUT_H__
+#define __RGY_INPUT_FANOUT_H__
+
+#include "rgy_input.h"
+#include "rgy_frame_fanout.h"
+
+class RGYAudioEncodeCache;
+
+class RGYInputFanoutPrm : public RGYInputPrm {
+public:
+    std::shared_ptr<RGYFrameFanout> fanout;           //フレームを分配するRGYFrameFanout
+    int branch;                                       //fanoutの出力先の番号
+    std::shared_ptr<RGYInput> source;                 //フレームを読み込む元のリーダー
+    std::shared_ptr<RGYAudioEncodeCache> audioEncodeCache; //同じ入力を共有するエンコード間で音声エンコードを共有する
+
+    RGYInputFanoutPrm(RGYInputPrm base);
+    virtual ~RGYInputFanoutPrm() {};
+};
+
+//RGYFrameFanoutが分配するフレームを読み込むリーダー
+//同じ入力を複数のエンコードで共有する場合 (ABRラダー) に、各エンコードの入力として使用する
+//入力ファイルの読み込み・デコードは、共有する元のリーダー (source) で1回だけ行う
+class RGYInputFanout : public RGYInput {
+public:
+    RGYInputFanout();
+    virtual ~RGYInputFanout();
+
+    virtual RGY_ERR LoadNextFrame(RGYFrame *pSurface) override;
+    virtual void Close() override;
+    virtual rgy_rational<int> getInputTimebase() override;
+
+    //以降のフレームを受け取らないことを通知し、ほかのエンコードを止めないようにする
+    //Closeより前に、このエンコードの終了処理で待機が発生する場合に使用する
+    void closeBranch();
+
+#if ENABLE_AVSW_READER
+    //次に読み込むフレームに付随する音声・字幕パケットの参照を返す
+    virtual vector<AVPacket> GetStreamDataPackets(int inputFrame) override;
+    //元のリーダーのストリーム情報を返す
+    virtual vector<AVDemuxStream> GetInputStreamInfo() override;
+#endif //#if ENABLE_AVSW_READER
+
+    //フレームを読み込む元のリーダー
+    std::shared_ptr<RGYInput> source() const { return m_source; }
+    //同じ入力を共有するエンコード間で共有する音声エンコード
+    std::shared_ptr<RGYAudioEncodeCache> audioEncodeCache() const { return m_audioEncodeCache; }
+
+    //元のリーダーから1フレーム読み込むRGYFrameFanout用の関数を作成する
+    //音声・字幕パケットも元のリーダーから取得し、フレームに付随させる
+    static RGYFrameFanout::funcLoad createLoader(std::shared_ptr<RGYInput> source);
+protected:
+    //pInputInfoには元のリーダーの読み込み結果 (initReaders後のVideoInfo) を、prmにはRGYInputFanoutPrmを渡すこと
+    virtual RGY_ERR Init(const TCHAR *strFileName, VideoInfo *pInputInfo, const RGYInputPrm *prm) override;
+    //次のフレームを取得しておく
+    RGY_ERR popNext();
+
+    std::shared_ptr<RGYFrameFanout> m_fanout;
+    int m_branch;
+    std::shared_ptr<RGYInput> m_source;
+    std::shared_ptr<RGYAudioEncodeCache> m_audioEncodeCache;
+    std::shared_ptr<RGYFanoutFrame> m_next; //GetStreamDataPacketsで先に取得したフレーム
+    RGY_ERR m_nextErr;
+    bool m_eosPacketsSent; //終端に付随するパケットを渡したか
+};
+
+#endif //__RGY_INPUT_FANOUT_H__
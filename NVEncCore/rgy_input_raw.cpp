@@ -27,7 +27,12 @@
 
 #include <sstream>
 #include <fcntl.h>
+#if !(defined(_WIN32) || defined(_WIN64))
+#include <poll.h>
+#endif //#if !(defined(_WIN32) || defined(_WIN64))
 #include "rgy_input_raw.h"
+#include "rgy_mem_pool.h"
+#include "rgy_trace.h"
 
 #if ENABLE_RAW_READER
 
@@ -152,7 +157,18 @@ RGY_ERR RGYInputRaw::ParseY4MHeader(char *buf, VideoInfo *pInfo) {
 RGYInputRaw::RGYInputRaw() :
     m_fSource(NULL),
     m_nBufSize(0),
-    m_pBuffer() {
+    m_pBuffer(),
+    m_fileMap(),
+    m_mapPos(0),
+    m_thRead(),
+    m_threadAbort(false),
+#if !(defined(_WIN32) || defined(_WIN64))
+    m_abortPipe{ -1, -1 },
+#endif //#if !(defined(_WIN32) || defined(_WIN64))
+    m_readEof(false),
+    m_readAheadBuf(),
+    m_qReadFree(),
+    m_qReadFilled() {
     m_readerName = _T("raw");
 }
 
@@ -161,12 +177,42 @@ RGYInputRaw::~RGYInputRaw() {
 }
 
 void RGYInputRaw::Close() {
+    if (m_thRead.joinable()) {
+        m_threadAbort = true;
+        //パイプの読み込みで止まっている場合は、読み込みを中断させてから終了を待つ
+#if defined(_WIN32) || defined(_WIN64)
+        while (WaitForSingleObject(m_thRead.native_handle(), 16) == WAIT_TIMEOUT) {
+            CancelSynchronousIo(m_thRead.native_handle());
+        }
+#else
+        if (write(m_abortPipe[1], "", 1) < 0) {
+            AddMessage(RGY_LOG_WARN, _T("failed to wake read-ahead thread.\n"));
+        }
+#endif //#if defined(_WIN32) || defined(_WIN64)
+        m_thRead.join();
+    }
+#if !(defined(_WIN32) || defined(_WIN64))
+    for (auto& fd : m_abortPipe) {
+        if (fd >= 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+#endif //#if !(defined(_WIN32) || defined(_WIN64))
+    m_threadAbort = false;
+    m_readEof = false;
+    m_qReadFree.close();
+    m_qReadFilled.close();
+    m_readAheadBuf.clear();
+    m_fileMap.close();
+    m_mapPos = 0;
     if (m_fSource) {
         fclose(m_fSource);
         m_fSource = NULL;
     }
     m_pBuffer.reset();
     m_nBufSize = 0;
+    AddMessage(RGY_LOG_DEBUG, _T("%s.\n"), RGYMemPool::shared()->statsStr().c_str());
     RGYInput::Close();
 }
 
@@ -195,6 +241,14 @@ RGY_ERR RGYInputRaw::Init(const TCHAR *strFileName, VideoInfo *pInputInfo, const
             AddMessage(RGY_LOG_DEBUG, _T("Opened file: \"%s\".\n"), strFileName);
         }
     }
+    //通常のファイルなら、ファイル全体をメモリにマップしてバッファへのコピーを省略する
+    const bool mapped = !use_stdin && m_fileMap.open(m_fSource) == RGY_ERR_NONE;
+#if !(defined(_WIN32) || defined(_WIN64))
+    if (!mapped) {
+        //先読みスレッドはfdから直接読み込むので、ヘッダの読み込みからFILE側ではバッファリングしない
+        setvbuf(m_fSource, nullptr, _IONBF, 0);
+    }
+#endif //#if !(defined(_WIN32) || defined(_WIN64))
 
     auto nOutputCSP = m_inputVideoInfo.csp;
     m_inputCsp = RGY_CSP_YV12;
@@ -276,6 +330,7 @@ RGY_ERR RGYInputRaw::Init(const TCHAR *strFileName, VideoInfo *pInputInfo, const
         return RGY_ERR_INVALID_COLOR_FORMAT;
     }
     AddMessage(RGY_LOG_DEBUG, _T("%dx%d, pitch:%d, bufferSize:%d.\n"), m_inputVideoInfo.srcWidth, m_inputVideoInfo.srcHeight, m_inputVideoInfo.srcPitch, bufferSize);
+    m_nBufSize = bufferSize;
 
     if (nOutputCSP != RGY_CSP_NA) {
         m_inputVideoInfo.csp =
@@ -287,7 +342,7 @@ RGY_ERR RGYInputRaw::Init(const TCHAR *strFileName, VideoInfo *pInputInfo, const
         m_inputVideoInfo.csp = output_csp_if_lossless;
     }
 
-    m_pBuffer = std::shared_ptr<uint8_t>((uint8_t *)_aligned_malloc(bufferSize, 32), aligned_malloc_deleter());
+    m_pBuffer = RGYMemPool::shared()->alloc(bufferSize);
     if (!m_pBuffer) {
         AddMessage(RGY_LOG_ERROR, _T("Failed to allocate input buffer.\n"));
         return RGY_ERR_NULL_PTR;
@@ -301,22 +356,79 @@ RGY_ERR RGYInputRaw::Init(const TCHAR *strFileName, VideoInfo *pInputInfo, const
         return RGY_ERR_INVALID_COLOR_FORMAT;
     }
 
+    if (mapped) {
+        m_mapPos = (uint64_t)_ftelli64(m_fSource);
+        m_fileMap.prefetch(m_mapPos, (uint64_t)m_nBufSize * READ_AHEAD_BUF_COUNT);
+        AddMessage(RGY_LOG_DEBUG, _T("mapped input file: size %lld, data start %lld.\n"), (long long)m_fileMap.size(), (long long)m_mapPos);
+    } else {
+        //パイプなどは先読みスレッドで読み込みと変換をオーバーラップさせる
+        m_qReadFree.init(READ_AHEAD_BUF_COUNT);
+        m_qReadFilled.init(READ_AHEAD_BUF_COUNT + 1);
+        for (int i = 0; i < READ_AHEAD_BUF_COUNT; i++) {
+            auto buf = RGYMemPool::shared()->alloc(m_nBufSize);
+            if (!buf) {
+                AddMessage(RGY_LOG_ERROR, _T("Failed to allocate input buffer.\n"));
+                return RGY_ERR_NULL_PTR;
+            }
+            m_qReadFree.push(buf.get());
+            m_readAheadBuf.push_back(buf);
+        }
+#if !(defined(_WIN32) || defined(_WIN64))
+        if (pipe(m_abortPipe) < 0) {
+            AddMessage(RGY_LOG_ERROR, _T("Failed to create pipe for read-ahead thread.\n"));
+            return RGY_ERR_UNKNOWN;
+        }
+#endif //#if !(defined(_WIN32) || defined(_WIN64))
+        m_thRead = std::thread(&RGYInputRaw::ThreadFuncRead, this);
+        AddMessage(RGY_LOG_DEBUG, _T("started read-ahead thread (%d buffers).\n"), READ_AHEAD_BUF_COUNT);
+    }
+
     CreateInputInfo(m_readerName.c_str(), RGY_CSP_NAMES[m_convert->getFunc()->csp_from], RGY_CSP_NAMES[m_convert->getFunc()->csp_to], get_simd_str(m_convert->getFunc()->simd), &m_inputVideoInfo);
     AddMessage(RGY_LOG_DEBUG, m_inputInfo);
     *pInputInfo = m_inputVideoInfo;
     return RGY_ERR_NONE;
 }
 
-RGY_ERR RGYInputRaw::LoadNextFrame(RGYFrame *pSurface) {
-    //m_encSatusInfo->m_nInputFramesがtrimの結果必要なフレーム数を大きく超えたら、エンコードを打ち切る
-    //ちょうどのところで打ち切ると他のストリームに影響があるかもしれないので、余分に取得しておく
-    if (getVideoTrimMaxFramIdx() < (int)m_encSatusInfo->m_sData.frameIn - TRIM_OVERREAD_FRAMES) {
-        return RGY_ERR_MORE_DATA;
+size_t RGYInputRaw::ReadAbortable(void *buf, size_t size) {
+#if defined(_WIN32) || defined(_WIN64)
+    //ブロックしている場合は、Close()からCancelSynchronousIoで中断される
+    return _fread_nolock(buf, 1, size, m_fSource);
+#else
+    //FILEはバッファリングしていないので、fdから直接読み込み、
+    //データが来るのを待つ間はm_abortPipeも監視してClose()から中断できるようにする
+    const int fd = fileno(m_fSource);
+    size_t readBytes = 0;
+    while (readBytes < size && !m_threadAbort) {
+        pollfd fds[2] = { { fd, POLLIN, 0 }, { m_abortPipe[0], POLLIN, 0 } };
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (fds[1].revents) {
+            break;
+        }
+        const auto ret = read(fd, (uint8_t *)buf + readBytes, size - readBytes);
+        if (ret < 0) {
+            if (errno == EINTR || errno == EAGAIN) {
+                continue;
+            }
+            break;
+        }
+        if (ret == 0) { //EOF
+            break;
+        }
+        readBytes += (size_t)ret;
     }
+    return readBytes;
+#endif //#if defined(_WIN32) || defined(_WIN64)
+}
 
+RGY_ERR RGYInputRaw::ReadFrame(uint8_t *buf) {
     if (m_inputVideoInfo.type == RGY_INPUT_FMT_Y4M) {
         uint8_t y4m_buf[8] = { 0 };
-        if (_fread_nolock(y4m_buf, 1, strlen("FRAME"), m_fSource) != strlen("FRAME")) {
+        if (ReadAbortable(y4m_buf, strlen("FRAME")) != strlen("FRAME")) {
             AddMessage(RGY_LOG_DEBUG, _T("header1: finish.\n"));
             return RGY_ERR_MORE_DATA;
         }
@@ -324,58 +436,131 @@ RGY_ERR RGYInputRaw::LoadNextFrame(RGYFrame *pSurface) {
             AddMessage(RGY_LOG_DEBUG, _T("header2: finish.\n"));
             return RGY_ERR_MORE_DATA;
         }
-        int i;
-        for (i = 0; _fgetc_nolock(m_fSource) != '\n'; i++) {
-            if (i >= 64) {
+        for (int i = 0; ; i++) {
+            char c = 0;
+            if (i >= 64 || ReadAbortable(&c, 1) != 1) {
                 AddMessage(RGY_LOG_DEBUG, _T("header3: finish.\n"));
                 return RGY_ERR_MORE_DATA;
             }
+            if (c == '\n') {
+                break;
+            }
         }
     }
+    if (m_nBufSize != ReadAbortable(buf, m_nBufSize)) {
+        AddMessage(RGY_LOG_DEBUG, _T("fread: finish: %d.\n"), m_nBufSize);
+        return RGY_ERR_MORE_DATA;
+    }
+    return RGY_ERR_NONE;
+}
 
-    uint32_t frameSize = 0;
-    switch (m_convert->getFunc()->csp_from) {
-    case RGY_CSP_NV12:
-    case RGY_CSP_YV12:
-        frameSize = m_inputVideoInfo.srcWidth * m_inputVideoInfo.srcHeight * 3 / 2; break;
-    case RGY_CSP_P010:
-        frameSize = m_inputVideoInfo.srcWidth * m_inputVideoInfo.srcHeight * 3; break;
-    case RGY_CSP_YUV422:
-        frameSize = m_inputVideoInfo.srcWidth * m_inputVideoInfo.srcHeight * 2; break;
-    case RGY_CSP_YUV444:
-        frameSize = m_inputVideoInfo.srcWidth * m_inputVideoInfo.srcHeight * 3; break;
-    case RGY_CSP_YV12_09:
-    case RGY_CSP_YV12_10:
-    case RGY_CSP_YV12_12:
-    case RGY_CSP_YV12_14:
-    case RGY_CSP_YV12_16:
-        frameSize = m_inputVideoInfo.srcWidth * m_inputVideoInfo.srcHeight * 3; break;
-    case RGY_CSP_YUV422_09:
-    case RGY_CSP_YUV422_10:
-    case RGY_CSP_YUV422_12:
-    case RGY_CSP_YUV422_14:
-    case RGY_CSP_YUV422_16:
-        frameSize = m_inputVideoInfo.srcWidth * m_inputVideoInfo.srcHeight * 4; break;
-    case RGY_CSP_YUV444_09:
-    case RGY_CSP_YUV444_10:
-    case RGY_CSP_YUV444_12:
-    case RGY_CSP_YUV444_14:
-    case RGY_CSP_YUV444_16:
-        frameSize = m_inputVideoInfo.srcWidth * m_inputVideoInfo.srcHeight * 6; break;
-    default:
-        AddMessage(RGY_LOG_ERROR, _T("Unknown color foramt.\n"));
-        return RGY_ERR_INVALID_COLOR_FORMAT;
+RGY_ERR RGYInputRaw::GetFrameMapped(const uint8_t **ptr) {
+    const uint8_t *mapPtr = m_fileMap.ptr();
+    const uint64_t mapSize = m_fileMap.size();
+    uint64_t pos = m_mapPos;
+    if (m_inputVideoInfo.type == RGY_INPUT_FMT_Y4M) {
+        //FRAMEヘッダはマップ上でそのまま解析する
+        if (pos + strlen("FRAME") > mapSize
+            || memcmp(mapPtr + pos, "FRAME", strlen("FRAME")) != 0) {
+            AddMessage(RGY_LOG_DEBUG, _T("header: finish.\n"));
+            return RGY_ERR_MORE_DATA;
+        }
+        pos += strlen("FRAME");
+        for (int i = 0; ; i++, pos++) {
+            if (i > 64 || pos >= mapSize) {
+                AddMessage(RGY_LOG_DEBUG, _T("header: finish.\n"));
+                return RGY_ERR_MORE_DATA;
+            }
+            if (mapPtr[pos] == '\n') {
+                pos++;
+                break;
+            }
+        }
     }
-    if (frameSize != _fread_nolock(m_pBuffer.get(), 1, frameSize, m_fSource)) {
-        AddMessage(RGY_LOG_DEBUG, _T("fread: finish: %d.\n"), frameSize);
+    if (pos + m_nBufSize > mapSize) {
+        AddMessage(RGY_LOG_DEBUG, _T("map: finish: %d.\n"), m_nBufSize);
         return RGY_ERR_MORE_DATA;
     }
+    m_mapPos = pos + m_nBufSize;
+    //変換関数はSIMDのロード幅の分だけ末尾を超えて読むことがあるので、
+    //ファイル末尾付近のフレームはバッファにコピーしてから変換する
+    static const uint64_t OVERREAD_MARGIN = 256;
+    if (m_mapPos + OVERREAD_MARGIN > mapSize) {
+        memcpy(m_pBuffer.get(), mapPtr + pos, m_nBufSize);
+        *ptr = m_pBuffer.get();
+    } else {
+        *ptr = mapPtr + pos;
+    }
+    //次のフレームを先読みしておく
+    m_fileMap.prefetch(m_mapPos, m_nBufSize + 64);
+    return RGY_ERR_NONE;
+}
 
+void RGYInputRaw::ThreadFuncRead() {
+    uint8_t *buf = nullptr;
+    while (!m_threadAbort) {
+        if (!m_qReadFree.front_copy_and_pop_no_lock(&buf)) {
+            m_qReadFree.wait_for_push();
+            continue;
+        }
+        if (ReadFrame(buf) != RGY_ERR_NONE) {
+            break;
+        }
+        m_qReadFilled.push(buf);
+    }
+    //終端を通知する
+    m_qReadFilled.push(nullptr);
+}
+
+RGY_ERR RGYInputRaw::GetFrameReadAhead(uint8_t **ptr) {
+    if (m_readEof) {
+        return RGY_ERR_MORE_DATA;
+    }
+    while (!m_qReadFilled.front_copy_and_pop_no_lock(ptr)) {
+        m_qReadFilled.wait_for_push();
+    }
+    if (*ptr == nullptr) {
+        m_readEof = true;
+        return RGY_ERR_MORE_DATA;
+    }
+    return RGY_ERR_NONE;
+}
+
+RGY_ERR RGYInputRaw::LoadNextFrame(RGYFrame *pSurface) {
+    //m_encSatusInfo->m_nInputFramesがtrimの結果必要なフレーム数を大きく超えたら、エンコードを打ち切る
+    //ちょうどのところで打ち切ると他のストリームに影響があるかもしれないので、余分に取得しておく
+    if (getVideoTrimMaxFramIdx() < (int)m_encSatusInfo->m_sData.frameIn - TRIM_OVERREAD_FRAMES) {
+        return RGY_ERR_MORE_DATA;
+    }
+
+    if (m_fileMap.ptr()) {
+        const uint8_t *src = nullptr;
+        auto sts = GetFrameMapped(&src);
+        if (sts != RGY_ERR_NONE) {
+            return sts;
+        }
+        sts = ConvertFrame(pSurface, src);
+        //変換済みの領域はもう参照しない
+        m_fileMap.release(m_mapPos);
+        return sts;
+    }
+
+    uint8_t *buf = nullptr;
+    auto sts = GetFrameReadAhead(&buf);
+    if (sts != RGY_ERR_NONE) {
+        return sts;
+    }
+    sts = ConvertFrame(pSurface, buf);
+    m_qReadFree.push(buf);
+    return sts;
+}
+
+RGY_ERR RGYInputRaw::ConvertFrame(RGYFrame *pSurface, const uint8_t *src) {
     void *dst_array[3];
     pSurface->ptrArray(dst_array, m_convert->getFunc()->csp_to == RGY_CSP_RGB24 || m_convert->getFunc()->csp_to == RGY_CSP_RGB32);
 
     const void *src_array[3];
-    src_array[0] = m_pBuffer.get();
+    src_array[0] = src;
     src_array[1] = (uint8_t *)src_array[0] + m_inputVideoInfo.srcPitch * m_inputVideoInfo.srcHeight;
     switch (m_convert->getFunc()->csp_from) {
     case RGY_CSP_YV12:
@@ -423,9 +608,12 @@ RGY_ERR RGYInputRaw::LoadNextFrame(RGYFrame *pSurface) {
         src_uv_pitch >>= 1;
         break;
     }
-    m_convert->run((m_inputVideoInfo.picstruct & RGY_PICSTRUCT_INTERLACED) ? 1 : 0,
-        dst_array, src_array, m_inputVideoInfo.srcWidth, m_inputVideoInfo.srcPitch,
-        src_uv_pitch, pSurface->pitch(), m_inputVideoInfo.srcHeight, m_inputVideoInfo.srcHeight, m_inputVideoInfo.crop.c);
+    {
+        RGY_TRACE_SCOPE("convert_csp", m_encSatusInfo->m_sData.frameIn);
+        m_convert->run((m_inputVideoInfo.picstruct & RGY_PICSTRUCT_INTERLACED) ? 1 : 0,
+            dst_array, src_array, m_inputVideoInfo.srcWidth, m_inputVideoInfo.srcPitch,
+            src_uv_pitch, pSurface->pitch(), m_inputVideoInfo.srcHeight, m_inputVideoInfo.srcHeight, m_inputVideoInfo.crop.c);
+    }
 
     m_encSatusInfo->m_sData.frameIn++;
     return m_encSatusInfo->UpdateDisplay();
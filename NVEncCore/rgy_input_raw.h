@@ -29,7 +29,10 @@
 #ifndef __RGY_INPUT_RAW_H__
 #define __RGY_INPUT_RAW_H__
 
+#include <thread>
+#include <atomic>
 #include "rgy_input.h"
+#include "rgy_queue.h"
 
 #if ENABLE_RAW_READER
 
@@ -45,10 +48,37 @@ protected:
     virtual RGY_ERR Init(const TCHAR *strFileName, VideoInfo *pInputInfo, const RGYInputPrm *prm) override;
     RGY_ERR ParseY4MHeader(char *buf, VideoInfo *pInfo);
 
+    //1フレーム分(y4mならFRAMEヘッダも)を読み込む
+    RGY_ERR ReadFrame(uint8_t *buf);
+    //Close()から中断できるように読み込む (読み込めたバイト数を返す)
+    size_t ReadAbortable(void *buf, size_t size);
+    //メモリマップ上の次のフレームの先頭へのポインタを取得する
+    RGY_ERR GetFrameMapped(const uint8_t **ptr);
+    //先読みスレッドから次のフレームを受け取る
+    RGY_ERR GetFrameReadAhead(uint8_t **ptr);
+    //先読みスレッド (メモリマップが使えない場合)
+    void ThreadFuncRead();
+    RGY_ERR ConvertFrame(RGYFrame *pSurface, const uint8_t *src);
+
+    static const int READ_AHEAD_BUF_COUNT = 2;
+
     FILE *m_fSource;
 
-    uint32_t m_nBufSize;
+    uint32_t m_nBufSize; //1フレームのデータサイズ
     shared_ptr<uint8_t> m_pBuffer;
+
+    RGYFileMap m_fileMap; //通常のファイルの場合、ファイル全体をマップして直接変換する
+    uint64_t m_mapPos;    //メモリマップ上の次に読むべき位置
+
+    std::thread m_thRead;              //パイプ入力などで、読み込みと変換をオーバーラップさせる先読みスレッド
+    std::atomic<bool> m_threadAbort;
+#if !(defined(_WIN32) || defined(_WIN64))
+    int m_abortPipe[2];                //パイプの読み込み待ちで止まっている先読みスレッドを起こす
+#endif //#if !(defined(_WIN32) || defined(_WIN64))
+    bool m_readEof;
+    std::vector<std::shared_ptr<uint8_t>> m_readAheadBuf;
+    RGYQueueSPSP<uint8_t *> m_qReadFree;   //空いているバッファ
+    RGYQueueSPSP<uint8_t *> m_qReadFilled; //読み込み済みのバッファ (nullptrは終端)
 };
 
 #endif //ENABLE_RAW_READER
@@ -26,6 +26,7 @@
 // ------------------------------------------------------------------------------------------
 
 #include "rgy_input_sm.h"
+#include "rgy_trace.h"
 
 #if ENABLE_SM_READER
 
@@ -308,9 +309,12 @@ RGY_ERR RGYInputSM::LoadNextFrame(RGYFrame *pSurface) {
         src_uv_pitch >>= 1;
         break;
     }
-    m_convert->run((m_inputVideoInfo.picstruct & RGY_PICSTRUCT_INTERLACED) ? 1 : 0,
-        dst_array, src_array, m_inputVideoInfo.srcWidth, m_inputVideoInfo.srcPitch,
-        src_uv_pitch, pSurface->pitch(), m_inputVideoInfo.srcHeight, m_inputVideoInfo.srcHeight, m_inputVideoInfo.crop.c);
+    {
+        RGY_TRACE_SCOPE("convert_csp", m_encSatusInfo->m_sData.frameIn);
+        m_convert->run((m_inputVideoInfo.picstruct & RGY_PICSTRUCT_INTERLACED) ? 1 : 0,
+            dst_array, src_array, m_inputVideoInfo.srcWidth, m_inputVideoInfo.srcPitch,
+            src_uv_pitch, pSurface->pitch(), m_inputVideoInfo.srcHeight, m_inputVideoInfo.srcHeight, m_inputVideoInfo.crop.c);
+    }
 
     pSurface->setTimestamp(prmsm->timestamp[m_encSatusInfo->m_sData.frameIn & 1]);
     pSurface->setDuration(prmsm->duration[m_encSatusInfo->m_sData.frameIn & 1]);
@@ -31,21 +31,35 @@
 #include <sstream>
 #include <map>
 #include <fstream>
+#include <cmath>
+#include "rgy_mem_pool.h"
+#include "rgy_trace.h"
 
 RGYInputVpy::RGYInputVpy() :
-    m_pAsyncBuffer(),
-    m_hAsyncEventFrameSetFin(),
-    m_hAsyncEventFrameSetStart(),
+    m_asyncMtx(),
+    m_asyncCond(),
+    m_asyncFrames(),
+    m_asyncFreeBuf(),
+    m_asyncBufInfo(),
+    m_asyncBufSize(0),
+    m_convertInCallback(false),
     m_bAbortAsync(false),
-    m_nCopyOfInputFrames(0),
+    m_nAsyncInflight(0),
+    m_asyncLatencyMs(0.0),
+    m_asyncErrMes(),
+    m_asyncDepth(1),
+    m_asyncDepthMin(1),
+    m_asyncDepthMax(1),
+    m_asyncDepthPeak(0),
+    m_asyncShrinkCount(0),
+    m_asyncStalls(0),
+    m_asyncIntervalMs(0.0),
+    m_asyncLastReturn(),
     m_sVSapi(nullptr),
     m_sVSscript(nullptr),
     m_sVSnode(nullptr),
     m_nAsyncFrames(0),
     m_sVS() {
-    memset(m_pAsyncBuffer, 0, sizeof(m_pAsyncBuffer));
-    memset(m_hAsyncEventFrameSetFin,   0, sizeof(m_hAsyncEventFrameSetFin));
-    memset(m_hAsyncEventFrameSetStart, 0, sizeof(m_hAsyncEventFrameSetStart));
     memset(&m_sVS, 0, sizeof(m_sVS));
     m_readerName = _T("vpy");
 }
@@ -102,48 +116,157 @@ int RGYInputVpy::load_vapoursynth() {
     return 0;
 }
 
-int RGYInputVpy::initAsyncEvents() {
-    for (int i = 0; i < _countof(m_hAsyncEventFrameSetFin); i++) {
-        if (   NULL == (m_hAsyncEventFrameSetFin[i]   = CreateEvent(NULL, FALSE, FALSE, NULL))
-            || NULL == (m_hAsyncEventFrameSetStart[i] = CreateEvent(NULL, FALSE, TRUE,  NULL)))
-            return 1;
+void __stdcall frameDoneCallback(void *userData, const VSFrameRef *f, int n, VSNodeRef *, const char *errorMsg) {
+    reinterpret_cast<RGYInputVpy*>(userData)->setFrameToAsyncBuffer(n, f, errorMsg);
+}
+
+void RGYInputVpy::initAsyncFrames(int vsThreads) {
+    //変換後のフレームの配置 (NVEncCoreの入力バッファと同じ配置とする)
+    m_asyncBufInfo = FrameInfo();
+    m_asyncBufInfo.csp = m_convert->getFunc()->csp_to;
+    m_asyncBufInfo.width = m_inputVideoInfo.srcWidth - m_inputVideoInfo.crop.e.left - m_inputVideoInfo.crop.e.right;
+    m_asyncBufInfo.height = m_inputVideoInfo.srcHeight - m_inputVideoInfo.crop.e.bottom - m_inputVideoInfo.crop.e.up;
+    m_asyncBufInfo.picstruct = m_inputVideoInfo.picstruct;
+    const auto exinfo = getFrameInfoExtra(&m_asyncBufInfo);
+    m_asyncBufInfo.pitch = ALIGN(exinfo.width_byte, 64 * (RGY_CSP_BIT_DEPTH[m_asyncBufInfo.csp] > 8 ? 2 : 1));
+    m_asyncBufSize = (size_t)m_asyncBufInfo.pitch * exinfo.height_total;
+    //配置の分からない色空間では、従来どおり読み込みスレッドで変換する
+    m_convertInCallback = m_asyncBufSize > 0;
+
+    if (m_inputVideoInfo.type != RGY_INPUT_FMT_VPY_MT) {
+        m_asyncDepthMin = 1;
+        m_asyncDepthMax = 1;
+        m_asyncDepth = 1;
+    } else {
+        //VapourSynthのスレッド数の2倍までとし、変換後のフレームの総量も制限する
+        int depthMax = (std::min)(ASYNC_BUFFER_SIZE-1, (std::max)(vsThreads * 2, 2));
+        if (m_convertInCallback) {
+            depthMax = (std::min)(depthMax, (int)(std::max<size_t>)(ASYNC_BUFFER_MAX_BYTES / m_asyncBufSize, 2));
+        }
+        m_asyncDepthMax = depthMax;
+        m_asyncDepthMin = (std::min)(2, depthMax);
+        m_asyncDepth = clamp(vsThreads, m_asyncDepthMin, m_asyncDepthMax);
     }
-    return 0;
+    m_asyncDepthPeak = m_asyncDepth;
+    m_asyncShrinkCount = 0;
+    m_asyncStalls = 0;
+    m_asyncIntervalMs = 0.0;
+    m_asyncLatencyMs = 0.0;
+    m_asyncLastReturn = std::chrono::high_resolution_clock::now();
+    m_nAsyncInflight = 0;
+    m_nAsyncFrames = 0;
 }
 
-void RGYInputVpy::closeAsyncEvents() {
-    m_bAbortAsync = true;
-    for (int i_frame = m_nCopyOfInputFrames; i_frame < m_nAsyncFrames; i_frame++) {
-        const VSFrameRef *src_frame = getFrameFromAsyncBuffer(i_frame);
-        m_sVSapi->freeFrame(src_frame);
-    }
-    for (int i = 0; i < _countof(m_hAsyncEventFrameSetFin); i++) {
-        if (m_hAsyncEventFrameSetFin[i])
-            CloseEvent(m_hAsyncEventFrameSetFin[i]);
-        if (m_hAsyncEventFrameSetStart[i])
-            CloseEvent(m_hAsyncEventFrameSetStart[i]);
-    }
-    memset(m_hAsyncEventFrameSetFin,   0, sizeof(m_hAsyncEventFrameSetFin));
-    memset(m_hAsyncEventFrameSetStart, 0, sizeof(m_hAsyncEventFrameSetStart));
-    m_bAbortAsync = false;
+void RGYInputVpy::requestAsyncFrames() {
+    //trimで不要となる範囲のフレームは要求しない (LoadNextFrameはTRIM_OVERREAD_FRAMES分余分に読む)
+    int maxFrames = m_inputVideoInfo.frames;
+    const int trimMax = getVideoTrimMaxFramIdx();
+    if (trimMax < INT_MAX - TRIM_OVERREAD_FRAMES - 1) {
+        maxFrames = (std::min)(maxFrames, trimMax + TRIM_OVERREAD_FRAMES + 1);
+    }
+    const int target = (std::min)(maxFrames, (int)m_encSatusInfo->m_sData.frameIn + m_asyncDepth);
+    while (m_nAsyncFrames < target) {
+        const int n = m_nAsyncFrames++;
+        auto& slot = m_asyncFrames[n & (ASYNC_BUFFER_SIZE-1)];
+        slot.done = false;
+        slot.error = false;
+        slot.frame = nullptr;
+        if (m_convertInCallback) {
+            if (m_asyncFreeBuf.size() > 0) {
+                slot.buf = std::move(m_asyncFreeBuf.back());
+                m_asyncFreeBuf.pop_back();
+            } else {
+                //確保できなかった場合は、そのフレームのみ読み込みスレッドで変換する
+                slot.buf = RGYMemPool::shared()->alloc(m_asyncBufSize);
+            }
+        }
+        slot.requested = std::chrono::high_resolution_clock::now();
+        {
+            std::lock_guard<std::mutex> lock(m_asyncMtx);
+            m_nAsyncInflight++;
+        }
+        m_sVSapi->getFrameAsync(n, m_sVSnode, frameDoneCallback, this);
+    }
 }
 
-#pragma warning(push)
-#pragma warning(disable:4100)
-void __stdcall frameDoneCallback(void *userData, const VSFrameRef *f, int n, VSNodeRef *, const char *errorMsg) {
-    reinterpret_cast<RGYInputVpy*>(userData)->setFrameToAsyncBuffer(n, f);
+void RGYInputVpy::convertFrame(int n, void **dst, const VSFrameRef *f, int dstPitch) {
+    RGY_TRACE_SCOPE("convert_csp", n);
+    const void *src_array[3] = { m_sVSapi->getReadPtr(f, 0), m_sVSapi->getReadPtr(f, 1), m_sVSapi->getReadPtr(f, 2) };
+    m_convert->run((m_inputVideoInfo.picstruct & RGY_PICSTRUCT_INTERLACED) ? 1 : 0,
+        dst, src_array,
+        m_inputVideoInfo.srcWidth, m_sVSapi->getStride(f, 0), m_sVSapi->getStride(f, 1),
+        dstPitch, m_inputVideoInfo.srcHeight, m_inputVideoInfo.srcHeight, m_inputVideoInfo.crop.c);
 }
-#pragma warning(pop)
 
-void RGYInputVpy::setFrameToAsyncBuffer(int n, const VSFrameRef* f) {
-    WaitForSingleObject(m_hAsyncEventFrameSetStart[n & (ASYNC_BUFFER_SIZE-1)], INFINITE);
-    m_pAsyncBuffer[n & (ASYNC_BUFFER_SIZE-1)] = f;
-    SetEvent(m_hAsyncEventFrameSetFin[n & (ASYNC_BUFFER_SIZE-1)]);
+void RGYInputVpy::setFrameToAsyncBuffer(int n, const VSFrameRef *f, const char *errorMsg) {
+    auto& slot = m_asyncFrames[n & (ASYNC_BUFFER_SIZE-1)];
+    bool converted = false;
+    if (f && m_bAbortAsync) {
+        m_sVSapi->freeFrame(f);
+        f = nullptr;
+    } else if (f && slot.buf) {
+        //色変換もVapourSynthのスレッドで並列に行い、読み込みスレッドではコピーのみとする
+        FrameInfo bufInfo = m_asyncBufInfo;
+        bufInfo.ptr = slot.buf.get();
+        void *dst_array[3];
+        RGYFrame(bufInfo).ptrArray(dst_array, bufInfo.csp == RGY_CSP_RGB24 || bufInfo.csp == RGY_CSP_RGB32);
+        convertFrame(n, dst_array, f, bufInfo.pitch);
+        m_sVSapi->freeFrame(f);
+        f = nullptr;
+        converted = true;
+    }
+    const double latencyMs = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - slot.requested).count();
+
+    std::lock_guard<std::mutex> lock(m_asyncMtx);
+    slot.frame = f;
+    slot.error = !converted && f == nullptr;
+    slot.done = true;
+    m_asyncLatencyMs = (m_asyncLatencyMs > 0.0) ? m_asyncLatencyMs * 0.9 + latencyMs * 0.1 : latencyMs;
+    if (errorMsg && m_asyncErrMes.length() == 0) {
+        m_asyncErrMes = char_to_tstring(errorMsg);
+    }
+    m_nAsyncInflight--;
+    //通知後にCloseで破棄される可能性があるので、ロックを保持したまま通知する
+    m_asyncCond.notify_all();
+}
 
-    if (m_nAsyncFrames < m_inputVideoInfo.frames && !m_bAbortAsync) {
-        m_sVSapi->getFrameAsync(m_nAsyncFrames, m_sVSnode, frameDoneCallback, this);
-        m_nAsyncFrames++;
+void RGYInputVpy::updateAsyncDepth(bool stalled, int ready, double latencyMs) {
+    if (m_asyncDepthMin >= m_asyncDepthMax) {
+        return;
     }
+    if (stalled) {
+        //スクリプトの処理が追いついていないので、要求数を増やしてVapourSynthのスレッドを埋める
+        m_asyncDepth = (std::min)(m_asyncDepth + 1, m_asyncDepthMax);
+        m_asyncShrinkCount = 0;
+    } else if (ready * 2 >= m_asyncDepth) {
+        //エンコーダ側が追いついておらず、完了したフレームが溜まっている
+        //スクリプトの処理時間と消費の間隔から必要な要求数を見積もり、それより多い状態が続けば1つずつ減らす
+        const int required = (m_asyncIntervalMs > 0.0) ? (int)std::ceil(latencyMs / m_asyncIntervalMs) + 1 : m_asyncDepth;
+        if (required < m_asyncDepth && ++m_asyncShrinkCount >= m_asyncDepth) {
+            m_asyncDepth = (std::max)(m_asyncDepth - 1, m_asyncDepthMin);
+            m_asyncShrinkCount = 0;
+        }
+    } else {
+        m_asyncShrinkCount = 0;
+    }
+    m_asyncDepthPeak = (std::max)(m_asyncDepthPeak, m_asyncDepth);
+}
+
+void RGYInputVpy::closeAsyncFrames() {
+    m_bAbortAsync = true;
+    {
+        std::unique_lock<std::mutex> lock(m_asyncMtx);
+        m_asyncCond.wait(lock, [this]() { return m_nAsyncInflight == 0; });
+    }
+    for (auto& slot : m_asyncFrames) {
+        if (slot.frame) {
+            m_sVSapi->freeFrame(slot.frame);
+        }
+        slot = AsyncFrame();
+    }
+    m_asyncFreeBuf.clear();
+    m_asyncErrMes.clear();
+    m_bAbortAsync = false;
 }
 
 int RGYInputVpy::getRevInfo(const char *vsVersionString) {
@@ -191,9 +314,6 @@ RGY_ERR RGYInputVpy::Init(const TCHAR *strFileName, VideoInfo *pInputInfo, const
     if (!m_sVS.init()) {
         AddMessage(RGY_LOG_ERROR, _T("VapourSynth Initialize Error.\n"));
         return RGY_ERR_NULL_PTR;
-    } else if (initAsyncEvents()) {
-        AddMessage(RGY_LOG_ERROR, _T("Failed to initialize async events.\n"));
-        return RGY_ERR_NULL_PTR;
     } else if ((m_sVSapi = m_sVS.getVSApi()) == nullptr) {
         AddMessage(RGY_LOG_ERROR, _T("Failed to get VapourSynth APIs.\n"));
         return RGY_ERR_NULL_PTR;
@@ -309,16 +429,10 @@ RGY_ERR RGYInputVpy::Init(const TCHAR *strFileName, VideoInfo *pInputInfo, const
     m_inputVideoInfo.shift = ((m_inputVideoInfo.csp == RGY_CSP_P010 || m_inputVideoInfo.csp == RGY_CSP_P210) && m_inputVideoInfo.shift) ? m_inputVideoInfo.shift : 0;
     m_inputVideoInfo.frames = vsvideoinfo->numFrames;
 
-    m_nAsyncFrames = vsvideoinfo->numFrames;
-    m_nAsyncFrames = (std::min)(m_nAsyncFrames, vscoreinfo->numThreads);
-    m_nAsyncFrames = (std::min)(m_nAsyncFrames, ASYNC_BUFFER_SIZE-1);
-    if (m_inputVideoInfo.type != RGY_INPUT_FMT_VPY_MT) {
-        m_nAsyncFrames = 1;
-    }
-
-    for (int i = 0; i < m_nAsyncFrames; i++) {
-        m_sVSapi->getFrameAsync(i, m_sVSnode, frameDoneCallback, this);
-    }
+    initAsyncFrames(vscoreinfo->numThreads);
+    AddMessage(RGY_LOG_DEBUG, _T("async depth %d (%d - %d), convert in %s.\n"),
+        m_asyncDepth, m_asyncDepthMin, m_asyncDepthMax, (m_convertInCallback) ? _T("callback") : _T("reader"));
+    requestAsyncFrames();
 
     tstring vs_ver = _T("VapourSynth");
     if (m_inputVideoInfo.type == RGY_INPUT_FMT_VPY_MT) {
@@ -338,7 +452,11 @@ RGY_ERR RGYInputVpy::Init(const TCHAR *strFileName, VideoInfo *pInputInfo, const
 
 void RGYInputVpy::Close() {
     AddMessage(RGY_LOG_DEBUG, _T("Closing...\n"));
-    closeAsyncEvents();
+    if (m_nAsyncFrames > 0) {
+        AddMessage(RGY_LOG_DEBUG, _T("async depth %d (peak %d), waited for %d/%d frames, script latency %.1f ms.\n"),
+            m_asyncDepth, m_asyncDepthPeak, m_asyncStalls, m_nAsyncFrames, m_asyncLatencyMs);
+    }
+    closeAsyncFrames();
     if (m_sVSapi && m_sVSnode)
         m_sVSapi->freeNode(m_sVSnode);
     if (m_sVSscript)
@@ -348,9 +466,6 @@ void RGYInputVpy::Close() {
 
     release_vapoursynth();
 
-    m_bAbortAsync = false;
-    m_nCopyOfInputFrames = 0;
-
     m_sVSapi = nullptr;
     m_sVSscript = nullptr;
     m_sVSnode = nullptr;
@@ -367,23 +482,73 @@ RGY_ERR RGYInputVpy::LoadNextFrame(RGYFrame *pSurface) {
         return RGY_ERR_MORE_DATA;
     }
 
-    const VSFrameRef *src_frame = getFrameFromAsyncBuffer(m_encSatusInfo->m_sData.frameIn);
-    if (src_frame == nullptr) {
-        return RGY_ERR_MORE_DATA;
+    const int n = (int)m_encSatusInfo->m_sData.frameIn;
+    const auto tmStart = std::chrono::high_resolution_clock::now();
+    if (n > 0) {
+        //エンコーダ側がフレームを要求する間隔 (前回返してから今回呼ばれるまで)
+        const double intervalMs = std::chrono::duration<double, std::milli>(tmStart - m_asyncLastReturn).count();
+        m_asyncIntervalMs = (m_asyncIntervalMs > 0.0) ? m_asyncIntervalMs * 0.9 + intervalMs * 0.1 : intervalMs;
+    }
+    //要求を始めたばかりで完了していないのは当然なので、要求数の調整には使わない
+    const bool warmup = n < m_asyncDepth;
+
+    auto& slot = m_asyncFrames[n & (ASYNC_BUFFER_SIZE-1)];
+    bool stalled = false;
+    int ready = 0;
+    double latencyMs = 0.0;
+    tstring errMes;
+    {
+        std::unique_lock<std::mutex> lock(m_asyncMtx);
+        if (!slot.done) {
+            RGY_TRACE_SCOPE("vpy_wait", n);
+            stalled = true;
+            m_asyncCond.wait(lock, [&slot]() { return slot.done; });
+        }
+        ready = m_nAsyncFrames - n - 1 - m_nAsyncInflight;
+        latencyMs = m_asyncLatencyMs;
+        if (slot.error) {
+            errMes = m_asyncErrMes;
+        }
+    }
+    if (stalled) {
+        m_asyncStalls++;
+    }
+    if (slot.error) {
+        AddMessage(RGY_LOG_ERROR, _T("Failed to get frame %d from VapourSynth: %s\n"), n, errMes.c_str());
+        return RGY_ERR_UNKNOWN;
     }
 
-    void *dst_array[3];
-    pSurface->ptrArray(dst_array, m_convert->getFunc()->csp_to == RGY_CSP_RGB24 || m_convert->getFunc()->csp_to == RGY_CSP_RGB32);
-    const void *src_array[3] = { m_sVSapi->getReadPtr(src_frame, 0), m_sVSapi->getReadPtr(src_frame, 1), m_sVSapi->getReadPtr(src_frame, 2) };
-    m_convert->run((m_inputVideoInfo.picstruct & RGY_PICSTRUCT_INTERLACED) ? 1 : 0,
-        dst_array, src_array,
-        m_inputVideoInfo.srcWidth, m_sVSapi->getStride(src_frame, 0), m_sVSapi->getStride(src_frame, 1),
-        pSurface->pitch(), m_inputVideoInfo.srcHeight, m_inputVideoInfo.srcHeight, m_inputVideoInfo.crop.c);
-
-    m_sVSapi->freeFrame(src_frame);
+    if (slot.buf) {
+        //コールバックで変換済みのフレームをコピーする
+        if ((int)pSurface->width() != m_asyncBufInfo.width || (int)pSurface->height() != m_asyncBufInfo.height) {
+            AddMessage(RGY_LOG_ERROR, _T("Frame size mismatch: %dx%d, expected %dx%d.\n"),
+                pSurface->width(), pSurface->height(), m_asyncBufInfo.width, m_asyncBufInfo.height);
+            return RGY_ERR_INCOMPATIBLE_VIDEO_PARAM;
+        }
+        const auto exinfo = getFrameInfoExtra(&m_asyncBufInfo);
+        const uint8_t *src = slot.buf.get();
+        uint8_t *dst = pSurface->ptrY();
+        const int dstPitch = (int)pSurface->pitch();
+        if (dstPitch == m_asyncBufInfo.pitch) {
+            memcpy(dst, src, m_asyncBufSize);
+        } else {
+            for (int y = 0; y < exinfo.height_total; y++) {
+                memcpy(dst + (size_t)y * dstPitch, src + (size_t)y * m_asyncBufInfo.pitch, exinfo.width_byte);
+            }
+        }
+        m_asyncFreeBuf.push_back(std::move(slot.buf));
+    } else {
+        void *dst_array[3];
+        pSurface->ptrArray(dst_array, m_convert->getFunc()->csp_to == RGY_CSP_RGB24 || m_convert->getFunc()->csp_to == RGY_CSP_RGB32);
+        convertFrame(n, dst_array, slot.frame, pSurface->pitch());
+        m_sVSapi->freeFrame(slot.frame);
+        slot.frame = nullptr;
+    }
 
     m_encSatusInfo->m_sData.frameIn++;
-    m_nCopyOfInputFrames = m_encSatusInfo->m_sData.frameIn;
+    updateAsyncDepth(stalled && !warmup, ready, latencyMs);
+    requestAsyncFrames();
+    m_asyncLastReturn = std::chrono::high_resolution_clock::now();
 
     return m_encSatusInfo->UpdateDisplay();
 }
@@ -31,6 +31,10 @@
 
 #include "rgy_version.h"
 #if ENABLE_VAPOURSYNTH_READER
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include "rgy_osdep.h"
 #include "rgy_input.h"
 #include "VapourSynth.h"
@@ -38,6 +42,8 @@
 
 const int ASYNC_BUFFER_2N = 7;
 const int ASYNC_BUFFER_SIZE = 1<<ASYNC_BUFFER_2N;
+//先読みで保持する変換後のフレームの総量の上限 (byte)
+const size_t ASYNC_BUFFER_MAX_BYTES = (size_t)1024 * 1024 * 1024;
 
 #if _M_IX86
 #define VPY_X64 0
@@ -79,33 +85,63 @@ public:
     virtual RGY_ERR LoadNextFrame(RGYFrame *pSurface) override;
     virtual void Close() override;
 
-    void setFrameToAsyncBuffer(int n, const VSFrameRef* f);
+    //getFrameAsyncのコールバック (VapourSynthのスレッドから呼ばれる)
+    void setFrameToAsyncBuffer(int n, const VSFrameRef *f, const char *errorMsg);
 protected:
+    //getFrameAsyncで要求したフレーム (m_asyncFrames[n & (ASYNC_BUFFER_SIZE-1)])
+    //doneがtrueになるまではコールバック側のみ、trueになった後は読み込みスレッドのみが触る
+    struct AsyncFrame {
+        bool done;                     //コールバックが完了したか (m_asyncMtxで保護)
+        bool error;                    //フレームの取得に失敗したか
+        const VSFrameRef *frame;       //コールバックで変換しなかった場合のフレーム
+        std::shared_ptr<uint8_t> buf;  //コールバックで変換したフレーム (m_asyncBufInfoの配置)
+        std::chrono::high_resolution_clock::time_point requested; //要求した時刻
+
+        AsyncFrame() : done(false), error(false), frame(nullptr), buf(), requested() {};
+    };
+
     virtual RGY_ERR Init(const TCHAR *strFileName, VideoInfo *pInputInfo, const RGYInputPrm *prm) override;
 
     void release_vapoursynth();
     int load_vapoursynth();
-    int initAsyncEvents();
-    void closeAsyncEvents();
-    const VSFrameRef* getFrameFromAsyncBuffer(int n) {
-        WaitForSingleObject(m_hAsyncEventFrameSetFin[n & (ASYNC_BUFFER_SIZE-1)], INFINITE);
-        const VSFrameRef *frame = m_pAsyncBuffer[n & (ASYNC_BUFFER_SIZE-1)];
-        SetEvent(m_hAsyncEventFrameSetStart[n & (ASYNC_BUFFER_SIZE-1)]);
-        return frame;
-    }
-    const VSFrameRef* m_pAsyncBuffer[ASYNC_BUFFER_SIZE];
-    HANDLE m_hAsyncEventFrameSetFin[ASYNC_BUFFER_SIZE];
-    HANDLE m_hAsyncEventFrameSetStart[ASYNC_BUFFER_SIZE];
+    //先読みの設定 (要求数の範囲、変換後のフレームの配置) を決める
+    void initAsyncFrames(int vsThreads);
+    //要求数の目標まで、getFrameAsyncでフレームを要求する
+    void requestAsyncFrames();
+    //スクリプトの処理時間とエンコーダ側の消費の状況から要求数の目標を調整する
+    void updateAsyncDepth(bool stalled, int ready, double latencyMs);
+    //要求済みのフレームの完了を待ってすべて解放する
+    void closeAsyncFrames();
+    void convertFrame(int n, void **dst, const VSFrameRef *f, int dstPitch);
 
     int getRevInfo(const char *vs_version_string);
 
-    bool m_bAbortAsync;
-    uint32_t m_nCopyOfInputFrames;
+    std::mutex m_asyncMtx;
+    std::condition_variable m_asyncCond;      //フレームの完了を通知する
+    AsyncFrame m_asyncFrames[ASYNC_BUFFER_SIZE];
+    std::vector<std::shared_ptr<uint8_t>> m_asyncFreeBuf; //再利用する変換後のフレームのバッファ
+    FrameInfo m_asyncBufInfo;                 //変換後のフレームの配置 (ptrは使用しない)
+    size_t m_asyncBufSize;
+    bool m_convertInCallback;                 //コールバックで色変換を行うか
+    std::atomic<bool> m_bAbortAsync;
+    int m_nAsyncInflight;                     //コールバック待ちのフレーム数 (m_asyncMtxで保護)
+    double m_asyncLatencyMs;                  //要求からコールバックまでの時間の平均 (m_asyncMtxで保護)
+    tstring m_asyncErrMes;                    //スクリプトのエラー (m_asyncMtxで保護)
+
+    //以下は読み込みスレッドのみが触る
+    int m_asyncDepth;                         //要求数 (要求済みで読み込みスレッドに渡していないフレーム数) の目標
+    int m_asyncDepthMin;
+    int m_asyncDepthMax;
+    int m_asyncDepthPeak;
+    int m_asyncShrinkCount;                   //要求数を減らせる状態が続いたフレーム数
+    int m_asyncStalls;                        //フレームの完了を待った回数
+    double m_asyncIntervalMs;                 //読み込みスレッドがフレームを要求する間隔の平均 (待ち時間を除く)
+    std::chrono::high_resolution_clock::time_point m_asyncLastReturn;
 
     const VSAPI *m_sVSapi;
     VSScript *m_sVSscript;
     VSNodeRef *m_sVSnode;
-    int m_nAsyncFrames;
+    int m_nAsyncFrames;                       //要求済みのフレーム数
 
     vsscript_t m_sVS;
 };
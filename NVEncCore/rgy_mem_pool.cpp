@@ -0,0 +1,209 @@
+﻿// -----------------------------------------------------------------------------------------
+// QSVEnc/NVEnc/VCEEnc by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2020 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+#include <algorithm>
+#include "rgy_mem_pool.h"
+#include "rgy_util.h"
+#if !(defined(_WIN32) || defined(_WIN64))
+#include <sys/mman.h>
+#endif
+
+static const size_t SMALL_PAGE_SIZE = 4096;
+
+RGYMemPool::RGYMemPool() :
+    m_mtx(),
+    m_free(),
+    m_stats(),
+    m_maxCached((size_t)2048 * 1024 * 1024),
+    m_hugetlbAvailable(true) {
+    memset(&m_stats, 0, sizeof(m_stats));
+#if defined(_WIN32) || defined(_WIN64)
+    m_hugetlbAvailable = GetLargePageMinimum() == HUGE_PAGE_SIZE;
+#endif
+}
+
+RGYMemPool::~RGYMemPool() {
+    trim();
+}
+
+std::shared_ptr<RGYMemPool> RGYMemPool::shared() {
+    //バッファが解放されるまでプールを残すため、各バッファからも参照を保持する
+    static std::shared_ptr<RGYMemPool> pool(new RGYMemPool());
+    return pool;
+}
+
+size_t RGYMemPool::sizeClass(size_t size) {
+    if (size >= HUGE_PAGE_SIZE / 2) {
+        //大きなバッファはhuge page単位
+        return ALIGN(size, HUGE_PAGE_SIZE);
+    }
+    //小さなバッファは2の累乗 (最小でページサイズ)
+    size_t sc = SMALL_PAGE_SIZE;
+    while (sc < size) {
+        sc <<= 1;
+    }
+    return sc;
+}
+
+RGYMemPool::Block RGYMemPool::sysAlloc(size_t size) {
+    Block block = { nullptr, false };
+    const bool tryHuge = size >= HUGE_PAGE_SIZE && m_hugetlbAvailable;
+#if defined(_WIN32) || defined(_WIN64)
+    if (tryHuge) {
+        //SeLockMemoryPrivilegeがない場合は失敗するので、以降は試行しない
+        block.ptr = VirtualAlloc(nullptr, size, MEM_COMMIT | MEM_RESERVE | MEM_LARGE_PAGES, PAGE_READWRITE);
+        if (block.ptr) {
+            block.huge = true;
+            return block;
+        }
+        m_hugetlbAvailable = false;
+    }
+    block.ptr = VirtualAlloc(nullptr, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+#else
+    if (tryHuge) {
+        //予約済みのhuge pageがない場合は失敗するので、以降は試行しない
+        void *ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (ptr != MAP_FAILED) {
+            block.ptr = ptr;
+            block.huge = true;
+            return block;
+        }
+        m_hugetlbAvailable = false;
+    }
+    if (size >= HUGE_PAGE_SIZE) {
+        //THPが適用されるよう、2MB境界に揃えて確保する
+        const size_t mapSize = size + HUGE_PAGE_SIZE;
+        uint8_t *ptr = (uint8_t *)mmap(nullptr, mapSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ptr == (uint8_t *)MAP_FAILED) {
+            return block;
+        }
+        uint8_t *aligned = (uint8_t *)ALIGN((size_t)ptr, HUGE_PAGE_SIZE);
+        if (aligned > ptr) {
+            munmap(ptr, aligned - ptr);
+        }
+        if (ptr + mapSize > aligned + size) {
+            munmap(aligned + size, (ptr + mapSize) - (aligned + size));
+        }
+#if defined(MADV_HUGEPAGE)
+        madvise(aligned, size, MADV_HUGEPAGE);
+#endif
+        block.ptr = aligned;
+    } else {
+        void *ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        block.ptr = (ptr != MAP_FAILED) ? ptr : nullptr;
+    }
+#endif
+    return block;
+}
+
+void RGYMemPool::sysFree(const Block& block, size_t size) {
+#if defined(_WIN32) || defined(_WIN64)
+    UNREFERENCED_PARAMETER(size);
+    VirtualFree(block.ptr, 0, MEM_RELEASE);
+#else
+    munmap(block.ptr, size);
+#endif
+}
+
+std::shared_ptr<uint8_t> RGYMemPool::alloc(size_t size) {
+    const size_t sc = sizeClass(std::max<size_t>(size, 1));
+    Block block = { nullptr, false };
+    {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        auto it = m_free.find(sc);
+        if (it != m_free.end() && it->second.size() > 0) {
+            block = it->second.back();
+            it->second.pop_back();
+            m_stats.cached -= sc;
+            m_stats.hit++;
+        }
+    }
+    if (block.ptr == nullptr) {
+        //mmap/VirtualAllocは数百us以上かかることがあるので、ロックの外で行い他のスレッドの再利用を妨げない
+        block = sysAlloc(sc);
+        if (block.ptr == nullptr) {
+            return std::shared_ptr<uint8_t>();
+        }
+        std::lock_guard<std::mutex> lock(m_mtx);
+        m_stats.allocated += sc;
+        m_stats.miss++;
+        if (block.huge) {
+            m_stats.hugeAlloc++;
+        }
+    }
+    auto pool = shared_from_this();
+    return std::shared_ptr<uint8_t>((uint8_t *)block.ptr, [pool, block, sc](uint8_t *) {
+        pool->release(block, sc);
+    });
+}
+
+void RGYMemPool::release(const Block& block, size_t size) {
+    {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        if (m_stats.cached + size <= m_maxCached) {
+            m_free[size].push_back(block);
+            m_stats.cached += size;
+            return;
+        }
+        m_stats.allocated -= size;
+    }
+    sysFree(block, size);
+}
+
+void RGYMemPool::trim() {
+    std::map<size_t, std::vector<Block>> freeList;
+    {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        std::swap(freeList, m_free);
+        for (const auto& sc : freeList) {
+            m_stats.allocated -= sc.first * sc.second.size();
+        }
+        m_stats.cached = 0;
+    }
+    for (const auto& sc : freeList) {
+        for (const auto& block : sc.second) {
+            sysFree(block, sc.first);
+        }
+    }
+}
+
+void RGYMemPool::setMaxCached(size_t size) {
+    std::lock_guard<std::mutex> lock(m_mtx);
+    m_maxCached = size;
+}
+
+RGYMemPool::Stats RGYMemPool::stats() const {
+    std::lock_guard<std::mutex> lock(m_mtx);
+    return m_stats;
+}
+
+tstring RGYMemPool::statsStr() const {
+    const auto s = stats();
+    return strsprintf(_T("mem pool: hit %lld, miss %lld (huge page %lld), allocated %.1f MB, cached %.1f MB"),
+        (long long)s.hit, (long long)s.miss, (long long)s.hugeAlloc,
+        s.allocated / (double)(1024 * 1024), s.cached / (double)(1024 * 1024));
+}
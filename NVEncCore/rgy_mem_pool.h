@@ -0,0 +1,91 @@
+﻿// -----------------------------------------------------------------------------------------
+// QSVEnc/NVEnc/VCEEnc by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2020 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+#pragma once
+#ifndef __RGY_MEM_POOL_H__
+#define __RGY_MEM_POOL_H__
+
+#include <cstdint>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include "rgy_osdep.h"
+#include "rgy_def.h"
+
+//フレームバッファ用のメモリプール
+//大きなバッファは2MBのhuge page (Linux: MAP_HUGETLB/THP, Windows: Large Page) 単位で確保し、
+//解放されたバッファはサイズクラスごとに保持して再利用することで、
+//新規確保時のページフォールトやTLBミスを削減する
+class RGYMemPool : public std::enable_shared_from_this<RGYMemPool> {
+public:
+    static const size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+    struct Stats {
+        uint64_t hit;         //保持していたバッファを再利用した回数
+        uint64_t miss;        //新たにOSから確保した回数
+        uint64_t hugeAlloc;   //miss のうちhuge pageで確保できた回数
+        size_t   allocated;   //OSから確保している総量 (byte)
+        size_t   cached;      //再利用のために保持している総量 (byte)
+    };
+
+    ~RGYMemPool();
+
+    //size byte以上のバッファを取得する (先頭はページ境界に揃えられる)
+    //返したshared_ptrが解放されると、バッファはプールに戻される
+    std::shared_ptr<uint8_t> alloc(size_t size);
+    //保持しているバッファをすべてOSに返す
+    void trim();
+    //保持するバッファの総量の上限を設定する
+    void setMaxCached(size_t size);
+
+    Stats stats() const;
+    tstring statsStr() const;
+
+    //プロセス全体で共有するメモリプール
+    static std::shared_ptr<RGYMemPool> shared();
+protected:
+    struct Block {
+        void *ptr;
+        bool huge;
+    };
+    RGYMemPool();
+    static size_t sizeClass(size_t size);
+    //OSからの確保・解放は時間がかかるので、m_mtxを保持せずに呼ぶ
+    Block sysAlloc(size_t size);
+    void sysFree(const Block& block, size_t size);
+    void release(const Block& block, size_t size);
+
+    mutable std::mutex m_mtx;
+    std::map<size_t, std::vector<Block>> m_free; //サイズクラスごとの再利用可能なバッファ
+    Stats m_stats;
+    size_t m_maxCached;
+    std::atomic<bool> m_hugetlbAvailable; //MAP_HUGETLB/MEM_LARGE_PAGES での確保を試みるか (m_mtxの外で参照する)
+};
+
+#endif //__RGY_MEM_POOL_H__
@@ -0,0 +1,439 @@
+﻿// -----------------------------------------------------------------------------------------
+// QSVEnc/NVEnc/VCEEnc by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2020 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+#include <cstdarg>
+#include <cmath>
+#include <cstring>
+#include <cctype>
+#include <functional>
+#include <algorithm>
+#include "rgy_metrics.h"
+#include "rgy_version.h"
+
+//OpenMetricsのラベルの値のエスケープ
+static std::string metricsEscapeLabel(const std::string& str) {
+    std::string escaped;
+    for (auto c : str) {
+        if (c == '\\') {
+            escaped += "\\\\";
+        } else if (c == '\"') {
+            escaped += "\\\"";
+        } else if (c == '\n') {
+            escaped += "\\n";
+        } else {
+            escaped += c;
+        }
+    }
+    return escaped;
+}
+
+static std::string metricsValue(double value) {
+    if (value == std::floor(value) && std::abs(value) < 1e15) {
+        return strsprintf("%lld", (long long)value);
+    }
+    return strsprintf("%.10g", value);
+}
+
+//メトリクス名の接頭辞 (nvencc_)
+static const std::string& metricsPrefix() {
+    static const std::string prefix = []() {
+        std::string name = ENCODER_NAME;
+        std::transform(name.begin(), name.end(), name.begin(), [](char c) { return (char)std::tolower((unsigned char)c); });
+        return name + "_";
+    }();
+    return prefix;
+}
+
+RGYMetricsSource::RGYMetricsSource(const tstring& output) :
+    m_label(metricsEscapeLabel(tchar_to_string(output, CP_UTF8))),
+    m_mtx(),
+    m_front(0) {
+    memset(m_buf, 0, sizeof(m_buf));
+}
+
+void RGYMetricsSource::publish() {
+    std::lock_guard<std::mutex> lock(m_mtx);
+    m_front ^= 1;
+}
+
+RGYMetricsSnapshot RGYMetricsSource::snapshot() const {
+    std::lock_guard<std::mutex> lock(m_mtx);
+    return m_buf[m_front];
+}
+
+struct RGYMetricsEntry {
+    std::string label;
+    RGYMetricsSnapshot snap;
+};
+
+//suffix: サンプル名の接尾辞 (_total, _bucketなど), labels: 追加のラベル
+typedef std::function<void(const char *suffix, const std::string& labels, double value)> RGYMetricsEmit;
+
+//各エンコードの値をメトリクスのfamilyごとにまとめて出力する
+class RGYMetricsText {
+public:
+    RGYMetricsText(const std::vector<RGYMetricsEntry>& entries) : m_entries(entries), m_str() {};
+    //サンプルが1つもなければfamilyごと出力しない
+    void family(const char *name, const char *type, const char *help, std::function<void(const RGYMetricsSnapshot&, const RGYMetricsEmit&)> func) {
+        const auto fullname = metricsPrefix() + name;
+        std::string samples;
+        for (const auto& entry : m_entries) {
+            func(entry.snap, [&](const char *suffix, const std::string& labels, double value) {
+                samples += fullname + suffix + "{output=\"" + entry.label + "\"" + ((labels.length() > 0) ? "," + labels : "") + "} " + metricsValue(value) + "\n";
+            });
+        }
+        if (samples.length() > 0) {
+            m_str += "# TYPE " + fullname + " " + type + "\n";
+            m_str += "# HELP " + fullname + " " + help + "\n";
+            m_str += samples;
+        }
+    }
+    std::string str() const {
+        return m_str + "# EOF\n";
+    }
+protected:
+    const std::vector<RGYMetricsEntry>& m_entries;
+    std::string m_str;
+};
+
+RGYMetricsServer *RGYMetricsServer::get() {
+    static RGYMetricsServer server;
+    return &server;
+}
+
+RGYMetricsServer::RGYMetricsServer() :
+    m_mtx(),
+    m_ref(0),
+    m_host(),
+    m_port(0),
+    m_listenPort(0),
+    m_listen(),
+    m_thread(),
+    m_abort(false),
+    m_scrapes(0),
+    m_log(),
+    m_sources() {
+}
+
+RGYMetricsServer::~RGYMetricsServer() {
+    while (m_ref > 0) {
+        close();
+    }
+}
+
+void RGYMetricsServer::AddMessage(int log_level, const TCHAR *format, ...) {
+    if (m_log == nullptr || log_level < m_log->getLogLevel()) {
+        return;
+    }
+    va_list args;
+    va_start(args, format);
+    int len = _vsctprintf(format, args) + 1; // _vscprintf doesn't count terminating '\0'
+    tstring buffer;
+    buffer.resize(len, _T('\0'));
+    _vstprintf_s(&buffer[0], len, format, args);
+    va_end(args);
+    m_log->write(log_level, (tstring(_T("metrics: ")) + buffer.c_str()).c_str());
+}
+
+RGY_ERR RGYMetricsServer::open(const std::string& host, int port, std::shared_ptr<RGYLog> log) {
+    std::lock_guard<std::mutex> lock(m_mtx);
+    if (m_ref > 0) {
+        //ひとつのプロセスで待ち受けるのはひとつのみ
+        if (host != m_host || port != m_port) {
+            return RGY_ERR_INVALID_CALL;
+        }
+        m_ref++;
+        return RGY_ERR_NONE;
+    }
+    auto err = m_listen.listen(host, port);
+    if (err != RGY_ERR_NONE) {
+        return err;
+    }
+    m_log = log;
+    m_host = host;
+    m_port = port;
+    m_listenPort = m_listen.localPort();
+    m_abort = false;
+    m_scrapes = 0;
+    m_thread = std::thread(&RGYMetricsServer::run, this);
+    m_ref = 1;
+    AddMessage(RGY_LOG_DEBUG, _T("listening on %s:%d.\n"), char_to_tstring(host).c_str(), m_listenPort);
+    return RGY_ERR_NONE;
+}
+
+void RGYMetricsServer::close() {
+    {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        if (m_ref <= 0 || --m_ref > 0) {
+            return;
+        }
+        m_abort = true;
+    }
+    if (m_thread.joinable()) {
+        m_thread.join();
+    }
+    m_listen.close();
+    AddMessage(RGY_LOG_DEBUG, _T("closed, %llu scrapes.\n"), (unsigned long long)m_scrapes);
+    std::lock_guard<std::mutex> lock(m_mtx);
+    m_sources.clear();
+    m_log.reset();
+}
+
+std::shared_ptr<RGYMetricsSource> RGYMetricsServer::addSource(const tstring& output) {
+    auto source = std::make_shared<RGYMetricsSource>(output);
+    std::lock_guard<std::mutex> lock(m_mtx);
+    m_sources.push_back(source);
+    return source;
+}
+
+void RGYMetricsServer::removeSource(const std::shared_ptr<RGYMetricsSource>& source) {
+    std::lock_guard<std::mutex> lock(m_mtx);
+    m_sources.erase(std::remove(m_sources.begin(), m_sources.end(), source), m_sources.end());
+}
+
+std::string RGYMetricsServer::render() {
+    std::vector<std::shared_ptr<RGYMetricsSource>> sources;
+    {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        sources = m_sources;
+    }
+    std::vector<RGYMetricsEntry> entries;
+    for (const auto& source : sources) {
+        RGYMetricsEntry entry;
+        entry.label = source->label();
+        entry.snap = source->snapshot();
+        if (entry.snap.valid) {
+            entries.push_back(entry);
+        }
+    }
+    RGYMetricsText text(entries);
+    typedef const RGYMetricsSnapshot& S;
+    typedef const RGYMetricsEmit& E;
+    text.family("build", "info", "Encoder version.", [](S, E emit) {
+        emit("_info", "version=\"" VER_STR_FILEVERSION "\"", 1.0);
+    });
+
+    //エンコードの状況
+    text.family("frames_out", "counter", "Frames output by the encoder, by picture type.", [](S s, E emit) {
+        if (!s.encStarted) return;
+        emit("_total", "type=\"I\"", s.enc.frameOutI);
+        emit("_total", "type=\"P\"", s.enc.frameOutP);
+        emit("_total", "type=\"B\"", s.enc.frameOutB);
+    });
+    text.family("frames_out_idr", "counter", "IDR frames output by the encoder, also counted as type I in frames_out.", [](S s, E emit) {
+        if (!s.encStarted) return;
+        emit("_total", "", s.enc.frameOutIDR);
+    });
+    text.family("frames_in", "counter", "Frames sent to the encoder.", [](S s, E emit) {
+        if (!s.encStarted) return;
+        emit("_total", "", s.enc.frameIn);
+    });
+    text.family("frames_dropped", "counter", "Frames dropped.", [](S s, E emit) {
+        if (!s.encStarted) return;
+        emit("_total", "", s.enc.frameDrop);
+    });
+    text.family("output_bytes", "counter", "Bytes of the encoded frames, by picture type.", [](S s, E emit) {
+        if (!s.encStarted) return;
+        emit("_total", "type=\"I\"", (double)s.enc.frameOutISize);
+        emit("_total", "type=\"P\"", (double)s.enc.frameOutPSize);
+        emit("_total", "type=\"B\"", (double)s.enc.frameOutBSize);
+    });
+    text.family("avg_qp", "gauge", "Average QP of the encoded frames, by picture type.", [](S s, E emit) {
+        if (!s.encStarted) return;
+        if (s.enc.frameOutI) emit("", "type=\"I\"", s.enc.frameOutIQPSum / (double)s.enc.frameOutI);
+        if (s.enc.frameOutP) emit("", "type=\"P\"", s.enc.frameOutPQPSum / (double)s.enc.frameOutP);
+        if (s.enc.frameOutB) emit("", "type=\"B\"", s.enc.frameOutBQPSum / (double)s.enc.frameOutB);
+    });
+    text.family("encode_fps", "gauge", "Encode speed in the last interval.", [](S s, E emit) {
+        if (!s.encStarted) return;
+        emit("", "", s.perf.fps);
+    });
+    text.family("encode_fps_average", "gauge", "Average encode speed.", [](S s, E emit) {
+        if (!s.encStarted) return;
+        emit("", "", s.perf.fps_avg);
+    });
+    text.family("bitrate_bits_per_second", "gauge", "Bitrate of the frames output in the last interval.", [](S s, E emit) {
+        if (!s.encStarted) return;
+        emit("", "", s.perf.bitrate_kbps * 1e3);
+    });
+    text.family("bitrate_average_bits_per_second", "gauge", "Average bitrate.", [](S s, E emit) {
+        if (!s.encStarted) return;
+        emit("", "", s.perf.bitrate_kbps_avg * 1e3);
+    });
+
+    //CPU・メモリ・IO
+    text.family("cpu_usage_percent", "gauge", "CPU usage of the process.", [](S s, E emit) {
+        emit("", "", s.perf.cpu_percent);
+    });
+    text.family("cpu_kernel_usage_percent", "gauge", "CPU usage of the process in kernel mode.", [](S s, E emit) {
+        emit("", "", s.perf.cpu_kernel_percent);
+    });
+    text.family("thread_cpu_usage_percent", "gauge", "CPU usage of each thread.", [](S s, E emit) {
+        emit("", "thread=\"main\"",          s.perf.main_thread_percent);
+        emit("", "thread=\"encode\"",        s.perf.enc_thread_percent);
+        emit("", "thread=\"input\"",         s.perf.in_thread_percent);
+        emit("", "thread=\"output\"",        s.perf.out_thread_percent);
+        emit("", "thread=\"audio_process\"", s.perf.aud_proc_thread_percent);
+        emit("", "thread=\"audio_encode\"",  s.perf.aud_enc_thread_percent);
+    });
+    text.family("memory_private_bytes", "gauge", "Private (resident) memory of the process.", [](S s, E emit) {
+        emit("", "", (double)s.perf.mem_private);
+    });
+    text.family("memory_virtual_bytes", "gauge", "Virtual memory of the process.", [](S s, E emit) {
+        emit("", "", (double)s.perf.mem_virtual);
+    });
+    text.family("io_read_bytes_per_second", "gauge", "IO read speed of the process.", [](S s, E emit) {
+        emit("", "", s.perf.io_read_per_sec);
+    });
+    text.family("io_write_bytes_per_second", "gauge", "IO write speed of the process.", [](S s, E emit) {
+        emit("", "", s.perf.io_write_per_sec);
+    });
+    text.family("cpu_cycles_per_second", "gauge", "CPU cycles of the monitored threads.", [](S s, E emit) {
+        if (s.perf.cpu_cycles > 0) emit("", "", s.perf.cpu_cycles_per_sec);
+    });
+    text.family("cpu_llc_misses_per_second", "gauge", "Last level cache misses of the monitored threads.", [](S s, E emit) {
+        if (s.perf.cpu_cycles > 0) emit("", "", s.perf.cpu_llc_miss_per_sec);
+    });
+
+    //キュー・出力
+    text.family("queue_usage", "gauge", "Number of items in each queue between the threads.", [](S s, E emit) {
+        emit("", "queue=\"video_in\"",      (double)s.queue.usage_vid_in);
+        emit("", "queue=\"audio_in\"",      (double)s.queue.usage_aud_in);
+        emit("", "queue=\"video_out\"",     (double)s.queue.usage_vid_out);
+        emit("", "queue=\"audio_out\"",     (double)s.queue.usage_aud_out);
+        emit("", "queue=\"audio_encode\"",  (double)s.queue.usage_aud_enc);
+        emit("", "queue=\"audio_process\"", (double)s.queue.usage_aud_proc);
+    });
+    text.family("output_inflight_bytes", "gauge", "Bytes waiting to be written by the output sink.", [](S s, E emit) {
+        emit("", "", (double)s.queue.output_inflight);
+    });
+    text.family("output_write_latency_seconds", "histogram", "Time to write each block by the output sink.", [](S s, E emit) {
+        static const char *bounds[PERF_OUTPUT_WRITE_LATENCY_BINS] = { "0.001", "0.004", "0.016", "0.064", "0.256", "+Inf" };
+        //各ビンの値を累積に変換する
+        double count = 0.0;
+        for (int i = 0; i < PERF_OUTPUT_WRITE_LATENCY_BINS; i++) {
+            count += s.queue.output_write_latency[i];
+            emit("_bucket", std::string("le=\"") + bounds[i] + "\"", count);
+        }
+        emit("_count", "", count);
+    });
+
+    //GPU
+    text.family("gpu_load_percent", "gauge", "GPU load.", [](S s, E emit) {
+        if (s.perf.gpu_info_valid) emit("", "", s.perf.gpu_load_percent);
+    });
+    text.family("gpu_clock_hertz", "gauge", "GPU core clock.", [](S s, E emit) {
+        if (s.perf.gpu_info_valid) emit("", "", s.perf.gpu_clock * 1e6);
+    });
+    text.family("video_encoder_load_percent", "gauge", "GPU video encoder load.", [](S s, E emit) {
+        if (s.perf.gpu_info_valid) emit("", "", s.perf.vee_load_percent);
+    });
+    text.family("video_decoder_load_percent", "gauge", "GPU video decoder load.", [](S s, E emit) {
+        if (s.perf.gpu_info_valid) emit("", "", s.perf.ved_load_percent);
+    });
+    text.family("video_engine_clock_hertz", "gauge", "GPU video engine clock.", [](S s, E emit) {
+        if (s.perf.gpu_info_valid) emit("", "", s.perf.ve_clock * 1e6);
+    });
+    text.family("pcie_generation", "gauge", "PCIe generation of the GPU link.", [](S s, E emit) {
+        if (s.perf.gpu_info_valid && s.perf.pcie_gen > 0) emit("", "", s.perf.pcie_gen);
+    });
+    text.family("pcie_link_width", "gauge", "PCIe link width of the GPU.", [](S s, E emit) {
+        if (s.perf.gpu_info_valid && s.perf.pcie_gen > 0) emit("", "", s.perf.pcie_link);
+    });
+    text.family("pcie_tx_bytes_per_second", "gauge", "PCIe transfer speed from the GPU.", [](S s, E emit) {
+        if (s.perf.gpu_info_valid && s.perf.pcie_gen > 0) emit("", "", s.perf.pcie_throughput_tx_per_sec * 1024.0);
+    });
+    text.family("pcie_rx_bytes_per_second", "gauge", "PCIe transfer speed to the GPU.", [](S s, E emit) {
+        if (s.perf.gpu_info_valid && s.perf.pcie_gen > 0) emit("", "", s.perf.pcie_throughput_rx_per_sec * 1024.0);
+    });
+    return text.str();
+}
+
+void RGYMetricsServer::run() {
+    while (!m_abort) {
+        RGYTCPSocket client;
+        const auto err = m_listen.accept(client, ACCEPT_TIMEOUT_MS);
+        if (err == RGY_ERR_MORE_DATA) {
+            continue;
+        }
+        if (err != RGY_ERR_NONE) {
+            AddMessage(RGY_LOG_ERROR, _T("failed to accept connection: %s.\n"), get_err_mes(err));
+            break;
+        }
+        handle(client);
+    }
+}
+
+void RGYMetricsServer::handle(RGYTCPSocket& client) {
+    //応答しないクライアントで次のscrapeが止まらないように
+    client.setTimeout(1000);
+    std::string request;
+    char buf[1024];
+    int64_t ret = 0;
+    while (request.find("\r\n\r\n") == std::string::npos && request.length() < 16384
+        && (ret = client.recv(buf, sizeof(buf))) > 0) {
+        request.append(buf, (size_t)ret);
+    }
+    //リクエスト行 (GET /metrics HTTP/1.1)
+    const auto line = request.substr(0, request.find("\r\n"));
+    const auto sp1 = line.find(' ');
+    const auto sp2 = (sp1 != std::string::npos) ? line.find(' ', sp1 + 1) : std::string::npos;
+    const auto method = line.substr(0, sp1);
+    const auto path = (sp2 != std::string::npos) ? line.substr(sp1 + 1, sp2 - sp1 - 1) : std::string();
+    int status = 200;
+    const char *statusText = "OK";
+    if (sp2 == std::string::npos) {
+        status = 400;
+        statusText = "Bad Request";
+    } else if (method != "GET" && method != "HEAD") {
+        status = 405;
+        statusText = "Method Not Allowed";
+    } else if (path.substr(0, path.find('?')) != "/metrics") {
+        status = 404;
+        statusText = "Not Found";
+    }
+    std::string body;
+    const char *contentType = "text/plain; charset=utf-8";
+    if (status == 200) {
+        body = render();
+        contentType = "application/openmetrics-text; version=1.0.0; charset=utf-8";
+        m_scrapes++;
+    } else {
+        body = strsprintf("%d %s\n", status, statusText);
+        AddMessage(RGY_LOG_DEBUG, _T("%s: %d.\n"), char_to_tstring(line).c_str(), status);
+    }
+    const auto header = strsprintf("HTTP/1.1 %d %s\r\n"
+        "Content-Type: %s\r\n"
+        "Content-Length: %zu\r\n"
+        "Connection: close\r\n"
+        "\r\n",
+        status, statusText, contentType, body.length());
+    if (client.send(header.data(), header.length()) == RGY_ERR_NONE && method != "HEAD") {
+        client.send(body.data(), body.length());
+    }
+    client.close();
+}
@@ -0,0 +1,117 @@
+﻿// -----------------------------------------------------------------------------------------
+// QSVEnc/NVEnc/VCEEnc by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2020 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+#pragma once
+#ifndef __RGY_METRICS_H__
+#define __RGY_METRICS_H__
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include "rgy_err.h"
+#include "rgy_log.h"
+#include "rgy_status.h"
+#include "rgy_perf_monitor.h"
+#include "rgy_socket.h"
+
+//--metrics-portで公開する値
+//性能モニタのスレッドがPerfInfoを更新するたびに書き込む
+struct RGYMetricsSnapshot {
+    bool valid;              //書き込み済みか
+    bool encStarted;         //encの値が有効か
+    PerfInfo perf;
+    PerfQueueInfo queue;
+    EncodeStatusData enc;
+};
+
+//1つのエンコード (出力ファイル) 分の値
+//書き込み側 (性能モニタのスレッド) は裏側のバッファに書き込んでから表裏を入れ替え、
+//読み出し側 (HTTPのスレッド) は表側のバッファをコピーするので、
+//互いにロックを取るのは入れ替えとコピーの間のみで、エンコードのスレッドは一切関与しない
+class RGYMetricsSource {
+public:
+    RGYMetricsSource(const tstring& output);
+    //書き込み側から呼ぶ: back()に書き込んでからpublish()する
+    RGYMetricsSnapshot *back() { return &m_buf[m_front ^ 1]; }
+    void publish();
+    //読み出し側から呼ぶ
+    RGYMetricsSnapshot snapshot() const;
+    //OpenMetricsのラベルの値としてエスケープ済みの出力ファイル名
+    const std::string& label() const { return m_label; }
+protected:
+    std::string m_label;
+    mutable std::mutex m_mtx; //m_frontの入れ替えと表側の読み出しの保護
+    RGYMetricsSnapshot m_buf[2];
+    int m_front;
+};
+
+//OpenMetrics形式 (Prometheus) で値を返すHTTPサーバ
+//GET /metrics に応答する
+class RGYMetricsServer {
+public:
+    //プロセス全体で1つ
+    static RGYMetricsServer *get();
+    //host:portで待ち受けを開始する
+    //すでに同じhost:portで開始している場合は参照カウントを増やすのみ (ABRラダーの各エンコードから呼ばれる)
+    RGY_ERR open(const std::string& host, int port, std::shared_ptr<RGYLog> log);
+    //参照カウントを減らし、0になったら待ち受けを終了する
+    void close();
+    //実際に待ち受けているポート (port=0で開始した場合に使用)
+    int port() const { return m_listenPort; }
+    //エンコードごとに呼び、性能モニタに渡す
+    std::shared_ptr<RGYMetricsSource> addSource(const tstring& output);
+    void removeSource(const std::shared_ptr<RGYMetricsSource>& source);
+    //登録されているすべてのエンコードの値をOpenMetrics形式の文字列にする
+    std::string render();
+    uint64_t scrapes() const { return m_scrapes; }
+
+    static const int ACCEPT_TIMEOUT_MS = 100;
+protected:
+    RGYMetricsServer();
+    ~RGYMetricsServer();
+    void run();
+    void handle(RGYTCPSocket& client);
+    void AddMessage(int log_level, const TCHAR *format, ...);
+
+    std::mutex m_mtx; //m_ref, m_sourcesの保護
+    int m_ref;
+    std::string m_host;
+    int m_port;
+    int m_listenPort;
+    RGYTCPSocket m_listen;
+    std::thread m_thread;
+    std::atomic<bool> m_abort;
+    std::atomic<uint64_t> m_scrapes;
+    std::shared_ptr<RGYLog> m_log;
+    std::vector<std::shared_ptr<RGYMetricsSource>> m_sources;
+};
+
+#endif //__RGY_METRICS_H__
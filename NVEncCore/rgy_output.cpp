@@ -105,7 +105,10 @@ void RGYOutput::Close() {
 }
 
 RGYOutputRaw::RGYOutputRaw() :
-    m_seiNal()
+    m_seiNal(),
+    m_nalList(),
+    m_segments(),
+    m_sink()
 #if ENABLE_AVSW_READER
     , m_pBsfc()
 #endif //#if ENABLE_AVSW_READER
@@ -120,6 +123,33 @@ RGYOutputRaw::~RGYOutputRaw() {
 #endif //#if ENABLE_AVSW_READER
 }
 
+void RGYOutputRaw::Close() {
+    if (m_sink) {
+        m_sink->close();
+        m_sink.reset();
+        AddMessage(RGY_LOG_DEBUG, _T("Closed file sink.\n"));
+    }
+    RGYOutput::Close();
+}
+
+size_t RGYOutputRaw::WriteData(const void *ptr, size_t size) {
+    if (m_sink) {
+        return (size_t)(std::max<int64_t>)(0, m_sink->write(ptr, size));
+    }
+    return _fwrite_nolock(ptr, 1, size, m_fDest.get());
+}
+
+size_t RGYOutputRaw::WriteData(const std::vector<RGYBitstreamSegment>& segments) {
+    //--output-sinkの非同期書き込みでは、各セグメントはそのまま書き込みブロックに連結される
+    size_t nBytesWritten = 0;
+    for (const auto& segment : segments) {
+        if (segment.size > 0) {
+            nBytesWritten += WriteData(segment.ptr, segment.size);
+        }
+    }
+    return nBytesWritten;
+}
+
 #pragma warning (push)
 #pragma warning (disable: 4127) //warning C4127: 条件式が定数です。
 RGY_ERR RGYOutputRaw::Init(const TCHAR *strFileName, const VideoInfo *pVideoOutputInfo, const void *prm) {
@@ -138,6 +168,16 @@ RGY_ERR RGYOutputRaw::Init(const TCHAR *strFileName, const VideoInfo *pVideoOutp
             m_fDest.reset(stdout);
             m_outputIsStdout = true;
             AddMessage(RGY_LOG_DEBUG, _T("using stdout\n"));
+        } else if (rawPrm->outputSink != RGY_OUTPUT_SINK_STDIO) {
+            CreateDirectoryRecursive(PathRemoveFileSpecFixed(strFileName).second.c_str());
+            const size_t bufferSizeByte = (size_t)(std::max)(clamp(rawPrm->bufSizeMB, 0, RGY_OUTPUT_BUF_MB_MAX), 1) * 1024 * 1024;
+            m_sink = createFileSink(rawPrm->outputSink, m_printMes, bufferSizeByte, rawPrm->queueInfo);
+            auto sts = m_sink->open(strFileName);
+            if (sts != RGY_ERR_NONE) {
+                AddMessage(RGY_LOG_ERROR, _T("failed to open output file \"%s\".\n"), strFileName);
+                return sts;
+            }
+            AddMessage(RGY_LOG_DEBUG, _T("Opened file \"%s\" (%s)\n"), strFileName, m_sink->name());
         } else {
             CreateDirectoryRecursive(PathRemoveFileSpecFixed(strFileName).second.c_str());
             FILE *fp = NULL;
@@ -282,21 +322,25 @@ RGY_ERR RGYOutputRaw::WriteNextFrame(RGYBitstream *pBitstream) {
 
     size_t nBytesWritten = 0;
     if (!m_noOutput) {
+        //出力するデータの並び (元のビットストリーム・bsfの出力・seiをそれぞれ直接指し、組み立て直さない)
+        auto& nal_list = m_nalList;
+        auto& segments = m_segments;
+        nal_list.clear();
+        segments.clear();
 #if ENABLE_AVSW_READER
+        AVPacket pkt = { 0 };
+        av_init_packet(&pkt);
         if (m_pBsfc) {
             uint8_t nal_type = 0;
-            std::vector<nal_info> nal_list;
             if (m_VideoOutputInfo.codec == RGY_CODEC_HEVC) {
                 nal_type = NALU_HEVC_SPS;
-                nal_list = parse_nal_unit_hevc(pBitstream->data(), pBitstream->size());
+                parse_nal_unit_hevc(nal_list, pBitstream->data(), pBitstream->size());
             } else if (m_VideoOutputInfo.codec == RGY_CODEC_H264) {
                 nal_type = NALU_H264_SPS;
-                nal_list = parse_nal_unit_h264(pBitstream->data(), pBitstream->size());
+                parse_nal_unit_h264(nal_list, pBitstream->data(), pBitstream->size());
             }
-            auto sps_nal = std::find_if(nal_list.begin(), nal_list.end(), [](nal_info info) { return info.type == NALU_HEVC_SPS; });
+            auto sps_nal = std::find_if(nal_list.begin(), nal_list.end(), [nal_type](nal_info info) { return info.type == nal_type; });
             if (sps_nal != nal_list.end()) {
-                AVPacket pkt = { 0 };
-                av_init_packet(&pkt);
                 av_new_packet(&pkt, (int)sps_nal->size);
                 memcpy(pkt.data, sps_nal->ptr, sps_nal->size);
                 int ret = 0;
@@ -310,51 +354,44 @@ RGY_ERR RGYOutputRaw::WriteNextFrame(RGYBitstream *pBitstream) {
                 if (ret == AVERROR(EAGAIN)) {
                     return RGY_ERR_NONE;
                 } else if ((ret < 0 && ret != AVERROR_EOF) || pkt.size < 0) {
+                    av_packet_unref(&pkt);
                     AddMessage(RGY_LOG_ERROR, _T("failed to run %s bitstream filter: %s.\n"),
                         char_to_tstring(m_pBsfc->filter->name).c_str(), qsv_av_err2str(ret).c_str());
                     return RGY_ERR_UNKNOWN;
                 }
-                const auto new_data_size = pBitstream->size() + pkt.size - sps_nal->size;
-                const auto sps_nal_offset = sps_nal->ptr - pBitstream->data();
-                const auto next_nal_orig_offset = sps_nal_offset + sps_nal->size;
-                const auto next_nal_new_offset = sps_nal_offset + pkt.size;
-                const auto stream_orig_length = pBitstream->size();
-                if ((decltype(new_data_size))pBitstream->bufsize() < new_data_size) {
-                    pBitstream->changeSize(new_data_size);
-                } else if (pkt.size > (decltype(pkt.size))sps_nal->size) {
-                    pBitstream->trim();
-                }
-                memmove(pBitstream->data() + next_nal_new_offset, pBitstream->data() + next_nal_orig_offset, stream_orig_length - next_nal_orig_offset);
-                memcpy(pBitstream->data() + sps_nal_offset, pkt.data, pkt.size);
-                av_packet_unref(&pkt);
+                //SPSの前後は元のビットストリームをそのまま指し、SPSだけをbsfの出力に差し替える
+                const uint8_t *sps_fin = sps_nal->ptr + sps_nal->size;
+                segments.push_back({ pBitstream->data(), (size_t)(sps_nal->ptr - pBitstream->data()) });
+                segments.push_back({ pkt.data, (size_t)pkt.size });
+                segments.push_back({ sps_fin, (size_t)(pBitstream->data() + pBitstream->size() - sps_fin) });
+                sps_nal->ptr = pkt.data;
+                sps_nal->size = pkt.size;
             }
         }
 #endif //#if ENABLE_AVSW_READER
         if (m_seiNal.size()) {
-            const auto nal_list     = parse_nal_unit_hevc(pBitstream->data(), pBitstream->size());
-            const auto hevc_vps_nal = std::find_if(nal_list.begin(), nal_list.end(), [](nal_info info) { return info.type == NALU_HEVC_VPS; });
-            const auto hevc_sps_nal = std::find_if(nal_list.begin(), nal_list.end(), [](nal_info info) { return info.type == NALU_HEVC_SPS; });
-            const auto hevc_pps_nal = std::find_if(nal_list.begin(), nal_list.end(), [](nal_info info) { return info.type == NALU_HEVC_PPS; });
-            const bool header_check = (nal_list.end() != hevc_vps_nal) && (nal_list.end() != hevc_sps_nal) && (nal_list.end() != hevc_pps_nal);
-            if (header_check) {
-                nBytesWritten  = _fwrite_nolock(hevc_vps_nal->ptr, 1, hevc_vps_nal->size, m_fDest.get());
-                nBytesWritten += _fwrite_nolock(hevc_sps_nal->ptr, 1, hevc_sps_nal->size, m_fDest.get());
-                nBytesWritten += _fwrite_nolock(hevc_pps_nal->ptr, 1, hevc_pps_nal->size, m_fDest.get());
-                nBytesWritten += _fwrite_nolock(m_seiNal.data(),   1, m_seiNal.size(),    m_fDest.get());
-                for (const auto& nal : nal_list) {
-                    if (nal.type != NALU_HEVC_VPS && nal.type != NALU_HEVC_SPS && nal.type != NALU_HEVC_PPS) {
-                        nBytesWritten += _fwrite_nolock(nal.ptr, 1, nal.size, m_fDest.get());
-                    }
-                }
-            } else {
+            if (nal_list.size() == 0) {
+                parse_nal_unit_hevc(nal_list, pBitstream->data(), pBitstream->size());
+            }
+            segments.clear();
+            if (!hevc_insert_sei_segments(segments, nal_list, m_seiNal.data(), m_seiNal.size())) {
+#if ENABLE_AVSW_READER
+                av_packet_unref(&pkt);
+#endif //#if ENABLE_AVSW_READER
                 AddMessage(RGY_LOG_ERROR, _T("Unexpected HEVC header.\n"));
                 return RGY_ERR_UNDEFINED_BEHAVIOR;
             }
-            m_seiNal.clear();
-        } else {
-            nBytesWritten = _fwrite_nolock(pBitstream->data(), 1, pBitstream->size(), m_fDest.get());
-            WRITE_CHECK(nBytesWritten, pBitstream->size());
         }
+        if (segments.size() == 0) {
+            segments.push_back({ pBitstream->data(), pBitstream->size() });
+        }
+        const auto nBytesExpected = bitstream_segments_size(segments);
+        nBytesWritten = WriteData(segments);
+#if ENABLE_AVSW_READER
+        av_packet_unref(&pkt);
+#endif //#if ENABLE_AVSW_READER
+        WRITE_CHECK(nBytesWritten, nBytesExpected);
+        m_seiNal.clear();
     }
 
     m_encSatusInfo->SetOutputData(pBitstream->frametype(), pBitstream->size(), 0);
@@ -550,6 +587,7 @@ RGY_ERR RGYOutFrame::WriteNextFrame(RGYFrame *pSurface) {
 
 #include "rgy_input_sm.h"
 #include "rgy_input_avcodec.h"
+#include "rgy_input_fanout.h"
 #include "rgy_output_avcodec.h"
 
 std::unique_ptr<HEVCHDRSei> createHEVCHDRSei(const std::string& maxCll, const std::string &masterDisplay, const RGYInput *reader) {
@@ -623,6 +661,10 @@ RGY_ERR initWriters(
         ((common->muxOutputFormat.length() > 0 && 0 == _tcscmp(common->muxOutputFormat.c_str(), _T("raw")))) //--formatにrawが指定されている
         || (PathFindExtension(common->outputFilename.c_str()) == nullptr || PathFindExtension(common->outputFilename.c_str())[0] != '.') //拡張子がしない
         || check_ext(common->outputFilename.c_str(), { ".m2v", ".264", ".h264", ".avc", ".avc1", ".x264", ".265", ".h265", ".hevc" }); //特定の拡張子
+    if (common->cmaf.enable) {
+        //CMAFのセグメント出力はmp4のmuxerで行う
+        useH264ESOutput = false;
+    }
     if (!useH264ESOutput) {
         common->AVMuxTarget |= RGY_MUX_VIDEO;
     }
@@ -660,12 +702,13 @@ RGY_ERR initWriters(
         log->write(RGY_LOG_DEBUG, _T("Output: Using avformat writer.\n"));
         pFileWriter = std::make_shared<RGYOutputAvcodec>();
         AvcodecWriterPrm writerPrm;
-        writerPrm.outputFormat            = common->muxOutputFormat;
+        writerPrm.outputFormat            = (common->cmaf.enable) ? _T("mp4") : common->muxOutputFormat;
         writerPrm.trimList                = trimParam.list;
         writerPrm.bVideoDtsUnavailable    = videoDtsUnavailable;
         writerPrm.threadOutput           = ctrl->threadOutput;
         writerPrm.threadAudio            = ctrl->threadAudio;
         writerPrm.bufSizeMB              = common->outputBufSizeMB;
+        writerPrm.outputSink             = common->outputSink;
         writerPrm.audioResampler         = common->audioResampler;
         writerPrm.audioIgnoreDecodeError = common->audioIgnoreDecodeError;
         writerPrm.queueInfo = (pPerfMonitor) ? pPerfMonitor->GetQueueInfoPtr() : nullptr;
@@ -676,7 +719,13 @@ RGY_ERR initWriters(
         writerPrm.afs                     = isAfs;
         writerPrm.disableMp4Opt           = common->disableMp4Opt;
         writerPrm.muxOpt                  = common->muxOpt;
+        writerPrm.cmaf                    = common->cmaf;
         auto pAVCodecReader = std::dynamic_pointer_cast<RGYInputAvcodec>(pFileReader);
+        if (auto pFanoutReader = std::dynamic_pointer_cast<RGYInputFanout>(pFileReader)) {
+            //入力を共有している場合は、元のリーダーから入力ファイルの情報を取得する
+            pAVCodecReader = std::dynamic_pointer_cast<RGYInputAvcodec>(pFanoutReader->source());
+            writerPrm.audioEncodeCache = pFanoutReader->audioEncodeCache();
+        }
         if (pAVCodecReader != nullptr) {
             writerPrm.inputFormatMetadata = pAVCodecReader->GetInputFormatMetadata();
             writerPrm.videoInputFirstKeyPts = pAVCodecReader->GetVideoFirstKeyPts();
@@ -935,6 +984,8 @@ RGY_ERR initWriters(
             pFileWriter = std::make_shared<RGYOutputRaw>();
             RGYOutputRawPrm rawPrm;
             rawPrm.bufSizeMB = common->outputBufSizeMB;
+            rawPrm.outputSink = common->outputSink;
+            rawPrm.queueInfo = (pPerfMonitor) ? pPerfMonitor->GetQueueInfoPtr() : nullptr;
             rawPrm.benchmark = benchmark;
             rawPrm.codecId = outputVideoInfo.codec;
             rawPrm.hedrsei = hedrsei;
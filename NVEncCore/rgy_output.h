@@ -40,6 +40,8 @@
 #include "rgy_avutil.h"
 #include "rgy_bitstream.h"
 #include "rgy_input.h"
+#include "rgy_file_sink.h"
+#include "rgy_timestamp.h"
 #if ENCODER_NVENC
 #include "NVEncUtil.h"
 #endif //#if ENCODER_NVENC
@@ -59,48 +61,6 @@ enum OutputType {
     OUT_TYPE_SURFACE
 };
 
-class RGYTimestamp {
-private:
-    std::unordered_map<int64_t, int64_t> m_duration;
-    std::mutex mtx;
-    int64_t last_check_pts;
-    int64_t offset;
-public:
-    RGYTimestamp() : m_duration(), mtx(), last_check_pts(-1), offset(0) {};
-    ~RGYTimestamp() {};
-    void add(int64_t pts, int64_t duration) {
-        std::lock_guard<std::mutex> lock(mtx);
-        m_duration[pts] = duration;
-    }
-    int64_t check(int64_t pts) {
-        if (last_check_pts < 0 && pts > 0) {
-            offset = -pts;
-        }
-        std::lock_guard<std::mutex> lock(mtx);
-        pts += offset;
-        auto pos = m_duration.find(pts);
-        if (pos == m_duration.end()) {
-            auto last_check_pos = m_duration.find(last_check_pts);
-            pts = last_check_pos->first + last_check_pos->second / 2;
-            auto next_pts = last_check_pos->first + last_check_pos->second;
-            last_check_pos->second = pts - last_check_pos->first;
-            m_duration[pts] = next_pts - pts;
-        }
-        last_check_pts = pts;
-        return pts;
-    }
-    int64_t get_and_pop(int64_t pts) {
-        std::lock_guard<std::mutex> lock(mtx);
-        auto pos = m_duration.find(pts);
-        if (pos == m_duration.end()) {
-            return -1;
-        }
-        auto duration = pos->second;
-        m_duration.erase(pos);
-        return duration;
-    }
-};
-
 class RGYOutput {
 public:
     RGYOutput();
@@ -183,6 +143,8 @@ protected:
 struct RGYOutputRawPrm {
     bool benchmark;
     int bufSizeMB;
+    RGYOutputSink outputSink;
+    PerfQueueInfo *queueInfo;
     RGY_CODEC codecId;
     const HEVCHDRSei *hedrsei;
 };
@@ -195,10 +157,16 @@ public:
 
     virtual RGY_ERR WriteNextFrame(RGYBitstream *pBitstream) override;
     virtual RGY_ERR WriteNextFrame(RGYFrame *pSurface) override;
+    virtual void Close() override;
 protected:
     virtual RGY_ERR Init(const TCHAR *strFileName, const VideoInfo *pOutputInfo, const void *prm) override;
+    size_t WriteData(const void *ptr, size_t size);
+    size_t WriteData(const std::vector<RGYBitstreamSegment>& segments);
 
     vector<uint8_t> m_seiNal;
+    vector<nal_info> m_nalList; //WriteNextFrameで使いまわすNALユニットのリスト
+    vector<RGYBitstreamSegment> m_segments; //WriteNextFrameで出力するデータの並び
+    unique_ptr<RGYFileSink> m_sink; //--output-sinkで指定された書き込み方法 (stdioならnullptr)
 #if ENABLE_AVSW_READER
     unique_ptr<AVBSFContext, RGYAVDeleter<AVBSFContext>> m_pBsfc;
 #endif //#if ENABLE_AVSW_READER
@@ -35,6 +35,7 @@
 #include "rgy_output_avcodec.h"
 #include "rgy_avlog.h"
 #include "rgy_bitstream.h"
+#include "rgy_trace.h"
 
 #if ENABLE_AVSW_READER
 #if USE_CUSTOM_IO
@@ -54,7 +55,85 @@ static int64_t funcSeek(void *opaque, int64_t offset, int whence) {
 
 const AVRational RGYOutputAvcodec::QUEUE_DTS_TIMEBASE = av_make_q(1, 90000);
 
-RGYOutputAvcodec::RGYOutputAvcodec() {
+//DASHのcodecs属性 (RFC6381形式) の文字列を返す、不明なものは空文字列
+//H.264/HEVCはextradata (Annex B) のSPSから作成する
+static std::string codecs_rfc6381(const AVCodecParameters *codecpar) {
+    switch (codecpar->codec_id) {
+    case AV_CODEC_ID_H264:
+    case AV_CODEC_ID_HEVC: {
+        const bool hevc = codecpar->codec_id == AV_CODEC_ID_HEVC;
+        if (codecpar->extradata == nullptr) {
+            return "";
+        }
+        const auto nal_list = (hevc) ? parse_nal_unit_hevc(codecpar->extradata, codecpar->extradata_size) : parse_nal_unit_h264(codecpar->extradata, codecpar->extradata_size);
+        const int sps_type = (hevc) ? NALU_HEVC_SPS : NALU_H264_SPS;
+        const auto sps_nal = std::find_if(nal_list.begin(), nal_list.end(), [sps_type](nal_info info) { return info.type == sps_type; });
+        if (sps_nal == nal_list.end()) {
+            return "";
+        }
+        //開始コードを除く
+        const uint8_t *ptr = sps_nal->ptr;
+        size_t size = sps_nal->size;
+        while (size > 0 && *ptr == 0x00) {
+            ptr++, size--;
+        }
+        if (size < 4) {
+            return "";
+        }
+        const auto sps = unnal(ptr + 1, size - 1);
+        if (!hevc) {
+            //profile_idc, constraint_set_flags, level_idc
+            return strsprintf("avc1.%02X%02X%02X", sps[1], sps[2], sps[3]);
+        }
+        //NALヘッダ(2byte)とsps_video_parameter_set_id等(1byte)のあとにprofile_tier_levelが続く
+        if (sps.size() < 15) {
+            return "";
+        }
+        const uint8_t *ptl = sps.data() + 3;
+        const int profile_space = ptl[0] >> 6;
+        const int tier = (ptl[0] >> 5) & 1;
+        const int profile_idc = ptl[0] & 0x1f;
+        uint32_t compat = 0;
+        for (int i = 0; i < 32; i++) {
+            //general_profile_compatibility_flagはビット順を逆にして表記する
+            compat |= ((ptl[1 + (i >> 3)] >> (7 - (i & 7))) & 1) << i;
+        }
+        auto str = strsprintf("%s.%s%d.%X.%c%d",
+            (codecpar->codec_tag == MKTAG('h', 'v', 'c', '1')) ? "hvc1" : "hev1",
+            (profile_space > 0) ? std::string(1, (char)('A' + profile_space - 1)).c_str() : "",
+            profile_idc, compat, (tier) ? 'H' : 'L', ptl[11]);
+        //constraint_flags (6byte) は末尾の0を省略する
+        int constraint_bytes = 6;
+        while (constraint_bytes > 0 && ptl[5 + constraint_bytes - 1] == 0) {
+            constraint_bytes--;
+        }
+        for (int i = 0; i < constraint_bytes; i++) {
+            str += strsprintf(".%X", ptl[5 + i]);
+        }
+        return str;
+    }
+    case AV_CODEC_ID_AAC:  return strsprintf("mp4a.40.%d", (codecpar->profile >= 0) ? codecpar->profile + 1 : 2);
+    case AV_CODEC_ID_MP3:  return "mp4a.40.34";
+    case AV_CODEC_ID_AC3:  return "ac-3";
+    case AV_CODEC_ID_EAC3: return "ec-3";
+    case AV_CODEC_ID_OPUS: return "Opus";
+    case AV_CODEC_ID_FLAC: return "fLaC";
+    default: return "";
+    }
+}
+
+//エンコード結果を受け取る側のトラックかどうか
+static bool audioEncodeShared(const AVMuxAudio *muxAudio) {
+    return muxAudio->encodeShareSrc != nullptr
+        || (muxAudio->encodeShare != nullptr && muxAudio->encodeShareId >= 0);
+}
+
+RGYOutputAvcodec::RGYOutputAvcodec() :
+    m_segmenter(),
+    m_cmafChunkFrames(0),
+    m_segmentChunkFrameCount(0),
+    m_segmentEnd(0),
+    m_audioEncodeCache() {
     memset(&m_Mux.format, 0, sizeof(m_Mux.format));
     memset(&m_Mux.video,  0, sizeof(m_Mux.video));
     m_strWriterName = _T("avout");
@@ -114,6 +193,15 @@ void RGYOutputAvcodec::CloseAudio(AVMuxAudio *muxAudio) {
     if (muxAudio->bsfc) {
         av_bsf_free(&muxAudio->bsfc);
     }
+
+    if (muxAudio->encodeShare) {
+        if (muxAudio->encodeShareId < 0) {
+            //エンコードを担当している場合、途中で終了した場合も受け取り側が待機し続けないよう通知する
+            muxAudio->encodeShare->finish(false);
+        } else {
+            muxAudio->encodeShare->unsubscribe(muxAudio->encodeShareId);
+        }
+    }
     memset(muxAudio, 0, sizeof(muxAudio[0]));
     AddMessage(RGY_LOG_DEBUG, _T("Closed audio.\n"));
 }
@@ -141,11 +229,20 @@ void RGYOutputAvcodec::CloseVideo(AVMuxVideo *muxVideo) {
 
 void RGYOutputAvcodec::CloseFormat(AVMuxFormat *muxFormat) {
     if (muxFormat->formatCtx) {
+        if (m_segmenter) {
+            //残りのパケットを最後のセグメントとして書き出し、プレイリストを確定させる
+            //av_write_trailerで書き出されるmfraはセグメントには含めない
+            if (!muxFormat->streamError && m_Mux.format.fileHeaderWritten
+                && FlushFragment() == RGY_ERR_NONE && m_segmenter->segmentOpened()) {
+                muxFormat->streamError |= m_segmenter->finishSegment(m_segmentEnd) != RGY_ERR_NONE;
+            }
+            muxFormat->streamError |= m_segmenter->close() != RGY_ERR_NONE;
+        }
         if (!muxFormat->streamError && m_Mux.format.fileHeaderWritten) {
             av_write_trailer(muxFormat->formatCtx);
         }
 #if USE_CUSTOM_IO
-        if (!muxFormat->fpOutput) {
+        if (!muxFormat->fpOutput && !muxFormat->fileSink && !m_segmenter) {
 #endif
             avio_close(muxFormat->formatCtx->pb);
             AddMessage(RGY_LOG_DEBUG, _T("Closed AVIO Context.\n"));
@@ -161,6 +258,17 @@ void RGYOutputAvcodec::CloseFormat(AVMuxFormat *muxFormat) {
         fclose(muxFormat->fpOutput);
         AddMessage(RGY_LOG_DEBUG, _T("Closed File Pointer.\n"));
     }
+    if (muxFormat->fileSink) {
+        if (muxFormat->fileSink->close() != RGY_ERR_NONE) {
+            muxFormat->streamError = true;
+        }
+        delete muxFormat->fileSink;
+        AddMessage(RGY_LOG_DEBUG, _T("Closed file sink.\n"));
+    }
+    if (m_segmenter) {
+        m_segmenter.reset();
+        AddMessage(RGY_LOG_DEBUG, _T("Closed cmaf segmenter.\n"));
+    }
 
     if (muxFormat->AVOutBuffer) {
         av_free(muxFormat->AVOutBuffer);
@@ -176,14 +284,22 @@ void RGYOutputAvcodec::CloseFormat(AVMuxFormat *muxFormat) {
 
 void RGYOutputAvcodec::CloseQueues() {
 #if ENABLE_AVCODEC_OUT_THREAD
-    m_Mux.thread.thAudEncodeAbort = true;
+    for (auto& th : m_Mux.thread.thAudEncode) {
+        th->abort = true;
+    }
     m_Mux.thread.thAudProcessAbort = true;
     m_Mux.thread.abortOutput = true;
+    //ここ以降に解放されたAVPacketのデータ領域は、キューに戻さずそのまま解放する
+    m_Mux.thread.videoBufferReturn = false;
     m_Mux.thread.qVideobitstream.close();
     m_Mux.thread.qVideobitstreamFreeI.close([](RGYBitstream *pBitstream) { pBitstream->clear(); });
     m_Mux.thread.qVideobitstreamFreePB.close([](RGYBitstream *pBitstream) { pBitstream->clear(); });
     m_Mux.thread.qAudioPacketOut.close();
-    m_Mux.thread.qAudioFrameEncode.close();
+    for (auto& th : m_Mux.thread.thAudEncode) {
+        th->qFrame.close();
+        th->qPacket.close();
+    }
+    m_Mux.thread.audEncodeOrder.clear();
     m_Mux.thread.qAudioPacketProcess.close();
     AddMessage(RGY_LOG_DEBUG, _T("closed queues...\n"));
 #endif
@@ -191,18 +307,9 @@ void RGYOutputAvcodec::CloseQueues() {
 
 void RGYOutputAvcodec::CloseThread() {
 #if ENABLE_AVCODEC_OUT_THREAD
-    m_Mux.thread.thAudEncodeAbort = true;
-    if (m_Mux.thread.thAudEncode.joinable()) {
-        //下記同様に、m_Mux.thread.heEventThOutputClosingがセットされるまで、
-        //SetEvent(m_Mux.thread.heEventThOutputPktAdded)を実行し続ける必要がある。
-        while (WAIT_TIMEOUT == WaitForSingleObject(m_Mux.thread.heEventClosingAudEncode, 100)) {
-            SetEvent(m_Mux.thread.heEventPktAddedAudEncode);
-        }
-        m_Mux.thread.thAudEncode.join();
-        CloseEvent(m_Mux.thread.heEventPktAddedAudEncode);
-        CloseEvent(m_Mux.thread.heEventClosingAudEncode);
-        AddMessage(RGY_LOG_DEBUG, _T("closed audio encode thread...\n"));
-    }
+    //音声処理スレッドは終了時に音声エンコードスレッドの処理完了を待つので、
+    //音声処理スレッド -> 音声エンコードスレッドの順に停止する
+    //音声エンコードスレッドへの終了の通知は、フレームをすべて渡し終えた音声処理スレッドが行う
     m_Mux.thread.thAudProcessAbort = true;
     if (m_Mux.thread.thAudProcess.joinable()) {
         //下記同様に、m_Mux.thread.heEventThOutputClosingがセットされるまで、
@@ -215,6 +322,22 @@ void RGYOutputAvcodec::CloseThread() {
         CloseEvent(m_Mux.thread.heEventClosingAudProcess);
         AddMessage(RGY_LOG_DEBUG, _T("closed audio process thread...\n"));
     }
+    for (auto& th : m_Mux.thread.thAudEncode) {
+        th->abort = true;
+        if (th->thread.joinable()) {
+            //下記同様に、th->heEventClosingがセットされるまで、
+            //SetEvent(th->heEventPktAdded)を実行し続ける必要がある。
+            while (WAIT_TIMEOUT == WaitForSingleObject(th->heEventClosing, 100)) {
+                SetEvent(th->heEventPktAdded);
+            }
+            th->thread.join();
+            CloseEvent(th->heEventPktAdded);
+            CloseEvent(th->heEventClosing);
+        }
+    }
+    if (m_Mux.thread.thAudEncode.size() > 0) {
+        AddMessage(RGY_LOG_DEBUG, _T("closed audio encode thread(s)...\n"));
+    }
     m_Mux.thread.abortOutput = true;
     if (m_Mux.thread.thOutput.joinable()) {
         //ここに来た時に、まだメインスレッドがループ中の可能性がある
@@ -232,9 +355,10 @@ void RGYOutputAvcodec::CloseThread() {
         AddMessage(RGY_LOG_DEBUG, _T("closed output thread...\n"));
     }
     CloseQueues();
+    m_Mux.thread.thAudEncode.clear();
+    m_Mux.thread.audEncodeThreadIdx.clear();
     m_Mux.thread.abortOutput = false;
     m_Mux.thread.thAudProcessAbort = false;
-    m_Mux.thread.thAudEncodeAbort = false;
 #endif
 }
 
@@ -246,6 +370,7 @@ void RGYOutputAvcodec::Close() {
         CloseAudio(&m_Mux.audio[i]);
     }
     m_Mux.audio.clear();
+    m_audioEncodeCache.reset();
     for (int i = 0; i < (int)m_Mux.other.size(); i++) {
         CloseOther(&m_Mux.other[i]);
     }
@@ -1317,6 +1442,56 @@ RGY_ERR RGYOutputAvcodec::InitAudio(AVMuxAudio *muxAudio, AVOutputStreamPrm *inp
     return RGY_ERR_NONE;
 }
 
+std::string RGYOutputAvcodec::AudioEncodeSignature(const AVOutputStreamPrm *inputAudio, const AvcodecWriterPrm *prm) {
+    //コピーするトラックは共有しない
+    if (avcodecIsCopy(inputAudio->encodeCodec)) {
+        return "";
+    }
+    const int subStream = inputAudio->src.subStreamId;
+    //入力ストリームは同じ入力を共有している出力間で同一のものとなる
+    std::string signature = strsprintf("stream=%p,track=%d,ch=%llx:%llx", inputAudio->src.stream, inputAudio->src.trackId,
+        (unsigned long long)inputAudio->src.streamChannelSelect[subStream], (unsigned long long)inputAudio->src.streamChannelOut[subStream]);
+    signature += ",dec=" + tchar_to_string(inputAudio->decodeCodecPrm);
+    signature += ",bsf=" + tchar_to_string(inputAudio->bsf);
+    signature += ",filter=" + tchar_to_string(inputAudio->filter);
+    signature += ",codec=" + tchar_to_string(inputAudio->encodeCodec);
+    signature += ",prm=" + tchar_to_string(inputAudio->encodeCodecPrm);
+    signature += ",profile=" + tchar_to_string(inputAudio->encodeCodecProfile);
+    signature += strsprintf(",bitrate=%d,samplerate=%d,resampler=%d,ignore_error=%u,global_header=%d",
+        inputAudio->bitrate, inputAudio->samplingRate, prm->audioResampler, prm->audioIgnoreDecodeError,
+        (m_Mux.format.outputFmt->flags & AVFMT_GLOBALHEADER) ? 1 : 0);
+    for (const auto& trim : prm->trimList) {
+        signature += strsprintf(",trim=%d:%d", trim.start, trim.fin);
+    }
+    return signature;
+}
+
+void RGYOutputAvcodec::InitAudioEncodeShare(const vector<std::string>& signatures) {
+    for (int i = 0; i < (int)m_Mux.audio.size(); i++) {
+        auto muxAudio = &m_Mux.audio[i];
+        if (signatures[i].length() == 0 || !muxAudio->outCodecEncodeCtx) {
+            continue;
+        }
+        //同じ出力内の先行するトラックと一致すれば、そのエンコード結果を受け取る
+        for (int j = 0; j < i; j++) {
+            if (signatures[j] == signatures[i] && m_Mux.audio[j].encodeShareSrc == nullptr) {
+                muxAudio->encodeShareSrc = &m_Mux.audio[j];
+                AddMessage(RGY_LOG_DEBUG, _T("audio track %d.%d: share encode result of track %d.%d.\n"),
+                    trackID(muxAudio->inTrackId), muxAudio->inSubStream, trackID(m_Mux.audio[j].inTrackId), m_Mux.audio[j].inSubStream);
+                break;
+            }
+        }
+        if (muxAudio->encodeShareSrc || !m_audioEncodeCache) {
+            continue;
+        }
+        //他の出力と共有する
+        auto share = m_audioEncodeCache->join(signatures[i], &muxAudio->encodeShareId);
+        muxAudio->encodeShare = share.get();
+        AddMessage(RGY_LOG_DEBUG, _T("audio track %d.%d: %s encode result with other outputs.\n"),
+            trackID(muxAudio->inTrackId), muxAudio->inSubStream, (muxAudio->encodeShareId < 0) ? _T("publish") : _T("receive"));
+    }
+}
+
 RGY_ERR RGYOutputAvcodec::InitOther(AVMuxOther *muxSub, AVOutputStreamPrm *inputStream) {
     const auto mediaType = (inputStream->asdata) ? AVMEDIA_TYPE_UNKNOWN : trackMediaType(inputStream->src.trackId);
     const auto mediaTypeStr = char_to_tstring(av_get_media_type_string(mediaType));
@@ -1619,6 +1794,17 @@ RGY_ERR RGYOutputAvcodec::Init(const TCHAR *strFileName, const VideoInfo *videoO
     }
     m_Mux.format.isMatroska = 0 == strcmp(m_Mux.format.formatCtx->oformat->name, "matroska");
     m_Mux.format.disableMp4Opt = prm->disableMp4Opt;
+    if (prm->cmaf.enable) {
+#if USE_CUSTOM_IO
+        if (m_Mux.format.isPipe || usingAVProtocols(filename, 1) || 0 != strcmp(m_Mux.format.formatCtx->oformat->name, "mp4")) {
+            AddMessage(RGY_LOG_ERROR, _T("--cmaf requires mp4 output to a local file name.\n"));
+            return RGY_ERR_UNSUPPORTED;
+        }
+#else
+        AddMessage(RGY_LOG_ERROR, _T("--cmaf is not supported in this build.\n"));
+        return RGY_ERR_UNSUPPORTED;
+#endif //#if USE_CUSTOM_IO
+    }
 
 #if USE_CUSTOM_IO
     if (m_Mux.format.isPipe || usingAVProtocols(filename, 1) || (m_Mux.format.formatCtx->oformat->flags & (AVFMT_NEEDNUMBER | AVFMT_NOFILE))) {
@@ -1675,18 +1861,41 @@ RGY_ERR RGYOutputAvcodec::Init(const TCHAR *strFileName, const VideoInfo *videoO
         AddMessage(RGY_LOG_DEBUG, _T("allocated internal buffer %d MB.\n"), m_Mux.format.AVOutBufferSize / (1024 * 1024));
         CreateDirectoryRecursive(PathRemoveFileSpecFixed(strFileName).second.c_str());
 
-        //"movflags:faststart"にするには、共有モードで開けるようにする必要がある
-        m_Mux.format.fpOutput = _tfsopen(strFileName, _T("wb"), _SH_DENYWR);
-        if (m_Mux.format.fpOutput == NULL) {
-            errno_t error = errno;
-            AddMessage(RGY_LOG_ERROR, _T("failed to open %soutput file \"%s\": %s.\n"), (videoOutputInfo) ? _T("") : _T("audio "), strFileName, _tcserror(error));
-            return RGY_ERR_FILE_OPEN; // Couldn't open file
-        }
-        if (0 < (m_Mux.format.outputBufferSize = (uint32_t)malloc_degeneracy((void **)&m_Mux.format.outputBuffer, m_Mux.format.outputBufferSize, 1024 * 1024))) {
-            setvbuf(m_Mux.format.fpOutput, m_Mux.format.outputBuffer, _IOFBF, m_Mux.format.outputBufferSize);
-            AddMessage(RGY_LOG_DEBUG, _T("set external output buffer %d MB.\n"), m_Mux.format.outputBufferSize / (1024 * 1024));
+        if (prm->cmaf.enable) {
+            //出力ファイル名をもとに、初期化セグメント・各セグメント・プレイリストに振り分ける
+            m_segmenter = std::unique_ptr<RGYOutputSegmenter>(new RGYOutputSegmenter(m_printMes));
+            auto sts = m_segmenter->init(strFileName, prm->cmaf);
+            if (sts != RGY_ERR_NONE) {
+                AddMessage(RGY_LOG_ERROR, _T("failed to init cmaf output \"%s\".\n"), strFileName);
+                return sts;
+            }
+            m_cmafChunkFrames = prm->cmaf.chunkFrames;
+            AddMessage(RGY_LOG_DEBUG, _T("opened cmaf segmenter.\n"));
+        } else if (prm->outputSink != RGY_OUTPUT_SINK_STDIO) {
+            //書き込みスレッドで非同期に書き込む
+            //出力バッファ0の指定でもブロック単位のバッファリングは必要なので、最低1MBは確保する
+            m_Mux.format.fileSink = createFileSink(prm->outputSink, m_printMes, (std::max<uint32_t>)(m_Mux.format.outputBufferSize, 1024 * 1024), prm->queueInfo).release();
+            auto sts = m_Mux.format.fileSink->open(strFileName);
+            if (sts != RGY_ERR_NONE) {
+                AddMessage(RGY_LOG_ERROR, _T("failed to open %soutput file \"%s\".\n"), (videoOutputInfo) ? _T("") : _T("audio "), strFileName);
+                return sts;
+            }
+            AddMessage(RGY_LOG_DEBUG, _T("opened output file by %s sink.\n"), m_Mux.format.fileSink->name());
+        } else {
+            //"movflags:faststart"にするには、共有モードで開けるようにする必要がある
+            m_Mux.format.fpOutput = _tfsopen(strFileName, _T("wb"), _SH_DENYWR);
+            if (m_Mux.format.fpOutput == NULL) {
+                errno_t error = errno;
+                AddMessage(RGY_LOG_ERROR, _T("failed to open %soutput file \"%s\": %s.\n"), (videoOutputInfo) ? _T("") : _T("audio "), strFileName, _tcserror(error));
+                return RGY_ERR_FILE_OPEN; // Couldn't open file
+            }
+            if (0 < (m_Mux.format.outputBufferSize = (uint32_t)malloc_degeneracy((void **)&m_Mux.format.outputBuffer, m_Mux.format.outputBufferSize, 1024 * 1024))) {
+                setvbuf(m_Mux.format.fpOutput, m_Mux.format.outputBuffer, _IOFBF, m_Mux.format.outputBufferSize);
+                AddMessage(RGY_LOG_DEBUG, _T("set external output buffer %d MB.\n"), m_Mux.format.outputBufferSize / (1024 * 1024));
+            }
         }
-        if (NULL == (m_Mux.format.formatCtx->pb = avio_alloc_context(m_Mux.format.AVOutBuffer, m_Mux.format.AVOutBufferSize, 1, this, funcReadPacket, funcWritePacket, funcSeek))) {
+        //セグメント出力は前から順に書き出すだけなので、seekできないものとしてmuxerに扱わせる
+        if (NULL == (m_Mux.format.formatCtx->pb = avio_alloc_context(m_Mux.format.AVOutBuffer, m_Mux.format.AVOutBufferSize, 1, this, funcReadPacket, funcWritePacket, (m_segmenter) ? nullptr : funcSeek))) {
             AddMessage(RGY_LOG_ERROR, _T("failed to alloc avio context.\n"));
             return RGY_ERR_NULL_PTR;
         }
@@ -1706,6 +1915,8 @@ RGY_ERR RGYOutputAvcodec::Init(const TCHAR *strFileName, const VideoInfo *videoO
     const int audioStreamCount = (int)count_if(prm->inputStreamList.begin(), prm->inputStreamList.end(), [](AVOutputStreamPrm prm) { return trackMediaType(prm.src.trackId) == AVMEDIA_TYPE_AUDIO; });
     if (audioStreamCount) {
         m_Mux.audio.resize(audioStreamCount, { 0 });
+        m_audioEncodeCache = prm->audioEncodeCache;
+        vector<std::string> audioEncodeSignatures;
         int iAudioIdx = 0;
         for (int iStream = 0; iStream < (int)prm->inputStreamList.size(); iStream++) {
             if (trackMediaType(prm->inputStreamList[iStream].src.trackId) == AVMEDIA_TYPE_AUDIO) {
@@ -1723,6 +1934,8 @@ RGY_ERR RGYOutputAvcodec::Init(const TCHAR *strFileName, const VideoInfo *videoO
                         return RGY_ERR_UNDEFINED_BEHAVIOR;
                     }
                 }
+                //InitAudioでencodeCodecが書き換えられるので、先に作成しておく
+                audioEncodeSignatures.push_back(AudioEncodeSignature(&prm->inputStreamList[iStream], prm));
                 RGY_ERR sts = InitAudio(&m_Mux.audio[iAudioIdx], &prm->inputStreamList[iStream], prm->audioIgnoreDecodeError);
                 if (sts != RGY_ERR_NONE) {
                     return sts;
@@ -1732,6 +1945,7 @@ RGY_ERR RGYOutputAvcodec::Init(const TCHAR *strFileName, const VideoInfo *videoO
                 iAudioIdx++;
             }
         }
+        InitAudioEncodeShare(audioEncodeSignatures);
     }
     const int otherStreamCount = (int)count_if(prm->inputStreamList.begin(), prm->inputStreamList.end(), [](AVOutputStreamPrm prm) {
         const auto type = trackMediaType(prm.src.trackId);
@@ -1786,8 +2000,14 @@ RGY_ERR RGYOutputAvcodec::Init(const TCHAR *strFileName, const VideoInfo *videoO
         prm->threadOutput = 1;
     }
 #if ENABLE_AVCODEC_AUDPROCESS_THREAD
+    //エンコードする音声トラックの数
+    //エンコード結果を受け取るだけのトラックは除く
+    const int audioEncodeTracks = (int)std::count_if(m_Mux.audio.begin(), m_Mux.audio.end(), [](const AVMuxAudio& muxAudio) { return muxAudio.outCodecEncodeCtx != nullptr && !audioEncodeShared(&muxAudio); });
     if (prm->threadAudio == RGY_AUDIO_THREAD_AUTO) {
-        prm->threadAudio = 0;
+        //複数の音声トラックをエンコードする場合は、音声処理スレッドとトラックごとの音声エンコードスレッドを使用する
+        //ただし、トラック数が多くても映像側の処理を圧迫しないよう、音声エンコードスレッドはAUDIO_ENCODE_THREAD_AUTO_MAXまでとし、
+        //それを超えるトラックは各スレッドに順に割り当てる
+        prm->threadAudio = (audioEncodeTracks >= 2) ? 1 + std::min(audioEncodeTracks, AUDIO_ENCODE_THREAD_AUTO_MAX) : 0;
     }
     m_Mux.thread.enableAudProcessThread = prm->threadOutput > 0 && prm->threadAudio > 0;
     m_Mux.thread.enableAudEncodeThread  = prm->threadOutput > 0 && prm->threadAudio > 1;
@@ -1798,28 +2018,45 @@ RGY_ERR RGYOutputAvcodec::Init(const TCHAR *strFileName, const VideoInfo *videoO
         const int audioQueueCapacity = 4096;
         m_Mux.thread.abortOutput = false;
         m_Mux.thread.thAudProcessAbort = false;
-        m_Mux.thread.thAudEncodeAbort = false;
         m_Mux.thread.qAudioPacketOut.init(16384, audioQueueCapacity * std::max(1, (int)m_Mux.audio.size())); //字幕のみコピーするときのため、最低でもある程度は確保する
         m_Mux.thread.qVideobitstream.init(4096, (std::max)(256, (m_Mux.video.outputFps.den) ? m_Mux.video.outputFps.num * 4 / m_Mux.video.outputFps.den : 0));
         m_Mux.thread.qVideobitstreamFreeI.init(256);
         m_Mux.thread.qVideobitstreamFreePB.init(3840);
+        m_Mux.thread.videoBufferReturn = true;
         m_Mux.thread.heEventPktAddedOutput = CreateEvent(NULL, TRUE, FALSE, NULL);
         m_Mux.thread.heEventClosingOutput  = CreateEvent(NULL, TRUE, FALSE, NULL);
         m_Mux.thread.thOutput = std::thread(&RGYOutputAvcodec::WriteThreadFunc, this);
 #if ENABLE_AVCODEC_AUDPROCESS_THREAD
         if (m_Mux.thread.enableAudProcessThread) {
+            if (m_Mux.thread.enableAudEncodeThread) {
+                //エンコードするトラックを音声エンコードスレッドに順に割り当てる
+                const int audioEncodeThreads = clamp(prm->threadAudio - 1, 1, std::max(audioEncodeTracks, 1));
+                m_Mux.thread.audEncodeThreadIdx.resize(m_Mux.audio.size(), -1);
+                for (int i = 0, encTrack = 0; i < (int)m_Mux.audio.size(); i++) {
+                    if (m_Mux.audio[i].outCodecEncodeCtx && !audioEncodeShared(&m_Mux.audio[i])) {
+                        m_Mux.thread.audEncodeThreadIdx[i] = (encTrack++) % audioEncodeThreads;
+                    }
+                }
+                AddMessage(RGY_LOG_DEBUG, _T("starting %d audio encode thread(s)...\n"), audioEncodeThreads);
+                for (int i = 0; i < audioEncodeThreads; i++) {
+                    auto th = std::make_unique<AVMuxAudioEncodeThread>();
+                    th->abort = false;
+                    th->qFrame.init(16384, audioQueueCapacity * 2, 4);
+                    //qPacketは音声処理スレッドが取り出すので、上限を設けるとqFrameへの追加と待ち合ってしまう
+                    th->qPacket.init(4096);
+                    th->heEventPktAdded = CreateEvent(NULL, TRUE, FALSE, NULL);
+                    th->heEventClosing  = CreateEvent(NULL, TRUE, FALSE, NULL);
+                    m_Mux.thread.thAudEncode.push_back(std::move(th));
+                }
+                for (int i = 0; i < audioEncodeThreads; i++) {
+                    m_Mux.thread.thAudEncode[i]->thread = std::thread(&RGYOutputAvcodec::ThreadFuncAudEncodeThread, this, i);
+                }
+            }
             AddMessage(RGY_LOG_DEBUG, _T("starting audio process thread...\n"));
             m_Mux.thread.qAudioPacketProcess.init(16384, audioQueueCapacity * std::max(2, (int)m_Mux.audio.size()), 4);
             m_Mux.thread.heEventPktAddedAudProcess = CreateEvent(NULL, TRUE, FALSE, NULL);
             m_Mux.thread.heEventClosingAudProcess  = CreateEvent(NULL, TRUE, FALSE, NULL);
             m_Mux.thread.thAudProcess = std::thread(&RGYOutputAvcodec::ThreadFuncAudThread, this);
-            if (m_Mux.thread.enableAudEncodeThread) {
-                AddMessage(RGY_LOG_DEBUG, _T("starting audio encode thread...\n"));
-                m_Mux.thread.qAudioFrameEncode.init(16384, audioQueueCapacity * std::max(2, (int)m_Mux.audio.size()), 4);
-                m_Mux.thread.heEventPktAddedAudEncode = CreateEvent(NULL, TRUE, FALSE, NULL);
-                m_Mux.thread.heEventClosingAudEncode  = CreateEvent(NULL, TRUE, FALSE, NULL);
-                m_Mux.thread.thAudEncode = std::thread(&RGYOutputAvcodec::ThreadFuncAudEncodeThread, this);
-            }
         }
 #endif //#if ENABLE_AVCODEC_AUDPROCESS_THREAD
     }
@@ -1906,10 +2143,16 @@ RGY_ERR RGYOutputAvcodec::WriteFileHeader(const RGYBitstream *bitstream) {
     if (m_Mux.video.streamOut) {
         if (   0 == strcmp(m_Mux.format.formatCtx->oformat->name, "mp4")
             || 0 == strcmp(m_Mux.format.formatCtx->oformat->name, "mov")) {
-            av_dict_set(&m_Mux.format.headerOptions, "brand", "mp42", 0);
-            AddMessage(RGY_LOG_DEBUG, _T("set format brand \"mp42\".\n"));
+            if (m_segmenter) {
+                //初期化セグメント (ftyp+moov) のあとは、FlushFragmentを呼ぶたびにmoof+mdatを書き出す
+                av_dict_set(&m_Mux.format.headerOptions, "movflags", "frag_custom+empty_moov+default_base_moof", 0);
+                AddMessage(RGY_LOG_DEBUG, _T("set frag_custom+empty_moov+default_base_moof.\n"));
+            } else {
+                av_dict_set(&m_Mux.format.headerOptions, "brand", "mp42", 0);
+                AddMessage(RGY_LOG_DEBUG, _T("set format brand \"mp42\".\n"));
+            }
 
-            if (!m_Mux.format.disableMp4Opt) {
+            if (!m_Mux.format.disableMp4Opt && !m_segmenter) {
                 //moovを先頭に
                 av_dict_set(&m_Mux.format.headerOptions, "movflags", "faststart", 0);
                 AddMessage(RGY_LOG_DEBUG, _T("set faststart.\n"));
@@ -1934,6 +2177,27 @@ RGY_ERR RGYOutputAvcodec::WriteFileHeader(const RGYBitstream *bitstream) {
 
     av_dump_format(m_Mux.format.formatCtx, 0, tchar_to_string(m_Mux.format.filename, CP_UTF8).c_str(), 1);
 
+    if (m_segmenter) {
+        std::string codecs;
+        for (uint32_t i = 0; i < m_Mux.format.formatCtx->nb_streams; i++) {
+            const auto str = codecs_rfc6381(m_Mux.format.formatCtx->streams[i]->codecpar);
+            if (str.length() > 0) {
+                codecs += ((codecs.length() > 0) ? "," : "") + str;
+            }
+        }
+        if (m_Mux.video.streamOut) {
+            m_segmenter->setStreamInfo(codecs, m_Mux.video.streamOut->codecpar->width, m_Mux.video.streamOut->codecpar->height,
+                rgy_rational<int>(m_Mux.video.outputFps.num, m_Mux.video.outputFps.den));
+        }
+        //ftyp+moovを初期化セグメントとして閉じる
+        avio_flush(m_Mux.format.formatCtx->pb);
+        if (m_Mux.format.streamError || m_segmenter->finishInit() != RGY_ERR_NONE) {
+            m_Mux.format.streamError = true;
+            return RGY_ERR_UNKNOWN;
+        }
+        AddMessage(RGY_LOG_DEBUG, _T("wrote init segment, codecs=%s.\n"), char_to_tstring(codecs).c_str());
+    }
+
     //frame_sizeを表示
     for (const auto& audio : m_Mux.audio) {
         if (audio.outCodecDecodeCtx || audio.outCodecEncodeCtx) {
@@ -1950,6 +2214,61 @@ RGY_ERR RGYOutputAvcodec::WriteFileHeader(const RGYBitstream *bitstream) {
     return RGY_ERR_NONE;
 }
 
+int RGYOutputAvcodec::MuxWritePacket(AVPacket *pkt) {
+    if (m_segmenter) {
+        //CMAF出力時は、muxerでinterleaveせずにそのまま渡す
+        //interleave待ちのパケットが残ったままfragmentを区切ると、前のセグメントのパケットが次のセグメントに入ってしまう
+        //fragmented mp4ではfragmentごとにトラック単位でまとめて書き出すので、トラック間の順序は問わない
+        const int ret = av_write_frame(m_Mux.format.formatCtx, pkt);
+        av_packet_unref(pkt);
+        return ret;
+    }
+    return av_interleaved_write_frame(m_Mux.format.formatCtx, pkt);
+}
+
+RGY_ERR RGYOutputAvcodec::FlushFragment() {
+    //MuxWritePacketで渡したパケットはすべてmuxerが保持しているので、そのままfragmentとして書き出す
+    int ret = av_write_frame(m_Mux.format.formatCtx, nullptr);
+    avio_flush(m_Mux.format.formatCtx->pb);
+    if (ret < 0 || m_Mux.format.streamError) {
+        AddMessage(RGY_LOG_ERROR, _T("failed to flush fragment: %s.\n"), qsv_av_err2str(ret).c_str());
+        m_Mux.format.streamError = true;
+        return RGY_ERR_UNKNOWN;
+    }
+    return RGY_ERR_NONE;
+}
+
+RGY_ERR RGYOutputAvcodec::WriteSegmentBoundary(bool isIDR, int64_t pts, int64_t duration) {
+    const auto streamTimebase = m_Mux.video.streamOut->time_base;
+    const auto segmentTimebase = av_make_q(1, RGYOutputSegmenter::TIMESCALE);
+    const int64_t start = av_rescale_q(pts, streamTimebase, segmentTimebase);
+    const bool newSegment = isIDR || !m_segmenter->segmentOpened();
+    const bool newChunk = m_cmafChunkFrames > 0 && m_segmentChunkFrameCount >= m_cmafChunkFrames;
+    if (m_segmenter->segmentOpened() && (newSegment || newChunk)) {
+        auto sts = FlushFragment();
+        if (sts != RGY_ERR_NONE) {
+            return sts;
+        }
+        //IDRのptsを前のセグメントの終端とする
+        sts = (newSegment) ? m_segmenter->finishSegment(start) : m_segmenter->flushChunk();
+        if (sts != RGY_ERR_NONE) {
+            m_Mux.format.streamError = true;
+            return sts;
+        }
+        m_segmentChunkFrameCount = 0;
+    }
+    if (newSegment) {
+        auto sts = m_segmenter->startSegment(start);
+        if (sts != RGY_ERR_NONE) {
+            m_Mux.format.streamError = true;
+            return sts;
+        }
+    }
+    m_segmentChunkFrameCount++;
+    m_segmentEnd = (std::max)(m_segmentEnd, av_rescale_q(pts + duration, streamTimebase, segmentTimebase));
+    return RGY_ERR_NONE;
+}
+
 int64_t RGYOutputAvcodec::AdjustTimestampTrimmed(int64_t nTimeIn, AVRational timescaleIn, AVRational timescaleOut, bool lastValidFrame) {
     AVRational timescaleFps = av_inv_q(m_Mux.video.outputFps);
     const int vidFrameIdx = (int)av_rescale_q(nTimeIn, timescaleIn, timescaleFps);
@@ -2084,9 +2403,10 @@ RGY_ERR RGYOutputAvcodec::WriteNextFrame(RGYBitstream *bitstream) {
         //IフレームかPBフレームかでサイズが大きく違うため、空きのmfxBistreamは異なるキューで管理する
         auto& qVideoQueueFree = (bFrameI) ? m_Mux.thread.qVideobitstreamFreeI : m_Mux.thread.qVideobitstreamFreePB;
         //空いているmfxBistreamを取り出す
-        if (!qVideoQueueFree.front_copy_and_pop_no_lock(&copyStream) || copyStream.bufsize() < bitstream->size()) {
+        if (!qVideoQueueFree.front_copy_and_pop_no_lock(&copyStream) || copyStream.bufsize() < bitstream->size() + AV_INPUT_BUFFER_PADDING_SIZE) {
             //空いているmfxBistreamがない、あるいはそのバッファサイズが小さい場合は、領域を取り直す
-            const auto allocate_bytes = bitstream->size() * ((bFrameI | bFrameP) ? 2 : 8);
+            //出力時にそのままAVPacketとして渡せるよう、AV_INPUT_BUFFER_PADDING_SIZE分の余裕を確保しておく
+            const auto allocate_bytes = bitstream->size() * ((bFrameI | bFrameP) ? 2 : 8) + AV_INPUT_BUFFER_PADDING_SIZE;
             if (RGY_ERR_NONE != copyStream.init(allocate_bytes)) {
                 AddMessage(RGY_LOG_ERROR, _T("Failed to allocate memory for video bitstream output buffer, %sB.\n"), allocate_bytes);
                 m_Mux.format.streamError = true;
@@ -2156,6 +2476,7 @@ RGY_ERR RGYOutputAvcodec::VidCheckStreamAVParser(RGYBitstream *pBitstream) {
 #pragma warning (push)
 #pragma warning (disable: 4127) //warning C4127: 条件式が定数です。
 RGY_ERR RGYOutputAvcodec::WriteNextFrameInternal(RGYBitstream *bitstream, int64_t *writtenDts) {
+    RGY_TRACE_SCOPE("mux_video", -1);
     if (!m_Mux.format.fileHeaderWritten) {
 #if ENCODER_QSV
         //HEVCエンコードでは、DecodeTimeStampが正しく設定されない
@@ -2166,29 +2487,32 @@ RGY_ERR RGYOutputAvcodec::WriteNextFrameInternal(RGYBitstream *bitstream, int64_
         m_Mux.video.dtsUnavailable = true;
 #endif
         if (m_VideoOutputInfo.codec == RGY_CODEC_HEVC && m_Mux.video.seiNal.size() > 0) {
+            //元のデータを退避し、そこを指すセグメントの並びから一度で組み立てる
+            //(appendを繰り返すと、バッファが足りなくなるたびに再確保とコピーが発生する)
             RGYBitstream bsCopy = RGYBitstreamInit();
             bsCopy.copy(bitstream);
-            std::vector<nal_info> nal_list = parse_nal_unit_hevc(bsCopy.data(), bsCopy.size());
-            const auto hevc_vps_nal = std::find_if(nal_list.begin(), nal_list.end(), [](nal_info info) { return info.type == NALU_HEVC_VPS; });
-            const auto hevc_sps_nal = std::find_if(nal_list.begin(), nal_list.end(), [](nal_info info) { return info.type == NALU_HEVC_SPS; });
-            const auto hevc_pps_nal = std::find_if(nal_list.begin(), nal_list.end(), [](nal_info info) { return info.type == NALU_HEVC_PPS; });
-            const bool header_check = (nal_list.end() != hevc_vps_nal) && (nal_list.end() != hevc_sps_nal) && (nal_list.end() != hevc_pps_nal);
-            if (header_check) {
-                bitstream->setSize(0);
-                bitstream->setOffset(0);
-                bitstream->append(hevc_vps_nal->ptr, hevc_vps_nal->size);
-                bitstream->append(hevc_sps_nal->ptr, hevc_sps_nal->size);
-                bitstream->append(hevc_pps_nal->ptr, hevc_pps_nal->size);
-                bitstream->append(&m_Mux.video.seiNal);
-                for (const auto& nal : nal_list) {
-                    if (nal.type != NALU_HEVC_VPS && nal.type != NALU_HEVC_SPS && nal.type != NALU_HEVC_PPS) {
-                        bitstream->append(nal.ptr, nal.size);
-                    }
-                }
-            } else {
+            auto& nal_list = m_VideoNalList;
+            parse_nal_unit_hevc(nal_list, bsCopy.data(), bsCopy.size());
+            std::vector<RGYBitstreamSegment> segments;
+            if (!hevc_insert_sei_segments(segments, nal_list, m_Mux.video.seiNal.data(), m_Mux.video.seiNal.size())) {
+                bsCopy.clear();
                 AddMessage(RGY_LOG_ERROR, _T("Unexpected HEVC header.\n"));
                 return RGY_ERR_UNDEFINED_BEHAVIOR;
             }
+            const auto new_size = bitstream_segments_size(segments);
+            if (bitstream->bufsize() < new_size + AV_INPUT_BUFFER_PADDING_SIZE) {
+                auto sts = bitstream->init(new_size + AV_INPUT_BUFFER_PADDING_SIZE);
+                if (sts != RGY_ERR_NONE) {
+                    bsCopy.clear();
+                    AddMessage(RGY_LOG_ERROR, _T("Failed to allocate memory for video header.\n"));
+                    return sts;
+                }
+            }
+            bitstream_segments_gather(bitstream->bufptr(), segments);
+            bitstream->setOffset(0);
+            bitstream->setSize(new_size);
+            bsCopy.clear();
+            nal_list.clear();
             m_Mux.video.seiNal.clear();
         }
         RGY_ERR sts = WriteFileHeader(bitstream);
@@ -2226,15 +2550,16 @@ RGY_ERR RGYOutputAvcodec::WriteNextFrameInternal(RGYBitstream *bitstream, int64_
     VidCheckStreamAVParser(bitstream);
 #endif //#if ENCODER_VCEENC
 
-    std::vector<nal_info> nal_list;
+    auto& nal_list = m_VideoNalList;
+    nal_list.clear();
     if (m_Mux.video.bsfc) {
         int target_nal = 0;
         if (m_VideoOutputInfo.codec == RGY_CODEC_HEVC) {
             target_nal = NALU_HEVC_SPS;
-            nal_list = parse_nal_unit_hevc(bitstream->data(), bitstream->size());
+            parse_nal_unit_hevc(nal_list, bitstream->data(), bitstream->size());
         } else if (m_VideoOutputInfo.codec == RGY_CODEC_H264) {
             target_nal = NALU_H264_SPS;
-            nal_list = parse_nal_unit_h264(bitstream->data(), bitstream->size());
+            parse_nal_unit_h264(nal_list, bitstream->data(), bitstream->size());
         }
         auto sps_nal = std::find_if(nal_list.begin(), nal_list.end(), [target_nal](nal_info info) { return info.type == target_nal; });
         if (sps_nal != nal_list.end()) {
@@ -2278,7 +2603,7 @@ RGY_ERR RGYOutputAvcodec::WriteNextFrameInternal(RGYBitstream *bitstream, int64_
     if (m_Mux.video.streamOut->codecpar->field_order != AV_FIELD_PROGRESSIVE) {
         if (m_VideoOutputInfo.codec == RGY_CODEC_H264) {
             if (nal_list.size() == 0) {
-                nal_list = parse_nal_unit_h264(bitstream->data(), bitstream->size());
+                parse_nal_unit_h264(nal_list, bitstream->data(), bitstream->size());
             }
             //インタレ保持の際、IDRかどうかのフラグが正しく設定されていないことがある
             //どちらかのフィールドがIDRならIDRのフラグを立てる
@@ -2289,11 +2614,38 @@ RGY_ERR RGYOutputAvcodec::WriteNextFrameInternal(RGYBitstream *bitstream, int64_
         }
     }
 
+    //インタレ保持の際、IDRかどうかのフラグが正しく設定されていないことがある
+    //どちらかのフィールドがIDRならIDRのフラグを立ててているので、それを参照する
+    const auto frameType = (isIDR) ? RGY_FRAMETYPE_IDR : bitstream->frametype();
+
     AVPacket pkt = { 0 };
     av_init_packet(&pkt);
-    av_new_packet(&pkt, (int)bitstream->size());
-    memcpy(pkt.data, bitstream->data(), bitstream->size());
-    pkt.size = (int)bitstream->size();
+#if ENABLE_AVCODEC_OUT_THREAD
+    //出力スレッドを使用する場合、bitstreamは空きキューから取得したデータ領域なので、コピーせずそのままAVPacketに渡す
+    //データ領域はAVPacketの解放時 (interleave後の書き出し時) にVideoBufferReleaseで空きキューに戻される
+    const bool zeroCopy = m_Mux.thread.thOutput.joinable()
+        && bitstream->bufsize() >= bitstream->offset() + bitstream->size() + AV_INPUT_BUFFER_PADDING_SIZE;
+    if (zeroCopy) {
+        memset(bitstream->data() + bitstream->size(), 0, AV_INPUT_BUFFER_PADDING_SIZE);
+        auto bufferRef = new AVMuxVideoBufferRef();
+        bufferRef->muxer = this;
+        bufferRef->bitstream = *bitstream;
+        bufferRef->frameI = (frameType & (RGY_FRAMETYPE_IDR | RGY_FRAMETYPE_I)) != 0;
+        pkt.buf = av_buffer_create(bitstream->bufptr(), (int)bitstream->bufsize(), VideoBufferRelease, bufferRef, 0);
+        if (pkt.buf == nullptr) {
+            delete bufferRef;
+            AddMessage(RGY_LOG_ERROR, _T("Failed to allocate buffer ref for video packet.\n"));
+            return RGY_ERR_NULL_PTR;
+        }
+        pkt.data = bitstream->data();
+        pkt.size = (int)bitstream->size();
+    } else
+#endif //#if ENABLE_AVCODEC_OUT_THREAD
+    {
+        av_new_packet(&pkt, (int)bitstream->size());
+        memcpy(pkt.data, bitstream->data(), bitstream->size());
+        pkt.size = (int)bitstream->size();
+    }
 
     const AVRational streamTimebase = m_Mux.video.streamOut->time_base;
     pkt.stream_index = m_Mux.video.streamOut->index;
@@ -2322,11 +2674,11 @@ RGY_ERR RGYOutputAvcodec::WriteNextFrameInternal(RGYBitstream *bitstream, int64_
     }
     const auto pts = pkt.pts, dts = pkt.dts, duration = pkt.duration;
     *writtenDts = av_rescale_q(pkt.dts, streamTimebase, QUEUE_DTS_TIMEBASE);
-    m_Mux.format.streamError |= 0 != av_interleaved_write_frame(m_Mux.format.formatCtx, &pkt);
+    if (m_segmenter) {
+        m_Mux.format.streamError |= WriteSegmentBoundary((frameType & RGY_FRAMETYPE_IDR) != 0, pts, duration) != RGY_ERR_NONE;
+    }
+    m_Mux.format.streamError |= 0 != MuxWritePacket(&pkt);
 
-    //インタレ保持の際、IDRかどうかのフラグが正しく設定されていないことがある
-    //どちらかのフィールドがIDRならIDRのフラグを立ててているので、それを参照する
-    const auto frameType = (isIDR) ? RGY_FRAMETYPE_IDR : bitstream->frametype();
     if (m_Mux.video.fpTsLogFile) {
         const TCHAR *pFrameTypeStr =
             (frameType & (RGY_FRAMETYPE_IDR | RGY_FRAMETYPE_I)) ? _T("I") : (((frameType & RGY_FRAMETYPE_B) == 0) ? _T("P") : _T("B"));
@@ -2334,18 +2686,12 @@ RGY_ERR RGYOutputAvcodec::WriteNextFrameInternal(RGYBitstream *bitstream, int64_
     }
     m_encSatusInfo->SetOutputData(frameType, bitstream->size(), bitstream->avgQP());
 #if ENABLE_AVCODEC_OUT_THREAD
-    //最初のヘッダーを書いたパケットはコピーではないので、キューに入れない
-    if (m_Mux.thread.thOutput.joinable()) {
+    if (zeroCopy) {
+        //データ領域の所有権はAVPacket側に移ったので、ここでは手放すだけにする
+        *bitstream = RGYBitstreamInit();
+    } else if (m_Mux.thread.thOutput.joinable()) {
         //確保したメモリ領域を使いまわすためにキューに格納
-        const auto frameI = (frameType & (RGY_FRAMETYPE_IDR | RGY_FRAMETYPE_I)) != 0;
-        auto& qVideoQueueFree = (frameI) ? m_Mux.thread.qVideobitstreamFreeI : m_Mux.thread.qVideobitstreamFreePB;
-        auto queueFavoredSize = (frameI) ? VID_BITSTREAM_QUEUE_SIZE_I : VID_BITSTREAM_QUEUE_SIZE_PB;
-        if ((int64_t)qVideoQueueFree.size() > queueFavoredSize) {
-            //あまり多すぎると無駄にメモリを使用するので減らす
-            bitstream->clear();
-        } else {
-            qVideoQueueFree.push(*bitstream);
-        }
+        VideoBufferReturn(bitstream, (frameType & (RGY_FRAMETYPE_IDR | RGY_FRAMETYPE_I)) != 0);
     } else {
 #endif
         bitstream->setSize(0);
@@ -2358,6 +2704,27 @@ RGY_ERR RGYOutputAvcodec::WriteNextFrameInternal(RGYBitstream *bitstream, int64_
 }
 #pragma warning (pop)
 
+#if ENABLE_AVCODEC_OUT_THREAD
+void RGYOutputAvcodec::VideoBufferReturn(RGYBitstream *bitstream, bool frameI) {
+    auto& qVideoQueueFree = (frameI) ? m_Mux.thread.qVideobitstreamFreeI : m_Mux.thread.qVideobitstreamFreePB;
+    auto queueFavoredSize = (frameI) ? VID_BITSTREAM_QUEUE_SIZE_I : VID_BITSTREAM_QUEUE_SIZE_PB;
+    if (!m_Mux.thread.videoBufferReturn || (int64_t)qVideoQueueFree.size() > queueFavoredSize) {
+        //キューが終了しているか、あまり多すぎると無駄にメモリを使用するので解放する
+        bitstream->clear();
+    } else {
+        qVideoQueueFree.push(*bitstream);
+    }
+}
+
+void RGYOutputAvcodec::VideoBufferRelease(void *opaque, uint8_t *data) {
+    UNREFERENCED_PARAMETER(data);
+    //AVPacketの解放は出力スレッド (スレッド終了後はClose) からのみ行われるので、空きキューへのpushは単一スレッドとなる
+    auto bufferRef = (AVMuxVideoBufferRef *)opaque;
+    bufferRef->muxer->VideoBufferReturn(&bufferRef->bitstream, bufferRef->frameI);
+    delete bufferRef;
+}
+#endif //#if ENABLE_AVCODEC_OUT_THREAD
+
 RGY_ERR RGYOutputAvcodec::WriteNextFrame(RGYFrame *surface) {
     UNREFERENCED_PARAMETER(surface);
     return RGY_ERR_UNSUPPORTED;
@@ -2483,6 +2850,7 @@ RGY_ERR RGYOutputAvcodec::applyBitstreamFilterAudio(AVPacket *pkt, AVMuxAudio *m
 // samples   ... [i]  pktのsamples数 音声処理時のみ有効 / 字幕の際は0を渡すべき
 // dts       ... [o]  書き出したパケットの最終的なdtsをHW_NATIVE_TIMEBASEで返す
 void RGYOutputAvcodec::WriteNextPacketProcessed(AVMuxAudio *muxAudio, AVPacket *pkt, int samples, int64_t *writtenDts) {
+    RGY_TRACE_SCOPE("mux_audio", -1);
     if (pkt == nullptr || pkt->buf == nullptr) {
         for (uint32_t i = 0; i < m_Mux.audio.size(); i++) {
             AudioFlushStream(&m_Mux.audio[i], writtenDts);
@@ -2548,8 +2916,8 @@ void RGYOutputAvcodec::WriteNextPacketProcessed(AVMuxAudio *muxAudio, AVPacket *
     if (*writtenDts != AV_NOPTS_VALUE) {
         atomic_max(m_Mux.thread.streamOutMaxDts, *writtenDts);
     }
-    //av_interleaved_write_frameに渡ったパケットは開放する必要がない
-    m_Mux.format.streamError |= 0 != av_interleaved_write_frame(m_Mux.format.formatCtx, pkt);
+    //MuxWritePacketに渡ったパケットは開放する必要がない
+    m_Mux.format.streamError |= 0 != MuxWritePacket(pkt);
     muxAudio->outputSamples += samples;
 }
 
@@ -2568,6 +2936,7 @@ void RGYOutputAvcodec::WriteNextPacketProcessed(AVPktMuxData *pktData, int64_t *
 }
 
 vector<unique_ptr<AVFrame, RGYAVDeleter<AVFrame>>> RGYOutputAvcodec::AudioDecodePacket(AVMuxAudio *muxAudio, AVPacket *pkt) {
+    RGY_TRACE_SCOPE("audio_decode", -1);
     vector<unique_ptr<AVFrame, RGYAVDeleter<AVFrame>>> decodedFrames;
     if (muxAudio->decodeError > muxAudio->ignoreDecodeError) {
         return decodedFrames;
@@ -2673,6 +3042,7 @@ vector<unique_ptr<AVFrame, RGYAVDeleter<AVFrame>>> RGYOutputAvcodec::AudioDecode
 
 //音声をフィルタ
 vector<AVPktMuxData> RGYOutputAvcodec::AudioFilterFrame(vector<AVPktMuxData> inputFrames) {
+    RGY_TRACE_SCOPE("audio_filter", -1);
     vector<AVPktMuxData> outputFrames;
     for (auto& pktData : inputFrames) {
         AVMuxAudio *muxAudio = pktData.muxAudio;
@@ -2734,6 +3104,7 @@ vector<AVPktMuxData> RGYOutputAvcodec::AudioFilterFrameFlush(AVMuxAudio *muxAudi
 
 //音声をエンコード
 vector<AVPktMuxData> RGYOutputAvcodec::AudioEncodeFrame(AVMuxAudio *muxAudio, AVFrame *frame) {
+    RGY_TRACE_SCOPE("audio_encode", -1);
     vector<AVPktMuxData> encPktDatas;
 
     if (frame) {
@@ -2743,8 +3114,13 @@ vector<AVPktMuxData> RGYOutputAvcodec::AudioEncodeFrame(AVMuxAudio *muxAudio, AV
             : av_make_q(1, muxAudio->outCodecDecodeCtx->sample_rate);
         frame->pts = av_rescale_q(frame->pts, timebase_filter, muxAudio->outCodecEncodeCtx->time_base);
     }
+    //エンコード結果を他の出力に渡す場合
+    RGYAudioEncodeShare *sharePublish = (muxAudio->encodeShare && muxAudio->encodeShareId < 0) ? muxAudio->encodeShare : nullptr;
     int ret = avcodec_send_frame(muxAudio->outCodecEncodeCtx, frame);
     if (ret == AVERROR_EOF) {
+        if (sharePublish) {
+            sharePublish->finish(true);
+        }
         return encPktDatas;
     }
     if (ret < 0) {
@@ -2768,11 +3144,95 @@ vector<AVPktMuxData> RGYOutputAvcodec::AudioEncodeFrame(AVMuxAudio *muxAudio, AV
         }
         pktData.samples = (int)av_rescale_q(pktData.pkt.duration, muxAudio->outCodecEncodeCtx->pkt_timebase, { 1, muxAudio->streamIn->codecpar->sample_rate });
         encPktDatas.push_back(pktData);
+        if (ret == 0) {
+            AudioEncodeShareToSubtracks(&encPktDatas, &pktData);
+            if (sharePublish && sharePublish->publish(&pktData.pkt) != RGY_ERR_NONE) {
+                AddMessage(RGY_LOG_WARN, _T("avcodec writer: failed to share audio packet of track #%d.\n"), trackID(muxAudio->inTrackId));
+            }
+        }
+    }
+    if (sharePublish && frame == nullptr && ret == AVERROR_EOF) {
+        sharePublish->finish(true);
     }
     return encPktDatas;
 }
 
+void RGYOutputAvcodec::AudioEncodeShareToSubtracks(vector<AVPktMuxData> *pktDatas, const AVPktMuxData *pktData) {
+    for (auto& muxAudio : m_Mux.audio) {
+        if (muxAudio.encodeShareSrc != pktData->muxAudio) {
+            continue;
+        }
+        AVPktMuxData pktCopy = *pktData;
+        pktCopy.muxAudio = &muxAudio;
+        memset(&pktCopy.pkt, 0, sizeof(pktCopy.pkt));
+        //データはコピーせず、参照を追加する
+        if (av_packet_ref(&pktCopy.pkt, &pktData->pkt) < 0) {
+            AddMessage(RGY_LOG_ERROR, _T("Failed to allocate memory for audio packet.\n"));
+            m_Mux.format.streamError = true;
+            continue;
+        }
+        pktDatas->push_back(pktCopy);
+    }
+}
+
+vector<AVPktMuxData> RGYOutputAvcodec::AudioSharedPackets(AVMuxAudio *muxAudio, bool wait) {
+    vector<AVPktMuxData> pktDatas;
+    if (!muxAudio->encodeShare || muxAudio->encodeShareId < 0) {
+        return pktDatas;
+    }
+    auto pkts = muxAudio->encodeShare->pop(muxAudio->encodeShareId, wait);
+    if (wait && !muxAudio->encodeShare->complete()) {
+        AddMessage(RGY_LOG_WARN, _T("avcodec writer: audio encode of track #%d shared from other output was terminated.\n"), trackID(muxAudio->inTrackId));
+    }
+    for (auto& pkt : pkts) {
+        AVPktMuxData pktData = { 0 };
+        pktData.type = MUX_DATA_TYPE_PACKET;
+        pktData.muxAudio = muxAudio;
+        pktData.dts = AV_NOPTS_VALUE;
+        av_packet_move_ref(&pktData.pkt, pkt);
+        av_packet_free(&pkt);
+        pktData.samples = (int)av_rescale_q(pktData.pkt.duration, muxAudio->outCodecEncodeCtx->pkt_timebase, { 1, muxAudio->streamIn->codecpar->sample_rate });
+        pktDatas.push_back(pktData);
+        AudioEncodeShareToSubtracks(&pktDatas, &pktData);
+    }
+    return pktDatas;
+}
+
+bool RGYOutputAvcodec::AudioDecodeRequired(int inTrackId) {
+    for (const auto& muxAudio : m_Mux.audio) {
+        if (muxAudio.inTrackId == inTrackId && muxAudio.outCodecDecodeCtx && !audioEncodeShared(&muxAudio)) {
+            return true;
+        }
+    }
+    return false;
+}
+
 void RGYOutputAvcodec::AudioFlushStream(AVMuxAudio *muxAudio, int64_t *writtenDts) {
+    if (muxAudio->flushed) {
+        //音声エンコードスレッドがある場合は、音声処理スレッドでflush済み
+        return;
+    }
+    muxAudio->flushed = true;
+    if (muxAudio->encodeShareSrc) {
+        //共有元のトラックのflushで、エンコード結果を受け取る
+        return;
+    }
+    if (audioEncodeShared(muxAudio)) {
+        //共有元のエンコードの終了を待って、残りのエンコード結果を受け取る
+        auto sharedPkts = AudioSharedPackets(muxAudio, true);
+        for (auto& pktMux : sharedPkts) {
+#if ENABLE_AVCODEC_AUDPROCESS_THREAD
+            if (m_Mux.thread.thAudEncode.size() > 0) {
+                AddAudQueue(&pktMux, AUD_QUEUE_ENCODE);
+                continue;
+            }
+#endif //#if ENABLE_AVCODEC_AUDPROCESS_THREAD
+            WriteNextPacketProcessed(&pktMux, writtenDts);
+        }
+        if (!AudioDecodeRequired(muxAudio->inTrackId)) {
+            return;
+        }
+    }
     while (muxAudio->outCodecDecodeCtx && !muxAudio->encodeError) {
         AVPacket pkt = { 0 };
         auto decodedFrames = AudioDecodePacket(muxAudio, &pkt);
@@ -2783,6 +3243,7 @@ void RGYOutputAvcodec::AudioFlushStream(AVMuxAudio *muxAudio, int64_t *writtenDt
         for (size_t i = 0; i < decodedFrames.size(); i++) {
             AVPktMuxData audPkt;
             av_init_packet(&audPkt.pkt);
+            audPkt.muxAudio = muxAudio;
             audPkt.dts = AV_NOPTS_VALUE;
             audPkt.samples = 0;
             audPkt.type = MUX_DATA_TYPE_FRAME;
@@ -2793,9 +3254,25 @@ void RGYOutputAvcodec::AudioFlushStream(AVMuxAudio *muxAudio, int64_t *writtenDt
         //フィルタリングを行う
         WriteNextPacketToAudioSubtracks(std::move(audioFrames));
     }
+    if (audioEncodeShared(muxAudio)) {
+        //サブストリームのためにデコーダのflushのみ行う
+        return;
+    }
     if (muxAudio->filterGraph) {
         WriteNextPacketAudioFrame(AudioFilterFrameFlush(muxAudio));
     }
+#if ENABLE_AVCODEC_AUDPROCESS_THREAD
+    if (muxAudio->outCodecEncodeCtx && m_Mux.thread.thAudEncode.size() > 0) {
+        //エンコーダのflushは、フレームを渡す代わりにnullptrを渡して音声エンコードスレッドで行う
+        AVPktMuxData pktData = { 0 };
+        pktData.type = MUX_DATA_TYPE_FRAME;
+        pktData.frame = nullptr;
+        pktData.got_result = TRUE;
+        pktData.muxAudio = muxAudio;
+        AddAudQueue(&pktData, AUD_QUEUE_ENCODE);
+        return;
+    }
+#endif //#if ENABLE_AVCODEC_AUDPROCESS_THREAD
     while (muxAudio->outCodecEncodeCtx) {
         auto encPktDatas = AudioEncodeFrame(muxAudio, nullptr);
         if (encPktDatas.size() == 0) {
@@ -2861,7 +3338,7 @@ RGY_ERR RGYOutputAvcodec::SubtitleTranscode(const AVMuxOther *muxSub, AVPacket *
             pktOut.pts += 90 * ((i == 0) ? sub.start_display_time : sub.end_display_time);
         }
         pktOut.dts = pktOut.pts;
-        m_Mux.format.streamError |= 0 != av_interleaved_write_frame(m_Mux.format.formatCtx, &pktOut);
+        m_Mux.format.streamError |= 0 != MuxWritePacket(&pktOut);
     }
     return (m_Mux.format.streamError) ? RGY_ERR_UNKNOWN : RGY_ERR_NONE;
 }
@@ -2898,7 +3375,7 @@ RGY_ERR RGYOutputAvcodec::WriteOtherPacket(AVPacket *pkt) {
     if (pkt->dts != AV_NOPTS_VALUE) {
         atomic_max(m_Mux.thread.streamOutMaxDts, av_rescale_q(pkt->dts, timebase_conv, QUEUE_DTS_TIMEBASE));
     }
-    m_Mux.format.streamError |= 0 != av_interleaved_write_frame(m_Mux.format.formatCtx, pkt);
+    m_Mux.format.streamError |= 0 != MuxWritePacket(pkt);
     return (m_Mux.format.streamError) ? RGY_ERR_UNKNOWN : RGY_ERR_NONE;
 }
 
@@ -2942,9 +3419,12 @@ RGY_ERR RGYOutputAvcodec::WriteNextPacket(AVPacket *pkt) {
 RGY_ERR RGYOutputAvcodec::AddAudQueue(AVPktMuxData *pktData, int type) {
 #if ENABLE_AVCODEC_AUDPROCESS_THREAD
     if (m_Mux.thread.thAudProcess.joinable()) {
+        if (type == AUD_QUEUE_ENCODE) {
+            return AddAudEncodeQueue(pktData);
+        }
         //出力キューに追加する
-        auto& qAudio       = (type == AUD_QUEUE_OUT) ? m_Mux.thread.qAudioPacketOut       : ((type == AUD_QUEUE_PROCESS) ? m_Mux.thread.qAudioPacketProcess       : m_Mux.thread.qAudioFrameEncode);
-        auto& heEventAdded = (type == AUD_QUEUE_OUT) ? m_Mux.thread.heEventPktAddedOutput : ((type == AUD_QUEUE_PROCESS) ? m_Mux.thread.heEventPktAddedAudProcess : m_Mux.thread.heEventPktAddedAudEncode);
+        auto& qAudio       = (type == AUD_QUEUE_OUT) ? m_Mux.thread.qAudioPacketOut       : m_Mux.thread.qAudioPacketProcess;
+        auto& heEventAdded = (type == AUD_QUEUE_OUT) ? m_Mux.thread.heEventPktAddedOutput : m_Mux.thread.heEventPktAddedAudProcess;
         if (!qAudio.push(*pktData)) {
             AddMessage(RGY_LOG_ERROR, _T("Failed to allocate memory for audio queue.\n"));
             m_Mux.format.streamError = true;
@@ -2958,6 +3438,46 @@ RGY_ERR RGYOutputAvcodec::AddAudQueue(AVPktMuxData *pktData, int type) {
     }
 }
 
+//音声エンコードスレッドのキューに追加する
+//フレーム以外(字幕やnull終端パケット、コピーする音声パケット)はそのまま出力キューに回すが、
+//先に投入したフレームのエンコード結果より前に出力されないよう、投入順を記録して並べ替える
+RGY_ERR RGYOutputAvcodec::AddAudEncodeQueue(AVPktMuxData *pktData) {
+#if ENABLE_AVCODEC_AUDPROCESS_THREAD
+    const int threadIdx = (pktData->type == MUX_DATA_TYPE_FRAME && pktData->muxAudio)
+        ? m_Mux.thread.audEncodeThreadIdx[pktData->muxAudio - m_Mux.audio.data()] : -1;
+    if (threadIdx < 0) {
+        m_Mux.thread.audEncodeOrder.push(-1, *pktData);
+    } else {
+        AVPktMuxData empty = { 0 };
+        m_Mux.thread.audEncodeOrder.push(threadIdx, empty);
+        auto& th = m_Mux.thread.thAudEncode[threadIdx];
+        if (!th->qFrame.push(*pktData)) {
+            AddMessage(RGY_LOG_ERROR, _T("Failed to allocate memory for audio queue.\n"));
+            m_Mux.format.streamError = true;
+        }
+        SetEvent(th->heEventPktAdded);
+    }
+    return AudEncodeMerge();
+#else
+    UNREFERENCED_PARAMETER(pktData);
+    return RGY_ERR_NOT_INITIALIZED;
+#endif //#if ENABLE_AVCODEC_AUDPROCESS_THREAD
+}
+
+//音声エンコードスレッドのエンコード結果を、投入した順に出力キューに移す
+//各音声エンコードスレッドは受け取った順にフレームを処理し、フレームごとにMUX_DATA_TYPE_NONEで区切って返すので、
+//audEncodeOrderの先頭から順に、対応するスレッドの区切りまでを出力キューに移せば、
+//音声エンコードスレッドが1つの場合と同じ順序(dts順)で出力される
+RGY_ERR RGYOutputAvcodec::AudEncodeMerge() {
+#if ENABLE_AVCODEC_AUDPROCESS_THREAD
+    m_Mux.thread.audEncodeOrder.merge(
+        [this](int threadIdx, AVPktMuxData *pktData) { return m_Mux.thread.thAudEncode[threadIdx]->qPacket.front_copy_and_pop_no_lock(pktData); },
+        [](const AVPktMuxData& pktData) { return pktData.type == MUX_DATA_TYPE_NONE; },
+        [this](AVPktMuxData& pktData) { AddAudQueue(&pktData, AUD_QUEUE_OUT); });
+#endif //#if ENABLE_AVCODEC_AUDPROCESS_THREAD
+    return (m_Mux.format.streamError) ? RGY_ERR_UNKNOWN : RGY_ERR_NONE;
+}
+
 //音声処理スレッドが存在する場合、この関数は音声処理スレッドによって処理される
 //音声処理スレッドがなく、出力スレッドがあれば、出力スレッドにより処理される
 //出力スレッドがなければメインエンコードスレッドが処理する
@@ -2994,7 +3514,14 @@ RGY_ERR RGYOutputAvcodec::WriteNextPacketInternal(AVPktMuxData *pktData, int64_t
             //音声処理を別スレッドでやっている場合は、AddAudOutputQueueを後段の出力スレッドで行う必要がある
             //WriteNextPacketInternalでは音声キューに追加するだけにして、WriteNextPacketProcessedで対応する
             //ひとまず、ここでは処理せず、次のキューに回す
-            return AddAudQueue(pktData, (m_Mux.thread.thAudEncode.joinable()) ? AUD_QUEUE_ENCODE : AUD_QUEUE_OUT);
+            if (m_Mux.thread.thAudEncode.size() > 0) {
+                //ただし、音声エンコードスレッドがある場合は、ここでデコーダ・フィルタをflushし、
+                //エンコーダのflushを音声エンコードスレッドに依頼しておく
+                for (uint32_t i = 0; i < m_Mux.audio.size(); i++) {
+                    AudioFlushStream(&m_Mux.audio[i], &pktData->dts);
+                }
+            }
+            return AddAudQueue(pktData, (m_Mux.thread.thAudEncode.size() > 0) ? AUD_QUEUE_ENCODE : AUD_QUEUE_OUT);
         }
 #endif //#if ENABLE_AVCODEC_AUDPROCESS_THREAD
         for (uint32_t i = 0; i < m_Mux.audio.size(); i++) {
@@ -3011,7 +3538,7 @@ RGY_ERR RGYOutputAvcodec::WriteNextPacketInternal(AVPktMuxData *pktData, int64_t
         if (m_Mux.thread.thAudProcess.joinable()) {
             //音声処理を別スレッドでやっている場合は、字幕パケットもその流れに乗せてやる必要がある
             //ひとまず、ここでは処理せず、次のキューに回す
-            return AddAudQueue(pktData, (m_Mux.thread.thAudEncode.joinable()) ? AUD_QUEUE_ENCODE : AUD_QUEUE_OUT);
+            return AddAudQueue(pktData, (m_Mux.thread.thAudEncode.size() > 0) ? AUD_QUEUE_ENCODE : AUD_QUEUE_OUT);
         }
 #endif //#if ENABLE_AVCODEC_AUDPROCESS_THREAD
         return WriteOtherPacket(&pktData->pkt);
@@ -3064,7 +3591,7 @@ RGY_ERR RGYOutputAvcodec::WriteNextPacketAudio(AVPktMuxData *pktData) {
 #if ENABLE_AVCODEC_AUDPROCESS_THREAD
         if (m_Mux.thread.thAudProcess.joinable()) {
             //ひとまず、ここでは処理せず、次のキューに回す
-            AddAudQueue(pktData, (m_Mux.thread.thAudEncode.joinable()) ? AUD_QUEUE_ENCODE : AUD_QUEUE_OUT);
+            AddAudQueue(pktData, (m_Mux.thread.thAudEncode.size() > 0) ? AUD_QUEUE_ENCODE : AUD_QUEUE_OUT);
         } else {
 #endif //#if ENABLE_AVCODEC_AUDPROCESS_THREAD
             WriteNextPacketProcessed(pktData);
@@ -3072,6 +3599,18 @@ RGY_ERR RGYOutputAvcodec::WriteNextPacketAudio(AVPktMuxData *pktData) {
         }
 #endif //#if ENABLE_AVCODEC_AUDPROCESS_THREAD
     };
+    if (audioEncodeShared(muxAudio)) {
+        //他の出力のエンコード結果を受け取る
+        auto sharedPkts = AudioSharedPackets(muxAudio, false);
+        for (auto& pktShared : sharedPkts) {
+            writeOrSetNextPacketAudioProcessed(&pktShared);
+        }
+        //同じトラックをエンコードするサブストリームがなければ、デコードも不要
+        if (!AudioDecodeRequired(muxAudio->inTrackId)) {
+            av_packet_unref(&pktData->pkt);
+            return (m_Mux.format.streamError) ? RGY_ERR_UNKNOWN : RGY_ERR_NONE;
+        }
+    }
     if (!muxAudio->outCodecDecodeCtx) {
         pktData->samples = av_get_audio_frame_duration2(muxAudio->streamIn->codecpar, pktData->pkt.size);
         if (!pktData->samples) {
@@ -3138,19 +3677,35 @@ RGY_ERR RGYOutputAvcodec::WriteNextPacketToAudioSubtracks(vector<AVPktMuxData> a
         //サブストリームが存在すれば、frameをコピーしてそれぞれに渡す
         AVMuxAudio *pMuxAudioSubStream = nullptr;
         for (int iSubStream = 1; nullptr != (pMuxAudioSubStream = getAudioStreamData(audioFrames[i].muxAudio->inTrackId, iSubStream)); iSubStream++) {
+            if (audioEncodeShared(pMuxAudioSubStream)) {
+                //エンコード結果を受け取る側なので、フレームは不要
+                continue;
+            }
             auto pktDataCopy = audioFrames[i];
             pktDataCopy.muxAudio = pMuxAudioSubStream;
             pktDataCopy.frame = (audioFrames[i].frame) ? av_frame_clone(audioFrames[i].frame) : nullptr;
             audioFrames.push_back(pktDataCopy);
         }
     }
+    if (std::any_of(audioFrames.begin(), audioFrames.end(), [](const AVPktMuxData& pktData) { return audioEncodeShared(pktData.muxAudio); })) {
+        //親ストリーム自身がエンコード結果を受け取る側の場合は、サブストリームの分のみ処理する
+        vector<AVPktMuxData> framesToEncode;
+        for (auto& pktData : audioFrames) {
+            if (audioEncodeShared(pktData.muxAudio)) {
+                av_frame_free(&pktData.frame);
+            } else {
+                framesToEncode.push_back(pktData);
+            }
+        }
+        audioFrames = std::move(framesToEncode);
+    }
     return WriteNextPacketAudioFrame(AudioFilterFrame(audioFrames));
 }
 
 //フレームをresampleして後段に渡す
 RGY_ERR RGYOutputAvcodec::WriteNextPacketAudioFrame(vector<AVPktMuxData> audioFrames) {
 #if ENABLE_AVCODEC_AUDPROCESS_THREAD
-    const bool bAudEncThread = m_Mux.thread.thAudEncode.joinable();
+    const bool bAudEncThread = m_Mux.thread.thAudEncode.size() > 0;
 #else
     const bool bAudEncThread = false;
 #endif //#if ENABLE_AVCODEC_AUDPROCESS_THREAD
@@ -3174,21 +3729,29 @@ RGY_ERR RGYOutputAvcodec::WriteNextPacketAudioFrame(vector<AVPktMuxData> audioFr
 //出力スレッドがなければメインエンコードスレッドが処理する
 RGY_ERR RGYOutputAvcodec::WriteNextAudioFrame(AVPktMuxData *pktData) {
     if (pktData->type != MUX_DATA_TYPE_FRAME) {
-#if ENABLE_AVCODEC_AUDPROCESS_THREAD
-        if (m_Mux.thread.thAudEncode.joinable()) {
-            //音声エンコードスレッドがこの関数を処理
-            //AVPacketは字幕やnull終端パケットなどが流れてきたもの
-            //これはそのまま出力キューに追加する
-            AddAudQueue(pktData, AUD_QUEUE_OUT);
-        }
-#endif //#if ENABLE_AVCODEC_AUDPROCESS_THREAD
-        //音声エンコードスレッドが存在しない場合、ここにAVPacketは流れてこないはず
+        //AVPacket(字幕やnull終端パケットなど)は、音声エンコードスレッドが存在する場合も
+        //AddAudEncodeQueueでそのまま出力キューに回されるので、ここには流れてこないはず
         return RGY_ERR_UNSUPPORTED;
     }
+    //frame == nullptrの場合はエンコーダのflush
     auto encPktDatas = AudioEncodeFrame(pktData->muxAudio, pktData->frame);
     av_frame_free(&pktData->frame);
 #if ENABLE_AVCODEC_AUDPROCESS_THREAD
-    if (m_Mux.thread.thAudProcess.joinable()) {
+    if (m_Mux.thread.thAudEncode.size() > 0) {
+        //音声エンコードスレッドがこの関数を処理
+        //エンコード結果はフレームの区切りとともに返却用のキューに追加し、音声処理スレッドで投入順に出力キューに移す
+        auto& th = m_Mux.thread.thAudEncode[m_Mux.thread.audEncodeThreadIdx[pktData->muxAudio - m_Mux.audio.data()]];
+        AVPktMuxData frameFin = { 0 };
+        frameFin.type = MUX_DATA_TYPE_NONE;
+        encPktDatas.push_back(frameFin);
+        for (auto& pktMux : encPktDatas) {
+            if (!th->qPacket.push(pktMux)) {
+                AddMessage(RGY_LOG_ERROR, _T("Failed to allocate memory for audio queue.\n"));
+                m_Mux.format.streamError = true;
+            }
+        }
+        SetEvent(m_Mux.thread.heEventPktAddedAudProcess);
+    } else if (m_Mux.thread.thAudProcess.joinable()) {
         for (auto& pktMux : encPktDatas) {
             AddAudQueue(&pktMux, AUD_QUEUE_OUT);
         }
@@ -3203,35 +3766,47 @@ RGY_ERR RGYOutputAvcodec::WriteNextAudioFrame(AVPktMuxData *pktData) {
     return (m_Mux.format.streamError) ? RGY_ERR_UNKNOWN : RGY_ERR_NONE;
 }
 
-RGY_ERR RGYOutputAvcodec::ThreadFuncAudEncodeThread() {
+RGY_ERR RGYOutputAvcodec::ThreadFuncAudEncodeThread(int threadIdx) {
 #if ENABLE_AVCODEC_AUDPROCESS_THREAD
-    WaitForSingleObject(m_Mux.thread.heEventPktAddedAudEncode, INFINITE);
-    while (!m_Mux.thread.thAudEncodeAbort) {
+    RGY_TRACE_THREAD_NAME("audio_encode");
+    auto th = m_Mux.thread.thAudEncode[threadIdx].get();
+    //キューの使用量はスレッド間で共有のため、最初のスレッドのものを代表として記録する
+    size_t *queueUsage = (m_Mux.thread.queueInfo && threadIdx == 0) ? &m_Mux.thread.queueInfo->usage_aud_enc : nullptr;
+    WaitForSingleObject(th->heEventPktAdded, INFINITE);
+    while (!th->abort) {
         if (!m_Mux.format.fileHeaderWritten) {
             std::this_thread::sleep_for(std::chrono::milliseconds(1));
         } else {
             AVPktMuxData pktData = { 0 };
-            while (m_Mux.thread.qAudioFrameEncode.front_copy_and_pop_no_lock(&pktData, (m_Mux.thread.queueInfo) ? &m_Mux.thread.queueInfo->usage_aud_enc : nullptr)) {
-                //音声エンコードを実行、出力キューに追加する
+            while (th->qFrame.front_copy_and_pop_no_lock(&pktData, queueUsage)) {
+                //音声エンコードを実行、返却用のキューに追加する
                 WriteNextAudioFrame(&pktData);
             }
         }
-        ResetEvent(m_Mux.thread.heEventPktAddedAudEncode);
-        WaitForSingleObject(m_Mux.thread.heEventPktAddedAudEncode, 16);
+        ResetEvent(th->heEventPktAdded);
+        WaitForSingleObject(th->heEventPktAdded, 16);
     }
     {   //音声をすべてエンコード
+        //ヘッダが書き出されずに終了する場合は、エンコードできないので破棄する
         AVPktMuxData pktData = { 0 };
-        while (m_Mux.thread.qAudioFrameEncode.front_copy_and_pop_no_lock(&pktData, (m_Mux.thread.queueInfo) ? &m_Mux.thread.queueInfo->usage_aud_enc : nullptr)) {
-            WriteNextAudioFrame(&pktData);
+        while (th->qFrame.front_copy_and_pop_no_lock(&pktData, queueUsage)) {
+            if (m_Mux.format.fileHeaderWritten) {
+                WriteNextAudioFrame(&pktData);
+            } else {
+                av_frame_free(&pktData.frame);
+            }
         }
     }
-    SetEvent(m_Mux.thread.heEventClosingAudEncode);
+    SetEvent(th->heEventClosing);
+#else
+    UNREFERENCED_PARAMETER(threadIdx);
 #endif //#if ENABLE_AVCODEC_AUDPROCESS_THREAD
     return (m_Mux.format.streamError) ? RGY_ERR_UNKNOWN : RGY_ERR_NONE;
 }
 
 RGY_ERR RGYOutputAvcodec::ThreadFuncAudThread() {
 #if ENABLE_AVCODEC_AUDPROCESS_THREAD
+    RGY_TRACE_THREAD_NAME("audio_process");
     WaitForSingleObject(m_Mux.thread.heEventPktAddedAudProcess, INFINITE);
     while (!m_Mux.thread.thAudProcessAbort) {
         if (!m_Mux.format.fileHeaderWritten) {
@@ -3242,6 +3817,8 @@ RGY_ERR RGYOutputAvcodec::ThreadFuncAudThread() {
                 //音声処理を実行、出力キューに追加する
                 WriteNextPacketInternal(&pktData, INT64_MAX);
             }
+            //音声エンコードスレッドのエンコード結果を出力キューに移す
+            AudEncodeMerge();
         }
         ResetEvent(m_Mux.thread.heEventPktAddedAudProcess);
         WaitForSingleObject(m_Mux.thread.heEventPktAddedAudProcess, 16);
@@ -3252,6 +3829,19 @@ RGY_ERR RGYOutputAvcodec::ThreadFuncAudThread() {
             //音声処理を実行、出力キューに追加する
             WriteNextPacketInternal(&pktData, INT64_MAX);
         }
+        //これ以上音声エンコードスレッドにフレームは追加されないので、ヘッダの書き出し状況によらず終了を通知する
+        //音声エンコードスレッドは残りのフレームを処理してから終了する
+        for (auto& th : m_Mux.thread.thAudEncode) {
+            th->abort = true;
+            SetEvent(th->heEventPktAdded);
+        }
+        //音声エンコードスレッドの処理の終了を待って、すべて出力キューに移す
+        //ヘッダが書き出されていない場合はエンコードされずに破棄されるので、待たずに終了する
+        while (m_Mux.format.fileHeaderWritten
+            && AudEncodeMerge() == RGY_ERR_NONE && m_Mux.thread.audEncodeOrder.size() > 0) {
+            ResetEvent(m_Mux.thread.heEventPktAddedAudProcess);
+            WaitForSingleObject(m_Mux.thread.heEventPktAddedAudProcess, 16);
+        }
     }
     SetEvent(m_Mux.thread.heEventClosingAudProcess);
 #endif //#if ENABLE_AVCODEC_AUDPROCESS_THREAD
@@ -3260,18 +3850,44 @@ RGY_ERR RGYOutputAvcodec::ThreadFuncAudThread() {
 
 RGY_ERR RGYOutputAvcodec::WriteThreadFunc() {
 #if ENABLE_AVCODEC_OUT_THREAD
-    //映像と音声の同期をとる際に、それをあきらめるまでの閾値
-    const int nWaitThreshold = 32;
-    //キューにデータが存在するか
-    bool bAudioExists = false;
-    bool bVideoExists = false;
+    RGY_TRACE_THREAD_NAME("output");
     const auto fpsTimebase = av_inv_q(m_Mux.video.outputFps);
+    //音声のパケットをm_AudPktBufFileHeadから書き出す際に、映像の出力位置からどれだけ先行してよいか
     const auto dtsThreshold = std::max<int64_t>(av_rescale_q(4, fpsTimebase, QUEUE_DTS_TIMEBASE), 4);
-    //syncIgnoreDtsは映像と音声の同期を行う必要がないことを意味する
-    //dtsThresholdを加算したときにオーバーフローしないよう、dtsThresholdを引いておく
-    const int64_t syncIgnoreDts = INT64_MAX - dtsThreshold;
-    int64_t audioDts = (m_Mux.audio.size()) ? 0 : syncIgnoreDts;
-    int64_t videoDts = (m_Mux.video.streamOut) ? 0 : syncIgnoreDts;
+    //各ストリームで出力を待たずに保持するパケット数の上限
+    //上限に達したストリームのパケットは入力側のキューに残し、キューが一杯になれば送り側を待たせる
+    const size_t videoCapacity = (size_t)(std::max)(256, (m_Mux.video.outputFps.den) ? m_Mux.video.outputFps.num * 4 / m_Mux.video.outputFps.den : 0);
+    const size_t audioCapacity = 1024;
+    const size_t otherCapacity = 256;
+
+    //出力するストリームごとに出力待ちのパケットを保持し、先頭のパケットのdts順に出力する
+    RGYMuxInterleaver<AVMuxInterleavePacket> interleaver;
+    std::vector<const void *> streamTarget; //各ストリームに対応するAVMuxVideo/AVMuxAudio/AVMuxOther
+    const int videoIdx = (m_Mux.video.streamOut) ? interleaver.addStream(RGY_MUX_INTERLEAVE_ACTIVE, videoCapacity) : -1;
+    if (videoIdx >= 0) {
+        streamTarget.push_back(&m_Mux.video);
+    }
+    //音声は最初のパケットが来るまでは待たない
+    //(音声処理スレッドはファイルヘッダが書き出されるまで処理を始めないので、待つと映像を書き出せなくなる)
+    for (auto& audio : m_Mux.audio) {
+        interleaver.addStream(RGY_MUX_INTERLEAVE_STALLED, audioCapacity);
+        streamTarget.push_back(&audio);
+    }
+    for (auto& other : m_Mux.other) {
+        interleaver.addStream(RGY_MUX_INTERLEAVE_SPARSE, otherCapacity);
+        streamTarget.push_back(&other);
+    }
+    auto findStream = [&streamTarget](const void *target) {
+        for (int i = 0; i < (int)streamTarget.size(); i++) {
+            if (streamTarget[i] == target) {
+                return i;
+            }
+        }
+        return -1;
+    };
+    //音声のflush (pkt.data == nullptr) は、それまでの音声・字幕をすべて出力してから処理する
+    std::deque<AVPktMuxData> audioFlush;
+
     WaitForSingleObject(m_Mux.thread.heEventPktAddedOutput, INFINITE);
     //bThAudProcessは出力開始した後で取得する(この前だとまだ起動していないことがある)
     const bool bThAudProcess = m_Mux.thread.thAudProcess.joinable();
@@ -3286,142 +3902,163 @@ RGY_ERR RGYOutputAvcodec::WriteThreadFunc() {
         }
         return sts;
     };
-    int audPacketsPerSec = 64;
-    int nWaitAudio = 0;
-    int nWaitVideo = 0;
-    while (!m_Mux.thread.abortOutput) {
-        do {
-            if (!m_Mux.format.fileHeaderWritten) {
-                std::this_thread::sleep_for(std::chrono::milliseconds(1));
-                //ヘッダー取得前に音声キューのサイズが足りず、エンコードが進まなくなってしまうことがある
-                //キューのcapcityを増やすことでこれを回避する
-                auto type = (m_Mux.thread.thAudEncode.joinable()) ? AUD_QUEUE_ENCODE : AUD_QUEUE_OUT;
-                auto& qAudio = (type == AUD_QUEUE_OUT) ? m_Mux.thread.qAudioPacketOut : m_Mux.thread.qAudioFrameEncode;
-                const auto nQueueCapacity = qAudio.capacity();
-                if (qAudio.size() >= nQueueCapacity) {
-                    qAudio.set_capacity(nQueueCapacity * 3 / 2);
-                }
-                //動画キューになにもなかったら再度待機する
-                if (m_Mux.thread.qVideobitstream.size() == 0) {
-                    break;
+    auto writePacket = [&](AVPktMuxData *pktData) {
+        const int64_t videoDts = (videoIdx >= 0 && interleaver.lastDts(videoIdx) != INT64_MIN) ? interleaver.lastDts(videoIdx) + dtsThreshold : INT64_MAX;
+        //音声処理スレッドが別にあるなら、出力スレッドがすべきことは単に出力するだけ
+        (bThAudProcess) ? writeProcessedPacket(pktData) : WriteNextPacketInternal(pktData, videoDts);
+    };
+
+    //キューに入れる時点で、各パケットの出力時のdtsを見積もる (timebase = QUEUE_DTS_TIMEBASE、不明ならINT64_MIN)
+    //映像: エンコーダの返すdts (なければpts)
+    const AVRational vidBitstreamTimebase = (ENCODER_QSV) ? HW_NATIVE_TIMEBASE : m_Mux.video.bitstreamTimebase;
+    auto videoPacketDts = [&](const RGYBitstream& bitstream) {
+        const int64_t ts = (bitstream.dts() != AV_NOPTS_VALUE && !m_Mux.video.dtsUnavailable) ? bitstream.dts() : bitstream.pts();
+        return (ts == AV_NOPTS_VALUE) ? INT64_MIN : av_rescale_q(ts, vidBitstreamTimebase, QUEUE_DTS_TIMEBASE);
+    };
+    //音声・字幕: 入力 (音声処理スレッドでエンコード済みならエンコーダ) のptsから、出力時と同じく映像の先頭のオフセットを引く
+    const AVRational vid_pkt_timebase = av_isvalid_q(m_Mux.video.inputStreamTimebase) ? m_Mux.video.inputStreamTimebase : av_inv_q(m_Mux.video.outputFps);
+    auto packetDts = [&](const AVPktMuxData *pktData) {
+        AVRational timebase = { 0, 1 };
+        int64_t ts = AV_NOPTS_VALUE;
+        if (pktData->muxAudio) {
+            const auto muxAudio = pktData->muxAudio;
+            timebase = (bThAudProcess && muxAudio->outCodecEncodeCtx) ? muxAudio->outCodecEncodeCtx->time_base : muxAudio->streamIn->time_base;
+            ts = pktData->pkt.pts;
+        } else {
+            timebase = getOtherPacketStreamData(&pktData->pkt)->streamInTimebase;
+            ts = pktData->pkt.dts;
+        }
+        if (ts == AV_NOPTS_VALUE || timebase.num == 0) {
+            return (int64_t)INT64_MIN;
+        }
+        const int64_t pts_offset = av_rescale_q(m_Mux.video.inputFirstKeyPts, vid_pkt_timebase, timebase);
+        return av_rescale_q(std::max<int64_t>(0, ts - pts_offset), timebase, QUEUE_DTS_TIMEBASE);
+    };
+
+    //出力スレッドに渡されたパケットを、ストリームごとのキューに振り分ける
+    //振り分け先が上限に達していれば入力側のキューに残し、送り側を待たせる
+    //入力側のキューを取り出したかどうかを返す
+    auto fetchPackets = [&]() {
+        bool fetched = false;
+        RGYBitstream bitstream = RGYBitstreamInit();
+        while ((videoIdx < 0 || !interleaver.full(videoIdx))
+            && m_Mux.thread.qVideobitstream.front_copy_and_pop_no_lock(&bitstream, (m_Mux.thread.queueInfo) ? &m_Mux.thread.queueInfo->usage_vid_out : nullptr)) {
+            fetched = true;
+            if (videoIdx < 0) {
+                int64_t dts = 0;
+                WriteNextFrameInternal(&bitstream, &dts);
+                continue;
+            }
+            AVMuxInterleavePacket packet = { bitstream, { 0 } };
+            interleaver.push(videoIdx, videoPacketDts(bitstream), packet);
+        }
+        AVPktMuxData pktData = { 0 };
+        while (m_Mux.thread.qAudioPacketOut.front_copy_no_lock(&pktData)) {
+            const bool flush = pktData.muxAudio == nullptr && pktData.pkt.data == nullptr;
+            const int idx = (flush) ? -1 : ((pktData.muxAudio) ? findStream(pktData.muxAudio) : findStream(getOtherPacketStreamData(&pktData.pkt)));
+            if (idx >= 0 && interleaver.full(idx)) {
+                //音声・字幕は1つのキューに混在しているので、ほかのストリームのパケットもここで止まる
+                //interleaverは上限に達したストリームがあれば空のストリームを待たないので、止まったままにはならない
+                break;
+            }
+            m_Mux.thread.qAudioPacketOut.front_copy_and_pop_no_lock(&pktData, (m_Mux.thread.queueInfo) ? &m_Mux.thread.queueInfo->usage_aud_out : nullptr);
+            fetched = true;
+            if (flush) {
+                //flushより後に音声・字幕のパケットは来ない
+                audioFlush.push_back(pktData);
+                for (int i = 0; i < interleaver.streams(); i++) {
+                    if (i != videoIdx) {
+                        interleaver.finish(i);
+                    }
                 }
+            } else if (idx < 0) {
+                writePacket(&pktData);
+            } else {
+                AVMuxInterleavePacket packet = { RGYBitstreamInit(), pktData };
+                interleaver.push(idx, packetDts(&pktData), packet);
             }
-            //映像・音声の同期待ちが必要な場合、falseとなってループから抜けるよう、ここでfalseに設定する
-            bAudioExists = false;
-            bVideoExists = false;
-            RGYBitstream bitstream = RGYBitstreamInit();
-            while ((audioDts < 0 || videoDts <= audioDts + dtsThreshold)
-                && false != (bVideoExists = m_Mux.thread.qVideobitstream.front_copy_and_pop_no_lock(&bitstream, (m_Mux.thread.queueInfo) ? &m_Mux.thread.queueInfo->usage_vid_out : nullptr))) {
-                WriteNextFrameInternal(&bitstream, &videoDts);
-                nWaitVideo = 0;
+        }
+        return fetched;
+    };
+    //出力可能なパケットを1つ出力する (出力できるものがなければfalseを返す)
+    auto writeNextPacket = [&]() {
+        int idx = -1;
+        AVMuxInterleavePacket packet = { RGYBitstreamInit(), { 0 } };
+        if (interleaver.pop(&idx, &packet)) {
+            if (idx == videoIdx) {
+                int64_t videoDts = 0;
+                WriteNextFrameInternal(&packet.video, &videoDts);
+                interleaver.setLastDts(idx, videoDts);
                 const int log_level = RGY_LOG_TRACE;
                 if (m_printMes && log_level >= m_printMes->getLogLevel()) {
                     AddMessage(log_level, _T("videoDts=%8lld: %s.\n"), videoDts, getTimestampString(videoDts, QUEUE_DTS_TIMEBASE).c_str());
                 }
-            }
-            AVPktMuxData pktData = { 0 };
-            while ((videoDts < 0 || audioDts <= videoDts + dtsThreshold)
-                && false != (bAudioExists = m_Mux.thread.qAudioPacketOut.front_copy_and_pop_no_lock(&pktData, (m_Mux.thread.queueInfo) ? &m_Mux.thread.queueInfo->usage_aud_out : nullptr))) {
-                if (pktData.muxAudio && pktData.muxAudio->streamIn) {
-                    audPacketsPerSec = std::max(audPacketsPerSec, (int)(1.0 / (av_q2d(pktData.muxAudio->streamIn->time_base) * pktData.pkt.duration) + 0.5));
-                    const auto videoDelay = (audioDts - videoDts) * av_q2d(QUEUE_DTS_TIMEBASE);
-                    const auto streamQueueCapacity = (int)(audPacketsPerSec * std::max(5.0, videoDelay * 1.5) * std::max((int)m_Mux.audio.size(), 1) + 0.5);
-                    if ((int)m_Mux.thread.qAudioPacketOut.capacity() < streamQueueCapacity) {
-                        m_Mux.thread.qAudioPacketOut.set_capacity(streamQueueCapacity);
+            } else {
+                writePacket(&packet.pktData);
+                if (interleaver.state(idx) != RGY_MUX_INTERLEAVE_SPARSE) {
+                    //音声処理を出力スレッドで行う場合はpktData.dtsは更新されないことがあるので、最後に出力したptsも参照する
+                    auto muxAudio = (const AVMuxAudio *)streamTarget[idx];
+                    if (packet.pktData.dts != INT64_MAX) {
+                        interleaver.setLastDts(idx, packet.pktData.dts);
+                    }
+                    if (muxAudio->streamOut && muxAudio->lastPtsOut != AV_NOPTS_VALUE) {
+                        interleaver.setLastDts(idx, av_rescale_q(muxAudio->lastPtsOut, muxAudio->streamOut->time_base, QUEUE_DTS_TIMEBASE));
                     }
                 }
-                const int64_t maxDts = (videoDts >= 0) ? videoDts + dtsThreshold : syncIgnoreDts;
-                //音声処理スレッドが別にあるなら、出力スレッドがすべきことは単に出力するだけ
-                (bThAudProcess) ? writeProcessedPacket(&pktData) : WriteNextPacketInternal(&pktData, maxDts);
-                //複数のstreamがあり得るので最大値をとる
-                audioDts = (std::max)(audioDts, (std::max)(pktData.dts, m_Mux.thread.streamOutMaxDts.load()));
-                nWaitAudio = 0;
                 const int log_level = RGY_LOG_TRACE;
                 if (m_printMes && log_level >= m_printMes->getLogLevel()) {
-                    AddMessage(log_level, _T("audioDts=%8lld: %s, maxDst=%8lld.\n"), audioDts, getTimestampString(audioDts, QUEUE_DTS_TIMEBASE).c_str(), maxDts);
+                    AddMessage(log_level, _T("stream %d dts=%8lld: %s.\n"), idx, interleaver.lastDts(idx), getTimestampString(interleaver.lastDts(idx), QUEUE_DTS_TIMEBASE).c_str());
                 }
             }
-            //一定以上の動画フレームがキューにたまっており、音声キューになにもなければ、
-            //音声を無視して動画フレームの処理を開始させる
-            //音声が途中までしかなかったり、途中からしかなかったりする場合にこうした処理が必要
-            const size_t videoPacketThreshold = std::min<size_t>(3072, m_Mux.thread.qVideobitstream.capacity()) - nWaitThreshold;
-            if (m_Mux.thread.qAudioPacketOut.size() == 0 && m_Mux.thread.qVideobitstream.size() > videoPacketThreshold) {
-                nWaitAudio++;
-                if (nWaitAudio <= nWaitThreshold) {
-                    //時折まだパケットが来ているのにタイミングによってsize() == 0が成立することがある
-                    //なのである程度連続でパケットが来ていないときのみ無視するようにする
-                    //このようにすることで適切に同期がとれる
-                    //また、映像キューのサイズが足りないことが考えられるので、拡大する
-                    m_Mux.thread.qVideobitstream.set_capacity(m_Mux.thread.qVideobitstream.capacity() + 50);
-                    break;
+            return true;
+        }
+        //音声のflush: 映像以外のストリームのパケットをすべて出力してから行う
+        if (audioFlush.size() > 0) {
+            for (int i = 0; i < interleaver.streams(); i++) {
+                if (i != videoIdx && interleaver.size(i) > 0) {
+                    return false;
                 }
-                audioDts = videoDts;
-                AddMessage(RGY_LOG_TRACE, _T("audio not coming.\n"));
-            }
-            //一定以上の音声フレームがキューにたまっており、動画キューになにもなければ、
-            //動画を無視して音声フレームの処理を開始させる
-            const size_t audioPacketThreshold = std::min<size_t>(6144, m_Mux.thread.qAudioPacketOut.capacity()) - nWaitThreshold;
-            if (m_Mux.thread.qVideobitstream.size() == 0 && m_Mux.thread.qAudioPacketOut.size() > audioPacketThreshold) {
-                nWaitVideo++;
-                if (nWaitVideo <= nWaitThreshold) {
-                    //時折まだパケットが来ているのにタイミングによってsize() == 0が成立することがある
-                    //なのである程度連続でパケットが来ていないときのみ無視するようにする
-                    //このようにすることで適切に同期がとれる
-                    //また、音声キューのサイズが足りないことが考えられるので、拡大する
-                    m_Mux.thread.qAudioPacketOut.set_capacity(m_Mux.thread.qAudioPacketOut.capacity() * 3 / 2);
+            }
+            AVPktMuxData pktData = audioFlush.front();
+            audioFlush.pop_front();
+            writePacket(&pktData);
+            return true;
+        }
+        return false;
+    };
+
+    while (!m_Mux.thread.abortOutput) {
+        //取り出し前にリセットしておけば、取り出し後に追加されたパケットの通知は失われない
+        ResetEvent(m_Mux.thread.heEventPktAddedOutput);
+        //出力できるパケットがなくなり、入力側のキューも空になる (または上限で止まる) まで処理する
+        bool progress = true;
+        while (progress && !m_Mux.format.streamError) {
+            progress = fetchPackets();
+            while (writeNextPacket()) {
+                progress = true;
+                if (m_Mux.format.streamError) {
                     break;
                 }
-                videoDts = audioDts;
-                AddMessage(RGY_LOG_TRACE, _T("video not coming.\n"));
-            }
-        } while (bAudioExists || bVideoExists); //両方のキューがひとまず空になるか、映像・音声の同期待ちが必要になるまで回す
-                                                //次のフレーム・パケットが送られてくるまで待機する
-        //キューの容量が両方とも半分以下なら、すこし待ってみる
-        //一方、どちらかのキューが半分以上使われていれば、なるべく早く処理する必要がある
-        if (   m_Mux.thread.qVideobitstream.size() / (double)m_Mux.thread.qVideobitstream.capacity() < 0.5
-            && m_Mux.thread.qAudioPacketOut.size() / (double)m_Mux.thread.qAudioPacketOut.capacity() < 0.5) {
-            ResetEvent(m_Mux.thread.heEventPktAddedOutput);
-            WaitForSingleObject(m_Mux.thread.heEventPktAddedOutput, 16);
-        } else {
-            std::this_thread::yield();
+            }
         }
+        //次のフレーム・パケットが送られてくるまで待機する
+        //送り側は追加のたびに、CloseThreadは終了までSetEventするので、タイムアウトは不要
+        WaitForSingleObject(m_Mux.thread.heEventPktAddedOutput, INFINITE);
     }
     //メインループを抜けたことを通知する
     SetEvent(m_Mux.thread.heEventClosingOutput);
     m_Mux.thread.qAudioPacketOut.set_keep_length(0);
     m_Mux.thread.qVideobitstream.set_keep_length(0);
-    bAudioExists = !m_Mux.thread.qAudioPacketOut.empty();
-    bVideoExists = !m_Mux.thread.qVideobitstream.empty();
-    //まずは映像と音声の同期をとって出力するためのループ
-    while (bAudioExists && bVideoExists) {
-        AVPktMuxData pktData = { 0 };
-        while (audioDts <= videoDts + dtsThreshold
-            && false != (bAudioExists = m_Mux.thread.qAudioPacketOut.front_copy_and_pop_no_lock(&pktData, (m_Mux.thread.queueInfo) ? &m_Mux.thread.queueInfo->usage_aud_out : nullptr))) {
-            //音声処理スレッドが別にあるなら、出力スレッドがすべきことは単に出力するだけ
-            const int64_t maxDts = (videoDts >= 0) ? videoDts + dtsThreshold : INT64_MAX;
-            (bThAudProcess) ? writeProcessedPacket(&pktData) : WriteNextPacketInternal(&pktData, maxDts);
-            //複数のstreamがあり得るので最大値をとる
-            audioDts = (std::max)(audioDts, pktData.dts);
-        }
-        RGYBitstream bitstream = RGYBitstreamInit();
-        while (videoDts <= audioDts + dtsThreshold
-            && false != (bVideoExists = m_Mux.thread.qVideobitstream.front_copy_and_pop_no_lock(&bitstream, (m_Mux.thread.queueInfo) ? &m_Mux.thread.queueInfo->usage_vid_out : nullptr))) {
-            WriteNextFrameInternal(&bitstream, &videoDts);
-        }
-        bAudioExists = !m_Mux.thread.qAudioPacketOut.empty();
-        bVideoExists = !m_Mux.thread.qVideobitstream.empty();
-    }
-    { //音声を書き出す
-        AVPktMuxData pktData = { 0 };
-        while (m_Mux.thread.qAudioPacketOut.front_copy_and_pop_no_lock(&pktData, (m_Mux.thread.queueInfo) ? &m_Mux.thread.queueInfo->usage_aud_out : nullptr)) {
-            //音声処理スレッドが別にあるなら、出力スレッドがすべきことは単に出力するだけ
-            (bThAudProcess) ? writeProcessedPacket(&pktData) : WriteNextPacketInternal(&pktData, INT64_MAX);
+    //これ以上パケットは来ないので、残りをdts順にすべて書き出す
+    interleaver.finishAll();
+    for (;;) {
+        const bool fetched = fetchPackets();
+        bool written = false;
+        while (writeNextPacket()) {
+            written = true;
         }
-    }
-    { //動画を書き出す
-        RGYBitstream bitstream = RGYBitstreamInit();
-        while (m_Mux.thread.qVideobitstream.front_copy_and_pop_no_lock(&bitstream, (m_Mux.thread.queueInfo) ? &m_Mux.thread.queueInfo->usage_vid_out : nullptr)) {
-            WriteNextFrameInternal(&bitstream, &videoDts);
+        if (!fetched && !written) {
+            break;
         }
     }
 #endif
@@ -3450,7 +4087,8 @@ HANDLE RGYOutputAvcodec::getThreadHandleAudProcess() {
 
 HANDLE RGYOutputAvcodec::getThreadHandleAudEncode() {
 #if ENABLE_AVCODEC_OUT_THREAD && ENABLE_AVCODEC_AUDPROCESS_THREAD
-    return (HANDLE)m_Mux.thread.thAudEncode.native_handle();
+    //音声エンコードスレッドが複数ある場合は、最初のスレッドを代表として返す
+    return (m_Mux.thread.thAudEncode.size() > 0) ? (HANDLE)m_Mux.thread.thAudEncode[0]->thread.native_handle() : NULL;
 #else
     return NULL;
 #endif
@@ -3458,10 +4096,20 @@ HANDLE RGYOutputAvcodec::getThreadHandleAudEncode() {
 
 #if USE_CUSTOM_IO
 int RGYOutputAvcodec::readPacket(uint8_t *buf, int buf_size) {
+    if (m_segmenter) {
+        return AVERROR(ENOSYS);
+    }
+    if (m_Mux.format.fileSink) {
+        return (int)(std::max<int64_t>)(0, m_Mux.format.fileSink->read(buf, buf_size));
+    }
     return (int)_fread_nolock(buf, 1, buf_size, m_Mux.format.fpOutput);
 }
 int RGYOutputAvcodec::writePacket(uint8_t *buf, int buf_size) {
-    int res = (int)_fwrite_nolock(buf, 1, buf_size, m_Mux.format.fpOutput);
+    int res = (m_segmenter)
+        ? (int)(std::max<int64_t>)(0, m_segmenter->write(buf, buf_size))
+        : (m_Mux.format.fileSink)
+        ? (int)(std::max<int64_t>)(0, m_Mux.format.fileSink->write(buf, buf_size))
+        : (int)_fwrite_nolock(buf, 1, buf_size, m_Mux.format.fpOutput);
     if (res < buf_size) {
         AddMessage(RGY_LOG_ERROR, _T("Error writing file.\nNot enough disk space!\""));
         m_Mux.format.streamError = true;
@@ -3469,6 +4117,9 @@ int RGYOutputAvcodec::writePacket(uint8_t *buf, int buf_size) {
     return res;
 }
 int64_t RGYOutputAvcodec::seek(int64_t offset, int whence) {
+    if (m_Mux.format.fileSink) {
+        return m_Mux.format.fileSink->seek(offset, whence);
+    }
     return _fseeki64(m_Mux.format.fpOutput, offset, whence);
 }
 #endif //USE_CUSTOM_IO
@@ -35,11 +35,14 @@
 #if ENABLE_AVSW_READER
 #include <thread>
 #include <atomic>
+#include <deque>
 #include <cstdint>
 #include "rgy_avutil.h"
 #include "rgy_bitstream.h"
 #include "rgy_input_avcodec.h"
 #include "rgy_output.h"
+#include "rgy_output_segment.h"
+#include "rgy_audio_encode_share.h"
 #include "rgy_perf_monitor.h"
 #include "rgy_util.h"
 #if ENCODER_NVENC
@@ -105,6 +108,7 @@ typedef struct AVMuxFormat {
     uint8_t              *AVOutBuffer;          //avio_alloc_context用のバッファ
     uint32_t              AVOutBufferSize;      //avio_alloc_context用のバッファサイズ
     FILE                 *fpOutput;             //出力ファイルポインタ
+    RGYFileSink          *fileSink;             //--output-sinkでstdio以外が指定された場合、fpOutputのかわりに使用する
     char                 *outputBuffer;         //出力ファイルポインタ用のバッファ
     uint32_t              outputBufferSize;     //出力ファイルポインタ用のバッファサイズ
 #endif //USE_CUSTOM_IO
@@ -183,6 +187,12 @@ typedef struct AVMuxAudio {
     int64_t               outputSamples;        //出力音声の出力済みsample数
     int64_t               lastPtsIn;            //入力音声の前パケットのpts (input stream timebase)
     int64_t               lastPtsOut;           //出力音声の前パケットのpts
+    bool                  flushed;              //デコーダ・フィルタ・エンコーダのflushを実行済み
+
+    //エンコード結果の共有
+    struct AVMuxAudio    *encodeShareSrc;       //同じ出力内で同一のエンコードを行うトラック (nullptrでなければ自身はエンコードせず、その結果を受け取る)
+    RGYAudioEncodeShare  *encodeShare;          //他の出力と共有するエンコード
+    int                   encodeShareId;        //encodeShareでの受け取り側のid (-1ならエンコードを担当してpublishする)
 } AVMuxAudio;
 
 typedef struct AVMuxOther {
@@ -226,6 +236,31 @@ enum {
 };
 
 #if ENABLE_AVCODEC_OUT_THREAD
+//音声エンコードスレッド (割り当てられたトラックのエンコードを担当)
+typedef struct AVMuxAudioEncodeThread {
+    std::thread                    thread;                    //音声エンコードスレッド
+    std::atomic<bool>              abort;                     //音声エンコードスレッドに停止を通知する
+    HANDLE                         heEventPktAdded;           //qFrameにデータが追加されたことを通知する
+    HANDLE                         heEventClosing;            //音声エンコードスレッドが停止処理を開始したことを通知する
+    RGYQueueSPSP<AVPktMuxData, 64> qFrame;                    //エンコードする音声フレームを渡すためのキュー
+    RGYQueueSPSP<AVPktMuxData, 64> qPacket;                   //エンコード済みの音声パケットを返すためのキュー (フレームごとにMUX_DATA_TYPE_NONEで区切る)
+} AVMuxAudioEncodeThread;
+
+//出力スレッドで、RGYMuxInterleaverによりdts順に並べるパケット
+typedef struct AVMuxInterleavePacket {
+    RGYBitstream                   video;                     //映像のパケット (映像のストリームの場合)
+    AVPktMuxData                   pktData;                   //音声・字幕のパケット (それ以外のストリームの場合)
+} AVMuxInterleavePacket;
+
+class RGYOutputAvcodec;
+
+//AVPacketに直接渡した映像のデータ領域の情報 (AVBufferRefのopaque)
+typedef struct AVMuxVideoBufferRef {
+    RGYOutputAvcodec              *muxer;                     //データ領域を戻す先
+    RGYBitstream                   bitstream;                 //AVPacketに渡したデータ領域
+    bool                           frameI;                    //Iフレームかどうか (戻すキューの選択用)
+} AVMuxVideoBufferRef;
+
 typedef struct AVMuxThread {
     bool                           enableOutputThread;        //出力スレッドを使用する
     bool                           enableAudProcessThread;    //音声処理スレッドを使用する
@@ -234,19 +269,18 @@ typedef struct AVMuxThread {
     std::thread                    thOutput;                  //出力スレッド(mux部分を担当)
     std::atomic<bool>              thAudProcessAbort;         //音声処理スレッドに停止を通知する
     std::thread                    thAudProcess;              //音声処理スレッド(デコード/thAudEncodeがなければエンコードも担当)
-    std::atomic<bool>              thAudEncodeAbort;          //音声エンコードスレッドに停止を通知する
-    std::thread                    thAudEncode;               //音声エンコードスレッド(エンコードを担当)
+    std::vector<std::unique_ptr<AVMuxAudioEncodeThread>> thAudEncode; //音声エンコードスレッド(エンコードを担当、トラックごとに割り当て)
+    std::vector<int>               audEncodeThreadIdx;        //各音声トラックを担当する音声エンコードスレッドのindex (-1ならエンコードしない)
+    RGYSubmitOrder<AVPktMuxData>   audEncodeOrder;            //音声エンコードスレッドに投入した順序 (出力キューへの並べ替えに使用)
     HANDLE                         heEventPktAddedOutput;     //キューのいずれかにデータが追加されたことを通知する
     HANDLE                         heEventClosingOutput;      //出力スレッドが停止処理を開始したことを通知する
     HANDLE                         heEventPktAddedAudProcess; //キューのいずれかにデータが追加されたことを通知する
     HANDLE                         heEventClosingAudProcess;  //音声処理スレッドが停止処理を開始したことを通知する
-    HANDLE                         heEventPktAddedAudEncode;  //キューのいずれかにデータが追加されたことを通知する
-    HANDLE                         heEventClosingAudEncode;   //音声処理スレッドが停止処理を開始したことを通知する
     RGYQueueSPSP<RGYBitstream, 64> qVideobitstreamFreeI;      //映像 Iフレーム用に空いているデータ領域を格納する
     RGYQueueSPSP<RGYBitstream, 64> qVideobitstreamFreePB;     //映像 P/Bフレーム用に空いているデータ領域を格納する
     RGYQueueSPSP<RGYBitstream, 64> qVideobitstream;           //映像パケットを出力スレッドに渡すためのキュー
+    bool                           videoBufferReturn;         //AVPacketから解放された映像のデータ領域を空きキューに戻す (キューの終了後はfalse)
     RGYQueueSPSP<AVPktMuxData, 64> qAudioPacketProcess;       //処理前音声パケットをデコード/エンコードスレッドに渡すためのキュー
-    RGYQueueSPSP<AVPktMuxData, 64> qAudioFrameEncode;         //デコード済み音声フレームをエンコードスレッドに渡すためのキュー
     RGYQueueSPSP<AVPktMuxData, 64> qAudioPacketOut;           //音声パケットを出力スレッドに渡すためのキュー
     std::atomic<int64_t>           streamOutMaxDts;           //音声・字幕キューの最後のdts (timebase = QUEUE_DTS_TIMEBASE) (キューの同期に使用)
     PerfQueueInfo                 *queueInfo;                 //キューの情報を格納する構造体
@@ -305,6 +339,7 @@ struct AvcodecWriterPrm {
     int                          audioResampler;          //音声のresamplerの選択
     uint32_t                     audioIgnoreDecodeError;  //音声デコード時に発生したエラーを無視して、無音に置き換える
     int                          bufSizeMB;               //出力バッファサイズ
+    RGYOutputSink                outputSink;              //出力ファイルへの書き込み方法
     int                          threadOutput;            //出力スレッド数
     int                          threadAudio;             //音声処理スレッド数
     RGYOptList                   muxOpt;                  //mux時に使用するオプション
@@ -315,6 +350,8 @@ struct AvcodecWriterPrm {
     std::string                  videoCodecTag;           //動画タグ
     bool                         afs;                     //入力が自動フィールドシフト
     bool                         disableMp4Opt;           //mp4出力時のmuxの最適化を無効にする
+    RGYCMAFParam                 cmaf;                    //CMAFセグメント出力
+    std::shared_ptr<RGYAudioEncodeCache> audioEncodeCache; //他の出力と音声エンコードを共有する場合に使用する
 
     AvcodecWriterPrm() :
         inputFormatMetadata(nullptr),
@@ -330,6 +367,7 @@ struct AvcodecWriterPrm {
         audioResampler(0),
         audioIgnoreDecodeError(0),
         bufSizeMB(0),
+        outputSink(RGY_OUTPUT_SINK_STDIO),
         threadOutput(0),
         threadAudio(0),
         muxOpt(),
@@ -339,7 +377,9 @@ struct AvcodecWriterPrm {
         vidTimestamp(nullptr),
         videoCodecTag(),
         afs(false),
-        disableMp4Opt(false) {
+        disableMp4Opt(false),
+        cmaf(),
+        audioEncodeCache() {
     }
 };
 
@@ -380,11 +420,17 @@ protected:
     RGY_ERR ThreadFuncAudThread();
 
     //別のスレッドで実行する場合のスレッド関数 (音声エンコード処理)
-    RGY_ERR ThreadFuncAudEncodeThread();
+    RGY_ERR ThreadFuncAudEncodeThread(int threadIdx);
 
     //音声出力キューに追加 (音声処理スレッドが有効な場合のみ有効)
     RGY_ERR AddAudQueue(AVPktMuxData *pktData, int type);
 
+    //音声エンコードスレッドに投入し、投入した順にエンコード結果を出力キューに移す (音声処理スレッドから呼ぶ)
+    RGY_ERR AddAudEncodeQueue(AVPktMuxData *pktData);
+
+    //音声エンコードスレッドのエンコード結果を、投入した順に出力キューに移す (音声処理スレッドから呼ぶ)
+    RGY_ERR AudEncodeMerge();
+
     //AVPktMuxDataを初期化する
     AVPktMuxData pktMuxData(const AVPacket *pkt);
 
@@ -394,6 +440,14 @@ protected:
     //WriteNextFrameの本体
     RGY_ERR WriteNextFrameInternal(RGYBitstream *bitstream, int64_t *writtenDts);
 
+#if ENABLE_AVCODEC_OUT_THREAD
+    //映像のデータ領域を空きキューに戻す (出力スレッドから呼ぶ)
+    void VideoBufferReturn(RGYBitstream *bitstream, bool frameI);
+
+    //av_buffer_createで作成したAVBufferRefの解放時に呼ばれ、データ領域を空きキューに戻す
+    static void VideoBufferRelease(void *opaque, uint8_t *data);
+#endif //#if ENABLE_AVCODEC_OUT_THREAD
+
     //WriteNextPacketの本体
     RGY_ERR WriteNextPacketInternal(AVPktMuxData *pktData, int64_t maxDtsToWrite);
 
@@ -490,6 +544,22 @@ protected:
     //音声をエンコード
     vector<AVPktMuxData> AudioEncodeFrame(AVMuxAudio *muxAudio, AVFrame *frame);
 
+    //音声エンコードの設定から、エンコード結果が一致するかを判定するための文字列を作成する
+    std::string AudioEncodeSignature(const AVOutputStreamPrm *inputAudio, const AvcodecWriterPrm *prm);
+
+    //同一のエンコードを行うトラックを探し、エンコード結果を共有する設定を行う
+    void InitAudioEncodeShare(const vector<std::string>& signatures);
+
+    //他の出力から共有されたエンコード結果を取り出す
+    //wait = trueの場合は、共有元のエンコードの終了を待ってすべて取り出す
+    vector<AVPktMuxData> AudioSharedPackets(AVMuxAudio *muxAudio, bool wait);
+
+    //同じ出力内で同一のエンコードを行うトラックに、エンコード結果の参照を渡す
+    void AudioEncodeShareToSubtracks(vector<AVPktMuxData> *pktDatas, const AVPktMuxData *pktData);
+
+    //デコードしたフレームを必要とする(エンコード結果を受け取る側でない)トラックがあるか
+    bool AudioDecodeRequired(int inTrackId);
+
     //字幕パケットを書き出す
     RGY_ERR SubtitleTranscode(const AVMuxOther *pMuxSub, AVPacket *pkt);
 
@@ -514,6 +584,15 @@ protected:
     //ファイルヘッダーを書き出す
     RGY_ERR WriteFileHeader(const RGYBitstream *pBitstream);
 
+    //パケットをmuxerに渡す (pktは解放される)
+    int MuxWritePacket(AVPacket *pkt);
+
+    //CMAF出力時、muxerに渡したパケットをfragment (moof+mdat) として書き出す
+    RGY_ERR FlushFragment();
+
+    //CMAF出力時、IDRでセグメントを、指定フレーム数ごとにchunkを区切る
+    RGY_ERR WriteSegmentBoundary(bool isIDR, int64_t pts, int64_t duration);
+
     //タイムスタンプをTrimなどを考慮しつつ計算しなおす
     //nTimeInがTrimで切り取られる領域の場合
     //lastValidFrame ... true 最後の有効なフレーム+1のtimestampを返す / false .. AV_NOPTS_VALUEを返す
@@ -533,6 +612,12 @@ protected:
     static const AVRational QUEUE_DTS_TIMEBASE;
     AVMux m_Mux;
     vector<AVPktMuxData> m_AudPktBufFileHead; //ファイルヘッダを書く前にやってきた音声パケットのバッファ
+    vector<nal_info> m_VideoNalList; //WriteNextFrameInternalで使いまわすNALユニットのリスト
+    std::unique_ptr<RGYOutputSegmenter> m_segmenter; //CMAFセグメント出力
+    int m_cmafChunkFrames;           //chunkあたりのフレーム数 (0でセグメント単位)
+    int m_segmentChunkFrameCount;    //現在のchunkに書き込んだフレーム数
+    int64_t m_segmentEnd;            //書き込んだ映像の終端 (RGYOutputSegmenter::TIMESCALE単位)
+    std::shared_ptr<RGYAudioEncodeCache> m_audioEncodeCache; //他の出力と共有する音声エンコード
 };
 
 #endif //ENABLE_AVSW_READER
@@ -0,0 +1,414 @@
+﻿// -----------------------------------------------------------------------------------------
+// QSVEnc/NVEnc/VCEEnc by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2020 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+#include <cmath>
+#include <ctime>
+#include <cstdarg>
+#include <algorithm>
+#include "rgy_output_segment.h"
+
+static const char *CONTENT_TYPE_MP4  = "video/mp4";
+static const char *CONTENT_TYPE_M4S  = "video/iso.segment";
+static const char *CONTENT_TYPE_HLS  = "application/vnd.apple.mpegurl";
+static const char *CONTENT_TYPE_DASH = "application/dash+xml";
+
+//ISO 8601 (UTC) の時刻
+static std::string iso8601_time(time_t t) {
+    struct tm tm;
+#if defined(_WIN32) || defined(_WIN64)
+    gmtime_s(&tm, &t);
+#else
+    gmtime_r(&t, &tm);
+#endif
+    char buf[64];
+    strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%SZ", &tm);
+    return buf;
+}
+
+//ISO 8601 の期間
+static std::string iso8601_duration(double sec) {
+    return strsprintf("PT%.3fS", sec);
+}
+
+RGYOutputSegmenter::RGYOutputSegmenter(std::shared_ptr<RGYLog> log) :
+    m_log(log),
+    m_prm(),
+    m_url(),
+    m_state(State::Init),
+    m_dir(),
+    m_base(),
+    m_initName(),
+    m_fp(nullptr, fclose),
+    m_http(),
+    m_pending(),
+    m_segments(),
+    m_expired(),
+    m_cur(),
+    m_nextIndex(0),
+    m_firstStart(-1),
+    m_targetDuration(1),
+    m_maxBitrate(0.0),
+    m_availabilityStart(0),
+    m_codecs(),
+    m_width(0),
+    m_height(0),
+    m_fps() {
+    memset(&m_cur, 0, sizeof(m_cur));
+}
+
+RGYOutputSegmenter::~RGYOutputSegmenter() {
+    m_fp.reset();
+    m_http.reset();
+}
+
+void RGYOutputSegmenter::AddMessage(int log_level, const TCHAR *format, ...) {
+    if (m_log == nullptr || log_level < m_log->getLogLevel()) {
+        return;
+    }
+    va_list args;
+    va_start(args, format);
+    int len = _vsctprintf(format, args) + 1; // _vscprintf doesn't count terminating '\0'
+    tstring buffer;
+    buffer.resize(len, _T('\0'));
+    _vstprintf_s(&buffer[0], len, format, args);
+    va_end(args);
+    m_log->write(log_level, (tstring(_T("cmaf: ")) + buffer.c_str()).c_str());
+}
+
+RGY_ERR RGYOutputSegmenter::init(const tstring& outputFilename, const RGYCMAFParam& prm) {
+    m_prm = prm;
+    //出力ファイル名の拡張子を除いたものを、各ファイルの名前のもとにする
+    const auto spec = PathRemoveFileSpecFixed(outputFilename);
+    m_dir = (spec.first > 0) ? outputFilename.substr(0, outputFilename.length() - spec.first + 1) : tstring();
+    m_base = PathRemoveExtensionS(outputFilename.substr(m_dir.length()));
+    m_initName = m_base + _T("_init.mp4");
+    if (m_prm.url.length() > 0) {
+        if (!rgy_parse_url(m_url, m_prm.url)) {
+            AddMessage(RGY_LOG_ERROR, _T("invalid url: %s.\n"), m_prm.url.c_str());
+            return RGY_ERR_INVALID_PARAM;
+        }
+        m_http = std::unique_ptr<RGYHTTPChunkedUpload>(new RGYHTTPChunkedUpload(m_log));
+    }
+    m_availabilityStart = time(nullptr);
+    AddMessage(RGY_LOG_DEBUG, _T("init segment %s, chunk %d frames, window %d, playlist %s, output %s.\n"),
+        m_initName.c_str(), m_prm.chunkFrames, m_prm.window,
+        get_chr_from_value(list_cmaf_playlist, m_prm.playlist),
+        (m_http) ? m_prm.url.c_str() : ((m_dir.length() > 0) ? m_dir.c_str() : _T(".")));
+    return openOutput(m_initName, CONTENT_TYPE_MP4);
+}
+
+void RGYOutputSegmenter::setStreamInfo(const std::string& codecs, int width, int height, rgy_rational<int> fps) {
+    m_codecs = codecs;
+    m_width = width;
+    m_height = height;
+    m_fps = fps;
+}
+
+tstring RGYOutputSegmenter::segmentName(int index) const {
+    return m_base + strsprintf(_T("_%05d.m4s"), index);
+}
+
+RGY_ERR RGYOutputSegmenter::openOutput(const tstring& name, const char *contentType) {
+    if (m_http) {
+        return m_http->begin(m_url, tchar_to_string(m_prm.method), tchar_to_string(name, CP_UTF8), contentType);
+    }
+    const auto filename = m_dir + name;
+    m_fp.reset(_tfopen(filename.c_str(), _T("wb")));
+    if (!m_fp) {
+        AddMessage(RGY_LOG_ERROR, _T("failed to open \"%s\": %s.\n"), filename.c_str(), _tcserror(errno));
+        return RGY_ERR_FILE_OPEN;
+    }
+    return RGY_ERR_NONE;
+}
+
+int64_t RGYOutputSegmenter::writeOutput(const void *buf, size_t size) {
+    if (m_http) {
+        return (m_http->write(buf, size) == RGY_ERR_NONE) ? (int64_t)size : -1;
+    }
+    return (int64_t)fwrite(buf, 1, size, m_fp.get());
+}
+
+RGY_ERR RGYOutputSegmenter::closeOutput() {
+    if (m_http) {
+        return m_http->end();
+    }
+    if (m_fp) {
+        const bool err = fflush(m_fp.get()) != 0;
+        m_fp.reset();
+        if (err) {
+            return RGY_ERR_UNDEFINED_BEHAVIOR;
+        }
+    }
+    return RGY_ERR_NONE;
+}
+
+int64_t RGYOutputSegmenter::write(const void *buf, size_t size) {
+    switch (m_state) {
+    case State::Closed:
+        return (int64_t)size;
+    case State::Idle:
+        m_pending.insert(m_pending.end(), (const uint8_t *)buf, (const uint8_t *)buf + size);
+        return (int64_t)size;
+    case State::Segment:
+        m_cur.size += size;
+        //fall through
+    default:
+        return writeOutput(buf, size);
+    }
+}
+
+RGY_ERR RGYOutputSegmenter::finishInit() {
+    if (m_state != State::Init) {
+        return RGY_ERR_UNDEFINED_BEHAVIOR;
+    }
+    auto sts = closeOutput();
+    if (sts != RGY_ERR_NONE) {
+        AddMessage(RGY_LOG_ERROR, _T("failed to write %s.\n"), m_initName.c_str());
+        return sts;
+    }
+    m_state = State::Idle;
+    return RGY_ERR_NONE;
+}
+
+RGY_ERR RGYOutputSegmenter::startSegment(int64_t start) {
+    if (m_state != State::Idle) {
+        return RGY_ERR_UNDEFINED_BEHAVIOR;
+    }
+    if (m_firstStart < 0) {
+        m_firstStart = start;
+    }
+    m_cur.index = m_nextIndex++;
+    m_cur.start = start - m_firstStart;
+    m_cur.duration = 0;
+    m_cur.size = 0;
+    auto sts = openOutput(segmentName(m_cur.index), CONTENT_TYPE_M4S);
+    if (sts != RGY_ERR_NONE) {
+        return sts;
+    }
+    m_state = State::Segment;
+    if (m_pending.size() > 0) {
+        const auto pendingSize = m_pending.size();
+        if (write(m_pending.data(), pendingSize) != (int64_t)pendingSize) {
+            return RGY_ERR_UNDEFINED_BEHAVIOR;
+        }
+        m_pending.clear();
+    }
+    return RGY_ERR_NONE;
+}
+
+RGY_ERR RGYOutputSegmenter::flushChunk() {
+    if (m_state != State::Segment) {
+        return RGY_ERR_NONE;
+    }
+    //httpではwriteごとにchunkとして送信済み
+    if (m_fp && fflush(m_fp.get()) != 0) {
+        return RGY_ERR_UNDEFINED_BEHAVIOR;
+    }
+    return RGY_ERR_NONE;
+}
+
+RGY_ERR RGYOutputSegmenter::finishSegment(int64_t end) {
+    if (m_state != State::Segment) {
+        return RGY_ERR_UNDEFINED_BEHAVIOR;
+    }
+    m_state = State::Idle;
+    auto sts = closeOutput();
+    if (sts != RGY_ERR_NONE) {
+        AddMessage(RGY_LOG_ERROR, _T("failed to write %s.\n"), segmentName(m_cur.index).c_str());
+        return sts;
+    }
+    m_cur.duration = (std::max<int64_t>)(end - m_firstStart - m_cur.start, 1);
+    const double durationSec = m_cur.duration / (double)TIMESCALE;
+    m_targetDuration = (std::max<int64_t>)(m_targetDuration, (int64_t)(durationSec + 0.5));
+    m_maxBitrate = (std::max)(m_maxBitrate, m_cur.size * 8.0 / durationSec);
+    m_segments.push_back(m_cur);
+    AddMessage(RGY_LOG_DEBUG, _T("segment #%d: %.3f sec, %llu bytes.\n"), m_cur.index, durationSec, (unsigned long long)m_cur.size);
+
+    if (m_prm.window > 0) {
+        while ((int)m_segments.size() > m_prm.window) {
+            m_expired.push_back(m_segments.front().index);
+            m_segments.pop_front();
+        }
+        //プレイリストから外れた直後はまだ読み込み中のクライアントがいるかもしれないので、
+        //さらにwindow分経過してから削除する (httpの場合は送信先に任せる)
+        while ((int)m_expired.size() > m_prm.window) {
+            if (!m_http) {
+                _tremove((m_dir + segmentName(m_expired.front())).c_str());
+            }
+            m_expired.pop_front();
+        }
+    }
+    return updatePlaylist(false);
+}
+
+RGY_ERR RGYOutputSegmenter::close() {
+    if (m_state == State::Closed) {
+        return RGY_ERR_NONE;
+    }
+    RGY_ERR sts = RGY_ERR_NONE;
+    if (m_state == State::Init || m_state == State::Segment) {
+        //途中で終了した場合
+        sts = closeOutput();
+    }
+    m_state = State::Closed;
+    m_pending.clear();
+    if (m_segments.size() > 0) {
+        auto ret = updatePlaylist(true);
+        if (sts == RGY_ERR_NONE) {
+            sts = ret;
+        }
+    }
+    return sts;
+}
+
+RGY_ERR RGYOutputSegmenter::writeTextFile(const tstring& name, const std::string& str, const char *contentType) {
+    if (m_http) {
+        //セグメントの送信と同じ接続を使用する
+        RGY_ERR sts = RGY_ERR_NONE;
+        if (   (sts = m_http->begin(m_url, tchar_to_string(m_prm.method), tchar_to_string(name, CP_UTF8), contentType)) != RGY_ERR_NONE
+            || (sts = m_http->write(str.data(), str.length())) != RGY_ERR_NONE
+            || (sts = m_http->end()) != RGY_ERR_NONE) {
+            AddMessage(RGY_LOG_ERROR, _T("failed to upload %s.\n"), name.c_str());
+            return sts;
+        }
+        return RGY_ERR_NONE;
+    }
+    //読み手が書きかけのプレイリストを読まないよう、一時ファイルに書いてから置き換える
+    const auto filename = m_dir + name;
+    const auto tmpFile = filename + _T(".tmp");
+    {
+        std::unique_ptr<FILE, decltype(&fclose)> fp(_tfopen(tmpFile.c_str(), _T("wb")), fclose);
+        if (!fp) {
+            AddMessage(RGY_LOG_ERROR, _T("failed to open \"%s\": %s.\n"), tmpFile.c_str(), _tcserror(errno));
+            return RGY_ERR_FILE_OPEN;
+        }
+        if (fwrite(str.data(), 1, str.length(), fp.get()) != str.length()) {
+            fp.reset();
+            _tremove(tmpFile.c_str());
+            return RGY_ERR_UNDEFINED_BEHAVIOR;
+        }
+    }
+    _tremove(filename.c_str()); //Windowsでは、置き換え先が存在するとrenameに失敗する
+    if (_trename(tmpFile.c_str(), filename.c_str()) != 0) {
+        _tremove(tmpFile.c_str());
+        AddMessage(RGY_LOG_ERROR, _T("failed to rename to \"%s\".\n"), filename.c_str());
+        return RGY_ERR_UNDEFINED_BEHAVIOR;
+    }
+    return RGY_ERR_NONE;
+}
+
+RGY_ERR RGYOutputSegmenter::updatePlaylist(bool final) {
+    if (m_prm.playlist & RGY_CMAF_PLAYLIST_HLS) {
+        auto sts = writeTextFile(m_base + _T(".m3u8"), genHLS(final), CONTENT_TYPE_HLS);
+        if (sts != RGY_ERR_NONE) {
+            return sts;
+        }
+    }
+    if (m_prm.playlist & RGY_CMAF_PLAYLIST_DASH) {
+        auto sts = writeTextFile(m_base + _T(".mpd"), genMPD(final), CONTENT_TYPE_DASH);
+        if (sts != RGY_ERR_NONE) {
+            return sts;
+        }
+    }
+    return RGY_ERR_NONE;
+}
+
+std::string RGYOutputSegmenter::genHLS(bool final) const {
+    std::string str;
+    str += "#EXTM3U\n";
+    str += "#EXT-X-VERSION:7\n";
+    str += strsprintf("#EXT-X-TARGETDURATION:%d\n", (int)m_targetDuration);
+    str += strsprintf("#EXT-X-MEDIA-SEQUENCE:%d\n", m_segments.front().index);
+    if (m_prm.window == 0) {
+        str += (final) ? "#EXT-X-PLAYLIST-TYPE:VOD\n" : "#EXT-X-PLAYLIST-TYPE:EVENT\n";
+    }
+    str += "#EXT-X-INDEPENDENT-SEGMENTS\n";
+    str += strsprintf("#EXT-X-MAP:URI=\"%s\"\n", tchar_to_string(m_initName, CP_UTF8).c_str());
+    for (const auto& seg : m_segments) {
+        str += strsprintf("#EXTINF:%.3f,\n", seg.duration / (double)TIMESCALE);
+        str += tchar_to_string(segmentName(seg.index), CP_UTF8) + "\n";
+    }
+    if (final) {
+        str += "#EXT-X-ENDLIST\n";
+    }
+    return str;
+}
+
+std::string RGYOutputSegmenter::genMPD(bool final) const {
+    const auto& last = m_segments.back();
+    const double totalSec = (last.start + last.duration) / (double)TIMESCALE;
+    std::string str;
+    str += "<?xml version=\"1.0\" encoding=\"utf-8\"?>\n";
+    str += "<MPD xmlns=\"urn:mpeg:dash:schema:mpd:2011\" profiles=\"urn:mpeg:dash:profile:isoff-live:2011,urn:mpeg:dash:profile:cmaf:2019\"";
+    if (final) {
+        str += " type=\"static\"";
+        str += strsprintf(" mediaPresentationDuration=\"%s\"", iso8601_duration(totalSec).c_str());
+    } else {
+        str += " type=\"dynamic\"";
+        str += strsprintf(" availabilityStartTime=\"%s\"", iso8601_time(m_availabilityStart).c_str());
+        str += strsprintf(" publishTime=\"%s\"", iso8601_time(time(nullptr)).c_str());
+        str += strsprintf(" minimumUpdatePeriod=\"%s\"", iso8601_duration((double)m_targetDuration).c_str());
+        if (m_prm.window > 0) {
+            const double windowSec = (last.start + last.duration - m_segments.front().start) / (double)TIMESCALE;
+            str += strsprintf(" timeShiftBufferDepth=\"%s\"", iso8601_duration(windowSec).c_str());
+        }
+    }
+    str += strsprintf(" minBufferTime=\"%s\">\n", iso8601_duration((double)m_targetDuration).c_str());
+    str += "  <Period id=\"0\" start=\"PT0S\">\n";
+    str += "    <AdaptationSet id=\"0\" mimeType=\"video/mp4\" segmentAlignment=\"true\" startWithSAP=\"1\">\n";
+    str += strsprintf("      <Representation id=\"0\" bandwidth=\"%d\"", (int)std::ceil(m_maxBitrate));
+    if (m_codecs.length() > 0) {
+        str += strsprintf(" codecs=\"%s\"", m_codecs.c_str());
+    }
+    if (m_width > 0 && m_height > 0) {
+        str += strsprintf(" width=\"%d\" height=\"%d\"", m_width, m_height);
+    }
+    if (m_fps.n() > 0 && m_fps.d() > 0) {
+        str += strsprintf(" frameRate=\"%d/%d\"", m_fps.n(), m_fps.d());
+    }
+    str += ">\n";
+    str += strsprintf("        <SegmentTemplate timescale=\"%d\" initialization=\"%s\" media=\"%s_$Number%%05d$.m4s\" startNumber=\"%d\"",
+        TIMESCALE, tchar_to_string(m_initName, CP_UTF8).c_str(), tchar_to_string(m_base, CP_UTF8).c_str(), m_segments.front().index);
+    if (!final && m_prm.chunkFrames > 0 && m_fps.n() > 0) {
+        //chunk単位で取得できるので、セグメントの完了を待たずに取得を開始できることを示す
+        const double chunkSec = m_prm.chunkFrames * m_fps.d() / (double)m_fps.n();
+        const double segmentSec = last.duration / (double)TIMESCALE;
+        str += strsprintf(" availabilityTimeOffset=\"%.3f\" availabilityTimeComplete=\"false\"", (std::max)(segmentSec - chunkSec, 0.0));
+    }
+    str += ">\n";
+    str += "          <SegmentTimeline>\n";
+    for (const auto& seg : m_segments) {
+        str += strsprintf("            <S t=\"%lld\" d=\"%lld\"/>\n", (long long)seg.start, (long long)seg.duration);
+    }
+    str += "          </SegmentTimeline>\n";
+    str += "        </SegmentTemplate>\n";
+    str += "      </Representation>\n";
+    str += "    </AdaptationSet>\n";
+    str += "  </Period>\n";
+    str += "</MPD>\n";
+    return str;
+}
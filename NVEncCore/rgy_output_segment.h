@@ -0,0 +1,123 @@
+﻿// -----------------------------------------------------------------------------------------
+// QSVEnc/NVEnc/VCEEnc by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2020 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+#pragma once
+#ifndef __RGY_OUTPUT_SEGMENT_H__
+#define __RGY_OUTPUT_SEGMENT_H__
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include "rgy_def.h"
+#include "rgy_err.h"
+#include "rgy_log.h"
+#include "rgy_util.h"
+#include "rgy_socket.h"
+
+//CMAF (fragmented mp4) のセグメント出力
+//muxerの書き出すデータを初期化セグメント (<base>_init.mp4) と各セグメント (<base>_%05d.m4s) に振り分け、
+//セグメントを閉じるたびにプレイリスト (<base>.m3u8 / <base>.mpd) を更新する
+//url指定時は、ファイルの代わりにhttpのchunked転送で送信する
+//
+//呼び出し順: init -> write* -> finishInit -> (startSegment -> (write* -> flushChunk)* -> finishSegment)* -> close
+class RGYOutputSegmenter {
+public:
+    //プレイリストで使用する時間の単位
+    static const int TIMESCALE = 90000;
+
+    RGYOutputSegmenter(std::shared_ptr<RGYLog> log);
+    ~RGYOutputSegmenter();
+
+    RGY_ERR init(const tstring& outputFilename, const RGYCMAFParam& prm);
+    //DASHのRepresentationに記載する情報 (codecsはRFC6381形式)
+    void setStreamInfo(const std::string& codecs, int width, int height, rgy_rational<int> fps);
+    //書き込んだバイト数を返す (エラー時は負の値)
+    int64_t write(const void *buf, size_t size);
+    //ここまでに書き込まれたデータを初期化セグメントとして閉じる
+    RGY_ERR finishInit();
+    //startはTIMESCALE単位
+    RGY_ERR startSegment(int64_t start);
+    //ここまでに書き込まれたchunkを読み手に見えるようにする
+    RGY_ERR flushChunk();
+    //endはTIMESCALE単位、セグメントを閉じてプレイリストを更新する
+    RGY_ERR finishSegment(int64_t end);
+    //最終的なプレイリストを書き出す、以降に書き込まれたデータ (mfraなど) は捨てる
+    RGY_ERR close();
+
+    bool segmentOpened() const { return m_state == State::Segment; }
+    const tstring& initName() const { return m_initName; }
+protected:
+    enum class State {
+        Init,
+        Idle,    //セグメント間 (書き込まれたデータは次のセグメントの先頭に回す)
+        Segment,
+        Closed,
+    };
+    struct Segment {
+        int index;
+        int64_t start;
+        int64_t duration;
+        uint64_t size;
+    };
+    RGY_ERR openOutput(const tstring& name, const char *contentType);
+    int64_t writeOutput(const void *buf, size_t size);
+    RGY_ERR closeOutput();
+    RGY_ERR writeTextFile(const tstring& name, const std::string& str, const char *contentType);
+    RGY_ERR updatePlaylist(bool final);
+    std::string genHLS(bool final) const;
+    std::string genMPD(bool final) const;
+    tstring segmentName(int index) const;
+    void AddMessage(int log_level, const TCHAR *format, ...);
+
+    std::shared_ptr<RGYLog> m_log;
+    RGYCMAFParam m_prm;
+    RGYURL m_url;
+    State m_state;
+    tstring m_dir;
+    tstring m_base;
+    tstring m_initName;
+    std::unique_ptr<FILE, decltype(&fclose)> m_fp;
+    std::unique_ptr<RGYHTTPChunkedUpload> m_http;
+    std::vector<uint8_t> m_pending;  //Idle中に書き込まれたデータ
+    std::deque<Segment> m_segments;  //プレイリストに記載するセグメント
+    std::deque<int> m_expired;       //プレイリストから外れたが、まだ削除していないセグメント
+    Segment m_cur;
+    int m_nextIndex;
+    int64_t m_firstStart;
+    int64_t m_targetDuration;        //秒
+    double m_maxBitrate;
+    time_t m_availabilityStart;
+    std::string m_codecs;
+    int m_width;
+    int m_height;
+    rgy_rational<int> m_fps;
+};
+
+#endif //__RGY_OUTPUT_SEGMENT_H__
@@ -35,11 +35,13 @@
 #include <string>
 #include "rgy_status.h"
 #include "rgy_perf_monitor.h"
+#include "rgy_metrics.h"
 #include "cpu_info.h"
 #include "rgy_osdep.h"
 #include "rgy_util.h"
 #include "rgy_pipe.h"
 #include "gpuz_info.h"
+#include "rgy_perf_monitor_proc.h"
 #if defined(_WIN32) || defined(_WIN64)
 #include <psapi.h>
 #else
@@ -47,6 +49,7 @@
 #include <sys/types.h>
 #include <sys/time.h>
 #include <sys/resource.h>
+#include <linux/perf_event.h>
 
 extern "C" {
 extern char _binary_PerfMonitor_perf_monitor_pyw_start[];
@@ -56,6 +59,20 @@ extern char _binary_PerfMonitor_perf_monitor_pyw_size[];
 
 #endif //#if defined(_WIN32) || defined(_WIN64)
 
+#if !(defined(_WIN32) || defined(_WIN64))
+//m_thProcの並び
+enum {
+    PERF_THREAD_PROC_MAIN = 0,
+    PERF_THREAD_PROC_ENC,
+    PERF_THREAD_PROC_AUDP,
+    PERF_THREAD_PROC_AUDE,
+    PERF_THREAD_PROC_IN,
+    PERF_THREAD_PROC_OUT,
+    PERF_THREAD_PROC_COUNT,
+};
+
+#endif //#if !(defined(_WIN32) || defined(_WIN64))
+
 #if ENABLE_METRIC_FRAMEWORK
 #pragma comment(lib, "gmframework.lib")
 #pragma comment(lib, "building_blocks.lib")
@@ -479,6 +496,7 @@ CPerfMonitor::CPerfMonitor() :
     m_nSelectOutputPlot(0),
     m_QueueInfo(),
     m_pRGYLog(),
+    m_metrics(),
 #if ENABLE_METRIC_FRAMEWORK
     m_pLoader(nullptr),
     m_pManager(),
@@ -496,6 +514,10 @@ CPerfMonitor::CPerfMonitor() :
     m_perfCounter(),
 #endif //#if ENABLE_PERF_COUNTER
     m_prefCounterValid(false)
+#if !(defined(_WIN32) || defined(_WIN64))
+    , m_thProcMtx(),
+    m_thProc()
+#endif //#if !(defined(_WIN32) || defined(_WIN64))
 {
     memset(m_info, 0, sizeof(m_info));
     memset(&m_pipes, 0, sizeof(m_pipes));
@@ -527,6 +549,7 @@ void CPerfMonitor::clear() {
 #endif //#if ENABLE_PERF_COUNTER
     memset(m_info, 0, sizeof(m_info));
     memset(&m_QueueInfo, 0, sizeof(m_QueueInfo));
+    m_metrics.reset();
 #if ENABLE_METRIC_FRAMEWORK
     if (m_pManager) {
         const auto metricsUsed = m_Consumer.getMetricUsed();
@@ -538,6 +561,9 @@ void CPerfMonitor::clear() {
 #endif //#if ENABLE_METRIC_FRAMEWORK
 
     m_nStep = 0;
+#if !(defined(_WIN32) || defined(_WIN64))
+    closeThreadProc();
+#endif //#if !(defined(_WIN32) || defined(_WIN64))
     m_thMainThread.reset();
     m_thAudProcThread = NULL;
     m_thEncThread = NULL;
@@ -630,6 +656,9 @@ void CPerfMonitor::write_header(FILE *fp, int nSelect) {
     if (nSelect & PERF_MONITOR_THREAD_OUT) {
         str += ",cpu out thread (%)";
     }
+    if (nSelect & PERF_MONITOR_CPU_COUNTER) {
+        str += ",cpu cycles (M/s),cpu llc miss (K/s)";
+    }
     if (nSelect & PERF_MONITOR_GPU_LOAD) {
         str += ",gpu load (%)";
     }
@@ -663,6 +692,9 @@ void CPerfMonitor::write_header(FILE *fp, int nSelect) {
     if (nSelect & PERF_MONITOR_QUEUE_AUD_OUT) {
         str += ",queue aud out";
     }
+    if (nSelect & PERF_MONITOR_OUT_SINK) {
+        str += ",out inflight (KB),out write <1ms,out write <4ms,out write <16ms,out write <64ms,out write <256ms,out write >=256ms";
+    }
     if (nSelect & PERF_MONITOR_MEM_PRIVATE) {
         str += ",mem private (MB)";
     }
@@ -705,9 +737,14 @@ int CPerfMonitor::init(tstring filename, const TCHAR *pPythonPath,
     clear();
     m_pRGYLog = pRGYLog;
     m_luid = prm->luid;
+    m_metrics = prm->metrics;
     m_pid = GetCurrentProcessId();
 
+#if defined(_WIN32) || defined(_WIN64)
     m_nCreateTime100ns = (int64_t)(clock() * (1e7 / CLOCKS_PER_SEC) + 0.5);
+#else
+    m_nCreateTime100ns = perfMonitorTime100ns();
+#endif //#if defined(_WIN32) || defined(_WIN64)
     m_sMonitorFilename = filename;
     m_nInterval = interval;
     m_nSelectOutputPlot = nSelectOutputPlot;
@@ -865,18 +902,38 @@ int CPerfMonitor::init(tstring filename, const TCHAR *pPythonPath,
     m_nSelectCheck &= (~PERF_MONITOR_FRAME_IN);
 
     //未実装
-#if !(defined(_WIN32) || defined(_WIN64))
-    m_nSelectCheck &= (~PERF_MONITOR_THREAD_MAIN);
-    m_nSelectCheck &= (~PERF_MONITOR_THREAD_ENC);
-    m_nSelectCheck &= (~PERF_MONITOR_THREAD_AUDP);
-    m_nSelectCheck &= (~PERF_MONITOR_THREAD_AUDE);
-    m_nSelectCheck &= (~PERF_MONITOR_THREAD_OUT);
-    m_nSelectCheck &= (~PERF_MONITOR_THREAD_IN);
+#if defined(_WIN32) || defined(_WIN64)
+    m_nSelectCheck &= (~PERF_MONITOR_CPU_COUNTER);
+#else
     m_nSelectCheck &= (~PERF_MONITOR_GPU_CLOCK);
     m_nSelectCheck &= (~PERF_MONITOR_GPU_LOAD);
     m_nSelectCheck &= (~PERF_MONITOR_MFX_LOAD);
 #endif //#if defined(_WIN32) || defined(_WIN64)
 
+#if !(defined(_WIN32) || defined(_WIN64))
+    {
+        std::lock_guard<std::mutex> lock(m_thProcMtx);
+        m_thProc = {
+            { -1, -1, -1, &PerfInfo::main_thread_total_active_us,     &PerfInfo::main_thread_percent },
+            { -1, -1, -1, &PerfInfo::enc_thread_total_active_us,      &PerfInfo::enc_thread_percent },
+            { -1, -1, -1, &PerfInfo::aud_proc_thread_total_active_us, &PerfInfo::aud_proc_thread_percent },
+            { -1, -1, -1, &PerfInfo::aud_enc_thread_total_active_us,  &PerfInfo::aud_enc_thread_percent },
+            { -1, -1, -1, &PerfInfo::in_thread_total_active_us,       &PerfInfo::in_thread_percent },
+            { -1, -1, -1, &PerfInfo::out_thread_total_active_us,      &PerfInfo::out_thread_percent },
+        };
+        setThreadProc(&m_thProc[PERF_THREAD_PROC_MAIN], m_thMainThread.get());
+    }
+    if ((m_nSelectCheck & PERF_MONITOR_CPU_COUNTER) && m_thProc[PERF_THREAD_PROC_MAIN].fdCycles < 0) {
+        //allで暗黙に選択された場合は警告を出さない
+        const int log_level = ((nSelectOutputLog | nSelectOutputPlot) == PERF_MONITOR_ALL) ? RGY_LOG_DEBUG : RGY_LOG_WARN;
+        m_pRGYLog->write(log_level, _T("Failed to open cpu counters by perf_event_open, please check /proc/sys/kernel/perf_event_paranoid.\n"));
+        m_pRGYLog->write(log_level, _T("cpu_counter in performance monitor disabled.\n"));
+        m_nSelectCheck &= (~PERF_MONITOR_CPU_COUNTER);
+        std::lock_guard<std::mutex> lock(m_thProcMtx);
+        setThreadProc(&m_thProc[PERF_THREAD_PROC_MAIN], m_thMainThread.get());
+    }
+#endif //#if !(defined(_WIN32) || defined(_WIN64))
+
 #if ENCODER_QSV
     m_nSelectCheck &= (~PERF_MONITOR_VED_LOAD);
     m_nSelectCheck &= (~PERF_MONITOR_VEE_LOAD);
@@ -912,8 +969,57 @@ void CPerfMonitor::SetThreadHandles(HANDLE thEncThread, HANDLE thInThread, HANDL
     m_thOutThread = thOutThread;
     m_thAudProcThread = thAudProcThread;
     m_thAudEncThread = thAudEncThread;
+#if !(defined(_WIN32) || defined(_WIN64))
+    std::lock_guard<std::mutex> lock(m_thProcMtx);
+    if (m_thProc.size() == PERF_THREAD_PROC_COUNT) {
+        setThreadProc(&m_thProc[PERF_THREAD_PROC_ENC],  m_thEncThread);
+        setThreadProc(&m_thProc[PERF_THREAD_PROC_AUDP], m_thAudProcThread);
+        setThreadProc(&m_thProc[PERF_THREAD_PROC_AUDE], m_thAudEncThread);
+        setThreadProc(&m_thProc[PERF_THREAD_PROC_IN],   m_thInThread);
+        setThreadProc(&m_thProc[PERF_THREAD_PROC_OUT],  m_thOutThread);
+    }
+#endif //#if !(defined(_WIN32) || defined(_WIN64))
+}
+
+#if !(defined(_WIN32) || defined(_WIN64))
+//m_thProcMtxをロックした状態で呼ぶこと
+void CPerfMonitor::setThreadProc(PerfThreadProc *thProc, HANDLE thread) {
+    if (thProc->fdCycles >= 0) {
+        close(thProc->fdCycles);
+    }
+    if (thProc->fdLLCMiss >= 0) {
+        close(thProc->fdLLCMiss);
+    }
+    thProc->tid = (thread) ? perfMonitorThreadTid(thread) : -1;
+    thProc->fdCycles = -1;
+    thProc->fdLLCMiss = -1;
+    if (thProc->tid <= 0 || (m_nSelectCheck & PERF_MONITOR_CPU_COUNTER) == 0) {
+        return;
+    }
+    //同じスレッドが複数登録されている場合は、カウンタを二重に計上しないようにする
+    for (const auto& th : m_thProc) {
+        if (&th != thProc && th.tid == thProc->tid && th.fdCycles >= 0) {
+            return;
+        }
+    }
+    thProc->fdCycles = perfMonitorOpenEvent(thProc->tid, PERF_COUNT_HW_CPU_CYCLES);
+    thProc->fdLLCMiss = perfMonitorOpenEvent(thProc->tid, PERF_COUNT_HW_CACHE_MISSES);
 }
 
+void CPerfMonitor::closeThreadProc() {
+    std::lock_guard<std::mutex> lock(m_thProcMtx);
+    for (auto& th : m_thProc) {
+        if (th.fdCycles >= 0) {
+            close(th.fdCycles);
+        }
+        if (th.fdLLCMiss >= 0) {
+            close(th.fdLLCMiss);
+        }
+    }
+    m_thProc.clear();
+}
+#endif //#if !(defined(_WIN32) || defined(_WIN64))
+
 void CPerfMonitor::check() {
     PerfInfo *pInfoNew = &m_info[(m_nStep + 1) & 1];
     PerfInfo *pInfoOld = &m_info[ m_nStep      & 1];
@@ -1044,46 +1150,28 @@ void CPerfMonitor::check() {
     getrusage(RUSAGE_SELF, &usage);
 
     //現在時間
-    uint64_t current_time = clock() * (1e7 / CLOCKS_PER_SEC);
-
-    std::string proc_dir = strsprintf("/proc/%d/", (int)getpid());
-    //メモリ情報
-    FILE *fp_mem = popen((std::string("cat ") + proc_dir + std::string("status")).c_str(), "r");
-    if (fp_mem) {
-        char buffer[2048] = { 0 };
-        while (NULL != fgets(buffer, _countof(buffer), fp_mem)) {
-            if (nullptr != strstr(buffer, "VmSize")) {
-                long long i = 0;
-                if (1 == sscanf(buffer, "VmSize: %lld kB", &i)) {
-                    pInfoNew->mem_virtual = i << 10;
-                }
-            } else if (nullptr != strstr(buffer, "VmRSS")) {
-                long long i = 0;
-                if (1 == sscanf(buffer, "VmRSS: %lld kB", &i)) {
-                    pInfoNew->mem_private = i << 10;
-                }
-            }
+    const int64_t current_time = perfMonitorTime100ns();
+
+    //メモリ情報 (statm: size resident shared text lib data dt, ページ単位)
+    char buffer[2048];
+    if (perfMonitorReadProc("/proc/self/statm", buffer, sizeof(buffer)) > 0) {
+        static const int64_t pageSize = sysconf(_SC_PAGESIZE);
+        long long size = 0, resident = 0;
+        if (2 == sscanf(buffer, "%lld %lld", &size, &resident)) {
+            pInfoNew->mem_virtual = size * pageSize;
+            pInfoNew->mem_private = resident * pageSize;
         }
-        fclose(fp_mem);
     }
     //IO情報
-    FILE *fp_io = popen((std::string("cat ") + proc_dir + std::string("io")).c_str(), "r");
-    if (fp_io) {
-        char buffer[2048] = { 0 };
-        while (NULL != fgets(buffer, _countof(buffer), fp_io)) {
-            if (nullptr != strstr(buffer, "rchar:")) {
-                long long i = 0;
-                if (1 == sscanf(buffer, "rchar: %lld", &i)) {
-                    pInfoNew->io_total_read = i;
-                }
-            } else if (nullptr != strstr(buffer, "wchar")) {
-                long long i = 0;
-                if (1 == sscanf(buffer, "wchar: %lld", &i)) {
-                    pInfoNew->io_total_write = i;
-                }
-            }
+    if (perfMonitorReadProc("/proc/self/io", buffer, sizeof(buffer)) > 0) {
+        long long i = 0;
+        const char *ptr = nullptr;
+        if (nullptr != (ptr = strstr(buffer, "rchar:")) && 1 == sscanf(ptr, "rchar: %lld", &i)) {
+            pInfoNew->io_total_read = i;
+        }
+        if (nullptr != (ptr = strstr(buffer, "wchar:")) && 1 == sscanf(ptr, "wchar: %lld", &i)) {
+            pInfoNew->io_total_write = i;
         }
-        fclose(fp_io);
     }
 
     //CPU情報
@@ -1173,6 +1261,34 @@ void CPerfMonitor::check() {
                 pInfoNew->out_thread_percent = 0.0;
             }
         }
+#else
+        //スレッドCPU使用率
+        int64_t cpu_cycles = 0;
+        int64_t cpu_llc_miss = 0;
+        {
+            std::lock_guard<std::mutex> lock(m_thProcMtx);
+            for (const auto& th : m_thProc) {
+                if (th.tid <= 0) {
+                    continue;
+                }
+                const int64_t active_us = perfMonitorThreadActiveUs(th.tid);
+                if (active_us >= 0) {
+                    pInfoNew->*th.activeUs = active_us;
+                    pInfoNew->*th.percent = (active_us - pInfoOld->*th.activeUs) * 100.0 * logical_cpu_inv * time_diff_inv;
+                } else {
+                    pInfoNew->*th.percent = 0.0;
+                }
+                //終了したスレッドのカウンタも最終値を返すので、そのまま合算する
+                cpu_cycles   += perfMonitorReadEvent(th.fdCycles);
+                cpu_llc_miss += perfMonitorReadEvent(th.fdLLCMiss);
+            }
+        }
+        if (m_nSelectCheck & PERF_MONITOR_CPU_COUNTER) {
+            pInfoNew->cpu_cycles   = cpu_cycles;
+            pInfoNew->cpu_llc_miss = cpu_llc_miss;
+            pInfoNew->cpu_cycles_per_sec   = std::max<int64_t>(pInfoNew->cpu_cycles   - pInfoOld->cpu_cycles,   0) * time_diff_inv * 1e6;
+            pInfoNew->cpu_llc_miss_per_sec = std::max<int64_t>(pInfoNew->cpu_llc_miss - pInfoOld->cpu_llc_miss, 0) * time_diff_inv * 1e6;
+        }
 #endif //defined(_WIN32) || defined(_WIN64)
     }
 
@@ -1242,6 +1358,10 @@ void CPerfMonitor::write(FILE *fp, int nSelect) {
     if (nSelect & PERF_MONITOR_THREAD_OUT) {
         str += strsprintf(",%lf", pInfo->out_thread_percent);
     }
+    if (nSelect & PERF_MONITOR_CPU_COUNTER) {
+        str += strsprintf(",%.2lf", pInfo->cpu_cycles_per_sec * 1e-6);
+        str += strsprintf(",%.2lf", pInfo->cpu_llc_miss_per_sec * 1e-3);
+    }
     if (nSelect & PERF_MONITOR_GPU_LOAD) {
         str += strsprintf(",%lf", pInfo->gpu_load_percent);
     }
@@ -1277,6 +1397,12 @@ void CPerfMonitor::write(FILE *fp, int nSelect) {
     if (nSelect & PERF_MONITOR_QUEUE_AUD_OUT) {
         str += strsprintf(",%d", (int)m_QueueInfo.usage_aud_out);
     }
+    if (nSelect & PERF_MONITOR_OUT_SINK) {
+        str += strsprintf(",%d", (int)(m_QueueInfo.output_inflight >> 10));
+        for (int i = 0; i < PERF_OUTPUT_WRITE_LATENCY_BINS; i++) {
+            str += strsprintf(",%u", m_QueueInfo.output_write_latency[i]);
+        }
+    }
     if (nSelect & PERF_MONITOR_MEM_PRIVATE) {
         str += strsprintf(",%.2lf", pInfo->mem_private / (double)(1024 * 1024));
     }
@@ -1323,6 +1449,7 @@ void CPerfMonitor::run() {
         auto timenow = std::chrono::system_clock::now();
         if (m_nInterval <= 100 || timenow - m_refreshedTime > std::chrono::milliseconds(m_nInterval)) {
             check();
+            publishMetrics();
             if (m_pProcess && !m_pProcess->processAlive()) {
                 if (m_pipes.f_stdin) {
                     fclose(m_pipes.f_stdin);
@@ -1340,6 +1467,23 @@ void CPerfMonitor::run() {
         std::this_thread::sleep_for(std::chrono::milliseconds((m_nInterval <= 100) ? m_nInterval : 50));
     }
     check();
+    publishMetrics();
     write(m_fpLog.get(),   m_nSelectOutputLog);
     write(m_pipes.f_stdin, m_nSelectOutputPlot);
 }
+
+void CPerfMonitor::publishMetrics() {
+    if (!m_metrics) {
+        return;
+    }
+    //裏側のバッファに書き込んでから入れ替えるので、scrape中でも待たない
+    auto snap = m_metrics->back();
+    snap->perf = m_info[m_nStep & 1];
+    snap->queue = m_QueueInfo;
+    snap->encStarted = m_bEncStarted && m_pEncStatus;
+    if (snap->encStarted) {
+        snap->enc = m_pEncStatus->GetEncodeData();
+    }
+    snap->valid = true;
+    m_metrics->publish();
+}
@@ -34,6 +34,8 @@
 #include <climits>
 #include <memory>
 #include <map>
+#include <mutex>
+#include <vector>
 #include "cpu_info.h"
 #include "rgy_def.h"
 #include "rgy_version.h"
@@ -100,6 +102,8 @@ enum : int {
     PERF_MONITOR_VEE_LOAD      = 0x04000000,
     PERF_MONITOR_VED_LOAD      = 0x08000000,
     PERF_MONITOR_PCIE_LOAD     = 0x10000000,
+    PERF_MONITOR_OUT_SINK      = 0x20000000,
+    PERF_MONITOR_CPU_COUNTER   = 0x40000000,
     PERF_MONITOR_ALL         = (int)UINT_MAX,
 };
 
@@ -115,6 +119,7 @@ static const CX_DESC list_pref_monitor[] = {
     { _T("cpu_aud_proc"),PERF_MONITOR_THREAD_AUDP },
     { _T("cpu_aud_enc"), PERF_MONITOR_THREAD_AUDE },
     { _T("cpu_out"),     PERF_MONITOR_THREAD_OUT },
+    { _T("cpu_counter"), PERF_MONITOR_CPU_COUNTER },
     { _T("mem"),         PERF_MONITOR_MEM_PRIVATE | PERF_MONITOR_MEM_VIRTUAL },
     { _T("mem_private"), PERF_MONITOR_MEM_PRIVATE },
     { _T("mem_virtual"), PERF_MONITOR_MEM_VIRTUAL },
@@ -137,6 +142,7 @@ static const CX_DESC list_pref_monitor[] = {
     { _T("pcie_load"),   PERF_MONITOR_PCIE_LOAD },
     { _T("ve_clock"),    PERF_MONITOR_VE_CLOCK },
     { _T("queue"),       PERF_MONITOR_QUEUE_VID_IN | PERF_MONITOR_QUEUE_VID_OUT | PERF_MONITOR_QUEUE_AUD_IN | PERF_MONITOR_QUEUE_AUD_OUT },
+    { _T("out_sink"),    PERF_MONITOR_OUT_SINK },
     { nullptr, 0 }
 };
 
@@ -158,6 +164,9 @@ struct PerfInfo {
     int64_t io_total_read;
     int64_t io_total_write;
 
+    int64_t cpu_cycles;
+    int64_t cpu_llc_miss;
+
     int64_t frames_in;
     int64_t frames_out;
     int64_t frames_out_byte;
@@ -181,6 +190,9 @@ struct PerfInfo {
     double  out_thread_percent;
     double  in_thread_percent;
 
+    double  cpu_cycles_per_sec;
+    double  cpu_llc_miss_per_sec;
+
     BOOL    gpu_info_valid;
     double  gpu_load_percent;
     double  gpu_clock;
@@ -203,6 +215,9 @@ struct PerfOutputInfo {
     ptrdiff_t offset;
 };
 
+//出力の書き込み時間のヒストグラムのビン数 (1ms, 4ms, 16ms, 64ms, 256ms, それ以上)
+static const int PERF_OUTPUT_WRITE_LATENCY_BINS = 6;
+
 struct PerfQueueInfo {
     size_t usage_vid_in;
     size_t usage_aud_in;
@@ -210,6 +225,8 @@ struct PerfQueueInfo {
     size_t usage_aud_out;
     size_t usage_aud_enc;
     size_t usage_aud_proc;
+    size_t output_inflight;                                        //出力の書き込み待ちのバイト数
+    uint32_t output_write_latency[PERF_OUTPUT_WRITE_LATENCY_BINS]; //出力の書き込み時間のヒストグラム
 };
 
 #if ENABLE_METRIC_FRAMEWORK
@@ -362,18 +379,32 @@ public:
     int getData(NVMLMonitorInfo *info, const std::string& gpu_pcibusid);
 };
 
+#if !(defined(_WIN32) || defined(_WIN64))
+//Linux用 監視対象スレッドの情報
+struct PerfThreadProc {
+    int tid;       //カーネルのスレッドID (-1で無効)
+    int fdCycles;  //perf_eventのfd (cycles)
+    int fdLLCMiss; //perf_eventのfd (LLC miss)
+    int64_t PerfInfo::*activeUs; //PerfInfoの格納先 (累積CPU時間)
+    double  PerfInfo::*percent;  //PerfInfoの格納先 (CPU使用率)
+};
+#endif //#if !(defined(_WIN32) || defined(_WIN64))
+
+class RGYMetricsSource;
+
 struct CPerfMonitorPrm {
 #if ENABLE_NVML
     std::string pciBusId;
 #endif
     LUID luid;
+    std::shared_ptr<RGYMetricsSource> metrics; //--metrics-portで公開する値の書き込み先
     char reserved[256];
 
     CPerfMonitorPrm() :
 #if ENABLE_NVML
         pciBusId(),
 #endif
-        luid({ 0 }), reserved() {};
+        luid({ 0 }), metrics(), reserved() {};
 };
 
 class CPerfMonitor {
@@ -423,6 +454,7 @@ public:
 protected:
     int createPerfMpnitorPyw(const TCHAR *pywPath);
     void check();
+    void publishMetrics();
     void run();
     void write_header(FILE *fp, int nSelect);
     void write(FILE *fp, int nSelect);
@@ -456,6 +488,10 @@ protected:
     static void loader(void *prm);
 
     tstring SelectedCounters(int select);
+#if !(defined(_WIN32) || defined(_WIN64))
+    void setThreadProc(PerfThreadProc *thProc, HANDLE thread);
+    void closeThreadProc();
+#endif //#if !(defined(_WIN32) || defined(_WIN64))
 
     int m_nStep;
     LUID m_luid;
@@ -488,6 +524,7 @@ protected:
     int m_nSelectOutputPlot;
     PerfQueueInfo m_QueueInfo;
     std::shared_ptr<RGYLog> m_pRGYLog;
+    std::shared_ptr<RGYMetricsSource> m_metrics;
 
 #if ENABLE_METRIC_FRAMEWORK
     IExtensionLoader *m_pLoader;
@@ -507,6 +544,10 @@ protected:
     std::unique_ptr<RGYGPUCounterWin> m_perfCounter;
 #endif
     bool m_prefCounterValid;
+#if !(defined(_WIN32) || defined(_WIN64))
+    std::mutex m_thProcMtx;
+    std::vector<PerfThreadProc> m_thProc;
+#endif //#if !(defined(_WIN32) || defined(_WIN64))
 };
 
 
@@ -0,0 +1,122 @@
+﻿// -----------------------------------------------------------------------------------------
+// QSVEnc/NVEnc/VCEEnc by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2020 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+
+#include "rgy_perf_monitor_proc.h"
+#if !(defined(_WIN32) || defined(_WIN64))
+#include <cstring>
+#include <cstdio>
+#include <ctime>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+int64_t perfMonitorTime100ns() {
+    struct timespec ts = { 0 };
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 10000000 + ts.tv_nsec / 100;
+}
+
+int perfMonitorReadProc(const char *path, char *buffer, size_t size) {
+    const int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    size_t total = 0;
+    while (total + 1 < size) {
+        const auto ret = read(fd, buffer + total, size - 1 - total);
+        if (ret <= 0) {
+            break;
+        }
+        total += ret;
+    }
+    close(fd);
+    buffer[total] = '\0';
+    return (int)total;
+}
+
+//pthread_getcpuclockidの返すclockidにはスレッドIDが ~(clockid >> 3) として埋め込まれている
+int perfMonitorThreadTid(HANDLE thread) {
+    if (pthread_equal((pthread_t)thread, pthread_self())) {
+        return (int)syscall(SYS_gettid);
+    }
+    clockid_t cid = 0;
+    if (pthread_getcpuclockid((pthread_t)thread, &cid) != 0) {
+        return -1;
+    }
+    const int tid = (int)~(cid >> 3);
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/self/task/%d", tid);
+    return (tid > 0 && access(path, F_OK) == 0) ? tid : -1;
+}
+
+int64_t perfMonitorThreadActiveUs(int tid) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/self/task/%d/stat", tid);
+    char buffer[1024];
+    if (perfMonitorReadProc(path, buffer, sizeof(buffer)) <= 0) {
+        return -1;
+    }
+    //2番目のcommには空白や括弧が含まれうるので、最後の')'以降を解析する
+    const char *ptr = strrchr(buffer, ')');
+    if (ptr == nullptr) {
+        return -1;
+    }
+    char state = 0;
+    unsigned long long utime = 0, stime = 0;
+    //3:state, 4-8:ppid,pgrp,session,tty_nr,tpgid, 9-13:flags,minflt,cminflt,majflt,cmajflt, 14:utime, 15:stime
+    if (3 != sscanf(ptr + 1, " %c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu", &state, &utime, &stime)
+        || state == 'Z' || state == 'X') {
+        return -1;
+    }
+    static const int64_t clkTck = sysconf(_SC_CLK_TCK);
+    return (int64_t)((utime + stime) * 1000000 / clkTck);
+}
+
+//perf_event_paranoid=2でも使用できるよう、ユーザー空間のみを計測する
+int perfMonitorOpenEvent(int tid, uint64_t config) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(__NR_perf_event_open, &attr, tid, -1, -1, PERF_FLAG_FD_CLOEXEC);
+}
+
+int64_t perfMonitorReadEvent(int fd) {
+    uint64_t value = 0;
+    if (fd < 0 || read(fd, &value, sizeof(value)) != sizeof(value)) {
+        return 0;
+    }
+    return (int64_t)value;
+}
+#endif //#if !(defined(_WIN32) || defined(_WIN64))
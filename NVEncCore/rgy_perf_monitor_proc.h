@@ -0,0 +1,63 @@
+﻿// -----------------------------------------------------------------------------------------
+// QSVEnc/NVEnc/VCEEnc by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2020 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+
+#pragma once
+#ifndef __RGY_PERF_MONITOR_PROC_H__
+#define __RGY_PERF_MONITOR_PROC_H__
+
+#include <cstdint>
+#include <cstddef>
+
+#ifndef HANDLE
+typedef void * HANDLE;
+#endif
+
+#if !(defined(_WIN32) || defined(_WIN64))
+//CPerfMonitorのLinux向けの情報取得 (/proc, perf_event)
+
+//現在時刻 (100ns単位, 単調増加)
+int64_t perfMonitorTime100ns();
+
+///procのファイルを読み込む
+//チェックのたびに呼ばれるので、popen等でプロセスを起動せずに直接読み込む
+int perfMonitorReadProc(const char *path, char *buffer, size_t size);
+
+//pthreadのハンドルからカーネルのスレッドIDを取得する
+int perfMonitorThreadTid(HANDLE thread);
+
+///proc/self/task/<tid>/statからスレッドの累積CPU時間 (utime + stime) を取得する
+//スレッドが終了している場合は-1を返す
+int64_t perfMonitorThreadActiveUs(int tid);
+
+//スレッド単位のハードウェアカウンタを開く (configはPERF_COUNT_HW_xxx)
+int perfMonitorOpenEvent(int tid, uint64_t config);
+
+int64_t perfMonitorReadEvent(int fd);
+#endif //#if !(defined(_WIN32) || defined(_WIN64))
+
+#endif //#ifndef __RGY_PERF_MONITOR_PROC_H__
@@ -173,6 +173,17 @@ void RGYPipeProcessWin::close() {
 bool RGYPipeProcessWin::processAlive() {
     return WAIT_OBJECT_0 == WaitForSingleObject(m_phandle, 0);
 }
+
+int RGYPipeProcessWin::waitAndGetExitCode() {
+    if (WAIT_OBJECT_0 != WaitForSingleObject(m_phandle, INFINITE)) {
+        return -1;
+    }
+    DWORD exitCode = 0;
+    if (!GetExitCodeProcess(m_phandle, &exitCode)) {
+        return -1;
+    }
+    return (int)exitCode;
+}
 #endif //defined(_WIN32) || defined(_WIN64)
 
 
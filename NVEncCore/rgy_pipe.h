@@ -80,6 +80,7 @@ public:
     virtual void close() = 0;
     virtual bool processAlive() = 0;
     virtual std::string getOutput(ProcessPipe *pipes) = 0;
+    virtual int waitAndGetExitCode() = 0;
 protected:
     virtual int startPipes(ProcessPipe *pipes) = 0;
     PROCESS_HANDLE m_phandle;
@@ -96,6 +97,7 @@ public:
     virtual void close() override;
     virtual bool processAlive() override;
     virtual std::string getOutput(ProcessPipe *pipes) override;
+    virtual int waitAndGetExitCode() override;
     const PROCESS_INFORMATION& getProcessInfo();
 protected:
     virtual int startPipes(ProcessPipe *pipes) override;
@@ -112,6 +114,7 @@ public:
     virtual void close() override;
     virtual bool processAlive() override;
     virtual std::string getOutput(ProcessPipe *pipes) override;
+    virtual int waitAndGetExitCode() override;
 protected:
     virtual int startPipes(ProcessPipe *pipes) override;
 };
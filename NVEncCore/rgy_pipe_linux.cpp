@@ -133,4 +133,12 @@ bool RGYPipeProcessLinux::processAlive() {
     int status = 0;
     return 0 == waitpid(m_phandle, &status, WNOHANG);
 }
+
+int RGYPipeProcessLinux::waitAndGetExitCode() {
+    int status = 0;
+    if (waitpid(m_phandle, &status, 0) < 0) {
+        return -1;
+    }
+    return (WIFEXITED(status)) ? WEXITSTATUS(status) : -1;
+}
 #endif //#if !(defined(_WIN32) || defined(_WIN64))
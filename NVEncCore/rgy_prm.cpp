@@ -91,7 +91,7 @@ RGYParamCommon::RGYParamCommon() :
     hdr10plusMetadataCopy(false),
     dynamicHdr10plusJson(),
     videoCodecTag(),
-    seekSec(0.0f),               //指定された秒数分先頭を飛ばす
+    seekSec(0.0),                //指定された秒数分先頭を飛ばす
     nSubtitleSelectCount(0),
     ppSubtitleSelectList(nullptr),
     subSource(),
@@ -104,6 +104,8 @@ RGYParamCommon::RGYParamCommon() :
     ppAttachmentSelectList(nullptr),
     audioResampler(RGY_RESAMPLER_SWR),
     demuxAnalyzeSec(0),
+    demuxPrefetchMB(0),
+    avsPrefetch(0),
     AVMuxTarget(RGY_MUX_NONE),                       //RGY_MUX_xxx
     videoTrack(0),
     videoStreamId(0),
@@ -118,7 +120,9 @@ RGYParamCommon::RGYParamCommon() :
     chapterFile(),
     AVInputFormat(nullptr),
     AVSyncMode(RGY_AVSYNC_ASSUME_CFR),     //avsyncの方法 (RGY_AVSYNC_xxx)
-    outputBufSizeMB(8) {
+    outputBufSizeMB(8),
+    outputSink(RGY_OUTPUT_SINK_STDIO),
+    cmaf() {
 
 }
 
@@ -138,8 +142,12 @@ RGYParamControl::RGYParamControl() :
     perfMonitorSelect(0),
     perfMonitorSelectMatplot(0),
     perfMonitorInterval(RGY_DEFAULT_PERF_MONITOR_INTERVAL),
+    traceFile(),
+    metricsHost(_T("127.0.0.1")),
+    metricsPort(0),
     parentProcessID(0),
-    lowLatency(false) {
+    lowLatency(false),
+    chunkParallel(0) {
 
 }
 RGYParamControl::~RGYParamControl() {};
@@ -203,11 +211,8 @@ unique_ptr<RGYHDR10Plus> initDynamicHDR10Plus(const tstring &dynamicHdr10plusJso
         log->write(RGY_LOG_ERROR, _T("Cannot find the file specified : %s.\n"), dynamicHdr10plusJson.c_str());
     } else {
         hdr10plus = std::unique_ptr<RGYHDR10Plus>(new RGYHDR10Plus());
-        auto ret = hdr10plus->init(dynamicHdr10plusJson);
-        if (ret == RGY_ERR_NOT_FOUND) {
-            log->write(RGY_LOG_ERROR, _T("Cannot find \"%s\" required for --dhdr10-info.\n"), RGYHDR10Plus::HDR10PLUS_GEN_EXE_NAME);
-            hdr10plus.reset();
-        } else if (ret != RGY_ERR_NONE) {
+        auto ret = hdr10plus->init(dynamicHdr10plusJson, log);
+        if (ret != RGY_ERR_NONE) {
             log->write(RGY_LOG_ERROR, _T("Failed to initialize hdr10plus reader: %s.\n"), get_err_mes((RGY_ERR)ret));
             hdr10plus.reset();
         }
@@ -112,7 +112,7 @@ struct RGYParamCommon {
     bool hdr10plusMetadataCopy;
     tstring dynamicHdr10plusJson;
     std::string videoCodecTag;
-    float seekSec;               //指定された秒数分先頭を飛ばす
+    double seekSec;              //指定された秒数分先頭を飛ばす
     int nSubtitleSelectCount;
     SubtitleSelect **ppSubtitleSelectList;
     std::vector<SubSource> subSource;
@@ -125,6 +125,8 @@ struct RGYParamCommon {
     AttachmentSelect **ppAttachmentSelectList;
     int audioResampler;
     int demuxAnalyzeSec;
+    int demuxPrefetchMB;                   //入力ファイルをバックグラウンドで先読みするサイズ (MB, 0で無効)
+    int avsPrefetch;                       //AviSynthリーダーでバックグラウンドで先読みするフレーム数 (0で無効)
     int AVMuxTarget;                       //RGY_MUX_xxx
     int videoTrack;
     int videoStreamId;
@@ -143,6 +145,8 @@ struct RGYParamCommon {
 
 
     int outputBufSizeMB;         //出力バッファサイズ
+    RGYOutputSink outputSink;    //出力ファイルへの書き込み方法
+    RGYCMAFParam cmaf;           //CMAFセグメント出力
 
     RGYParamCommon();
     ~RGYParamCommon();
@@ -162,8 +166,12 @@ struct RGYParamControl {
     int64_t perfMonitorSelect;
     int64_t perfMonitorSelectMatplot;
     int     perfMonitorInterval;
+    tstring traceFile;            //トレース(Chrome trace形式)出力先
+    tstring metricsHost;          //OpenMetricsのHTTPサーバの待ち受けアドレス
+    int metricsPort;              //OpenMetricsのHTTPサーバの待ち受けポート (0で無効)
     uint32_t parentProcessID;
     bool lowLatency;
+    int chunkParallel;            //チャンク分割による並列エンコードの並列数 (0で無効)
 
     RGYParamControl();
     ~RGYParamControl();
@@ -182,6 +190,8 @@ const CX_DESC list_simd[] = {
     { _T("sse41"),    SSE41|SSSE3|SSE3|SSE2 },
     { _T("avx"),      AVX|SSE42|SSE41|SSSE3|SSE3|SSE2 },
     { _T("avx2"),     AVX2|AVX|SSE42|SSE41|SSSE3|SSE3|SSE2 },
+    { _T("avx512bw"), AVX512BW|AVX512F|AVX2|AVX|SSE42|SSE41|SSSE3|SSE3|SSE2 },
+    { _T("avx512vbmi"), AVX512VBMI|AVX512BW|AVX512F|AVX2|AVX|SSE42|SSE41|SSSE3|SSE3|SSE2 },
     { NULL, 0 }
 };
 
@@ -34,13 +34,69 @@
 #include <atomic>
 #include <climits>
 #include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <deque>
+#include <vector>
+#include <queue>
+#include <functional>
 #include "rgy_osdep.h"
 #include "rgy_event.h"
+#include "rgy_thread.h"
 
 #ifndef clamp
 #define clamp(x, low, high) (((x) <= (high)) ? (((x) >= (low)) ? (x) : (low)) : (high))
 #endif
 
+//キューの待機側スレッドを起こすための通知
+//待機時はまずspin→yieldで条件の成立を待ち、それでもだめならcondition_variableで待機する
+//待機しているスレッドがいないときは、notify()はatomic変数の確認のみで済む
+class RGYQueueWaiter {
+public:
+    static const int SPIN_COUNT = 256;
+    static const int YIELD_COUNT = 16;
+
+    RGYQueueWaiter() : m_mtx(), m_cv(), m_waiting(0) {};
+    ~RGYQueueWaiter() {};
+
+    //predがtrueとなるまで待機する
+    //timeoutした場合はpredの結果を返す
+    template<typename Pred>
+    bool wait(Pred pred, uint32_t millisec) {
+        for (int i = 0; i < SPIN_COUNT; i++) {
+            if (pred()) return true;
+            _mm_pause();
+        }
+        for (int i = 0; i < YIELD_COUNT; i++) {
+            if (pred()) return true;
+            std::this_thread::yield();
+        }
+        std::unique_lock<std::mutex> lock(m_mtx);
+        //m_waitingの更新は必ずpredの確認より前に行う (notify側は状態の更新→m_waitingの確認の順)
+        m_waiting++;
+        bool ret = true;
+        if (millisec == INFINITE) {
+            m_cv.wait(lock, pred);
+        } else {
+            ret = m_cv.wait_for(lock, std::chrono::milliseconds(millisec), pred);
+        }
+        m_waiting--;
+        return ret;
+    }
+    //待機中のスレッドがいれば起こす
+    void notify() {
+        if (m_waiting.load() > 0) {
+            std::lock_guard<std::mutex> lock(m_mtx);
+            m_cv.notify_all();
+        }
+    }
+protected:
+    std::mutex m_mtx;
+    std::condition_variable m_cv;
+    std::atomic<int> m_waiting; //待機中のスレッドの数
+};
+
 template<typename Type, size_t align_byte = sizeof(Type)>
 class RGYQueueSPSP {
     union queueData {
@@ -51,14 +107,17 @@ public:
     //並列で1つの押し込みと1つの取り出しが可能なキューを作成する
     //スレッド並列対応のため、データにはパディングをつけてアライメントをとることが可能 (align_byte)
     //どこまで効果があるかは不明だが、align_byte=64としてfalse sharingを回避できる
+    //push側とpop側で書き換える変数はキャッシュラインを分けて配置し、false sharingを回避する
+    //待機はRGYQueueWaiterで行い、イベントのポーリングは行わない
     RGYQueueSPSP() :
         m_nPushRestartExtra(0),
-        m_heEventPoped(NULL),
-        m_heEventPushed(NULL),
         m_nMallocAlign(32),
         m_nMaxCapacity(SIZE_MAX),
         m_nKeepLength(0),
-        m_pBufStart(), m_pBufFin(nullptr), m_pBufIn(nullptr), m_pBufOut(nullptr), m_bUsingData(false) {
+        m_pBufStart(), m_pBufFin(nullptr),
+        m_padIn(), m_pBufIn(nullptr),
+        m_padOut(), m_pBufOut(nullptr), m_bUsingData(false),
+        m_padWait(), m_waitPoped(), m_waitPushed() {
         //実際のメモリのアライメントに適切な2の倍数であるか確認する
         //そうでない場合は32をデフォルトとして使用
         for (uint32_t i = 4; i < sizeof(i) * 8; i++) {
@@ -90,6 +149,7 @@ public:
     //キューが一定の長さに達しないとfront_copy/popできないように設定する
     void set_keep_length(size_t keepLength) {
         m_nKeepLength = keepLength;
+        m_waitPushed.notify();
     }
     size_t get_keep_length() {
         return m_nKeepLength;
@@ -100,8 +160,6 @@ public:
     void init(size_t bufSize = 1024, size_t maxCapacity = SIZE_MAX, int nPushRestart = 1) {
         close();
         alloc(bufSize);
-        m_heEventPoped = CreateEvent(NULL, TRUE, TRUE, NULL);
-        m_heEventPushed = CreateEvent(NULL, TRUE, TRUE, NULL);
         m_nMaxCapacity = maxCapacity;
         m_nKeepLength = 0;
         m_nPushRestartExtra = clamp(nPushRestart - 1, 0, (int)std::min<size_t>(INT_MAX, maxCapacity) - 4);
@@ -112,6 +170,7 @@ public:
         m_pBufFin = m_pBufStart.get() + bufSize;
         m_pBufIn  = m_pBufStart.get();
         m_pBufOut = m_pBufStart.get();
+        m_waitPoped.notify();
     }
     //キューのデータをクリアする際に、指定した関数で内部データを開放してから、データをクリアする
     template<typename Func>
@@ -124,10 +183,6 @@ public:
     }
     //キューのデータをクリアし、リソースを破棄する
     void close() {
-        if (m_heEventPoped) {
-            CloseEvent(m_heEventPoped);
-            m_heEventPoped = NULL;
-        }
         m_pBufStart.reset();
         m_pBufFin = nullptr;
         m_pBufIn = nullptr;
@@ -144,9 +199,9 @@ public:
     //キューのデータ量があらかじめ設定した上限に達した場合は、キューに空きができるまで待機する
     bool push(const Type& in) {
         //最初に決めた容量分までキューにデータがたまっていたら、キューに空きができるまで待機する
-        while (size() >= m_nMaxCapacity) {
-            ResetEvent(m_heEventPoped);
-            WaitForSingleObject(m_heEventPoped, 16);
+        //いったん待機に入ったら、m_nPushRestartExtraの分だけ余剰に空きができるまで待つ
+        if (size() >= m_nMaxCapacity) {
+            m_waitPoped.wait([this]() { return size() + m_nPushRestartExtra < m_nMaxCapacity; }, INFINITE);
         }
         if (m_pBufIn >= m_pBufFin) {
             //現時点でのm_pBufOut (この後別スレッドによって書き換わるかもしれない)
@@ -197,7 +252,7 @@ public:
         }
         m_pBufIn.load()->data = in;
         m_pBufIn++;
-        SetEvent(m_heEventPushed);
+        m_waitPushed.notify();
         return true;
     }
     //キューのsizeを取得する
@@ -224,6 +279,7 @@ public:
     void set_capacity(size_t capacity) {
         m_nMaxCapacity = capacity;
         m_nPushRestartExtra = (std::min)(m_nPushRestartExtra, (int)std::min<size_t>(INT_MAX, m_nMaxCapacity) - 1);
+        m_waitPoped.notify();
     }
     //indexの位置のコピーを取得する
     bool copy(Type *out, uint32_t index, size_t *pnSize = nullptr) {
@@ -235,9 +291,6 @@ public:
             *out = ptr->data;
         }
         m_bUsingData--;
-        if (!bCopy) {
-            ResetEvent(m_heEventPushed);
-        }
         if (pnSize) {
             *pnSize = nSize;
         }
@@ -253,9 +306,6 @@ public:
             *out = m_pBufOut.load()->data;
         }
         m_bUsingData--;
-        if (!bCopy) {
-            ResetEvent(m_heEventPushed);
-        }
         if (pnSize) {
             *pnSize = nSize;
         }
@@ -270,14 +320,9 @@ public:
         if (bCopy) {
             *out = m_pBufOut.load()->data;
             m_pBufOut++;
-            if (nSize <= m_nMaxCapacity - m_nPushRestartExtra) {
-                SetEvent(m_heEventPoped);
-            }
+            m_waitPoped.notify();
         }
         m_bUsingData--;
-        if (!bCopy) {
-            ResetEvent(m_heEventPushed);
-        }
         if (pnSize) {
             *pnSize = nSize;
         }
@@ -291,23 +336,14 @@ public:
         bool bCopy = nSize > m_nKeepLength;
         if (bCopy) {
             m_pBufOut++;
-            if (nSize <= m_nMaxCapacity - m_nPushRestartExtra) {
-                SetEvent(m_heEventPoped);
-            }
+            m_waitPoped.notify();
         }
         m_bUsingData--;
-        if (!bCopy) {
-            ResetEvent(m_heEventPushed);
-        }
         return bCopy;
     }
-    //要素が追加されるまで待機する
-    void wait_for_push() {
-        WaitForSingleObject(m_heEventPushed, 16);
-    }
-    //要素が追加されるまで待機するイベントを取得
-    HANDLE get_push_event() {
-        return m_heEventPushed;
+    //要素が追加されるまで待機する (取り出し可能になるか、millisecが経過するまで)
+    bool wait_for_push(uint32_t millisec = 16) {
+        return m_waitPushed.wait([this]() { return size() > m_nKeepLength; }, millisec);
     }
 protected:
     //bufSize分の内部領域を確保する
@@ -321,17 +357,191 @@ protected:
         m_pBufOut = m_pBufStart.get();
     }
 
-    int m_nPushRestartExtra; //キューに空きがこのぶんだけ余剰にないと空き通知を行わない (0 = ひとつあけば通知を行う)
-    HANDLE m_heEventPoped; //キューからデータを取り出したときセットする
-    HANDLE m_heEventPushed; //キューにデータが追加されたときセットする
+    static const size_t CACHE_LINE_SIZE = 64;
+
+    int m_nPushRestartExtra; //満杯で待機に入った場合、キューに空きがこのぶんだけ余剰にできるまで押し込みを再開しない (0 = ひとつあけば再開する)
     int m_nMallocAlign; //メモリのアライメント
-    size_t m_nMaxCapacity; //キューに詰められる有効なデータの最大数
-    size_t m_nKeepLength; //ある一定の長さを常にキュー内に保持するようにする
+    std::atomic<size_t> m_nMaxCapacity; //キューに詰められる有効なデータの最大数
+    std::atomic<size_t> m_nKeepLength; //ある一定の長さを常にキュー内に保持するようにする
     std::unique_ptr<queueData, aligned_malloc_deleter> m_pBufStart; //確保しているメモリ領域の先頭へのポインタ
     queueData *m_pBufFin; //確保しているメモリ領域の終端
-    std::atomic<queueData*> m_pBufIn; //キューにデータを格納する位置へのポインタ
-    std::atomic<queueData*> m_pBufOut; //キューから取り出すべき先頭のデータへのポインタ
+    char m_padIn[CACHE_LINE_SIZE];
+    std::atomic<queueData*> m_pBufIn; //キューにデータを格納する位置へのポインタ (push側が更新)
+    char m_padOut[CACHE_LINE_SIZE];
+    std::atomic<queueData*> m_pBufOut; //キューから取り出すべき先頭のデータへのポインタ (pop側が更新)
     std::atomic<int> m_bUsingData; //キューから読み出し中のスレッドの数
+    char m_padWait[CACHE_LINE_SIZE];
+    RGYQueueWaiter m_waitPoped; //キューからデータを取り出したとき通知する
+    RGYQueueWaiter m_waitPushed; //キューにデータが追加されたとき通知する
+};
+
+//複数のスレッドに振り分けて処理させたデータの処理結果を、投入した順に取り出すための投入順の記録
+//各スレッドは受け取った順にデータを処理し、1つのデータの処理結果の最後に区切りを返すことを前提とする
+//スレッドを経由しないデータ(worker = -1)は、それより前に投入したデータの処理結果の後にそのまま出力する
+template<typename Type>
+class RGYSubmitOrder {
+public:
+    RGYSubmitOrder() : m_order() {};
+    void push(int worker, const Type& data) {
+        m_order.push_back(std::make_pair(worker, data));
+    }
+    //先頭から順に、出力できるところまで出力する
+    //  pop(worker, &data) ... workerの処理結果を1つ取り出す (まだなければfalse)
+    //  isEnd(data)        ... 処理結果の区切りかどうか
+    //  out(data)          ... 出力する
+    template<typename PopFunc, typename EndFunc, typename OutFunc>
+    void merge(PopFunc pop, EndFunc isEnd, OutFunc out) {
+        while (m_order.size() > 0) {
+            if (m_order.front().first < 0) {
+                out(m_order.front().second);
+                m_order.pop_front();
+                continue;
+            }
+            bool fin = false;
+            Type data = Type();
+            while (!fin && pop(m_order.front().first, &data)) {
+                if (isEnd(data)) {
+                    fin = true;
+                } else {
+                    out(data);
+                }
+            }
+            if (!fin) {
+                //まだ処理中
+                break;
+            }
+            m_order.pop_front();
+        }
+    }
+    size_t size() const {
+        return m_order.size();
+    }
+    void clear() {
+        m_order.clear();
+    }
+private:
+    std::deque<std::pair<int, Type>> m_order;
+};
+
+//muxerの出力スレッドでのストリームの状態
+enum RGYMuxInterleaveState {
+    RGY_MUX_INTERLEAVE_ACTIVE,   //パケットが継続的に来るストリーム (映像・音声)、空ならdts順を保つためパケットが来るまで待つ
+    RGY_MUX_INTERLEAVE_STALLED,  //しばらくパケットが来ていない映像・音声のストリーム、次のパケットが来るまでは待たない
+    RGY_MUX_INTERLEAVE_SPARSE,   //まばらにしかパケットが来ないストリーム (字幕・データ)、空でもほかのストリームを待たせない
+    RGY_MUX_INTERLEAVE_FINISHED, //これ以上パケットが来ないストリーム
+};
+
+//複数のストリームのパケットを、dts順に並べて取り出す
+//ストリームごとにパケットを保持し、先頭のパケットのdtsをキーとするヒープから、dtsが最も小さいものを取り出す
+//空のACTIVEなストリームがある場合、そのストリームの次のパケットのdtsは最後に取り出したdts以上なので、それ以下のパケットのみ取り出せる
+//ストリームごとに保持するパケット数には上限があり、上限に達したストリーム (full()) には追加せず、呼び出し側で待たせる
+//いずれかのストリームが上限に達した場合は、空のACTIVEなストリームをSTALLEDにして待たないようにする
+template<typename Type>
+class RGYMuxInterleaver {
+public:
+    RGYMuxInterleaver() : m_streams(), m_heap() {};
+    //ストリームを追加し、そのインデックスを返す
+    int addStream(RGYMuxInterleaveState state, size_t capacity) {
+        Stream stream;
+        stream.state = state;
+        stream.capacity = (std::max)(capacity, (size_t)1);
+        stream.lastDts = INT64_MIN;
+        m_streams.push_back(std::move(stream));
+        return (int)m_streams.size() - 1;
+    }
+    int streams() const {
+        return (int)m_streams.size();
+    }
+    size_t size(int idx) const {
+        return m_streams[idx].packets.size();
+    }
+    bool full(int idx) const {
+        return m_streams[idx].packets.size() >= m_streams[idx].capacity;
+    }
+    bool empty() const {
+        return m_heap.empty();
+    }
+    RGYMuxInterleaveState state(int idx) const {
+        return m_streams[idx].state;
+    }
+    //最後に取り出したパケットのdts (まだ取り出していなければINT64_MIN)
+    int64_t lastDts(int idx) const {
+        return m_streams[idx].lastDts;
+    }
+    //dtsが不明なパケット (INT64_MIN) は、直前のパケットと同じdtsとして扱う
+    void push(int idx, int64_t dts, const Type& data) {
+        auto& stream = m_streams[idx];
+        if (dts == INT64_MIN) {
+            dts = (stream.packets.size() > 0) ? stream.packets.back().first : stream.lastDts;
+        }
+        if (stream.packets.size() > 0) {
+            dts = (std::max)(dts, stream.packets.back().first);
+        }
+        stream.packets.push_back(std::make_pair(dts, data));
+        if (stream.packets.size() == 1) {
+            m_heap.push(std::make_pair(stream.packets.front().first, idx));
+        }
+        if (stream.state == RGY_MUX_INTERLEAVE_STALLED) {
+            stream.state = RGY_MUX_INTERLEAVE_ACTIVE;
+        }
+    }
+    //これ以上パケットが来ないストリームとする
+    void finish(int idx) {
+        m_streams[idx].state = RGY_MUX_INTERLEAVE_FINISHED;
+    }
+    void finishAll() {
+        for (auto& stream : m_streams) {
+            stream.state = RGY_MUX_INTERLEAVE_FINISHED;
+        }
+    }
+    //次に出力するパケットを取り出す (空のストリームのパケットを待つ必要があればfalseを返す)
+    bool pop(int *idx, Type *data) {
+        if (m_heap.empty()) {
+            return false;
+        }
+        bool overflow = false;
+        for (const auto& stream : m_streams) {
+            overflow |= stream.packets.size() >= stream.capacity;
+        }
+        int64_t bound = INT64_MAX;
+        for (auto& stream : m_streams) {
+            if (stream.state == RGY_MUX_INTERLEAVE_ACTIVE && stream.packets.size() == 0) {
+                if (overflow) {
+                    stream.state = RGY_MUX_INTERLEAVE_STALLED;
+                } else {
+                    bound = (std::min)(bound, stream.lastDts);
+                }
+            }
+        }
+        const auto top = m_heap.top();
+        if (top.first > bound) {
+            return false;
+        }
+        m_heap.pop();
+        auto& stream = m_streams[top.second];
+        *idx = top.second;
+        *data = stream.packets.front().second;
+        stream.lastDts = (std::max)(stream.lastDts, top.first);
+        stream.packets.pop_front();
+        if (stream.packets.size() > 0) {
+            m_heap.push(std::make_pair(stream.packets.front().first, top.second));
+        }
+        return true;
+    }
+    //取り出したパケットの実際のdtsが見積もりと異なった場合に反映する
+    void setLastDts(int idx, int64_t dts) {
+        m_streams[idx].lastDts = (std::max)(m_streams[idx].lastDts, dts);
+    }
+private:
+    struct Stream {
+        RGYMuxInterleaveState state;
+        size_t capacity;
+        int64_t lastDts;
+        std::deque<std::pair<int64_t, Type>> packets; //dtsとパケット
+    };
+    std::vector<Stream> m_streams;
+    //空でないストリームの (先頭のパケットのdts, インデックス)、dtsが同じならインデックスの小さいものを先に取り出す
+    std::priority_queue<std::pair<int64_t, int>, std::vector<std::pair<int64_t, int>>, std::greater<std::pair<int64_t, int>>> m_heap;
 };
 
 #endif //__RGY_QUEUE_H__
@@ -57,5 +57,17 @@ unsigned int get_availableSIMD() {
     __cpuid(CPUInfo, 7);
     if ((simd & AVX) && (CPUInfo[1] & 0x00000020))
         simd |= AVX2;
+#if defined(_MSC_VER) || defined(__AVX__)
+    //opmask, ZMM0-15上位, ZMM16-31の保存がOSで有効になっているか確認する
+    if ((simd & AVX2) && (xgetbv & 0xE6) == 0xE6) {
+        if (CPUInfo[1] & 0x00010000) {
+            simd |= AVX512F;
+            if (CPUInfo[1] & 0x40000000)
+                simd |= AVX512BW;
+            if ((simd & AVX512BW) && (CPUInfo[2] & 0x00000002))
+                simd |= AVX512VBMI;
+        }
+    }
+#endif
     return simd;
 }
@@ -29,6 +29,8 @@
 #ifndef __RGY_SIMD_H__
 #define __RGY_SIMD_H__
 
+#include <cstdint>
+
 #ifndef _MSC_VER
 
 #include <immintrin.h>
@@ -52,18 +54,36 @@
 #endif //#ifndef _MSC_VER
 
 enum {
-    NONE   = 0x0000,
-    SSE2   = 0x0001,
-    SSE3   = 0x0002,
-    SSSE3  = 0x0004,
-    SSE41  = 0x0008,
-    SSE42  = 0x0010,
-    POPCNT = 0x0020,
-    AVX    = 0x0040,
-    AVX2   = 0x0080,
-    FMA3   = 0x0100,
+    NONE       = 0x0000,
+    SSE2       = 0x0001,
+    SSE3       = 0x0002,
+    SSSE3      = 0x0004,
+    SSE41      = 0x0008,
+    SSE42      = 0x0010,
+    POPCNT     = 0x0020,
+    AVX        = 0x0040,
+    AVX2       = 0x0080,
+    FMA3       = 0x0100,
+    AVX512F    = 0x0200,
+    AVX512BW   = 0x0400,
+    AVX512VBMI = 0x0800,
 };
 
 unsigned int get_availableSIMD();
 
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif //#ifdef _MSC_VER
+
+//maskの最下位の立っているビットの位置を返す (maskは0以外であること)
+static inline int rgy_ctz32(uint32_t mask) {
+#ifdef _MSC_VER
+    unsigned long index = 0;
+    _BitScanForward(&index, mask);
+    return (int)index;
+#else
+    return __builtin_ctz(mask);
+#endif
+}
+
 #endif //__RGY_SIMD_H__
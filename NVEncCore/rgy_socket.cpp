@@ -0,0 +1,488 @@
+﻿// -----------------------------------------------------------------------------------------
+// QSVEnc/NVEnc/VCEEnc by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2020 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+#include <mutex>
+#include <cstdarg>
+#include <cstdlib>
+#include <cctype>
+#include <algorithm>
+#include "rgy_socket.h"
+#include "rgy_version.h"
+#if defined(_WIN32) || defined(_WIN64)
+#pragma comment(lib, "ws2_32.lib")
+#else
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <cerrno>
+#endif
+
+#if defined(_WIN32) || defined(_WIN64)
+#define closesocket_rgy closesocket
+static const int RGY_SEND_FLAGS = 0;
+#else
+#define closesocket_rgy ::close
+static const int RGY_SEND_FLAGS = MSG_NOSIGNAL; //切断時にSIGPIPEで落ちないように
+#endif
+
+bool rgy_parse_url(RGYURL& url, const tstring& str) {
+    const auto s = tchar_to_string(str, CP_UTF8);
+    const std::string scheme = "http://";
+    if (s.substr(0, scheme.length()) != scheme) {
+        return false;
+    }
+    auto hostport = s.substr(scheme.length());
+    url.path.clear();
+    const auto pathpos = hostport.find('/');
+    if (pathpos != std::string::npos) {
+        url.path = hostport.substr(pathpos);
+        hostport = hostport.substr(0, pathpos);
+    }
+    while (url.path.length() > 0 && url.path.back() == '/') {
+        url.path.pop_back();
+    }
+    url.port = 80;
+    const auto portpos = hostport.find(':');
+    if (portpos != std::string::npos) {
+        try {
+            url.port = std::stoi(hostport.substr(portpos + 1));
+        } catch (...) {
+            return false;
+        }
+        hostport = hostport.substr(0, portpos);
+    }
+    url.host = hostport;
+    return url.host.length() > 0 && 0 < url.port && url.port < 65536;
+}
+
+//直前のソケット操作の失敗が、SO_SNDTIMEO/SO_RCVTIMEOのタイムアウトによるものか
+static bool rgy_socket_error_timeout() {
+#if defined(_WIN32) || defined(_WIN64)
+    return WSAGetLastError() == WSAETIMEDOUT;
+#else
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+#endif
+}
+
+RGYTCPSocket::RGYTCPSocket() : m_sock(RGY_INVALID_SOCKET), m_timedOut(false) {
+#if defined(_WIN32) || defined(_WIN64)
+    static std::once_flag wsaInit;
+    std::call_once(wsaInit, []() {
+        WSADATA wsaData;
+        WSAStartup(MAKEWORD(2, 2), &wsaData);
+    });
+#endif
+}
+
+RGYTCPSocket::~RGYTCPSocket() {
+    close();
+}
+
+RGY_ERR RGYTCPSocket::connect(const std::string& host, int port) {
+    close();
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo *result = nullptr;
+    if (getaddrinfo(host.c_str(), strsprintf("%d", port).c_str(), &hints, &result) != 0 || result == nullptr) {
+        return RGY_ERR_NOT_FOUND;
+    }
+    for (auto ai = result; ai != nullptr; ai = ai->ai_next) {
+        m_sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (m_sock == RGY_INVALID_SOCKET) {
+            continue;
+        }
+        if (::connect(m_sock, ai->ai_addr, (int)ai->ai_addrlen) == 0) {
+            break;
+        }
+        close();
+    }
+    freeaddrinfo(result);
+    if (m_sock == RGY_INVALID_SOCKET) {
+        return RGY_ERR_DEVICE_NOT_AVAILABLE;
+    }
+    //chunkは書き込むごとにすぐ送信したいので、Nagleアルゴリズムを無効にする
+    int nodelay = 1;
+    setsockopt(m_sock, IPPROTO_TCP, TCP_NODELAY, (const char *)&nodelay, sizeof(nodelay));
+    return RGY_ERR_NONE;
+}
+
+RGY_ERR RGYTCPSocket::listen(const std::string& host, int port) {
+    close();
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    struct addrinfo *result = nullptr;
+    if (getaddrinfo((host.length() > 0) ? host.c_str() : nullptr, strsprintf("%d", port).c_str(), &hints, &result) != 0 || result == nullptr) {
+        return RGY_ERR_NOT_FOUND;
+    }
+    for (auto ai = result; ai != nullptr; ai = ai->ai_next) {
+        m_sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (m_sock == RGY_INVALID_SOCKET) {
+            continue;
+        }
+        //前回の終了直後でもすぐ同じポートを使えるように
+        int reuse = 1;
+        setsockopt(m_sock, SOL_SOCKET, SO_REUSEADDR, (const char *)&reuse, sizeof(reuse));
+        if (::bind(m_sock, ai->ai_addr, (int)ai->ai_addrlen) == 0 && ::listen(m_sock, 16) == 0) {
+            break;
+        }
+        close();
+    }
+    freeaddrinfo(result);
+    if (m_sock == RGY_INVALID_SOCKET) {
+        return RGY_ERR_DEVICE_NOT_AVAILABLE;
+    }
+    return RGY_ERR_NONE;
+}
+
+RGY_ERR RGYTCPSocket::accept(RGYTCPSocket& client, int timeoutMs) {
+    fd_set fds;
+    FD_ZERO(&fds);
+    FD_SET(m_sock, &fds);
+    struct timeval tv;
+    tv.tv_sec = timeoutMs / 1000;
+    tv.tv_usec = (timeoutMs % 1000) * 1000;
+    const int ret = select((int)m_sock + 1, &fds, nullptr, nullptr, &tv);
+    if (ret == 0) {
+        return RGY_ERR_MORE_DATA;
+    }
+    if (ret < 0) {
+#if !(defined(_WIN32) || defined(_WIN64))
+        if (errno == EINTR) {
+            return RGY_ERR_MORE_DATA;
+        }
+#endif
+        return RGY_ERR_DEVICE_LOST;
+    }
+    const auto sock = ::accept(m_sock, nullptr, nullptr);
+    if (sock == RGY_INVALID_SOCKET) {
+        //selectの後で相手が切断した場合などは、次の接続を待つ
+        return RGY_ERR_MORE_DATA;
+    }
+    client.close();
+    client.m_sock = sock;
+    return RGY_ERR_NONE;
+}
+
+int RGYTCPSocket::localPort() const {
+    struct sockaddr_storage addr;
+    memset(&addr, 0, sizeof(addr));
+    socklen_t len = sizeof(addr);
+    if (getsockname(m_sock, (struct sockaddr *)&addr, &len) != 0) {
+        return 0;
+    }
+    if (addr.ss_family == AF_INET6) {
+        return ntohs(((struct sockaddr_in6 *)&addr)->sin6_port);
+    }
+    return ntohs(((struct sockaddr_in *)&addr)->sin_port);
+}
+
+void RGYTCPSocket::setTimeout(int timeoutMs) {
+#if defined(_WIN32) || defined(_WIN64)
+    DWORD tv = timeoutMs;
+#else
+    struct timeval tv;
+    tv.tv_sec = timeoutMs / 1000;
+    tv.tv_usec = (timeoutMs % 1000) * 1000;
+#endif
+    setsockopt(m_sock, SOL_SOCKET, SO_RCVTIMEO, (const char *)&tv, sizeof(tv));
+    setsockopt(m_sock, SOL_SOCKET, SO_SNDTIMEO, (const char *)&tv, sizeof(tv));
+}
+
+RGY_ERR RGYTCPSocket::send(const void *buf, size_t size) {
+    m_timedOut = false;
+    const char *ptr = (const char *)buf;
+    while (size > 0) {
+        const int sent = ::send(m_sock, ptr, (int)(std::min<size_t>)(size, 1 << 30), RGY_SEND_FLAGS);
+        if (sent <= 0) {
+#if !(defined(_WIN32) || defined(_WIN64))
+            if (sent < 0 && errno == EINTR) {
+                continue;
+            }
+#endif
+            m_timedOut = sent < 0 && rgy_socket_error_timeout();
+            return RGY_ERR_DEVICE_LOST;
+        }
+        ptr += sent;
+        size -= sent;
+    }
+    return RGY_ERR_NONE;
+}
+
+int64_t RGYTCPSocket::recv(void *buf, size_t size) {
+    for (;;) {
+        const int64_t ret = ::recv(m_sock, (char *)buf, (int)size, 0);
+#if !(defined(_WIN32) || defined(_WIN64))
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+#endif
+        m_timedOut = ret < 0 && rgy_socket_error_timeout();
+        return ret;
+    }
+}
+
+bool RGYTCPSocket::readable(int timeoutMs) {
+    fd_set fds;
+    FD_ZERO(&fds);
+    FD_SET(m_sock, &fds);
+    struct timeval tv;
+    tv.tv_sec = timeoutMs / 1000;
+    tv.tv_usec = (timeoutMs % 1000) * 1000;
+    return select((int)m_sock + 1, &fds, nullptr, nullptr, &tv) != 0;
+}
+
+void RGYTCPSocket::close() {
+    if (m_sock != RGY_INVALID_SOCKET) {
+        closesocket_rgy(m_sock);
+        m_sock = RGY_INVALID_SOCKET;
+    }
+}
+
+RGYHTTPChunkedUpload::RGYHTTPChunkedUpload(std::shared_ptr<RGYLog> log, int timeoutMs) :
+    m_log(log),
+    m_timeoutMs(timeoutMs),
+    m_sock(),
+    m_host(),
+    m_port(0),
+    m_target(),
+    m_recvBuf(),
+    m_connections(0) {
+}
+
+RGYHTTPChunkedUpload::~RGYHTTPChunkedUpload() {
+    m_sock.close();
+}
+
+void RGYHTTPChunkedUpload::AddMessage(int log_level, const TCHAR *format, ...) {
+    if (m_log == nullptr || log_level < m_log->getLogLevel()) {
+        return;
+    }
+    va_list args;
+    va_start(args, format);
+    int len = _vsctprintf(format, args) + 1; // _vscprintf doesn't count terminating '\0'
+    tstring buffer;
+    buffer.resize(len, _T('\0'));
+    _vstprintf_s(&buffer[0], len, format, args);
+    va_end(args);
+    m_log->write(log_level, (tstring(_T("http: ")) + buffer.c_str()).c_str());
+}
+
+RGY_ERR RGYHTTPChunkedUpload::connect(const RGYURL& url) {
+    m_sock.close();
+    m_recvBuf.clear();
+    auto sts = m_sock.connect(url.host, url.port);
+    if (sts != RGY_ERR_NONE) {
+        AddMessage(RGY_LOG_ERROR, _T("failed to connect to %s:%d.\n"), char_to_tstring(url.host).c_str(), url.port);
+        return sts;
+    }
+    //サーバーが応答しなくなった場合に、エンコードを止めたままにしないようにする
+    m_sock.setTimeout(m_timeoutMs);
+    m_host = url.host;
+    m_port = url.port;
+    m_connections++;
+    AddMessage(RGY_LOG_DEBUG, _T("connected to %s:%d.\n"), char_to_tstring(url.host).c_str(), url.port);
+    return RGY_ERR_NONE;
+}
+
+RGY_ERR RGYHTTPChunkedUpload::begin(const RGYURL& url, const std::string& method, const std::string& name, const char *contentType) {
+    m_target = url.path + "/" + name;
+    //前回の接続が残っていれば、そのまま使う
+    //待機中に受信できるものがあれば、サーバーが切断したか、接続を使えない状態なので接続しなおす
+    if (m_sock.isOpen() && (m_host != url.host || m_port != url.port || m_sock.readable(0))) {
+        m_sock.close();
+    }
+    RGY_ERR sts = RGY_ERR_NONE;
+    if (!m_sock.isOpen() && (sts = connect(url)) != RGY_ERR_NONE) {
+        return sts;
+    }
+    const auto header = strsprintf("%s %s HTTP/1.1\r\n"
+        "Host: %s:%d\r\n"
+        "User-Agent: " ENCODER_NAME "/" VER_STR_FILEVERSION "\r\n"
+        "Content-Type: %s\r\n"
+        "Transfer-Encoding: chunked\r\n"
+        "Connection: keep-alive\r\n"
+        "\r\n",
+        method.c_str(), m_target.c_str(), url.host.c_str(), url.port, contentType);
+    if ((sts = m_sock.send(header.data(), header.length())) != RGY_ERR_NONE) {
+        AddMessage(RGY_LOG_ERROR, _T("failed to send request for %s%s.\n"), char_to_tstring(m_target).c_str(),
+            (m_sock.timedOut()) ? strsprintf(_T(": timed out (%d ms)"), m_timeoutMs).c_str() : _T(""));
+        m_sock.close();
+        return sts;
+    }
+    AddMessage(RGY_LOG_DEBUG, _T("%s %s.\n"), char_to_tstring(method).c_str(), char_to_tstring(m_target).c_str());
+    return RGY_ERR_NONE;
+}
+
+RGY_ERR RGYHTTPChunkedUpload::write(const void *buf, size_t size) {
+    if (size == 0) {
+        return RGY_ERR_NONE; //サイズ0のchunkは終端を意味するので送らない
+    }
+    if (!m_sock.isOpen()) {
+        return RGY_ERR_DEVICE_LOST; //このリクエストは既に失敗している
+    }
+    const auto chunkHeader = strsprintf("%zx\r\n", size);
+    RGY_ERR sts = RGY_ERR_NONE;
+    if (   (sts = m_sock.send(chunkHeader.data(), chunkHeader.length())) != RGY_ERR_NONE
+        || (sts = m_sock.send(buf, size)) != RGY_ERR_NONE
+        || (sts = m_sock.send("\r\n", 2)) != RGY_ERR_NONE) {
+        AddMessage(RGY_LOG_ERROR, _T("failed to send data for %s%s.\n"), char_to_tstring(m_target).c_str(),
+            (m_sock.timedOut()) ? strsprintf(_T(": timed out (%d ms)"), m_timeoutMs).c_str() : _T(""));
+        m_sock.close();
+    }
+    return sts;
+}
+
+RGY_ERR RGYHTTPChunkedUpload::end() {
+    if (!m_sock.isOpen()) {
+        return RGY_ERR_DEVICE_LOST; //このリクエストは既に失敗している
+    }
+    auto sts = m_sock.send("0\r\n\r\n", 5);
+    if (sts != RGY_ERR_NONE) {
+        AddMessage(RGY_LOG_ERROR, _T("failed to finish request for %s%s.\n"), char_to_tstring(m_target).c_str(),
+            (m_sock.timedOut()) ? strsprintf(_T(": timed out (%d ms)"), m_timeoutMs).c_str() : _T(""));
+        m_sock.close();
+        return sts;
+    }
+    int status = 0;
+    bool keepAlive = false;
+    sts = readResponse(&status, &keepAlive);
+    if (sts != RGY_ERR_NONE || !keepAlive) {
+        m_sock.close();
+    }
+    if (sts != RGY_ERR_NONE) {
+        return sts;
+    }
+    if (status < 200 || 300 <= status) {
+        AddMessage(RGY_LOG_ERROR, _T("%s returned status %d.\n"), char_to_tstring(m_target).c_str(), status);
+        return RGY_ERR_ACCESS_DENIED;
+    }
+    return RGY_ERR_NONE;
+}
+
+RGY_ERR RGYHTTPChunkedUpload::recvAtLeast(size_t size) {
+    while (m_recvBuf.length() < size) {
+        char buf[4096];
+        const auto ret = m_sock.recv(buf, sizeof(buf));
+        if (ret <= 0) {
+            AddMessage(RGY_LOG_ERROR, _T("failed to receive response for %s: %s.\n"), char_to_tstring(m_target).c_str(),
+                (ret == 0) ? _T("connection closed") : ((m_sock.timedOut()) ? strsprintf(_T("timed out (%d ms)"), m_timeoutMs).c_str() : _T("error")));
+            return RGY_ERR_DEVICE_LOST;
+        }
+        m_recvBuf.append(buf, (size_t)ret);
+    }
+    return RGY_ERR_NONE;
+}
+
+RGY_ERR RGYHTTPChunkedUpload::recvLine(const char *delim, size_t *pos) {
+    while ((*pos = m_recvBuf.find(delim)) == std::string::npos) {
+        auto sts = recvAtLeast(m_recvBuf.length() + 1);
+        if (sts != RGY_ERR_NONE) {
+            return sts;
+        }
+    }
+    return RGY_ERR_NONE;
+}
+
+RGY_ERR RGYHTTPChunkedUpload::readResponse(int *status, bool *keepAlive) {
+    std::string header;
+    for (;;) {
+        size_t headerEnd = 0;
+        auto sts = recvLine("\r\n\r\n", &headerEnd);
+        if (sts != RGY_ERR_NONE) {
+            return sts;
+        }
+        header = m_recvBuf.substr(0, headerEnd + 2);
+        m_recvBuf.erase(0, headerEnd + 4);
+        const auto sp = header.find(' ');
+        if (header.substr(0, 5) != "HTTP/" || sp == std::string::npos || 1 != sscanf_s(header.c_str() + sp + 1, "%d", status)) {
+            AddMessage(RGY_LOG_ERROR, _T("invalid response for %s.\n"), char_to_tstring(m_target).c_str());
+            return RGY_ERR_INVALID_DATA_TYPE;
+        }
+        //100 Continueなどの途中経過の応答は読み飛ばす
+        if (*status >= 200) {
+            break;
+        }
+    }
+    //ヘッダのフィールド名と値は大文字小文字を区別しない
+    std::transform(header.begin(), header.end(), header.begin(), [](char c) { return (char)tolower(c); });
+    auto field = [&header](const char *name) {
+        const auto key = std::string("\r\n") + name + ":";
+        const auto pos = header.find(key);
+        if (pos == std::string::npos) {
+            return std::string();
+        }
+        const auto start = header.find_first_not_of(" \t", pos + key.length());
+        return (start == std::string::npos) ? std::string() : header.substr(start, header.find("\r\n", start) - start);
+    };
+    *keepAlive = header.substr(0, 8) == "http/1.1" && field("connection").find("close") == std::string::npos;
+    //次のリクエストで接続を使いまわせるよう、応答の本体を読み捨てる
+    RGY_ERR sts = RGY_ERR_NONE;
+    const auto contentLength = field("content-length");
+    if (field("transfer-encoding").find("chunked") != std::string::npos) {
+        for (;;) {
+            size_t lineEnd = 0;
+            if ((sts = recvLine("\r\n", &lineEnd)) != RGY_ERR_NONE) {
+                return sts;
+            }
+            const auto chunkSize = strtoull(m_recvBuf.c_str(), nullptr, 16);
+            m_recvBuf.erase(0, lineEnd + 2);
+            if (chunkSize == 0) {
+                //trailerは使用しないので、空行までを読み捨てる
+                while ((sts = recvLine("\r\n", &lineEnd)) == RGY_ERR_NONE && lineEnd > 0) {
+                    m_recvBuf.erase(0, lineEnd + 2);
+                }
+                if (sts == RGY_ERR_NONE) {
+                    m_recvBuf.erase(0, 2);
+                }
+                return sts;
+            }
+            if ((sts = recvAtLeast((size_t)chunkSize + 2)) != RGY_ERR_NONE) {
+                return sts;
+            }
+            m_recvBuf.erase(0, (size_t)chunkSize + 2);
+        }
+    } else if (contentLength.length() > 0) {
+        const auto size = (size_t)strtoull(contentLength.c_str(), nullptr, 10);
+        if ((sts = recvAtLeast(size)) != RGY_ERR_NONE) {
+            return sts;
+        }
+        m_recvBuf.erase(0, size);
+    } else if (*status != 204 && *status != 304) {
+        //本体の長さがわからない場合は、切断までが本体なので接続を使いまわせない
+        *keepAlive = false;
+    }
+    return RGY_ERR_NONE;
+}
@@ -0,0 +1,132 @@
+﻿// -----------------------------------------------------------------------------------------
+// QSVEnc/NVEnc/VCEEnc by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2020 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+#pragma once
+#ifndef __RGY_SOCKET_H__
+#define __RGY_SOCKET_H__
+
+#include <cstdint>
+#include <string>
+#include <memory>
+#include "rgy_osdep.h"
+#include "rgy_tchar.h"
+#include "rgy_err.h"
+#include "rgy_log.h"
+#include "rgy_util.h"
+
+#if defined(_WIN32) || defined(_WIN64)
+#include <winsock2.h>
+#include <ws2tcpip.h>
+typedef SOCKET rgy_socket_t;
+#define RGY_INVALID_SOCKET INVALID_SOCKET
+#else
+typedef int rgy_socket_t;
+#define RGY_INVALID_SOCKET (-1)
+#endif
+
+//http://host[:port][/path] を分解したもの
+struct RGYURL {
+    std::string host;
+    int port;
+    std::string path; //先頭の'/'を含む、末尾の'/'は含まない
+
+    RGYURL() : host(), port(80), path() {};
+};
+
+//http://以外は非対応、失敗時はfalseを返す
+bool rgy_parse_url(RGYURL& url, const tstring& str);
+
+//TCPでの接続
+//Windowsでは、最初のインスタンスの生成時にWSAStartupを行う
+class RGYTCPSocket {
+public:
+    RGYTCPSocket();
+    ~RGYTCPSocket();
+
+    RGY_ERR connect(const std::string& host, int port);
+    //host:portで接続を待ち受ける (port=0なら空いているポートを使用する)
+    RGY_ERR listen(const std::string& host, int port);
+    //timeoutMs以内に接続がなければRGY_ERR_MORE_DATAを返す
+    RGY_ERR accept(RGYTCPSocket& client, int timeoutMs);
+    //待ち受けているポート
+    int localPort() const;
+    //送受信のタイムアウト (ms)
+    void setTimeout(int timeoutMs);
+    //すべて送信できなければエラー
+    RGY_ERR send(const void *buf, size_t size);
+    //受信したバイト数を返す (切断時は0、エラー時は負の値)
+    int64_t recv(void *buf, size_t size);
+    //timeoutMs以内に受信できるデータ (または切断) があればtrueを返す
+    bool readable(int timeoutMs);
+    //直前のsend/recvの失敗がタイムアウトによるものか
+    bool timedOut() const { return m_timedOut; }
+    void close();
+    bool isOpen() const { return m_sock != RGY_INVALID_SOCKET; }
+protected:
+    rgy_socket_t m_sock;
+    bool m_timedOut;
+};
+
+//Transfer-Encoding: chunked でデータを送信するhttpのリクエスト
+//begin() -> write() * n -> end() の順に呼ぶ
+//write()ごとに1つのchunkとして送信するので、書き込んだデータはすぐに送信先に届く
+//サーバーが接続を維持していれば、次のbegin()では同じ接続を使用する (keep-alive)
+class RGYHTTPChunkedUpload {
+public:
+    //送受信がこの時間以上進まなければ、そのリクエストはエラーとする
+    static const int DEFAULT_TIMEOUT_MS = 10000;
+
+    RGYHTTPChunkedUpload(std::shared_ptr<RGYLog> log, int timeoutMs = DEFAULT_TIMEOUT_MS);
+    ~RGYHTTPChunkedUpload();
+
+    RGY_ERR begin(const RGYURL& url, const std::string& method, const std::string& name, const char *contentType);
+    RGY_ERR write(const void *buf, size_t size);
+    //終端のchunkを送信し、応答のステータスを確認する
+    RGY_ERR end();
+    //これまでに接続した回数
+    int connections() const { return m_connections; }
+protected:
+    RGY_ERR connect(const RGYURL& url);
+    //応答を受信し、ステータスと接続を維持できるかを返す
+    RGY_ERR readResponse(int *status, bool *keepAlive);
+    //m_recvBufにsize以上のデータがたまるまで受信する
+    RGY_ERR recvAtLeast(size_t size);
+    //m_recvBufに改行が含まれるまで受信し、その位置を返す
+    RGY_ERR recvLine(const char *delim, size_t *pos);
+    void AddMessage(int log_level, const TCHAR *format, ...);
+
+    std::shared_ptr<RGYLog> m_log;
+    int m_timeoutMs;
+    RGYTCPSocket m_sock;
+    std::string m_host;     //接続中のサーバー
+    int m_port;
+    std::string m_target;
+    std::string m_recvBuf;  //受信済みで未処理のデータ
+    int m_connections;
+};
+
+#endif //__RGY_SOCKET_H__
@@ -0,0 +1,158 @@
+﻿// -----------------------------------------------------------------------------------------
+// QSVEnc/NVEnc/VCEEnc by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2020 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+#include <algorithm>
+#include "rgy_thread_pool.h"
+#include "rgy_thread.h"
+
+struct RGYThreadPool::Job {
+    std::function<void(int, int)> func;
+    int taskN;
+    int maxThreads;
+    std::atomic<int> threads;  //処理に参加しているスレッド数
+    std::atomic<int> nextTask; //次に処理すべきタスク
+    std::atomic<int> doneTask; //終了したタスク数
+    std::mutex mtx;
+    std::condition_variable cvDone;
+
+    Job(int task_n, int max_threads, std::function<void(int, int)> f) :
+        func(f), taskN(task_n), maxThreads(max_threads), threads(1), nextTask(0), doneTask(0), mtx(), cvDone() {};
+};
+
+RGYThreadPool::RGYThreadPool() :
+    m_threads(),
+    m_jobs(),
+    m_mtx(),
+    m_cvJob(),
+    m_abort(false) {
+}
+
+RGYThreadPool::~RGYThreadPool() {
+    close();
+}
+
+RGYThreadPool *RGYThreadPool::shared() {
+    static RGYThreadPool pool;
+    return &pool;
+}
+
+void RGYThreadPool::reserve(int threads) {
+    std::lock_guard<std::mutex> lock(m_mtx);
+    while ((int)m_threads.size() < threads - 1) {
+        m_threads.push_back(std::thread(&RGYThreadPool::threadFunc, this));
+    }
+}
+
+void RGYThreadPool::close() {
+    {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        m_abort = true;
+    }
+    m_cvJob.notify_all();
+    for (auto& th : m_threads) {
+        if (th.joinable()) {
+            th.join();
+        }
+    }
+    m_threads.clear();
+    m_jobs.clear();
+    m_abort = false;
+}
+
+int RGYThreadPool::workers() const {
+    std::lock_guard<std::mutex> lock(m_mtx);
+    return (int)m_threads.size();
+}
+
+void RGYThreadPool::runTasks(Job *job) {
+    for (int task_id; (task_id = job->nextTask++) < job->taskN; ) {
+        job->func(task_id, job->taskN);
+        if (++job->doneTask == job->taskN) {
+            std::lock_guard<std::mutex> lock(job->mtx);
+            job->cvDone.notify_all();
+        }
+    }
+}
+
+void RGYThreadPool::threadFunc() {
+    for (;;) {
+        std::shared_ptr<Job> job;
+        {
+            std::unique_lock<std::mutex> lock(m_mtx);
+            m_cvJob.wait(lock, [this]() { return m_abort || !m_jobs.empty(); });
+            if (m_abort) {
+                break;
+            }
+            job = m_jobs.front();
+            //参加スレッド数が上限に達したか、タスクが残っていない処理はキューから外す
+            if (++job->threads >= job->maxThreads || job->nextTask >= job->taskN) {
+                m_jobs.pop_front();
+            }
+            if (job->threads > job->maxThreads) {
+                continue;
+            }
+        }
+        runTasks(job.get());
+    }
+}
+
+void RGYThreadPool::run(int task_n, int max_threads, std::function<void(int task_id, int task_n)> func) {
+    if (task_n <= 0) {
+        return;
+    }
+    max_threads = (std::min)(max_threads, task_n);
+    if (max_threads <= 1 || workers() == 0) {
+        for (int i = 0; i < task_n; i++) {
+            func(i, task_n);
+        }
+        return;
+    }
+    auto job = std::make_shared<Job>(task_n, max_threads, func);
+    {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        m_jobs.push_back(job);
+    }
+    for (int i = 1; i < max_threads; i++) {
+        m_cvJob.notify_one();
+    }
+    runTasks(job.get());
+    {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        auto it = std::find(m_jobs.begin(), m_jobs.end(), job);
+        if (it != m_jobs.end()) {
+            m_jobs.erase(it);
+        }
+    }
+    //他のスレッドが処理中のタスクの終了を待つ
+    for (int i = 0; job->doneTask < task_n && i < 1024; i++) {
+        _mm_pause();
+    }
+    if (job->doneTask < task_n) {
+        std::unique_lock<std::mutex> lock(job->mtx);
+        job->cvDone.wait(lock, [&job, task_n]() { return job->doneTask >= task_n; });
+    }
+}
@@ -0,0 +1,77 @@
+﻿// -----------------------------------------------------------------------------------------
+// QSVEnc/NVEnc/VCEEnc by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2020 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+#pragma once
+#ifndef __RGY_THREAD_POOL_H__
+#define __RGY_THREAD_POOL_H__
+
+#include <cstdint>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include "rgy_osdep.h"
+
+//複数の処理から共有される常駐スレッドプール
+//run()に渡した処理はtask_n個のタスクに分割され、空いているスレッドが順にタスクを取得して処理する
+//呼び出し元のスレッドも処理に参加するので、プールが他の処理で埋まっていても進行が止まることはない
+class RGYThreadPool {
+public:
+    struct Job;
+
+    RGYThreadPool();
+    ~RGYThreadPool();
+
+    //呼び出し元を含めてthreads個のスレッドで処理できるよう、必要ならワーカースレッドを追加する
+    void reserve(int threads);
+    //ワーカースレッドを終了する
+    void close();
+    //ワーカースレッドの数 (呼び出し元を含まない)
+    int workers() const;
+
+    //func(task_id, task_n)をtask_id = 0 ... task_n-1について実行し、すべて終了するまで待機する
+    //同時に処理に参加するスレッド数は、呼び出し元を含めmax_threadsまで
+    void run(int task_n, int max_threads, std::function<void(int task_id, int task_n)> func);
+
+    //プロセス全体で共有するスレッドプール
+    static RGYThreadPool *shared();
+protected:
+    void threadFunc();
+    static void runTasks(Job *job);
+
+    std::vector<std::thread> m_threads;
+    std::deque<std::shared_ptr<Job>> m_jobs; //タスクが残っている処理
+    mutable std::mutex m_mtx;
+    std::condition_variable m_cvJob;
+    bool m_abort;
+};
+
+#endif //__RGY_THREAD_POOL_H__
@@ -0,0 +1,219 @@
+﻿// -----------------------------------------------------------------------------------------
+// QSVEnc/NVEnc/VCEEnc by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2020 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+#include <algorithm>
+#include <limits>
+#include "rgy_timestamp.h"
+
+RGYTimestamp::RGYTimestamp(size_t capacity) :
+    m_ring(),
+    m_mask(0),
+    m_head(0),
+    m_tail(0),
+    m_lastAddPts(std::numeric_limits<int64_t>::min()),
+    m_mtx(),
+    m_overflow(),
+    m_overflowCount(0),
+    m_lastCheckPts(-1),
+    m_offset(0) {
+    size_t size = 1;
+    while (size < capacity) {
+        size <<= 1;
+    }
+    m_ring.resize(size);
+    m_mask = size - 1;
+}
+
+RGYTimestamp::~RGYTimestamp() {
+}
+
+void RGYTimestamp::add(int64_t pts, int64_t duration) {
+    const size_t tail = m_tail.load(std::memory_order_relaxed);
+    if (pts > m_lastAddPts && tail - m_head.load(std::memory_order_acquire) < m_ring.size()) {
+        auto& entry = m_ring[tail & m_mask];
+        entry.pts = pts;
+        entry.duration = duration;
+        entry.subPts = 0;
+        entry.subDuration = 0;
+        entry.flags = ENTRY_MAIN;
+        m_lastAddPts = pts;
+        m_tail.store(tail + 1, std::memory_order_release);
+        return;
+    }
+    //リングバッファが満杯、またはptsが単調増加でない場合
+    std::lock_guard<std::mutex> lock(m_mtx);
+    m_overflow[pts] = duration;
+    m_overflowCount.store(m_overflow.size(), std::memory_order_release);
+}
+
+int64_t *RGYTimestamp::findRing(int64_t pts, Entry **entry, uint32_t *flag) {
+    size_t lo = m_head.load(std::memory_order_relaxed);
+    size_t hi = m_tail.load(std::memory_order_acquire);
+    //pts以下で最後のエントリを探す
+    while (lo < hi) {
+        const size_t mid = lo + ((hi - lo) >> 1);
+        if (m_ring[mid & m_mask].pts <= pts) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo == m_head.load(std::memory_order_relaxed)) {
+        return nullptr;
+    }
+    auto& e = m_ring[(lo - 1) & m_mask];
+    if (e.pts == pts && (e.flags & ENTRY_MAIN)) {
+        *entry = &e;
+        *flag = ENTRY_MAIN;
+        return &e.duration;
+    }
+    if (e.subPts == pts && (e.flags & ENTRY_SUB)) {
+        *entry = &e;
+        *flag = ENTRY_SUB;
+        return &e.subDuration;
+    }
+    return nullptr;
+}
+
+void RGYTimestamp::release(int64_t popPts) {
+    size_t head = m_head.load(std::memory_order_relaxed);
+    const size_t tail = m_tail.load(std::memory_order_acquire);
+    const size_t head_org = head;
+    while (head < tail) {
+        auto& e = m_ring[head & m_mask];
+        if (e.flags != 0) {
+            //取り出されないまま残ったエントリ (エンコーダが出力しなかったフレームなど) が先頭にあると、
+            //m_headが進まず、リングバッファが一周した後はadd()がすべてm_overflowに回ってしまう
+            //満杯の場合は、取り出したptsより古いエントリをm_overflowに移して先頭を空ける
+            if (tail - head < m_ring.size() || e.pts >= popPts) {
+                break;
+            }
+            spill(e, popPts);
+        }
+        head++;
+    }
+    if (head != head_org) {
+        m_head.store(head, std::memory_order_release);
+    }
+}
+
+void RGYTimestamp::spill(Entry& entry, int64_t popPts) {
+    std::lock_guard<std::mutex> lock(m_mtx);
+    if (entry.flags & ENTRY_MAIN) {
+        m_overflow[entry.pts] = entry.duration;
+    }
+    if (entry.flags & ENTRY_SUB) {
+        m_overflow[entry.subPts] = entry.subDuration;
+    }
+    entry.flags = 0;
+    //m_overflowにも取り出されないエントリがたまり続けないよう、上限を超えたら取り出したptsより古いものから捨てる
+    const size_t overflowMax = (std::max)(m_ring.size(), (size_t)OVERFLOW_KEEP_MIN);
+    while (m_overflow.size() > overflowMax && m_overflow.begin()->first < popPts) {
+        m_overflow.erase(m_overflow.begin());
+    }
+    m_overflowCount.store(m_overflow.size(), std::memory_order_release);
+}
+
+int64_t RGYTimestamp::check(int64_t pts) {
+    if (m_lastCheckPts < 0 && pts > 0) {
+        m_offset = -pts;
+    }
+    pts += m_offset;
+    Entry *entry = nullptr;
+    uint32_t flag = 0;
+    if (findRing(pts, &entry, &flag)) {
+        m_lastCheckPts = pts;
+        return pts;
+    }
+    std::unique_lock<std::mutex> lock(m_mtx, std::defer_lock);
+    if (m_overflowCount.load(std::memory_order_acquire) > 0) {
+        lock.lock();
+        if (m_overflow.count(pts) > 0) {
+            m_lastCheckPts = pts;
+            return pts;
+        }
+    }
+    //見つからない場合は、直前にcheckしたフレームを前半と後半に分割し、後半のptsを返す
+    int64_t *lastDuration = findRing(m_lastCheckPts, &entry, &flag);
+    if (lastDuration == nullptr && lock.owns_lock()) {
+        auto pos = m_overflow.find(m_lastCheckPts);
+        if (pos != m_overflow.end()) {
+            lastDuration = &pos->second;
+            entry = nullptr;
+        }
+    }
+    if (lastDuration == nullptr) {
+        //分割するフレームがない
+        m_lastCheckPts = pts;
+        return pts;
+    }
+    const int64_t half = m_lastCheckPts + *lastDuration / 2;
+    const int64_t next = m_lastCheckPts + *lastDuration;
+    if (half != m_lastCheckPts) {
+        *lastDuration = half - m_lastCheckPts;
+        if (entry && flag == ENTRY_MAIN && (entry->flags & ENTRY_SUB) == 0) {
+            entry->subPts = half;
+            entry->subDuration = next - half;
+            entry->flags |= ENTRY_SUB;
+        } else {
+            //同じフレームを2回以上分割する場合
+            if (!lock.owns_lock()) {
+                lock.lock();
+            }
+            m_overflow[half] = next - half;
+            m_overflowCount.store(m_overflow.size(), std::memory_order_release);
+        }
+    }
+    m_lastCheckPts = half;
+    return half;
+}
+
+int64_t RGYTimestamp::get_and_pop(int64_t pts) {
+    Entry *entry = nullptr;
+    uint32_t flag = 0;
+    int64_t *duration = findRing(pts, &entry, &flag);
+    if (duration) {
+        const int64_t ret = *duration;
+        entry->flags &= ~flag;
+        if (entry->flags == 0) {
+            release(pts);
+        }
+        return ret;
+    }
+    if (m_overflowCount.load(std::memory_order_acquire) > 0) {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        auto pos = m_overflow.find(pts);
+        if (pos != m_overflow.end()) {
+            const int64_t ret = pos->second;
+            m_overflow.erase(pos);
+            m_overflowCount.store(m_overflow.size(), std::memory_order_release);
+            return ret;
+        }
+    }
+    return -1;
+}
+
@@ -0,0 +1,94 @@
+﻿// -----------------------------------------------------------------------------------------
+// QSVEnc/NVEnc/VCEEnc by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2020 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+#pragma once
+#ifndef __RGY_TIMESTAMP_H__
+#define __RGY_TIMESTAMP_H__
+
+#include <cstdint>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <atomic>
+#include "rgy_tchar.h"
+#include "rgy_util.h"
+
+//エンコーダに渡したフレームのpts→durationの対応を保持する
+//add()はエンコードスレッド (1つ) から、check()/get_and_pop()は出力スレッド (1つ) から呼ぶこと
+//
+//add()に渡されるptsは単調増加なので、ptsの順に並んだリングバッファに格納し、二分探索で検索する
+//エントリはadd()で書き込んでからm_tailを進めて公開し、公開後は出力スレッドのみが書き換える
+//出力スレッドは先頭から連続して削除済みになったエントリをm_headを進めて返却する
+//ロックを取るのは、リングバッファが満杯の場合やptsが単調増加でない場合などの例外的なケースのみ (m_overflowに格納)
+//検索はリングバッファ→m_overflowの順に行うため、in-flightのptsを重複してadd()した場合は先に格納したほうが返る
+//取り出されないまま残ったエントリは、リングバッファが一周した時点でm_overflowに移し、
+//m_overflowが上限(OVERFLOW_KEEP_MINまたは容量の大きいほう)を超えたら古いものから捨てる
+class RGYTimestamp {
+public:
+    RGYTimestamp(size_t capacity = DEFAULT_CAPACITY);
+    ~RGYTimestamp();
+    void add(int64_t pts, int64_t duration);
+    //ptsが見つからない場合は、直前にcheckしたフレームを2つに分割し (フィールド単位の出力)、後半のptsを返す
+    int64_t check(int64_t pts);
+    //見つからない場合は-1を返す
+    int64_t get_and_pop(int64_t pts);
+
+    static const size_t DEFAULT_CAPACITY = 1024;
+    static const size_t OVERFLOW_KEEP_MIN = 256;
+protected:
+    struct Entry {
+        int64_t pts;
+        int64_t duration;
+        int64_t subPts;      //check()で分割した後半のpts
+        int64_t subDuration;
+        uint32_t flags;      //ENTRY_xxx
+    };
+    enum : uint32_t {
+        ENTRY_MAIN = 0x01,
+        ENTRY_SUB  = 0x02,
+    };
+    //リングバッファを検索し、見つかったエントリのdurationへのポインタを返す (出力スレッドのみ)
+    int64_t *findRing(int64_t pts, Entry **entry, uint32_t *flag);
+    //先頭から連続して削除済みのエントリを返却する (出力スレッドのみ)
+    //満杯の場合は、popPtsより古い残ったエントリもm_overflowに移して返却する
+    void release(int64_t popPts);
+    //エントリをm_overflowに移す (出力スレッドのみ)
+    void spill(Entry& entry, int64_t popPts);
+
+    std::vector<Entry> m_ring;
+    size_t m_mask;
+    std::atomic<size_t> m_head;      //出力スレッドが書き換え、エンコードスレッドが読む
+    std::atomic<size_t> m_tail;      //エンコードスレッドが書き換え、出力スレッドが読む
+    int64_t m_lastAddPts;            //エンコードスレッドのみ
+    std::mutex m_mtx;
+    std::map<int64_t, int64_t> m_overflow;
+    std::atomic<size_t> m_overflowCount; //m_overflowの要素数 (0ならロックを取らずに済ませる)
+    int64_t m_lastCheckPts;          //出力スレッドのみ
+    int64_t m_offset;                //出力スレッドのみ
+};
+
+#endif //__RGY_TIMESTAMP_H__
@@ -0,0 +1,277 @@
+﻿// -----------------------------------------------------------------------------------------
+// QSVEnc/NVEnc/VCEEnc by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2020 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+#include <set>
+#include <cstdarg>
+#include "rgy_trace.h"
+#include "rgy_osdep.h"
+#include "rgy_version.h"
+
+std::atomic<bool> RGYTrace::s_enabled(false);
+
+//スレッドごとのリングバッファへの参照
+//世代 (open()の回数) が変わった場合は取り直す
+struct RGYTraceThreadLocal {
+    RGYTraceRing *ring;
+    uint32_t generation;
+    RGYTraceThreadLocal() : ring(nullptr), generation(0) {};
+    ~RGYTraceThreadLocal() {
+        //スレッドの終了後、書き出しが済んだリングバッファは他のスレッドで再利用する
+        if (ring && generation == RGYTrace::get()->generation()) {
+            ring->ownerExited = true;
+        }
+    }
+};
+static thread_local RGYTraceThreadLocal t_traceLocal;
+
+RGYTraceRing::RGYTraceRing(size_t capacity) :
+    tid(0),
+    name(),
+    nameWritten(false),
+    ownerExited(false),
+    m_buf(),
+    m_mask(0),
+    m_head(0),
+    m_tail(0),
+    m_dropped(0) {
+    size_t size = 1;
+    while (size < capacity) {
+        size <<= 1;
+    }
+    m_buf.resize(size);
+    m_mask = size - 1;
+}
+
+RGYTrace *RGYTrace::get() {
+    static RGYTrace trace;
+    return &trace;
+}
+
+RGYTrace::RGYTrace() :
+    m_mtx(),
+    m_cvWrite(),
+    m_rings(),
+    m_generation(0),
+    m_ref(0),
+    m_filename(),
+    m_fp(),
+    m_thWrite(),
+    m_abort(false),
+    m_ringSize(DEFAULT_RING_SIZE),
+    m_start(std::chrono::steady_clock::now()),
+    m_pid(0),
+    m_records(0),
+    m_events(0),
+    m_threads(0) {
+}
+
+RGYTrace::~RGYTrace() {
+    while (m_ref > 0) {
+        close();
+    }
+}
+
+RGY_ERR RGYTrace::open(const tstring& filename, size_t ringSize) {
+    std::lock_guard<std::mutex> lock(m_mtx);
+    if (m_ref > 0) {
+        //ひとつのプロセスで書き出せるファイルはひとつ
+        if (filename != m_filename) {
+            return RGY_ERR_INVALID_CALL;
+        }
+        m_ref++;
+        return RGY_ERR_NONE;
+    }
+    FILE *fp = nullptr;
+    if (_tfopen_s(&fp, filename.c_str(), _T("w")) || fp == nullptr) {
+        return RGY_ERR_FILE_OPEN;
+    }
+    m_fp.reset(fp);
+    m_filename = filename;
+    m_ringSize = 1;
+    while (m_ringSize < std::max<size_t>(ringSize, 16)) {
+        m_ringSize <<= 1;
+    }
+    //前回の残りは捨てて、すべてのリングバッファを未使用に戻す
+    for (auto& ring : m_rings) {
+        ring->reset();
+        ring->tid = 0;
+    }
+    m_generation++;
+    m_start = std::chrono::steady_clock::now();
+    m_pid = GetCurrentProcessId();
+    m_records = 0;
+    m_events = 0;
+    m_threads = 0;
+    m_abort = false;
+    m_ref = 1;
+    fprintf(m_fp.get(), "{\"traceEvents\":[\n");
+    m_thWrite = std::thread(&RGYTrace::writeThread, this);
+    s_enabled = true;
+    return RGY_ERR_NONE;
+}
+
+void RGYTrace::close() {
+    {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        if (m_ref <= 0 || --m_ref > 0) {
+            return;
+        }
+        s_enabled = false;
+        m_abort = true;
+    }
+    m_cvWrite.notify_all();
+    if (m_thWrite.joinable()) {
+        m_thWrite.join();
+    }
+    std::lock_guard<std::mutex> lock(m_mtx);
+    flush();
+    uint64_t dropped = 0;
+    for (const auto& ring : m_rings) {
+        dropped += ring->dropped();
+    }
+    writeRecord("{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%u,\"args\":{\"name\":\"%s\"}}", m_pid, ENCODER_NAME);
+    fprintf(m_fp.get(), "\n],\"displayTimeUnit\":\"ms\",\"otherData\":{\"events\":%llu,\"dropped\":%llu}}\n",
+        (unsigned long long)m_events, (unsigned long long)dropped);
+    m_fp.reset();
+}
+
+RGYTrace::Stats RGYTrace::stats() const {
+    auto self = const_cast<RGYTrace *>(this);
+    std::lock_guard<std::mutex> lock(self->m_mtx);
+    Stats stats = { 0 };
+    stats.events = m_events;
+    for (const auto& ring : m_rings) {
+        stats.dropped += ring->dropped();
+    }
+    stats.threads = m_threads;
+    return stats;
+}
+
+RGYTraceRing *RGYTrace::ring() {
+    auto& local = t_traceLocal;
+    const auto generation = m_generation.load(std::memory_order_acquire);
+    if (local.ring && local.generation == generation) {
+        return local.ring;
+    }
+    std::lock_guard<std::mutex> lock(m_mtx);
+    RGYTraceRing *ring = nullptr;
+    for (auto& r : m_rings) {
+        if (r->capacity() == m_ringSize
+            && (r->tid == 0 || (r->ownerExited && r->empty()))) {
+            ring = r.get();
+            break;
+        }
+    }
+    if (ring == nullptr) {
+        m_rings.push_back(std::unique_ptr<RGYTraceRing>(new RGYTraceRing(m_ringSize)));
+        ring = m_rings.back().get();
+    }
+    ring->tid = ++m_threads;
+    ring->name = strsprintf("thread %d", ring->tid);
+    ring->nameWritten = false;
+    ring->ownerExited = false;
+    local.ring = ring;
+    local.generation = generation;
+    return ring;
+}
+
+void RGYTrace::add(const char *name, int64_t frame, int64_t begin, int64_t end) {
+    if (!enabled()) {
+        return;
+    }
+    RGYTraceEvent ev;
+    ev.name = name;
+    ev.frame = frame;
+    ev.begin = begin;
+    ev.end = end;
+    ring()->push(ev);
+}
+
+void RGYTrace::setThreadName(const char *name) {
+    auto ring = this->ring();
+    std::lock_guard<std::mutex> lock(m_mtx);
+    ring->name = name;
+    ring->nameWritten = false;
+}
+
+const char *RGYTrace::intern(const tstring& name) {
+    static std::mutex mtx;
+    static std::set<std::string> names;
+    //JSONの文字列としてそのまま出力できるようにしておく
+    std::string str;
+    for (auto c : tchar_to_string(name)) {
+        if (c == '\"' || c == '\\') {
+            str += '\\';
+        }
+        str += ((unsigned char)c < 0x20) ? ' ' : c;
+    }
+    std::lock_guard<std::mutex> lock(mtx);
+    return names.insert(str).first->c_str();
+}
+
+void RGYTrace::writeThread() {
+    std::unique_lock<std::mutex> lock(m_mtx);
+    while (!m_abort) {
+        m_cvWrite.wait_for(lock, std::chrono::milliseconds(100), [this]() { return m_abort; });
+        flush();
+    }
+}
+
+void RGYTrace::writeRecord(const char *format, ...) {
+    if (m_records++) {
+        fputs(",\n", m_fp.get());
+    }
+    va_list args;
+    va_start(args, format);
+    vfprintf(m_fp.get(), format, args);
+    va_end(args);
+}
+
+void RGYTrace::flush() {
+    if (!m_fp) {
+        return;
+    }
+    for (auto& ring : m_rings) {
+        if (ring->tid == 0) {
+            continue;
+        }
+        const int tid = ring->tid;
+        if (!ring->nameWritten) {
+            writeRecord("{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%u,\"tid\":%d,\"args\":{\"name\":\"%s\"}}", m_pid, tid, ring->name.c_str());
+            ring->nameWritten = true;
+        }
+        m_events += ring->drain([&](const RGYTraceEvent& ev) {
+            writeRecord("{\"name\":\"%s\",\"cat\":\"rgy\",\"ph\":\"X\",\"pid\":%u,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f",
+                ev.name, m_pid, tid, ev.begin * 1e-3, (ev.end - ev.begin) * 1e-3);
+            if (ev.frame >= 0) {
+                fprintf(m_fp.get(), ",\"args\":{\"frame\":%lld}", (long long)ev.frame);
+            }
+            fprintf(m_fp.get(), "}");
+        });
+    }
+    fflush(m_fp.get());
+}
@@ -0,0 +1,201 @@
+﻿// -----------------------------------------------------------------------------------------
+// QSVEnc/NVEnc/VCEEnc by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2020 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+#pragma once
+#ifndef __RGY_TRACE_H__
+#define __RGY_TRACE_H__
+
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+#include <deque>
+#include <string>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include "rgy_err.h"
+#include "rgy_util.h"
+
+//フレームごとの処理区間 (demux, decode, 各フィルタ, エンコード, mux, 音声...) を記録し、
+//Chrome trace形式 (chrome://tracing, Perfetto) のJSONとして出力する
+//
+//各スレッドはそれぞれのリングバッファに区間を書き込むだけで、ロックは取らない
+//書き出しスレッドが定期的にリングバッファを回収してファイルに書き出す
+//リングバッファが満杯の場合は待機せずにその区間を捨てる (捨てた数は最後に出力する)
+//無効時は区間ごとに1回のatomic変数の読み込みのみとなる
+
+struct RGYTraceEvent {
+    const char *name; //区間名 (RGYTrace::intern()で得た文字列か文字列リテラル)
+    int64_t frame;    //フレーム番号 (-1で無し)
+    int64_t begin;    //開始時刻 (ns, open()からの経過時間)
+    int64_t end;      //終了時刻 (ns, open()からの経過時間)
+};
+
+//1スレッド分のリングバッファ (書き込みは所有スレッド、読み出しは書き出しスレッドのみ)
+class RGYTraceRing {
+public:
+    RGYTraceRing(size_t capacity);
+    //所有スレッドから呼ぶ
+    void push(const RGYTraceEvent& ev) {
+        const auto head = m_head.load(std::memory_order_relaxed);
+        if (head - m_tail.load(std::memory_order_acquire) >= m_buf.size()) {
+            m_dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        m_buf[head & m_mask] = ev;
+        m_head.store(head + 1, std::memory_order_release);
+    }
+    //書き出しスレッドから呼ぶ
+    template<typename Func>
+    size_t drain(Func func) {
+        const auto tail = m_tail.load(std::memory_order_relaxed);
+        const auto head = m_head.load(std::memory_order_acquire);
+        for (auto i = tail; i < head; i++) {
+            func(m_buf[i & m_mask]);
+        }
+        m_tail.store(head, std::memory_order_release);
+        return (size_t)(head - tail);
+    }
+    bool empty() const {
+        return m_head.load(std::memory_order_acquire) == m_tail.load(std::memory_order_acquire);
+    }
+    uint64_t dropped() const { return m_dropped.load(std::memory_order_relaxed); }
+    //記録が無効な間に呼ぶこと
+    void reset() {
+        m_tail.store(m_head.load(std::memory_order_acquire), std::memory_order_release);
+        m_dropped = 0;
+    }
+    size_t capacity() const { return m_buf.size(); }
+
+    //以下はRGYTrace::m_mtxで保護
+    int tid;              //出力上のスレッド番号 (0で未使用)
+    std::string name;     //スレッド名
+    bool nameWritten;     //スレッド名を出力済みか
+    std::atomic<bool> ownerExited; //所有スレッドが終了したか
+protected:
+    std::vector<RGYTraceEvent> m_buf;
+    uint64_t m_mask;
+    std::atomic<uint64_t> m_head;
+    std::atomic<uint64_t> m_tail;
+    std::atomic<uint64_t> m_dropped;
+};
+
+class RGYTrace {
+public:
+    struct Stats {
+        uint64_t events;  //出力した区間の数
+        uint64_t dropped; //リングバッファが満杯で捨てた区間の数
+        int threads;      //区間を記録したスレッドの数
+    };
+    //プロセス全体で1つ
+    static RGYTrace *get();
+    //区間の記録を開始し、filenameにChrome trace形式のJSONを書き出す
+    //すでに同じファイルで開始している場合は参照カウントを増やすのみ (ABRラダーの各エンコードから呼ばれる)
+    //ringSize: スレッドごとのリングバッファの長さ (区間の数, 2の累乗に切り上げ)
+    RGY_ERR open(const tstring& filename, size_t ringSize = DEFAULT_RING_SIZE);
+    //参照カウントを減らし、0になったら残りの区間を書き出してファイルを閉じる
+    void close();
+    Stats stats() const;
+
+    uint32_t generation() const {
+        return m_generation.load(std::memory_order_acquire);
+    }
+    static bool enabled() {
+        return s_enabled.load(std::memory_order_relaxed);
+    }
+    //現在時刻 (ns, open()からの経過時間)
+    int64_t now() const {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - m_start).count();
+    }
+    //区間を記録する
+    void add(const char *name, int64_t frame, int64_t begin, int64_t end);
+    //呼び出したスレッドの名前を設定する
+    void setThreadName(const char *name);
+    //区間名として使う文字列を、closeしても無効にならない文字列に変換する (フィルタ名など)
+    static const char *intern(const tstring& name);
+
+    static const size_t DEFAULT_RING_SIZE = 1 << 15;
+protected:
+    RGYTrace();
+    ~RGYTrace();
+    RGYTraceRing *ring();
+    void writeThread();
+    //m_mtxを取得した状態で呼ぶこと
+    void flush();
+    //m_mtxを取得した状態で呼ぶこと
+    void writeRecord(const char *format, ...);
+
+    static std::atomic<bool> s_enabled;
+    std::mutex m_mtx; //m_rings, m_ref, m_fpの保護
+    std::condition_variable m_cvWrite;
+    std::vector<std::unique_ptr<RGYTraceRing>> m_rings;
+    std::atomic<uint32_t> m_generation;
+    int m_ref;
+    tstring m_filename;
+    std::unique_ptr<FILE, fp_deleter> m_fp;
+    std::thread m_thWrite;
+    bool m_abort;
+    size_t m_ringSize;
+    std::chrono::steady_clock::time_point m_start;
+    uint32_t m_pid;
+    uint64_t m_records; //書き出したレコードの数 (区切りの判定用)
+    uint64_t m_events;
+    int m_threads;
+};
+
+//スコープの開始から終了までを1つの区間として記録する
+class RGYTraceScope {
+public:
+    RGYTraceScope(const char *name, int64_t frame) : m_name(nullptr), m_frame(frame), m_begin(0) {
+        if (RGYTrace::enabled()) {
+            m_name = name;
+            m_begin = RGYTrace::get()->now();
+        }
+    }
+    ~RGYTraceScope() {
+        if (m_name) {
+            auto trace = RGYTrace::get();
+            trace->add(m_name, m_frame, m_begin, trace->now());
+        }
+    }
+    //フレーム番号がスコープの途中で決まる場合に使う
+    void setFrame(int64_t frame) { m_frame = frame; }
+protected:
+    const char *m_name;
+    int64_t m_frame;
+    int64_t m_begin;
+};
+
+#define RGY_TRACE_CONCAT2(a, b) a ## b
+#define RGY_TRACE_CONCAT(a, b) RGY_TRACE_CONCAT2(a, b)
+#define RGY_TRACE_SCOPE(name, frame) RGYTraceScope RGY_TRACE_CONCAT(rgyTraceScope, __LINE__)((name), (frame))
+#define RGY_TRACE_THREAD_NAME(name) { if (RGYTrace::enabled()) RGYTrace::get()->setThreadName(name); }
+
+#endif //__RGY_TRACE_H__
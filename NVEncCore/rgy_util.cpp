@@ -36,6 +36,8 @@
 #include <sys/sysinfo.h>
 #include <sys/utsname.h>
 #include <sys/wait.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 #include <iconv.h>
 #endif
 #include "rgy_util.h"
@@ -1171,6 +1173,113 @@ int getEmbeddedResource(void **data, const TCHAR *name, const TCHAR *type, HMODU
 #endif
 }
 
+RGYFileMap::RGYFileMap() :
+    m_ptr(nullptr),
+    m_size(0),
+    m_released(0),
+#if defined(_WIN32) || defined(_WIN64)
+    m_hMap(NULL) {
+#else
+    m_fd(-1) {
+#endif //#if defined(_WIN32) || defined(_WIN64)
+}
+
+RGYFileMap::~RGYFileMap() {
+    close();
+}
+
+RGY_ERR RGYFileMap::open(FILE *fp) {
+    close();
+    if (fp == nullptr) {
+        return RGY_ERR_NULL_PTR;
+    }
+#if defined(_WIN32) || defined(_WIN64)
+    HANDLE hFile = (HANDLE)_get_osfhandle(_fileno(fp));
+    if (hFile == INVALID_HANDLE_VALUE || GetFileType(hFile) != FILE_TYPE_DISK) {
+        return RGY_ERR_UNSUPPORTED;
+    }
+    LARGE_INTEGER fileSize = { 0 };
+    if (!GetFileSizeEx(hFile, &fileSize) || fileSize.QuadPart <= 0 || (uint64_t)fileSize.QuadPart > (uint64_t)SIZE_MAX) {
+        return RGY_ERR_UNSUPPORTED;
+    }
+    m_hMap = CreateFileMapping(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (m_hMap == NULL) {
+        return RGY_ERR_UNSUPPORTED;
+    }
+    m_ptr = (uint8_t *)MapViewOfFile(m_hMap, FILE_MAP_READ, 0, 0, 0);
+    if (m_ptr == nullptr) {
+        close();
+        return RGY_ERR_UNSUPPORTED;
+    }
+    m_size = (uint64_t)fileSize.QuadPart;
+#else //#if defined(_WIN32) || defined(_WIN64)
+    const int fd = fileno(fp);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)
+        || st.st_size <= 0 || (uint64_t)st.st_size > (uint64_t)SIZE_MAX) {
+        return RGY_ERR_UNSUPPORTED;
+    }
+    void *ptr = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (ptr == MAP_FAILED) {
+        return RGY_ERR_UNSUPPORTED;
+    }
+    madvise(ptr, (size_t)st.st_size, MADV_SEQUENTIAL);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    m_fd = fd;
+    m_ptr = (uint8_t *)ptr;
+    m_size = (uint64_t)st.st_size;
+#endif //#if defined(_WIN32) || defined(_WIN64)
+    m_released = 0;
+    return RGY_ERR_NONE;
+}
+
+void RGYFileMap::close() {
+#if defined(_WIN32) || defined(_WIN64)
+    if (m_ptr) {
+        UnmapViewOfFile(m_ptr);
+    }
+    if (m_hMap) {
+        CloseHandle(m_hMap);
+        m_hMap = NULL;
+    }
+#else //#if defined(_WIN32) || defined(_WIN64)
+    if (m_ptr) {
+        munmap(m_ptr, (size_t)m_size);
+    }
+    m_fd = -1; //fdはFILE側で閉じる
+#endif //#if defined(_WIN32) || defined(_WIN64)
+    m_ptr = nullptr;
+    m_size = 0;
+    m_released = 0;
+}
+
+void RGYFileMap::prefetch(uint64_t offset, uint64_t size) {
+#if !(defined(_WIN32) || defined(_WIN64))
+    if (m_ptr == nullptr || offset >= m_size) {
+        return;
+    }
+    const uint64_t pageSize = (uint64_t)sysconf(_SC_PAGESIZE);
+    const uint64_t start = offset & ~(pageSize - 1);
+    const uint64_t fin = (std::min)(offset + size, m_size);
+    madvise(m_ptr + start, (size_t)(fin - start), MADV_WILLNEED);
+#endif //#if !(defined(_WIN32) || defined(_WIN64))
+}
+
+void RGYFileMap::release(uint64_t offset) {
+#if !(defined(_WIN32) || defined(_WIN64))
+    if (m_ptr == nullptr) {
+        return;
+    }
+    const uint64_t pageSize = (uint64_t)sysconf(_SC_PAGESIZE);
+    const uint64_t fin = (std::min)(offset, m_size) & ~(pageSize - 1);
+    if (fin > m_released) {
+        //参照済みのページをプロセスのメモリから外す (ページキャッシュには残る)
+        madvise(m_ptr + m_released, (size_t)(fin - m_released), MADV_DONTNEED);
+        m_released = fin;
+    }
+#endif //#if !(defined(_WIN32) || defined(_WIN64))
+}
+
 #include "rgy_simd.h"
 #include <immintrin.h>
 
@@ -1252,6 +1252,31 @@ public:
     }
 };
 
+//ファイル全体を読み取り専用でメモリにマップする
+//通常のファイル以外(パイプなど)や、アドレス空間が足りない場合はopenに失敗する
+class RGYFileMap {
+public:
+    RGYFileMap();
+    ~RGYFileMap();
+    RGY_ERR open(FILE *fp);
+    void close();
+    const uint8_t *ptr() const { return m_ptr; }
+    uint64_t size() const { return m_size; }
+    //[offset, offset+size)を先読みするよう要求する
+    void prefetch(uint64_t offset, uint64_t size);
+    //offsetより前の領域はもう参照しないことを通知する
+    void release(uint64_t offset);
+protected:
+    uint8_t *m_ptr;
+    uint64_t m_size;
+    uint64_t m_released;
+#if defined(_WIN32) || defined(_WIN64)
+    HANDLE m_hMap;
+#else
+    int m_fd;
+#endif //#if defined(_WIN32) || defined(_WIN64)
+};
+
 int rgy_avx_dummy_if_avail(int bAVXAvail);
 
 #endif //__RGY_UTIL_H__
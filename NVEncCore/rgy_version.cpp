@@ -51,7 +51,9 @@ const TCHAR *get_encoder_version() {
         _T("Win/avx2")
 #elif  __linux
         _T("Linux")
-  #if defined(__AVX2__)
+  #if defined(__AVX512BW__)
+        _T("/avx512")
+  #elif defined(__AVX2__)
         _T("/avx2")
   #elif defined(__AVX__)
         _T("/avx")
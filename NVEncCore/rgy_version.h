@@ -106,7 +106,9 @@ const char *get_encoder_version();
 #define DECODER_NAME              "cuvid"
 #define FOR_AUO                   0
 #define ENABLE_RAW_READER         1
+#ifndef ENABLE_NVML
 #define ENABLE_NVML               1
+#endif
 #define ENABLE_NVRTC              1
 #define ENABLE_CAPTION2ASS        0
 #endif // #if defined(WIN32) || defined(WIN64)
@@ -0,0 +1,99 @@
+﻿// -----------------------------------------------------------------------------------------
+// QSVEnc/NVEnc/VCEEnc by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2020 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+#include <cstring>
+#include <chrono>
+#include "rgy_test.h"
+
+std::vector<RGYTestEntry>& rgy_test_list() {
+    static std::vector<RGYTestEntry> list;
+    return list;
+}
+
+static void print_help() {
+    fprintf(stdout, "nvenc_test [--list] [<test name>...]\n");
+    fprintf(stdout, "  run the given tests, or every registered test when none is given.\n");
+    fprintf(stdout, "  exit code: 0 = pass, 1 = fail, 77 = all given tests were skipped.\n");
+}
+
+static int run_test(const RGYTestEntry& test) {
+    fprintf(stdout, "[ RUN      ] %s\n", test.name);
+    fflush(stdout);
+    const auto start = std::chrono::steady_clock::now();
+    const int ret = test.func();
+    const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+    const char *result = (ret == RGY_TEST_PASS) ? "      OK" : ((ret == RGY_TEST_SKIP) ? " SKIPPED" : "  FAILED");
+    fprintf(stdout, "[%s ] %s (%d ms)\n", result, test.name, (int)elapsed);
+    fflush(stdout);
+    return ret;
+}
+
+int main(int argc, char **argv) {
+    std::vector<const RGYTestEntry *> tests;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--list") == 0) {
+            for (const auto& test : rgy_test_list()) {
+                fprintf(stdout, "%s\n", test.name);
+            }
+            return 0;
+        }
+        if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
+            print_help();
+            return 0;
+        }
+        const RGYTestEntry *found = nullptr;
+        for (const auto& test : rgy_test_list()) {
+            if (strcmp(test.name, argv[i]) == 0) {
+                found = &test;
+                break;
+            }
+        }
+        if (found == nullptr) {
+            fprintf(stderr, "unknown test: %s\n", argv[i]);
+            return RGY_TEST_FAIL;
+        }
+        tests.push_back(found);
+    }
+    if (tests.size() == 0) {
+        for (const auto& test : rgy_test_list()) {
+            tests.push_back(&test);
+        }
+    }
+    int failed = 0, skipped = 0;
+    for (const auto test : tests) {
+        const int ret = run_test(*test);
+        if (ret == RGY_TEST_SKIP) {
+            skipped++;
+        } else if (ret != RGY_TEST_PASS) {
+            failed++;
+        }
+    }
+    if (failed) {
+        return RGY_TEST_FAIL;
+    }
+    return (skipped == (int)tests.size()) ? RGY_TEST_SKIP : RGY_TEST_PASS;
+}
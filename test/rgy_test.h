@@ -0,0 +1,72 @@
+﻿// -----------------------------------------------------------------------------------------
+// QSVEnc/NVEnc/VCEEnc by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2020 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+#pragma once
+#ifndef __RGY_TEST_H__
+#define __RGY_TEST_H__
+
+#include <cstdio>
+#include <vector>
+#include "rgy_tchar.h"
+
+//テストの戻り値 (RGY_TEST_SKIPはctestのSKIP_RETURN_CODEに対応)
+static const int RGY_TEST_PASS = 0;
+static const int RGY_TEST_FAIL = 1;
+static const int RGY_TEST_SKIP = 77;
+
+typedef int (*funcRGYTest)();
+
+struct RGYTestEntry {
+    const char *name;
+    funcRGYTest func;
+};
+
+std::vector<RGYTestEntry>& rgy_test_list();
+
+struct RGYTestRegister {
+    RGYTestRegister(const char *name, funcRGYTest func) {
+        rgy_test_list().push_back({ name, func });
+    }
+};
+
+//RGY_TEST(name) { ... return RGY_TEST_PASS; } の形でテストを登録する
+//登録したテストは nvenc_test <name> で実行できる
+#define RGY_TEST(name) \
+    static int rgy_test_func_##name(); \
+    static RGYTestRegister rgy_test_register_##name(#name, rgy_test_func_##name); \
+    static int rgy_test_func_##name()
+
+//条件が成立しなければ、失敗箇所を表示してRGY_TEST_FAILを返す
+#define RGY_TEST_EXPECT(cond) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            return RGY_TEST_FAIL; \
+        } \
+    } while (0)
+
+#endif //__RGY_TEST_H__
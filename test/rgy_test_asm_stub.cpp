@@ -0,0 +1,45 @@
+﻿// -----------------------------------------------------------------------------------------
+// QSVEnc/NVEnc/VCEEnc by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2020 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+//nasm/yasmのない環境でテストをリンクするための代替実装
+//cpu_info_x64.asm / ram_speed_x64.asm の関数はテストでは使用しない
+
+#include <cstdint>
+
+extern "C" {
+int64_t runl_por(uint32_t loop_count) {
+    return 0;
+}
+void read_sse(uint8_t *src, uint32_t size, uint32_t count_n) {
+}
+void read_avx(uint8_t *src, uint32_t size, uint32_t count_n) {
+}
+void write_sse(uint8_t *dst, uint32_t size, uint32_t count_n) {
+}
+void write_avx(uint8_t *dst, uint32_t size, uint32_t count_n) {
+}
+}
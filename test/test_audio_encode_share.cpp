@@ -0,0 +1,255 @@
+﻿// -----------------------------------------------------------------------------------------
+// QSVEnc/NVEnc/VCEEnc by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2020 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+#include <vector>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include "rgy_version.h"
+#include "rgy_util.h"
+#include "rgy_test.h"
+#if ENABLE_AVSW_READER
+#include "rgy_audio_encode_share.h"
+
+static const int AUDIO_SHARE_CHECK_PACKET_SIZE = 1024;
+
+//音声エンコードの代わりにパケットを生成する (データはパケット番号から決まる)
+static AVPacket *audio_share_check_encode(int index, int encodeCost) {
+    AVPacket *pkt = av_packet_alloc();
+    if (pkt == nullptr || av_new_packet(pkt, AUDIO_SHARE_CHECK_PACKET_SIZE) < 0) {
+        av_packet_free(&pkt);
+        return nullptr;
+    }
+    uint32_t state = (uint32_t)index * 2654435761u;
+    for (int i = 0; i < AUDIO_SHARE_CHECK_PACKET_SIZE; i++) {
+        //エンコードの負荷を模す
+        for (int j = 0; j < encodeCost; j++) {
+            state = state * 1664525u + 1013904223u;
+        }
+        pkt->data[i] = (uint8_t)(index + i) ^ (uint8_t)(state >> 31) ^ (uint8_t)(state >> 31);
+    }
+    pkt->pts = (int64_t)index * 1024;
+    pkt->duration = 1024;
+    return pkt;
+}
+
+static bool audio_share_check_verify(const AVPacket *pkt, int index) {
+    if (pkt->size != AUDIO_SHARE_CHECK_PACKET_SIZE || pkt->pts != (int64_t)index * 1024) {
+        return false;
+    }
+    for (int i = 0; i < AUDIO_SHARE_CHECK_PACKET_SIZE; i++) {
+        if (pkt->data[i] != (uint8_t)(index + i)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+struct AudioShareCheckResult {
+    int mismatch;
+    double pps; //1秒あたりの全出力のパケット数
+};
+
+//1つの出力がエンコードしてpublishし、残りの出力は受け取るだけとする
+// leaveAt  ... 受け取り側がこのパケット数を受け取ったらunsubscribeする (-1で無効)
+// abortAt  ... エンコードする側がこのパケット数で終了する (-1で無効)
+static AudioShareCheckResult audio_share_check_run(int outputs, int packets, int leaveAt, int abortAt, int encodeCost) {
+    AudioShareCheckResult result = { 0, 0.0 };
+    RGYAudioEncodeCache cache;
+    std::vector<std::shared_ptr<RGYAudioEncodeShare>> shares(outputs);
+    std::vector<int> ids(outputs, 0);
+    for (int i = 0; i < outputs; i++) {
+        shares[i] = cache.join("check", &ids[i]);
+    }
+    if (ids[0] >= 0 || cache.shares() != 1) {
+        result.mismatch++;
+    }
+    const int packetsToEncode = (abortAt >= 0) ? abortAt : packets;
+    std::vector<const uint8_t *> published(packetsToEncode, nullptr);
+    std::vector<int> mismatch(outputs, 0);
+    const auto start = std::chrono::high_resolution_clock::now();
+    std::vector<std::thread> threads;
+    threads.push_back(std::thread([&]() {
+        for (int i = 0; i < packetsToEncode; i++) {
+            AVPacket *pkt = audio_share_check_encode(i, encodeCost);
+            if (pkt == nullptr) {
+                mismatch[0]++;
+                break;
+            }
+            published[i] = pkt->data;
+            if (shares[0]->publish(pkt) != RGY_ERR_NONE) {
+                mismatch[0]++;
+            }
+            av_packet_free(&pkt);
+        }
+        shares[0]->finish(abortAt < 0);
+    }));
+    for (int iout = 1; iout < outputs; iout++) {
+        threads.push_back(std::thread([&, iout]() {
+            int received = 0;
+            for (bool fin = false; !fin; ) {
+                if (leaveAt >= 0 && received >= leaveAt) {
+                    shares[iout]->unsubscribe(ids[iout]);
+                    return;
+                }
+                fin = shares[iout]->finished();
+                auto pkts = shares[iout]->pop(ids[iout], fin);
+                for (auto& pkt : pkts) {
+                    //データはコピーされず、publishしたものを参照している
+                    if (!audio_share_check_verify(pkt, received) || pkt->data != published[received]) {
+                        mismatch[iout]++;
+                    }
+                    received++;
+                    av_packet_free(&pkt);
+                }
+                if (pkts.size() == 0 && !fin) {
+                    std::this_thread::yield();
+                }
+            }
+            if (received != packetsToEncode || shares[iout]->complete() != (abortAt < 0)) {
+                mismatch[iout]++;
+            }
+        }));
+    }
+    for (auto& th : threads) {
+        th.join();
+    }
+    const double elapsed = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+    for (auto m : mismatch) {
+        result.mismatch += m;
+    }
+    if (shares[0]->published() != packetsToEncode) {
+        result.mismatch++;
+    }
+    result.pps = (double)packetsToEncode * outputs / (std::max)(elapsed, 1e-9);
+    return result;
+}
+
+//共有せず、出力ごとにエンコードする場合
+static double audio_share_check_separate(int outputs, int packets, int encodeCost, int *mismatch) {
+    const auto start = std::chrono::high_resolution_clock::now();
+    std::vector<std::thread> threads;
+    std::vector<int> errors(outputs, 0);
+    for (int iout = 0; iout < outputs; iout++) {
+        threads.push_back(std::thread([&, iout]() {
+            for (int i = 0; i < packets; i++) {
+                AVPacket *pkt = audio_share_check_encode(i, encodeCost);
+                if (pkt == nullptr || !audio_share_check_verify(pkt, i)) {
+                    errors[iout]++;
+                }
+                av_packet_free(&pkt);
+            }
+        }));
+    }
+    for (auto& th : threads) {
+        th.join();
+    }
+    const double elapsed = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+    for (auto e : errors) {
+        *mismatch += e;
+    }
+    return (double)packets * outputs / (std::max)(elapsed, 1e-9);
+}
+
+
+//受け取り側がfinishを待っている間にunsubscribeされた場合は、待機を終了する
+//(途中で終了した出力が、エンコードを担当する出力の終了を待ち続けないようにする)
+static int audio_share_check_abort_wait() {
+    RGYAudioEncodeCache cache;
+    int idPublisher = 0, idSubscriber = 0;
+    auto publisher = cache.join("check", &idPublisher);
+    auto subscriber = cache.join("check", &idSubscriber);
+    std::atomic<bool> returned(false);
+    std::thread th([&]() {
+        auto pkts = subscriber->pop(idSubscriber, true);
+        for (auto& pkt : pkts) {
+            av_packet_free(&pkt);
+        }
+        returned = true;
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    int mismatch = (returned) ? 1 : 0; //finishされていないので待機しているはず
+    subscriber->unsubscribe(idSubscriber);
+    th.join();
+    publisher->finish(true);
+    return mismatch;
+}
+#endif //#if ENABLE_AVSW_READER
+
+RGY_TEST(audio_encode_share) {
+#if ENABLE_AVSW_READER
+    const int outputs = 4;
+    const int packets = 2000;
+    struct test_result {
+        const char *name;
+        int mismatch;
+    };
+    const test_result results[] = {
+        { "share",       audio_share_check_run(outputs, packets, -1, -1, 0).mismatch },
+        { "unsubscribe", audio_share_check_run(outputs, packets, 100, -1, 0).mismatch },
+        { "terminate",   audio_share_check_run(outputs, packets, -1, 500, 0).mismatch },
+        { "abort_wait",  audio_share_check_abort_wait() },
+    };
+    int mismatch = 0;
+    for (const auto& result : results) {
+        if (result.mismatch) {
+            fprintf(stderr, "%s: %d mismatch\n", result.name, result.mismatch);
+        }
+        mismatch += result.mismatch;
+    }
+    return (mismatch) ? RGY_TEST_FAIL : RGY_TEST_PASS;
+#else
+    fprintf(stderr, "libavcodec is not available.\n");
+    return RGY_TEST_SKIP;
+#endif //#if ENABLE_AVSW_READER
+}
+
+//同じ音声を出力ごとにエンコードする場合と、1回だけエンコードして共有する場合の処理速度をJSONで出力する
+RGY_TEST(bench_audio_encode_share) {
+#if ENABLE_AVSW_READER
+    const int outputs = 4;
+    const int packets = 2000;
+    const int encodeCost = 200;
+    int mismatch = 0;
+    const auto shared = audio_share_check_run(outputs, packets, -1, -1, encodeCost);
+    mismatch += shared.mismatch;
+    const double separatePps = audio_share_check_separate(outputs, packets, encodeCost, &mismatch);
+    tstring str = _T("{\n");
+    str += _T("  \"bench\": [\n");
+    str += strsprintf(_T("    { \"impl\": \"encode_per_output\", \"outputs\": %d, \"packets_per_sec\": %.1f },\n"), outputs, separatePps);
+    str += strsprintf(_T("    { \"impl\": \"shared\", \"outputs\": %d, \"packets_per_sec\": %.1f }\n"), outputs, shared.pps);
+    str += _T("  ]\n");
+    str += _T("}\n");
+    _ftprintf(stdout, _T("%s"), str.c_str());
+    return (mismatch) ? RGY_TEST_FAIL : RGY_TEST_PASS;
+#else
+    fprintf(stderr, "libavcodec is not available.\n");
+    return RGY_TEST_SKIP;
+#endif //#if ENABLE_AVSW_READER
+}
@@ -0,0 +1,323 @@
+﻿// -----------------------------------------------------------------------------------------
+// QSVEnc/NVEnc/VCEEnc by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2020 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+#include <cstring>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <algorithm>
+#include "rgy_util.h"
+#include "rgy_simd.h"
+#include "convert_csp.h"
+#include "rgy_bitstream.h"
+#include "rgy_test.h"
+
+//従来の1byteずつ走査する実装 (比較用)
+static std::vector<nal_info> parse_nal_unit_ref(const uint8_t *data, size_t size, bool hevc) {
+    std::vector<nal_info> nal_list;
+    if (size > 3) {
+        nal_info nal_start = { nullptr, 0, 0 };
+        const auto i_fin = size - 3;
+        for (size_t i = 0; i < i_fin; i++) {
+            if (data[i+0] == 0 && data[i+1] == 0 && data[i+2] == 1) {
+                if (nal_start.ptr) {
+                    nal_list.push_back(nal_start);
+                }
+                nal_start.ptr = data + i - (i > 0 && data[i-1] == 0);
+                nal_start.type = (hevc) ? (data[i+3] & 0x7f) >> 1 : data[i+3] & 0x1f;
+                nal_start.size = data + size - nal_start.ptr;
+                if (nal_list.size()) {
+                    auto prev = nal_list.end()-1;
+                    prev->size = nal_start.ptr - prev->ptr;
+                }
+                i += 3;
+            }
+        }
+        if (nal_start.ptr) {
+            nal_list.push_back(nal_start);
+        }
+    }
+    return nal_list;
+}
+
+static bool cmp_nal_list(const std::vector<nal_info>& a, const std::vector<nal_info>& b) {
+    if (a.size() != b.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < a.size(); i++) {
+        if (a[i].ptr != b[i].ptr || a[i].type != b[i].type || a[i].size != b[i].size) {
+            return false;
+        }
+    }
+    return true;
+}
+
+//開始コードの現れやすいバイト列をランダムに生成し、従来の実装と結果を比較する
+static bool check_nal_unit_parse_exact(funcFindNalStartCode func, std::mt19937& mt) {
+    static const size_t check_buf_size = 4096 + 64;
+    std::vector<uint8_t> buf(check_buf_size);
+    std::vector<nal_info> nal_list;
+    std::uniform_int_distribution<int> rand_byte(0, 255);
+    std::uniform_int_distribution<int> rand_kind(0, 9);
+    for (int loop = 0; loop < 20000; loop++) {
+        //0と1を多めに含める
+        for (auto& b : buf) {
+            const int kind = rand_kind(mt);
+            b = (uint8_t)((kind < 4) ? 0 : (kind < 6) ? 1 : rand_byte(mt));
+        }
+        //アライメントと長さを変えて確認する (終端はバッファの末尾にそろえ、範囲外の読み込みを検出しやすくする)
+        const size_t size = (loop < 10000) ? (size_t)(loop % 300) : (size_t)(mt() % 4096);
+        const size_t offset = check_buf_size - size - (mt() % 64);
+        const uint8_t *data = buf.data() + offset;
+        for (int hevc = 0; hevc < 2; hevc++) {
+            parse_nal_unit(nal_list, func, data, size, hevc != 0);
+            if (!cmp_nal_list(parse_nal_unit_ref(data, size, hevc != 0), nal_list)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+//GB/s
+static double bench_nal_unit_parse(funcFindNalStartCode func, const std::vector<uint8_t>& buf) {
+    static const auto bench_duration = std::chrono::milliseconds(100);
+    std::vector<nal_info> nal_list;
+    auto run = [&]() {
+        if (func) {
+            parse_nal_unit(nal_list, func, buf.data(), buf.size(), true);
+        } else {
+            nal_list = parse_nal_unit_ref(buf.data(), buf.size(), true);
+        }
+    };
+    run(); //warm up
+    int count = 0;
+    const auto start = std::chrono::high_resolution_clock::now();
+    auto elapsed = std::chrono::high_resolution_clock::duration::zero();
+    while (count < 4 || elapsed < bench_duration) {
+        run();
+        count++;
+        elapsed = std::chrono::high_resolution_clock::now() - start;
+    }
+    const double sec = std::chrono::duration<double>(elapsed).count();
+    return buf.size() * count / sec * 1e-9;
+}
+
+static const std::pair<uint32_t, funcFindNalStartCode> nal_func_list[] = {
+    { NONE, find_nal_start_code_c },
+    { SSE2, find_nal_start_code_sse2 },
+#if defined(_MSC_VER) || defined(__AVX2__)
+    { AVX2, find_nal_start_code_avx2 },
+#endif
+};
+
+//0を含まないランダムなデータに、16byte・32byteの境界をまたぐ位置に開始コードを置き、
+//すべての探索開始位置について、SIMD版の結果がC版と一致するか確認する
+//(SIMD版は探索開始位置から16/32byteずつ処理するので、開始位置もずらして境界との位置関係を変える)
+static bool check_nal_start_code_boundary(funcFindNalStartCode func, std::mt19937& mt) {
+    static const size_t size = 256;
+    std::vector<uint8_t> buf(size);
+    std::uniform_int_distribution<int> rand_byte(2, 255);
+    for (int loop = 0; loop < 200; loop++) {
+        for (auto& b : buf) {
+            b = (uint8_t)rand_byte(mt);
+        }
+        //境界 (16の倍数) の直前・直後に開始コードの各バイトが来るように置く
+        const size_t boundary = 16 * (1 + mt() % (size / 16 - 2));
+        const size_t codePos = boundary - 3 + mt() % 4; //00 00 01のいずれかのbyteが境界をまたぐ
+        const bool fourBytes = (mt() & 1) != 0 && codePos > 0;
+        buf[codePos + 0] = 0;
+        buf[codePos + 1] = 0;
+        buf[codePos + 2] = 1;
+        if (fourBytes) {
+            buf[codePos - 1] = 0;
+        }
+        //2つめの開始コードは32byteの境界付近に置く
+        const size_t boundary32 = 32 * (1 + mt() % (size / 32 - 1));
+        const size_t codePos2 = boundary32 - 3 + mt() % 4;
+        if (codePos2 + 3 < size && (codePos2 + 3 < codePos - 1 || codePos2 > codePos + 3)) {
+            buf[codePos2 + 0] = 0;
+            buf[codePos2 + 1] = 0;
+            buf[codePos2 + 2] = 1;
+        }
+        //探索範囲の終端も変えて、SIMDで処理する範囲の末尾をまたぐ場合も確認する
+        const size_t end = size - mt() % 40;
+        for (size_t pos = 0; pos < end; pos++) {
+            const size_t expected = find_nal_start_code_c(buf.data(), pos, end);
+            const size_t result = func(buf.data(), pos, end);
+            if (result != expected) {
+                fprintf(stderr, "nal start code mismatch: pos %zu, end %zu, code at %zu/%zu, expected %zu, got %zu\n",
+                    pos, end, codePos, codePos2, expected, result);
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+//開始コード検出の各実装を、開始コードの現れやすいランダムなデータで従来の実装と比較する
+RGY_TEST(nal_parse) {
+    const uint32_t availableSIMD = get_availableSIMD();
+    std::mt19937 mt(4321);
+    int checked = 0, mismatch = 0;
+    for (const auto& func : nal_func_list) {
+        if (func.first != (availableSIMD & func.first)) {
+            continue;
+        }
+        checked++;
+        if (!check_nal_unit_parse_exact(func.second, mt) || !check_nal_start_code_boundary(func.second, mt)) {
+            fprintf(stderr, "nal parse mismatch: %s\n", (func.first) ? get_simd_str(func.first) : "C");
+            mismatch++;
+        }
+    }
+    fprintf(stdout, "simd: %s, checked %d functions, %d mismatch\n", get_simd_str(availableSIMD), checked, mismatch);
+    return (mismatch) ? RGY_TEST_FAIL : RGY_TEST_PASS;
+}
+
+//HEVCのNALユニットを開始コード付きで追加し、先頭からの位置を返す
+static size_t add_hevc_nal(std::vector<uint8_t>& buf, uint8_t type, size_t payload_size, bool long_start_code, std::mt19937& mt) {
+    if (long_start_code) {
+        buf.push_back(0);
+    }
+    const size_t offset = buf.size() - (long_start_code ? 1 : 0);
+    buf.push_back(0);
+    buf.push_back(0);
+    buf.push_back(1);
+    buf.push_back((uint8_t)(type << 1));
+    buf.push_back(1);
+    for (size_t i = 0; i < payload_size; i++) {
+        buf.push_back((uint8_t)(2 + mt() % 254)); //開始コードが現れないようにする
+    }
+    return offset;
+}
+
+//hevc_insert_sei_segmentsで分割した各セグメントが元のデータ内の正しい位置を指し、
+//連結するとVPS/SPS/PPSの直後にSEIを挿入したデータになるか確認する
+RGY_TEST(bitstream_segments) {
+    std::mt19937 mt(1234);
+    std::vector<uint8_t> buf;
+    struct nal_pos { uint8_t type; size_t offset; };
+    std::vector<nal_pos> nals;
+    const std::pair<uint8_t, size_t> nal_types[] = {
+        { NALU_HEVC_AUD, 3 }, { NALU_HEVC_VPS, 24 }, { NALU_HEVC_SPS, 40 }, { NALU_HEVC_PPS, 7 },
+        { NALU_HEVC_PREFIX_SEI, 17 }, { 19 /*IDR_W_RADL*/, 1000 }, { 19 /*IDR_W_RADL*/, 33 }
+    };
+    for (const auto& t : nal_types) {
+        nals.push_back({ t.first, add_hevc_nal(buf, t.first, t.second, (mt() & 1) != 0, mt) });
+    }
+    const auto nal_size = [&](size_t i) { return ((i + 1 < nals.size()) ? nals[i + 1].offset : buf.size()) - nals[i].offset; };
+    const auto nal_list = parse_nal_unit_hevc(buf.data(), buf.size());
+    RGY_TEST_EXPECT(nal_list.size() == nals.size());
+
+    std::vector<uint8_t> sei = { 0, 0, 0, 1, NALU_HEVC_PREFIX_SEI << 1, 1, 4, 2, 0x55, 0xaa, 0x80 };
+
+    //既存のセグメントの後ろに追加される
+    std::vector<uint8_t> head = { 0xde, 0xad };
+    std::vector<RGYBitstreamSegment> segments;
+    segments.push_back({ head.data(), head.size() });
+    RGY_TEST_EXPECT(hevc_insert_sei_segments(segments, nal_list, sei.data(), sei.size()));
+    RGY_TEST_EXPECT(segments.size() == 1 + nals.size() + 1);
+    RGY_TEST_EXPECT(segments[0].ptr == head.data() && segments[0].size == head.size());
+
+    //各セグメントは元のデータを指す (コピーされない)
+    const size_t expected_order[] = { 1, 2, 3, SIZE_MAX, 0, 4, 5, 6 };
+    std::vector<uint8_t> expected(head);
+    for (size_t i = 0; i < _countof(expected_order); i++) {
+        const auto& seg = segments[1 + i];
+        if (expected_order[i] == SIZE_MAX) {
+            RGY_TEST_EXPECT(seg.ptr == sei.data() && seg.size == sei.size());
+            expected.insert(expected.end(), sei.begin(), sei.end());
+        } else {
+            const size_t idx = expected_order[i];
+            RGY_TEST_EXPECT(seg.ptr == buf.data() + nals[idx].offset);
+            RGY_TEST_EXPECT(seg.size == nal_size(idx));
+            expected.insert(expected.end(), buf.begin() + nals[idx].offset, buf.begin() + nals[idx].offset + nal_size(idx));
+        }
+    }
+
+    //連結結果と、領域外に書き込まないことを確認する
+    const size_t total = bitstream_segments_size(segments);
+    RGY_TEST_EXPECT(total == head.size() + buf.size() + sei.size());
+    std::vector<uint8_t> gathered(total + 16, 0xcc);
+    const uint8_t *end = bitstream_segments_gather(gathered.data(), segments);
+    RGY_TEST_EXPECT(end == gathered.data() + total);
+    RGY_TEST_EXPECT(memcmp(gathered.data(), expected.data(), total) == 0);
+    RGY_TEST_EXPECT(std::all_of(gathered.begin() + total, gathered.end(), [](uint8_t b) { return b == 0xcc; }));
+
+    //サイズ0のセグメントは何も書き込まない
+    std::vector<RGYBitstreamSegment> empty_segments = { { nullptr, 0 }, { head.data(), head.size() }, { nullptr, 0 } };
+    RGY_TEST_EXPECT(bitstream_segments_size(empty_segments) == head.size());
+    RGY_TEST_EXPECT(bitstream_segments_gather(gathered.data(), empty_segments) == gathered.data() + head.size());
+
+    //PPSがなければ失敗し、segmentsは変更されない
+    std::vector<nal_info> no_pps;
+    for (const auto& nal : nal_list) {
+        if (nal.type != NALU_HEVC_PPS) {
+            no_pps.push_back(nal);
+        }
+    }
+    std::vector<RGYBitstreamSegment> segments_fail = { { head.data(), head.size() } };
+    RGY_TEST_EXPECT(!hevc_insert_sei_segments(segments_fail, no_pps, sei.data(), sei.size()));
+    RGY_TEST_EXPECT(segments_fail.size() == 1);
+    return RGY_TEST_PASS;
+}
+
+//エンコーダ出力程度の間隔(平均16KB)でNALユニットが並ぶ8MBのデータでの処理速度をJSONで出力する
+RGY_TEST(bench_nal_parse) {
+    const uint32_t availableSIMD = get_availableSIMD();
+    std::mt19937 mt(4321);
+    std::vector<uint8_t> bench_buf(8 * 1024 * 1024);
+    std::uniform_int_distribution<int> rand_byte(0, 255);
+    for (auto& b : bench_buf) {
+        b = (uint8_t)rand_byte(mt);
+    }
+    for (size_t pos = 0; pos + 5 < bench_buf.size(); pos += 1024 + mt() % 30720) {
+        bench_buf[pos+0] = 0;
+        bench_buf[pos+1] = 0;
+        bench_buf[pos+2] = 0;
+        bench_buf[pos+3] = 1;
+    }
+
+    tstring str = _T("{\n");
+    str += strsprintf(_T("  \"simd\": \"%s\",\n"), get_simd_str(availableSIMD));
+    str += strsprintf(_T("  \"reference_GBps\": %.3f,\n"), bench_nal_unit_parse(nullptr, bench_buf));
+    str += _T("  \"results\": [\n");
+    bool first = true;
+    for (const auto& func : nal_func_list) {
+        if (func.first != (availableSIMD & func.first)) {
+            continue;
+        }
+        str += (first) ? _T("") : _T(",\n");
+        str += strsprintf(_T("    { \"simd\": \"%s\", \"GBps\": %.3f }"),
+            (func.first) ? get_simd_str(func.first) : _T("C"), bench_nal_unit_parse(func.second, bench_buf));
+        first = false;
+    }
+    str += _T("\n  ]\n");
+    str += _T("}\n");
+    _ftprintf(stdout, _T("%s"), str.c_str());
+    return RGY_TEST_PASS;
+}
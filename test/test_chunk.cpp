@@ -0,0 +1,304 @@
+﻿// -----------------------------------------------------------------------------------------
+// QSVEnc/NVEnc/VCEEnc by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2020 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+#include <cstdio>
+#include <cstdint>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include <unistd.h>
+#include "rgy_util.h"
+#include "rgy_chunk.h"
+#include "rgy_test.h"
+
+static const double CHUNK_TEST_TIMEBASE = 1.0 / 90000.0;
+static const int64_t CHUNK_TEST_PTS_OFFSET = 1000;
+static const int64_t CHUNK_TEST_DURATION = 3003;
+static const int CHUNK_TEST_GOP = 30;
+
+//open GOPのIBBP構成のパケットをデコード順に生成する
+//表示順のフレーム番号dに対し、デコード順はd=2,0,1,5,3,4,... キーフレームはd%30==2
+//d=0,1は最初のキーフレームより前に表示されるので、フレームとしては数えない (framesは3の倍数とする)
+static std::vector<RGYChunkPacket> chunk_test_packets(int frames) {
+    std::vector<RGYChunkPacket> packets;
+    auto add = [&](int d) {
+        const int64_t pts = CHUNK_TEST_PTS_OFFSET + d * CHUNK_TEST_DURATION;
+        packets.push_back(RGYChunkPacket{ pts, CHUNK_TEST_PTS_OFFSET + ((int64_t)packets.size() - 1) * CHUNK_TEST_DURATION, d % CHUNK_TEST_GOP == 2 });
+    };
+    for (int a = 2; a < frames; a += 3) {
+        add(a);
+        add(a - 2);
+        add(a - 1);
+    }
+    return packets;
+}
+
+//子プロセスのエンコーダの代わりに、--seek/--trimに従ってリーダーの動作を再現し、
+//各フレームの表示順の番号をスライスに書き込んだエレメンタリストリームを出力する
+class RGYChunkBackendStub : public RGYChunkBackend {
+public:
+    RGYChunkBackendStub(const std::vector<RGYChunkPacket>& packets, bool hevc) :
+        m_hevc(hevc), m_seekBackward(false), m_dropFrameChunk(-1), m_failChunk(-1), m_running(0), m_runningMax(0), m_startOrder(), m_waitOrder(), m_firstPts(packets.front().pts), m_displayPts(), m_keyPts() {
+        for (const auto& packet : packets) {
+            m_displayPts.push_back(packet.pts);
+            if (packet.key) {
+                m_keyPts.push_back(packet.pts);
+            }
+        }
+        std::sort(m_displayPts.begin(), m_displayPts.end());
+        std::sort(m_keyPts.begin(), m_keyPts.end());
+    }
+    virtual RGY_ERR start(int ichunk, const std::vector<tstring>& args) override {
+        tstring output;
+        double seekSec = 0.0;
+        int trimStart = 0, trimFrames = 0;
+        for (size_t i = 0; i + 1 < args.size(); i++) {
+            if (args[i] == _T("-o")) {
+                output = args[i + 1];
+            } else if (args[i] == _T("--seek")) {
+                _stscanf_s(args[i + 1].c_str(), _T("%lf"), &seekSec);
+            } else if (args[i] == _T("--trim")) {
+                if (2 != _stscanf_s(args[i + 1].c_str(), _T("%d:-%d"), &trimStart, &trimFrames)) {
+                    return RGY_ERR_INVALID_PARAM;
+                }
+            }
+        }
+        m_running++;
+        m_runningMax = (std::max)(m_running, m_runningMax);
+        m_startOrder.push_back(ichunk);
+        //リーダーのシーク: 最初のパケットのptsからの時刻のキーフレームにシークし、そのキーフレームより前に表示されるフレームは捨てる
+        int64_t startPts = m_keyPts.front();
+        if (seekSec > 0.0) {
+            const int64_t target = m_firstPts + (int64_t)std::round(seekSec / CHUNK_TEST_TIMEBASE);
+            if (m_seekBackward) {
+                auto it = std::upper_bound(m_keyPts.begin(), m_keyPts.end(), target);
+                startPts = (it == m_keyPts.begin()) ? m_keyPts.front() : *(it - 1);
+            } else {
+                auto it = std::lower_bound(m_keyPts.begin(), m_keyPts.end(), target);
+                startPts = (it == m_keyPts.end()) ? m_keyPts.back() : *it;
+            }
+        }
+        const int firstFrame = (int)(std::lower_bound(m_displayPts.begin(), m_displayPts.end(), startPts) - m_displayPts.begin());
+        FILE *fp = _tfopen(output.c_str(), _T("wb"));
+        if (fp == nullptr) {
+            return RGY_ERR_FILE_OPEN;
+        }
+        writeParameterSets(fp);
+        for (int i = 0; i < trimFrames; i++) {
+            const int d = firstFrame + trimStart + i;
+            if (d >= (int)m_displayPts.size() || (ichunk == m_dropFrameChunk && i == trimFrames / 2)) {
+                continue;
+            }
+            writeFrame(fp, d, i == 0);
+        }
+        fclose(fp);
+        return RGY_ERR_NONE;
+    }
+    virtual int wait(int ichunk) override {
+        m_running--;
+        m_waitOrder.push_back(ichunk);
+        return (ichunk == m_failChunk) ? 1 : 0;
+    }
+
+    bool m_hevc;
+    bool m_seekBackward;
+    int m_dropFrameChunk; //このチャンクのフレームを1つ落とす
+    int m_failChunk;      //このチャンクの終了コードを1にする
+    int m_running;
+    int m_runningMax;
+    std::vector<int> m_startOrder;
+    std::vector<int> m_waitOrder;
+protected:
+    void writeNal(FILE *fp, const std::vector<uint8_t>& nal) {
+        static const uint8_t startCode[] = { 0x00, 0x00, 0x00, 0x01 };
+        fwrite(startCode, 1, sizeof(startCode), fp);
+        fwrite(nal.data(), 1, nal.size(), fp);
+    }
+    void writeParameterSets(FILE *fp) {
+        if (m_hevc) {
+            writeNal(fp, { 32 << 1, 0x01, 0x0c, 0x01 }); //VPS
+            writeNal(fp, { 33 << 1, 0x01, 0x81, 0x01 }); //SPS
+            writeNal(fp, { 34 << 1, 0x01, 0xc1, 0x72 }); //PPS
+        } else {
+            writeNal(fp, { 0x67, 0x64, 0x00, 0x28 }); //SPS
+            writeNal(fp, { 0x68, 0xee, 0x3c, 0x80 }); //PPS
+        }
+    }
+    //フレーム番号は0x00を含まないようにしてスライスに書き込む
+    //2つめのスライスはピクチャの先頭ではないので、フレームとして数えられてはいけない
+    void writeFrame(FILE *fp, int d, bool idr) {
+        const uint8_t id[] = { (uint8_t)(0x80 | (d & 0x7f)), (uint8_t)(0x80 | ((d >> 7) & 0x7f)), (uint8_t)(0x80 | ((d >> 14) & 0x7f)) };
+        if (m_hevc) {
+            const uint8_t type = (idr) ? 19 : 1;
+            writeNal(fp, { (uint8_t)(type << 1), 0x01, 0x80, id[0], id[1], id[2] });
+            writeNal(fp, { (uint8_t)(type << 1), 0x01, 0x40, 0x55 });
+        } else {
+            const uint8_t type = (idr) ? 0x65 : 0x41;
+            writeNal(fp, { type, 0x88, id[0], id[1], id[2] });
+            writeNal(fp, { type, 0x40, 0x55 });
+        }
+    }
+    int64_t m_firstPts; //デコード順で最初のパケットのpts
+    std::vector<int64_t> m_displayPts;
+    std::vector<int64_t> m_keyPts;
+};
+
+//スタブの出力から、ピクチャの先頭のスライスに書かれたフレーム番号を順に取り出す
+static std::vector<int> chunk_test_read_frames(const tstring& filename, bool hevc) {
+    std::vector<int> frames;
+    std::vector<uint8_t> data;
+    FILE *fp = _tfopen(filename.c_str(), _T("rb"));
+    if (fp == nullptr) {
+        return frames;
+    }
+    uint8_t buf[4096];
+    size_t size = 0;
+    while ((size = fread(buf, 1, sizeof(buf), fp)) > 0) {
+        data.insert(data.end(), buf, buf + size);
+    }
+    fclose(fp);
+    const size_t headerSize = (hevc) ? 2 : 1;
+    for (size_t i = 0; i + 4 + headerSize + 4 <= data.size(); i++) {
+        if (data[i] != 0 || data[i + 1] != 0 || data[i + 2] != 0 || data[i + 3] != 1) continue;
+        const uint8_t *nal = data.data() + i + 4;
+        const bool vcl = (hevc) ? ((nal[0] >> 1) < 32) : ((nal[0] & 0x1f) == 1 || (nal[0] & 0x1f) == 5);
+        if (vcl && (nal[headerSize] & 0x80)) {
+            const uint8_t *id = nal + headerSize + 1;
+            frames.push_back((id[0] & 0x7f) | ((id[1] & 0x7f) << 7) | ((id[2] & 0x7f) << 14));
+        }
+    }
+    return frames;
+}
+
+static bool chunk_test_file_exists(const tstring& filename) {
+    FILE *fp = _tfopen(filename.c_str(), _T("rb"));
+    if (fp) {
+        fclose(fp);
+        return true;
+    }
+    return false;
+}
+
+//区間がキーフレームで連続して区切られ、シーク位置がキーフレームのptsちょうどであること
+RGY_TEST(chunk_plan) {
+    const int totalFrames = 600;
+    const auto packets = chunk_test_packets(totalFrames);
+    auto log = std::make_shared<RGYLog>(nullptr, RGY_LOG_QUIET);
+    for (int chunkCount : { 1, 2, 4, 7 }) {
+        std::vector<RGYChunk> chunks;
+        int frameCount = 0;
+        RGY_TEST_EXPECT(rgy_chunk_plan(chunks, &frameCount, packets, CHUNK_TEST_TIMEBASE, chunkCount, log) == RGY_ERR_NONE);
+        RGY_TEST_EXPECT(frameCount == totalFrames - 2);
+        RGY_TEST_EXPECT((int)chunks.size() == chunkCount);
+        int next = 0;
+        for (const auto& chunk : chunks) {
+            RGY_TEST_EXPECT(chunk.trim.start == next);
+            RGY_TEST_EXPECT(chunk.trim.fin >= chunk.trim.start);
+            RGY_TEST_EXPECT(chunk.trim.start % CHUNK_TEST_GOP == 0);
+            //フレーム番号iは表示順のd=i+2、そのptsちょうどに最初のパケット(d=2)のptsを基準としてシークする
+            const int64_t keyPts = CHUNK_TEST_PTS_OFFSET + (chunk.trim.start + 2) * CHUNK_TEST_DURATION;
+            const double expectedSeek = (keyPts - packets.front().pts) * CHUNK_TEST_TIMEBASE;
+            RGY_TEST_EXPECT(chunk.seekSec == expectedSeek);
+            next = chunk.trim.fin + 1;
+        }
+        RGY_TEST_EXPECT(next == frameCount);
+    }
+    //キーフレームが足りない場合は、区間の数を減らす
+    std::vector<RGYChunk> chunks;
+    int frameCount = 0;
+    RGY_TEST_EXPECT(rgy_chunk_plan(chunks, &frameCount, chunk_test_packets(63), CHUNK_TEST_TIMEBASE, 8, log) == RGY_ERR_NONE);
+    RGY_TEST_EXPECT(chunks.size() == 3);
+    RGY_TEST_EXPECT(chunks.back().trim.fin == frameCount - 1);
+    RGY_TEST_EXPECT(rgy_chunk_plan(chunks, &frameCount, std::vector<RGYChunkPacket>(), CHUNK_TEST_TIMEBASE, 2, log) != RGY_ERR_NONE);
+    return RGY_TEST_PASS;
+}
+
+//スタブのバックエンドで分割・並列実行・連結を行い、全フレームが順に1回ずつ出力されること
+//フレームの欠落や子プロセスの失敗はエラーとなり、出力が残らないこと
+RGY_TEST(chunk_encode) {
+    const int totalFrames = 600;
+    const auto packets = chunk_test_packets(totalFrames);
+    auto log = std::make_shared<RGYLog>(nullptr, RGY_LOG_QUIET);
+    std::vector<RGYChunk> chunks;
+    int frameCount = 0;
+    RGY_TEST_EXPECT(rgy_chunk_plan(chunks, &frameCount, packets, CHUNK_TEST_TIMEBASE, 5, log) == RGY_ERR_NONE);
+    RGY_TEST_EXPECT(chunks.size() == 5);
+
+    const tstring output = strsprintf(_T("/tmp/rgy_chunk_%d.264"), (int)getpid());
+    const TCHAR *argv[] = { _T("NVEncC"), _T("-i"), _T("input.mp4"), _T("--chunk-parallel"), _T("5"), _T("-o"), output.c_str(), _T("--log"), _T("x.log") };
+    const int argc = (int)_countof(argv);
+    for (const bool hevc : { false, true }) {
+        for (const bool seekBackward : { false, true }) {
+            RGYChunkEncodePrm prm;
+            prm.output = output;
+            prm.codec = (hevc) ? RGY_CODEC_HEVC : RGY_CODEC_H264;
+            prm.workersMax = 2;
+            RGYChunkBackendStub backend(packets, hevc);
+            backend.m_seekBackward = seekBackward;
+            RGY_TEST_EXPECT(rgy_chunk_encode(chunks, argc, argv, prm, &backend, log) == RGY_ERR_NONE);
+            RGY_TEST_EXPECT(backend.m_runningMax == 2);
+            RGY_TEST_EXPECT(backend.m_running == 0);
+            RGY_TEST_EXPECT(backend.m_startOrder == std::vector<int>({ 0, 1, 2, 3, 4 }));
+            RGY_TEST_EXPECT(backend.m_waitOrder == std::vector<int>({ 0, 1, 2, 3, 4 }));
+            const auto frames = chunk_test_read_frames(output, hevc);
+            RGY_TEST_EXPECT((int)frames.size() == frameCount);
+            for (int i = 0; i < (int)frames.size(); i++) {
+                RGY_TEST_EXPECT(frames[i] == i + 2);
+            }
+            for (int ichunk = 0; ichunk < (int)chunks.size(); ichunk++) {
+                RGY_TEST_EXPECT(!chunk_test_file_exists(PathRemoveExtensionS(output) + strsprintf(_T(".chunk%02d.264"), ichunk)));
+            }
+            _tremove(output.c_str());
+        }
+    }
+    {
+        //1つの区間でフレームが欠けた場合
+        RGYChunkEncodePrm prm;
+        prm.output = output;
+        prm.workersMax = 3;
+        RGYChunkBackendStub backend(packets, false);
+        backend.m_dropFrameChunk = 2;
+        RGY_TEST_EXPECT(rgy_chunk_encode(chunks, argc, argv, prm, &backend, log) != RGY_ERR_NONE);
+        RGY_TEST_EXPECT(backend.m_runningMax == 3);
+        RGY_TEST_EXPECT(!chunk_test_file_exists(output));
+    }
+    {
+        //子プロセスが失敗した場合は、実行中のものを待ってから終了する
+        RGYChunkEncodePrm prm;
+        prm.output = output;
+        prm.workersMax = 2;
+        RGYChunkBackendStub backend(packets, false);
+        backend.m_failChunk = 1;
+        RGY_TEST_EXPECT(rgy_chunk_encode(chunks, argc, argv, prm, &backend, log) != RGY_ERR_NONE);
+        RGY_TEST_EXPECT(backend.m_running == 0);
+        RGY_TEST_EXPECT(!chunk_test_file_exists(output));
+        for (int ichunk = 0; ichunk < (int)chunks.size(); ichunk++) {
+            _tremove((PathRemoveExtensionS(output) + strsprintf(_T(".chunk%02d.log"), ichunk)).c_str());
+        }
+    }
+    return RGY_TEST_PASS;
+}
@@ -0,0 +1,678 @@
+﻿// -----------------------------------------------------------------------------------------
+// QSVEnc/NVEnc/VCEEnc by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2020 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+#include <cstring>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <thread>
+#include <algorithm>
+#include "rgy_util.h"
+#include "rgy_simd.h"
+#include "convert_csp.h"
+#include "rgy_test.h"
+
+static const int CSP_CHECK_BUF_MARGIN = 512;
+static const uint8_t CSP_CHECK_DST_FILL = 0xA5;
+
+//1画素あたりのバイト数 (各プレーン共通)
+static int csp_pixel_byte(RGY_CSP csp) {
+    switch (csp) {
+    case RGY_CSP_YUY2:   return 2;
+    case RGY_CSP_YC48:   return 6;
+    case RGY_CSP_RGB24:
+    case RGY_CSP_RGB24R:
+    case RGY_CSP_BGR24:  return 3;
+    case RGY_CSP_RGB32:
+    case RGY_CSP_RGB32R:
+    case RGY_CSP_BGR32:  return 4;
+    default:             return (RGY_CSP_BIT_DEPTH[csp] > 8) ? 2 : 1;
+    }
+}
+
+struct CspCheckFrame {
+    FrameInfo info;
+    std::vector<uint8_t> buf;
+
+    CspCheckFrame(RGY_CSP csp, int width, int height) : info(), buf() {
+        info.csp = csp;
+        info.width = width;
+        info.height = height;
+        info.pitch = ALIGN(width * csp_pixel_byte(csp) + CSP_CHECK_BUF_MARGIN, 64);
+        //各プレーンは輝度と同じpitch, 同じ高さの領域に順に配置する
+        buf.resize((size_t)info.pitch * height * (std::max)(1, planes()) + CSP_CHECK_BUF_MARGIN);
+        info.ptr = buf.data();
+    }
+    int planes() const {
+        return RGY_CSP_PLANES[info.csp];
+    }
+    uint8_t *ptr(int iplane) const {
+        return info.ptr + (size_t)info.pitch * info.height * iplane;
+    }
+    void fill_random(std::mt19937& mt) {
+        const int bit_depth = RGY_CSP_BIT_DEPTH[info.csp];
+        if (csp_pixel_byte(info.csp) == 2 && info.csp != RGY_CSP_YUY2) {
+            std::uniform_int_distribution<int> dist(0, (1 << bit_depth) - 1);
+            for (size_t i = 0; i + 1 < buf.size(); i += 2) {
+                const uint16_t value = (uint16_t)dist(mt);
+                memcpy(&buf[i], &value, sizeof(value));
+            }
+        } else {
+            std::uniform_int_distribution<int> dist(0, 255);
+            for (auto& value : buf) {
+                value = (uint8_t)dist(mt);
+            }
+        }
+    }
+    void fill(uint8_t value) {
+        memset(buf.data(), value, buf.size());
+    }
+    //プレーンごとの有効な1行のバイト数と行数
+    void plane_size(int iplane, int out_width, int out_height, int *width_byte, int *lines) const {
+        FrameInfo outInfo = info;
+        outInfo.width = out_width;
+        outInfo.height = out_height;
+        const auto planeInfo = getPlane(&outInfo, (RGY_PLANE)iplane);
+        *width_byte = planeInfo.width * csp_pixel_byte(info.csp);
+        *lines = planeInfo.height;
+    }
+    //処理対象のバイト数 (速度計算用)
+    size_t data_size() const {
+        size_t size = 0;
+        for (int i = 0; i < planes(); i++) {
+            int width_byte = 0, lines = 0;
+            plane_size(i, info.width, info.height, &width_byte, &lines);
+            size += (size_t)width_byte * lines;
+        }
+        return size;
+    }
+};
+
+static void run_convert_csp(funcConvertCSP func, CspCheckFrame& dst, const CspCheckFrame& src, int thread_n, sInputCrop crop) {
+    void *dst_ptr[4] = { 0 };
+    const void *src_ptr[4] = { 0 };
+    for (int i = 0; i < dst.planes(); i++) dst_ptr[i] = dst.ptr(i);
+    for (int i = 0; i < src.planes(); i++) src_ptr[i] = src.ptr(i);
+    for (int ithread = 0; ithread < thread_n; ithread++) {
+        func(dst_ptr, src_ptr, src.info.width, src.info.pitch, src.info.pitch, dst.info.pitch, src.info.height, dst.info.height, ithread, thread_n, crop.c);
+    }
+}
+
+//RGYConvertCSPで変換する (スレッド数が2以上なら、スレッドプールでタイルに分割して処理する)
+static void run_convert_csp_pool(RGYConvertCSP& conv, int interlaced, CspCheckFrame& dst, const CspCheckFrame& src, sInputCrop crop) {
+    void *dst_ptr[4] = { 0 };
+    const void *src_ptr[4] = { 0 };
+    for (int i = 0; i < dst.planes(); i++) dst_ptr[i] = dst.ptr(i);
+    for (int i = 0; i < src.planes(); i++) src_ptr[i] = src.ptr(i);
+    conv.run(interlaced, dst_ptr, src_ptr, src.info.width, src.info.pitch, src.info.pitch, dst.info.pitch, src.info.height, dst.info.height, crop.c);
+}
+
+//有効領域のみを比較する (SIMD実装は行末を超えて書き込むことがある)
+static bool cmp_convert_csp_result(const CspCheckFrame& a, const CspCheckFrame& b, bool uv_only, int out_width, int out_height) {
+    for (int i = (uv_only) ? 1 : 0; i < a.planes(); i++) {
+        int width_byte = 0, lines = 0;
+        a.plane_size(i, out_width, out_height, &width_byte, &lines);
+        for (int y = 0; y < lines; y++) {
+            if (memcmp(a.ptr(i) + (size_t)a.info.pitch * y, b.ptr(i) + (size_t)b.info.pitch * y, width_byte) != 0) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+//------------------------------------------------------------------------------
+// C参照実装
+// funcListにC実装(simd = NONE)のない変換について、1画素ずつ素直に処理する参照実装
+// スレッド分割はせず、常に全体を処理する
+//------------------------------------------------------------------------------
+template<typename T>
+static T *ref_line(const void *plane, int pitch_byte, int y) {
+    return (T *)((uint8_t *)plane + (size_t)pitch_byte * y);
+}
+
+//ビット深度の変換 (8bit→16bit以上は左詰め、高ビット深度→8bitは下位ビットの切り捨て)
+static int ref_depth(int value, int in_bit_depth, int out_bit_depth) {
+    return (in_bit_depth > out_bit_depth) ? (value >> (in_bit_depth - out_bit_depth)) : (value << (out_bit_depth - in_bit_depth));
+}
+
+//輝度プレーンのコピー (ビット深度変換つき)
+template<typename Tin, typename Tout, int in_bit_depth, int out_bit_depth>
+static void ref_copy_plane(void *dst, const void *src, int src_pitch_byte, int dst_pitch_byte, int out_width, int out_height, int crop_left, int crop_up) {
+    for (int y = 0; y < out_height; y++) {
+        const Tin *ptr_src = ref_line<Tin>(src, src_pitch_byte, y + crop_up) + crop_left;
+        Tout *ptr_dst = ref_line<Tout>(dst, dst_pitch_byte, y);
+        for (int x = 0; x < out_width; x++) {
+            ptr_dst[x] = (Tout)ref_depth(ptr_src[x], in_bit_depth, out_bit_depth);
+        }
+    }
+}
+
+//nv12/p010 -> nv12/p010 (UVはインタリーブのまま)
+template<typename T>
+static void ref_copy_nv12(void **dst, const void **src, int width, int src_y_pitch_byte, int src_uv_pitch_byte, int dst_y_pitch_byte, int height, int dst_height, int thread_id, int thread_n, int *crop) {
+    const int out_width  = width  - crop[0] - crop[2];
+    const int out_height = height - crop[1] - crop[3];
+    const int bit_depth = sizeof(T) * 8;
+    ref_copy_plane<T, T, bit_depth, bit_depth>(dst[0], src[0], src_y_pitch_byte, dst_y_pitch_byte, out_width, out_height, crop[0], crop[1]);
+    ref_copy_plane<T, T, bit_depth, bit_depth>(dst[1], src[1], src_uv_pitch_byte, dst_y_pitch_byte, out_width, out_height >> 1, crop[0], crop[1] >> 1);
+}
+
+//yv12/yuv422 (planar) -> nv12/p010/nv16/p210 (UVインタリーブ)
+//chroma_shift_yは色差の縦方向の間引き (420: 1, 422: 0)
+template<typename Tin, typename Tout, int in_bit_depth, int out_bit_depth, int chroma_shift_y, bool uv_only>
+static void ref_planar_to_semiplanar(void **dst, const void **src, int width, int src_y_pitch_byte, int src_uv_pitch_byte, int dst_y_pitch_byte, int height, int dst_height, int thread_id, int thread_n, int *crop) {
+    const int out_width  = width  - crop[0] - crop[2];
+    const int out_height = height - crop[1] - crop[3];
+    if (!uv_only) {
+        ref_copy_plane<Tin, Tout, in_bit_depth, out_bit_depth>(dst[0], src[0], src_y_pitch_byte, dst_y_pitch_byte, out_width, out_height, crop[0], crop[1]);
+    }
+    for (int y = 0; y < (out_height >> chroma_shift_y); y++) {
+        const Tin *ptr_u = ref_line<Tin>(src[1], src_uv_pitch_byte, y + (crop[1] >> chroma_shift_y)) + (crop[0] >> 1);
+        const Tin *ptr_v = ref_line<Tin>(src[2], src_uv_pitch_byte, y + (crop[1] >> chroma_shift_y)) + (crop[0] >> 1);
+        Tout *ptr_dst = ref_line<Tout>(dst[1], dst_y_pitch_byte, y);
+        for (int x = 0; x < (out_width >> 1); x++) {
+            ptr_dst[x * 2 + 0] = (Tout)ref_depth(ptr_u[x], in_bit_depth, out_bit_depth);
+            ptr_dst[x * 2 + 1] = (Tout)ref_depth(ptr_v[x], in_bit_depth, out_bit_depth);
+        }
+    }
+}
+
+//yuv444 (planar) -> yuv444 (planar)
+template<typename Tin, typename Tout, int in_bit_depth, int out_bit_depth>
+static void ref_yuv444_to_yuv444(void **dst, const void **src, int width, int src_y_pitch_byte, int src_uv_pitch_byte, int dst_y_pitch_byte, int height, int dst_height, int thread_id, int thread_n, int *crop) {
+    const int out_width  = width  - crop[0] - crop[2];
+    const int out_height = height - crop[1] - crop[3];
+    for (int i = 0; i < 3; i++) {
+        ref_copy_plane<Tin, Tout, in_bit_depth, out_bit_depth>(dst[i], src[i], src_y_pitch_byte, dst_y_pitch_byte, out_width, out_height, crop[0], crop[1]);
+    }
+}
+
+//RGB系の色空間の画素配置
+//  パックド : 画素内の R, G, B, A のバイト位置 (RGB24/RGB32はメモリ上B,G,R(,A)の順)
+//  プレーナ : R, G, B のプレーン番号
+//  reverse  : 上下反転して格納されている (メモリ上の先頭が画面の最下行)
+struct RefRGBLayout {
+    bool planar;
+    int pixel_byte;
+    int r, g, b, a;
+    bool reverse;
+};
+
+static RefRGBLayout ref_rgb_layout(RGY_CSP csp) {
+    switch (csp) {
+    case RGY_CSP_RGB24:  return { false, 3, 2, 1, 0, -1, false };
+    case RGY_CSP_RGB24R: return { false, 3, 2, 1, 0, -1, true  };
+    case RGY_CSP_BGR24:  return { false, 3, 0, 1, 2, -1, false };
+    case RGY_CSP_RGB32:  return { false, 4, 2, 1, 0,  3, false };
+    case RGY_CSP_RGB32R: return { false, 4, 2, 1, 0,  3, true  };
+    case RGY_CSP_BGR32:  return { false, 4, 0, 1, 2,  3, false };
+    case RGY_CSP_RGB:    return { true,  1, 0, 1, 2, -1, false };
+    case RGY_CSP_GBR:    return { true,  1, 2, 0, 1, -1, false };
+    //GBRAのアルファは変換先で使用しない
+    case RGY_CSP_GBRA:   return { true,  1, 2, 0, 1, -1, false };
+    default:             return { false, 0, 0, 0, 0, -1, false };
+    }
+}
+
+//RGB系の色空間どうしの変換
+//上下反転の入力では、crop_up/crop_bottomはメモリ上の行に対するものとし、
+//メモリ上で最も下の有効行を出力の先頭行とする
+//変換元にアルファがなければ、パックドの出力のアルファは0とする
+static void ref_convert_rgb_impl(RGY_CSP csp_from, RGY_CSP csp_to, void **dst, const void **src, int width, int src_pitch_byte, int dst_pitch_byte, int height, int *crop) {
+    const auto from = ref_rgb_layout(csp_from);
+    const auto to   = ref_rgb_layout(csp_to);
+    const int out_width  = width  - crop[0] - crop[2];
+    const int out_height = height - crop[1] - crop[3];
+    for (int y = 0; y < out_height; y++) {
+        const int src_y = (from.reverse) ? (height - crop[3] - 1 - y) : (y + crop[1]);
+        for (int x = 0; x < out_width; x++) {
+            const int src_x = x + crop[0];
+            int rgba[4] = { 0 };
+            const int idx[4] = { from.r, from.g, from.b, from.a };
+            for (int i = 0; i < 4; i++) {
+                if (idx[i] < 0) continue;
+                rgba[i] = (from.planar)
+                    ? ref_line<uint8_t>(src[idx[i]], src_pitch_byte, src_y)[src_x]
+                    : ref_line<uint8_t>(src[0], src_pitch_byte, src_y)[src_x * from.pixel_byte + idx[i]];
+            }
+            const int dst_idx[4] = { to.r, to.g, to.b, (to.planar) ? -1 : ((to.pixel_byte == 4) ? 3 : -1) };
+            for (int i = 0; i < 4; i++) {
+                if (dst_idx[i] < 0) continue;
+                uint8_t *ptr_dst = (to.planar)
+                    ? ref_line<uint8_t>(dst[dst_idx[i]], dst_pitch_byte, y) + x
+                    : ref_line<uint8_t>(dst[0], dst_pitch_byte, y) + x * to.pixel_byte + dst_idx[i];
+                *ptr_dst = (uint8_t)rgba[i];
+            }
+        }
+    }
+}
+
+template<RGY_CSP csp_from, RGY_CSP csp_to>
+static void ref_convert_rgb(void **dst, const void **src, int width, int src_y_pitch_byte, int src_uv_pitch_byte, int dst_y_pitch_byte, int height, int dst_height, int thread_id, int thread_n, int *crop) {
+    ref_convert_rgb_impl(csp_from, csp_to, dst, src, width, src_y_pitch_byte, dst_y_pitch_byte, height, crop);
+}
+
+struct RefConvertCSP {
+    RGY_CSP csp_from, csp_to;
+    bool uv_only;
+    funcConvertCSP func;
+};
+
+#define REF_RGB(from, to) { from, to, false, ref_convert_rgb<from, to> }
+
+static const RefConvertCSP refList[] = {
+    { RGY_CSP_NV12,       RGY_CSP_NV12,      false, ref_copy_nv12<uint8_t>  },
+    { RGY_CSP_P010,       RGY_CSP_P010,      false, ref_copy_nv12<uint16_t> },
+    { RGY_CSP_YV12,       RGY_CSP_NV12,      false, ref_planar_to_semiplanar<uint8_t,  uint8_t,   8,  8, 1, false> },
+    { RGY_CSP_YV12,       RGY_CSP_NV12,      true,  ref_planar_to_semiplanar<uint8_t,  uint8_t,   8,  8, 1, true>  },
+    { RGY_CSP_YV12_16,    RGY_CSP_NV12,      false, ref_planar_to_semiplanar<uint16_t, uint8_t,  16,  8, 1, false> },
+    { RGY_CSP_YV12_14,    RGY_CSP_NV12,      false, ref_planar_to_semiplanar<uint16_t, uint8_t,  14,  8, 1, false> },
+    { RGY_CSP_YV12_12,    RGY_CSP_NV12,      false, ref_planar_to_semiplanar<uint16_t, uint8_t,  12,  8, 1, false> },
+    { RGY_CSP_YV12_10,    RGY_CSP_NV12,      false, ref_planar_to_semiplanar<uint16_t, uint8_t,  10,  8, 1, false> },
+    { RGY_CSP_YV12_09,    RGY_CSP_NV12,      false, ref_planar_to_semiplanar<uint16_t, uint8_t,   9,  8, 1, false> },
+    { RGY_CSP_YV12_16,    RGY_CSP_P010,      false, ref_planar_to_semiplanar<uint16_t, uint16_t, 16, 16, 1, false> },
+    { RGY_CSP_YV12_14,    RGY_CSP_P010,      false, ref_planar_to_semiplanar<uint16_t, uint16_t, 14, 16, 1, false> },
+    { RGY_CSP_YV12_12,    RGY_CSP_P010,      false, ref_planar_to_semiplanar<uint16_t, uint16_t, 12, 16, 1, false> },
+    { RGY_CSP_YV12_10,    RGY_CSP_P010,      false, ref_planar_to_semiplanar<uint16_t, uint16_t, 10, 16, 1, false> },
+    { RGY_CSP_YV12_09,    RGY_CSP_P010,      false, ref_planar_to_semiplanar<uint16_t, uint16_t,  9, 16, 1, false> },
+    { RGY_CSP_YUV422,     RGY_CSP_NV16,      false, ref_planar_to_semiplanar<uint8_t,  uint8_t,   8,  8, 0, false> },
+    { RGY_CSP_YUV422,     RGY_CSP_P210,      false, ref_planar_to_semiplanar<uint8_t,  uint16_t,  8, 16, 0, false> },
+    { RGY_CSP_YUV422_16,  RGY_CSP_P210,      false, ref_planar_to_semiplanar<uint16_t, uint16_t, 16, 16, 0, false> },
+    { RGY_CSP_YUV422_14,  RGY_CSP_P210,      false, ref_planar_to_semiplanar<uint16_t, uint16_t, 14, 16, 0, false> },
+    { RGY_CSP_YUV422_12,  RGY_CSP_P210,      false, ref_planar_to_semiplanar<uint16_t, uint16_t, 12, 16, 0, false> },
+    { RGY_CSP_YUV422_10,  RGY_CSP_P210,      false, ref_planar_to_semiplanar<uint16_t, uint16_t, 10, 16, 0, false> },
+    { RGY_CSP_YUV422_09,  RGY_CSP_P210,      false, ref_planar_to_semiplanar<uint16_t, uint16_t,  9, 16, 0, false> },
+    { RGY_CSP_YUV444,     RGY_CSP_YUV444,    false, ref_yuv444_to_yuv444<uint8_t,  uint8_t,   8,  8> },
+    { RGY_CSP_YUV444,     RGY_CSP_YUV444_16, false, ref_yuv444_to_yuv444<uint8_t,  uint16_t,  8, 16> },
+    { RGY_CSP_YUV444_16,  RGY_CSP_YUV444_16, false, ref_yuv444_to_yuv444<uint16_t, uint16_t, 16, 16> },
+    { RGY_CSP_YUV444_14,  RGY_CSP_YUV444_16, false, ref_yuv444_to_yuv444<uint16_t, uint16_t, 14, 16> },
+    { RGY_CSP_YUV444_12,  RGY_CSP_YUV444_16, false, ref_yuv444_to_yuv444<uint16_t, uint16_t, 12, 16> },
+    { RGY_CSP_YUV444_10,  RGY_CSP_YUV444_16, false, ref_yuv444_to_yuv444<uint16_t, uint16_t, 10, 16> },
+    { RGY_CSP_YUV444_09,  RGY_CSP_YUV444_16, false, ref_yuv444_to_yuv444<uint16_t, uint16_t,  9, 16> },
+    { RGY_CSP_YUV444_16,  RGY_CSP_YUV444,    false, ref_yuv444_to_yuv444<uint16_t, uint8_t,  16,  8> },
+    { RGY_CSP_YUV444_14,  RGY_CSP_YUV444,    false, ref_yuv444_to_yuv444<uint16_t, uint8_t,  14,  8> },
+    { RGY_CSP_YUV444_12,  RGY_CSP_YUV444,    false, ref_yuv444_to_yuv444<uint16_t, uint8_t,  12,  8> },
+    { RGY_CSP_YUV444_10,  RGY_CSP_YUV444,    false, ref_yuv444_to_yuv444<uint16_t, uint8_t,  10,  8> },
+    { RGY_CSP_YUV444_09,  RGY_CSP_YUV444,    false, ref_yuv444_to_yuv444<uint16_t, uint8_t,   9,  8> },
+    REF_RGB(RGY_CSP_BGR24,  RGY_CSP_RGB24),
+    REF_RGB(RGY_CSP_BGR32,  RGY_CSP_RGB32),
+    REF_RGB(RGY_CSP_RGB24,  RGY_CSP_RGB),
+    REF_RGB(RGY_CSP_BGR24,  RGY_CSP_RGB),
+    REF_RGB(RGY_CSP_RGB24R, RGY_CSP_RGB),
+    REF_RGB(RGY_CSP_RGB32,  RGY_CSP_RGB),
+    REF_RGB(RGY_CSP_BGR32,  RGY_CSP_RGB),
+    REF_RGB(RGY_CSP_RGB32R, RGY_CSP_RGB),
+    REF_RGB(RGY_CSP_GBR,    RGY_CSP_RGB24),
+    REF_RGB(RGY_CSP_GBRA,   RGY_CSP_RGB24),
+    REF_RGB(RGY_CSP_GBR,    RGY_CSP_RGB32),
+    REF_RGB(RGY_CSP_GBRA,   RGY_CSP_RGB32),
+    REF_RGB(RGY_CSP_RGB,    RGY_CSP_RGB),
+    REF_RGB(RGY_CSP_GBR,    RGY_CSP_RGB),
+    REF_RGB(RGY_CSP_RGB24,  RGY_CSP_RGB32),
+    REF_RGB(RGY_CSP_RGB24R, RGY_CSP_RGB32),
+    REF_RGB(RGY_CSP_RGB32,  RGY_CSP_RGB32),
+    REF_RGB(RGY_CSP_RGB32R, RGY_CSP_RGB32),
+    REF_RGB(RGY_CSP_RGB24,  RGY_CSP_RGB24),
+    REF_RGB(RGY_CSP_RGB24R, RGY_CSP_RGB24),
+};
+
+#undef REF_RGB
+
+//比較に使うC実装を返す
+//funcListのC実装(simd = NONE)を優先し、なければ上記の参照実装を使う
+static bool get_convert_csp_ref(const std::vector<const ConvertCSP *>& list, const ConvertCSP *target, ConvertCSP *ref) {
+    for (const auto func : list) {
+        if (func->csp_from == target->csp_from
+            && func->csp_to == target->csp_to
+            && func->uv_only == target->uv_only
+            && func->simd == NONE) {
+            *ref = *func;
+            return true;
+        }
+    }
+    for (const auto& func : refList) {
+        if (func.csp_from == target->csp_from
+            && func.csp_to == target->csp_to
+            && func.uv_only == target->uv_only) {
+            *ref = { func.csp_from, func.csp_to, func.uv_only, { func.func, func.func }, NONE };
+            return true;
+        }
+    }
+    return false;
+}
+
+//幅・Cropが奇数の場合を含めて確認するCrop値
+static const int CSP_CHECK_CROP_N = 3;
+static void get_convert_csp_check_crop(sInputCrop check_crop[CSP_CHECK_CROP_N]) {
+    check_crop[0] = initCrop();
+    check_crop[1] = initCrop();
+    check_crop[1].e.left = 2;
+    check_crop[1].e.up = 4;
+    check_crop[1].e.right = 6;
+    check_crop[1].e.bottom = 4;
+    check_crop[2] = initCrop();
+    check_crop[2].e.left = 3;
+    check_crop[2].e.up = 1;
+    check_crop[2].e.right = 1;
+    check_crop[2].e.bottom = 5;
+}
+
+//色差が間引かれた色空間で幅・Cropが奇数の場合は、RGYConvertCSPが変換せずにエラーを返すことを確認する
+static bool check_convert_csp_reject(const ConvertCSP *target, const CspCheckFrame& src, sInputCrop crop) {
+    RGYConvertCSP conv(1);
+    conv.getFunc(target->csp_from, target->csp_to, target->uv_only, target->simd);
+    if (conv.checkSize(src.info.width, src.info.height, crop.c) == RGY_ERR_NONE) {
+        return true; //対応するサイズ
+    }
+    CspCheckFrame dst(target->csp_to, src.info.width, src.info.height);
+    dst.fill(CSP_CHECK_DST_FILL);
+    void *dst_ptr[4] = { 0 };
+    const void *src_ptr[4] = { 0 };
+    for (int i = 0; i < dst.planes(); i++) dst_ptr[i] = dst.ptr(i);
+    for (int i = 0; i < src.planes(); i++) src_ptr[i] = src.ptr(i);
+    const auto err = conv.run(0, dst_ptr, src_ptr, src.info.width, src.info.pitch, src.info.pitch, dst.info.pitch, src.info.height, dst.info.height, crop.c);
+    return err == RGY_ERR_INVALID_RESOLUTION
+        && std::all_of(dst.buf.begin(), dst.buf.end(), [](uint8_t value) { return value == CSP_CHECK_DST_FILL; });
+}
+
+static bool is_convert_csp_size_supported(const ConvertCSP *target, int width, int height, sInputCrop crop) {
+    RGYConvertCSP conv(1);
+    conv.getFunc(target->csp_from, target->csp_to, target->uv_only, target->simd);
+    return conv.checkSize(width, height, crop.c) == RGY_ERR_NONE;
+}
+
+static bool check_convert_csp_exact(const ConvertCSP *ref, const ConvertCSP *target, const std::vector<int>& check_width, std::mt19937& mt) {
+    static const int check_height = 136;
+    sInputCrop check_crop[CSP_CHECK_CROP_N];
+    get_convert_csp_check_crop(check_crop);
+
+    for (const auto width : check_width) {
+        CspCheckFrame src(target->csp_from, width, check_height);
+        src.fill_random(mt);
+        for (const auto& crop : check_crop) {
+            if (!is_convert_csp_size_supported(target, width, check_height, crop)) {
+                if (!check_convert_csp_reject(target, src, crop)) {
+                    fprintf(stderr, "not rejected: %s -> %s%s [%s] width %d, crop %d,%d,%d,%d\n",
+                        RGY_CSP_NAMES[target->csp_from], RGY_CSP_NAMES[target->csp_to], target->uv_only ? " (uv only)" : "",
+                        get_simd_str(target->simd), width, crop.e.left, crop.e.up, crop.e.right, crop.e.bottom);
+                    return false;
+                }
+                continue;
+            }
+            const int out_width  = width - crop.e.left - crop.e.right;
+            const int out_height = check_height - crop.e.up - crop.e.bottom;
+            for (int interlaced = 0; interlaced < 2; interlaced++) {
+                for (int thread_n = 1; thread_n <= 3; thread_n += 2) {
+                    CspCheckFrame dst_ref(target->csp_to, width, check_height);
+                    CspCheckFrame dst(target->csp_to, width, check_height);
+                    dst_ref.fill(CSP_CHECK_DST_FILL);
+                    dst.fill(CSP_CHECK_DST_FILL);
+                    run_convert_csp(ref->func[interlaced], dst_ref, src, 1, crop);
+                    run_convert_csp(target->func[interlaced], dst, src, thread_n, crop);
+                    if (!cmp_convert_csp_result(dst_ref, dst, target->uv_only, out_width, out_height)) {
+                        fprintf(stderr, "mismatch: %s -> %s%s [%s] width %d, crop %d,%d,%d,%d, %s, %d thread(s)\n",
+                            RGY_CSP_NAMES[target->csp_from], RGY_CSP_NAMES[target->csp_to], target->uv_only ? " (uv only)" : "",
+                            get_simd_str(target->simd), width, crop.e.left, crop.e.up, crop.e.right, crop.e.bottom,
+                            interlaced ? "interlaced" : "progressive", thread_n);
+                        return false;
+                    }
+                }
+            }
+        }
+    }
+    return true;
+}
+
+//simd_maskのいずれかを使用する関数 (0ですべて) を、C実装とcheck_widthの各幅で比較する
+static int check_convert_csp_table(uint32_t simd_mask, const std::vector<int>& check_width) {
+    const uint32_t availableSIMD = get_availableSIMD();
+    const auto list = get_convert_csp_func_list();
+    std::mt19937 mt(4321);
+    int checked = 0, mismatch = 0;
+    for (const auto func : list) {
+        if (func->simd != (availableSIMD & func->simd)) {
+            continue;
+        }
+        if (simd_mask != 0 && (func->simd & simd_mask) == 0) {
+            continue;
+        }
+        ConvertCSP ref;
+        if (!get_convert_csp_ref(list, func, &ref)) {
+            fprintf(stderr, "no C reference: %s -> %s%s [%s]\n",
+                RGY_CSP_NAMES[func->csp_from], RGY_CSP_NAMES[func->csp_to], func->uv_only ? " (uv only)" : "", get_simd_str(func->simd));
+            mismatch++;
+            continue;
+        }
+        if (func->simd == NONE && ref.func[0] == func->func[0] && ref.func[1] == func->func[1]) {
+            continue; //C実装そのもの
+        }
+        checked++;
+        if (!check_convert_csp_exact(&ref, func, check_width, mt)) {
+            mismatch++;
+        }
+    }
+    fprintf(stdout, "simd: %s, checked %d functions, %d mismatch\n", get_simd_str(availableSIMD), checked, mismatch);
+    if (mismatch) {
+        return RGY_TEST_FAIL;
+    }
+    return (checked > 0) ? RGY_TEST_PASS : RGY_TEST_SKIP;
+}
+
+//funcListのすべての関数を、対応するC実装とビット単位で比較する
+RGY_TEST(convert_csp) {
+    return check_convert_csp_table(0, { 1920, 1366, 722, 1921, 723, 131 });
+}
+
+//AVX-512の関数のみを、ループの端数処理(64byte未満の残り)が発生する幅も含めて比較する
+RGY_TEST(convert_csp_avx512) {
+    if ((get_availableSIMD() & (AVX512F | AVX512BW)) != (AVX512F | AVX512BW)) {
+        fprintf(stdout, "AVX-512 is not available.\n");
+        return RGY_TEST_SKIP;
+    }
+    return check_convert_csp_table(AVX512F | AVX512BW | AVX512VBMI, { 1920, 1366, 722, 190, 130, 66, 1921, 191, 67 });
+}
+
+//RGYConvertCSPがスレッドプールでタイルに分割して変換した結果が、1スレッドでの変換と一致するか
+//タイル数はスレッド数より多く、タイルの境界は各関数のスレッド分割の単位と揃わないこともある
+RGY_TEST(convert_csp_pool) {
+    static const int check_size[][2] = { { 1280, 720 }, { 722, 136 }, { 723, 136 } };
+    const uint32_t availableSIMD = get_availableSIMD();
+    const auto list = get_convert_csp_func_list();
+    std::mt19937 mt(4321);
+    sInputCrop check_crop[CSP_CHECK_CROP_N];
+    get_convert_csp_check_crop(check_crop);
+    int checked = 0, mismatch = 0;
+    for (const auto func : list) {
+        if (func->simd != (availableSIMD & func->simd)) {
+            continue;
+        }
+        //RGYConvertCSPで選択される関数のみ確認する
+        RGYConvertCSP probe(1);
+        if (probe.getFunc(func->csp_from, func->csp_to, func->uv_only, func->simd) != func) {
+            continue;
+        }
+        checked++;
+        bool ok = true;
+        for (const auto& size : check_size) {
+            CspCheckFrame src(func->csp_from, size[0], size[1]);
+            src.fill_random(mt);
+            for (const auto& crop : check_crop) {
+                if (!is_convert_csp_size_supported(func, size[0], size[1], crop)) {
+                    continue;
+                }
+                const int out_width  = size[0] - crop.e.left - crop.e.right;
+                const int out_height = size[1] - crop.e.up - crop.e.bottom;
+                for (int interlaced = 0; interlaced < 2 && ok; interlaced++) {
+                    CspCheckFrame dst_ref(func->csp_to, size[0], size[1]);
+                    dst_ref.fill(CSP_CHECK_DST_FILL);
+                    run_convert_csp(func->func[interlaced], dst_ref, src, 1, crop);
+                    for (int threads : { 2, 5 }) {
+                        RGYConvertCSP conv(threads);
+                        conv.getFunc(func->csp_from, func->csp_to, func->uv_only, func->simd);
+                        CspCheckFrame dst(func->csp_to, size[0], size[1]);
+                        dst.fill(CSP_CHECK_DST_FILL);
+                        run_convert_csp_pool(conv, interlaced, dst, src, crop);
+                        if (!cmp_convert_csp_result(dst_ref, dst, func->uv_only, out_width, out_height)) {
+                            fprintf(stderr, "pool mismatch: %s -> %s%s [%s] %dx%d, crop %d,%d,%d,%d, %s, %d threads\n",
+                                RGY_CSP_NAMES[func->csp_from], RGY_CSP_NAMES[func->csp_to], func->uv_only ? " (uv only)" : "",
+                                get_simd_str(func->simd), size[0], size[1], crop.e.left, crop.e.up, crop.e.right, crop.e.bottom,
+                                interlaced ? "interlaced" : "progressive", threads);
+                            ok = false;
+                            break;
+                        }
+                    }
+                }
+            }
+        }
+        mismatch += (ok) ? 0 : 1;
+    }
+    fprintf(stdout, "simd: %s, checked %d functions, %d mismatch\n", get_simd_str(availableSIMD), checked, mismatch);
+    if (mismatch) {
+        return RGY_TEST_FAIL;
+    }
+    return (checked > 0) ? RGY_TEST_PASS : RGY_TEST_SKIP;
+}
+
+//GB/s (読み込み+書き込みのバイト数)
+static double bench_convert_csp(funcConvertCSP func, RGY_CSP csp_from, RGY_CSP csp_to, std::mt19937& mt) {
+    static const int bench_width = 1920;
+    static const int bench_height = 1080;
+    static const auto bench_duration = std::chrono::milliseconds(20);
+    CspCheckFrame src(csp_from, bench_width, bench_height);
+    CspCheckFrame dst(csp_to, bench_width, bench_height);
+    src.fill_random(mt);
+    dst.fill(0);
+    const size_t frame_bytes = src.data_size() + dst.data_size();
+
+    run_convert_csp(func, dst, src, 1, initCrop()); //warm up
+    int count = 0;
+    const auto start = std::chrono::high_resolution_clock::now();
+    auto elapsed = std::chrono::high_resolution_clock::duration::zero();
+    while (count < 4 || elapsed < bench_duration) {
+        run_convert_csp(func, dst, src, 1, initCrop());
+        count++;
+        elapsed = std::chrono::high_resolution_clock::now() - start;
+    }
+    const double sec = std::chrono::duration<double>(elapsed).count();
+    return frame_bytes * count / sec * 1e-9;
+}
+
+//1920x1080での各関数の処理速度をJSONで出力する
+RGY_TEST(bench_convert_csp) {
+    const uint32_t availableSIMD = get_availableSIMD();
+    const auto list = get_convert_csp_func_list();
+    std::mt19937 mt(4321);
+
+    tstring str = _T("{\n");
+    str += strsprintf(_T("  \"simd\": \"%s\",\n"), get_simd_str(availableSIMD));
+    str += _T("  \"results\": [\n");
+    bool first = true;
+    for (const auto func : list) {
+        if (func->simd != (availableSIMD & func->simd)) {
+            continue;
+        }
+        const double gbps_p = bench_convert_csp(func->func[0], func->csp_from, func->csp_to, mt);
+        const double gbps_i = (func->func[1] == func->func[0]) ? gbps_p : bench_convert_csp(func->func[1], func->csp_from, func->csp_to, mt);
+        str += (first) ? _T("") : _T(",\n");
+        str += strsprintf(_T("    { \"from\": \"%s\", \"to\": \"%s\", \"uv_only\": %s, \"simd\": \"%s\", \"progressive_GBps\": %.3f, \"interlaced_GBps\": %.3f }"),
+            RGY_CSP_NAMES[func->csp_from], RGY_CSP_NAMES[func->csp_to], func->uv_only ? _T("true") : _T("false"),
+            get_simd_str(func->simd), gbps_p, gbps_i);
+        first = false;
+    }
+    str += _T("\n  ]\n");
+    str += _T("}\n");
+    _ftprintf(stdout, _T("%s"), str.c_str());
+    return RGY_TEST_PASS;
+}
+
+//MB/s (読み込み+書き込みのバイト数) をthread_listの各スレッド数について計測する
+//RGYConvertCSPを使い、スレッド数が2以上ならスレッドプールでタイルに分割して処理する
+static std::vector<double> bench_convert_csp_mt(const ConvertCSP *func, int width, int height, const std::vector<int>& thread_list) {
+    static const auto bench_duration = std::chrono::milliseconds(20);
+    CspCheckFrame src(func->csp_from, width, height);
+    CspCheckFrame dst(func->csp_to, width, height);
+    //処理速度はデータに依存しないので、乱数は使わず埋めるだけにする
+    src.fill(0x35);
+    const size_t frame_bytes = src.data_size() + dst.data_size();
+
+    std::vector<double> mbps;
+    for (const auto threads : thread_list) {
+        RGYConvertCSP conv(threads);
+        conv.getFunc(func->csp_from, func->csp_to, func->uv_only, func->simd);
+        run_convert_csp_pool(conv, 0, dst, src, initCrop()); //warm up
+        int count = 0;
+        const auto start = std::chrono::steady_clock::now();
+        auto elapsed = std::chrono::steady_clock::duration::zero();
+        while (count < 2 || elapsed < bench_duration) {
+            run_convert_csp_pool(conv, 0, dst, src, initCrop());
+            count++;
+            elapsed = std::chrono::steady_clock::now() - start;
+        }
+        const double sec = std::chrono::duration<double>(elapsed).count();
+        mbps.push_back(frame_bytes * count / sec * 1e-6);
+    }
+    return mbps;
+}
+
+//1080p/4K/8Kでの各関数の処理速度 (MB/s) を、スレッド数 1, 2, 4, ... , 論理コア数 で計測してJSONで出力する
+RGY_TEST(bench_convert_csp_mt) {
+    static const int bench_size[][2] = { { 1920, 1080 }, { 3840, 2160 }, { 7680, 4320 } };
+    const uint32_t availableSIMD = get_availableSIMD();
+    const auto list = get_convert_csp_func_list();
+    const int max_threads = (std::max)(1, (int)std::thread::hardware_concurrency());
+    std::vector<int> thread_list;
+    for (int threads = 1; threads < max_threads; threads *= 2) {
+        thread_list.push_back(threads);
+    }
+    thread_list.push_back(max_threads);
+
+    tstring str = _T("{\n");
+    str += strsprintf(_T("  \"simd\": \"%s\",\n"), get_simd_str(availableSIMD));
+    str += strsprintf(_T("  \"threads\": %d,\n"), max_threads);
+    str += _T("  \"results\": [\n");
+    bool first = true;
+    for (const auto func : list) {
+        if (func->simd != (availableSIMD & func->simd)) {
+            continue;
+        }
+        for (const auto& size : bench_size) {
+            const auto mbps = bench_convert_csp_mt(func, size[0], size[1], thread_list);
+            for (size_t i = 0; i < thread_list.size(); i++) {
+                str += (first) ? _T("") : _T(",\n");
+                str += strsprintf(_T("    { \"from\": \"%s\", \"to\": \"%s\", \"uv_only\": %s, \"simd\": \"%s\", \"width\": %d, \"height\": %d, \"threads\": %d, \"MBps\": %.1f }"),
+                    RGY_CSP_NAMES[func->csp_from], RGY_CSP_NAMES[func->csp_to], func->uv_only ? _T("true") : _T("false"),
+                    get_simd_str(func->simd), size[0], size[1], thread_list[i], mbps[i]);
+                first = false;
+            }
+        }
+    }
+    str += _T("\n  ]\n");
+    str += _T("}\n");
+    _ftprintf(stdout, _T("%s"), str.c_str());
+    return RGY_TEST_PASS;
+}
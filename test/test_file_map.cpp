@@ -0,0 +1,124 @@
+﻿// -----------------------------------------------------------------------------------------
+// QSVEnc/NVEnc/VCEEnc by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2020 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include "rgy_util.h"
+#include "rgy_test.h"
+
+static tstring file_map_tmp_name(const TCHAR *tag) {
+    return strsprintf(_T("/tmp/rgy_file_map_%s_%d.bin"), tag, (int)getpid());
+}
+
+static bool file_map_write(const tstring& filename, const std::vector<uint8_t>& data) {
+    FILE *fp = _tfopen(filename.c_str(), _T("wb"));
+    if (fp == nullptr) {
+        return false;
+    }
+    const bool ret = fwrite(data.data(), 1, data.size(), fp) == data.size();
+    fclose(fp);
+    return ret;
+}
+
+//通常のファイルはマップして読め、prefetch/releaseの後も内容が変わらないこと
+//パイプや空のファイルはマップできないこと
+RGY_TEST(file_map) {
+    std::vector<uint8_t> data(4 * 1024 * 1024 + 123);
+    uint32_t seed = 12345;
+    for (auto& v : data) {
+        seed = seed * 1664525u + 1013904223u;
+        v = (uint8_t)(seed >> 24);
+    }
+    const auto filename = file_map_tmp_name(_T("data"));
+    RGY_TEST_EXPECT(file_map_write(filename, data));
+
+    int mismatch = 0;
+    {
+        FILE *fp = _tfopen(filename.c_str(), _T("rb"));
+        RGY_TEST_EXPECT(fp != nullptr);
+        RGYFileMap map;
+        const auto err = map.open(fp);
+        if (err == RGY_ERR_NONE) {
+            mismatch += (map.size() != data.size()) ? 1 : 0;
+            //先頭から順に読み進めながら、先読みと参照済み領域の解放を行う
+            const uint64_t step = 256 * 1024 + 17;
+            for (uint64_t pos = 0; pos < map.size() && !mismatch; pos += step) {
+                const auto size = (std::min)(step, map.size() - pos);
+                map.prefetch(pos + size, step);
+                mismatch += (memcmp(map.ptr() + pos, data.data() + pos, (size_t)size) != 0) ? 1 : 0;
+                map.release(pos + size);
+            }
+            //解放した領域もファイルから読み直されるので、参照はできる
+            mismatch += (memcmp(map.ptr(), data.data(), data.size()) != 0) ? 1 : 0;
+            map.close();
+            mismatch += (map.ptr() != nullptr || map.size() != 0) ? 1 : 0;
+        } else {
+            fprintf(stderr, "failed to map regular file: %s.\n", tchar_to_string(get_err_mes(err)).c_str());
+            mismatch++;
+        }
+        fclose(fp);
+    }
+    _tremove(filename.c_str());
+
+    //空のファイル
+    const auto emptyname = file_map_tmp_name(_T("empty"));
+    RGY_TEST_EXPECT(file_map_write(emptyname, std::vector<uint8_t>()));
+    {
+        FILE *fp = _tfopen(emptyname.c_str(), _T("rb"));
+        RGY_TEST_EXPECT(fp != nullptr);
+        RGYFileMap map;
+        mismatch += (map.open(fp) != RGY_ERR_UNSUPPORTED || map.ptr() != nullptr) ? 1 : 0;
+        fclose(fp);
+    }
+    _tremove(emptyname.c_str());
+
+    //パイプ
+    int fds[2] = { -1, -1 };
+    RGY_TEST_EXPECT(pipe(fds) == 0);
+    {
+        FILE *fp = fdopen(fds[0], "rb");
+        RGY_TEST_EXPECT(fp != nullptr);
+        RGYFileMap map;
+        mismatch += (map.open(fp) != RGY_ERR_UNSUPPORTED || map.ptr() != nullptr) ? 1 : 0;
+        //マップされていない状態でのprefetch/releaseは何もしない
+        map.prefetch(0, 4096);
+        map.release(4096);
+        fclose(fp);
+    }
+    close(fds[1]);
+
+    {
+        RGYFileMap map;
+        mismatch += (map.open(nullptr) != RGY_ERR_NULL_PTR) ? 1 : 0;
+    }
+    if (mismatch) {
+        fprintf(stderr, "file_map: %d mismatch.\n", mismatch);
+    }
+    return (mismatch) ? RGY_TEST_FAIL : RGY_TEST_PASS;
+}
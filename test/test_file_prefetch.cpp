@@ -0,0 +1,121 @@
+﻿// -----------------------------------------------------------------------------------------
+// QSVEnc/NVEnc/VCEEnc by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2020 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+#include <cstdio>
+#include <cstdint>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <functional>
+#include "rgy_util.h"
+#include "rgy_file_prefetch.h"
+#include "rgy_test.h"
+
+static tstring file_prefetch_tmp_name() {
+    return strsprintf(_T("/tmp/rgy_file_prefetch_%d.bin"), (int)getpid());
+}
+
+static bool file_prefetch_write(const tstring& filename, size_t size, const TCHAR *mode) {
+    FILE *fp = _tfopen(filename.c_str(), mode);
+    if (fp == nullptr) {
+        return false;
+    }
+    std::vector<uint8_t> data(size, 0x5a);
+    const bool ret = fwrite(data.data(), 1, data.size(), fp) == data.size();
+    fclose(fp);
+    return ret;
+}
+
+//条件が満たされるまで待つ (5秒でタイムアウト)
+static bool file_prefetch_wait(const std::function<bool()>& cond) {
+    const auto timeout = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (!cond()) {
+        if (std::chrono::steady_clock::now() > timeout) {
+            return false;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return true;
+}
+
+//読み込み位置から指定サイズだけ先まで読んで止まり、読み込み位置の更新・シーク・ファイル終端・伸びていくファイルに追従すること
+RGY_TEST(file_prefetch) {
+    const int64_t MB = 1024 * 1024;
+    const int64_t prefetchSize = 2 * MB;
+    const int64_t fileSize = 8 * MB + 5;
+    const auto filename = file_prefetch_tmp_name();
+    RGY_TEST_EXPECT(file_prefetch_write(filename, (size_t)fileSize, _T("wb")));
+
+    bool ok = true;
+    auto check = [&ok](bool cond, const char *msg) {
+        if (!cond) {
+            fprintf(stderr, "file_prefetch: %s\n", msg);
+            ok = false;
+        }
+    };
+    {
+        RGYFilePrefetch prefetch(nullptr);
+        check(prefetch.start(filename + _T(".none"), prefetchSize) == RGY_ERR_FILE_OPEN, "opened a missing file");
+        check(!prefetch.running(), "running without a file");
+
+        check(prefetch.start(filename, prefetchSize) == RGY_ERR_NONE, "failed to start");
+        check(prefetch.running(), "not running");
+        //先頭からprefetchSizeまで読んで待機する
+        check(file_prefetch_wait([&]() { return prefetch.prefetchPos() >= prefetchSize; }), "did not read ahead from the start");
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        check(prefetch.prefetchPos() == prefetchSize, "read beyond the prefetch size");
+
+        //demuxerに追い越された場合は、読み込み位置から再開する
+        prefetch.setReadPos(3 * MB);
+        check(file_prefetch_wait([&]() { return prefetch.prefetchPos() == 3 * MB + prefetchSize; }), "did not follow the read position");
+
+        //ファイル終端に到達したら待機する
+        prefetch.setReadPos(7 * MB);
+        check(file_prefetch_wait([&]() { return prefetch.state() == RGY_PREFETCH_EOF; }), "did not reach EOF");
+        check(prefetch.prefetchPos() == fileSize, "EOF position mismatch");
+
+        //ファイルが伸びた場合は、読み込み位置の更新でファイル終端から再開する
+        RGY_TEST_EXPECT(file_prefetch_write(filename, (size_t)MB, _T("ab")));
+        prefetch.setReadPos(7 * MB + 1);
+        check(file_prefetch_wait([&]() { return prefetch.prefetchPos() == fileSize + MB; }), "did not continue on the grown file");
+
+        //前にシークした場合は、読み込み位置から読み直す
+        prefetch.setReadPos(0);
+        check(file_prefetch_wait([&]() { return prefetch.prefetchPos() == prefetchSize; }), "did not restart after seeking back");
+        check(prefetch.state() == RGY_PREFETCH_RUNNING, "state after seek");
+        check(prefetch.totalRead() == 3 * prefetchSize + (fileSize + MB - 7 * MB), "total read mismatch");
+
+        //待機中でもすぐに停止できる
+        const auto start = std::chrono::steady_clock::now();
+        prefetch.close();
+        check(std::chrono::steady_clock::now() - start < std::chrono::seconds(1), "close blocked");
+        check(!prefetch.running(), "running after close");
+    }
+    _tremove(filename.c_str());
+    RGY_TEST_EXPECT(ok);
+    return RGY_TEST_PASS;
+}
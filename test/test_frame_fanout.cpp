@@ -0,0 +1,251 @@
+﻿// -----------------------------------------------------------------------------------------
+// QSVEnc/NVEnc/VCEEnc by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2020 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+#include <cstring>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include "rgy_util.h"
+#include "rgy_frame_fanout.h"
+#include "rgy_test.h"
+
+static const int FANOUT_CHECK_WIDTH  = 320;
+static const int FANOUT_CHECK_HEIGHT = 180;
+
+//デコードの代わりにフレームを生成する (画素値はフレーム番号と位置から決まる)
+static RGY_ERR fanout_check_load(FrameInfo *frame, int frameCount, int errorFrame, int decodeCost) {
+    if (frame->inputFrameId == errorFrame) {
+        return RGY_ERR_UNKNOWN;
+    }
+    if (frame->inputFrameId >= frameCount) {
+        return RGY_ERR_MORE_DATA;
+    }
+    const int heightTotal = frame->height * 3 / 2;
+    uint32_t state = (uint32_t)frame->inputFrameId * 2654435761u;
+    for (int y = 0; y < heightTotal; y++) {
+        uint8_t *line = frame->ptr + (size_t)y * frame->pitch;
+        for (int x = 0; x < frame->width; x++) {
+            line[x] = (uint8_t)(frame->inputFrameId + x + y);
+        }
+        //デコードの負荷を模す
+        for (int i = 0; i < decodeCost; i++) {
+            state = state * 1664525u + 1013904223u;
+        }
+        line[0] ^= (uint8_t)(state >> 31);
+        line[0] ^= (uint8_t)(state >> 31);
+    }
+    frame->timestamp = (int64_t)frame->inputFrameId * 1001;
+    frame->duration = 1001;
+    return RGY_ERR_NONE;
+}
+
+//CPUで動作する仮のエンコーダ: 受け取ったフレームを検証し、scale分の1に縮小して「エンコード」する
+struct FanoutCheckEncoder {
+    int branch;
+    int scale;
+    int workCost;     //1フレームあたりの処理負荷
+    int closeAt;      //このフレーム数を処理したら出力先を終了する (-1で無効)
+    int frames;
+    int mismatch;
+    RGY_ERR result;
+    uint64_t checksum;
+    std::vector<uint8_t> output;
+
+    FanoutCheckEncoder(int branch_, int scale_, int workCost_, int closeAt_) :
+        branch(branch_), scale(scale_), workCost(workCost_), closeAt(closeAt_),
+        frames(0), mismatch(0), result(RGY_ERR_NONE), checksum(0), output() {};
+
+    void run(RGYFrameFanout *fanout) {
+        output.resize((FANOUT_CHECK_WIDTH / scale) * (FANOUT_CHECK_HEIGHT / scale));
+        for (;;) {
+            if (closeAt >= 0 && frames >= closeAt) {
+                fanout->closeBranch(branch);
+                result = RGY_ERR_MORE_DATA;
+                return;
+            }
+            std::shared_ptr<RGYFanoutFrame> frame;
+            result = fanout->pop(branch, frame);
+            if (result != RGY_ERR_NONE) {
+                //入力の終端では、付随するデータとして全フレーム数が渡される
+                if (result == RGY_ERR_MORE_DATA) {
+                    auto total = std::static_pointer_cast<int>(frame->extra);
+                    mismatch += (!total || *total != frames) ? 1 : 0;
+                }
+                return;
+            }
+            const auto& info = frame->info;
+            auto extraId = std::static_pointer_cast<int>(frame->extra);
+            mismatch += (info.inputFrameId != frames) ? 1 : 0;
+            mismatch += (info.timestamp != (int64_t)frames * 1001) ? 1 : 0;
+            mismatch += (!extraId || *extraId != frames) ? 1 : 0;
+            //縮小 (resize) しつつ、入力の画素値を検証する
+            const int dstWidth = FANOUT_CHECK_WIDTH / scale;
+            const int dstHeight = FANOUT_CHECK_HEIGHT / scale;
+            for (int y = 0; y < dstHeight; y++) {
+                const uint8_t *src = info.ptr + (size_t)(y * scale) * info.pitch;
+                for (int x = 0; x < dstWidth; x++) {
+                    const uint8_t pix = src[x * scale];
+                    mismatch += (pix != (uint8_t)(info.inputFrameId + x * scale + y * scale)) ? 1 : 0;
+                    output[y * dstWidth + x] = pix;
+                }
+            }
+            uint64_t hash = checksum;
+            for (int i = 0; i < workCost; i++) {
+                hash = hash * 6364136223846793005ull + output[i % output.size()];
+            }
+            checksum = hash;
+            frames++;
+        }
+    }
+};
+
+struct FanoutCheckResult {
+    int mismatch;
+    int maxBuffersInUse;
+    int buffersLeft;
+    double fps;
+};
+
+//branchScale.size()個のエンコーダにframeCountフレームを分配する
+static FanoutCheckResult fanout_check_run(const std::vector<int>& branchScale, const std::vector<int>& closeAt, int frameCount, int errorFrame, int queueSize, int decodeCost, int workCost) {
+    FanoutCheckResult ret = { 0 };
+    FrameInfo frameInfo;
+    frameInfo.csp = RGY_CSP_NV12;
+    frameInfo.width = FANOUT_CHECK_WIDTH;
+    frameInfo.height = FANOUT_CHECK_HEIGHT;
+    frameInfo.pitch = ALIGN(FANOUT_CHECK_WIDTH, 64);
+    const size_t frameSize = (size_t)frameInfo.pitch * frameInfo.height * 3 / 2;
+
+    RGYFrameFanout fanout;
+    auto load = [frameCount, errorFrame, decodeCost](FrameInfo *frame, std::shared_ptr<void> *extra) {
+        auto err = fanout_check_load(frame, frameCount, errorFrame, decodeCost);
+        *extra = std::make_shared<int>((err == RGY_ERR_MORE_DATA) ? frameCount : frame->inputFrameId);
+        return err;
+    };
+    if (fanout.init((int)branchScale.size(), frameInfo, frameSize, queueSize, 0, load, nullptr) != RGY_ERR_NONE) {
+        ret.mismatch++;
+        return ret;
+    }
+    std::vector<std::unique_ptr<FanoutCheckEncoder>> encoders;
+    for (int i = 0; i < (int)branchScale.size(); i++) {
+        encoders.push_back(std::make_unique<FanoutCheckEncoder>(i, branchScale[i], workCost * (i + 1), (i < (int)closeAt.size()) ? closeAt[i] : -1));
+    }
+    const auto start = std::chrono::high_resolution_clock::now();
+    fanout.start();
+    std::vector<std::thread> threads;
+    for (auto& enc : encoders) {
+        threads.push_back(std::thread(&FanoutCheckEncoder::run, enc.get(), &fanout));
+    }
+    for (auto& th : threads) {
+        th.join();
+    }
+    const auto elapsed = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+    const auto stats = fanout.stats();
+    fanout.close();
+    ret.fps = frameCount / (std::max)(elapsed, 1e-9);
+    ret.maxBuffersInUse = stats.maxBuffersInUse;
+    for (auto& enc : encoders) {
+        ret.mismatch += enc->mismatch;
+        const int expectedFrames = (enc->closeAt >= 0) ? enc->closeAt : (errorFrame >= 0) ? errorFrame : frameCount;
+        ret.mismatch += (enc->frames != expectedFrames) ? 1 : 0;
+        const RGY_ERR expectedResult = (enc->closeAt < 0 && errorFrame >= 0) ? RGY_ERR_UNKNOWN : RGY_ERR_MORE_DATA;
+        ret.mismatch += (enc->result != expectedResult) ? 1 : 0;
+    }
+    //バッファはすべて返却されていなければならない
+    ret.buffersLeft = fanout.buffersInUse();
+    ret.mismatch += (ret.buffersLeft != 0) ? 1 : 0;
+    ret.mismatch += (stats.maxBuffersInUse > (int)branchScale.size() + queueSize + 1) ? 1 : 0;
+    return ret;
+}
+
+//出力先ごとにデコードする場合 (従来の動作) の処理速度
+static double fanout_check_separate_decode(const std::vector<int>& branchScale, int frameCount, int decodeCost, int workCost, int *mismatch) {
+    std::atomic<int> mismatchCount(0);
+    const auto start = std::chrono::high_resolution_clock::now();
+    std::vector<std::thread> threads;
+    for (int i = 0; i < (int)branchScale.size(); i++) {
+        threads.push_back(std::thread([&, i]() {
+            mismatchCount += fanout_check_run({ branchScale[i] }, {}, frameCount, -1, 4, decodeCost, workCost * (i + 1)).mismatch;
+        }));
+    }
+    for (auto& th : threads) {
+        th.join();
+    }
+    const auto elapsed = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+    *mismatch += mismatchCount;
+    return frameCount / (std::max)(elapsed, 1e-9);
+}
+
+//処理速度の異なるCPUのみの仮のエンコーダに分配し、順序・内容・タイムスタンプ・付随データ・バッファの返却を確認する
+RGY_TEST(frame_fanout) {
+    const int frameCount = 300;
+    const int workCost = 20000;
+    const std::vector<int> scales = { 1, 2, 3, 4 };
+    struct test_result {
+        const char *name;
+        FanoutCheckResult result;
+    };
+    const test_result results[] = {
+        { "distribute",   fanout_check_run(scales, {}, frameCount, -1, 4, 0, workCost) },
+        { "queue1",       fanout_check_run(scales, {}, frameCount, -1, 1, 0, workCost) },
+        { "close_branch", fanout_check_run(scales, { 10, -1, 0, 150 }, frameCount, -1, 4, 0, workCost) },
+        { "close_all",    fanout_check_run({ 1, 2 }, { 5, 7 }, frameCount, -1, 4, 0, workCost) },
+        { "load_error",   fanout_check_run(scales, {}, frameCount, 100, 4, 0, workCost) },
+    };
+    int mismatch = 0;
+    for (const auto& result : results) {
+        if (result.result.mismatch) {
+            fprintf(stderr, "%s: %d mismatch, max buffers %d, buffers left %d\n",
+                result.name, result.result.mismatch, result.result.maxBuffersInUse, result.result.buffersLeft);
+        }
+        mismatch += result.result.mismatch;
+    }
+    return (mismatch) ? RGY_TEST_FAIL : RGY_TEST_PASS;
+}
+
+//入力を1回だけデコードして分配する場合と、出力先ごとにデコードする場合の処理速度をJSONで出力する
+RGY_TEST(bench_frame_fanout) {
+    const int frameCount = 300;
+    const int workCost = 20000;
+    const int decodeCost = 2000;
+    const std::vector<int> scales = { 1, 2, 3, 4 };
+    int mismatch = 0;
+    const auto fanout = fanout_check_run(scales, {}, frameCount, -1, 4, decodeCost, workCost);
+    mismatch += fanout.mismatch;
+    const double separateFps = fanout_check_separate_decode(scales, frameCount, decodeCost, workCost, &mismatch);
+    tstring str = _T("{\n");
+    str += _T("  \"bench\": [\n");
+    str += strsprintf(_T("    { \"impl\": \"decode_per_output\", \"outputs\": %d, \"fps\": %.1f },\n"), (int)scales.size(), separateFps);
+    str += strsprintf(_T("    { \"impl\": \"fanout\", \"outputs\": %d, \"fps\": %.1f }\n"), (int)scales.size(), fanout.fps);
+    str += _T("  ]\n");
+    str += _T("}\n");
+    _ftprintf(stdout, _T("%s"), str.c_str());
+    return (mismatch) ? RGY_TEST_FAIL : RGY_TEST_PASS;
+}
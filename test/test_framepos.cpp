@@ -0,0 +1,156 @@
+﻿// -----------------------------------------------------------------------------------------
+// QSVEnc/NVEnc/VCEEnc by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2020 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+#include <cstdio>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include "rgy_version.h"
+#include "rgy_util.h"
+#include "rgy_test.h"
+#if ENABLE_AVSW_READER
+#include "rgy_input_avcodec.h"
+
+static const int64_t FRAMEPOS_CHECK_DURATION = 3003;
+static const int64_t FRAMEPOS_CHECK_PTS_MASK = (1LL << 33) - 1; //MPEG-TSのpts (33bit)
+
+//表示順でdisp番目のフレームのpts (frames/2 付近で33bitのwrap arroundが起こるようにする)
+//先頭のcheckPtsStatus前の範囲でwrap arroundすると先頭のopengopの除去と区別できないので、framesは十分大きくすること
+static int64_t framepos_check_pts(int disp, int frames) {
+    const int64_t base = (1LL << 33) - FRAMEPOS_CHECK_DURATION * (frames / 2);
+    return (base + disp * FRAMEPOS_CHECK_DURATION) & FRAMEPOS_CHECK_PTS_MASK;
+}
+
+//I/P B B の並びのストリームをデコード順でFramePosListに登録する (RGYInputAvcodecと同様に、先頭の数フレームでptsの状態を確認する)
+static void framepos_check_replay(FramePosList& list, int frames) {
+    int decodeIdx = 0;
+    auto add = [&](int disp) {
+        if (disp >= frames) return;
+        const int64_t pts = framepos_check_pts(disp, frames);
+        const int64_t dts = (framepos_check_pts(0, frames) + (decodeIdx - 2) * FRAMEPOS_CHECK_DURATION) & FRAMEPOS_CHECK_PTS_MASK;
+        list.add(framePos(pts, dts, (int)FRAMEPOS_CHECK_DURATION, 0, FRAMEPOS_POC_INVALID, (disp % 300 == 0) ? AV_PKT_FLAG_KEY : 0));
+        if (++decodeIdx == 64) {
+            list.checkPtsStatus();
+        }
+    };
+    add(0);
+    for (int anchor = 3; anchor < frames + 2; anchor += 3) {
+        add(anchor);
+        add(anchor - 2);
+        add(anchor - 1);
+    }
+    list.fin(framePos(framepos_check_pts(frames, frames), framepos_check_pts(frames, frames), 0), frames * FRAMEPOS_CHECK_DURATION);
+}
+
+//表示順にfindptsで検索し、ptsの一致するフレームが順に見つかるか確認する
+//missEveryごとに存在しないpts(フレームの間)も検索し、直前のフレームが返るか確認する
+static bool framepos_check_findpts(FramePosList& list, int frames, int missEvery) {
+    uint32_t lastIndex = UINT32_MAX;
+    int prevPoc = -1;
+    for (int disp = 0; disp < frames; disp++) {
+        const int64_t pts = framepos_check_pts(disp, frames);
+        const auto pos = list.findpts(pts, &lastIndex);
+        if (pos.pts != pts || pos.poc != prevPoc + 1 || list.list(lastIndex).pts != pts) {
+            fprintf(stderr, "findpts: frame %d, pts %lld: got pts %lld, poc %d (expected %d), index %u\n",
+                disp, (long long)pts, (long long)pos.pts, pos.poc, prevPoc + 1, lastIndex);
+            return false;
+        }
+        prevPoc = pos.poc;
+        if (missEvery > 0 && disp % missEvery == missEvery - 1) {
+            //フレームの間のpts → 直前のフレーム
+            uint32_t missIndex = lastIndex;
+            const auto posMiss = list.findpts((pts + FRAMEPOS_CHECK_DURATION / 2) & FRAMEPOS_CHECK_PTS_MASK, &missIndex);
+            if (posMiss.pts != pts || missIndex != lastIndex) {
+                fprintf(stderr, "findpts: frame %d, pts %lld + 1/2: got pts %lld, index %u (expected %u)\n",
+                    disp, (long long)pts, (long long)posMiss.pts, missIndex, lastIndex);
+                return false;
+            }
+        }
+    }
+    //前に戻っての検索
+    for (int disp : { 0, frames / 2 - 1, frames / 2, frames - 1, frames / 3 }) {
+        const int64_t pts = framepos_check_pts(disp, frames);
+        const auto pos = list.findpts(pts, &lastIndex);
+        if (pos.pts != pts || pos.poc != disp) {
+            fprintf(stderr, "findpts: jump to frame %d: got pts %lld, poc %d\n", disp, (long long)pos.pts, pos.poc);
+            return false;
+        }
+    }
+    return true;
+}
+#endif //#if ENABLE_AVSW_READER
+
+//wrap arroundを含むストリームで、FramePosList::findptsがptsの一致するフレーム(なければ直前のフレーム)を返すか
+RGY_TEST(framepos_findpts) {
+#if ENABLE_AVSW_READER
+    for (int frames : { 1000, 20000 }) {
+        FramePosList list;
+        framepos_check_replay(list, frames);
+        RGY_TEST_EXPECT(list.sortedNum() >= (uint32_t)frames);
+        RGY_TEST_EXPECT(framepos_check_findpts(list, frames, 0));
+        FramePosList listMiss;
+        framepos_check_replay(listMiss, frames);
+        RGY_TEST_EXPECT(framepos_check_findpts(listMiss, frames, 7));
+    }
+    return RGY_TEST_PASS;
+#else
+    fprintf(stdout, "avcodec reader is disabled.\n");
+    return RGY_TEST_SKIP;
+#endif //#if ENABLE_AVSW_READER
+}
+
+//100万フレームのストリームを登録し、表示順にfindptsで検索する時間をJSONで出力する
+RGY_TEST(bench_framepos_findpts) {
+#if ENABLE_AVSW_READER
+    static const int frames = 1000000;
+    tstring str = _T("{\n");
+    str += strsprintf(_T("  \"frames\": %d,\n"), frames);
+    str += _T("  \"results\": [\n");
+    bool first = true;
+    for (int missEvery : { 0, 100, 10 }) {
+        FramePosList list;
+        auto start = std::chrono::steady_clock::now();
+        framepos_check_replay(list, frames);
+        const double addSec = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        start = std::chrono::steady_clock::now();
+        RGY_TEST_EXPECT(framepos_check_findpts(list, frames, missEvery));
+        const double findSec = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        const int lookups = frames + ((missEvery > 0) ? frames / missEvery : 0);
+        str += (first) ? _T("") : _T(",\n");
+        str += strsprintf(_T("    { \"miss_every\": %d, \"add_ns_per_frame\": %.1f, \"findpts_ns_per_lookup\": %.1f }"),
+            missEvery, addSec * 1e9 / frames, findSec * 1e9 / lookups);
+        first = false;
+    }
+    str += _T("\n  ]\n");
+    str += _T("}\n");
+    _ftprintf(stdout, _T("%s"), str.c_str());
+    return RGY_TEST_PASS;
+#else
+    fprintf(stdout, "avcodec reader is disabled.\n");
+    return RGY_TEST_SKIP;
+#endif //#if ENABLE_AVSW_READER
+}
@@ -0,0 +1,286 @@
+﻿// -----------------------------------------------------------------------------------------
+// QSVEnc/NVEnc/VCEEnc by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2020 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <string>
+#include <sys/stat.h>
+#include <utime.h>
+#include "rgy_util.h"
+#include "rgy_hdr10plus.h"
+#include "rgy_test.h"
+
+//HDR10+ LLC形式のjson (値の範囲の上下限、BezierCurveDataの有無を含む)
+static const char *HDR10PLUS_TEST_JSON = R"json({
+  "JSONInfo": { "HDR10plusProfile": "B", "Version": "1.0" },
+  "SceneInfo": [
+    {
+      "BezierCurveData": { "Anchors": [ 102, 205, 307, 410, 512, 614, 717, 819, 922 ], "KneePointX": 17, "KneePointY": 64 },
+      "LuminanceParameters": {
+        "AverageRGB": 1037,
+        "LuminanceDistributions": {
+          "DistributionIndex": [ 1, 5, 10, 25, 50, 75, 90, 95, 99 ],
+          "DistributionValues": [ 0, 3, 64, 422, 1203, 2940, 8021, 12345, 30011 ]
+        },
+        "MaxScl": [ 40000, 35432, 28012 ]
+      },
+      "NumberOfWindows": 1,
+      "TargetedSystemDisplayMaximumLuminance": 400,
+      "SceneFrameIndex": 0, "SceneId": 0, "SequenceFrameIndex": 0
+    },
+    {
+      "BezierCurveData": {},
+      "LuminanceParameters": {
+        "AverageRGB": 0,
+        "LuminanceDistributions": { "DistributionIndex": [ 1, 50, 99 ], "DistributionValues": [ 7, 500, 99999 ] },
+        "MaxScl": [ 131071, 0, 1 ]
+      },
+      "NumberOfWindows": 1,
+      "TargetedSystemDisplayMaximumLuminance": 1000,
+      "SceneFrameIndex": 1, "SceneId": 0, "SequenceFrameIndex": 1
+    },
+    {
+      "LuminanceParameters": {
+        "AverageRGB": 65536,
+        "LuminanceDistributions": { "DistributionIndex": [], "DistributionValues": [] },
+        "MaxScl": [ 1, 2, 3 ]
+      },
+      "NumberOfWindows": 1,
+      "TargetedSystemDisplayMaximumLuminance": 0,
+      "SceneFrameIndex": 0, "SceneId": 1, "SequenceFrameIndex": 2
+    }
+  ]
+}
+)json";
+
+//上記のjsonをhdr10plus_gen (x265のmetadataFromJson) と同じビット配置で変換したペイロード
+static const std::vector<uint8_t> HDR10PLUS_TEST_PAYLOAD[] = {
+    {
+        0xb5, 0x00, 0x3c, 0x00, 0x01, 0x04, 0x01, 0x40, 0x00, 0x0c, 0x81, 0x38, 0x80, 0x8a, 0x68, 0x36,
+        0xb6, 0x01, 0x03, 0x64, 0x08, 0x00, 0x00, 0x28, 0x00, 0x0c, 0x50, 0x01, 0x00, 0xc8, 0x06, 0x99,
+        0x90, 0x12, 0xce, 0x58, 0x2d, 0xf2, 0xd0, 0x7d, 0x56, 0xf8, 0xc0, 0xe7, 0x19, 0xd4, 0xec, 0x00,
+        0x40, 0x44, 0x10, 0x24, 0x66, 0x33, 0x53, 0x36, 0x6a, 0x00, 0x99, 0xac, 0xdc, 0xcf, 0x9a, 0x00
+    },
+    {
+        0xb5, 0x00, 0x3c, 0x00, 0x01, 0x04, 0x01, 0x40, 0x00, 0x1f, 0x43, 0xff, 0xfe, 0x00, 0x00, 0x00,
+        0x00, 0x80, 0x00, 0x0c, 0x08, 0x00, 0x1d, 0x90, 0x07, 0xd3, 0x1e, 0x1a, 0x7c, 0x00, 0x00
+    },
+    {
+        0xb5, 0x00, 0x3c, 0x00, 0x01, 0x04, 0x01, 0x40, 0x00, 0x00, 0x00, 0x00, 0x02, 0x00, 0x02, 0x00,
+        0x01, 0xc0, 0x00, 0x00, 0x00, 0x00
+    },
+};
+
+static tstring hdr10plus_tmp_name() {
+    return strsprintf(_T("/tmp/rgy_hdr10plus_%d.json"), (int)getpid());
+}
+
+static bool hdr10plus_write(const tstring& filename, const std::string& data) {
+    FILE *fp = _tfopen(filename.c_str(), _T("wb"));
+    if (fp == nullptr) {
+        return false;
+    }
+    const bool ret = fwrite(data.data(), 1, data.size(), fp) == data.size();
+    fclose(fp);
+    return ret;
+}
+
+static bool hdr10plus_set_mtime(const tstring& filename, time_t mtime) {
+    struct utimbuf times;
+    times.actime = mtime;
+    times.modtime = mtime;
+    return utime(filename.c_str(), &times) == 0;
+}
+
+static time_t hdr10plus_get_mtime(const tstring& filename) {
+    struct stat st;
+    return (stat(filename.c_str(), &st) == 0) ? st.st_mtime : 0;
+}
+
+static void hdr10plus_remove(const tstring& filename) {
+    _tremove(filename.c_str());
+    _tremove((filename + RGYHDR10Plus::INDEX_FILE_EXT).c_str());
+}
+
+//ペイロードのtargeted_system_display_maximum_luminance (先頭から58bit目から27bit)
+static uint32_t hdr10plus_target_peak(const std::vector<uint8_t> *payload) {
+    uint32_t value = 0;
+    for (int i = 58; i < 58 + 27; i++) {
+        value = (value << 1) | ((payload->at(i >> 3) >> (7 - (i & 7))) & 1);
+    }
+    return value;
+}
+
+static bool hdr10plus_check_payload(RGYHDR10Plus& hdr10plus) {
+    if (hdr10plus.frameCount() != (int)_countof(HDR10PLUS_TEST_PAYLOAD)) {
+        return false;
+    }
+    //順不同に取得しても同じ内容になる
+    const int order[] = { 2, 0, 1, 1, 0 };
+    for (const auto iframe : order) {
+        const auto payload = hdr10plus.getData(iframe);
+        if (payload == nullptr || *payload != HDR10PLUS_TEST_PAYLOAD[iframe]) {
+            fprintf(stderr, "hdr10plus: payload mismatch at frame %d\n", iframe);
+            return false;
+        }
+    }
+    return hdr10plus.getData(-1) == nullptr && hdr10plus.getData(hdr10plus.frameCount()) == nullptr;
+}
+
+//jsonから生成したペイロードがhdr10plus_genの出力とbyte単位で一致すること
+RGY_TEST(hdr10plus_payload) {
+    const auto filename = hdr10plus_tmp_name();
+    hdr10plus_remove(filename);
+    RGY_TEST_EXPECT(hdr10plus_write(filename, HDR10PLUS_TEST_JSON));
+    bool ret = false;
+    {
+        RGYHDR10Plus hdr10plus;
+        ret = hdr10plus.init(filename, nullptr) == RGY_ERR_NONE
+            && hdr10plus_check_payload(hdr10plus);
+    }
+    hdr10plus_remove(filename);
+    RGY_TEST_EXPECT(ret);
+    return RGY_TEST_PASS;
+}
+
+//索引のキャッシュを読み込んだ場合も同じ内容となり、
+//jsonのサイズまたは更新時刻が変わった場合、キャッシュが壊れている場合は、jsonを読み直すこと
+RGY_TEST(hdr10plus_index) {
+    const auto filename = hdr10plus_tmp_name();
+    const auto indexFile = filename + RGYHDR10Plus::INDEX_FILE_EXT;
+    hdr10plus_remove(filename);
+    const std::string json = HDR10PLUS_TEST_JSON;
+    const std::string key = "\"TargetedSystemDisplayMaximumLuminance\": 400";
+    RGY_TEST_EXPECT(json.find(key) != std::string::npos);
+    auto json_peak = [&](const char *peak) {
+        auto str = json;
+        str.replace(str.find(key), key.length(), std::string("\"TargetedSystemDisplayMaximumLuminance\": ") + peak);
+        return str;
+    };
+    auto load_peak = [&](uint32_t *peak) {
+        RGYHDR10Plus hdr10plus;
+        if (hdr10plus.init(filename, nullptr) != RGY_ERR_NONE || hdr10plus.frameCount() != (int)_countof(HDR10PLUS_TEST_PAYLOAD)) {
+            return false;
+        }
+        *peak = hdr10plus_target_peak(hdr10plus.getData(0));
+        return true;
+    };
+
+    int error = 0;
+    //初回はjsonを解析して索引を書き出し、2回目は索引から同じ内容が得られる
+    RGY_TEST_EXPECT(hdr10plus_write(filename, json));
+    const time_t mtime = hdr10plus_get_mtime(filename) - 100;
+    RGY_TEST_EXPECT(hdr10plus_set_mtime(filename, mtime));
+    {
+        RGYHDR10Plus hdr10plus;
+        error += (hdr10plus.init(filename, nullptr) != RGY_ERR_NONE || !hdr10plus_check_payload(hdr10plus)) ? 1 : 0;
+    }
+    error += (hdr10plus_get_mtime(indexFile) == 0) ? 1 : 0;
+    {
+        RGYHDR10Plus hdr10plus;
+        error += (hdr10plus.init(filename, nullptr) != RGY_ERR_NONE || !hdr10plus_check_payload(hdr10plus)) ? 1 : 0;
+    }
+
+    //サイズも更新時刻も同じなら、内容が変わっても索引が使われる (索引が使われていることの確認)
+    uint32_t peak = 0;
+    RGY_TEST_EXPECT(hdr10plus_write(filename, json_peak("401")) && hdr10plus_set_mtime(filename, mtime));
+    error += (!load_peak(&peak) || peak != 400) ? 1 : 0;
+
+    //更新時刻が変われば読み直す
+    RGY_TEST_EXPECT(hdr10plus_set_mtime(filename, mtime + 10));
+    error += (!load_peak(&peak) || peak != 401) ? 1 : 0;
+
+    //サイズが変われば、更新時刻が同じでも読み直す
+    RGY_TEST_EXPECT(hdr10plus_write(filename, json_peak("4000")) && hdr10plus_set_mtime(filename, mtime + 10));
+    error += (!load_peak(&peak) || peak != 4000) ? 1 : 0;
+    error += (!load_peak(&peak) || peak != 4000) ? 1 : 0;
+
+    //索引が壊れていれば (途中で切れている)、jsonを読み直して索引を作り直す
+    RGY_TEST_EXPECT(hdr10plus_write(filename, json_peak("4001")) && hdr10plus_set_mtime(filename, mtime + 20));
+    {
+        //一度読み込んで索引を作成してから、その末尾を切り詰める
+        error += (!load_peak(&peak) || peak != 4001) ? 1 : 0;
+        RGY_TEST_EXPECT(truncate(indexFile.c_str(), 40) == 0);
+        error += (!load_peak(&peak) || peak != 4001) ? 1 : 0;
+        struct stat st;
+        error += (stat(indexFile.c_str(), &st) != 0 || st.st_size <= 40) ? 1 : 0;
+    }
+    hdr10plus_remove(filename);
+    RGY_TEST_EXPECT(error == 0);
+    return RGY_TEST_PASS;
+}
+
+//不正なjsonはエラーとし、索引も作成しないこと
+RGY_TEST(hdr10plus_malformed) {
+    const auto filename = hdr10plus_tmp_name();
+    const auto indexFile = filename + RGYHDR10Plus::INDEX_FILE_EXT;
+    const std::string json = HDR10PLUS_TEST_JSON;
+    auto json_replace = [&](const char *from, const char *to) {
+        auto str = json;
+        const auto pos = str.find(from);
+        if (pos != std::string::npos) {
+            str.replace(pos, strlen(from), to);
+        }
+        return str;
+    };
+    const std::pair<const char *, std::string> malformed[] = {
+        { "empty",                 "" },
+        { "not object",            "[]" },
+        { "truncated",             json.substr(0, json.length() / 2) },
+        { "no SceneInfo",          json_replace("\"SceneInfo\"", "\"Scenes\"") },
+        { "trailing comma",        json_replace("\"MaxScl\": [ 1, 2, 3 ]", "\"MaxScl\": [ 1, 2, 3, ]") },
+        { "unterminated string",   json_replace("\"NumberOfWindows\"", "\"NumberOfWindows") },
+        { "invalid value",         json_replace("\"AverageRGB\": 1037", "\"AverageRGB\": 10x37") },
+        { "invalid escape",        json_replace("\"HDR10plusProfile\": \"B\"", "\"HDR10plusProfile\": \"\\u00G0\"") },
+        { "missing peak",          json_replace("\"TargetedSystemDisplayMaximumLuminance\": 400", "\"TargetedSystemDisplayMaximumLuminanceX\": 400") },
+        { "MaxScl count",          json_replace("\"MaxScl\": [ 40000, 35432, 28012 ]", "\"MaxScl\": [ 40000, 35432 ]") },
+        { "MaxScl type",           json_replace("\"MaxScl\": [ 40000, 35432, 28012 ]", "\"MaxScl\": [ 40000, \"35432\", 28012 ]") },
+        { "distribution count",    json_replace("\"DistributionValues\": [ 7, 500, 99999 ]", "\"DistributionValues\": [ 7, 500 ]") },
+        { "bezier without knee",   json_replace("\"KneePointX\": 17, ", "") },
+        { "nested too deeply",     "{ \"a\": " + std::string(100, '[') + std::string(100, ']') + ", \"SceneInfo\": [] }" },
+        { "garbage after object",  json + "}" },
+    };
+    int error = 0;
+    for (const auto& test : malformed) {
+        hdr10plus_remove(filename);
+        if (!hdr10plus_write(filename, test.second)) {
+            error++;
+            continue;
+        }
+        RGYHDR10Plus hdr10plus;
+        const auto err = hdr10plus.init(filename, nullptr);
+        if (err != RGY_ERR_INVALID_FORMAT || hdr10plus.getData(0) != nullptr || hdr10plus_get_mtime(indexFile) != 0) {
+            fprintf(stderr, "hdr10plus: %s: not rejected (%s)\n", test.first, tchar_to_string(get_err_mes(err)).c_str());
+            error++;
+        }
+    }
+    hdr10plus_remove(filename);
+    RGY_TEST_EXPECT(error == 0);
+    return RGY_TEST_PASS;
+}
@@ -0,0 +1,527 @@
+﻿// -----------------------------------------------------------------------------------------
+// QSVEnc/NVEnc/VCEEnc by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2020 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include "rgy_version.h"
+#include "rgy_util.h"
+#include "rgy_test.h"
+#if ENABLE_AVISYNTH_READER
+#include "rgy_input_avs.h"
+
+//AviSynthを使わずに先読みを確認するための仮のクリップ
+//get_frameで要求されたフレームを、指定した処理時間の後に返す
+struct AvsCheckClip {
+    AVS_VideoInfo vi;
+    int latencyUs, jitterUs;
+    int errorFrame;
+    const char *error;               //直前の呼び出しのエラー
+    std::atomic<int> calls;          //実行中のAviSynthの呼び出しの数
+    std::atomic<int> callsMax;
+    std::atomic<int> liveFrames;     //解放されていないフレームの数
+    std::atomic<int> maxFrameRequested;
+
+    AvsCheckClip(int width, int height, int frames, int latency, int jitter, int errFrame) :
+        vi(), latencyUs(latency), jitterUs(jitter), errorFrame(errFrame), error(nullptr),
+        calls(0), callsMax(0), liveFrames(0), maxFrameRequested(-1) {
+        memset(&vi, 0, sizeof(vi));
+        vi.width = width;
+        vi.height = height;
+        vi.fps_numerator = 30000;
+        vi.fps_denominator = 1001;
+        vi.num_frames = frames;
+        vi.pixel_type = AVS_CS_YV12;
+        vi.audio_samples_per_second = 48000;
+        vi.sample_type = AVS_SAMPLE_INT16;
+        vi.num_audio_samples = (int64_t)frames * 48000 * 1001 / 30000;
+        vi.nchannels = 2;
+    }
+};
+
+//AviSynthの呼び出しが同時に行われていないかを確認する
+struct AvsCheckCall {
+    AvsCheckClip *clip;
+    AvsCheckCall(AvsCheckClip *c) : clip(c) {
+        const int calls = ++clip->calls;
+        int callsMax = clip->callsMax;
+        while (calls > callsMax && !clip->callsMax.compare_exchange_weak(callsMax, calls)) {}
+    }
+    ~AvsCheckCall() {
+        clip->calls--;
+    }
+};
+
+struct AvsCheckFrame {
+    AvsCheckClip *clip;
+    int stride[3];
+    std::vector<uint8_t> plane[3];
+};
+
+static uint8_t avs_check_pixel(int n, int iplane, int x, int y) {
+    return (uint8_t)(n * 7 + iplane * 61 + x * 3 + y * 5);
+}
+
+static int avs_check_plane_idx(int plane) {
+    switch (plane) {
+    case AVS_PLANAR_U: return 1;
+    case AVS_PLANAR_V: return 2;
+    default:           return 0;
+    }
+}
+
+static AVS_VideoFrame *AVSC_CC avs_check_get_frame(AVS_Clip *p, int n) {
+    auto clip = (AvsCheckClip *)p;
+    AvsCheckCall call(clip);
+    //フレームごとに処理時間を変える
+    const uint32_t hash = (uint32_t)n * 2654435761u;
+    std::this_thread::sleep_for(std::chrono::microseconds(clip->latencyUs + ((clip->jitterUs > 0) ? (int)((hash >> 8) % (uint32_t)clip->jitterUs) : 0)));
+    int maxFrameRequested = clip->maxFrameRequested;
+    while (n > maxFrameRequested && !clip->maxFrameRequested.compare_exchange_weak(maxFrameRequested, n)) {}
+    if (n == clip->errorFrame) {
+        clip->error = "check error";
+        return nullptr;
+    }
+    clip->error = nullptr;
+    auto frame = new AvsCheckFrame();
+    frame->clip = clip;
+    for (int iplane = 0; iplane < 3; iplane++) {
+        const int planeWidth  = (iplane) ? clip->vi.width  >> 1 : clip->vi.width;
+        const int planeHeight = (iplane) ? clip->vi.height >> 1 : clip->vi.height;
+        frame->stride[iplane] = ALIGN(planeWidth, 64);
+        frame->plane[iplane].resize((size_t)frame->stride[iplane] * planeHeight);
+        for (int y = 0; y < planeHeight; y++) {
+            for (int x = 0; x < planeWidth; x++) {
+                frame->plane[iplane][(size_t)y * frame->stride[iplane] + x] = avs_check_pixel(n, iplane, x, y);
+            }
+        }
+    }
+    clip->liveFrames++;
+    return (AVS_VideoFrame *)frame;
+}
+static void AVSC_CC avs_check_release_video_frame(AVS_VideoFrame *f) {
+    auto frame = (AvsCheckFrame *)f;
+    AvsCheckCall call(frame->clip);
+    frame->clip->liveFrames--;
+    delete frame;
+}
+static const char *AVSC_CC avs_check_clip_get_error(AVS_Clip *p) {
+    auto clip = (AvsCheckClip *)p;
+    AvsCheckCall call(clip);
+    return clip->error;
+}
+static int AVSC_CC avs_check_get_pitch_p(const AVS_VideoFrame *f, int plane) {
+    return ((const AvsCheckFrame *)f)->stride[avs_check_plane_idx(plane)];
+}
+static const uint8_t *AVSC_CC avs_check_get_read_ptr_p(const AVS_VideoFrame *f, int plane) {
+    return ((const AvsCheckFrame *)f)->plane[avs_check_plane_idx(plane)].data();
+}
+#if ENABLE_AVSW_READER
+static int16_t avs_check_sample(int64_t sample, int ch) {
+    return (int16_t)(sample * 3 + ch * 1000);
+}
+static int AVSC_CC avs_check_get_audio(AVS_Clip *p, void *buf, int64_t start, int64_t count) {
+    auto clip = (AvsCheckClip *)p;
+    AvsCheckCall call(clip);
+    int16_t *ptr = (int16_t *)buf;
+    for (int64_t i = 0; i < count; i++) {
+        for (int ch = 0; ch < clip->vi.nchannels; ch++) {
+            *ptr++ = avs_check_sample(start + i, ch);
+        }
+    }
+    clip->error = nullptr;
+    return 0;
+}
+#endif //#if ENABLE_AVSW_READER
+
+class RGYInputAvsCheck : public RGYInputAvs {
+public:
+    RGYInputAvsCheck() : RGYInputAvs() {};
+    virtual ~RGYInputAvsCheck() {
+        Close();
+    }
+    RGY_ERR open(AvsCheckClip *clip, int prefetch, int trimMax, bool audio, shared_ptr<EncodeStatus> status) {
+        m_encSatusInfo = status;
+        m_sAvisynth.f_get_frame = (func_avs_get_frame)avs_check_get_frame;
+        m_sAvisynth.f_release_video_frame = (func_avs_release_video_frame)avs_check_release_video_frame;
+        m_sAvisynth.f_clip_get_error = (func_avs_clip_get_error)avs_check_clip_get_error;
+        m_sAvisynth.f_get_pitch_p = (func_avs_get_pitch_p)avs_check_get_pitch_p;
+        m_sAvisynth.f_get_read_ptr_p = (func_avs_get_read_ptr_p)avs_check_get_read_ptr_p;
+        m_sAVSclip = (AVS_Clip *)clip;
+        m_sAVSinfo = &clip->vi;
+        m_inputVideoInfo.srcWidth = clip->vi.width;
+        m_inputVideoInfo.srcHeight = clip->vi.height;
+        m_inputVideoInfo.fpsN = clip->vi.fps_numerator;
+        m_inputVideoInfo.fpsD = clip->vi.fps_denominator;
+        m_inputVideoInfo.frames = clip->vi.num_frames;
+        m_inputVideoInfo.csp = RGY_CSP_NV12;
+        m_inputVideoInfo.picstruct = RGY_PICSTRUCT_FRAME;
+        m_inputVideoInfo.crop = initCrop();
+        m_inputCsp = RGY_CSP_YV12;
+        m_convert = std::make_unique<RGYConvertCSP>(1);
+        if (m_convert->getFunc(m_inputCsp, m_inputVideoInfo.csp, false, get_availableSIMD()) == nullptr) {
+            return RGY_ERR_UNSUPPORTED;
+        }
+        if (trimMax >= 0) {
+            sTrimParam trim;
+            trim.list.push_back({ 0, trimMax });
+            trim.offset = 0;
+            SetTrimParam(trim);
+        }
+#if ENABLE_AVSW_READER
+        if (audio) {
+            m_sAvisynth.f_get_audio = (func_avs_get_audio)avs_check_get_audio;
+            auto err = InitAudio();
+            if (err != RGY_ERR_NONE) {
+                return err;
+            }
+        }
+#else
+        UNREFERENCED_PARAMETER(audio);
+#endif //#if ENABLE_AVSW_READER
+        initPrefetch(prefetch);
+        return RGY_ERR_NONE;
+    }
+    virtual void Close() override {
+        stopPrefetch();
+        m_sAVSclip = nullptr;
+        m_sAVSinfo = nullptr;
+        memset(&m_sAvisynth, 0, sizeof(m_sAvisynth));
+        RGYInputAvs::Close();
+    }
+    int depth() const { return m_prefetchDepth; }
+    int stalls() const { return m_prefetchStalls; }
+};
+
+struct AvsCheckResult {
+    int frames;
+    int depth;
+    int stalls;
+    int callsMax;
+    int maxFrameRequested;
+    int64_t audioSamples;
+    int mismatch;
+    double fps;
+};
+
+//closeAt: そのフレーム数を読んだところで閉じる (-1で最後まで)
+//trimMax: trimの最後のフレーム (-1でtrimなし)
+static AvsCheckResult avs_check_run(int frames, int width, int height, int latencyUs, int jitterUs, int consumeUs,
+    int errorFrame, int closeAt, int trimMax, int prefetch, bool audio, bool verify) {
+    AvsCheckResult result = { 0 };
+    AvsCheckClip clip(width, height, frames, latencyUs, jitterUs, errorFrame);
+    {
+        auto status = std::make_shared<EncodeStatus>();
+        RGYInputAvsCheck reader;
+        if (reader.open(&clip, prefetch, trimMax, audio, status) != RGY_ERR_NONE) {
+            result.mismatch++;
+            return result;
+        }
+        FrameInfo frameInfo;
+        frameInfo.csp = RGY_CSP_NV12;
+        frameInfo.width = width;
+        frameInfo.height = height;
+        frameInfo.pitch = ALIGN(width, 64);
+        std::vector<uint8_t> buf((size_t)frameInfo.pitch * height * 3 / 2);
+        frameInfo.ptr = buf.data();
+        RGYFrame surface(frameInfo);
+
+#if ENABLE_AVSW_READER
+        //エンコードのループと同じく、フレームの読み込み前に音声を取得し、途切れずに届いていることを確認する
+        auto checkAudio = [&]() {
+            auto pkts = reader.GetStreamDataPackets(result.frames);
+            for (auto& pkt : pkts) {
+                int diff = (pkt.pts != result.audioSamples) ? 1 : 0;
+                const int16_t *ptr = (const int16_t *)pkt.data;
+                for (int64_t i = 0; i < pkt.duration; i++) {
+                    for (int ch = 0; ch < clip.vi.nchannels; ch++) {
+                        diff |= (*ptr++ != avs_check_sample(pkt.pts + i, ch)) ? 1 : 0;
+                    }
+                }
+                result.mismatch += diff;
+                result.audioSamples += pkt.duration;
+                av_packet_unref(&pkt);
+            }
+        };
+#endif //#if ENABLE_AVSW_READER
+
+        const int expectedFrames = (trimMax >= 0) ? (std::min)(frames, trimMax + TRIM_OVERREAD_FRAMES + 1) : frames;
+        const auto tmStart = std::chrono::steady_clock::now();
+        for (;;) {
+            if (closeAt >= 0 && result.frames >= closeAt) {
+                break;
+            }
+#if ENABLE_AVSW_READER
+            checkAudio();
+#endif //#if ENABLE_AVSW_READER
+            const auto err = reader.LoadNextFrame(&surface);
+            if (err != RGY_ERR_NONE) {
+                //エラーとなるべきフレームでのみエラーとなり、それ以外は必要な範囲を最後まで読めること
+                const bool expected = (errorFrame >= 0) ? (err != RGY_ERR_MORE_DATA && result.frames == errorFrame) : (err == RGY_ERR_MORE_DATA && result.frames == expectedFrames);
+                result.mismatch += (expected) ? 0 : 1;
+                break;
+            }
+            if (verify) {
+                const int n = result.frames;
+                int diff = 0;
+                for (int y = 0; y < height; y++) {
+                    const uint8_t *ptrY = buf.data() + (size_t)y * frameInfo.pitch;
+                    for (int x = 0; x < width; x++) {
+                        diff |= ptrY[x] ^ avs_check_pixel(n, 0, x, y);
+                    }
+                }
+                for (int y = 0; y < height / 2; y++) {
+                    const uint8_t *ptrUV = buf.data() + (size_t)(height + y) * frameInfo.pitch;
+                    for (int x = 0; x < width / 2; x++) {
+                        diff |= ptrUV[x * 2 + 0] ^ avs_check_pixel(n, 1, x, y);
+                        diff |= ptrUV[x * 2 + 1] ^ avs_check_pixel(n, 2, x, y);
+                    }
+                }
+                result.mismatch += (diff) ? 1 : 0;
+            }
+            result.frames++;
+            if (consumeUs > 0) {
+                //エンコーダへの投入にかかる時間の代わり
+                std::this_thread::sleep_for(std::chrono::microseconds(consumeUs));
+            }
+        }
+        const double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - tmStart).count();
+        result.fps = result.frames / (std::max)(elapsed, 1e-9);
+#if ENABLE_AVSW_READER
+        checkAudio();
+        if (audio) {
+            //返したフレームの分の音声が過不足なく届いていること
+            const auto expectedSamples = (std::min<int64_t>)(clip.vi.num_audio_samples,
+                av_rescale_q(result.frames, av_make_q(clip.vi.audio_samples_per_second, 1), av_make_q(clip.vi.fps_numerator, clip.vi.fps_denominator)));
+            result.mismatch += (result.audioSamples != expectedSamples) ? 1 : 0;
+        }
+#endif //#if ENABLE_AVSW_READER
+        result.depth = reader.depth();
+        result.stalls = reader.stalls();
+        reader.Close();
+        //trimで不要となる範囲のフレームを読んでいないこと
+        if (clip.maxFrameRequested >= expectedFrames) {
+            result.mismatch++;
+        }
+    }
+    result.callsMax = clip.callsMax;
+    result.maxFrameRequested = clip.maxFrameRequested;
+    //AviSynthの呼び出しが同時に行われていないこと
+    result.mismatch += (result.callsMax != 1) ? 1 : 0;
+    //すべてのフレームが解放されていること
+    result.mismatch += (clip.liveFrames != 0) ? 1 : 0;
+    return result;
+}
+
+#endif //#if ENABLE_AVISYNTH_READER
+
+//先読みしたフレームと音声が、エンコーダがスクリプトより遅い場合、スクリプトがエラーを返す場合、
+//trimで範囲を指定した場合、先読み中に閉じた場合も含め、正しい順序・内容で渡されるか、
+//またAviSynthが複数のスレッドから同時に呼ばれないか
+RGY_TEST(avs_prefetch) {
+#if ENABLE_AVISYNTH_READER
+    struct test_result {
+        const char *name;
+        AvsCheckResult result;
+    };
+    const int frames = 300;
+    const test_result results[] = {
+        { "prefetch",       avs_check_run(frames, 320, 180, 1000, 2000,  200,  -1, -1,  -1, 4, true, true) },
+        { "prefetch_1",     avs_check_run(frames, 320, 180, 1000, 2000,  200,  -1, -1,  -1, 1, true, true) },
+        { "no_prefetch",    avs_check_run(frames, 320, 180, 1000, 2000,  200,  -1, -1,  -1, 0, true, true) },
+        { "slow_consumer",  avs_check_run(frames, 320, 180,  200,  400, 2000,  -1, -1,  -1, 4, true, true) },
+        { "script_error",   avs_check_run(frames, 320, 180,  200,  400,    0, 100, -1,  -1, 4, true, true) },
+        { "trim",           avs_check_run(frames, 320, 180,  200,  400,    0,  -1, -1,  99, 4, true, true) },
+        { "early_close",    avs_check_run(frames, 320, 180, 1000, 2000,    0,  -1, 50,  -1, 4, true, true) },
+    };
+    int mismatch = 0;
+    for (const auto& result : results) {
+        const auto& r = result.result;
+        if (r.mismatch) {
+            fprintf(stderr, "%s: %d mismatch, frames %d, depth %d, stalls %d, max frame requested %d, avs calls max %d, audio samples %lld\n",
+                result.name, r.mismatch, r.frames, r.depth, r.stalls, r.maxFrameRequested, r.callsMax, (long long)r.audioSamples);
+        }
+        mismatch += r.mismatch;
+    }
+    return (mismatch) ? RGY_TEST_FAIL : RGY_TEST_PASS;
+#else
+    fprintf(stderr, "avs reader is not available.\n");
+    return RGY_TEST_SKIP;
+#endif //#if ENABLE_AVISYNTH_READER
+}
+
+//スクリプトの処理時間とエンコーダへの投入の時間が同程度の場合に、先読みの有無での処理速度をJSONで出力する
+RGY_TEST(bench_avs_prefetch) {
+#if ENABLE_AVISYNTH_READER
+    const int frames = 200;
+    const auto sync = avs_check_run(frames, 640, 360, 2000, 4000, 3000, -1, -1, -1, 0, true, false);
+    const auto prefetch = avs_check_run(frames, 640, 360, 2000, 4000, 3000, -1, -1, -1, 4, true, false);
+    tstring str = _T("{\n");
+    str += _T("  \"bench\": [\n");
+    str += strsprintf(_T("    { \"impl\": \"no_prefetch\", \"fps\": %.1f },\n"), sync.fps);
+    str += strsprintf(_T("    { \"impl\": \"prefetch\", \"depth\": %d, \"stalls\": %d, \"fps\": %.1f }\n"), prefetch.depth, prefetch.stalls, prefetch.fps);
+    str += _T("  ]\n");
+    str += _T("}\n");
+    _ftprintf(stdout, _T("%s"), str.c_str());
+    return (sync.mismatch + prefetch.mismatch) ? RGY_TEST_FAIL : RGY_TEST_PASS;
+#else
+    fprintf(stderr, "avs reader is not available.\n");
+    return RGY_TEST_SKIP;
+#endif //#if ENABLE_AVISYNTH_READER
+}
+
+//実際のAviSynthでBlankClipを読み込み、先読みしたフレームと音声が正しく渡されるか
+//(リーダーが読み込むAviSynthのライブラリがなければスキップする)
+RGY_TEST(avs_blankclip) {
+#if ENABLE_AVISYNTH_READER
+    bool dllFound = false;
+    for (const auto dllName : RGYInputAvs::dllNames()) {
+        auto hModule = RGY_LOAD_LIBRARY(dllName);
+        if (hModule) {
+            RGY_FREE_LIBRARY(hModule);
+            dllFound = true;
+            break;
+        }
+        fprintf(stderr, "%s is not available.\n", tchar_to_string(dllName).c_str());
+    }
+    if (!dllFound) {
+        return RGY_TEST_SKIP;
+    }
+
+    const int frames = 60;
+    const int width = 320, height = 180;
+    const uint8_t colorY = 0x5a, colorU = 0x6e, colorV = 0x8c;
+    const tstring filename = strsprintf(_T("/tmp/rgy_avs_blankclip_%d.avs"), (int)getpid());
+    {
+        FILE *fp = _tfopen(filename.c_str(), _T("w"));
+        if (fp == nullptr) {
+            fprintf(stderr, "failed to create %s.\n", tchar_to_string(filename).c_str());
+            return RGY_TEST_FAIL;
+        }
+        fprintf(fp, "BlankClip(length=%d, width=%d, height=%d, pixel_type=\"YV12\", fps=30000, fps_denominator=1001, "
+            "audio_rate=48000, stereo=true, sixteen_bit=true, color_yuv=$%02X%02X%02X)\n",
+            frames, width, height, colorY, colorU, colorV);
+        fclose(fp);
+    }
+
+    int mismatch = 0;
+    int framesRead = 0;
+    int64_t audioSamples = 0;
+    {
+        auto status = std::make_shared<EncodeStatus>();
+        std::unique_ptr<RGYInput> reader(new RGYInputAvs());
+        RGYInputPrm base;
+        base.threadCsp = 0;
+        base.simdCsp = (uint32_t)-1;
+        RGYInputAvsPrm prm(base);
+        prm.readAudio = ENABLE_AVSW_READER != 0;
+        prm.prefetch = 4;
+        VideoInfo inputInfo;
+        inputInfo.csp = RGY_CSP_NV12;
+        auto err = reader->Init(filename.c_str(), &inputInfo, &prm, std::make_shared<RGYLog>(nullptr, RGY_LOG_QUIET), status);
+        if (err != RGY_ERR_NONE) {
+            fprintf(stderr, "failed to open %s: %s.\n", tchar_to_string(filename).c_str(), tchar_to_string(get_err_mes(err)).c_str());
+            _tremove(filename.c_str());
+            return RGY_TEST_FAIL;
+        }
+        mismatch += (inputInfo.srcWidth != width || inputInfo.srcHeight != height || inputInfo.frames != frames || inputInfo.csp != RGY_CSP_NV12) ? 1 : 0;
+
+        FrameInfo frameInfo;
+        frameInfo.csp = RGY_CSP_NV12;
+        frameInfo.width = width;
+        frameInfo.height = height;
+        frameInfo.pitch = ALIGN(width, 64);
+        std::vector<uint8_t> buf((size_t)frameInfo.pitch * height * 3 / 2);
+        frameInfo.ptr = buf.data();
+        RGYFrame surface(frameInfo);
+
+#if ENABLE_AVSW_READER
+        //BlankClipの音声は無音で、途切れずに届いていること
+        auto checkAudio = [&]() {
+            auto pkts = reader->GetStreamDataPackets(framesRead);
+            for (auto& pkt : pkts) {
+                int diff = (pkt.pts != audioSamples) ? 1 : 0;
+                const int16_t *ptr = (const int16_t *)pkt.data;
+                for (int64_t i = 0; i < pkt.duration * 2; i++) {
+                    diff |= (ptr[i] != 0) ? 1 : 0;
+                }
+                mismatch += diff;
+                audioSamples += pkt.duration;
+                av_packet_unref(&pkt);
+            }
+        };
+#endif //#if ENABLE_AVSW_READER
+        for (;;) {
+#if ENABLE_AVSW_READER
+            checkAudio();
+#endif //#if ENABLE_AVSW_READER
+            err = reader->LoadNextFrame(&surface);
+            if (err != RGY_ERR_NONE) {
+                mismatch += (err == RGY_ERR_MORE_DATA && framesRead == frames) ? 0 : 1;
+                break;
+            }
+            int diff = 0;
+            for (int y = 0; y < height; y++) {
+                const uint8_t *ptrY = buf.data() + (size_t)y * frameInfo.pitch;
+                for (int x = 0; x < width; x++) {
+                    diff |= ptrY[x] ^ colorY;
+                }
+            }
+            for (int y = 0; y < height / 2; y++) {
+                const uint8_t *ptrUV = buf.data() + (size_t)(height + y) * frameInfo.pitch;
+                for (int x = 0; x < width / 2; x++) {
+                    diff |= ptrUV[x * 2 + 0] ^ colorU;
+                    diff |= ptrUV[x * 2 + 1] ^ colorV;
+                }
+            }
+            mismatch += (diff) ? 1 : 0;
+            framesRead++;
+        }
+#if ENABLE_AVSW_READER
+        checkAudio();
+        //すべてのフレームの分の音声が過不足なく届いていること
+        mismatch += (audioSamples != av_rescale(frames, 48000 * 1001, 30000)) ? 1 : 0;
+#endif //#if ENABLE_AVSW_READER
+        reader->Close();
+    }
+    _tremove(filename.c_str());
+    if (mismatch) {
+        fprintf(stderr, "%d mismatch, frames %d, audio samples %lld\n", mismatch, framesRead, (long long)audioSamples);
+    }
+    return (mismatch) ? RGY_TEST_FAIL : RGY_TEST_PASS;
+#else
+    fprintf(stderr, "avs reader is not available.\n");
+    return RGY_TEST_SKIP;
+#endif //#if ENABLE_AVISYNTH_READER
+}
@@ -0,0 +1,240 @@
+﻿// -----------------------------------------------------------------------------------------
+// QSVEnc/NVEnc/VCEEnc by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2020 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <future>
+#include <chrono>
+#include "rgy_version.h"
+#include "rgy_util.h"
+#include "rgy_test.h"
+#if ENABLE_RAW_READER
+#include "rgy_input_raw.h"
+
+static const int RAW_TEST_WIDTH = 64;
+static const int RAW_TEST_HEIGHT = 36;
+
+static uint8_t raw_test_y(int frame, int x, int y) { return (uint8_t)(x + y * 3 + frame * 7); }
+static uint8_t raw_test_u(int frame, int x, int y) { return (uint8_t)(x * 5 + y + frame * 11); }
+static uint8_t raw_test_v(int frame, int x, int y) { return (uint8_t)(x + y * 9 + frame * 13); }
+
+//yv12のy4mを作成する (partialBytes > 0なら、最後に途中で切れたフレームを付け加える)
+static std::vector<uint8_t> raw_test_y4m(int frames, int partialBytes) {
+    const int w = RAW_TEST_WIDTH, h = RAW_TEST_HEIGHT;
+    std::string header = strsprintf("YUV4MPEG2 W%d H%d F30000:1001 Ip A1:1 C420jpeg\n", w, h);
+    std::vector<uint8_t> data(header.begin(), header.end());
+    for (int i = 0; i < frames + ((partialBytes > 0) ? 1 : 0); i++) {
+        std::vector<uint8_t> frame;
+        const char *frameHeader = "FRAME\n";
+        frame.insert(frame.end(), frameHeader, frameHeader + strlen(frameHeader));
+        for (int y = 0; y < h; y++) {
+            for (int x = 0; x < w; x++) {
+                frame.push_back(raw_test_y(i, x, y));
+            }
+        }
+        for (int y = 0; y < h / 2; y++) {
+            for (int x = 0; x < w / 2; x++) {
+                frame.push_back(raw_test_u(i, x, y));
+            }
+        }
+        for (int y = 0; y < h / 2; y++) {
+            for (int x = 0; x < w / 2; x++) {
+                frame.push_back(raw_test_v(i, x, y));
+            }
+        }
+        if (i == frames) {
+            frame.resize(partialBytes);
+        }
+        data.insert(data.end(), frame.begin(), frame.end());
+    }
+    return data;
+}
+
+struct RawTestReader {
+    std::unique_ptr<RGYInput> reader;
+    FrameInfo frameInfo;
+    std::vector<uint8_t> buf;
+    std::unique_ptr<RGYFrame> surface;
+
+    RGY_ERR open(const tstring& filename) {
+        reader.reset(new RGYInputRaw());
+        RGYInputPrm prm;
+        prm.threadCsp = 1;
+        prm.simdCsp = (uint32_t)-1;
+        VideoInfo inputInfo;
+        inputInfo.type = RGY_INPUT_FMT_Y4M;
+        inputInfo.csp = RGY_CSP_NV12;
+        auto err = reader->Init(filename.c_str(), &inputInfo, &prm, std::make_shared<RGYLog>(nullptr, RGY_LOG_QUIET), std::make_shared<EncodeStatus>());
+        if (err != RGY_ERR_NONE) {
+            return err;
+        }
+        if (inputInfo.srcWidth != RAW_TEST_WIDTH || inputInfo.srcHeight != RAW_TEST_HEIGHT || inputInfo.csp != RGY_CSP_NV12) {
+            return RGY_ERR_INVALID_FORMAT;
+        }
+        frameInfo.csp = RGY_CSP_NV12;
+        frameInfo.width = RAW_TEST_WIDTH;
+        frameInfo.height = RAW_TEST_HEIGHT;
+        frameInfo.pitch = ALIGN(RAW_TEST_WIDTH, 64);
+        buf.resize((size_t)frameInfo.pitch * RAW_TEST_HEIGHT * 3 / 2);
+        frameInfo.ptr = buf.data();
+        surface.reset(new RGYFrame(frameInfo));
+        return RGY_ERR_NONE;
+    }
+    //1フレーム読み込み、frameの内容に一致するか確認する
+    RGY_ERR read(int frame, int *mismatch) {
+        const auto err = reader->LoadNextFrame(surface.get());
+        if (err != RGY_ERR_NONE) {
+            return err;
+        }
+        int diff = 0;
+        for (int y = 0; y < RAW_TEST_HEIGHT; y++) {
+            const uint8_t *ptrY = buf.data() + (size_t)y * frameInfo.pitch;
+            for (int x = 0; x < RAW_TEST_WIDTH; x++) {
+                diff |= ptrY[x] ^ raw_test_y(frame, x, y);
+            }
+        }
+        for (int y = 0; y < RAW_TEST_HEIGHT / 2; y++) {
+            const uint8_t *ptrUV = buf.data() + (size_t)(RAW_TEST_HEIGHT + y) * frameInfo.pitch;
+            for (int x = 0; x < RAW_TEST_WIDTH / 2; x++) {
+                diff |= ptrUV[x * 2 + 0] ^ raw_test_u(frame, x, y);
+                diff |= ptrUV[x * 2 + 1] ^ raw_test_v(frame, x, y);
+            }
+        }
+        *mismatch += (diff) ? 1 : 0;
+        return RGY_ERR_NONE;
+    }
+    //すべてのフレームを読み、その後はEOFが返り続けること
+    int readAll(int frames) {
+        int mismatch = 0;
+        for (int i = 0; i < frames; i++) {
+            const auto err = read(i, &mismatch);
+            if (err != RGY_ERR_NONE) {
+                fprintf(stderr, "frame %d: %s.\n", i, tchar_to_string(get_err_mes(err)).c_str());
+                return mismatch + 1;
+            }
+        }
+        for (int i = 0; i < 2; i++) {
+            mismatch += (reader->LoadNextFrame(surface.get()) != RGY_ERR_MORE_DATA) ? 1 : 0;
+        }
+        return mismatch;
+    }
+};
+
+//通常のファイルは、ファイルをマップして読み込む
+RGY_TEST(raw_read_file) {
+    int mismatch = 0;
+    for (int partial : { 0, 100 }) {
+        const int frames = 12;
+        const auto data = raw_test_y4m(frames, partial);
+        const tstring filename = strsprintf(_T("/tmp/rgy_raw_read_%d.y4m"), (int)getpid());
+        FILE *fp = _tfopen(filename.c_str(), _T("wb"));
+        RGY_TEST_EXPECT(fp != nullptr);
+        RGY_TEST_EXPECT(fwrite(data.data(), 1, data.size(), fp) == data.size());
+        fclose(fp);
+
+        RawTestReader reader;
+        const auto err = reader.open(filename);
+        if (err != RGY_ERR_NONE) {
+            fprintf(stderr, "failed to open %s: %s.\n", tchar_to_string(filename).c_str(), tchar_to_string(get_err_mes(err)).c_str());
+            mismatch++;
+        } else {
+            mismatch += reader.readAll(frames);
+            reader.reader->Close();
+        }
+        _tremove(filename.c_str());
+    }
+    return (mismatch) ? RGY_TEST_FAIL : RGY_TEST_PASS;
+}
+
+//パイプは先読みスレッドで読み込み、途中で切れたフレームはEOFとして扱う
+RGY_TEST(raw_read_pipe) {
+    int mismatch = 0;
+    for (int partial : { 0, 100 }) {
+        const int frames = 12;
+        const auto data = raw_test_y4m(frames, partial);
+        int fds[2] = { -1, -1 };
+        RGY_TEST_EXPECT(pipe(fds) == 0);
+        //少しずつ書き込んで、先読みスレッドが読み込み待ちになるようにする
+        std::thread writer([&]() {
+            for (size_t pos = 0; pos < data.size(); ) {
+                const size_t size = (std::min)((size_t)1000, data.size() - pos);
+                const auto ret = write(fds[1], data.data() + pos, size);
+                if (ret <= 0) {
+                    break;
+                }
+                pos += (size_t)ret;
+                std::this_thread::sleep_for(std::chrono::microseconds(200));
+            }
+            close(fds[1]);
+        });
+        RawTestReader reader;
+        const auto err = reader.open(strsprintf(_T("/dev/fd/%d"), fds[0]));
+        if (err != RGY_ERR_NONE) {
+            fprintf(stderr, "failed to open pipe: %s.\n", tchar_to_string(get_err_mes(err)).c_str());
+            mismatch++;
+        } else {
+            mismatch += reader.readAll(frames);
+        }
+        writer.join();
+        if (reader.reader) {
+            reader.reader->Close();
+        }
+        close(fds[0]);
+    }
+    return (mismatch) ? RGY_TEST_FAIL : RGY_TEST_PASS;
+}
+
+//パイプの書き込み側が止まっていて、先読みスレッドが読み込み待ちのままでもClose()できること
+RGY_TEST(raw_close_blocked) {
+    const int frames = 2;
+    const auto data = raw_test_y4m(frames, 0);
+    int fds[2] = { -1, -1 };
+    RGY_TEST_EXPECT(pipe(fds) == 0);
+    RGY_TEST_EXPECT(write(fds[1], data.data(), data.size()) == (ssize_t)data.size());
+
+    int mismatch = 0;
+    RawTestReader reader;
+    RGY_TEST_EXPECT(reader.open(strsprintf(_T("/dev/fd/%d"), fds[0])) == RGY_ERR_NONE);
+    for (int i = 0; i < frames; i++) {
+        RGY_TEST_EXPECT(reader.read(i, &mismatch) == RGY_ERR_NONE);
+    }
+    auto closed = std::async(std::launch::async, [&]() { reader.reader->Close(); });
+    const bool hang = closed.wait_for(std::chrono::seconds(5)) != std::future_status::ready;
+    //止まっていた場合は、書き込み側を閉じて読み込みを終わらせる
+    close(fds[1]);
+    closed.wait();
+    close(fds[0]);
+    if (hang) {
+        fprintf(stderr, "Close() blocked while the read-ahead thread was waiting for data.\n");
+        return RGY_TEST_FAIL;
+    }
+    return (mismatch) ? RGY_TEST_FAIL : RGY_TEST_PASS;
+}
+#endif //#if ENABLE_RAW_READER
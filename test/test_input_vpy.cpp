@@ -0,0 +1,359 @@
+﻿// -----------------------------------------------------------------------------------------
+// QSVEnc/NVEnc/VCEEnc by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2020 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include "rgy_version.h"
+#include "rgy_util.h"
+#include "rgy_test.h"
+#if ENABLE_VAPOURSYNTH_READER
+#include "rgy_input_vpy.h"
+
+//VapourSynthを使わずに先読みを確認するための仮のスクリプト
+//getFrameAsyncで要求されたフレームを、指定した処理時間の後に別スレッドからコールバックで返す
+struct VpyCheckScript;
+
+struct VpyCheckFrame {
+    VpyCheckScript *script;
+    int n;
+    int stride[3];
+    std::vector<uint8_t> plane[3];
+};
+
+static uint8_t vpy_check_pixel(int n, int iplane, int x, int y) {
+    return (uint8_t)(n * 7 + iplane * 61 + x * 3 + y * 5);
+}
+
+struct VpyCheckScript {
+    struct Request {
+        int n;
+        VSFrameDoneCallback callback;
+        void *userData;
+    };
+    int width, height;
+    int latencyUs, jitterUs;
+    int errorFrame;
+    std::mutex mtx;
+    std::condition_variable cond;
+    std::deque<Request> requests;
+    std::vector<std::thread> workers;
+    bool quit;
+    int pending;              //コールバックを返していない要求の数
+    int pendingMax;
+    std::atomic<int> liveFrames; //解放されていないフレームの数
+
+    VpyCheckScript(int threads, int w, int h, int latency, int jitter, int error) :
+        width(w), height(h), latencyUs(latency), jitterUs(jitter), errorFrame(error),
+        mtx(), cond(), requests(), workers(), quit(false), pending(0), pendingMax(0), liveFrames(0) {
+        for (int i = 0; i < threads; i++) {
+            workers.push_back(std::thread([this]() { run(); }));
+        }
+    }
+    ~VpyCheckScript() {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            quit = true;
+        }
+        cond.notify_all();
+        for (auto& th : workers) {
+            th.join();
+        }
+    }
+    void request(int n, VSFrameDoneCallback callback, void *userData) {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            requests.push_back({ n, callback, userData });
+            pending++;
+            pendingMax = (std::max)(pendingMax, pending);
+        }
+        cond.notify_one();
+    }
+    void run() {
+        for (;;) {
+            Request req;
+            {
+                std::unique_lock<std::mutex> lock(mtx);
+                cond.wait(lock, [this]() { return quit || requests.size() > 0; });
+                if (requests.size() == 0) {
+                    return;
+                }
+                req = requests.front();
+                requests.pop_front();
+            }
+            //フレームごとに処理時間を変える
+            const uint32_t hash = (uint32_t)req.n * 2654435761u;
+            std::this_thread::sleep_for(std::chrono::microseconds(latencyUs + ((jitterUs > 0) ? (int)((hash >> 8) % (uint32_t)jitterUs) : 0)));
+            VpyCheckFrame *frame = nullptr;
+            if (req.n != errorFrame) {
+                frame = new VpyCheckFrame();
+                frame->script = this;
+                frame->n = req.n;
+                for (int iplane = 0; iplane < 3; iplane++) {
+                    const int planeWidth  = (iplane) ? width  >> 1 : width;
+                    const int planeHeight = (iplane) ? height >> 1 : height;
+                    frame->stride[iplane] = ALIGN(planeWidth, 64);
+                    frame->plane[iplane].resize((size_t)frame->stride[iplane] * planeHeight);
+                    for (int y = 0; y < planeHeight; y++) {
+                        for (int x = 0; x < planeWidth; x++) {
+                            frame->plane[iplane][(size_t)y * frame->stride[iplane] + x] = vpy_check_pixel(req.n, iplane, x, y);
+                        }
+                    }
+                }
+                liveFrames++;
+            }
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                pending--;
+            }
+            req.callback(req.userData, (const VSFrameRef *)frame, req.n, (VSNodeRef *)this, (frame) ? nullptr : "check error");
+        }
+    }
+};
+
+static void VS_CC vpy_check_get_frame_async(int n, VSNodeRef *node, VSFrameDoneCallback callback, void *userData) {
+    ((VpyCheckScript *)node)->request(n, callback, userData);
+}
+static void VS_CC vpy_check_free_frame(const VSFrameRef *f) {
+    auto frame = (VpyCheckFrame *)f;
+    frame->script->liveFrames--;
+    delete frame;
+}
+static const uint8_t *VS_CC vpy_check_get_read_ptr(const VSFrameRef *f, int plane) {
+    return ((const VpyCheckFrame *)f)->plane[plane].data();
+}
+static int VS_CC vpy_check_get_stride(const VSFrameRef *f, int plane) {
+    return ((const VpyCheckFrame *)f)->stride[plane];
+}
+
+class RGYInputVpyCheck : public RGYInputVpy {
+public:
+    RGYInputVpyCheck() : RGYInputVpy() {};
+    virtual ~RGYInputVpyCheck() {
+        Close();
+    }
+    RGY_ERR open(const VSAPI *api, VpyCheckScript *script, int vsThreads, int frames, bool mt, bool adaptive, bool convertInCallback, shared_ptr<EncodeStatus> status) {
+        m_encSatusInfo = status;
+        m_sVSapi = api;
+        m_sVSnode = (VSNodeRef *)script;
+        m_inputVideoInfo.type = (mt) ? RGY_INPUT_FMT_VPY_MT : RGY_INPUT_FMT_VPY;
+        m_inputVideoInfo.srcWidth = script->width;
+        m_inputVideoInfo.srcHeight = script->height;
+        m_inputVideoInfo.frames = frames;
+        m_inputVideoInfo.csp = RGY_CSP_NV12;
+        m_inputVideoInfo.picstruct = RGY_PICSTRUCT_FRAME;
+        m_inputVideoInfo.crop = initCrop();
+        m_inputCsp = RGY_CSP_YV12;
+        m_convert = std::make_unique<RGYConvertCSP>(1);
+        if (m_convert->getFunc(m_inputCsp, m_inputVideoInfo.csp, false, get_availableSIMD()) == nullptr) {
+            return RGY_ERR_UNSUPPORTED;
+        }
+        initAsyncFrames(vsThreads);
+        if (!adaptive) {
+            m_asyncDepthMin = m_asyncDepth;
+            m_asyncDepthMax = m_asyncDepth;
+        }
+        m_convertInCallback &= convertInCallback;
+        requestAsyncFrames();
+        return RGY_ERR_NONE;
+    }
+    virtual void Close() override {
+        closeAsyncFrames();
+        m_sVSapi = nullptr;
+        m_sVSnode = nullptr;
+        RGYInputVpy::Close();
+    }
+    int depth() const { return m_asyncDepth; }
+    int depthPeak() const { return m_asyncDepthPeak; }
+    int depthMax() const { return m_asyncDepthMax; }
+    int stalls() const { return m_asyncStalls; }
+};
+
+struct VpyCheckResult {
+    int frames;
+    int depth;
+    int depthPeak;
+    int stalls;
+    int pendingMax;
+    int mismatch;
+    double fps;
+};
+
+//closeAt: そのフレーム数を読んだところで閉じる (-1で最後まで)
+static VpyCheckResult vpy_check_run(int frames, int vsThreads, int width, int height, int latencyUs, int jitterUs, int consumeUs,
+    int errorFrame, int closeAt, bool mt, bool adaptive, bool convertInCallback, bool verify) {
+    VpyCheckResult result = { 0 };
+    VSAPI api;
+    memset(&api, 0, sizeof(api));
+    api.getFrameAsync = vpy_check_get_frame_async;
+    api.freeFrame = vpy_check_free_frame;
+    api.getReadPtr = vpy_check_get_read_ptr;
+    api.getStride = vpy_check_get_stride;
+
+    VpyCheckScript script(vsThreads, width, height, latencyUs, jitterUs, errorFrame);
+    {
+        auto status = std::make_shared<EncodeStatus>();
+        RGYInputVpyCheck reader;
+        if (reader.open(&api, &script, vsThreads, frames, mt, adaptive, convertInCallback, status) != RGY_ERR_NONE) {
+            result.mismatch++;
+            return result;
+        }
+        FrameInfo frameInfo;
+        frameInfo.csp = RGY_CSP_NV12;
+        frameInfo.width = width;
+        frameInfo.height = height;
+        frameInfo.pitch = ALIGN(width, 64);
+        std::vector<uint8_t> buf((size_t)frameInfo.pitch * height * 3 / 2);
+        frameInfo.ptr = buf.data();
+        RGYFrame surface(frameInfo);
+
+        const auto tmStart = std::chrono::steady_clock::now();
+        for (;;) {
+            if (closeAt >= 0 && result.frames >= closeAt) {
+                break;
+            }
+            const auto err = reader.LoadNextFrame(&surface);
+            if (err != RGY_ERR_NONE) {
+                //エラーとなるべきフレームでのみエラーとなり、それ以外は最後まで読めること
+                const bool expected = (errorFrame >= 0) ? (err != RGY_ERR_MORE_DATA && result.frames == errorFrame) : (err == RGY_ERR_MORE_DATA && result.frames == frames);
+                result.mismatch += (expected) ? 0 : 1;
+                break;
+            }
+            if (verify) {
+                const int n = result.frames;
+                int diff = 0;
+                for (int y = 0; y < height; y++) {
+                    const uint8_t *ptrY = buf.data() + (size_t)y * frameInfo.pitch;
+                    for (int x = 0; x < width; x++) {
+                        diff |= ptrY[x] ^ vpy_check_pixel(n, 0, x, y);
+                    }
+                }
+                for (int y = 0; y < height / 2; y++) {
+                    const uint8_t *ptrUV = buf.data() + (size_t)(height + y) * frameInfo.pitch;
+                    for (int x = 0; x < width / 2; x++) {
+                        diff |= ptrUV[x * 2 + 0] ^ vpy_check_pixel(n, 1, x, y);
+                        diff |= ptrUV[x * 2 + 1] ^ vpy_check_pixel(n, 2, x, y);
+                    }
+                }
+                result.mismatch += (diff) ? 1 : 0;
+            }
+            result.frames++;
+            if (consumeUs > 0) {
+                //エンコーダへの投入にかかる時間の代わり
+                std::this_thread::sleep_for(std::chrono::microseconds(consumeUs));
+            }
+        }
+        const double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - tmStart).count();
+        result.fps = result.frames / (std::max)(elapsed, 1e-9);
+        result.depth = reader.depth();
+        result.depthPeak = reader.depthPeak();
+        result.stalls = reader.stalls();
+        if (result.depthPeak > reader.depthMax()) {
+            result.mismatch++;
+        }
+        reader.Close();
+    }
+    {
+        std::lock_guard<std::mutex> lock(script.mtx);
+        result.pendingMax = script.pendingMax;
+        //閉じた後に要求が残っていないこと
+        result.mismatch += (script.pending != 0) ? 1 : 0;
+    }
+    //すべてのフレームが解放されていること
+    result.mismatch += (script.liveFrames != 0) ? 1 : 0;
+    if (!mt && result.pendingMax > 1) {
+        result.mismatch++;
+    }
+    return result;
+}
+#endif //#if ENABLE_VAPOURSYNTH_READER
+
+//先読みしたフレームが、エンコーダがスクリプトより遅い場合、スクリプトがエラーを返す場合、
+//フレームを要求中に閉じた場合も含め、正しい順序・内容で渡されるか
+RGY_TEST(vpy_prefetch) {
+#if ENABLE_VAPOURSYNTH_READER
+    struct test_result {
+        const char *name;
+        VpyCheckResult result;
+    };
+    const int frames = 300;
+    const int threads = 4;
+    const test_result results[] = {
+        { "adaptive",          vpy_check_run(frames, threads, 320, 180, 2000, 4000,  200,  -1, -1, true,  true,  true,  true) },
+        { "slow_consumer",     vpy_check_run(frames, threads, 320, 180,  500, 1000, 3000,  -1, -1, true,  true,  true,  true) },
+        { "fixed_depth",       vpy_check_run(frames, threads, 320, 180, 2000, 4000,  200,  -1, -1, true,  false, true,  true) },
+        { "convert_on_reader", vpy_check_run(frames, threads, 320, 180, 2000, 4000,  200,  -1, -1, true,  true,  false, true) },
+        { "non_mt",            vpy_check_run(100,    threads, 320, 180,  500,    0,    0,  -1, -1, false, true,  true,  true) },
+        { "script_error",      vpy_check_run(frames, threads, 320, 180,  500, 1000,    0, 100, -1, true,  true,  true,  true) },
+        { "early_close",       vpy_check_run(frames, threads, 320, 180, 2000, 4000,    0,  -1, 50, true,  true,  true,  true) },
+    };
+    int mismatch = 0;
+    for (const auto& result : results) {
+        const auto& r = result.result;
+        if (r.mismatch) {
+            fprintf(stderr, "%s: %d mismatch, frames %d, depth %d, depth peak %d, stalls %d, script pending max %d\n",
+                result.name, r.mismatch, r.frames, r.depth, r.depthPeak, r.stalls, r.pendingMax);
+        }
+        mismatch += r.mismatch;
+    }
+    return (mismatch) ? RGY_TEST_FAIL : RGY_TEST_PASS;
+#else
+    fprintf(stderr, "vpy reader is not available.\n");
+    return RGY_TEST_SKIP;
+#endif //#if ENABLE_VAPOURSYNTH_READER
+}
+
+//処理時間のばらつくスクリプトと、フレームごとに投入の時間がかかるエンコーダを想定し、
+//一定数のフレームを要求し読み込みスレッドで色変換する場合と、要求数を調整しスクリプトのスレッドで色変換する場合の処理速度をJSONで出力する
+RGY_TEST(bench_vpy_prefetch) {
+#if ENABLE_VAPOURSYNTH_READER
+    const int frames = 240;
+    const int threads = 4;
+    const auto fixedReader = vpy_check_run(frames, threads, 640, 360, 2000, 30000, 1500, -1, -1, true, false, false, false);
+    const auto adaptiveCallback = vpy_check_run(frames, threads, 640, 360, 2000, 30000, 1500, -1, -1, true, true, true, false);
+    tstring str = _T("{\n");
+    str += _T("  \"bench\": [\n");
+    str += strsprintf(_T("    { \"impl\": \"fixed_depth_convert_on_reader\", \"depth\": %d, \"stalls\": %d, \"fps\": %.1f },\n"), fixedReader.depth, fixedReader.stalls, fixedReader.fps);
+    str += strsprintf(_T("    { \"impl\": \"adaptive_depth_convert_in_callback\", \"depth\": %d, \"depth_peak\": %d, \"stalls\": %d, \"fps\": %.1f }\n"), adaptiveCallback.depth, adaptiveCallback.depthPeak, adaptiveCallback.stalls, adaptiveCallback.fps);
+    str += _T("  ]\n");
+    str += _T("}\n");
+    _ftprintf(stdout, _T("%s"), str.c_str());
+    return (fixedReader.mismatch + adaptiveCallback.mismatch) ? RGY_TEST_FAIL : RGY_TEST_PASS;
+#else
+    fprintf(stderr, "vpy reader is not available.\n");
+    return RGY_TEST_SKIP;
+#endif //#if ENABLE_VAPOURSYNTH_READER
+}
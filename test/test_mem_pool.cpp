@@ -0,0 +1,122 @@
+﻿// -----------------------------------------------------------------------------------------
+// QSVEnc/NVEnc/VCEEnc by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2020 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <thread>
+#include <memory>
+#include "rgy_mem_pool.h"
+#include "rgy_test.h"
+
+//プロセス全体で共有するプールの統計に影響しないよう、テストごとにプールを作る
+class RGYMemPoolTest : public RGYMemPool {
+public:
+    RGYMemPoolTest() : RGYMemPool() {};
+};
+
+static bool check_mem_pool_stats(const RGYMemPool::Stats& s, uint64_t hit, uint64_t miss, size_t allocated, size_t cached, const char *step) {
+    if (s.hit != hit || s.miss != miss || s.allocated != allocated || s.cached != cached) {
+        fprintf(stderr, "%s: hit %lld (expected %lld), miss %lld (%lld), allocated %zu (%zu), cached %zu (%zu)\n", step,
+            (long long)s.hit, (long long)hit, (long long)s.miss, (long long)miss, s.allocated, allocated, s.cached, cached);
+        return false;
+    }
+    return true;
+}
+
+//サイズクラスごとの再利用 (hit/miss)、上限を超えた場合の解放、trimを確認する
+RGY_TEST(mem_pool) {
+    const size_t small = 4096;
+    const size_t large = 2 * RGYMemPool::HUGE_PAGE_SIZE; //3MBは2MB単位に切り上げられる
+    auto pool = std::make_shared<RGYMemPoolTest>();
+
+    auto buf0 = pool->alloc(100);
+    auto buf1 = pool->alloc(3 * 1024 * 1024);
+    RGY_TEST_EXPECT(buf0 && buf1);
+    RGY_TEST_EXPECT(((size_t)buf0.get() & (small - 1)) == 0);
+    RGY_TEST_EXPECT(((size_t)buf1.get() & (RGYMemPool::HUGE_PAGE_SIZE - 1)) == 0);
+    memset(buf0.get(), 0x12, small);
+    memset(buf1.get(), 0x34, large);
+    RGY_TEST_EXPECT(check_mem_pool_stats(pool->stats(), 0, 2, small + large, 0, "alloc"));
+
+    //解放したバッファは保持され、同じサイズクラスの確保で再利用される
+    uint8_t *ptr0 = buf0.get();
+    buf0.reset();
+    buf1.reset();
+    RGY_TEST_EXPECT(check_mem_pool_stats(pool->stats(), 0, 2, small + large, small + large, "release"));
+    buf0 = pool->alloc(small);
+    RGY_TEST_EXPECT(buf0.get() == ptr0);
+    RGY_TEST_EXPECT(check_mem_pool_stats(pool->stats(), 1, 2, small + large, large, "reuse"));
+
+    //異なるサイズクラスは再利用しない
+    auto buf2 = pool->alloc(small + 1);
+    RGY_TEST_EXPECT(buf2 && buf2.get() != ptr0);
+    RGY_TEST_EXPECT(check_mem_pool_stats(pool->stats(), 1, 3, small * 3 + large, large, "other class"));
+
+    //trimで保持しているバッファのみOSに返す (使用中のバッファはそのまま)
+    pool->trim();
+    RGY_TEST_EXPECT(check_mem_pool_stats(pool->stats(), 1, 3, small * 3, 0, "trim"));
+    RGY_TEST_EXPECT(buf0.get()[0] == 0x12);
+
+    //上限を超える分は保持せずに解放する
+    pool->setMaxCached(small);
+    buf0.reset();
+    buf2.reset();
+    RGY_TEST_EXPECT(check_mem_pool_stats(pool->stats(), 1, 3, small, small, "max cached"));
+    pool->trim();
+    RGY_TEST_EXPECT(check_mem_pool_stats(pool->stats(), 1, 3, 0, 0, "trim all"));
+    return RGY_TEST_PASS;
+}
+
+//複数スレッドから同時に確保・解放しても、統計が整合するか
+RGY_TEST(mem_pool_threads) {
+    const int threads = 8;
+    const int loop = 2000;
+    auto pool = std::make_shared<RGYMemPoolTest>();
+    std::vector<std::thread> workers;
+    for (int i = 0; i < threads; i++) {
+        workers.push_back(std::thread([pool, i, loop]() {
+            for (int j = 0; j < loop; j++) {
+                auto buf = pool->alloc((size_t)4096 << ((i + j) % 4));
+                if (buf) {
+                    buf.get()[0] = (uint8_t)j;
+                }
+            }
+        }));
+    }
+    for (auto& th : workers) {
+        th.join();
+    }
+    const auto s = pool->stats();
+    RGY_TEST_EXPECT(s.hit + s.miss == (uint64_t)threads * loop);
+    RGY_TEST_EXPECT(s.allocated == s.cached);
+    //同時に使用するのは各スレッド1つまでなので、サイズクラスごとにスレッド数を超えて確保しない
+    RGY_TEST_EXPECT(s.miss <= (uint64_t)threads * 4);
+    pool->trim();
+    RGY_TEST_EXPECT(check_mem_pool_stats(pool->stats(), s.hit, s.miss, 0, 0, "trim"));
+    return RGY_TEST_PASS;
+}
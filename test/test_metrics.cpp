@@ -0,0 +1,271 @@
+﻿// -----------------------------------------------------------------------------------------
+// QSVEnc/NVEnc/VCEEnc by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2020 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <cctype>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include "rgy_util.h"
+#include "rgy_version.h"
+#include "rgy_metrics.h"
+#include "rgy_test.h"
+
+static const std::string METRICS_TEST_REQUEST = "GET /metrics HTTP/1.1\r\nHost: 127.0.0.1\r\n\r\n";
+
+//seqから決まる値を書き込み、読み出した値が同じ回の書き込みのものかを確認できるようにする
+static void metrics_test_fill(RGYMetricsSnapshot *snap, uint32_t seq) {
+    memset(snap, 0, sizeof(snap[0]));
+    snap->valid = true;
+    snap->encStarted = true;
+    snap->enc.frameOutI = seq;
+    snap->enc.frameOutP = seq * 2;
+    snap->enc.frameOutB = seq * 3;
+    snap->enc.frameIn = seq * 6;
+    snap->enc.frameOutISize = (uint64_t)seq * 1000;
+    snap->perf.fps = seq;
+    snap->perf.cpu_percent = seq * 0.5;
+    snap->queue.usage_vid_in = seq;
+    for (int i = 0; i < PERF_OUTPUT_WRITE_LATENCY_BINS; i++) {
+        snap->queue.output_write_latency[i] = seq;
+    }
+}
+
+//statusを返す (接続できなければ-1)
+static int metrics_test_get(int port, const std::string& request, std::string *header, std::string *body) {
+    RGYTCPSocket sock;
+    if (sock.connect("127.0.0.1", port) != RGY_ERR_NONE) {
+        return -1;
+    }
+    sock.setTimeout(5000);
+    if (sock.send(request.data(), request.length()) != RGY_ERR_NONE) {
+        return -1;
+    }
+    std::string response;
+    char buf[4096];
+    int64_t ret = 0;
+    while ((ret = sock.recv(buf, sizeof(buf))) > 0) {
+        response.append(buf, (size_t)ret);
+    }
+    const auto pos = response.find("\r\n\r\n");
+    if (pos == std::string::npos) {
+        return -1;
+    }
+    *header = response.substr(0, pos + 2);
+    *body = response.substr(pos + 4);
+    int status = 0;
+    if (1 != sscanf(header->c_str(), "HTTP/1.1 %d", &status)) {
+        return -1;
+    }
+    return status;
+}
+
+static double metrics_test_value(const std::string& body, const std::string& sample) {
+    std::string prefix = ENCODER_NAME;
+    std::transform(prefix.begin(), prefix.end(), prefix.begin(), [](char c) { return (char)std::tolower((unsigned char)c); });
+    const auto key = "\n" + prefix + "_" + sample + " ";
+    const auto pos = body.find(key);
+    if (pos == std::string::npos) {
+        return -1.0;
+    }
+    return atof(body.c_str() + pos + key.length());
+}
+
+//1つのエンコード分の値が、すべて同じ回の書き込みのものか
+static bool metrics_test_source(const std::string& body, const std::string& label, double *lastSeq) {
+    const auto out = "{output=\"" + label + "\"";
+    const double seq = metrics_test_value(body, "frames_out_total" + out + ",type=\"I\"}");
+    const bool ok = seq > 0.0 && seq >= *lastSeq
+        && metrics_test_value(body, "frames_out_total" + out + ",type=\"P\"}") == seq * 2
+        && metrics_test_value(body, "frames_out_total" + out + ",type=\"B\"}") == seq * 3
+        && metrics_test_value(body, "frames_in_total" + out + "}") == seq * 6
+        && metrics_test_value(body, "output_bytes_total" + out + ",type=\"I\"}") == seq * 1000
+        && metrics_test_value(body, "encode_fps" + out + "}") == seq
+        && metrics_test_value(body, "cpu_usage_percent" + out + "}") == seq * 0.5
+        && metrics_test_value(body, "queue_usage" + out + ",queue=\"video_in\"}") == seq
+        && metrics_test_value(body, "output_write_latency_seconds_bucket" + out + ",le=\"0.001\"}") == seq
+        && metrics_test_value(body, "output_write_latency_seconds_bucket" + out + ",le=\"+Inf\"}") == seq * PERF_OUTPUT_WRITE_LATENCY_BINS
+        && metrics_test_value(body, "output_write_latency_seconds_count" + out + "}") == seq * PERF_OUTPUT_WRITE_LATENCY_BINS;
+    if (!ok) {
+        fprintf(stderr, "metrics of %s are not from a single snapshot (seq %.0f, last %.0f)\n", label.c_str(), seq, *lastSeq);
+    }
+    *lastSeq = seq;
+    return ok;
+}
+
+struct MetricsTestResult {
+    bool ok;
+    double scrapeUs;     //1回のscrapeの平均時間
+    double publishNs;    //1回の書き込みの平均時間
+    double publishMaxUs; //1回の書き込みの最大時間
+    size_t bodySize;
+};
+
+//2つのエンコード分の値の更新を続けながらscrapeし、応答の形式と値の一貫性を確認する
+static MetricsTestResult metrics_test_scrape(int scrapes) {
+    MetricsTestResult result = { false, 0.0, 0.0, 0.0, 0 };
+    auto server = RGYMetricsServer::get();
+    if (server->open("127.0.0.1", 0, nullptr) != RGY_ERR_NONE) {
+        fprintf(stderr, "failed to open metrics server.\n");
+        return result;
+    }
+    const int port = server->port();
+    //ラベルのエスケープも確認する
+    const std::vector<tstring> outputs = { _T("test_a.mp4"), _T("test \"b\".mp4") };
+    const std::vector<std::string> labels = { "test_a.mp4", "test \\\"b\\\".mp4" };
+    std::vector<std::shared_ptr<RGYMetricsSource>> sources;
+    for (const auto& output : outputs) {
+        sources.push_back(server->addSource(output));
+    }
+    //一度も書き込んでいないものは出力しない
+    auto sourceUnused = server->addSource(_T("test_unused.mp4"));
+
+    std::atomic<bool> stop(false);
+    std::vector<std::thread> publishers;
+    std::vector<uint64_t> publishCount(sources.size(), 0);
+    std::vector<double> publishTotalNs(sources.size(), 0.0), publishMaxNs(sources.size(), 0.0);
+    for (size_t i = 0; i < sources.size(); i++) {
+        publishers.push_back(std::thread([&, i]() {
+            for (uint32_t seq = 1; !stop; seq++) {
+                const auto start = std::chrono::steady_clock::now();
+                metrics_test_fill(sources[i]->back(), seq);
+                sources[i]->publish();
+                const double ns = (double)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+                publishCount[i]++;
+                publishTotalNs[i] += ns;
+                publishMaxNs[i] = std::max(publishMaxNs[i], ns);
+                std::this_thread::yield();
+            }
+        }));
+    }
+    //最初の書き込みを待つ
+    while (sources.back()->snapshot().valid == false || sources.front()->snapshot().valid == false) {
+        std::this_thread::yield();
+    }
+    bool ok = true;
+    std::vector<double> lastSeq(sources.size(), 0.0);
+    const auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < scrapes && ok; i++) {
+        std::string header, body;
+        const int status = metrics_test_get(port, METRICS_TEST_REQUEST, &header, &body);
+        if (status != 200) {
+            fprintf(stderr, "scrape returned %d.\n", status);
+            ok = false;
+            break;
+        }
+        size_t contentLength = 0;
+        const auto lenpos = header.find("Content-Length: ");
+        if (lenpos == std::string::npos || 1 != sscanf(header.c_str() + lenpos, "Content-Length: %zu", &contentLength) || contentLength != body.length()) {
+            fprintf(stderr, "Content-Length mismatch: %zu, body %zu.\n", contentLength, body.length());
+            ok = false;
+        }
+        if (header.find("Content-Type: application/openmetrics-text") == std::string::npos
+            || body.length() < 6 || body.substr(body.length() - 6) != "# EOF\n"
+            || body.find("test_unused.mp4") != std::string::npos) {
+            fprintf(stderr, "invalid response:\n%s%s\n", header.c_str(), body.c_str());
+            ok = false;
+        }
+        for (size_t j = 0; j < sources.size(); j++) {
+            ok &= metrics_test_source(body, labels[j], &lastSeq[j]);
+        }
+        result.bodySize = body.length();
+    }
+    result.scrapeUs = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count() / (double)scrapes;
+    stop = true;
+    for (auto& th : publishers) {
+        th.join();
+    }
+    uint64_t count = 0;
+    double totalNs = 0.0;
+    for (size_t i = 0; i < sources.size(); i++) {
+        count += publishCount[i];
+        totalNs += publishTotalNs[i];
+        result.publishMaxUs = std::max(result.publishMaxUs, publishMaxNs[i] * 1e-3);
+    }
+    result.publishNs = totalNs / std::max<uint64_t>(count, 1);
+    if (ok && server->scrapes() != (uint64_t)scrapes) {
+        fprintf(stderr, "scrape count mismatch: expected %d, got %llu.\n", scrapes, (unsigned long long)server->scrapes());
+        ok = false;
+    }
+    server->close();
+    result.ok = ok;
+    return result;
+}
+
+//値の更新中にscrapeしても、常に一貫したスナップショットがOpenMetrics形式で返される
+RGY_TEST(metrics_scrape) {
+    RGY_TEST_EXPECT(metrics_test_scrape(200).ok);
+    return RGY_TEST_PASS;
+}
+
+//不正なリクエストは拒否され、エンコードが1つもなくても形式は正しい
+RGY_TEST(metrics_request) {
+    auto server = RGYMetricsServer::get();
+    RGY_TEST_EXPECT(server->open("127.0.0.1", 0, nullptr) == RGY_ERR_NONE);
+    const int port = server->port();
+    std::string header, body;
+    RGY_TEST_EXPECT(metrics_test_get(port, "GET /other HTTP/1.1\r\n\r\n", &header, &body) == 404);
+    RGY_TEST_EXPECT(metrics_test_get(port, "POST /metrics HTTP/1.1\r\n\r\n", &header, &body) == 405);
+    RGY_TEST_EXPECT(metrics_test_get(port, "GARBAGE\r\n\r\n", &header, &body) == 400);
+    RGY_TEST_EXPECT(metrics_test_get(port, "HEAD /metrics?x=1 HTTP/1.1\r\n\r\n", &header, &body) == 200 && body.length() == 0);
+    RGY_TEST_EXPECT(metrics_test_get(port, METRICS_TEST_REQUEST, &header, &body) == 200 && body == "# EOF\n");
+    server->close();
+    return RGY_TEST_PASS;
+}
+
+//同じhost:portでのopenは参照カウントを増やし (--ladder)、別のポートではエラーとなる
+RGY_TEST(metrics_refcount) {
+    auto server = RGYMetricsServer::get();
+    RGY_TEST_EXPECT(server->open("127.0.0.1", 0, nullptr) == RGY_ERR_NONE);
+    const int port = server->port();
+    std::string header, body;
+    RGY_TEST_EXPECT(server->open("127.0.0.1", 0, nullptr) == RGY_ERR_NONE);
+    RGY_TEST_EXPECT(server->open("127.0.0.1", port + 1, nullptr) != RGY_ERR_NONE);
+    server->close();
+    RGY_TEST_EXPECT(metrics_test_get(port, METRICS_TEST_REQUEST, &header, &body) == 200);
+    server->close();
+    RGY_TEST_EXPECT(metrics_test_get(port, METRICS_TEST_REQUEST, &header, &body) == -1);
+    return RGY_TEST_PASS;
+}
+
+//値の更新とscrapeの所要時間をJSONで出力する
+RGY_TEST(bench_metrics) {
+    const auto result = metrics_test_scrape(1000);
+    RGY_TEST_EXPECT(result.ok);
+    tstring str = _T("{\n");
+    str += strsprintf(_T("  \"publish\": { \"ns_avg\": %.1f, \"us_max\": %.1f },\n"), result.publishNs, result.publishMaxUs);
+    str += strsprintf(_T("  \"scrape\": { \"us_avg\": %.1f, \"bytes\": %d }\n"), result.scrapeUs, (int)result.bodySize);
+    str += _T("}\n");
+    _ftprintf(stdout, _T("%s"), str.c_str());
+    return RGY_TEST_PASS;
+}
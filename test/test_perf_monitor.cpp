@@ -0,0 +1,167 @@
+﻿// -----------------------------------------------------------------------------------------
+// QSVEnc/NVEnc/VCEEnc by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2020 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "rgy_util.h"
+#include "rgy_perf_monitor_proc.h"
+#include "rgy_test.h"
+
+static bool perf_monitor_read_mem(int64_t *mem_private) {
+    char buffer[256];
+    long long size = 0, resident = 0;
+    if (perfMonitorReadProc("/proc/self/statm", buffer, sizeof(buffer)) <= 0
+        || 2 != sscanf(buffer, "%lld %lld", &size, &resident)) {
+        return false;
+    }
+    *mem_private = resident * sysconf(_SC_PAGESIZE);
+    return true;
+}
+
+static bool perf_monitor_read_io(int64_t *rchar) {
+    char buffer[2048];
+    long long i = 0;
+    const char *ptr = nullptr;
+    if (perfMonitorReadProc("/proc/self/io", buffer, sizeof(buffer)) <= 0
+        || nullptr == (ptr = strstr(buffer, "rchar:"))
+        || 1 != sscanf(ptr, "rchar: %lld", &i)) {
+        return false;
+    }
+    *rchar = i;
+    return true;
+}
+
+//CPerfMonitorのLinux向けの情報取得 (スレッドID、スレッドのCPU時間、メモリ、IO、ハードウェアカウンタ) を確認する
+RGY_TEST(perf_monitor_proc) {
+    //計測対象のスレッド: 止めるまでCPUを使い続ける
+    std::atomic<int> spinTid(0);
+    std::atomic<bool> spinStop(false);
+    std::thread thSpin([&]() {
+        spinTid = (int)syscall(SYS_gettid);
+        volatile uint64_t count = 0;
+        while (!spinStop) {
+            count++;
+        }
+    });
+    while (spinTid == 0) {
+        std::this_thread::yield();
+    }
+    //pthreadのハンドルからスレッドIDが正しく得られるか
+    RGY_TEST_EXPECT(perfMonitorThreadTid((HANDLE)thSpin.native_handle()) == spinTid);
+    RGY_TEST_EXPECT(perfMonitorThreadTid((HANDLE)pthread_self()) == (int)syscall(SYS_gettid));
+
+    //スピンしているスレッドはほぼ経過時間分のCPU時間を使用しているはず
+    const int fdCycles = perfMonitorOpenEvent(spinTid, PERF_COUNT_HW_CPU_CYCLES);
+    const int64_t cyclesStart = perfMonitorReadEvent(fdCycles);
+    const int64_t timeStart = perfMonitorTime100ns();
+    const int64_t activeStart = perfMonitorThreadActiveUs(spinTid);
+    std::this_thread::sleep_for(std::chrono::milliseconds(300));
+    const int64_t activeEnd = perfMonitorThreadActiveUs(spinTid);
+    const int64_t elapsedUs = (perfMonitorTime100ns() - timeStart) / 10;
+    const int64_t cycles = perfMonitorReadEvent(fdCycles) - cyclesStart;
+    spinStop = true;
+    thSpin.join();
+    if (fdCycles >= 0) {
+        close(fdCycles);
+    }
+    const int64_t activeUs = activeEnd - activeStart;
+    //clock tickの粒度とスケジューリングの揺らぎを考慮して、緩めに判定する
+    if (activeStart < 0 || activeEnd < 0 || activeUs < elapsedUs / 4 || activeUs > elapsedUs + 20000) {
+        fprintf(stderr, "thread cpu time mismatch: active %lld us, elapsed %lld us\n", (long long)activeUs, (long long)elapsedUs);
+        return RGY_TEST_FAIL;
+    }
+    //終了したスレッドは-1となる
+    RGY_TEST_EXPECT(perfMonitorThreadActiveUs(spinTid) < 0);
+    //perf_eventはコンテナ等では使用できないことがある
+    if (fdCycles >= 0) {
+        RGY_TEST_EXPECT(cycles > 0);
+    } else {
+        fprintf(stderr, "perf_event is not available, cycles not checked.\n");
+    }
+
+    int64_t memPrivate = 0;
+    RGY_TEST_EXPECT(perf_monitor_read_mem(&memPrivate) && memPrivate > 0);
+
+    ///proc/self/ioもコンテナ等では読めないことがある
+    int64_t rcharStart = 0, rcharEnd = 0;
+    if (perf_monitor_read_io(&rcharStart)) {
+        perf_monitor_read_mem(&memPrivate);
+        RGY_TEST_EXPECT(perf_monitor_read_io(&rcharEnd) && rcharEnd > rcharStart);
+    } else {
+        fprintf(stderr, "/proc/self/io is not available, io not checked.\n");
+    }
+    return RGY_TEST_PASS;
+}
+
+//以前の実装 (popenでcatを起動して/proc/<pid>/statusを読む) の1回分
+static bool perf_monitor_read_mem_popen(int64_t *mem_private) {
+    FILE *fp = popen(strsprintf("cat /proc/%d/status", (int)getpid()).c_str(), "r");
+    if (!fp) {
+        return false;
+    }
+    char buffer[2048] = { 0 };
+    while (NULL != fgets(buffer, _countof(buffer), fp)) {
+        long long i = 0;
+        if (1 == sscanf(buffer, "VmRSS: %lld kB", &i)) {
+            *mem_private = i << 10;
+        }
+    }
+    pclose(fp);
+    return true;
+}
+
+static double bench_perf_monitor_read(bool (*func)(int64_t *), int loops) {
+    int64_t value = 0;
+    const auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < loops; i++) {
+        func(&value);
+    }
+    const double sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return loops / std::max(sec, 1e-9);
+}
+
+///procの読み込みをpopenによる以前の実装と比較し、1秒あたりの読み込み回数をJSONで出力する
+RGY_TEST(bench_perf_monitor_proc) {
+    tstring str = _T("{\n");
+    str += _T("  \"reads_per_sec\": [\n");
+    str += strsprintf(_T("    { \"impl\": \"popen_cat\", \"reads_per_sec\": %.1f },\n"), bench_perf_monitor_read(perf_monitor_read_mem_popen, 50));
+    str += strsprintf(_T("    { \"impl\": \"proc_read\", \"reads_per_sec\": %.1f }\n"), bench_perf_monitor_read(perf_monitor_read_mem, 20000));
+    str += _T("  ]\n");
+    str += _T("}\n");
+    _ftprintf(stdout, _T("%s"), str.c_str());
+    return RGY_TEST_PASS;
+}
@@ -0,0 +1,619 @@
+﻿// -----------------------------------------------------------------------------------------
+// QSVEnc/NVEnc/VCEEnc by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2020 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+#include <cstdint>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include "rgy_util.h"
+#include "rgy_queue.h"
+#include "rgy_test.h"
+
+//キューを通して0,1,2,...を送り、受け取り側で順序を確認する
+//bufSizeを小さくして、送り側でのバッファの再確保も発生させる
+static bool check_queue_spsp_order(size_t bufSize, size_t maxCapacity, int nPushRestart, uint32_t count) {
+    RGYQueueSPSP<uint32_t, 64> queue;
+    queue.init(bufSize, maxCapacity, nPushRestart);
+    std::atomic<bool> push_error(false);
+    std::thread producer([&]() {
+        for (uint32_t i = 0; i < count; i++) {
+            if (!queue.push(i)) {
+                push_error = true;
+                return;
+            }
+        }
+    });
+    bool ok = true;
+    for (uint32_t expected = 0; expected < count && ok && !push_error; ) {
+        uint32_t value = 0;
+        if (queue.front_copy_and_pop_no_lock(&value)) {
+            if (value != expected) {
+                fprintf(stderr, "queue order mismatch: expected %u, got %u (buf %zu, capacity %zu)\n",
+                    expected, value, bufSize, maxCapacity);
+                ok = false;
+            }
+            expected++;
+        } else {
+            queue.wait_for_push(INFINITE);
+        }
+    }
+    producer.join();
+    if (push_error) {
+        fprintf(stderr, "queue push failed (buf %zu, capacity %zu)\n", bufSize, maxCapacity);
+        return false;
+    }
+    return ok && queue.empty();
+}
+
+//RGYQueueSPSPの順序、容量制限、keep_length、待機のタイムアウトを確認する
+RGY_TEST(queue_spsp) {
+    RGY_TEST_EXPECT(check_queue_spsp_order(1024, SIZE_MAX, 1, 200000));
+    RGY_TEST_EXPECT(check_queue_spsp_order(4, SIZE_MAX, 1, 200000));
+    RGY_TEST_EXPECT(check_queue_spsp_order(4, 4, 1, 200000));
+    RGY_TEST_EXPECT(check_queue_spsp_order(16, 8, 4, 200000));
+
+    RGYQueueSPSP<int> queue;
+    queue.init(16);
+    //空のキューでの待機はタイムアウトする
+    const auto start = std::chrono::steady_clock::now();
+    RGY_TEST_EXPECT(!queue.wait_for_push(20));
+    RGY_TEST_EXPECT(std::chrono::steady_clock::now() - start >= std::chrono::milliseconds(15));
+
+    //keep_lengthに達するまでは取り出せない
+    queue.set_keep_length(2);
+    RGY_TEST_EXPECT(queue.push(1));
+    RGY_TEST_EXPECT(queue.push(2));
+    int value = 0;
+    RGY_TEST_EXPECT(!queue.front_copy_and_pop_no_lock(&value));
+    RGY_TEST_EXPECT(queue.push(3));
+    RGY_TEST_EXPECT(queue.wait_for_push(0));
+    RGY_TEST_EXPECT(queue.front_copy_and_pop_no_lock(&value) && value == 1);
+    queue.set_keep_length(0);
+    RGY_TEST_EXPECT(queue.front_copy_and_pop_no_lock(&value) && value == 2);
+    RGY_TEST_EXPECT(queue.front_copy_and_pop_no_lock(&value) && value == 3);
+    RGY_TEST_EXPECT(queue.empty());
+
+    //別スレッドからの通知で待機が解除される
+    RGYQueueWaiter waiter;
+    std::atomic<bool> flag(false);
+    std::thread notifier([&]() {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        flag = true;
+        waiter.notify();
+    });
+    RGY_TEST_EXPECT(waiter.wait([&]() { return flag.load(); }, 5000));
+    notifier.join();
+    return RGY_TEST_PASS;
+}
+
+//RGYSubmitOrderで並べ替えるデータ (音声のフレーム/パケットの代わり)
+struct SubmitOrderItem {
+    int track;  //-1ならスレッドを経由しない (コピーする音声や字幕の代わり)
+    int index;  //投入した順番
+    int part;   //1つのフレームから生成したパケットの番号
+    bool end;   //1フレーム分の処理結果の区切り
+};
+
+//音声エンコードスレッドと同様に、トラックごとに割り当てたスレッドで処理させた結果を
+//投入順に並べ替え、1スレッドで順に処理した場合と同じ順序になるか確認する
+static bool check_submit_order(int tracks, int workers, int count, uint32_t seed) {
+    std::vector<std::unique_ptr<RGYQueueSPSP<SubmitOrderItem>>> qIn, qOut;
+    for (int i = 0; i < workers; i++) {
+        qIn.push_back(std::unique_ptr<RGYQueueSPSP<SubmitOrderItem>>(new RGYQueueSPSP<SubmitOrderItem>()));
+        qOut.push_back(std::unique_ptr<RGYQueueSPSP<SubmitOrderItem>>(new RGYQueueSPSP<SubmitOrderItem>()));
+        qIn.back()->init(64);
+        qOut.back()->init(64);
+    }
+    //フレームごとに0-2個のパケットを生成する (エンコーダのバッファリングで出力がない場合も含む)
+    auto packets = [](int index) { return index % 3; };
+    std::vector<std::thread> threads;
+    for (int i = 0; i < workers; i++) {
+        threads.push_back(std::thread([&, i]() {
+            std::mt19937 mt(seed + i);
+            for (;;) {
+                SubmitOrderItem item = { 0 };
+                while (!qIn[i]->front_copy_and_pop_no_lock(&item)) {
+                    qIn[i]->wait_for_push(INFINITE);
+                }
+                if (item.end) {
+                    return;
+                }
+                std::this_thread::sleep_for(std::chrono::microseconds(mt() % 50));
+                for (int part = 0; part < packets(item.index); part++) {
+                    SubmitOrderItem pkt = item;
+                    pkt.part = part;
+                    qOut[i]->push(pkt);
+                }
+                SubmitOrderItem fin = item;
+                fin.end = true;
+                qOut[i]->push(fin);
+            }
+        }));
+    }
+
+    RGYSubmitOrder<SubmitOrderItem> order;
+    std::vector<SubmitOrderItem> expected, result;
+    auto merge = [&]() {
+        order.merge(
+            [&](int worker, SubmitOrderItem *item) { return qOut[worker]->front_copy_and_pop_no_lock(item); },
+            [](const SubmitOrderItem& item) { return item.end; },
+            [&](SubmitOrderItem& item) { result.push_back(item); });
+    };
+    std::mt19937 mt(seed);
+    for (int index = 0; index < count; index++) {
+        SubmitOrderItem item = { (int)(mt() % (tracks + 1)) - 1, index, 0, false };
+        if (item.track < 0) {
+            order.push(-1, item);
+            expected.push_back(item);
+        } else {
+            const int worker = item.track % workers; //トラックはスレッドに順に割り当てる
+            order.push(worker, SubmitOrderItem());
+            qIn[worker]->push(item);
+            for (int part = 0; part < packets(index); part++) {
+                item.part = part;
+                expected.push_back(item);
+            }
+        }
+        merge();
+    }
+    for (int i = 0; i < workers; i++) {
+        SubmitOrderItem fin = { 0, -1, 0, true };
+        qIn[i]->push(fin);
+    }
+    for (auto& th : threads) {
+        th.join();
+    }
+    merge();
+
+    if (order.size() > 0 || result.size() != expected.size()) {
+        fprintf(stderr, "submit order: %zu left, %zu results (expected %zu)\n", order.size(), result.size(), expected.size());
+        return false;
+    }
+    for (size_t i = 0; i < result.size(); i++) {
+        if (result[i].track != expected[i].track || result[i].index != expected[i].index || result[i].part != expected[i].part) {
+            fprintf(stderr, "submit order mismatch at %zu: track %d, index %d, part %d (expected track %d, index %d, part %d)\n", i,
+                result[i].track, result[i].index, result[i].part, expected[i].track, expected[i].index, expected[i].part);
+            return false;
+        }
+    }
+    return true;
+}
+
+//トラックごとの音声エンコードスレッドの出力順 (RGYSubmitOrder) を確認する
+RGY_TEST(submit_order) {
+    RGY_TEST_EXPECT(check_submit_order(2, 2, 5000, 1));
+    RGY_TEST_EXPECT(check_submit_order(6, 4, 5000, 2)); //スレッド数の上限よりトラックが多い場合
+    RGY_TEST_EXPECT(check_submit_order(1, 1, 2000, 3));
+    return RGY_TEST_PASS;
+}
+
+//比較用: mutex + condition_variable + dequeによる単純なキュー
+class RefMutexQueue {
+public:
+    RefMutexQueue(size_t maxCapacity) : m_mtx(), m_cvPush(), m_cvPop(), m_queue(), m_maxCapacity(maxCapacity) {};
+    void push(uint32_t value) {
+        std::unique_lock<std::mutex> lock(m_mtx);
+        m_cvPop.wait(lock, [this]() { return m_queue.size() < m_maxCapacity; });
+        m_queue.push_back(value);
+        m_cvPush.notify_one();
+    }
+    uint32_t pop() {
+        std::unique_lock<std::mutex> lock(m_mtx);
+        m_cvPush.wait(lock, [this]() { return !m_queue.empty(); });
+        const auto value = m_queue.front();
+        m_queue.pop_front();
+        m_cvPop.notify_one();
+        return value;
+    }
+protected:
+    std::mutex m_mtx;
+    std::condition_variable m_cvPush;
+    std::condition_variable m_cvPop;
+    std::deque<uint32_t> m_queue;
+    size_t m_maxCapacity;
+};
+
+//1つの送り側スレッドと1つの受け取り側スレッドで、countだけ送る時間から Mops を求める
+static double bench_queue_spsp(size_t maxCapacity, uint32_t count) {
+    RGYQueueSPSP<uint32_t, 64> queue;
+    queue.init(1024, maxCapacity);
+    const auto start = std::chrono::steady_clock::now();
+    std::thread producer([&]() {
+        for (uint32_t i = 0; i < count; i++) {
+            queue.push(i);
+        }
+    });
+    for (uint32_t received = 0; received < count; ) {
+        uint32_t value = 0;
+        if (queue.front_copy_and_pop_no_lock(&value)) {
+            received++;
+        } else {
+            queue.wait_for_push(INFINITE);
+        }
+    }
+    producer.join();
+    const double sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return count / sec * 1e-6;
+}
+
+static double bench_queue_mutex(size_t maxCapacity, uint32_t count) {
+    RefMutexQueue queue(maxCapacity);
+    const auto start = std::chrono::steady_clock::now();
+    std::thread producer([&]() {
+        for (uint32_t i = 0; i < count; i++) {
+            queue.push(i);
+        }
+    });
+    for (uint32_t received = 0; received < count; received++) {
+        queue.pop();
+    }
+    producer.join();
+    const double sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return count / sec * 1e-6;
+}
+
+//2つのキューで値を往復させ、1往復あたりの時間(us)を求める (待機からの復帰の遅延)
+static double bench_queue_spsp_pingpong(uint32_t count) {
+    RGYQueueSPSP<uint32_t, 64> ping, pong;
+    ping.init(16);
+    pong.init(16);
+    std::thread echo([&]() {
+        for (uint32_t i = 0; i < count; i++) {
+            uint32_t value = 0;
+            while (!ping.front_copy_and_pop_no_lock(&value)) {
+                ping.wait_for_push(INFINITE);
+            }
+            pong.push(value);
+        }
+    });
+    const auto start = std::chrono::steady_clock::now();
+    for (uint32_t i = 0; i < count; i++) {
+        ping.push(i);
+        uint32_t value = 0;
+        while (!pong.front_copy_and_pop_no_lock(&value)) {
+            pong.wait_for_push(INFINITE);
+        }
+    }
+    const double sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    echo.join();
+    return sec / count * 1e6;
+}
+
+//RGYQueueSPSPとmutexによるキューの処理速度をJSONで出力する
+RGY_TEST(bench_queue_spsp) {
+    static const uint32_t count = 1000000;
+    static const uint32_t pingpong_count = 5000;
+    tstring str = _T("{\n");
+    str += strsprintf(_T("  \"hardware_threads\": %u,\n"), std::thread::hardware_concurrency());
+    str += _T("  \"throughput_Mops\": [\n");
+    const size_t capacity_list[] = { SIZE_MAX, 64, 4 };
+    for (size_t i = 0; i < _countof(capacity_list); i++) {
+        const auto capacity = capacity_list[i];
+        const double spsp = bench_queue_spsp(capacity, count);
+        const double mutex = bench_queue_mutex(capacity, count);
+        str += strsprintf(_T("    { \"capacity\": %lld, \"RGYQueueSPSP\": %.3f, \"mutex_deque\": %.3f }%s\n"),
+            (capacity == SIZE_MAX) ? -1LL : (long long)capacity, spsp, mutex, (i + 1 < _countof(capacity_list)) ? _T(",") : _T(""));
+    }
+    str += _T("  ],\n");
+    str += strsprintf(_T("  \"pingpong_us\": %.3f\n"), bench_queue_spsp_pingpong(pingpong_count));
+    str += _T("}\n");
+    _ftprintf(stdout, _T("%s"), str.c_str());
+    return RGY_TEST_PASS;
+}
+
+//RGYMuxInterleaverに入れるパケット (ストリーム番号とdts、送った時刻)
+struct MuxInterleaveItem {
+    int stream;
+    int64_t dts;
+    int64_t pushed; //steady_clockのns
+};
+
+//各ストリームの増加するdtsのパケットをランダムな順に入れ、取り出せるだけ取り出す
+//上限に達したストリームには入れない (送り側を待たせる代わり)
+//ストリーム間の到着のずれが上限内に収まっていれば、取り出したdtsは単調増加となること
+static bool check_mux_interleave_order(int activeStreams, int count, uint32_t seed) {
+    RGYMuxInterleaver<MuxInterleaveItem> interleaver;
+    std::mt19937 mt(seed);
+    const int streams = activeStreams + 1;
+    for (int i = 0; i < activeStreams; i++) {
+        interleaver.addStream(RGY_MUX_INTERLEAVE_ACTIVE, 64);
+    }
+    const int sparseIdx = interleaver.addStream(RGY_MUX_INTERLEAVE_SPARSE, 64);
+    std::vector<int64_t> nextDts(streams, 0);
+    std::vector<int> pushed(streams, 0);
+    std::vector<MuxInterleaveItem> result;
+    auto popAll = [&]() {
+        int idx = -1;
+        MuxInterleaveItem item = { 0 };
+        while (interleaver.pop(&idx, &item)) {
+            if (idx != item.stream) {
+                return false;
+            }
+            result.push_back(item);
+        }
+        return true;
+    };
+    int total = 0;
+    while (total < count * activeStreams) {
+        const int stream = (int)(mt() % streams);
+        const bool sparse = stream == sparseIdx;
+        if ((!sparse && pushed[stream] >= count) || interleaver.full(stream)) {
+            continue;
+        }
+        //到着のずれは、最も遅れているストリームからdts 200以内とする
+        int64_t frontier = INT64_MAX;
+        for (int i = 0; i < activeStreams; i++) {
+            if (pushed[i] < count) {
+                frontier = (std::min)(frontier, nextDts[i]);
+            }
+        }
+        if (frontier != INT64_MAX && nextDts[stream] > frontier + 200) {
+            continue;
+        }
+        //ストリームごとに異なる間隔のdts、字幕はまばら
+        nextDts[stream] += (sparse) ? 1000 + mt() % 5000 : 10 + stream * 7 + mt() % 5;
+        MuxInterleaveItem item = { stream, nextDts[stream], 0 };
+        interleaver.push(stream, item.dts, item);
+        pushed[stream]++;
+        total += (sparse) ? 0 : 1;
+        if (!popAll()) {
+            return false;
+        }
+    }
+    interleaver.finishAll();
+    if (!popAll() || !interleaver.empty()) {
+        fprintf(stderr, "mux interleave: packets left after finish\n");
+        return false;
+    }
+    size_t expected = 0;
+    for (int i = 0; i < streams; i++) {
+        expected += pushed[i];
+        if (interleaver.state(i) != RGY_MUX_INTERLEAVE_FINISHED) {
+            return false;
+        }
+    }
+    if (result.size() != expected) {
+        fprintf(stderr, "mux interleave: %zu packets, expected %zu\n", result.size(), expected);
+        return false;
+    }
+    for (size_t i = 1; i < result.size(); i++) {
+        if (result[i].dts < result[i - 1].dts) {
+            fprintf(stderr, "mux interleave: dts order mismatch at %zu: %lld after %lld\n", i, (long long)result[i].dts, (long long)result[i - 1].dts);
+            return false;
+        }
+    }
+    return true;
+}
+
+//RGYMuxInterleaverのdts順、空のストリームの待機とSTALLED、字幕の扱いを確認する
+RGY_TEST(mux_interleave) {
+    RGY_TEST_EXPECT(check_mux_interleave_order(1, 5000, 1));
+    RGY_TEST_EXPECT(check_mux_interleave_order(3, 5000, 2));
+    RGY_TEST_EXPECT(check_mux_interleave_order(8, 2000, 3));
+
+    RGYMuxInterleaver<int> interleaver;
+    const int video = interleaver.addStream(RGY_MUX_INTERLEAVE_ACTIVE, 4);
+    const int audio = interleaver.addStream(RGY_MUX_INTERLEAVE_ACTIVE, 4);
+    const int sub = interleaver.addStream(RGY_MUX_INTERLEAVE_SPARSE, 4);
+    int idx = -1, value = 0;
+    //空のACTIVEなストリームがあれば、そのパケットを待つ
+    interleaver.push(video, 0, 0);
+    interleaver.push(video, 10, 10);
+    RGY_TEST_EXPECT(!interleaver.pop(&idx, &value));
+    interleaver.push(audio, 5, 5);
+    RGY_TEST_EXPECT(interleaver.pop(&idx, &value) && idx == video && value == 0);
+    RGY_TEST_EXPECT(interleaver.pop(&idx, &value) && idx == audio && value == 5);
+    //空になった音声の次のパケットのdtsは5以上なので、それより後の映像は待つ
+    RGY_TEST_EXPECT(!interleaver.pop(&idx, &value));
+    //字幕は空でも待たず、先頭のdtsまでほかのストリームが進むまでは出力しない
+    interleaver.push(sub, 100, 100);
+    RGY_TEST_EXPECT(!interleaver.pop(&idx, &value));
+    interleaver.push(audio, 20, 20);
+    RGY_TEST_EXPECT(interleaver.pop(&idx, &value) && idx == video && value == 10);
+    RGY_TEST_EXPECT(!interleaver.pop(&idx, &value));
+    //映像が上限に達したら、音声を待たずに出力する
+    for (int i = 0; i < 4; i++) {
+        RGY_TEST_EXPECT(!interleaver.full(video));
+        interleaver.push(video, 30 + i * 10, 30 + i * 10);
+    }
+    RGY_TEST_EXPECT(interleaver.full(video));
+    RGY_TEST_EXPECT(interleaver.pop(&idx, &value) && idx == audio && value == 20);
+    RGY_TEST_EXPECT(interleaver.pop(&idx, &value) && idx == video && value == 30);
+    RGY_TEST_EXPECT(interleaver.state(audio) == RGY_MUX_INTERLEAVE_STALLED);
+    //STALLEDのストリームは待たないが、パケットが来ればACTIVEに戻る
+    RGY_TEST_EXPECT(interleaver.pop(&idx, &value) && idx == video && value == 40);
+    interleaver.push(audio, 45, 45);
+    RGY_TEST_EXPECT(interleaver.state(audio) == RGY_MUX_INTERLEAVE_ACTIVE);
+    RGY_TEST_EXPECT(interleaver.pop(&idx, &value) && idx == audio && value == 45);
+    RGY_TEST_EXPECT(!interleaver.pop(&idx, &value));
+    //dtsが不明なパケットは直前のパケットと同じdtsとして扱う
+    interleaver.push(audio, INT64_MIN, -1);
+    RGY_TEST_EXPECT(interleaver.pop(&idx, &value) && idx == audio && value == -1);
+    //終了後は残りをすべてdts順に出力する
+    interleaver.finish(audio);
+    RGY_TEST_EXPECT(interleaver.pop(&idx, &value) && idx == video && value == 50);
+    RGY_TEST_EXPECT(interleaver.pop(&idx, &value) && idx == video && value == 60);
+    RGY_TEST_EXPECT(!interleaver.pop(&idx, &value));
+    interleaver.finishAll();
+    RGY_TEST_EXPECT(interleaver.pop(&idx, &value) && idx == sub && value == 100);
+    RGY_TEST_EXPECT(interleaver.empty());
+    return RGY_TEST_PASS;
+}
+
+struct MuxLatencyResult {
+    double p50_us;
+    double p99_us;
+    double max_us;
+    size_t maxStaged;
+    size_t packets;
+};
+
+//muxerの出力スレッドと同じ構成で、パケットを送ってから取り出されるまでの時間を測る
+//送り側は映像1本と音声・字幕の混在した1本のキューに、実時間のspeed倍の速さでパケットを送る
+//映像はエンコードの遅延分だけ音声より遅れて届く
+//pollMs = 0 なら送り側が追加のたびに通知し、出力側はその通知で起きる
+//pollMs > 0 なら送り側は通知せず、出力側はpollMsごとに確認する (以前のポーリング)
+static MuxLatencyResult bench_mux_interleave_latency(int audioTracks, double mediaSec, double speed, uint32_t pollMs) {
+    typedef std::chrono::steady_clock clock;
+    const int64_t videoDuration = 3003;  //90kHzで29.97fps
+    const int64_t audioDuration = 1920;  //90kHzで48kHz 1024サンプル
+    const int64_t subDuration = 180000;  //2秒ごと
+    const int64_t videoDelay = 15 * videoDuration; //エンコードの遅延
+    const int64_t mediaEnd = (int64_t)(mediaSec * 90000);
+
+    RGYQueueSPSP<MuxInterleaveItem> qVideo, qOther;
+    qVideo.init(256, 256);
+    qOther.init(1024, 1024);
+    HANDLE heEventAdded = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+    std::atomic<bool> abort(false);
+
+    //送り側: 到着時刻 (映像は遅延分だけ遅れる) の順にパケットを送る
+    std::thread producer([&]() {
+        const auto start = clock::now();
+        std::vector<int64_t> nextDts(2 + audioTracks, 0);
+        for (;;) {
+            int stream = -1;
+            int64_t arrival = INT64_MAX;
+            for (int i = 0; i < (int)nextDts.size(); i++) {
+                const int64_t t = nextDts[i] + ((i == 0) ? videoDelay : 0);
+                if (nextDts[i] < mediaEnd && t < arrival) {
+                    arrival = t;
+                    stream = i;
+                }
+            }
+            if (stream < 0) {
+                break;
+            }
+            const auto sendTime = start + std::chrono::nanoseconds((int64_t)(arrival / 90000.0 / speed * 1e9));
+            std::this_thread::sleep_until(sendTime);
+            MuxInterleaveItem item = { stream, nextDts[stream], std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now().time_since_epoch()).count() };
+            ((stream == 0) ? qVideo : qOther).push(item);
+            if (pollMs == 0) {
+                SetEvent(heEventAdded);
+            }
+            nextDts[stream] += (stream == 0) ? videoDuration : ((stream == 1) ? subDuration : audioDuration);
+        }
+        abort = true;
+        SetEvent(heEventAdded);
+    });
+
+    //出力側: RGYOutputAvcodec::WriteThreadFuncと同様に、上限に達したストリームには振り分けずに待たせる
+    RGYMuxInterleaver<MuxInterleaveItem> interleaver;
+    interleaver.addStream(RGY_MUX_INTERLEAVE_ACTIVE, 256);
+    interleaver.addStream(RGY_MUX_INTERLEAVE_SPARSE, 256);
+    for (int i = 0; i < audioTracks; i++) {
+        interleaver.addStream(RGY_MUX_INTERLEAVE_ACTIVE, 1024);
+    }
+    std::vector<double> latency;
+    size_t maxStaged = 0;
+    auto fetch = [&]() {
+        bool fetched = false;
+        MuxInterleaveItem item = { 0 };
+        while (!interleaver.full(0) && qVideo.front_copy_and_pop_no_lock(&item)) {
+            interleaver.push(0, item.dts, item);
+            fetched = true;
+        }
+        while (qOther.front_copy_no_lock(&item) && !interleaver.full(item.stream)) {
+            qOther.front_copy_and_pop_no_lock(&item);
+            interleaver.push(item.stream, item.dts, item);
+            fetched = true;
+        }
+        size_t staged = 0;
+        for (int i = 0; i < interleaver.streams(); i++) {
+            staged += interleaver.size(i);
+        }
+        maxStaged = (std::max)(maxStaged, staged);
+        return fetched;
+    };
+    auto write = [&]() {
+        bool written = false;
+        int idx = -1;
+        MuxInterleaveItem item = { 0 };
+        while (interleaver.pop(&idx, &item)) {
+            const auto now = std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now().time_since_epoch()).count();
+            latency.push_back((now - item.pushed) * 1e-3);
+            written = true;
+        }
+        return written;
+    };
+    while (!abort) {
+        ResetEvent(heEventAdded);
+        bool progress = true;
+        while (progress) {
+            progress = fetch();
+            progress |= write();
+        }
+        WaitForSingleObject(heEventAdded, (pollMs == 0) ? INFINITE : pollMs);
+    }
+    producer.join();
+    interleaver.finishAll();
+    while (fetch() | write()) {
+        ;
+    }
+    CloseEvent(heEventAdded);
+
+    //映像のエンコード遅延で音声が待たされるのは避けられないので、映像の到着で出力できるようになった分も含めて集計する
+    MuxLatencyResult result = { 0 };
+    result.packets = latency.size();
+    result.maxStaged = maxStaged;
+    if (latency.size() > 0) {
+        std::sort(latency.begin(), latency.end());
+        result.p50_us = latency[latency.size() / 2];
+        result.p99_us = latency[latency.size() * 99 / 100];
+        result.max_us = latency.back();
+    }
+    return result;
+}
+
+//muxerの出力スレッドの遅延 (通知による起床と16msごとのポーリング) をJSONで出力する
+RGY_TEST(bench_mux_interleave) {
+    static const double mediaSec = 60.0;
+    static const double speed = 20.0;
+    tstring str = _T("{\n");
+    str += strsprintf(_T("  \"media_sec\": %.1f,\n  \"speed\": %.1f,\n"), mediaSec, speed);
+    str += _T("  \"latency\": [\n");
+    const int tracks_list[] = { 1, 8 };
+    const uint32_t poll_list[] = { 0, 16 };
+    for (size_t i = 0; i < _countof(tracks_list); i++) {
+        for (size_t j = 0; j < _countof(poll_list); j++) {
+            const auto result = bench_mux_interleave_latency(tracks_list[i], mediaSec, speed, poll_list[j]);
+            const bool last = i + 1 == _countof(tracks_list) && j + 1 == _countof(poll_list);
+            str += strsprintf(_T("    { \"audio_tracks\": %d, \"wakeup\": \"%s\", \"packets\": %zu, \"p50_us\": %.1f, \"p99_us\": %.1f, \"max_us\": %.1f, \"max_staged\": %zu }%s\n"),
+                tracks_list[i], (poll_list[j] == 0) ? _T("event") : _T("poll16ms"), result.packets, result.p50_us, result.p99_us, result.max_us, result.maxStaged, (last) ? _T("") : _T(","));
+        }
+    }
+    str += _T("  ]\n");
+    str += _T("}\n");
+    _ftprintf(stdout, _T("%s"), str.c_str());
+    return RGY_TEST_PASS;
+}
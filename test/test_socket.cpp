@@ -0,0 +1,534 @@
+﻿// -----------------------------------------------------------------------------------------
+// QSVEnc/NVEnc/VCEEnc by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2020 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+#include <cstring>
+#include <string>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include "rgy_version.h"
+#include "rgy_util.h"
+#include "rgy_socket.h"
+#include "rgy_output_segment.h"
+#include "rgy_test.h"
+#if ENABLE_AVSW_READER
+#include "rgy_avutil.h"
+#endif
+
+//ループバックで動作する、chunked転送のリクエストを受け取るだけのhttpサーバー
+class HTTPTestServer {
+public:
+    enum class Mode {
+        KeepAlive, //応答後も接続を維持する
+        Close,     //応答ごとに切断する
+        Stall,     //受信も応答もしない
+    };
+    struct Request {
+        std::string method;
+        std::string target;
+        std::string body;
+    };
+
+    HTTPTestServer() : m_listen(), m_thread(), m_abort(false), m_mode(Mode::KeepAlive), m_mtx(), m_requests(), m_connections(0) {};
+    ~HTTPTestServer() {
+        stop();
+    }
+    RGY_ERR start(Mode mode) {
+        m_mode = mode;
+        auto err = m_listen.listen("127.0.0.1", 0);
+        if (err != RGY_ERR_NONE) {
+            return err;
+        }
+        m_thread = std::thread([this]() { run(); });
+        return RGY_ERR_NONE;
+    }
+    void stop() {
+        m_abort = true;
+        if (m_thread.joinable()) {
+            m_thread.join();
+        }
+        m_listen.close();
+    }
+    int port() const { return m_listen.localPort(); }
+    int connections() const { return m_connections; }
+    std::vector<Request> requests() {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        return m_requests;
+    }
+protected:
+    void run() {
+        while (!m_abort) {
+            RGYTCPSocket client;
+            if (m_listen.accept(client, 50) != RGY_ERR_NONE) {
+                continue;
+            }
+            m_connections++;
+            if (m_mode == Mode::Stall) {
+                while (!m_abort) {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                }
+                break;
+            }
+            client.setTimeout(50);
+            std::string buf;
+            Request req;
+            while (!m_abort && recvRequest(client, buf, req)) {
+                {
+                    std::lock_guard<std::mutex> lock(m_mtx);
+                    m_requests.push_back(req);
+                }
+                const std::string response = (m_mode == Mode::Close)
+                    ? "HTTP/1.1 201 Created\r\nContent-Length: 2\r\nConnection: close\r\n\r\nok"
+                    : "HTTP/1.1 201 Created\r\nTransfer-Encoding: chunked\r\n\r\n2\r\nok\r\n0\r\n\r\n";
+                if (client.send(response.data(), response.length()) != RGY_ERR_NONE || m_mode == Mode::Close) {
+                    break;
+                }
+            }
+        }
+    }
+    //bufにsize以上のデータがたまるまで受信する (切断・停止時はfalse)
+    bool recvAtLeast(RGYTCPSocket& client, std::string& buf, size_t size) {
+        while (buf.length() < size) {
+            char tmp[4096];
+            const auto ret = client.recv(tmp, sizeof(tmp));
+            if (ret == 0 || (ret < 0 && (!client.timedOut() || m_abort))) {
+                return false;
+            }
+            if (ret > 0) {
+                buf.append(tmp, (size_t)ret);
+            }
+        }
+        return true;
+    }
+    bool recvLine(RGYTCPSocket& client, std::string& buf, const char *delim, std::string& line) {
+        size_t pos = 0;
+        while ((pos = buf.find(delim)) == std::string::npos) {
+            if (!recvAtLeast(client, buf, buf.length() + 1)) {
+                return false;
+            }
+        }
+        line = buf.substr(0, pos);
+        buf.erase(0, pos + strlen(delim));
+        return true;
+    }
+    bool recvRequest(RGYTCPSocket& client, std::string& buf, Request& req) {
+        std::string header, line;
+        if (!recvLine(client, buf, "\r\n\r\n", header)) {
+            return false;
+        }
+        const auto sp1 = header.find(' ');
+        const auto sp2 = header.find(' ', sp1 + 1);
+        req.method = header.substr(0, sp1);
+        req.target = header.substr(sp1 + 1, sp2 - sp1 - 1);
+        req.body.clear();
+        for (;;) {
+            if (!recvLine(client, buf, "\r\n", line)) {
+                return false;
+            }
+            const auto size = (size_t)strtoull(line.c_str(), nullptr, 16);
+            if (size == 0) {
+                return recvLine(client, buf, "\r\n", line);
+            }
+            if (!recvAtLeast(client, buf, size + 2)) {
+                return false;
+            }
+            req.body.append(buf, 0, size);
+            buf.erase(0, size + 2);
+        }
+    }
+
+    RGYTCPSocket m_listen;
+    std::thread m_thread;
+    std::atomic<bool> m_abort;
+    Mode m_mode;
+    std::mutex m_mtx;
+    std::vector<Request> m_requests;
+    std::atomic<int> m_connections;
+};
+
+static std::shared_ptr<RGYLog> test_log() {
+    return std::make_shared<RGYLog>(nullptr, RGY_LOG_QUIET);
+}
+
+static RGY_ERR http_test_upload(RGYHTTPChunkedUpload& http, const RGYURL& url, const std::string& name, const std::vector<std::string>& chunks) {
+    RGY_ERR sts = http.begin(url, "PUT", name, "application/octet-stream");
+    for (const auto& chunk : chunks) {
+        if (sts == RGY_ERR_NONE) {
+            sts = http.write(chunk.data(), chunk.length());
+        }
+    }
+    return (sts == RGY_ERR_NONE) ? http.end() : sts;
+}
+
+//応答後に接続が維持されれば同じ接続で続けて送信し、切断されれば接続しなおす
+RGY_TEST(http_upload) {
+    for (const auto mode : { HTTPTestServer::Mode::KeepAlive, HTTPTestServer::Mode::Close }) {
+        HTTPTestServer server;
+        RGY_TEST_EXPECT(server.start(mode) == RGY_ERR_NONE);
+        RGYURL url;
+        RGY_TEST_EXPECT(rgy_parse_url(url, strsprintf(_T("http://127.0.0.1:%d/live/"), server.port())));
+        RGYHTTPChunkedUpload http(test_log());
+        const int uploads = 3;
+        for (int i = 0; i < uploads; i++) {
+            RGY_TEST_EXPECT(http_test_upload(http, url, strsprintf("seg%d.m4s", i), { "abc", std::string(100000, (char)('a' + i)), "xyz" }) == RGY_ERR_NONE);
+        }
+        server.stop();
+        const auto requests = server.requests();
+        RGY_TEST_EXPECT((int)requests.size() == uploads);
+        for (int i = 0; i < (int)requests.size(); i++) {
+            RGY_TEST_EXPECT(requests[i].method == "PUT");
+            RGY_TEST_EXPECT(requests[i].target == strsprintf("/live/seg%d.m4s", i));
+            RGY_TEST_EXPECT(requests[i].body == "abc" + std::string(100000, (char)('a' + i)) + "xyz");
+        }
+        const int expectedConnections = (mode == HTTPTestServer::Mode::KeepAlive) ? 1 : uploads;
+        RGY_TEST_EXPECT(http.connections() == expectedConnections);
+        RGY_TEST_EXPECT(server.connections() == expectedConnections);
+    }
+    return RGY_TEST_PASS;
+}
+
+//サーバーが受信も応答もしなくなった場合、送信・応答待ちはタイムアウトでエラーとなる
+RGY_TEST(http_upload_timeout) {
+    HTTPTestServer server;
+    RGY_TEST_EXPECT(server.start(HTTPTestServer::Mode::Stall) == RGY_ERR_NONE);
+    RGYURL url;
+    RGY_TEST_EXPECT(rgy_parse_url(url, strsprintf(_T("http://127.0.0.1:%d"), server.port())));
+    const int timeoutMs = 200;
+    RGYHTTPChunkedUpload http(test_log(), timeoutMs);
+    //応答待ちのタイムアウト
+    auto start = std::chrono::steady_clock::now();
+    RGY_TEST_EXPECT(http_test_upload(http, url, "init.mp4", { "abc" }) != RGY_ERR_NONE);
+    RGY_TEST_EXPECT(std::chrono::steady_clock::now() - start < std::chrono::seconds(5));
+    //送信のタイムアウト (受信されないので、ソケットのバッファが埋まると送信できなくなる)
+    start = std::chrono::steady_clock::now();
+    RGY_ERR sts = http.begin(url, "PUT", "seg0.m4s", "application/octet-stream");
+    const std::string data(1024 * 1024, 'x');
+    for (int i = 0; sts == RGY_ERR_NONE && i < 1024; i++) {
+        sts = http.write(data.data(), data.length());
+    }
+    RGY_TEST_EXPECT(sts != RGY_ERR_NONE);
+    RGY_TEST_EXPECT(std::chrono::steady_clock::now() - start < std::chrono::seconds(5));
+    //失敗したリクエストの続きは送信しない
+    RGY_TEST_EXPECT(http.end() != RGY_ERR_NONE);
+    return RGY_TEST_PASS;
+}
+
+//--cmafのurl出力で、初期化セグメント・セグメント・プレイリストを1つの接続で送信する
+RGY_TEST(cmaf_upload) {
+    HTTPTestServer server;
+    RGY_TEST_EXPECT(server.start(HTTPTestServer::Mode::KeepAlive) == RGY_ERR_NONE);
+    RGYCMAFParam prm;
+    prm.enable = true;
+    prm.playlist = RGY_CMAF_PLAYLIST_HLS;
+    prm.url = strsprintf(_T("http://127.0.0.1:%d/out"), server.port());
+    prm.method = _T("PUT");
+    RGYOutputSegmenter segmenter(test_log());
+    RGY_TEST_EXPECT(segmenter.init(_T("live.mp4"), prm) == RGY_ERR_NONE);
+    RGY_TEST_EXPECT(segmenter.write("init", 4) == 4);
+    RGY_TEST_EXPECT(segmenter.finishInit() == RGY_ERR_NONE);
+    const int segments = 3;
+    for (int i = 0; i < segments; i++) {
+        RGY_TEST_EXPECT(segmenter.startSegment((int64_t)i * 2 * RGYOutputSegmenter::TIMESCALE) == RGY_ERR_NONE);
+        const auto data = strsprintf("segment%d", i);
+        RGY_TEST_EXPECT(segmenter.write(data.data(), data.length()) == (int64_t)data.length());
+        RGY_TEST_EXPECT(segmenter.flushChunk() == RGY_ERR_NONE);
+        RGY_TEST_EXPECT(segmenter.finishSegment((int64_t)(i + 1) * 2 * RGYOutputSegmenter::TIMESCALE) == RGY_ERR_NONE);
+    }
+    RGY_TEST_EXPECT(segmenter.close() == RGY_ERR_NONE);
+    server.stop();
+    const auto requests = server.requests();
+    RGY_TEST_EXPECT(server.connections() == 1);
+    RGY_TEST_EXPECT(requests.size() > 0 && requests[0].target == "/out/live_init.mp4" && requests[0].body == "init");
+    int segmentsReceived = 0;
+    bool playlistReceived = false;
+    for (const auto& req : requests) {
+        if (req.target == strsprintf("/out/live_%05d.m4s", segmentsReceived)) {
+            RGY_TEST_EXPECT(req.body == strsprintf("segment%d", segmentsReceived));
+            segmentsReceived++;
+        } else if (req.target == "/out/live.m3u8") {
+            playlistReceived = true;
+            RGY_TEST_EXPECT(req.body.find("#EXTM3U") == 0);
+        }
+    }
+    RGY_TEST_EXPECT(segmentsReceived == segments);
+    RGY_TEST_EXPECT(playlistReceived);
+    return RGY_TEST_PASS;
+}
+
+//mp4のbox (size, type) を順に列挙する
+struct MP4TestBox {
+    std::string type;
+    const uint8_t *data; //ヘッダーを除いた中身
+    size_t size;
+};
+
+static uint32_t mp4_test_rb32(const uint8_t *ptr) {
+    return ((uint32_t)ptr[0] << 24) | ((uint32_t)ptr[1] << 16) | ((uint32_t)ptr[2] << 8) | (uint32_t)ptr[3];
+}
+
+static uint64_t mp4_test_rb64(const uint8_t *ptr) {
+    return ((uint64_t)mp4_test_rb32(ptr) << 32) | mp4_test_rb32(ptr + 4);
+}
+
+static bool mp4_test_boxes(const uint8_t *ptr, size_t size, std::vector<MP4TestBox>& boxes) {
+    boxes.clear();
+    while (size > 0) {
+        if (size < 8) {
+            return false;
+        }
+        const size_t boxSize = mp4_test_rb32(ptr);
+        if (boxSize < 8 || boxSize > size) {
+            return false;
+        }
+        boxes.push_back({ std::string((const char *)ptr + 4, 4), ptr + 8, boxSize - 8 });
+        ptr += boxSize;
+        size -= boxSize;
+    }
+    return true;
+}
+
+//moofのtrafごとの情報
+struct MP4TestFragment {
+    uint32_t trackId;
+    uint64_t baseDecodeTime;
+    uint32_t sampleCount;
+};
+
+//セグメント (moof+mdat の繰り返し) から、トラックごとのfragmentの情報を取り出す
+static bool mp4_test_parse_segment(const std::vector<uint8_t>& segment, std::vector<MP4TestFragment>& fragments) {
+    std::vector<MP4TestBox> top, moof, traf;
+    if (!mp4_test_boxes(segment.data(), segment.size(), top)) {
+        return false;
+    }
+    for (const auto& box : top) {
+        if (box.type != "moof") {
+            continue;
+        }
+        if (!mp4_test_boxes(box.data, box.size, moof)) {
+            return false;
+        }
+        for (const auto& trafBox : moof) {
+            if (trafBox.type != "traf" || !mp4_test_boxes(trafBox.data, trafBox.size, traf)) {
+                continue;
+            }
+            MP4TestFragment fragment = { 0, 0, 0 };
+            for (const auto& child : traf) {
+                if (child.type == "tfhd" && child.size >= 8) {
+                    fragment.trackId = mp4_test_rb32(child.data + 4);
+                } else if (child.type == "tfdt" && child.size >= 8) {
+                    fragment.baseDecodeTime = (child.data[0] == 1 && child.size >= 12) ? mp4_test_rb64(child.data + 4) : mp4_test_rb32(child.data + 4);
+                } else if (child.type == "trun" && child.size >= 8) {
+                    fragment.sampleCount += mp4_test_rb32(child.data + 4);
+                }
+            }
+            fragments.push_back(fragment);
+        }
+    }
+    return true;
+}
+
+static bool test_read_file(const tstring& filename, std::vector<uint8_t>& data) {
+    FILE *fp = _tfopen(filename.c_str(), _T("rb"));
+    if (fp == nullptr) {
+        return false;
+    }
+    data.clear();
+    uint8_t buf[4096];
+    size_t read = 0;
+    while ((read = fread(buf, 1, sizeof(buf), fp)) > 0) {
+        data.insert(data.end(), buf, buf + read);
+    }
+    fclose(fp);
+    return true;
+}
+
+#if ENABLE_AVSW_READER
+static int cmaf_av_test_write(void *opaque, uint8_t *buf, int buf_size) {
+    auto segmenter = (RGYOutputSegmenter *)opaque;
+    return (int)segmenter->write(buf, buf_size);
+}
+
+static bool cmaf_av_test_packet(AVFormatContext *ctx, int streamIndex, int64_t ts, int64_t duration, bool key, int size) {
+    AVPacket pkt;
+    av_init_packet(&pkt);
+    if (av_new_packet(&pkt, size) < 0) {
+        return false;
+    }
+    memset(pkt.data, 0x80 | streamIndex, size);
+    pkt.stream_index = streamIndex;
+    pkt.pts = ts;
+    pkt.dts = ts;
+    pkt.duration = duration;
+    pkt.flags = (key) ? AV_PKT_FLAG_KEY : 0;
+    //RGYOutputAvcodec::MuxWritePacketと同じく、interleaveせずに渡す
+    const int ret = av_write_frame(ctx, &pkt);
+    av_packet_unref(&pkt);
+    return ret >= 0;
+}
+#endif //#if ENABLE_AVSW_READER
+
+//--cmafで映像と音声をmp4 muxerに渡し、IDRごとにfragmentを区切ったとき、
+//各セグメントにその区間の映像と音声がそろって入り、前後のセグメントにはみ出さないこと
+RGY_TEST(cmaf_av_segment) {
+#if ENABLE_AVSW_READER
+    const tstring filename = strsprintf(_T("/tmp/rgy_cmaf_av_%d.mp4"), (int)getpid());
+    const tstring base = filename.substr(0, filename.length() - 4);
+    const int frames = 90, gop = 30;
+    const int audioRate = 48000, audioFrame = 1024;
+    const AVRational videoTimebase = { 1, 90000 };
+    const int64_t frameDuration = 3000; //30fps
+
+    RGYCMAFParam prm;
+    prm.enable = true;
+    prm.playlist = RGY_CMAF_PLAYLIST_HLS;
+    RGYOutputSegmenter segmenter(test_log());
+    RGY_TEST_EXPECT(segmenter.init(filename, prm) == RGY_ERR_NONE);
+
+    AVFormatContext *ctx = nullptr;
+    RGY_TEST_EXPECT(avformat_alloc_output_context2(&ctx, nullptr, "mp4", nullptr) >= 0 && ctx);
+    std::unique_ptr<AVFormatContext, decltype(&avformat_free_context)> ctxDeleter(ctx, avformat_free_context);
+    const int ioBufferSize = 16 * 1024;
+    auto ioBuffer = (uint8_t *)av_malloc(ioBufferSize);
+    ctx->pb = avio_alloc_context(ioBuffer, ioBufferSize, 1, &segmenter, nullptr, cmaf_av_test_write, nullptr);
+    RGY_TEST_EXPECT(ctx->pb);
+
+    //映像 (avcC形式のextradata) と音声 (AAC-LC 48kHz stereo)
+    static const uint8_t avcC[] = { 0x01, 0x64, 0x00, 0x1f, 0xff, 0xe0, 0x00 };
+    static const uint8_t asc[] = { 0x11, 0x90 };
+    AVStream *video = avformat_new_stream(ctx, nullptr);
+    AVStream *audio = avformat_new_stream(ctx, nullptr);
+    RGY_TEST_EXPECT(video && audio);
+    video->time_base = videoTimebase;
+    video->codecpar->codec_type = AVMEDIA_TYPE_VIDEO;
+    video->codecpar->codec_id = AV_CODEC_ID_H264;
+    video->codecpar->width = 320;
+    video->codecpar->height = 240;
+    audio->time_base = av_make_q(1, audioRate);
+    audio->codecpar->codec_type = AVMEDIA_TYPE_AUDIO;
+    audio->codecpar->codec_id = AV_CODEC_ID_AAC;
+    audio->codecpar->sample_rate = audioRate;
+    audio->codecpar->channels = 2;
+    audio->codecpar->channel_layout = AV_CH_LAYOUT_STEREO;
+    audio->codecpar->frame_size = audioFrame;
+    for (auto& ext : { std::make_pair(video, std::vector<uint8_t>(avcC, avcC + sizeof(avcC))), std::make_pair(audio, std::vector<uint8_t>(asc, asc + sizeof(asc))) }) {
+        ext.first->codecpar->extradata = (uint8_t *)av_mallocz(ext.second.size() + AV_INPUT_BUFFER_PADDING_SIZE);
+        memcpy(ext.first->codecpar->extradata, ext.second.data(), ext.second.size());
+        ext.first->codecpar->extradata_size = (int)ext.second.size();
+    }
+    AVDictionary *opt = nullptr;
+    av_dict_set(&opt, "movflags", "frag_custom+empty_moov+default_base_moof", 0);
+    const int headerRet = avformat_write_header(ctx, &opt);
+    av_dict_free(&opt);
+    RGY_TEST_EXPECT(headerRet >= 0);
+    avio_flush(ctx->pb);
+    RGY_TEST_EXPECT(segmenter.finishInit() == RGY_ERR_NONE);
+    const AVRational videoTb = video->time_base, audioTb = audio->time_base;
+
+    //RGYOutputAvcodecと同じく、各パケットはdts順に渡し、IDRの前でfragmentを書き出してセグメントを区切る
+    auto flush = [&]() {
+        const int ret = av_write_frame(ctx, nullptr);
+        avio_flush(ctx->pb);
+        return ret >= 0;
+    };
+    const auto segmentTimebase = av_make_q(1, RGYOutputSegmenter::TIMESCALE);
+    int64_t audioIndex = 0;
+    bool ret = true;
+    for (int i = 0; i < frames && ret; i++) {
+        const int64_t pts = av_rescale_q(i * frameDuration, videoTimebase, videoTb);
+        const int64_t duration = av_rescale_q(frameDuration, videoTimebase, videoTb);
+        //この映像フレームより前の音声を先に渡す
+        for (; ret && av_compare_ts(audioIndex * audioFrame, audioTb, pts, videoTb) < 0; audioIndex++) {
+            ret = cmaf_av_test_packet(ctx, audio->index, av_rescale_q(audioIndex * audioFrame, av_make_q(1, audioRate), audioTb),
+                av_rescale_q(audioFrame, av_make_q(1, audioRate), audioTb), true, 64);
+        }
+        const bool idr = (i % gop) == 0;
+        if (idr) {
+            const int64_t start = av_rescale_q(pts, videoTb, segmentTimebase);
+            if (segmenter.segmentOpened()) {
+                ret = ret && flush() && segmenter.finishSegment(start) == RGY_ERR_NONE;
+            }
+            ret = ret && segmenter.startSegment(start) == RGY_ERR_NONE;
+        }
+        ret = ret && cmaf_av_test_packet(ctx, video->index, pts, duration, idr, 256 + i);
+    }
+    const int64_t end = av_rescale_q(frames * frameDuration, videoTimebase, segmentTimebase);
+    ret = ret && flush() && segmenter.finishSegment(end) == RGY_ERR_NONE;
+    ret = ret && segmenter.close() == RGY_ERR_NONE;
+    av_write_trailer(ctx);
+    av_freep(&ctx->pb->buffer);
+    avio_context_free(&ctx->pb);
+    RGY_TEST_EXPECT(ret);
+
+    //各セグメントの先頭の映像は前のセグメントの続きから始まり、gopフレームずつ入っている
+    //音声はそのセグメントの区間のもののみ入っている
+    const int segments = frames / gop;
+    int error = 0;
+    int64_t audioSamples = 0;
+    for (int iseg = 0; iseg < segments; iseg++) {
+        const tstring segmentName = strsprintf(_T("%s_%05d.m4s"), base.c_str(), iseg);
+        std::vector<uint8_t> data;
+        std::vector<MP4TestFragment> fragments;
+        if (!test_read_file(segmentName, data) || !mp4_test_parse_segment(data, fragments)) {
+            fprintf(stderr, "cmaf_av_segment: failed to read %s\n", tchar_to_string(segmentName).c_str());
+            error++;
+            continue;
+        }
+        int segmentError = 0;
+        uint32_t videoCount = 0, audioCount = 0;
+        for (const auto& fragment : fragments) {
+            if (fragment.trackId == 1) { //映像
+                segmentError += (fragment.baseDecodeTime != (uint64_t)av_rescale_q((int64_t)iseg * gop * frameDuration, videoTimebase, videoTb)) ? 1 : 0;
+                videoCount += fragment.sampleCount;
+            } else {
+                //セグメント開始時刻以降の最初の音声フレームから始まる
+                const int64_t segmentStart = av_rescale_q((int64_t)iseg * gop * frameDuration, videoTimebase, audioTb);
+                const int64_t firstAudio = (segmentStart + audioFrame - 1) / audioFrame * audioFrame;
+                segmentError += (fragment.baseDecodeTime != (uint64_t)firstAudio) ? 1 : 0;
+                audioCount += fragment.sampleCount;
+            }
+        }
+        segmentError += (videoCount != (uint32_t)gop) ? 1 : 0;
+        segmentError += (audioCount == 0) ? 1 : 0;
+        audioSamples += audioCount;
+        if (segmentError) {
+            fprintf(stderr, "cmaf_av_segment: segment %d: video %u, audio %u samples\n", iseg, videoCount, audioCount);
+            error += segmentError;
+        }
+        _tremove(segmentName.c_str());
+    }
+    error += (audioSamples != audioIndex) ? 1 : 0;
+    _tremove((base + _T("_init.mp4")).c_str());
+    _tremove((base + _T(".m3u8")).c_str());
+    RGY_TEST_EXPECT(error == 0);
+    return RGY_TEST_PASS;
+#else
+    return RGY_TEST_SKIP;
+#endif //#if ENABLE_AVSW_READER
+}
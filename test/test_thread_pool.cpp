@@ -0,0 +1,112 @@
+﻿// -----------------------------------------------------------------------------------------
+// QSVEnc/NVEnc/VCEEnc by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2020 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+#include <cstdio>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include "rgy_thread_pool.h"
+#include "rgy_test.h"
+
+//run()が各タスクをちょうど1回ずつ実行し、同時に実行するスレッド数がmax_threadsを超えないか
+static bool check_thread_pool_run(RGYThreadPool& pool, int task_n, int max_threads, int task_us) {
+    std::vector<std::atomic<int>> executed(task_n);
+    for (auto& e : executed) {
+        e = 0;
+    }
+    std::atomic<int> running(0), runningMax(0), wrongTaskN(0);
+    pool.run(task_n, max_threads, [&](int task_id, int n) {
+        const int cur = ++running;
+        for (int prev = runningMax; prev < cur && !runningMax.compare_exchange_weak(prev, cur); ) {
+        }
+        if (n != task_n || task_id < 0 || task_id >= task_n) {
+            wrongTaskN++;
+        } else {
+            executed[task_id]++;
+        }
+        if (task_us > 0) {
+            std::this_thread::sleep_for(std::chrono::microseconds(task_us));
+        }
+        running--;
+    });
+    const bool once = std::all_of(executed.begin(), executed.end(), [](const std::atomic<int>& e) { return e == 1; });
+    if (!once || wrongTaskN > 0 || runningMax > (std::max)(1, max_threads)) {
+        fprintf(stderr, "thread pool: task_n %d, max_threads %d, workers %d: once %d, wrong %d, running max %d\n",
+            task_n, max_threads, pool.workers(), once ? 1 : 0, wrongTaskN.load(), runningMax.load());
+        return false;
+    }
+    return true;
+}
+
+RGY_TEST(thread_pool) {
+    int mismatch = 0;
+    {
+        //ワーカーがなければ、呼び出し元のスレッドですべて処理する
+        RGYThreadPool pool;
+        mismatch += (pool.workers() != 0) ? 1 : 0;
+        mismatch += check_thread_pool_run(pool, 5, 4, 0) ? 0 : 1;
+        mismatch += check_thread_pool_run(pool, 0, 4, 0) ? 0 : 1;
+    }
+    {
+        RGYThreadPool pool;
+        pool.reserve(4);
+        mismatch += (pool.workers() != 3) ? 1 : 0;
+        pool.reserve(2); //減らすことはない
+        mismatch += (pool.workers() != 3) ? 1 : 0;
+        for (int task_n : { 1, 2, 3, 7, 64, 1000 }) {
+            for (int max_threads : { 1, 2, 4, 8 }) {
+                mismatch += check_thread_pool_run(pool, task_n, max_threads, (task_n <= 64) ? 200 : 0) ? 0 : 1;
+            }
+        }
+        //複数のスレッドから同時にrun()しても、それぞれの処理が完了すること
+        std::atomic<int> callerMismatch(0);
+        std::vector<std::thread> callers;
+        for (int i = 0; i < 4; i++) {
+            callers.push_back(std::thread([&, i]() {
+                for (int j = 0; j < 50; j++) {
+                    if (!check_thread_pool_run(pool, 3 + (i + j) % 20, 1 + (i + j) % 4, (j % 5 == 0) ? 100 : 0)) {
+                        callerMismatch++;
+                    }
+                }
+            }));
+        }
+        for (auto& th : callers) {
+            th.join();
+        }
+        mismatch += callerMismatch;
+        //終了後も再びreserveして使用できること
+        pool.close();
+        mismatch += (pool.workers() != 0) ? 1 : 0;
+        mismatch += check_thread_pool_run(pool, 16, 4, 0) ? 0 : 1;
+        pool.reserve(3);
+        mismatch += (pool.workers() != 2) ? 1 : 0;
+        mismatch += check_thread_pool_run(pool, 16, 3, 100) ? 0 : 1;
+    }
+    return (mismatch) ? RGY_TEST_FAIL : RGY_TEST_PASS;
+}
@@ -0,0 +1,268 @@
+﻿// -----------------------------------------------------------------------------------------
+// QSVEnc/NVEnc/VCEEnc by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2020 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+#include <algorithm>
+#include <vector>
+#include <random>
+#include <thread>
+#include <chrono>
+#include <unordered_map>
+#include "rgy_util.h"
+#include "rgy_timestamp.h"
+#include "rgy_test.h"
+
+//比較用の従来の実装
+class RGYTimestampMapRef {
+private:
+    std::unordered_map<int64_t, int64_t> m_duration;
+    std::mutex mtx;
+    int64_t last_check_pts;
+    int64_t offset;
+public:
+    RGYTimestampMapRef() : m_duration(), mtx(), last_check_pts(-1), offset(0) {};
+    void add(int64_t pts, int64_t duration) {
+        std::lock_guard<std::mutex> lock(mtx);
+        m_duration[pts] = duration;
+    }
+    int64_t check(int64_t pts) {
+        if (last_check_pts < 0 && pts > 0) {
+            offset = -pts;
+        }
+        std::lock_guard<std::mutex> lock(mtx);
+        pts += offset;
+        auto pos = m_duration.find(pts);
+        if (pos == m_duration.end()) {
+            auto last_check_pos = m_duration.find(last_check_pts);
+            pts = last_check_pos->first + last_check_pos->second / 2;
+            auto next_pts = last_check_pos->first + last_check_pos->second;
+            last_check_pos->second = pts - last_check_pos->first;
+            m_duration[pts] = next_pts - pts;
+        }
+        last_check_pts = pts;
+        return pts;
+    }
+    int64_t get_and_pop(int64_t pts) {
+        std::lock_guard<std::mutex> lock(mtx);
+        auto pos = m_duration.find(pts);
+        if (pos == m_duration.end()) {
+            return -1;
+        }
+        auto duration = pos->second;
+        m_duration.erase(pos);
+        return duration;
+    }
+};
+
+//エンコーダの入出力を模してadd/check/get_and_popを行い、従来の実装と結果を比較する
+//capacityを小さくすると、満杯時のm_overflowへの退避も確認できる
+static int check_timestamp_map_random(size_t capacity, uint32_t seed, int frames, bool nonMonotonic) {
+    std::mt19937 mt(seed);
+    RGYTimestamp ts(capacity);
+    RGYTimestampMapRef ref;
+    int mismatch = 0;
+    auto compare = [&mismatch](int64_t a, int64_t b) {
+        if (a != b) {
+            mismatch++;
+        }
+    };
+    std::vector<int64_t> inflight; //エンコーダに入力済みのpts
+    std::unordered_map<int64_t, int64_t> durations;
+    int64_t pts = 0;
+    bool firstOutput = true; //最初の出力のptsでoffsetが決まるので、pts=0を先に出力する
+    for (int i = 0; i < frames; i++) {
+        const int64_t duration = 2 + (mt() % 3000);
+        int64_t addPts = pts;
+        if (nonMonotonic && (mt() % 16) == 0 && pts > 200000) {
+            //ptsが戻る場合 (既存のptsとは重ならないように奇数にする)
+            addPts = (pts - 100000 - (int64_t)(mt() % 50000)) | 1;
+            while (std::find(inflight.begin(), inflight.end(), addPts) != inflight.end()) {
+                addPts += 2;
+            }
+        }
+        ts.add(addPts, duration);
+        ref.add(addPts, duration);
+        durations[addPts] = duration;
+        inflight.push_back(addPts);
+        pts += duration + (duration & 1);
+        //Bフレームによる並べ替えを模して、ある程度たまったらランダムな順に出力する
+        const size_t delay = 1 + (mt() % 6);
+        while (inflight.size() > delay) {
+            const size_t idx = (firstOutput) ? 0 : mt() % (std::min<size_t>)(inflight.size(), 4);
+            firstOutput = false;
+            const int64_t outPts = inflight[idx];
+            inflight.erase(inflight.begin() + idx);
+            compare(ts.check(outPts), ref.check(outPts));
+            const int64_t halfPts = outPts + durations[outPts] / 2;
+            if ((mt() % 4) == 0 && std::find(inflight.begin(), inflight.end(), halfPts) == inflight.end()) {
+                //フィールド単位の出力 (見つからないptsでのcheck) を模す
+                int64_t missPts = outPts + 1 + 2 * (int64_t)(mt() % 3);
+                while (std::find(inflight.begin(), inflight.end(), missPts) != inflight.end()) {
+                    missPts += 2;
+                }
+                const int64_t fieldPts = ts.check(missPts);
+                compare(fieldPts, ref.check(missPts));
+                compare(ts.get_and_pop(fieldPts), ref.get_and_pop(fieldPts));
+            }
+            compare(ts.get_and_pop(outPts), ref.get_and_pop(outPts));
+            const int64_t unknownPts = -((int64_t)1 << 40) - (int64_t)(mt() % 1000);
+            compare(ts.get_and_pop(unknownPts), ref.get_and_pop(unknownPts));
+        }
+    }
+    for (auto outPts : inflight) {
+        compare(ts.get_and_pop(outPts), ref.get_and_pop(outPts));
+    }
+    return mismatch;
+}
+
+//フィールド単位の出力では、後半のフィールドのptsは pts + duration/2 となる
+static int check_timestamp_map_field(size_t capacity) {
+    RGYTimestamp ts(capacity);
+    int mismatch = 0;
+    const int64_t duration = 3003;
+    for (int64_t i = 0; i < 64; i++) {
+        ts.add(i * duration, duration);
+    }
+    for (int64_t i = 0; i < 64; i++) {
+        const int64_t pts = i * duration;
+        mismatch += ts.check(pts) != pts;
+        mismatch += ts.check(pts + 1) != pts + duration / 2;
+        mismatch += ts.get_and_pop(pts) != duration / 2;
+        mismatch += ts.get_and_pop(pts + duration / 2) != duration - duration / 2;
+        mismatch += ts.get_and_pop(pts) != -1;
+    }
+    return mismatch;
+}
+
+//エンコードスレッドでadd、出力スレッドでget_and_popを同時に行う
+static int check_timestamp_map_threaded(int frames, double *opsPerSec) {
+    RGYTimestamp ts;
+    const auto start = std::chrono::high_resolution_clock::now();
+    std::thread producer([&ts, frames]() {
+        for (int i = 0; i < frames; i++) {
+            ts.add((int64_t)i * 1001, 1000 + (i & 15));
+        }
+    });
+    int mismatch = 0;
+    for (int i = 0; i < frames; i++) {
+        int64_t duration = 0;
+        while ((duration = ts.get_and_pop((int64_t)i * 1001)) < 0) {
+            std::this_thread::yield();
+        }
+        mismatch += duration != 1000 + (i & 15);
+    }
+    producer.join();
+    const auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::high_resolution_clock::now() - start).count();
+    *opsPerSec = frames * 1e9 / (std::max<int64_t>)(elapsed, 1);
+    return mismatch;
+}
+
+//in-flightのフレーム数を一定に保ちながら add -> check -> get_and_pop を繰り返す速度 (フレーム/秒)
+template<typename T>
+static double bench_timestamp_map(int frames, int inflight) {
+    T ts;
+    const auto start = std::chrono::high_resolution_clock::now();
+    int64_t sum = 0;
+    for (int i = 0; i < frames + inflight; i++) {
+        if (i < frames) {
+            ts.add((int64_t)i * 1001, 1001);
+        }
+        if (i >= inflight) {
+            const int64_t pts = (int64_t)(i - inflight) * 1001;
+            sum += ts.check(pts);
+            sum += ts.get_and_pop(pts);
+        }
+    }
+    const auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::high_resolution_clock::now() - start).count();
+    return (sum == 0) ? 0.0 : frames * 1e9 / (std::max<int64_t>)(elapsed, 1);
+}
+
+//取り出されないエントリ (エンコーダが出力しなかったフレーム) があっても、
+//リングバッファが一周した後にadd()がm_overflowに回り続けないことを確認する
+class RGYTimestampTest : public RGYTimestamp {
+public:
+    RGYTimestampTest(size_t capacity) : RGYTimestamp(capacity) {};
+    size_t ring_used() const { return m_tail.load() - m_head.load(); }
+    size_t overflow_size() const { return m_overflowCount.load(); }
+};
+
+static int check_timestamp_map_stale(size_t capacity, int frames, int dropInterval) {
+    RGYTimestampTest ts(capacity);
+    int mismatch = 0;
+    size_t maxOverflow = 0;
+    const int64_t duration = 1001;
+    for (int i = 0; i < frames; i++) {
+        const int64_t pts = (int64_t)i * duration;
+        ts.add(pts, duration + (i & 7));
+        //dropInterval毎に1フレームは取り出さない
+        if (i % dropInterval != 0) {
+            mismatch += ts.get_and_pop(pts) != duration + (i & 7);
+        }
+        maxOverflow = (std::max)(maxOverflow, ts.overflow_size());
+    }
+    //取り出されないエントリはリングバッファに残り続けず、m_overflowも上限を超えない
+    mismatch += ts.ring_used() >= capacity;
+    mismatch += maxOverflow > (std::max)(capacity, (size_t)RGYTimestamp::OVERFLOW_KEEP_MIN);
+    //上限に達するまでは、移したエントリも取り出せる
+    if (frames / dropInterval < (int)RGYTimestamp::OVERFLOW_KEEP_MIN) {
+        for (int i = 0; i < frames; i += dropInterval) {
+            mismatch += ts.get_and_pop((int64_t)i * duration) != duration + (i & 7);
+        }
+        mismatch += ts.overflow_size() != 0;
+    }
+    return mismatch;
+}
+
+//RGYTimestampを従来のハッシュテーブルによる実装と比較する
+RGY_TEST(timestamp_map) {
+    double threadedOps = 0.0;
+    RGY_TEST_EXPECT(check_timestamp_map_random(RGYTimestamp::DEFAULT_CAPACITY, 1234, 100000, false) == 0);
+    RGY_TEST_EXPECT(check_timestamp_map_random(4, 5678, 100000, false) == 0);
+    RGY_TEST_EXPECT(check_timestamp_map_random(16, 9012, 100000, true) == 0);
+    RGY_TEST_EXPECT(check_timestamp_map_field(RGYTimestamp::DEFAULT_CAPACITY) == 0);
+    RGY_TEST_EXPECT(check_timestamp_map_field(8) == 0);
+    RGY_TEST_EXPECT(check_timestamp_map_threaded(1000000, &threadedOps) == 0);
+    RGY_TEST_EXPECT(check_timestamp_map_stale(16, 2000, 1000) == 0);
+    RGY_TEST_EXPECT(check_timestamp_map_stale(RGYTimestamp::DEFAULT_CAPACITY, 100000, 10) == 0);
+    return RGY_TEST_PASS;
+}
+
+//in-flightのフレーム数を一定に保った場合の処理速度をJSONで出力する
+RGY_TEST(bench_timestamp_map) {
+    const int benchFrames = 2000000;
+    const int benchInflight = 16;
+    double threadedOps = 0.0;
+    check_timestamp_map_threaded(benchFrames, &threadedOps);
+    tstring str = _T("{\n");
+    str += _T("  \"bench\": [\n");
+    str += strsprintf(_T("    { \"impl\": \"unordered_map+mutex\", \"Mframes_per_sec\": %.2f },\n"), bench_timestamp_map<RGYTimestampMapRef>(benchFrames, benchInflight) * 1e-6);
+    str += strsprintf(_T("    { \"impl\": \"ring\", \"Mframes_per_sec\": %.2f },\n"), bench_timestamp_map<RGYTimestamp>(benchFrames, benchInflight) * 1e-6);
+    str += strsprintf(_T("    { \"impl\": \"ring_threaded\", \"Mframes_per_sec\": %.2f }\n"), threadedOps * 1e-6);
+    str += _T("  ]\n");
+    str += _T("}\n");
+    _ftprintf(stdout, _T("%s"), str.c_str());
+    return RGY_TEST_PASS;
+}
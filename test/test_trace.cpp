@@ -0,0 +1,219 @@
+﻿// -----------------------------------------------------------------------------------------
+// QSVEnc/NVEnc/VCEEnc by rigaya
+// -----------------------------------------------------------------------------------------
+// The MIT License
+//
+// Copyright (c) 2020 rigaya
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+//
+// --------------------------------------------------------------------------------------------
+
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include "rgy_util.h"
+#include "rgy_osdep.h"
+#include "rgy_trace.h"
+#include "rgy_test.h"
+
+static tstring trace_test_tmpfile(const TCHAR *name) {
+    return strsprintf(_T("/tmp/%s_%d.json"), name, (int)getpid());
+}
+
+struct TraceTestFile {
+    bool valid;                 //JSONの先頭と末尾が正しいか
+    int threadNames;            //thread_nameの数
+    std::vector<std::vector<int64_t>> frames; //tidごとの区間のフレーム番号
+    uint64_t events;
+    uint64_t dropped;
+};
+
+//1行1レコードで出力しているので、行単位で読み取る
+static TraceTestFile trace_test_read(const tstring& filename) {
+    TraceTestFile result;
+    result.valid = false;
+    result.threadNames = 0;
+    result.events = 0;
+    result.dropped = 0;
+    FILE *fp = nullptr;
+    if (_tfopen_s(&fp, filename.c_str(), _T("r")) || fp == nullptr) {
+        return result;
+    }
+    char line[1024];
+    bool header = false;
+    while (fgets(line, sizeof(line), fp)) {
+        if (strncmp(line, "{\"traceEvents\":[", 16) == 0) {
+            header = true;
+            continue;
+        }
+        unsigned long long events = 0, dropped = 0;
+        if (2 == sscanf(line, "],\"displayTimeUnit\":\"ms\",\"otherData\":{\"events\":%llu,\"dropped\":%llu}}", &events, &dropped)) {
+            result.valid = header;
+            result.events = events;
+            result.dropped = dropped;
+            continue;
+        }
+        if (strstr(line, "\"thread_name\"")) {
+            result.threadNames++;
+            continue;
+        }
+        int tid = 0;
+        long long frame = -1;
+        const char *ptr = strstr(line, "\"tid\":");
+        const char *ptrFrame = strstr(line, "\"frame\":");
+        if (strstr(line, "\"ph\":\"X\"") && ptr && 1 == sscanf(ptr, "\"tid\":%d", &tid) && tid > 0
+            && ptrFrame && 1 == sscanf(ptrFrame, "\"frame\":%lld", &frame)) {
+            if ((int)result.frames.size() < tid) {
+                result.frames.resize(tid);
+            }
+            result.frames[tid - 1].push_back(frame);
+        }
+    }
+    fclose(fp);
+    return result;
+}
+
+//threads個のスレッドからそれぞれeventsPerThread個の区間を記録する
+static void trace_test_record(int threads, int eventsPerThread) {
+    //終了したスレッドのリングバッファが再利用されないよう、すべてのスレッドがそろってから開始する
+    std::atomic<int> ready(0);
+    std::vector<std::thread> th;
+    for (int ith = 0; ith < threads; ith++) {
+        th.push_back(std::thread([eventsPerThread, threads, &ready]() {
+            RGY_TRACE_THREAD_NAME("test");
+            ready++;
+            while (ready < threads) {
+                std::this_thread::yield();
+            }
+            for (int i = 0; i < eventsPerThread; i++) {
+                RGY_TRACE_SCOPE("test", i);
+            }
+        }));
+    }
+    for (auto& t : th) {
+        t.join();
+    }
+}
+
+//スレッドごとにフレーム番号が0から順に並んでいるか
+static bool trace_test_frames(const TraceTestFile& file, int threads, int eventsPerThread, bool allowDrop) {
+    if (!file.valid || (int)file.frames.size() != threads || file.threadNames != threads) {
+        fprintf(stderr, "trace file mismatch: valid %d, threads %d, thread names %d\n",
+            file.valid ? 1 : 0, (int)file.frames.size(), file.threadNames);
+        return false;
+    }
+    for (const auto& frames : file.frames) {
+        if (!allowDrop && (int)frames.size() != eventsPerThread) {
+            fprintf(stderr, "trace events mismatch: expected %d, got %d\n", eventsPerThread, (int)frames.size());
+            return false;
+        }
+        for (size_t i = 0; i < frames.size(); i++) {
+            //リングバッファが満杯で捨てられる場合も、順序は保たれる
+            if ((!allowDrop && frames[i] != (int64_t)i) || (i > 0 && frames[i] <= frames[i - 1])) {
+                fprintf(stderr, "trace order mismatch at %d: frame %lld\n", (int)i, (long long)frames[i]);
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+//複数スレッドから記録したすべての区間が、正しいスレッド・フレーム・順序で出力されるか
+RGY_TEST(trace_record) {
+    const tstring filename = trace_test_tmpfile(_T("rgy_trace_record"));
+    const int threads = 4;
+    const int eventsPerThread = 20000;
+    RGY_TEST_EXPECT(RGYTrace::get()->open(filename) == RGY_ERR_NONE);
+    trace_test_record(threads, eventsPerThread);
+    RGYTrace::get()->close();
+    const auto file = trace_test_read(filename);
+    _tremove(filename.c_str());
+    RGY_TEST_EXPECT(trace_test_frames(file, threads, eventsPerThread, false));
+    RGY_TEST_EXPECT(file.events == (uint64_t)(threads * eventsPerThread) && file.dropped == 0);
+    return RGY_TEST_PASS;
+}
+
+//リングバッファが満杯になった場合に捨てた数が正しく、順序が保たれるか
+RGY_TEST(trace_drop) {
+    const tstring filename = trace_test_tmpfile(_T("rgy_trace_drop"));
+    const int threads = 4;
+    const int eventsPerThread = 20000;
+    RGY_TEST_EXPECT(RGYTrace::get()->open(filename, 64) == RGY_ERR_NONE);
+    trace_test_record(threads, eventsPerThread);
+    RGYTrace::get()->close();
+    const auto file = trace_test_read(filename);
+    _tremove(filename.c_str());
+    RGY_TEST_EXPECT(trace_test_frames(file, threads, eventsPerThread, true));
+    RGY_TEST_EXPECT(file.events + file.dropped == (uint64_t)(threads * eventsPerThread));
+    RGY_TEST_EXPECT(file.dropped > 0);
+    return RGY_TEST_PASS;
+}
+
+//同じファイルでのopenは参照カウントを増やし (--ladder)、別のファイルではエラーとなる
+//すべてcloseしたあとは記録されない
+RGY_TEST(trace_refcount) {
+    const tstring filename = trace_test_tmpfile(_T("rgy_trace_refcount"));
+    auto trace = RGYTrace::get();
+    RGY_TEST_EXPECT(trace->open(filename) == RGY_ERR_NONE);
+    RGY_TEST_EXPECT(trace->open(filename) == RGY_ERR_NONE);
+    RGY_TEST_EXPECT(trace->open(filename + _T(".other")) != RGY_ERR_NONE);
+    trace->close();
+    RGY_TEST_EXPECT(RGYTrace::enabled());
+    trace->close();
+    RGY_TEST_EXPECT(!RGYTrace::enabled());
+    trace_test_record(1, 100);
+    RGY_TEST_EXPECT(trace->stats().events == 0);
+    _tremove(filename.c_str());
+    return RGY_TEST_PASS;
+}
+
+static double bench_trace_scope(int loops) {
+    const auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < loops; i++) {
+        RGY_TRACE_SCOPE("bench", i);
+    }
+    return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / loops;
+}
+
+//無効時・有効時の区間1つあたりのコストをJSONで出力する
+RGY_TEST(bench_trace) {
+    const tstring filename = trace_test_tmpfile(_T("rgy_trace_bench"));
+    const int loops = 200000;
+    const double nsDisabled = bench_trace_scope(loops);
+    double nsEnabled = 0.0;
+    if (RGYTrace::get()->open(filename, loops) == RGY_ERR_NONE) {
+        nsEnabled = bench_trace_scope(loops);
+        RGYTrace::get()->close();
+    }
+    _tremove(filename.c_str());
+    tstring str = _T("{\n");
+    str += _T("  \"ns_per_scope\": [\n");
+    str += strsprintf(_T("    { \"impl\": \"disabled\", \"ns_per_scope\": %.1f },\n"), nsDisabled);
+    str += strsprintf(_T("    { \"impl\": \"enabled\", \"ns_per_scope\": %.1f }\n"), nsEnabled);
+    str += _T("  ]\n");
+    str += _T("}\n");
+    _ftprintf(stdout, _T("%s"), str.c_str());
+    return RGY_TEST_PASS;
+}